@@ -0,0 +1,485 @@
+#include "cli_ops_core.h"
+#include "cli_shared.h"
+#include "codec.h"
+#include "layer.h"
+#include "parallel.h"
+#include "transform.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace {
+struct BenchSettings {
+    std::string filter;
+    std::string jsonPath;
+    std::string baselinePath;
+    double thresholdPercent = 10.0;
+    double minSeconds = 0.2;
+    int threads = 0;
+    bool listOnly = false;
+};
+
+struct BenchResult {
+    std::string name;
+    // Pixels (or bytes) one iteration processes, for per-item rates.
+    std::size_t items = 0;
+    std::size_t iterations = 0;
+    double medianNs = 0.0;
+    double minNs = 0.0;
+};
+
+// Times each benchmark whose name contains the filter: one untimed warm-up,
+// then iterations until minSeconds have run (at least three). setup runs
+// before every iteration outside the timed part.
+class BenchRunner {
+public:
+    explicit BenchRunner(const BenchSettings& settings) : m_settings(settings) {}
+
+    void run(const std::string& name, std::size_t items, const std::function<void()>& setup, const std::function<void()>& body) {
+        if (name.find(m_settings.filter) == std::string::npos) {
+            return;
+        }
+        if (m_settings.listOnly) {
+            std::cout << name << "\n";
+            return;
+        }
+        setup();
+        body();
+        std::vector<double> samples;
+        double total = 0.0;
+        while ((samples.size() < 3 || total < m_settings.minSeconds * 1e9) && samples.size() < 100000) {
+            setup();
+            const auto start = std::chrono::steady_clock::now();
+            body();
+            const auto stop = std::chrono::steady_clock::now();
+            const double ns = std::chrono::duration<double, std::nano>(stop - start).count();
+            samples.push_back(ns);
+            total += ns;
+        }
+        std::sort(samples.begin(), samples.end());
+        BenchResult result;
+        result.name = name;
+        result.items = items;
+        result.iterations = samples.size();
+        result.medianNs = samples[samples.size() / 2];
+        result.minNs = samples.front();
+        m_results.push_back(result);
+        std::cout << std::left << std::setw(44) << name << std::right << std::setw(14) << std::fixed << std::setprecision(1)
+                  << result.medianNs / 1e3 << " us" << std::setw(10) << std::setprecision(2)
+                  << result.medianNs / static_cast<double>(std::max<std::size_t>(1, items)) << " ns/item" << std::setw(8)
+                  << result.iterations << "x\n";
+    }
+
+    void run(const std::string& name, std::size_t items, const std::function<void()>& body) {
+        run(name, items, [] {}, body);
+    }
+
+    const std::vector<BenchResult>& results() const {
+        return m_results;
+    }
+
+private:
+    const BenchSettings& m_settings;
+    std::vector<BenchResult> m_results;
+};
+
+std::uint32_t hashPixel(int x, int y, std::uint32_t seed) {
+    std::uint32_t n = static_cast<std::uint32_t>(x) * 374761393u + static_cast<std::uint32_t>(y) * 668265263u + seed * 2246822519u;
+    n = (n ^ (n >> 13)) * 1274126177u;
+    return n ^ (n >> 16);
+}
+
+// Smooth gradients with hashed grain and varying alpha, stored pixel by
+// pixel so no solid or generated fast path applies.
+ImageBuffer patternImage(int width, int height, std::uint32_t seed, bool opaque) {
+    ImageBuffer image(width, height);
+    for (int y = 0; y < height; ++y) {
+        PixelRGBA8* row = image.row(y);
+        for (int x = 0; x < width; ++x) {
+            const std::uint32_t grain = hashPixel(x, y, seed);
+            row[x] = PixelRGBA8(static_cast<std::uint8_t>((x * 255) / std::max(1, width - 1) ^ (grain & 15u)),
+                                static_cast<std::uint8_t>((y * 255) / std::max(1, height - 1) ^ ((grain >> 4) & 15u)),
+                                static_cast<std::uint8_t>(((x + y) * 2 + seed * 40u) & 255u),
+                                opaque ? 255 : static_cast<std::uint8_t>(96 + ((grain >> 8) & 127u)));
+        }
+    }
+    return image;
+}
+
+Layer patternLayer(const std::string& name, int width, int height, std::uint32_t seed, bool opaque) {
+    Layer layer(name, width, height);
+    layer.image() = patternImage(width, height, seed, opaque);
+    return layer;
+}
+
+const std::vector<BlendMode>& allBlendModes() {
+    static const std::vector<BlendMode> modes = {BlendMode::Normal,  BlendMode::Multiply, BlendMode::Screen,
+                                                 BlendMode::Overlay, BlendMode::Darken,   BlendMode::Lighten,
+                                                 BlendMode::Add,     BlendMode::Subtract, BlendMode::Difference,
+                                                 BlendMode::ColorDodge};
+    return modes;
+}
+
+const char* blendName(BlendMode mode) {
+    switch (mode) {
+        case BlendMode::Normal:
+            return "normal";
+        case BlendMode::Multiply:
+            return "multiply";
+        case BlendMode::Screen:
+            return "screen";
+        case BlendMode::Overlay:
+            return "overlay";
+        case BlendMode::Darken:
+            return "darken";
+        case BlendMode::Lighten:
+            return "lighten";
+        case BlendMode::Add:
+            return "add";
+        case BlendMode::Subtract:
+            return "subtract";
+        case BlendMode::Difference:
+            return "difference";
+        case BlendMode::ColorDodge:
+            return "color-dodge";
+    }
+    return "unknown";
+}
+
+// One translucent layer in mode over an opaque one, so the per-pixel blend
+// dominates the composite.
+void benchBlendModes(BenchRunner& runner, const CompositeOptions& options) {
+    const int size = 512;
+    for (BlendMode mode : allBlendModes()) {
+        Document document(size, size);
+        document.addLayer(patternLayer("base", size, size, 1, true));
+        document.addLayer(patternLayer("top", size, size, 2, false)).setBlendMode(mode);
+        ImageBuffer out;
+        runner.run(std::string("blend/") + blendName(mode) + "/512", static_cast<std::size_t>(size) * size,
+                   [&] { out = document.composite(options); });
+    }
+}
+
+// Stacks of layerCount offset layers, split over groupCount groups (0 keeps
+// them at the root), with no transform, a translation or a rotation.
+Document stackDocument(int layerCount, int groupCount, const std::string& transform) {
+    const int width = 640;
+    const int height = 480;
+    Document document(width, height);
+    document.addLayer(patternLayer("base", width, height, 0, true));
+    std::vector<LayerGroup*> groups;
+    for (int g = 0; g < groupCount; ++g) {
+        groups.push_back(&document.addGroup(LayerGroup("group" + std::to_string(g))));
+        groups.back()->setOpacity(0.9f);
+    }
+    for (int i = 0; i < layerCount; ++i) {
+        Layer layer = patternLayer("layer" + std::to_string(i), width / 2, height / 2, static_cast<std::uint32_t>(i + 1), false);
+        layer.setOffset((i * 37) % (width / 2), (i * 53) % (height / 2));
+        layer.setBlendMode(allBlendModes()[static_cast<std::size_t>(i) % allBlendModes().size()]);
+        if (transform == "translate") {
+            layer.transform() = Transform2D::translation(11.5, 7.25);
+        } else if (transform == "rotate") {
+            layer.transform() = Transform2D::rotationRadians(0.3, width / 4.0, height / 4.0);
+        }
+        if (groups.empty()) {
+            document.addLayer(std::move(layer));
+        } else {
+            groups[static_cast<std::size_t>(i) % groups.size()]->addLayer(std::move(layer));
+        }
+    }
+    return document;
+}
+
+void benchComposite(BenchRunner& runner, const CompositeOptions& options) {
+    for (int layers : {4, 16}) {
+        for (int groups : {0, 4}) {
+            for (const char* transform : {"none", "translate", "rotate"}) {
+                const Document document = stackDocument(layers, groups, transform);
+                ImageBuffer out;
+                std::ostringstream name;
+                name << "composite/layers" << layers << "/groups" << groups << "/" << transform;
+                runner.run(name.str(), static_cast<std::size_t>(document.width()) * document.height(),
+                           [&] { out = document.composite(options); });
+            }
+        }
+    }
+}
+
+std::vector<std::uint8_t> readBytes(const std::filesystem::path& path) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        throw std::runtime_error("Failed to read " + path.string());
+    }
+    return std::vector<std::uint8_t>(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+// Encodes go through the same writers as render; decodes run from bytes
+// already in memory.
+void benchCodecs(BenchRunner& runner, const std::filesystem::path& scratch) {
+    for (const char* format : {"png", "jpg", "bmp", "gif", "webp"}) {
+        for (int size : {128, 512}) {
+            const ImageBuffer image = patternImage(size, size, 3, true);
+            const std::string path = (scratch / (std::string("codec.") + format)).string();
+            const std::size_t pixels = static_cast<std::size_t>(size) * size;
+            const std::string suffix = "/" + std::to_string(size);
+            runner.run(std::string("codec/") + format + "/encode" + suffix, pixels, [&] {
+                if (!saveCompositeByExtension(image, path)) {
+                    throw std::runtime_error(std::string("Failed to encode ") + format);
+                }
+            });
+            if (!saveCompositeByExtension(image, path)) {
+                throw std::runtime_error(std::string("Failed to encode ") + format);
+            }
+            const std::vector<std::uint8_t> bytes = readBytes(path);
+            ImageBuffer decoded;
+            runner.run(std::string("codec/") + format + "/decode" + suffix, pixels,
+                       [&] { decoded = decodeImage(bytes.data(), bytes.size(), path); });
+        }
+    }
+}
+
+void writeIdentityCube(const std::filesystem::path& path, int size) {
+    std::ofstream out(path);
+    out << "LUT_3D_SIZE " << size << "\n";
+    for (int b = 0; b < size; ++b) {
+        for (int g = 0; g < size; ++g) {
+            for (int r = 0; r < size; ++r) {
+                out << static_cast<double>(r) / (size - 1) << " " << static_cast<double>(g) / (size - 1) << " "
+                    << static_cast<double>(b) / (size - 1) << "\n";
+            }
+        }
+    }
+    if (!out) {
+        throw std::runtime_error("Failed to write " + path.string());
+    }
+}
+
+// Every effects op, with radius-like parameters swept; each iteration runs
+// on a fresh copy of the same layer.
+void benchEffects(BenchRunner& runner, const CompositeOptions& options, const std::filesystem::path& scratch) {
+    const std::string cube = (scratch / "identity.cube").string();
+    writeIdentityCube(cube, 17);
+    const std::vector<std::pair<std::string, std::string>> ops = {
+        {"gaussian-blur/r1", "gaussian-blur radius=1"},
+        {"gaussian-blur/r4", "gaussian-blur radius=4"},
+        {"gaussian-blur/r16", "gaussian-blur radius=16"},
+        {"gaussian-blur/r64", "gaussian-blur radius=64"},
+        {"morphology/dilate-r1", "morphology op=dilate radius=1"},
+        {"morphology/dilate-r4", "morphology op=dilate radius=4"},
+        {"morphology/dilate-r16", "morphology op=dilate radius=16"},
+        {"morphology/erode-square-r4", "morphology op=erode shape=square radius=4"},
+        {"morphology/dilate-line-r8", "morphology op=dilate shape=line angle=45 radius=8"},
+        {"edge-detect/sobel", "edge-detect method=sobel"},
+        {"edge-detect/canny", "edge-detect method=canny"},
+        {"apply-effect/grayscale", "apply-effect effect=grayscale"},
+        {"apply-effect/sepia", "apply-effect effect=sepia"},
+        {"gamma", "gamma value=1.3"},
+        {"levels", "levels in_black=12 in_white=240 gamma=1.2"},
+        {"curves", "curves rgb=0,0;128,150;255,255"},
+        {"replace-color", "replace-color from=120,120,120 to=35,95,220 tolerance=90 softness=55"},
+        {"channel-mix", "channel-mix rr=0.9 rg=0.2 gb=0.1 gg=0.85 bb=1.1"},
+        {"apply-lut", "apply-lut file=\"" + cube + "\""},
+        {"fractal-noise/o1", "fractal-noise octaves=1"},
+        {"fractal-noise/o5", "fractal-noise octaves=5"},
+        {"hatch/s4", "hatch spacing=4"},
+        {"hatch/s16", "hatch spacing=16"},
+        {"pencil-strokes/s4", "pencil-strokes spacing=4"},
+        {"pencil-strokes/s16", "pencil-strokes spacing=16"},
+    };
+    const int size = 512;
+    const ImageBuffer source = patternImage(size, size, 4, true);
+    Document document(size, size);
+    document.addLayer(Layer("target", size, size));
+    for (const auto& op : ops) {
+        const CompiledOp compiled = compileOp(op.second + " path=/0");
+        runner.run("effect/" + op.first + "/512", static_cast<std::size_t>(size) * size,
+                   [&] {
+                       // Writing one pixel detaches the copy outside the timed part.
+                       ImageBuffer& image = document.layer(0).image();
+                       image = source;
+                       image.setPixel(0, 0, source.getPixel(0, 0));
+                   },
+                   [&] { applyDocumentOperation(document, compiled, {}, {}, {}, options.threads); });
+    }
+}
+
+std::string jsonString(const std::string& value) {
+    std::string out = "\"";
+    for (char c : value) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+        }
+        out += c;
+    }
+    return out + "\"";
+}
+
+void writeJSON(const std::string& path, const BenchSettings& settings, const std::vector<BenchResult>& results) {
+    std::ofstream out(path);
+    if (!out) {
+        throw std::runtime_error("Failed to open " + path);
+    }
+    out << "{\n  \"version\": 1,\n  \"threads\": " << resolveThreadCount(settings.threads) << ",\n  \"results\": [\n";
+    for (std::size_t i = 0; i < results.size(); ++i) {
+        const BenchResult& result = results[i];
+        out << "    {\"name\": " << jsonString(result.name) << ", \"items\": " << result.items
+            << ", \"iterations\": " << result.iterations << std::fixed << std::setprecision(1)
+            << ", \"median_ns\": " << result.medianNs << ", \"min_ns\": " << result.minNs << "}"
+            << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n}\n";
+    if (!out) {
+        throw std::runtime_error("Failed to write " + path);
+    }
+}
+
+// Reads the name and median of every result in a file written by --json.
+std::map<std::string, double> readBaseline(const std::string& path) {
+    std::ifstream in(path);
+    if (!in) {
+        throw std::runtime_error("Failed to open baseline " + path);
+    }
+    const std::string text((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    std::map<std::string, double> medians;
+    const std::string nameKey = "\"name\": \"";
+    const std::string medianKey = "\"median_ns\": ";
+    for (std::size_t at = text.find(nameKey); at != std::string::npos; at = text.find(nameKey, at)) {
+        at += nameKey.size();
+        std::string name;
+        while (at < text.size() && text[at] != '"') {
+            if (text[at] == '\\' && at + 1 < text.size()) {
+                ++at;
+            }
+            name += text[at++];
+        }
+        const std::size_t median = text.find(medianKey, at);
+        if (median == std::string::npos) {
+            throw std::runtime_error("Baseline result " + name + " has no median_ns");
+        }
+        medians[name] = std::strtod(text.c_str() + median + medianKey.size(), nullptr);
+    }
+    return medians;
+}
+
+// Prints each result's change against the baseline; returns how many got
+// slower by more than the threshold.
+int compareWithBaseline(const std::vector<BenchResult>& results, const std::map<std::string, double>& baseline,
+                        double thresholdPercent) {
+    int regressions = 0;
+    std::cout << std::defaultfloat << "\nAgainst baseline (threshold " << thresholdPercent << "%):\n";
+    for (const BenchResult& result : results) {
+        const auto it = baseline.find(result.name);
+        std::cout << std::left << std::setw(44) << result.name << std::right;
+        if (it == baseline.end() || it->second <= 0.0) {
+            std::cout << "         new\n";
+            continue;
+        }
+        const double change = (result.medianNs / it->second - 1.0) * 100.0;
+        std::cout << std::setw(11) << std::showpos << std::fixed << std::setprecision(1) << change << "%" << std::noshowpos;
+        if (change > thresholdPercent) {
+            std::cout << "  REGRESSION";
+            ++regressions;
+        }
+        std::cout << "\n";
+    }
+    return regressions;
+}
+
+void printUsage() {
+    std::cout << "Usage: bench [--filter <substring>] [--json <path>] [--baseline <path>] [--threshold <percent>]\n"
+              << "             [--min-time <ms>] [--threads <n>] [--list]\n"
+              << "  Times blend modes, composites, codecs and effects ops; the median of each is reported.\n"
+              << "  --json writes the results; --baseline compares against such a file and exits 1 when a\n"
+              << "  benchmark got slower than --threshold percent (default 10).\n";
+}
+
+BenchSettings parseSettings(int argc, char** argv) {
+    BenchSettings settings;
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        const auto value = [&]() -> std::string {
+            if (i + 1 >= argc) {
+                throw std::runtime_error(arg + " requires a value");
+            }
+            return argv[++i];
+        };
+        if (arg == "--filter") {
+            settings.filter = value();
+        } else if (arg == "--json") {
+            settings.jsonPath = value();
+        } else if (arg == "--baseline") {
+            settings.baselinePath = value();
+        } else if (arg == "--threshold") {
+            settings.thresholdPercent = std::stod(value());
+        } else if (arg == "--min-time") {
+            settings.minSeconds = std::stod(value()) / 1000.0;
+        } else if (arg == "--threads") {
+            settings.threads = std::stoi(value());
+        } else if (arg == "--list") {
+            settings.listOnly = true;
+        } else {
+            throw std::runtime_error("Unknown argument " + arg);
+        }
+    }
+    if (settings.thresholdPercent < 0.0 || settings.minSeconds < 0.0 || settings.threads < 0) {
+        throw std::runtime_error("--threshold, --min-time and --threads must not be negative");
+    }
+    return settings;
+}
+} // namespace
+
+int main(int argc, char** argv) {
+    try {
+        if (argc > 1 && (std::string(argv[1]) == "--help" || std::string(argv[1]) == "-h")) {
+            printUsage();
+            return 0;
+        }
+        const BenchSettings settings = parseSettings(argc, argv);
+        const std::filesystem::path scratch = std::filesystem::temp_directory_path() / "image_flow_bench";
+        std::filesystem::create_directories(scratch);
+        CompositeOptions options;
+        options.threads = settings.threads;
+
+        BenchRunner runner(settings);
+        benchBlendModes(runner, options);
+        benchComposite(runner, options);
+        benchCodecs(runner, scratch);
+        benchEffects(runner, options, scratch);
+        std::filesystem::remove_all(scratch);
+        if (settings.listOnly) {
+            return 0;
+        }
+
+        if (!settings.jsonPath.empty()) {
+            writeJSON(settings.jsonPath, settings, runner.results());
+            std::cout << "Wrote " << settings.jsonPath << "\n";
+        }
+        if (!settings.baselinePath.empty()) {
+            const int regressions =
+                compareWithBaseline(runner.results(), readBaseline(settings.baselinePath), settings.thresholdPercent);
+            if (regressions > 0) {
+                std::cerr << regressions << " benchmark(s) regressed\n";
+                return 1;
+            }
+        }
+        return 0;
+    } catch (const std::exception& ex) {
+        std::cerr << "bench: " << ex.what() << "\n";
+        return 2;
+    }
+}
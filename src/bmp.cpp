@@ -1,6 +1,10 @@
 #include "bmp.h"
 
-#include <fstream>
+#include "mapped_file.h"
+#include "swizzle.h"
+
+#include <cstring>
+#include <limits>
 #include <stdexcept>
 
 namespace {
@@ -26,18 +30,69 @@ struct BMPInfoHeader {
     std::uint32_t colorsUsed;
     std::uint32_t colorsImportant;
 };
+
+// BITMAPV4HEADER fields after the basic info header; 32-bit files carry
+// them so readers know the fourth byte is alpha.
+struct BMPV4Fields {
+    std::uint32_t redMask;
+    std::uint32_t greenMask;
+    std::uint32_t blueMask;
+    std::uint32_t alphaMask;
+    std::uint32_t colorSpace;
+    std::uint8_t endpoints[36];
+    std::uint32_t gammaRed;
+    std::uint32_t gammaGreen;
+    std::uint32_t gammaBlue;
+};
 #pragma pack(pop)
 
 constexpr std::uint16_t kBMPMagic = 0x4D42;
 constexpr std::uint32_t kBI_RGB = 0;
+constexpr std::uint32_t kBI_BITFIELDS = 3;
+constexpr std::uint32_t kLCS_sRGB = 0x73524742;
+constexpr std::uint32_t kRedMask = 0x00FF0000;
+constexpr std::uint32_t kGreenMask = 0x0000FF00;
+constexpr std::uint32_t kBlueMask = 0x000000FF;
+constexpr std::uint32_t kAlphaMask = 0xFF000000;
+
+enum class BMPAlpha { Opaque, Stored, Unknown };
 
 std::size_t pixelIndex(int x, int y, int width) {
     return static_cast<std::size_t>(y) * static_cast<std::size_t>(width) + static_cast<std::size_t>(x);
 }
 
-int paddedRowSize(int width) {
-    const int rowStride = width * 3;
-    return (rowStride + 3) & ~3;
+std::size_t paddedRowSize(int width, int bytesPerPixel) {
+    const std::size_t rowStride = static_cast<std::size_t>(width) * static_cast<std::size_t>(bytesPerPixel);
+    return (rowStride + 3) & ~static_cast<std::size_t>(3);
+}
+
+std::uint32_t readU32(const std::uint8_t* data) {
+    std::uint32_t value = 0;
+    std::memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+// 32-bit files say how their fourth byte is used through bit masks; plain
+// BI_RGB ones do not, and many writers leave it zero.
+BMPAlpha alphaUsage(const BMPInfoHeader& info, const std::uint8_t* data, std::size_t size) {
+    if (info.compression == kBI_RGB) {
+        return BMPAlpha::Unknown;
+    }
+    std::uint32_t masks[4] = {0, 0, 0, 0};
+    const std::size_t infoOffset = sizeof(BMPFileHeader);
+    const std::size_t maskBytes = info.headerSize >= 56 ? 16 : 12;
+    const std::size_t maskOffset = info.headerSize >= 52 ? infoOffset + sizeof(BMPInfoHeader) : infoOffset + info.headerSize;
+    if (size < maskOffset + maskBytes) {
+        throw std::runtime_error("Failed to read BMP bit masks");
+    }
+    for (std::size_t i = 0; i < maskBytes / 4; ++i) {
+        masks[i] = readU32(data + maskOffset + i * 4);
+    }
+    if (masks[0] != kRedMask || masks[1] != kGreenMask || masks[2] != kBlueMask ||
+        (masks[3] != 0 && masks[3] != kAlphaMask)) {
+        throw std::runtime_error("Only 8-bit BGR(A) BMP bit masks are supported");
+    }
+    return masks[3] == kAlphaMask ? BMPAlpha::Stored : BMPAlpha::Opaque;
 }
 } // namespace
 
@@ -80,98 +135,130 @@ bool BMPImage::save(const std::string& filename) const {
     if (m_width <= 0 || m_height <= 0) {
         return false;
     }
+    return saveRows(filename, colorRows(m_pixels.data(), m_width, m_height));
+}
 
-    std::ofstream out(filename, std::ios::binary);
-    if (!out) {
+bool BMPImage::saveRows(const std::string& filename, const PixelRows& pixels) {
+    if (pixels.width <= 0 || pixels.height <= 0 || (pixels.channels != 3 && pixels.channels != 4)) {
         return false;
     }
 
-    const int rowSize = paddedRowSize(m_width);
-    const std::uint32_t imageSize = static_cast<std::uint32_t>(rowSize * m_height);
+    const int fileChannels = pixels.channels;
+    const std::size_t rowSize = paddedRowSize(pixels.width, fileChannels);
+    const std::size_t imageSize = rowSize * static_cast<std::size_t>(pixels.height);
+    const std::size_t headerSize = sizeof(BMPInfoHeader) + (fileChannels == 4 ? sizeof(BMPV4Fields) : 0);
+    const std::size_t offsetData = sizeof(BMPFileHeader) + headerSize;
+    if (imageSize > std::numeric_limits<std::uint32_t>::max() - offsetData) {
+        return false;
+    }
+
+    MappedOutputFile out(filename, offsetData + imageSize);
+    if (!out.isOpen()) {
+        return false;
+    }
 
     BMPFileHeader fileHeader{};
     fileHeader.fileType = kBMPMagic;
-    fileHeader.fileSize = static_cast<std::uint32_t>(sizeof(BMPFileHeader) + sizeof(BMPInfoHeader)) + imageSize;
-    fileHeader.offsetData = static_cast<std::uint32_t>(sizeof(BMPFileHeader) + sizeof(BMPInfoHeader));
+    fileHeader.fileSize = static_cast<std::uint32_t>(offsetData + imageSize);
+    fileHeader.offsetData = static_cast<std::uint32_t>(offsetData);
 
     BMPInfoHeader infoHeader{};
-    infoHeader.headerSize = sizeof(BMPInfoHeader);
-    infoHeader.width = m_width;
-    infoHeader.height = m_height;
+    infoHeader.headerSize = static_cast<std::uint32_t>(headerSize);
+    infoHeader.width = pixels.width;
+    infoHeader.height = pixels.height;
     infoHeader.planes = 1;
-    infoHeader.bitCount = 24;
-    infoHeader.compression = kBI_RGB;
-    infoHeader.imageSize = imageSize;
-
-    out.write(reinterpret_cast<const char*>(&fileHeader), sizeof(fileHeader));
-    out.write(reinterpret_cast<const char*>(&infoHeader), sizeof(infoHeader));
-
-    const int paddingSize = rowSize - (m_width * 3);
-    const std::uint8_t padding[3] = {0, 0, 0};
-
-    for (int y = m_height - 1; y >= 0; --y) {
-        for (int x = 0; x < m_width; ++x) {
-            const Color& px = m_pixels[pixelIndex(x, y, m_width)];
-            const std::uint8_t bgr[3] = {px.b, px.g, px.r};
-            out.write(reinterpret_cast<const char*>(bgr), 3);
-        }
-        out.write(reinterpret_cast<const char*>(padding), paddingSize);
+    infoHeader.bitCount = static_cast<std::uint16_t>(fileChannels * 8);
+    infoHeader.compression = fileChannels == 4 ? kBI_BITFIELDS : kBI_RGB;
+    infoHeader.imageSize = static_cast<std::uint32_t>(imageSize);
+
+    std::uint8_t* data = out.data();
+    std::memcpy(data, &fileHeader, sizeof(fileHeader));
+    std::memcpy(data + sizeof(fileHeader), &infoHeader, sizeof(infoHeader));
+    if (fileChannels == 4) {
+        BMPV4Fields v4{};
+        v4.redMask = kRedMask;
+        v4.greenMask = kGreenMask;
+        v4.blueMask = kBlueMask;
+        v4.alphaMask = kAlphaMask;
+        v4.colorSpace = kLCS_sRGB;
+        std::memcpy(data + sizeof(fileHeader) + sizeof(infoHeader), &v4, sizeof(v4));
     }
 
-    return static_cast<bool>(out);
+    // Rows are swizzled straight into the mapped file, bottom row first;
+    // padding bytes start out zero.
+    std::uint8_t* dst = data + offsetData;
+    for (int y = pixels.height - 1; y >= 0; --y, dst += rowSize) {
+        convertPixels(pixels.row(y), pixels.channels, dst, fileChannels, static_cast<std::size_t>(pixels.width), true);
+    }
+    return out.commit();
 }
 
 BMPImage BMPImage::load(const std::string& filename) {
-    std::ifstream in(filename, std::ios::binary);
-    if (!in) {
-        throw std::runtime_error("Cannot open BMP file: " + filename);
-    }
+    const MappedFile file(filename);
+    BMPImage image;
+    decode(file.data(), file.size(), {3, [&image](int width, int height) {
+                                          image = BMPImage(width, height);
+                                          return reinterpret_cast<std::uint8_t*>(image.m_pixels.data());
+                                      }});
+    return image;
+}
 
+void BMPImage::decode(const std::uint8_t* data, std::size_t size, const PixelTarget& target) {
     BMPFileHeader fileHeader{};
     BMPInfoHeader infoHeader{};
-
-    in.read(reinterpret_cast<char*>(&fileHeader), sizeof(fileHeader));
-    in.read(reinterpret_cast<char*>(&infoHeader), sizeof(infoHeader));
-
-    if (!in) {
+    if (size < sizeof(fileHeader) + sizeof(infoHeader)) {
         throw std::runtime_error("Failed to read BMP headers");
     }
+    std::memcpy(&fileHeader, data, sizeof(fileHeader));
+    std::memcpy(&infoHeader, data + sizeof(fileHeader), sizeof(infoHeader));
+
     if (fileHeader.fileType != kBMPMagic) {
         throw std::runtime_error("Not a BMP file");
     }
-    if (infoHeader.headerSize != sizeof(BMPInfoHeader)) {
+    const std::uint32_t headerSize = infoHeader.headerSize;
+    if (headerSize != 40 && headerSize != 52 && headerSize != 56 && headerSize != 108 && headerSize != 124) {
         throw std::runtime_error("Unsupported BMP info header size");
     }
-    if (infoHeader.bitCount != 24 || infoHeader.compression != kBI_RGB) {
-        throw std::runtime_error("Only uncompressed 24-bit BMP is supported");
+    const bool rgb24 = infoHeader.bitCount == 24 && infoHeader.compression == kBI_RGB;
+    const bool bgra32 = infoHeader.bitCount == 32 && (infoHeader.compression == kBI_RGB || infoHeader.compression == kBI_BITFIELDS);
+    if (!rgb24 && !bgra32) {
+        throw std::runtime_error("Only uncompressed 24-bit and 32-bit BMP is supported");
     }
-    if (infoHeader.width <= 0 || infoHeader.height == 0) {
+    if (infoHeader.width <= 0 || infoHeader.height == 0 || infoHeader.height == std::numeric_limits<std::int32_t>::min()) {
         throw std::runtime_error("Invalid BMP dimensions");
     }
 
     const int width = infoHeader.width;
     const bool topDown = infoHeader.height < 0;
     const int height = topDown ? -infoHeader.height : infoHeader.height;
+    const int fileChannels = bgra32 ? 4 : 3;
+    const BMPAlpha alpha = bgra32 ? alphaUsage(infoHeader, data, size) : BMPAlpha::Opaque;
+    const std::size_t rowSize = paddedRowSize(width, fileChannels);
+    if (fileHeader.offsetData > size || (size - fileHeader.offsetData) / rowSize < static_cast<std::size_t>(height)) {
+        throw std::runtime_error("Unexpected end of BMP pixel data");
+    }
 
-    BMPImage image(width, height, Color(0, 0, 0));
-
-    const int rowSize = paddedRowSize(width);
-    std::vector<std::uint8_t> row(static_cast<std::size_t>(rowSize));
-
-    in.seekg(fileHeader.offsetData, std::ios::beg);
-
+    const int channels = target.channels;
+    std::uint8_t* pixels = target.allocate(width, height);
+    const std::size_t dstRowSize = static_cast<std::size_t>(width) * static_cast<std::size_t>(channels);
+    std::uint8_t storedAlpha = 0;
     for (int fileY = 0; fileY < height; ++fileY) {
-        in.read(reinterpret_cast<char*>(row.data()), rowSize);
-        if (!in) {
-            throw std::runtime_error("Unexpected end of BMP pixel data");
-        }
-
+        const std::uint8_t* src = data + fileHeader.offsetData + static_cast<std::size_t>(fileY) * rowSize;
         const int y = topDown ? fileY : (height - 1 - fileY);
-        for (int x = 0; x < width; ++x) {
-            const std::size_t i = static_cast<std::size_t>(x) * 3;
-            image.setPixel(x, y, Color(row[i + 2], row[i + 1], row[i]));
+        std::uint8_t* dst = pixels + static_cast<std::size_t>(y) * dstRowSize;
+        convertPixels(src, fileChannels, dst, channels, static_cast<std::size_t>(width), true);
+        if (channels == 4 && alpha == BMPAlpha::Unknown) {
+            for (std::size_t i = 3; i < dstRowSize; i += 4) {
+                storedAlpha |= dst[i];
+            }
         }
     }
 
-    return image;
+    // 32-bit files whose fourth byte is unused, or all zero, are opaque.
+    if (channels == 4 && fileChannels == 4 && (alpha == BMPAlpha::Opaque || (alpha == BMPAlpha::Unknown && storedAlpha == 0))) {
+        const std::size_t total = dstRowSize * static_cast<std::size_t>(height);
+        for (std::size_t i = 3; i < total; i += 4) {
+            pixels[i] = 255;
+        }
+    }
 }
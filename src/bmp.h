@@ -3,6 +3,8 @@
 
 #include "image.h"
 
+#include <cstddef>
+#include <cstdint>
 #include <string>
 #include <vector>
 
@@ -19,7 +21,12 @@ public:
     void setPixel(int x, int y, const Color& color) override;
 
     bool save(const std::string& filename) const;
+    // RGB rows are written as 24-bit BGR, RGBA rows as 32-bit BGRA.
+    static bool saveRows(const std::string& filename, const PixelRows& pixels);
     static BMPImage load(const std::string& filename);
+    // Uncompressed 24-bit or 32-bit files; 32-bit alpha reaches 4-channel
+    // targets unless the file marks it unused or leaves it all zero.
+    static void decode(const std::uint8_t* data, std::size_t size, const PixelTarget& target);
 
 private:
     int m_width;
@@ -9,29 +9,71 @@ void writeUsage() {
         << "  image_flow help\n"
         << "  image_flow help ops\n"
         << "  image_flow new --width <w> --height <h> --out <project.iflow>\n"
-        << "  image_flow new --from-image <file> [--fit <w>x<h>] --out <project.iflow>\n"
+        << "  image_flow new --from-image <file> [--fit <w>x<h> [--filter nearest|bilinear|box|lanczos3|mitchell|catmull-rom]] --out <project.iflow>\n"
         << "  image_flow info --in <project.iflow>\n"
-        << "  image_flow render --in <project.iflow> --out <image.{png|bmp|jpg|gif|webp|svg}>\n"
-        << "  image_flow ops --in <project.iflow> --out <project.iflow> --op \"<action key=value ...>\" [--op ...]\n\n"
+        << "  image_flow render --in <project.iflow> --out <image.{png|bmp|jpg|gif|webp|svg}>[,scale=<f>][,quality=<n>][,level=<0-9>] [--out ...] [--scale <f>|--max-size <W>x<H>] [--threads <n>] [--memory-budget <MiB>] [--png-level <0-9>] [--jpeg-quality <1-100>] [--jpeg-subsampling 444|422|420] [--gif-dither none|ordered|fs] [--webp-quality <0-100>] [--svg-mode auto|rects|png] [--profile <trace.json>]\n"
+        << "  image_flow ops --in <project.iflow> --out <project.iflow> --op \"<action key=value ...>\" [--op ...] [--memory-budget <MiB>]\n\n"
         << "  image_flow ops --width <w> --height <h> --out <project.iflow> [--op ...|--ops-file <path>|--stdin]\n\n"
+        << "  image_flow bake-lut --out <grade.cube> [--size <2-256>] [--title <text>] --op \"<color op>\" [--op ...]\n\n"
+        << "  image_flow serve [--socket <path>] [--threads <n>] [--memory-budget <MiB>] [--compression <codec>] [--compact]\n\n"
         << "Notes:\n"
-        << "  - WebP output requires cwebp/dwebp tooling in PATH.\n";
+        << "  - WebP output is lossless; --webp-quality <0-100> below 100 enables near-lossless coding.\n"
+        << "  - Lossy WebP input needs dwebp in PATH.\n"
+        << "  - SVG input fills anti-aliased rects, circles, ellipses, polygons and paths (nonzero or evenodd) in row bands.\n"
+        << "  - --threads <n> sets compositor worker threads for render and ops (--render/emit); 0 uses all cores.\n"
+        << "  - render takes several --out targets (composited once, encoded concurrently), each with optional ,scale= ,quality= ,level=.\n"
+        << "  - render streams PNG output band by band; --memory-budget <MiB> caps decoded layer pixels it keeps.\n"
+        << "  - render --scale <f> or --max-size <W>x<H> composites a proxy at the reduced size through mip levels.\n"
+        << "  - ops --memory-budget <MiB> evicts least recently edited layers between ops, spilling edits to a temp file.\n"
+        << "  - --max-memory <MiB> is an alias of --memory-budget on render, ops and serve.\n"
+        << "  - info lists decoded and resident pixel memory per layer and for the document.\n"
+        << "  - Composite BMP output is 32-bit BGRA, so alpha survives; 24-bit and 32-bit BMP input is memory-mapped.\n"
+        << "  - PNG output is deflated on the worker pool; --png-level <0-9> trades speed for size (default 6).\n"
+        << "  - JPEG output takes --jpeg-quality <1-100> (default 50) and --jpeg-subsampling 444|422|420 (default 420).\n"
+        << "  - GIF output over 256 colors uses a median-cut palette; --gif-dither none|ordered|fs (default none).\n"
+        << "  - SVG output merges equal-color rects or embeds a PNG; --svg-mode auto|rects|png (default auto).\n"
+        << "  - IFLOW pixels are saved as compressed chunks; new and ops accept --compression auto|none|rle|lz4|deflate.\n"
+        << "  - serve keeps documents in memory between requests; see image_flow help serve.\n"
+        << "  - ops and render take --profile <trace.json>: a per-op, composite-node, encode and decode summary goes to\n"
+        << "    stderr and a Chrome trace-event file to the path.\n";
 }
 
 void writeOpsUsage() {
     std::cout
         << "image_flow ops reference\n\n"
         << "Usage:\n"
-        << "  image_flow ops --in <project.iflow> --out <project.iflow> --op \"<action key=value ...>\" [--op ...]\n"
+        << "  image_flow ops --in <project.iflow> --out <project.iflow> --op \"<action key=value ...>\" [--op ...] [--memory-budget <MiB>]\n"
         << "  image_flow ops --width <w> --height <h> --out <project.iflow> [--op ...|--ops-file <path>|--stdin]\n\n"
         << "Input modes:\n"
         << "  - Use --in for existing projects.\n"
         << "  - Use --width/--height to start a new in-memory document.\n"
         << "  - --in and --width/--height are mutually exclusive.\n\n"
+        << "Rendering:\n"
+        << "  - --render <image> writes the final composite after saving.\n"
+        << "  - --threads <n> sets compositor worker threads for --render and emit (default 0 = all cores).\n"
+        << "  - Repeated emit ops only recomposite tiles touched by edits since the previous output.\n"
+        << "  - emit scale=<f> (in (0, 1]) composites that output straight at the reduced size.\n"
+        << "  - emit encodes and writes in the background while later ops run; write errors are reported at the end.\n"
+        << "  - --png-level <0-9> sets the deflate level of PNG outputs (default 6; 0 stores).\n"
+        << "  - --jpeg-quality <1-100> and --jpeg-subsampling 444|422|420 set JPEG outputs (default 50 and 420).\n"
+        << "  - --gif-dither none|ordered|fs dithers GIF outputs that need a reduced palette (default none).\n"
+        << "  - --webp-quality <0-100> below 100 writes near-lossless WebP outputs (default 100).\n"
+        << "  - --svg-mode auto|rects|png picks merged rects or an embedded PNG for SVG outputs (default auto).\n"
+        << "  - --animate <out.gif> appends the composite as a frame at each emit-frame op; frames after the\n"
+        << "    first store only the changed rectangle. emit-frame delay=<cs> overrides --frame-delay (default 10).\n\n"
+        << "Saving:\n"
+        << "  - --compression auto|none|rle|lz4|deflate picks the IFLOW chunk codec (default auto keeps the smallest).\n"
+        << "  - --threads also sets the worker count for chunk encoding and decoding.\n"
+        << "  - Layers load lazily; chunks of layers no op touched are copied into the output unchanged.\n"
+        << "  - When --out is the --in file, only changed layers and the layer tree are appended to it;\n"
+        << "    --compact forces a full rewrite (also done automatically once half the file is stale).\n\n"
         << "Op sources:\n"
         << "  - --op \"...\" (repeatable)\n"
         << "  - --ops-file <path> (one op per line, '#' comments supported)\n"
-        << "  - --stdin (one op per line)\n\n"
+        << "  - --stdin (one op per line)\n"
+        << "  - Every op is parsed and its action checked before the first one runs.\n"
+        << "  - Runs of layer ops on different path= layers execute concurrently (--threads); each layer keeps\n"
+        << "    script order, and structure, import and emit ops wait for the ops before them.\n\n"
         << "Tokenization rules:\n"
         << "  - Op tokens are key=value pairs separated by spaces.\n"
         << "  - Quote values containing spaces: name=\"Layer One\" or name='Layer One'.\n"
@@ -41,13 +83,57 @@ void writeOpsUsage() {
         << "  - Transform: set-transform concat-transform clear-transform\n"
         << "  - Drawing: draw-fill draw-line draw-rect draw-fill-rect draw-round-rect draw-fill-round-rect draw-ellipse\n"
         << "             draw-fill-ellipse draw-polyline draw-polygon draw-fill-polygon draw-flood-fill draw-circle\n"
-        << "             draw-fill-circle draw-arc draw-quadratic-bezier draw-bezier\n"
-        << "  - Effects: apply-effect replace-color channel-mix levels gamma curves gaussian-blur edge-detect morphology\n"
-        << "             fractal-noise hatch pencil-strokes noise-layer checker-layer gradient-layer\n"
+        << "             draw-fill-circle draw-arc draw-quadratic-bezier draw-bezier draw-batch\n"
+        << "  - Effects: apply-effect replace-color channel-mix levels gamma curves apply-lut gaussian-blur edge-detect\n"
+        << "             morphology fractal-noise hatch pencil-strokes noise-layer checker-layer gradient-layer\n"
         << "  - Pixel/mask: fill-layer set-pixel mask-enable mask-clear mask-set-pixel\n"
-        << "  - Output: emit\n\n"
+        << "  - draw-line, draw-polyline, draw-polygon and the beziers take line_width=<px> cap=butt|round|square\n"
+        << "    join=miter|round|bevel miter_limit=<ratio>; wide strokes are filled as outline polygons.\n"
+        << "  - Fills and wide strokes take antialias=true; draw-fill-polygon takes fill_rule=evenodd|nonzero.\n"
+        << "  - Draw ops blend rgba with alpha below 255 source-over; blend=copy replaces the pixels instead.\n"
+        << "  - Consecutive draw ops on one path and target replay as one display list, tiled on all cores;\n"
+        << "    draw-batch path=<layer> file=<ops.txt> reads one from a file of draw ops without path= or target=.\n"
+        << "  - Output: emit emit-frame\n"
+        << "  - Consecutive levels/gamma/curves/channel-mix/apply-effect/replace-color/apply-lut ops on one path run as a\n"
+        << "    single fused pass. apply-lut file=<grade.cube> reads 3D .cube LUTs; bake-lut writes one from color ops.\n"
+        << "  - gaussian-blur radius=<n> [sigma=<f>] (default sigma 0.3*radius+0.8) runs on all cores; radii above 16\n"
+        << "    use a three-pass box cascade whose cost does not grow with the radius.\n"
+        << "  - morphology op=erode|dilate shape=disc|square|line [angle=0|45|90|135 for lines] costs the same at\n"
+        << "    any radius; iterations=<n> runs as one pass with an n times longer element. Discs are octagons.\n"
+        << "  - noise-layer, fractal-noise, hatch and pencil-strokes fill rows on all cores; each seed gives the same\n"
+        << "    pixels at any thread count. pencil-strokes places every stroke from the layer as it was before any.\n"
+        << "  - gradient-layer and checker-layer without region=, and noise-layer over them or a solid layer, keep\n"
+        << "    parameters only: composites compute the pixels they draw and the first pixel edit bakes them.\n"
+        << "  - Effect, procedural and fill-layer ops take region=x,y,w,h or region=mask to work on that rect only;\n"
+        << "    region=mask fades the result in by coverage, and emits only recomposite the tiles under it.\n"
+        << "  - resize-layer and scaled import-image take filter=nearest|bilinear|box|lanczos3|mitchell|catmull-rom\n"
+        << "    (default bilinear); alpha and masks are resampled with the colors.\n\n"
         << "Example:\n"
         << "  image_flow ops --in in.iflow --out out.iflow \\\n"
         << "    --op \"add-layer parent=/ name=Sketch width=800 height=600 fill=0,0,0,0\" \\\n"
         << "    --op \"draw-fill-rect path=/0 x=40 y=30 width=220 height=140 rgba=255,180,20,220\"\n";
 }
+
+void writeServeUsage() {
+    std::cout
+        << "image_flow serve reference\n\n"
+        << "Usage:\n"
+        << "  image_flow serve [--socket <path>] [--threads <n>] [--memory-budget <MiB>] [--compression <codec>] [--compact]\n"
+        << "                   [--png-level <0-9>] [--jpeg-quality <1-100>] [--webp-quality <0-100>] ...\n\n"
+        << "Framing:\n"
+        << "  - Without --socket, requests are read from stdin and replies written to stdout; with it, clients of\n"
+        << "    the Unix socket are served one at a time and documents stay open between connections.\n"
+        << "  - A request is its byte count in decimal, a newline, then that many bytes.\n"
+        << "  - A reply is \"ok <count>\\n\" or \"error <count>\\n\", then that many bytes: a message or an image.\n\n"
+        << "Requests (the first line, key=value tokens as in ops):\n"
+        << "  - open name=<doc> file=<project.iflow>\n"
+        << "  - new name=<doc> width=<w> height=<h> [file=<project.iflow>]\n"
+        << "  - ops name=<doc>, then one op per line ('#' comments supported). All ops are parsed first; a failing\n"
+        << "    op is reported with its index and the ops before it stay applied. emit file= writes images.\n"
+        << "  - render name=<doc> [format=png|bmp|jpg|gif|webp|svg] [scale=<f>] [quality=<n>] [level=<0-9>]\n"
+        << "    replies with the encoded composite; renders only recomposite tiles changed since the last one.\n"
+        << "  - save name=<doc> [file=<project.iflow>] writes now, appending changes when file= is the open file.\n"
+        << "  - close name=<doc> [file=...] [save=true|false] saves changes unless save=false, then forgets it.\n"
+        << "  - list, and quit, which saves changed documents that have a file and stops the server.\n"
+        << "  - Changed documents are also saved when stdin ends; ones never given a file= are dropped.\n";
+}
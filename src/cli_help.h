@@ -3,5 +3,6 @@
 
 void writeUsage();
 void writeOpsUsage();
+void writeServeUsage();
 
 #endif
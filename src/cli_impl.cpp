@@ -4,6 +4,7 @@
 #include "cli_help.h"
 #include "cli_ops.h"
 #include "cli_project_cmds.h"
+#include "cli_serve.h"
 
 #include <exception>
 #include <iostream>
@@ -13,7 +14,7 @@
 namespace {
 int runCommand(const std::vector<std::string>& args) {
     if (args.size() < 2) {
-        std::cerr << "Usage: image_flow <new|info|render|ops|help> ...\n";
+        std::cerr << "Usage: image_flow <new|info|render|ops|bake-lut|serve|help> ...\n";
         return 1;
     }
 
@@ -30,6 +31,12 @@ int runCommand(const std::vector<std::string>& args) {
     if (sub == "ops") {
         return runIFLOWOps(args);
     }
+    if (sub == "bake-lut") {
+        return runBakeLUT(args);
+    }
+    if (sub == "serve") {
+        return runIFLOWServe(args);
+    }
 
     std::cerr << "Unknown command: " << sub << "\n";
     return 1;
@@ -50,6 +57,10 @@ int runCLIImpl(int argc, char** argv) {
                 writeOpsUsage();
                 return 0;
             }
+            if (args.size() >= 3 && args[2] == "serve") {
+                writeServeUsage();
+                return 0;
+            }
             writeUsage();
             return 0;
         }
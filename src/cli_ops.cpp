@@ -3,20 +3,217 @@
 #include "cli_help.h"
 #include "cli_parse.h"
 #include "cli_ops_core.h"
+#include "cli_ops_resolve.h"
 #include "cli_project_cmds.h"
 #include "cli_shared.h"
+#include "profile.h"
 
 #include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
 #include <exception>
 #include <filesystem>
 #include <functional>
+#include <future>
 #include <iostream>
 #include <limits>
-#include <sstream>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 namespace {
+// Decoded imports held ahead of their ops; each holds a full image.
+constexpr std::size_t kMaxPrefetchedImports = 2;
+// Emitted composites waiting for the encoder, on top of the one it is
+// writing; each holds a full image unless it shares pixels with the document.
+constexpr std::size_t kMaxQueuedEmits = 2;
+
+std::string emitPathKey(const std::string& path) {
+    std::error_code error;
+    const std::filesystem::path absolute = std::filesystem::absolute(path, error);
+    return (error ? std::filesystem::path(path) : absolute).lexically_normal().string();
+}
+
+// Encodes and writes emit outputs on one background thread while later ops
+// keep changing the document. Failures are collected, with their op, for
+// finish() to report.
+class EmitQueue {
+public:
+    explicit EmitQueue(const ImageSaveOptions& options) : m_options(options) {}
+
+    ~EmitQueue() {
+        finish();
+    }
+
+    EmitQueue(const EmitQueue&) = delete;
+    EmitQueue& operator=(const EmitQueue&) = delete;
+
+    // Blocks while kMaxQueuedEmits outputs are already waiting.
+    void push(std::size_t opIndex, const std::string& opSpec, const std::string& path, ImageBuffer composite) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (!m_worker.joinable()) {
+            m_worker = std::thread([this]() { run(); });
+        }
+        m_changed.wait(lock, [this]() { return m_jobs.size() < kMaxQueuedEmits; });
+        m_jobs.push_back({opIndex, opSpec, path, emitPathKey(path), std::move(composite)});
+        m_changed.notify_all();
+    }
+
+    // Waits until no queued or running emit writes path.
+    void waitForPath(const std::string& path) {
+        const std::string key = emitPathKey(path);
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_changed.wait(lock, [&]() {
+            return m_writingKey != key &&
+                   std::none_of(m_jobs.begin(), m_jobs.end(), [&](const Job& job) { return job.key == key; });
+        });
+    }
+
+    // Drains the queue and returns the failures in op order.
+    std::vector<std::string> finish() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_closed = true;
+            m_changed.notify_all();
+        }
+        if (m_worker.joinable()) {
+            m_worker.join();
+        }
+        return m_failures;
+    }
+
+    std::size_t writtenCount() const {
+        return m_written;
+    }
+
+private:
+    struct Job {
+        std::size_t opIndex;
+        std::string opSpec;
+        std::string path;
+        std::string key;
+        ImageBuffer composite;
+    };
+
+    void run() {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        for (;;) {
+            m_changed.wait(lock, [this]() { return m_closed || !m_jobs.empty(); });
+            if (m_jobs.empty()) {
+                return;
+            }
+            Job job = std::move(m_jobs.front());
+            m_jobs.pop_front();
+            m_writingKey = job.key;
+            m_changed.notify_all();
+            lock.unlock();
+
+            std::string failure;
+            try {
+                const std::filesystem::path outFsPath(job.path);
+                if (outFsPath.has_parent_path()) {
+                    std::filesystem::create_directories(outFsPath.parent_path());
+                }
+                if (saveCompositeByExtension(job.composite, job.path, m_options)) {
+                    std::cout << "Emitted " << job.path << "\n";
+                } else {
+                    failure = "Failed writing emit output: " + job.path;
+                }
+            } catch (const std::exception& ex) {
+                failure = ex.what();
+            }
+            job.composite = ImageBuffer();
+
+            lock.lock();
+            m_writingKey.clear();
+            if (failure.empty()) {
+                ++m_written;
+            } else {
+                m_failures.push_back(opFailure(job.opIndex, job.opSpec, failure));
+            }
+            m_changed.notify_all();
+        }
+    }
+
+    ImageSaveOptions m_options;
+    std::mutex m_mutex;
+    std::condition_variable m_changed;
+    std::deque<Job> m_jobs;
+    std::string m_writingKey;
+    std::vector<std::string> m_failures;
+    std::size_t m_written = 0;
+    bool m_closed = false;
+    std::thread m_worker;
+};
+
+void collectLayers(const LayerGroup& group, std::vector<const Layer*>& layers) {
+    for (std::size_t i = 0; i < group.nodeCount(); ++i) {
+        const LayerNode& node = group.node(i);
+        if (node.isLayer()) {
+            layers.push_back(&node.asLayer());
+        } else {
+            collectLayers(node.asGroup(), layers);
+        }
+    }
+}
+
+// Revisions of every layer in tree order, taken before a profiled op.
+std::vector<std::uint64_t> layerRevisions(const Document& document) {
+    std::vector<const Layer*> layers;
+    collectLayers(document.rootGroup(), layers);
+    std::vector<std::uint64_t> revisions;
+    for (const Layer* layer : layers) {
+        revisions.push_back(layer->revision());
+    }
+    return revisions;
+}
+
+// Pixels of the layers edited since revisions: rect edits count their rect,
+// other edits (and layers the tree gained) the whole layer.
+std::uint64_t editedPixels(const Document& document, const std::vector<std::uint64_t>& revisions) {
+    std::vector<const Layer*> layers;
+    collectLayers(document.rootGroup(), layers);
+    const bool sameTree = layers.size() == revisions.size();
+    std::uint64_t pixels = 0;
+    for (std::size_t i = 0; i < layers.size(); ++i) {
+        const Layer& layer = *layers[i];
+        const bool unchanged = sameTree ? layer.revision() == revisions[i]
+                                        : std::find(revisions.begin(), revisions.end(), layer.revision()) != revisions.end();
+        if (unchanged) {
+            continue;
+        }
+        std::uint64_t since = 0;
+        int x0 = 0;
+        int y0 = 0;
+        int x1 = 0;
+        int y1 = 0;
+        if (sameTree && layer.changedRect(since, x0, y0, x1, y1) && since <= revisions[i]) {
+            pixels += static_cast<std::uint64_t>(std::max(0, x1 - x0)) * static_cast<std::uint64_t>(std::max(0, y1 - y0));
+        } else {
+            pixels += static_cast<std::uint64_t>(layer.image().width()) * static_cast<std::uint64_t>(layer.image().height());
+        }
+    }
+    return pixels;
+}
+
+// "op[3] gamma", or "op[3-9] gamma" / "op[3-9] 7 ops" for a run.
+std::string opSpanName(const std::vector<CompiledOp>& program, std::size_t first, std::size_t end) {
+    std::string name = "op[" + std::to_string(first);
+    if (end - first > 1) {
+        name += "-" + std::to_string(end - 1);
+    }
+    name += "] ";
+    bool sameAction = true;
+    for (std::size_t i = first + 1; i < end; ++i) {
+        sameAction = sameAction && program[i].action == program[first].action;
+    }
+    return name + (sameAction ? program[first].action : std::to_string(end - first) + " ops");
+}
+
 int runIFLOWOpsImpl(const std::vector<std::string>& args) {
     if (std::find(args.begin(), args.end(), "--help") != args.end() ||
         std::find(args.begin(), args.end(), "-h") != args.end()) {
@@ -29,11 +226,17 @@ int runIFLOWOpsImpl(const std::vector<std::string>& args) {
     std::string widthValue;
     std::string heightValue;
     std::string renderPath;
+    std::string animatePath;
+    std::string frameDelayValue;
     const bool hasIn = getFlagValue(args, "--in", inPath);
     const bool hasOut = getFlagValue(args, "--out", outPath);
     const bool hasWidth = getFlagValue(args, "--width", widthValue);
     const bool hasHeight = getFlagValue(args, "--height", heightValue);
     const bool hasRender = getFlagValue(args, "--render", renderPath);
+    const bool hasAnimate = getFlagValue(args, "--animate", animatePath);
+    const int frameDelay = getFlagValue(args, "--frame-delay", frameDelayValue)
+                               ? parseIntInRange(frameDelayValue, "frame-delay", 0, 65535)
+                               : 10;
     const std::vector<std::string> opSpecs = gatherOps(args);
     if (hasIn && (hasWidth || hasHeight)) {
         std::cerr << "Error: --in cannot be combined with --width/--height for ops\n";
@@ -41,54 +244,195 @@ int runIFLOWOpsImpl(const std::vector<std::string>& args) {
     }
 
     if (!hasOut || opSpecs.empty() || (!hasIn && (!hasWidth || !hasHeight))) {
-        std::cerr << "Usage: image_flow ops --in <project.iflow> --out <project.iflow> --op \"<action key=value ...>\" [--op ...]\n"
+        std::cerr << "Usage: image_flow ops --in <project.iflow> --out <project.iflow> --op \"<action key=value ...>\" [--op ...] [--render <image>] [--threads <n>] [--memory-budget <MiB>] [--compression <codec>] [--compact] [--png-level <0-9>] [--animate <out.gif> [--frame-delay <cs>]] [--profile <trace.json>]\n"
                   << "   or: image_flow ops --width <w> --height <h> --out <project.iflow> [--op ...|--ops-file <path>|--stdin]\n";
         return 1;
     }
 
+    const ProfileSession profile(args);
+    // Every op is parsed before the first one runs, so a typo late in a long
+    // script fails before any work, and the loop below never re-parses.
+    std::vector<CompiledOp> program;
+    program.reserve(opSpecs.size());
+    for (std::size_t i = 0; i < opSpecs.size(); ++i) {
+        try {
+            program.push_back(compileOp(opSpecs[i]));
+        } catch (const std::exception& ex) {
+            throw std::runtime_error(opFailure(i, opSpecs[i], ex.what()));
+        }
+    }
+
+    const CompositeOptions compositeOptions = parseCompositeOptions(args);
+    const IFLOWSaveOptions saveOptions = parseIFLOWSaveOptions(args);
+    const ImageSaveOptions imageOptions = parseImageSaveOptions(args);
     Document document = hasIn
-                            ? loadDocumentIFLOW(inPath)
+                            ? loadDocumentIFLOW(inPath, compositeOptions.threads)
                             : Document(parseIntInRange(widthValue, "width", 1, std::numeric_limits<int>::max()),
                                        parseIntInRange(heightValue, "height", 1, std::numeric_limits<int>::max()));
-    std::size_t emitCount = 0;
-    const auto emitOutput = [&](const std::string& outputPath) {
-        const ImageBuffer composite = document.composite();
-        const std::filesystem::path outFsPath(outputPath);
-        if (outFsPath.has_parent_path()) {
-            std::filesystem::create_directories(outFsPath.parent_path());
-        }
-        if (!saveCompositeByExtension(composite, outputPath)) {
-            throw std::runtime_error("Failed writing emit output: " + outputPath);
-        }
-        ++emitCount;
-        std::cout << "Emitted " << outputPath << "\n";
+    CompositeCache compositeCache;
+    // One cache per emit scale= proxy size, so alternating sizes keep
+    // redoing only changed tiles.
+    std::map<double, CompositeCache> proxyCaches;
+    EmitQueue emits(imageOptions);
+    std::size_t currentOp = 0;
+    // The snapshot shares the composite's pixels copy-on-write, so later ops
+    // cannot change it; pixels a memory budget may drop are copied instead.
+    const auto emitOutput = [&](const std::string& outputPath, double scale) {
+        CompositeOptions options = compositeOptions;
+        options.scale = scale;
+        ImageBuffer composite = document.composite(options, scale == 1.0 ? compositeCache : proxyCaches[scale]);
+        if (composite.pixelSource() != nullptr) {
+            ImageBuffer copy(composite.width(), composite.height());
+            std::memcpy(copy.data(), composite.data(),
+                        static_cast<std::size_t>(composite.width()) * static_cast<std::size_t>(composite.height()) * sizeof(PixelRGBA8));
+            composite = std::move(copy);
+        }
+        emits.push(currentOp, opSpecs[currentOp], outputPath, std::move(composite));
     };
-    for (std::size_t i = 0; i < opSpecs.size(); ++i) {
+    std::unique_ptr<GIFAnimationWriter> animation;
+    const auto emitFrame = [&](int delay) {
+        const ImageBuffer composite = document.composite(compositeOptions, compositeCache);
+        if (!animation) {
+            const std::filesystem::path animateFsPath(animatePath);
+            if (animateFsPath.has_parent_path()) {
+                std::filesystem::create_directories(animateFsPath.parent_path());
+            }
+            animation = std::make_unique<GIFAnimationWriter>(animatePath, composite.width(), composite.height(), imageOptions.gif);
+        }
+        animation->addFrame(pixelRows(composite), delay < 0 ? frameDelay : delay);
+    };
+    // Upcoming raster imports are read and decoded in the background while
+    // earlier ops run. Emit ops write files a later import may read, so the
+    // look-ahead never passes one that has not run yet.
+    std::map<std::size_t, std::future<ImageBuffer>> prefetched;
+    std::size_t nextToScan = 0;
+    const auto prefetchImports = [&](std::size_t from) {
+        nextToScan = std::max(nextToScan, from);
+        while (nextToScan < program.size() && prefetched.size() < kMaxPrefetchedImports) {
+            const CompiledOp& op = program[nextToScan];
+            if (op.action == "emit" || op.action == "emit-frame") {
+                return;
+            }
+            std::string path;
+            DecodeOptions options;
+            try {
+                if (rasterImportRequest(op, path, options)) {
+                    emits.waitForPath(path);
+                    options.threads = compositeOptions.threads;
+                    prefetched.emplace(nextToScan, decodeImageFileAsync(path, options));
+                }
+            } catch (const std::exception&) {
+                // Left for the op itself to report.
+            }
+            ++nextToScan;
+        }
+    };
+    // With a memory budget, layers the next op does not name are spilled
+    // once resident pixels pass it.
+    SpillFile spill;
+    const auto enforceBudget = [&](std::size_t next) {
+        if (compositeOptions.memoryBudget == 0) {
+            return;
+        }
+        std::vector<const Layer*> keep;
+        if (next < program.size() && program[next].kv.count("path") != 0) {
+            try {
+                keep.push_back(&resolveLayerPath(document, program[next].kv.at("path")));
+            } catch (const std::exception&) {
+                // Left for the op itself to report.
+            }
+        }
+        enforceMemoryBudget(document, compositeOptions.memoryBudget, spill, keep);
+    };
+    prefetchImports(0);
+    for (std::size_t i = 0; i < program.size(); ++i) {
+        ProfileScope opScope("op");
+        const std::vector<std::uint64_t> revisions = opScope.active() ? layerRevisions(document) : std::vector<std::uint64_t>();
+        const auto finishOpSpan = [&](std::size_t end) {
+            if (opScope.active()) {
+                opScope.setName(opSpanName(program, currentOp, end));
+                opScope.addPixels(editedPixels(document, revisions));
+            }
+        };
         try {
-            applyDocumentOperation(document, opSpecs[i], emitOutput);
+            currentOp = i;
+            if (opScope.active()) {
+                opScope.setName(opSpanName(program, i, i + 1));
+            }
+            std::size_t runEnd = applyIndependentOps(document, program, i, compositeOptions.threads);
+            if (runEnd == i) {
+                runEnd = applyOpRun(document, program, i, compositeOptions.threads);
+            }
+            if (runEnd > i) {
+                finishOpSpan(runEnd);
+                i = runEnd - 1;
+                enforceBudget(runEnd);
+                prefetchImports(runEnd);
+                continue;
+            }
+            ImageLoader loadImage;
+            const auto pending = prefetched.find(i);
+            if (pending != prefetched.end()) {
+                loadImage = [future = std::make_shared<std::future<ImageBuffer>>(std::move(pending->second))](
+                                const std::string&, const DecodeOptions&) { return future->get(); };
+                prefetched.erase(pending);
+            } else {
+                const std::string importPath = importedFilePath(program[i]);
+                if (!importPath.empty()) {
+                    emits.waitForPath(importPath);
+                }
+            }
+            applyDocumentOperation(document, program[i], emitOutput, hasAnimate ? emitFrame : std::function<void(int)>(), loadImage,
+                                   compositeOptions.threads);
+            finishOpSpan(i + 1);
+            enforceBudget(i + 1);
+            prefetchImports(i + 1);
+        } catch (const OpRunError& ex) {
+            throw std::runtime_error(opFailure(ex.index(), opSpecs[ex.index()], ex.what()));
         } catch (const std::exception& ex) {
-            std::ostringstream error;
-            error << "Failed op[" << i << "] \"" << opSpecs[i] << "\": " << ex.what();
-            throw std::runtime_error(error.str());
+            throw std::runtime_error(opFailure(i, opSpecs[i], ex.what()));
+        }
+    }
+
+    const std::vector<std::string> emitFailures = emits.finish();
+    if (!emitFailures.empty()) {
+        for (const std::string& failure : emitFailures) {
+            std::cerr << "Error: " << failure << "\n";
+        }
+        return 1;
+    }
+    const std::size_t emitCount = emits.writtenCount();
+
+    if (hasAnimate) {
+        if (!animation) {
+            std::cerr << "Error: --animate needs at least one emit-frame op\n";
+            return 1;
         }
+        animation->finish();
+        std::cout << "Wrote " << animation->frameCount() << " frames to " << animatePath << "\n";
     }
 
     const std::filesystem::path outFsPath(outPath);
     if (outFsPath.has_parent_path()) {
         std::filesystem::create_directories(outFsPath.parent_path());
     }
-    if (!saveDocumentIFLOW(document, outPath)) {
+    bool saved = false;
+    {
+        const ProfileScope saveScope("save", outPath);
+        saved = saveDocumentIFLOW(document, outPath, saveOptions);
+    }
+    if (!saved) {
         std::cerr << "Failed saving IFLOW document: " << outPath << "\n";
         return 1;
     }
 
     if (hasRender) {
-        const ImageBuffer composite = document.composite();
+        const ImageBuffer composite = document.composite(compositeOptions, compositeCache);
         const std::filesystem::path renderFsPath(renderPath);
         if (renderFsPath.has_parent_path()) {
             std::filesystem::create_directories(renderFsPath.parent_path());
         }
-        if (!saveCompositeByExtension(composite, renderPath)) {
+        if (!saveCompositeByExtension(composite, renderPath, imageOptions)) {
             std::cerr << "Failed writing render output: " << renderPath << "\n";
             return 1;
         }
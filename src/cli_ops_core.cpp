@@ -6,156 +6,46 @@
 #include "cli_parse.h"
 #include "cli_shared.h"
 
-#include "bmp.h"
+#include "codec.h"
 #include "drawable.h"
-#include "gif.h"
-#include "jpg.h"
-#include "png.h"
-#include "resize.h"
+#include "generator.h"
+#include "parallel.h"
+#include "resample.h"
 #include "svg.h"
-#include "webp.h"
 
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <cmath>
 #include <cstdint>
 #include <deque>
 #include <limits>
-#include <random>
+#include <sstream>
 #include <stdexcept>
 #include <string>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
 namespace {
-float clamp01(float value) {
-    return std::max(0.0f, std::min(1.0f, value));
+// These ops always edit the image, whatever target= says.
+std::unordered_map<std::string, std::string> imageOnly(const std::unordered_map<std::string, std::string>& kv) {
+    std::unordered_map<std::string, std::string> options = kv;
+    options.erase("target");
+    return options;
 }
 
-std::uint8_t clampByte(int value) {
-    if (value < 0) {
-        return 0;
-    }
-    if (value > 255) {
-        return 255;
-    }
-    return static_cast<std::uint8_t>(value);
-}
-
-PixelRGBA8 lerpPixel(const PixelRGBA8& a, const PixelRGBA8& b, float t) {
-    const float clamped = clamp01(t);
-    const float inv = 1.0f - clamped;
-    return PixelRGBA8(
-        clampByte(static_cast<int>(std::lround(inv * static_cast<float>(a.r) + clamped * static_cast<float>(b.r)))),
-        clampByte(static_cast<int>(std::lround(inv * static_cast<float>(a.g) + clamped * static_cast<float>(b.g)))),
-        clampByte(static_cast<int>(std::lround(inv * static_cast<float>(a.b) + clamped * static_cast<float>(b.b)))),
-        clampByte(static_cast<int>(std::lround(inv * static_cast<float>(a.a) + clamped * static_cast<float>(b.a)))));
-}
-
-void applyLinearGradientToLayer(Layer& layer,
-                                const PixelRGBA8& fromColor,
-                                const PixelRGBA8& toColor,
-                                double x0,
-                                double y0,
-                                double x1,
-                                double y1) {
-    ImageBuffer& image = layer.image();
-    const double dx = x1 - x0;
-    const double dy = y1 - y0;
-    const double denom = (dx * dx) + (dy * dy);
-
-    if (denom <= 0.0) {
-        image.fill(fromColor);
+// Lazy pixels when the op covers the whole image, otherwise rendered into
+// the target now.
+void applyGenerator(Layer& layer, const std::unordered_map<std::string, std::string>& kv, const LayerGenerator& generator) {
+    if (kv.find("region") == kv.end()) {
+        ImageBuffer& image = layer.image();
+        image = generatedImage(image.width(), image.height(), generator);
         return;
     }
-
-    for (int y = 0; y < image.height(); ++y) {
-        for (int x = 0; x < image.width(); ++x) {
-            const double proj = ((static_cast<double>(x) - x0) * dx + (static_cast<double>(y) - y0) * dy) / denom;
-            const float t = clamp01(static_cast<float>(proj));
-            image.setPixel(x, y, lerpPixel(fromColor, toColor, t));
-        }
-    }
-}
-
-void applyRadialGradientToLayer(Layer& layer,
-                                const PixelRGBA8& innerColor,
-                                const PixelRGBA8& outerColor,
-                                double cx,
-                                double cy,
-                                double radius) {
-    if (radius <= 0.0) {
-        throw std::runtime_error("gradient-layer radial radius must be > 0");
-    }
-
-    ImageBuffer& image = layer.image();
-    for (int y = 0; y < image.height(); ++y) {
-        for (int x = 0; x < image.width(); ++x) {
-            const double dx = static_cast<double>(x) - cx;
-            const double dy = static_cast<double>(y) - cy;
-            const double dist = std::sqrt((dx * dx) + (dy * dy));
-            const float t = clamp01(static_cast<float>(dist / radius));
-            image.setPixel(x, y, lerpPixel(innerColor, outerColor, t));
-        }
-    }
-}
-
-void applyCheckerToLayer(Layer& layer,
-                         int cellWidth,
-                         int cellHeight,
-                         const PixelRGBA8& colorA,
-                         const PixelRGBA8& colorB,
-                         int offsetX,
-                         int offsetY) {
-    if (cellWidth <= 0 || cellHeight <= 0) {
-        throw std::runtime_error("checker-layer requires cell_width>0 and cell_height>0");
-    }
-
-    ImageBuffer& image = layer.image();
-    for (int y = 0; y < image.height(); ++y) {
-        for (int x = 0; x < image.width(); ++x) {
-            const int shiftedX = x + offsetX;
-            const int shiftedY = y + offsetY;
-            const int cellX = static_cast<int>(std::floor(static_cast<double>(shiftedX) / static_cast<double>(cellWidth)));
-            const int cellY = static_cast<int>(std::floor(static_cast<double>(shiftedY) / static_cast<double>(cellHeight)));
-            const bool useA = ((cellX + cellY) % 2) == 0;
-            image.setPixel(x, y, useA ? colorA : colorB);
-        }
-    }
-}
-
-void applyNoiseToLayer(Layer& layer,
-                       std::uint32_t seed,
-                       float amount,
-                       bool monochrome,
-                       bool affectAlpha) {
-    const float mix = clamp01(amount);
-    if (mix <= 0.0f) {
-        return;
-    }
-
-    std::mt19937 rng(seed);
-    std::uniform_int_distribution<int> jitter(-128, 128);
-    ImageBuffer& image = layer.image();
-    for (int y = 0; y < image.height(); ++y) {
-        for (int x = 0; x < image.width(); ++x) {
-            const PixelRGBA8 src = image.getPixel(x, y);
-            const int baseNoise = jitter(rng);
-            const int rNoise = monochrome ? baseNoise : jitter(rng);
-            const int gNoise = monochrome ? baseNoise : jitter(rng);
-            const int bNoise = monochrome ? baseNoise : jitter(rng);
-            const int aNoise = monochrome ? baseNoise : jitter(rng);
-
-            const int outR = static_cast<int>(std::lround(static_cast<float>(src.r) + mix * static_cast<float>(rNoise)));
-            const int outG = static_cast<int>(std::lround(static_cast<float>(src.g) + mix * static_cast<float>(gNoise)));
-            const int outB = static_cast<int>(std::lround(static_cast<float>(src.b) + mix * static_cast<float>(bNoise)));
-            const int outA = affectAlpha
-                                 ? static_cast<int>(std::lround(static_cast<float>(src.a) + mix * static_cast<float>(aNoise)))
-                                 : static_cast<int>(src.a);
-
-            image.setPixel(x, y, PixelRGBA8(clampByte(outR), clampByte(outG), clampByte(outB), clampByte(outA)));
-        }
-    }
+    applyInRegion(layer, imageOnly(kv), 0, [&](ImageBuffer& target, const OpWindow& window) {
+        generator.render(target.view(), window.originX, window.originY);
+    });
 }
 
 BlendMode parseBlendMode(const std::string& value) {
@@ -173,56 +63,47 @@ BlendMode parseBlendMode(const std::string& value) {
     throw std::runtime_error("Unsupported blend mode: " + value);
 }
 
-std::unordered_map<std::string, std::string> parseKeyValues(const std::vector<std::string>& tokens, std::size_t startIndex) {
-    std::unordered_map<std::string, std::string> kv;
-    for (std::size_t i = startIndex; i < tokens.size(); ++i) {
-        const std::size_t split = tokens[i].find('=');
-        if (split == std::string::npos || split == 0 || split + 1 >= tokens[i].size()) {
-            throw std::runtime_error("Expected key=value token but got: " + tokens[i]);
-        }
-        kv[tokens[i].substr(0, split)] = tokens[i].substr(split + 1);
-    }
-    return kv;
-}
-
-ResizeFilter parseResizeFilter(const std::string& value) {
-    const std::string lowered = toLower(value);
-    if (lowered == "nearest") return ResizeFilter::Nearest;
-    if (lowered == "bilinear") return ResizeFilter::Bilinear;
-    if (lowered == "box" || lowered == "boxaverage" || lowered == "box_average") return ResizeFilter::BoxAverage;
-    throw std::runtime_error("Unsupported resize filter: " + value);
+// Raster imports keep the source size unless width= and height= are both
+// given; crop=x,y,w,h first takes a rectangle of the source, and filter=
+// picks how it is scaled.
+DecodeOptions rasterImportOptions(const std::unordered_map<std::string, std::string>& kv) {
+    DecodeOptions options;
+    const auto widthIt = kv.find("width");
+    const auto heightIt = kv.find("height");
+    if (widthIt != kv.end() || heightIt != kv.end()) {
+        if (widthIt == kv.end() || heightIt == kv.end()) {
+            throw std::runtime_error("import-image requires width= and height= together for raster files");
+        }
+        options.targetWidth = parseIntInRange(widthIt->second, "width", 1, std::numeric_limits<int>::max());
+        options.targetHeight = parseIntInRange(heightIt->second, "height", 1, std::numeric_limits<int>::max());
+    }
+    if (kv.find("filter") != kv.end()) {
+        options.filter = parseResampleFilter(kv.at("filter"));
+    }
+    const auto cropIt = kv.find("crop");
+    if (cropIt != kv.end()) {
+        const std::vector<std::string> parts = splitByChar(cropIt->second, ',');
+        if (parts.size() != 4) {
+            throw std::runtime_error("crop= expects x,y,w,h");
+        }
+        options.regionX = parseIntInRange(parts[0], "crop x", 0, std::numeric_limits<int>::max());
+        options.regionY = parseIntInRange(parts[1], "crop y", 0, std::numeric_limits<int>::max());
+        options.regionWidth = parseIntInRange(parts[2], "crop width", 1, std::numeric_limits<int>::max());
+        options.regionHeight = parseIntInRange(parts[3], "crop height", 1, std::numeric_limits<int>::max());
+    }
+    return options;
 }
 
-void importImageIntoLayer(Layer& layer, const std::string& imagePath, std::uint8_t alpha, const std::unordered_map<std::string, std::string>& kv) {
-    const std::string ext = extensionLower(imagePath);
-    if (ext == "png") {
-        layer.setImageFromRaster(PNGImage::load(imagePath), alpha);
-        return;
-    }
-    if (ext == "bmp") {
-        layer.setImageFromRaster(BMPImage::load(imagePath), alpha);
-        return;
-    }
-    if (ext == "jpg" || ext == "jpeg") {
-        layer.setImageFromRaster(JPGImage::load(imagePath), alpha);
-        return;
-    }
-    if (ext == "gif") {
-        layer.setImageFromRaster(GIFImage::load(imagePath), alpha);
-        return;
-    }
-    if (ext == "webp") {
-        if (!WEBPImage::isToolingAvailable()) {
-            throw std::runtime_error("WebP tooling unavailable (install cwebp and dwebp)");
-        }
-        layer.setImageFromRaster(WEBPImage::load(imagePath), alpha);
-        return;
-    }
-    if (ext == "svg") {
-        int rasterWidth = layer.image().width();
-        int rasterHeight = layer.image().height();
+void importImageIntoLayer(Layer& layer,
+                          const std::string& imagePath,
+                          std::uint8_t alpha,
+                          const std::unordered_map<std::string, std::string>& kv,
+                          const ImageLoader& loadImage) {
+    if (extensionLower(imagePath) == "svg") {
         const auto widthIt = kv.find("width");
         const auto heightIt = kv.find("height");
+        int rasterWidth = layer.image().width();
+        int rasterHeight = layer.image().height();
         if (widthIt != kv.end()) {
             rasterWidth = std::stoi(widthIt->second);
         }
@@ -230,32 +111,38 @@ void importImageIntoLayer(Layer& layer, const std::string& imagePath, std::uint8
             rasterHeight = std::stoi(heightIt->second);
         }
         SVGImage svg = SVGImage::load(imagePath, rasterWidth, rasterHeight);
-        ImageBuffer buffer(svg.width(), svg.height(), PixelRGBA8(0, 0, 0, alpha));
-        for (int y = 0; y < svg.height(); ++y) {
-            for (int x = 0; x < svg.width(); ++x) {
-                const Color& c = svg.getPixel(x, y);
-                buffer.setPixel(x, y, PixelRGBA8(c.r, c.g, c.b, alpha));
-            }
-        }
-        layer.image() = buffer;
-        if (layer.hasMask()) {
-            layer.clearMask();
-        }
+        ImageBuffer buffer(svg.width(), svg.height());
+        const Color* src = svg.data();
+        PixelRGBA8* dst = buffer.data();
+        const std::size_t count = static_cast<std::size_t>(svg.width()) * static_cast<std::size_t>(svg.height());
+        for (std::size_t i = 0; i < count; ++i) {
+            dst[i] = PixelRGBA8(src[i].r, src[i].g, src[i].b, alpha);
+        }
+        layer.setImage(std::move(buffer));
         return;
     }
-    throw std::runtime_error("Unsupported import extension: " + ext);
-}
 
-void resizeLayer(Layer& layer, int width, int height, ResizeFilter filter) {
-    PNGImage source(layer.image().width(), layer.image().height(), Color(0, 0, 0));
-    for (int y = 0; y < source.height(); ++y) {
-        for (int x = 0; x < source.width(); ++x) {
-            const PixelRGBA8& p = layer.image().getPixel(x, y);
-            source.setPixel(x, y, Color(p.r, p.g, p.b));
+    const DecodeOptions options = rasterImportOptions(kv);
+    ImageBuffer image = loadImage ? loadImage(imagePath, options) : decodeImageFile(imagePath, options);
+    if (alpha != 255) {
+        PixelRGBA8* pixels = image.data();
+        const std::size_t count = static_cast<std::size_t>(image.width()) * static_cast<std::size_t>(image.height());
+        for (std::size_t i = 0; i < count; ++i) {
+            pixels[i].a = static_cast<std::uint8_t>((pixels[i].a * alpha + 127) / 255);
         }
     }
-    PNGImage resized = resizeImage(source, width, height, filter);
-    layer.setImageFromRaster(resized, 255);
+    layer.setImage(std::move(image));
+}
+
+// Alpha and any mask are resampled along with the colors.
+void resizeLayer(Layer& layer, int width, int height, ResampleFilter filter, int threads) {
+    const Layer& source = layer;
+    const bool hasMask = source.hasMask();
+    const ImageBuffer mask = hasMask ? resampleBuffer(source.mask().toImage(), width, height, threads, filter) : ImageBuffer();
+    layer.setImage(resampleBuffer(source.image(), width, height, threads, filter));
+    if (hasMask) {
+        layer.setMask(MaskBuffer::fromImage(mask));
+    }
 }
 
 Transform2D buildTransformFromKV(const std::unordered_map<std::string, std::string>& kv) {
@@ -306,40 +193,31 @@ Transform2D buildTransformFromKV(const std::unordered_map<std::string, std::stri
     return transform;
 }
 
-} // namespace
-
-void applyDocumentOperation(Document& document, const std::string& opSpec, const std::function<void(const std::string&)>& emitOutput) {
-    const std::vector<std::string> tokens = tokenizeOpSpec(opSpec);
-    if (tokens.empty()) {
-        throw std::runtime_error("Empty --op value");
-    }
-
-    const std::string action = tokens[0];
-    const std::unordered_map<std::string, std::string> kv = parseKeyValues(tokens, 1);
-
-    enum class ActionType {
-        Unknown,
-        AddLayer,
-        AddGridLayers,
-        AddGroup,
-        SetLayer,
-        SetGroup,
-        SetTransform,
-        ConcatTransform,
-        ClearTransform,
-        GradientLayer,
-        CheckerLayer,
-        NoiseLayer,
-        FillLayer,
-        SetPixel,
-        MaskEnable,
-        MaskClear,
-        MaskSetPixel,
-        ImportImage,
-        ResizeLayer,
-        Emit,
-    };
-
+enum class ActionType {
+    Unknown,
+    AddLayer,
+    AddGridLayers,
+    AddGroup,
+    SetLayer,
+    SetGroup,
+    SetTransform,
+    ConcatTransform,
+    ClearTransform,
+    GradientLayer,
+    CheckerLayer,
+    NoiseLayer,
+    FillLayer,
+    SetPixel,
+    MaskEnable,
+    MaskClear,
+    MaskSetPixel,
+    ImportImage,
+    ResizeLayer,
+    Emit,
+    EmitFrame,
+};
+
+ActionType coreActionType(const std::string& action) {
     static const std::unordered_map<std::string, ActionType> actionTypes = {
         {"add-layer", ActionType::AddLayer},
         {"add-grid-layers", ActionType::AddGridLayers},
@@ -360,14 +238,80 @@ void applyDocumentOperation(Document& document, const std::string& opSpec, const
         {"import-image", ActionType::ImportImage},
         {"resize-layer", ActionType::ResizeLayer},
         {"emit", ActionType::Emit},
+        {"emit-frame", ActionType::EmitFrame},
     };
     const auto actionTypeIt = actionTypes.find(action);
-    const ActionType actionType = actionTypeIt == actionTypes.end() ? ActionType::Unknown : actionTypeIt->second;
+    return actionTypeIt == actionTypes.end() ? ActionType::Unknown : actionTypeIt->second;
+}
+
+} // namespace
+
+CompiledOp compileOp(const std::string& opSpec) {
+    const std::vector<std::string> tokens = tokenizeOpSpec(opSpec);
+    if (tokens.empty()) {
+        throw std::runtime_error("Empty --op value");
+    }
+
+    CompiledOp op;
+    op.action = tokens[0];
+    op.kv = parseKeyValues(tokens, 1);
+    const ActionType actionType = coreActionType(op.action);
+    if (actionType == ActionType::Unknown && !isEffectsAction(op.action) && !isDrawAction(op.action)) {
+        throw std::runtime_error("Unknown op action: " + op.action);
+    }
+    if (actionType == ActionType::SetPixel || actionType == ActionType::MaskSetPixel) {
+        const auto& kv = op.kv;
+        if (kv.find("path") == kv.end() || kv.find("x") == kv.end() || kv.find("y") == kv.end() || kv.find("rgba") == kv.end()) {
+            throw std::runtime_error(op.action + " requires path= x= y= rgba=");
+        }
+        op.x = std::stoi(kv.at("x"));
+        op.y = std::stoi(kv.at("y"));
+        op.rgba = parseRGBA(kv.at("rgba"));
+    }
+    switch (actionType) {
+    case ActionType::GradientLayer:
+    case ActionType::CheckerLayer:
+    case ActionType::NoiseLayer:
+    case ActionType::FillLayer:
+    case ActionType::SetPixel:
+    case ActionType::MaskEnable:
+    case ActionType::MaskClear:
+    case ActionType::MaskSetPixel:
+    case ActionType::ResizeLayer:
+        op.singleLayer = true;
+        break;
+    case ActionType::Unknown:
+        op.singleLayer = isEffectsAction(op.action) || isDrawAction(op.action);
+        break;
+    default:
+        break;
+    }
+    return op;
+}
 
-    if (tryApplyEffectsOperation(action, document, kv)) {
+void applyDocumentOperation(Document& document,
+                            const std::string& opSpec,
+                            const std::function<void(const std::string&, double)>& emitOutput,
+                            const std::function<void(int)>& emitFrame,
+                            const ImageLoader& loadImage,
+                            int threads) {
+    applyDocumentOperation(document, compileOp(opSpec), emitOutput, emitFrame, loadImage, threads);
+}
+
+void applyDocumentOperation(Document& document,
+                            const CompiledOp& op,
+                            const std::function<void(const std::string&, double)>& emitOutput,
+                            const std::function<void(int)>& emitFrame,
+                            const ImageLoader& loadImage,
+                            int threads) {
+    const std::string& action = op.action;
+    const std::unordered_map<std::string, std::string>& kv = op.kv;
+    const ActionType actionType = coreActionType(action);
+
+    if (tryApplyEffectsOperation(action, document, kv, threads)) {
         return;
     }
-    if (tryApplyDrawOperation(action, document, kv)) {
+    if (tryApplyDrawOperation(action, document, kv, threads)) {
         return;
     }
 
@@ -379,7 +323,7 @@ void applyDocumentOperation(Document& document, const std::string& opSpec, const
         const int width = kv.find("width") == kv.end() ? document.width() : std::stoi(kv.at("width"));
         const int height = kv.find("height") == kv.end() ? document.height() : std::stoi(kv.at("height"));
         const PixelRGBA8 fill = kv.find("fill") == kv.end() ? PixelRGBA8(0, 0, 0, 0) : parseRGBA(kv.at("fill"));
-        resolveGroupPath(document, parentPath).addLayer(Layer(name, width, height, fill));
+        resolveGroupPath(document, parentPath).emplaceLayer(name, width, height, fill);
         return;
     }
 
@@ -439,11 +383,10 @@ void applyDocumentOperation(Document& document, const std::string& opSpec, const
                 const PixelRGBA8 fill = fillSequence.empty() ? defaultFill : fillSequence[sequenceIndex % static_cast<int>(fillSequence.size())];
                 const BlendMode layerBlend = blendSequence.empty() ? blend : blendSequence[sequenceIndex % static_cast<int>(blendSequence.size())];
 
-                Layer layer(prefix + "_" + std::to_string(row) + "_" + std::to_string(col), innerWidth, innerHeight, fill);
+                Layer& layer = group.emplaceLayer(prefix + "_" + std::to_string(row) + "_" + std::to_string(col), innerWidth, innerHeight, fill);
                 layer.setOpacity(opacity);
                 layer.setBlendMode(layerBlend);
                 layer.setOffset(x, y);
-                group.addLayer(layer);
                 ++sequenceIndex;
             }
         }
@@ -454,7 +397,7 @@ void applyDocumentOperation(Document& document, const std::string& opSpec, const
         const auto parentIt = kv.find("parent");
         const std::string parentPath = parentIt == kv.end() ? "/" : parentIt->second;
         const std::string name = kv.find("name") == kv.end() ? "Group" : kv.at("name");
-        resolveGroupPath(document, parentPath).addGroup(LayerGroup(name));
+        resolveGroupPath(document, parentPath).emplaceGroup(name);
         return;
     }
 
@@ -541,29 +484,44 @@ void applyDocumentOperation(Document& document, const std::string& opSpec, const
         }
         Layer& layer = resolveLayerPath(document, kv.at("path"));
         const std::string type = kv.find("type") == kv.end() ? "linear" : toLower(kv.at("type"));
-        const PixelRGBA8 fromColor = kv.find("from") == kv.end() ? PixelRGBA8(0, 0, 0, 255) : parseRGBA(kv.at("from"), true);
-        const PixelRGBA8 toColor = kv.find("to") == kv.end() ? PixelRGBA8(255, 255, 255, 255) : parseRGBA(kv.at("to"), true);
+        LayerGenerator generator;
+        generator.from = kv.find("from") == kv.end() ? PixelRGBA8(0, 0, 0, 255) : parseRGBA(kv.at("from"), true);
+        generator.to = kv.find("to") == kv.end() ? PixelRGBA8(255, 255, 255, 255) : parseRGBA(kv.at("to"), true);
+        const int width = layer.image().width();
+        const int height = layer.image().height();
 
         if (type == "linear") {
             const std::pair<double, double> fromPoint = kv.find("from_point") == kv.end()
                                                              ? std::pair<double, double>(0.0, 0.0)
                                                              : parseDoublePair(kv.at("from_point"));
             const std::pair<double, double> toPoint = kv.find("to_point") == kv.end()
-                                                           ? std::pair<double, double>(static_cast<double>(layer.image().width() - 1),
-                                                                                      static_cast<double>(layer.image().height() - 1))
+                                                           ? std::pair<double, double>(static_cast<double>(width - 1),
+                                                                                      static_cast<double>(height - 1))
                                                            : parseDoublePair(kv.at("to_point"));
-            applyLinearGradientToLayer(layer, fromColor, toColor, fromPoint.first, fromPoint.second, toPoint.first, toPoint.second);
+            generator.kind = LayerGenerator::Kind::LinearGradient;
+            generator.x0 = fromPoint.first;
+            generator.y0 = fromPoint.second;
+            generator.x1 = toPoint.first;
+            generator.y1 = toPoint.second;
+            applyGenerator(layer, kv, generator);
             return;
         }
 
         if (type == "radial") {
             const std::pair<double, double> center = kv.find("center") == kv.end()
-                                                          ? std::pair<double, double>(static_cast<double>(layer.image().width()) / 2.0,
-                                                                                     static_cast<double>(layer.image().height()) / 2.0)
+                                                          ? std::pair<double, double>(static_cast<double>(width) / 2.0,
+                                                                                     static_cast<double>(height) / 2.0)
                                                           : parseDoublePair(kv.at("center"));
-            const double defaultRadius = static_cast<double>(std::min(layer.image().width(), layer.image().height())) * 0.5;
+            const double defaultRadius = static_cast<double>(std::min(width, height)) * 0.5;
             const double radius = kv.find("radius") == kv.end() ? defaultRadius : std::stod(kv.at("radius"));
-            applyRadialGradientToLayer(layer, fromColor, toColor, center.first, center.second, radius);
+            if (radius <= 0.0) {
+                throw std::runtime_error("gradient-layer radial radius must be > 0");
+            }
+            generator.kind = LayerGenerator::Kind::RadialGradient;
+            generator.x0 = center.first;
+            generator.y0 = center.second;
+            generator.x1 = radius;
+            applyGenerator(layer, kv, generator);
             return;
         }
 
@@ -575,14 +533,19 @@ void applyDocumentOperation(Document& document, const std::string& opSpec, const
             throw std::runtime_error("checker-layer requires path=");
         }
         Layer& layer = resolveLayerPath(document, kv.at("path"));
-        const int cellWidth = kv.find("cell_width") == kv.end() ? (kv.find("cell") == kv.end() ? 32 : std::stoi(kv.at("cell")))
+        LayerGenerator generator;
+        generator.kind = LayerGenerator::Kind::Checker;
+        generator.cellWidth = kv.find("cell_width") == kv.end() ? (kv.find("cell") == kv.end() ? 32 : std::stoi(kv.at("cell")))
                                                                  : std::stoi(kv.at("cell_width"));
-        const int cellHeight = kv.find("cell_height") == kv.end() ? cellWidth : std::stoi(kv.at("cell_height"));
-        const PixelRGBA8 colorA = kv.find("a") == kv.end() ? PixelRGBA8(0, 0, 0, 255) : parseRGBA(kv.at("a"), true);
-        const PixelRGBA8 colorB = kv.find("b") == kv.end() ? PixelRGBA8(255, 255, 255, 255) : parseRGBA(kv.at("b"), true);
-        const int offsetX = kv.find("offset_x") == kv.end() ? 0 : std::stoi(kv.at("offset_x"));
-        const int offsetY = kv.find("offset_y") == kv.end() ? 0 : std::stoi(kv.at("offset_y"));
-        applyCheckerToLayer(layer, cellWidth, cellHeight, colorA, colorB, offsetX, offsetY);
+        generator.cellHeight = kv.find("cell_height") == kv.end() ? generator.cellWidth : std::stoi(kv.at("cell_height"));
+        generator.from = kv.find("a") == kv.end() ? PixelRGBA8(0, 0, 0, 255) : parseRGBA(kv.at("a"), true);
+        generator.to = kv.find("b") == kv.end() ? PixelRGBA8(255, 255, 255, 255) : parseRGBA(kv.at("b"), true);
+        generator.offsetX = kv.find("offset_x") == kv.end() ? 0 : std::stoi(kv.at("offset_x"));
+        generator.offsetY = kv.find("offset_y") == kv.end() ? 0 : std::stoi(kv.at("offset_y"));
+        if (generator.cellWidth <= 0 || generator.cellHeight <= 0) {
+            throw std::runtime_error("checker-layer requires cell_width>0 and cell_height>0");
+        }
+        applyGenerator(layer, kv, generator);
         return;
     }
 
@@ -591,11 +554,32 @@ void applyDocumentOperation(Document& document, const std::string& opSpec, const
             throw std::runtime_error("noise-layer requires path=");
         }
         Layer& layer = resolveLayerPath(document, kv.at("path"));
-        const std::uint32_t seed = kv.find("seed") == kv.end() ? 1337u : static_cast<std::uint32_t>(std::stoul(kv.at("seed")));
-        const float amount = kv.find("amount") == kv.end() ? 0.2f : std::stof(kv.at("amount"));
-        const bool monochrome = kv.find("monochrome") == kv.end() ? false : parseBoolFlag(kv.at("monochrome"));
-        const bool affectAlpha = kv.find("affect_alpha") == kv.end() ? false : parseBoolFlag(kv.at("affect_alpha"));
-        applyNoiseToLayer(layer, seed, amount, monochrome, affectAlpha);
+        NoisePass pass;
+        pass.seed = kv.find("seed") == kv.end() ? 1337u : static_cast<std::uint32_t>(std::stoul(kv.at("seed")));
+        pass.amount = kv.find("amount") == kv.end() ? 0.2f : std::stof(kv.at("amount"));
+        pass.monochrome = kv.find("monochrome") == kv.end() ? false : parseBoolFlag(kv.at("monochrome"));
+        pass.affectAlpha = kv.find("affect_alpha") == kv.end() ? false : parseBoolFlag(kv.at("affect_alpha"));
+        // Noise over generated or solid pixels stays a generator.
+        const Layer& current = layer;
+        LayerGenerator generator;
+        const LayerGenerator* existing = imageGenerator(current.image());
+        if (kv.find("region") == kv.end() && (existing || current.image().trySolidColor(generator.from))) {
+            if (existing) {
+                generator = *existing;
+            }
+            generator.noise.push_back(pass);
+            applyGenerator(layer, kv, generator);
+            return;
+        }
+        applyInRegion(layer, imageOnly(kv), 0, [&](ImageBuffer& target, const OpWindow& window) {
+            const ImageView view = target.view();
+            parallelFor(view.height(), threads, [&](int y) {
+                PixelRGBA8* row = view.row(y);
+                for (int x = 0; x < view.width(); ++x) {
+                    pass.apply(row[x], x + window.originX, y + window.originY);
+                }
+            });
+        });
         return;
     }
 
@@ -604,16 +588,17 @@ void applyDocumentOperation(Document& document, const std::string& opSpec, const
             throw std::runtime_error("fill-layer requires path= and rgba=");
         }
         Layer& layer = resolveLayerPath(document, kv.at("path"));
-        layer.image().fill(parseRGBA(kv.at("rgba")));
+        const PixelRGBA8 color = parseRGBA(kv.at("rgba"));
+        if (kv.find("region") == kv.end()) {
+            layer.image().fill(color);
+            return;
+        }
+        applyInRegion(layer, imageOnly(kv), 0, [&](ImageBuffer& target, const OpWindow&) { target.fill(color); });
         return;
     }
 
     case ActionType::SetPixel: {
-        if (kv.find("path") == kv.end() || kv.find("x") == kv.end() || kv.find("y") == kv.end() || kv.find("rgba") == kv.end()) {
-            throw std::runtime_error("set-pixel requires path= x= y= rgba=");
-        }
-        Layer& layer = resolveLayerPath(document, kv.at("path"));
-        layer.image().setPixel(std::stoi(kv.at("x")), std::stoi(kv.at("y")), parseRGBA(kv.at("rgba")));
+        resolveLayerPath(document, kv.at("path")).image().setPixel(op.x, op.y, op.rgba);
         return;
     }
 
@@ -636,14 +621,11 @@ void applyDocumentOperation(Document& document, const std::string& opSpec, const
     }
 
     case ActionType::MaskSetPixel: {
-        if (kv.find("path") == kv.end() || kv.find("x") == kv.end() || kv.find("y") == kv.end() || kv.find("rgba") == kv.end()) {
-            throw std::runtime_error("mask-set-pixel requires path= x= y= rgba=");
-        }
         Layer& layer = resolveLayerPath(document, kv.at("path"));
         if (!layer.hasMask()) {
             layer.ensureMask();
         }
-        layer.maskOrThrow().setPixel(std::stoi(kv.at("x")), std::stoi(kv.at("y")), parseRGBA(kv.at("rgba")));
+        layer.maskOrThrow().setPixel(op.x, op.y, op.rgba);
         return;
     }
 
@@ -653,7 +635,7 @@ void applyDocumentOperation(Document& document, const std::string& opSpec, const
         }
         Layer& layer = resolveLayerPath(document, kv.at("path"));
         const std::uint8_t alpha = kv.find("alpha") == kv.end() ? 255 : parseByte(kv.at("alpha"), "alpha");
-        importImageIntoLayer(layer, kv.at("file"), alpha, kv);
+        importImageIntoLayer(layer, kv.at("file"), alpha, kv, loadImage);
         return;
     }
 
@@ -662,11 +644,11 @@ void applyDocumentOperation(Document& document, const std::string& opSpec, const
             throw std::runtime_error("resize-layer requires path= width= height=");
         }
         Layer& layer = resolveLayerPath(document, kv.at("path"));
-        const ResizeFilter filter = kv.find("filter") == kv.end() ? ResizeFilter::Bilinear : parseResizeFilter(kv.at("filter"));
+        const ResampleFilter filter = kv.find("filter") == kv.end() ? ResampleFilter::Bilinear : parseResampleFilter(kv.at("filter"));
         resizeLayer(layer,
                     parseIntInRange(kv.at("width"), "width", 1, std::numeric_limits<int>::max()),
                     parseIntInRange(kv.at("height"), "height", 1, std::numeric_limits<int>::max()),
-                    filter);
+                    filter, threads);
         return;
     }
 
@@ -680,7 +662,21 @@ void applyDocumentOperation(Document& document, const std::string& opSpec, const
         if (outputPath.empty()) {
             throw std::runtime_error("emit requires file= (or out=)");
         }
-        emitOutput(outputPath);
+        const auto scaleIt = kv.find("scale");
+        const double scale = scaleIt == kv.end() ? 1.0 : parseDoubleStrict(scaleIt->second, "scale");
+        if (!(scale > 0.0 && scale <= 1.0)) {
+            throw std::runtime_error("emit scale must be in (0, 1]");
+        }
+        emitOutput(outputPath, scale);
+        return;
+    }
+
+    case ActionType::EmitFrame: {
+        if (!emitFrame) {
+            throw std::runtime_error("emit-frame requires --animate <out.gif>");
+        }
+        const auto delayIt = kv.find("delay");
+        emitFrame(delayIt == kv.end() ? -1 : parseIntInRange(delayIt->second, "delay", 0, 65535));
         return;
     }
 
@@ -691,3 +687,245 @@ void applyDocumentOperation(Document& document, const std::string& opSpec, const
 
     throw std::runtime_error("Unknown op action: " + action);
 }
+
+bool rasterImportRequest(const CompiledOp& op, std::string& path, DecodeOptions& options) {
+    if (op.action != "import-image") {
+        return false;
+    }
+    const auto fileIt = op.kv.find("file");
+    if (fileIt == op.kv.end() || extensionLower(fileIt->second) == "svg") {
+        return false;
+    }
+    path = fileIt->second;
+    options = rasterImportOptions(op.kv);
+    return true;
+}
+
+std::string importedFilePath(const CompiledOp& op) {
+    if (op.action != "import-image") {
+        return "";
+    }
+    const auto fileIt = op.kv.find("file");
+    return fileIt == op.kv.end() ? "" : fileIt->second;
+}
+
+std::size_t applyFusedPointOps(Document& document, const std::vector<CompiledOp>& program, std::size_t first, int threads) {
+    PointOpProgram fused;
+    std::size_t end = first;
+    while (end < program.size()) {
+        try {
+            if (!fused.append(program[end].action, program[end].kv)) {
+                break;
+            }
+        } catch (const std::exception&) {
+            // The op reports its own error when it runs by itself.
+            break;
+        }
+        ++end;
+    }
+    if (fused.opCount() < 2) {
+        return first;
+    }
+    fused.apply(resolveLayerPath(document, fused.layerPath()).image(), threads);
+    return end;
+}
+
+std::size_t applyBatchedDrawOps(Document& document, const std::vector<CompiledOp>& program, std::size_t first, int threads) {
+    const auto target = [](const std::unordered_map<std::string, std::string>& values) {
+        return values.find("target") == values.end() ? std::string("image") : toLower(values.at("target"));
+    };
+    const std::unordered_map<std::string, std::string>& firstKv = program[first].kv;
+    DisplayList list;
+    std::size_t end = first;
+    while (end < program.size()) {
+        const std::unordered_map<std::string, std::string>& kv = program[end].kv;
+        try {
+            if (end > first && (kv.find("path") == kv.end() || kv.at("path") != firstKv.at("path") || target(kv) != target(firstKv))) {
+                break;
+            }
+            if (!recordDrawOperation(list, program[end].action, kv)) {
+                break;
+            }
+        } catch (const std::exception&) {
+            // The op reports its own error when it runs by itself.
+            break;
+        }
+        ++end;
+    }
+    if (end - first < 2) {
+        return first;
+    }
+    replayDrawOperations(document, list, firstKv, threads);
+    return end;
+}
+
+std::size_t applyPixelOps(Document& document, const std::vector<CompiledOp>& program, std::size_t first) {
+    const CompiledOp& head = program[first];
+    const bool mask = head.action == "mask-set-pixel";
+    if (!mask && head.action != "set-pixel") {
+        return first;
+    }
+    const std::string& path = head.kv.at("path");
+    std::size_t end = first;
+    while (end < program.size() && program[end].action == head.action && program[end].kv.at("path") == path) {
+        ++end;
+    }
+    if (end - first < 2) {
+        return first;
+    }
+    Layer& layer = resolveLayerPath(document, path);
+    if (mask && !layer.hasMask()) {
+        layer.ensureMask();
+    }
+    // An out of bounds write ends the run, so that op reports its own error.
+    for (std::size_t i = first; i < end; ++i) {
+        const CompiledOp& op = program[i];
+        if (mask) {
+            MaskBuffer& target = layer.maskOrThrow();
+            if (!target.inBounds(op.x, op.y)) {
+                return i;
+            }
+            target.setPixel(op.x, op.y, op.rgba);
+        } else if (!layer.image().trySetPixel(op.x, op.y, op.rgba)) {
+            return i;
+        }
+    }
+    return end;
+}
+
+std::size_t applyOpRun(Document& document, const std::vector<CompiledOp>& program, std::size_t first, int threads) {
+    std::size_t end = applyPixelOps(document, program, first);
+    if (end == first) {
+        end = applyFusedPointOps(document, program, first, threads);
+    }
+    if (end == first) {
+        end = applyBatchedDrawOps(document, program, first, threads);
+    }
+    return end;
+}
+
+std::size_t applyIndependentOps(Document& document, const std::vector<CompiledOp>& program, std::size_t first, int threads,
+                                bool rollback) {
+    if (resolveThreadCount(threads) < 2) {
+        return first;
+    }
+    // Paths cannot change before the next structure op, so each one is
+    // resolved once; ops that fail to resolve end the run and report it.
+    std::unordered_map<std::string, Layer*> layerAt;
+    std::unordered_map<const Layer*, std::size_t> laneOf;
+    std::vector<Layer*> laneLayers;
+    std::vector<std::vector<std::size_t>> lanes;
+    std::size_t end = first;
+    for (; end < program.size() && program[end].singleLayer; ++end) {
+        const auto pathIt = program[end].kv.find("path");
+        if (pathIt == program[end].kv.end()) {
+            break;
+        }
+        auto layerIt = layerAt.find(pathIt->second);
+        if (layerIt == layerAt.end()) {
+            try {
+                layerIt = layerAt.emplace(pathIt->second, &resolveLayerPath(document, pathIt->second)).first;
+            } catch (const std::exception&) {
+                break;
+            }
+        }
+        const auto lane = laneOf.emplace(layerIt->second, lanes.size());
+        if (lane.second) {
+            lanes.emplace_back();
+            laneLayers.push_back(layerIt->second);
+        }
+        lanes[lane.first->second].push_back(end);
+    }
+    if (lanes.size() < 2) {
+        return first;
+    }
+
+    // Copies share pixels until the lanes write them.
+    std::vector<Layer> saved;
+    if (rollback) {
+        for (const Layer* layer : laneLayers) {
+            saved.push_back(*layer);
+        }
+    }
+    // Lanes stop before runs past the lowest failure published so far.
+    std::atomic<std::size_t> lowestFailure(program.size());
+    std::vector<std::size_t> failedAt(lanes.size(), program.size());
+    std::vector<std::string> failures(lanes.size());
+    parallelFor(static_cast<int>(lanes.size()), threads, [&](int index) {
+        const std::vector<std::size_t>& indices = lanes[static_cast<std::size_t>(index)];
+        std::vector<CompiledOp> lane;
+        lane.reserve(indices.size());
+        for (std::size_t opIndex : indices) {
+            lane.push_back(program[opIndex]);
+        }
+        std::size_t i = 0;
+        try {
+            for (; i < lane.size() && indices[i] < lowestFailure.load(); ++i) {
+                const std::size_t runEnd = applyOpRun(document, lane, i, threads);
+                if (runEnd > i) {
+                    i = runEnd - 1;
+                    continue;
+                }
+                applyDocumentOperation(document, lane[i], {}, {}, {}, threads);
+            }
+        } catch (const std::exception& ex) {
+            failedAt[static_cast<std::size_t>(index)] = indices[i];
+            failures[static_cast<std::size_t>(index)] = ex.what();
+            std::size_t lowest = lowestFailure.load();
+            while (indices[i] < lowest && !lowestFailure.compare_exchange_weak(lowest, indices[i])) {
+            }
+        }
+    });
+    const std::size_t failed = static_cast<std::size_t>(std::min_element(failedAt.begin(), failedAt.end()) - failedAt.begin());
+    if (failedAt[failed] < program.size()) {
+        if (rollback) {
+            // Other lanes may have run ops past the failure; redo only the
+            // ops before it, in order, on the layers as they were.
+            for (std::size_t lane = 0; lane < laneLayers.size(); ++lane) {
+                *laneLayers[lane] = saved[lane];
+            }
+            const std::vector<CompiledOp> before(program.begin() + static_cast<std::ptrdiff_t>(first),
+                                                 program.begin() + static_cast<std::ptrdiff_t>(failedAt[failed]));
+            for (std::size_t i = 0; i < before.size(); ++i) {
+                const std::size_t runEnd = applyOpRun(document, before, i, threads);
+                if (runEnd > i) {
+                    i = runEnd - 1;
+                    continue;
+                }
+                applyDocumentOperation(document, before[i], {}, {}, {}, threads);
+            }
+        }
+        throw OpRunError(failedAt[failed], failures[failed]);
+    }
+    return end;
+}
+
+std::string opFailure(std::size_t index, const std::string& opSpec, const std::string& message) {
+    std::ostringstream error;
+    error << "Failed op[" << index << "] \"" << opSpec << "\": " << message;
+    return error.str();
+}
+
+ColorLUT bakeColorOps(const std::vector<std::string>& opSpecs, int size) {
+    PointOpProgram program;
+    for (const std::string& opSpec : opSpecs) {
+        const std::vector<std::string> tokens = tokenizeOpSpec(opSpec);
+        if (tokens.empty()) {
+            continue;
+        }
+        std::unordered_map<std::string, std::string> kv = parseKeyValues(tokens, 1);
+        kv.emplace("path", program.opCount() > 0 ? program.layerPath() : "/0");
+        if (!program.append(tokens[0], kv)) {
+            throw std::runtime_error("Only color ops on one layer image can be baked into a LUT: " + opSpec);
+        }
+    }
+    if (program.opCount() == 0) {
+        throw std::runtime_error("Baking a LUT needs at least one color op");
+    }
+    return bakeColorLUT(size, [&program](PixelRGBA8* pixels, std::size_t count) {
+        ImageBuffer lattice(static_cast<int>(count), 1);
+        std::copy(pixels, pixels + count, lattice.row(0));
+        program.apply(lattice, 1);
+        std::copy(lattice.row(0), lattice.row(0) + count, pixels);
+    });
+}
@@ -1,13 +1,99 @@
 #ifndef CLI_OPS_CORE_H
 #define CLI_OPS_CORE_H
 
+#include "codec.h"
+#include "color_lut.h"
 #include "layer.h"
 
+#include <cstddef>
 #include <functional>
+#include <stdexcept>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
+// Supplies the pixels for a raster import-image op.
+using ImageLoader = std::function<ImageBuffer(const std::string& path, const DecodeOptions& options)>;
+
+// An op tokenized and split into key=value pairs once, before a run starts.
+struct CompiledOp {
+    std::string action;
+    std::unordered_map<std::string, std::string> kv;
+    // x=, y= and rgba= of set-pixel and mask-set-pixel ops.
+    int x = 0;
+    int y = 0;
+    PixelRGBA8 rgba;
+    // The op reads and writes only the layer at path=, image or mask, so it
+    // can run alongside ops on other layers.
+    bool singleLayer = false;
+};
+
+// Thrown by op runs for a failing op other than the one they started at.
+class OpRunError : public std::runtime_error {
+public:
+    OpRunError(std::size_t index, const std::string& message) : std::runtime_error(message), m_index(index) {}
+    std::size_t index() const { return m_index; }
+
+private:
+    std::size_t m_index;
+};
+
+// Throws on an empty op, a malformed token, an unknown action or a
+// set-pixel or mask-set-pixel op with missing or bad values.
+CompiledOp compileOp(const std::string& opSpec);
+
+// emitOutput receives an emit op's path and its scale= in (0, 1].
+// emitFrame receives an emit-frame op's delay in centiseconds, or -1 when
+// the op leaves it to the run; it is only set when there is an animation.
+// Without loadImage, imports decode their file when the op runs. Pixel
+// work runs on up to threads workers (parallelFor rules).
 void applyDocumentOperation(Document& document,
                             const std::string& opSpec,
-                            const std::function<void(const std::string&)>& emitOutput);
+                            const std::function<void(const std::string&, double)>& emitOutput,
+                            const std::function<void(int)>& emitFrame = {},
+                            const ImageLoader& loadImage = {},
+                            int threads = 0);
+void applyDocumentOperation(Document& document,
+                            const CompiledOp& op,
+                            const std::function<void(const std::string&, double)>& emitOutput,
+                            const std::function<void(int)>& emitFrame = {},
+                            const ImageLoader& loadImage = {},
+                            int threads = 0);
+// The decode a raster import-image op will ask its loader for, so it can be
+// started early; false for other ops and SVG imports. Throws on bad values.
+bool rasterImportRequest(const CompiledOp& op, std::string& path, DecodeOptions& options);
+// The file= an import-image op reads, raster or SVG; empty for other ops.
+std::string importedFilePath(const CompiledOp& op);
+// Runs the color and tone ops from program[first] on as one fused pass when
+// at least two in a row draw to the same layer image. Returns the index
+// after them, or first when the op should run by itself.
+std::size_t applyFusedPointOps(Document& document, const std::vector<CompiledOp>& program, std::size_t first, int threads = 0);
+// Records the draw ops from program[first] on into one display list and
+// replays it when at least two in a row draw to the same layer and target.
+// Returns the index after them, or first when the op should run by itself.
+std::size_t applyBatchedDrawOps(Document& document, const std::vector<CompiledOp>& program, std::size_t first, int threads = 0);
+// Writes the set-pixel or mask-set-pixel ops from program[first] on that
+// share a layer path with one path lookup, when at least two in a row do.
+// Returns the index after them, or the first op that should run by itself.
+std::size_t applyPixelOps(Document& document, const std::vector<CompiledOp>& program, std::size_t first);
+// The first of applyPixelOps, applyFusedPointOps and applyBatchedDrawOps
+// that takes program[first]; returns first when the op should run by itself.
+std::size_t applyOpRun(Document& document, const std::vector<CompiledOp>& program, std::size_t first, int threads = 0);
+// Runs the single-layer ops from program[first] up to the next other op
+// when they reach at least two layers: each layer's ops run in order as
+// one task and the tasks run on up to threads workers (parallelFor rules),
+// so the pixels match running the ops one by one. Returns the index after
+// them, or first when there is nothing to overlap. The lowest failing op
+// is rethrown as an OpRunError. Lanes stop at a failure another lane has
+// hit, but may already have run later ops; with rollback the lanes' layers
+// are put back and only the ops before the failing one are redone, as the
+// serial run leaves them.
+std::size_t applyIndependentOps(Document& document, const std::vector<CompiledOp>& program, std::size_t first, int threads,
+                                bool rollback = false);
+// "Failed op[index] "spec": message", as op runs report a failing op.
+std::string opFailure(std::size_t index, const std::string& opSpec, const std::string& message);
+// Samples a run of those color ops, path= optional, into a size^3 cube.
+// Throws on ops that are not color ops on the image.
+ColorLUT bakeColorOps(const std::vector<std::string>& opSpecs, int size);
 
 #endif
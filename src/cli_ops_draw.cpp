@@ -2,62 +2,124 @@
 #include "cli_ops_resolve.h"
 
 #include "cli_parse.h"
-#include "drawable.h"
+#include "cli_shared.h"
+#include "cli_args.h"
+#include "display_list.h"
+#include "flood_fill.h"
 
 #include <cmath>
+#include <fstream>
 #include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 namespace {
-class BufferImageView final : public Image {
-public:
-    explicit BufferImageView(ImageBuffer& buffer, std::uint8_t drawAlpha = 255, bool forceAlpha = true)
-        : m_buffer(buffer), m_lastColor(0, 0, 0), m_drawAlpha(drawAlpha), m_forceAlpha(forceAlpha) {}
+MaskBuffer& drawMask(Layer& layer, const std::unordered_map<std::string, std::string>& kv) {
+    if (!layer.hasMask()) {
+        layer.ensureMask(kv.find("mask_fill") == kv.end() ? PixelRGBA8(0, 0, 0, 255) : parseRGBA(kv.at("mask_fill"), true));
+    }
+    return layer.maskOrThrow();
+}
+
+BufferTarget::Blend parseDrawBlend(const std::unordered_map<std::string, std::string>& kv) {
+    if (kv.find("blend") == kv.end()) {
+        return BufferTarget::Blend::Over;
+    }
+    const std::string mode = toLower(kv.at("blend"));
+    if (mode == "copy") {
+        return BufferTarget::Blend::Copy;
+    }
+    if (mode != "over") {
+        throw std::runtime_error("blend must be over or copy");
+    }
+    return BufferTarget::Blend::Over;
+}
 
-    int width() const override { return m_buffer.width(); }
-    int height() const override { return m_buffer.height(); }
-    bool inBounds(int x, int y) const override { return m_buffer.inBounds(x, y); }
+std::string drawTargetName(const std::unordered_map<std::string, std::string>& kv) {
+    return kv.find("target") == kv.end() ? "image" : toLower(kv.at("target"));
+}
 
-    const Color& getPixel(int x, int y) const override {
-        if (!m_buffer.inBounds(x, y)) {
-            m_lastColor = Color(0, 0, 0);
-            return m_lastColor;
+// antialias=true|false and, for polygon fills, fill_rule=evenodd|nonzero.
+void applyFillStyle(DisplayList& list, const std::unordered_map<std::string, std::string>& kv) {
+    if (kv.find("antialias") != kv.end()) {
+        list.setAntialias(parseBoolFlag(kv.at("antialias")));
+    }
+    if (kv.find("fill_rule") != kv.end()) {
+        const std::string rule = toLower(kv.at("fill_rule"));
+        if (rule == "evenodd") {
+            list.setFillRule(FillRule::EvenOdd);
+        } else if (rule == "nonzero") {
+            list.setFillRule(FillRule::NonZero);
+        } else {
+            throw std::runtime_error("fill_rule must be evenodd or nonzero");
         }
-        const PixelRGBA8& px = m_buffer.getPixel(x, y);
-        m_lastColor = Color(px.r, px.g, px.b);
-        return m_lastColor;
     }
+}
 
-    void setPixel(int x, int y, const Color& color) override {
-        if (!m_buffer.inBounds(x, y)) {
-            return;
+// line_width= cap=butt|round|square join=miter|round|bevel miter_limit=.
+// Returns whether the stroke is wider than one pixel.
+bool applyStrokeStyle(DisplayList& list, const std::unordered_map<std::string, std::string>& kv) {
+    const int width = kv.find("line_width") == kv.end() ? 1 : std::stoi(kv.at("line_width"));
+    if (width < 1) {
+        throw std::runtime_error("line_width must be at least 1");
+    }
+    list.setLineWidth(width);
+    applyFillStyle(list, kv);
+    if (kv.find("cap") != kv.end()) {
+        const std::string cap = toLower(kv.at("cap"));
+        if (cap == "butt") {
+            list.setLineCap(LineCap::Butt);
+        } else if (cap == "round") {
+            list.setLineCap(LineCap::Round);
+        } else if (cap == "square") {
+            list.setLineCap(LineCap::Square);
+        } else {
+            throw std::runtime_error("cap must be butt, round or square");
         }
-        const PixelRGBA8 src = m_buffer.getPixel(x, y);
-        const std::uint8_t alpha = m_forceAlpha ? m_drawAlpha : src.a;
-        m_buffer.setPixel(x, y, PixelRGBA8(color.r, color.g, color.b, alpha));
     }
+    if (kv.find("join") != kv.end()) {
+        const std::string join = toLower(kv.at("join"));
+        if (join == "miter") {
+            list.setLineJoin(LineJoin::Miter);
+        } else if (join == "round") {
+            list.setLineJoin(LineJoin::Round);
+        } else if (join == "bevel") {
+            list.setLineJoin(LineJoin::Bevel);
+        } else {
+            throw std::runtime_error("join must be miter, round or bevel");
+        }
+    }
+    if (kv.find("miter_limit") != kv.end()) {
+        list.setMiterLimit(std::stof(kv.at("miter_limit")));
+    }
+    return width > 1;
+}
 
-private:
-    ImageBuffer& m_buffer;
-    mutable Color m_lastColor;
-    std::uint8_t m_drawAlpha;
-    bool m_forceAlpha;
-};
+void strokePoints(DisplayList& list, const std::vector<std::pair<int, int>>& points, bool closed, const Color& color) {
+    list.beginPath();
+    list.moveTo(static_cast<float>(points.front().first), static_cast<float>(points.front().second));
+    for (std::size_t i = 1; i < points.size(); ++i) {
+        list.lineTo(static_cast<float>(points[i].first), static_cast<float>(points[i].second));
+    }
+    if (closed) {
+        list.closePath();
+    }
+    list.stroke(color);
+}
 } // namespace
 
-bool tryApplyDrawOperation(
-    const std::string& action,
-    Document& document,
-    const std::unordered_map<std::string, std::string>& kv) {
+bool recordDrawOperation(DisplayList& list, const std::string& action, const std::unordered_map<std::string, std::string>& kv) {
+    list.resetStyle();
     if (action == "draw-fill") {
         if (kv.find("path") == kv.end() || kv.find("rgba") == kv.end()) {
             throw std::runtime_error("draw-fill requires path= and rgba=");
         }
-        Layer& layer = resolveLayerPath(document, kv.at("path"));
-        ImageBuffer& targetBuffer = resolveDrawTargetBuffer(layer, kv);
         const PixelRGBA8 rgba = parseRGBA(kv.at("rgba"), true);
-        BufferImageView view(targetBuffer, rgba.a, true);
-        Drawable drawable(view);
-        drawable.fill(Color(rgba.r, rgba.g, rgba.b));
+        list.setAlpha(rgba.a);
+        list.setBlend(parseDrawBlend(kv));
+        list.fill(Color(rgba.r, rgba.g, rgba.b));
         return true;
     }
 
@@ -66,14 +128,18 @@ bool tryApplyDrawOperation(
             kv.find("x1") == kv.end() || kv.find("y1") == kv.end() || kv.find("rgba") == kv.end()) {
             throw std::runtime_error("draw-line requires path= x0= y0= x1= y1= rgba=");
         }
-        Layer& layer = resolveLayerPath(document, kv.at("path"));
-        ImageBuffer& targetBuffer = resolveDrawTargetBuffer(layer, kv);
         const PixelRGBA8 rgba = parseRGBA(kv.at("rgba"), true);
-        BufferImageView view(targetBuffer, rgba.a, true);
-        Drawable drawable(view);
-        drawable.line(std::stoi(kv.at("x0")), std::stoi(kv.at("y0")),
-                      std::stoi(kv.at("x1")), std::stoi(kv.at("y1")),
-                      Color(rgba.r, rgba.g, rgba.b));
+        const int x0 = std::stoi(kv.at("x0"));
+        const int y0 = std::stoi(kv.at("y0"));
+        const int x1 = std::stoi(kv.at("x1"));
+        const int y1 = std::stoi(kv.at("y1"));
+        list.setAlpha(rgba.a);
+        list.setBlend(parseDrawBlend(kv));
+        if (applyStrokeStyle(list, kv)) {
+            strokePoints(list, {{x0, y0}, {x1, y1}}, false, Color(rgba.r, rgba.g, rgba.b));
+        } else {
+            list.line(x0, y0, x1, y1, Color(rgba.r, rgba.g, rgba.b));
+        }
         return true;
     }
 
@@ -82,14 +148,12 @@ bool tryApplyDrawOperation(
             kv.find("width") == kv.end() || kv.find("height") == kv.end() || kv.find("rgba") == kv.end()) {
             throw std::runtime_error("draw-rect requires path= x= y= width= height= rgba=");
         }
-        Layer& layer = resolveLayerPath(document, kv.at("path"));
-        ImageBuffer& targetBuffer = resolveDrawTargetBuffer(layer, kv);
         const PixelRGBA8 rgba = parseRGBA(kv.at("rgba"), true);
-        BufferImageView view(targetBuffer, rgba.a, true);
-        Drawable drawable(view);
-        drawable.rect(std::stoi(kv.at("x")), std::stoi(kv.at("y")),
-                      std::stoi(kv.at("width")), std::stoi(kv.at("height")),
-                      Color(rgba.r, rgba.g, rgba.b));
+        list.setAlpha(rgba.a);
+        list.setBlend(parseDrawBlend(kv));
+        list.rect(std::stoi(kv.at("x")), std::stoi(kv.at("y")),
+                  std::stoi(kv.at("width")), std::stoi(kv.at("height")),
+                  Color(rgba.r, rgba.g, rgba.b));
         return true;
     }
 
@@ -98,14 +162,12 @@ bool tryApplyDrawOperation(
             kv.find("width") == kv.end() || kv.find("height") == kv.end() || kv.find("rgba") == kv.end()) {
             throw std::runtime_error("draw-fill-rect requires path= x= y= width= height= rgba=");
         }
-        Layer& layer = resolveLayerPath(document, kv.at("path"));
-        ImageBuffer& targetBuffer = resolveDrawTargetBuffer(layer, kv);
         const PixelRGBA8 rgba = parseRGBA(kv.at("rgba"), true);
-        BufferImageView view(targetBuffer, rgba.a, true);
-        Drawable drawable(view);
-        drawable.fillRect(std::stoi(kv.at("x")), std::stoi(kv.at("y")),
-                          std::stoi(kv.at("width")), std::stoi(kv.at("height")),
-                          Color(rgba.r, rgba.g, rgba.b));
+        list.setAlpha(rgba.a);
+        list.setBlend(parseDrawBlend(kv));
+        list.fillRect(std::stoi(kv.at("x")), std::stoi(kv.at("y")),
+                      std::stoi(kv.at("width")), std::stoi(kv.at("height")),
+                      Color(rgba.r, rgba.g, rgba.b));
         return true;
     }
 
@@ -115,14 +177,12 @@ bool tryApplyDrawOperation(
             kv.find("radius") == kv.end() || kv.find("rgba") == kv.end()) {
             throw std::runtime_error("draw-round-rect requires path= x= y= width= height= radius= rgba=");
         }
-        Layer& layer = resolveLayerPath(document, kv.at("path"));
-        ImageBuffer& targetBuffer = resolveDrawTargetBuffer(layer, kv);
         const PixelRGBA8 rgba = parseRGBA(kv.at("rgba"), true);
-        BufferImageView view(targetBuffer, rgba.a, true);
-        Drawable drawable(view);
-        drawable.roundRect(std::stoi(kv.at("x")), std::stoi(kv.at("y")),
-                           std::stoi(kv.at("width")), std::stoi(kv.at("height")),
-                           std::stoi(kv.at("radius")), Color(rgba.r, rgba.g, rgba.b));
+        list.setAlpha(rgba.a);
+        list.setBlend(parseDrawBlend(kv));
+        list.roundRect(std::stoi(kv.at("x")), std::stoi(kv.at("y")),
+                       std::stoi(kv.at("width")), std::stoi(kv.at("height")),
+                       std::stoi(kv.at("radius")), Color(rgba.r, rgba.g, rgba.b));
         return true;
     }
 
@@ -132,14 +192,13 @@ bool tryApplyDrawOperation(
             kv.find("radius") == kv.end() || kv.find("rgba") == kv.end()) {
             throw std::runtime_error("draw-fill-round-rect requires path= x= y= width= height= radius= rgba=");
         }
-        Layer& layer = resolveLayerPath(document, kv.at("path"));
-        ImageBuffer& targetBuffer = resolveDrawTargetBuffer(layer, kv);
         const PixelRGBA8 rgba = parseRGBA(kv.at("rgba"), true);
-        BufferImageView view(targetBuffer, rgba.a, true);
-        Drawable drawable(view);
-        drawable.fillRoundRect(std::stoi(kv.at("x")), std::stoi(kv.at("y")),
-                               std::stoi(kv.at("width")), std::stoi(kv.at("height")),
-                               std::stoi(kv.at("radius")), Color(rgba.r, rgba.g, rgba.b));
+        list.setAlpha(rgba.a);
+        list.setBlend(parseDrawBlend(kv));
+        applyFillStyle(list, kv);
+        list.fillRoundRect(std::stoi(kv.at("x")), std::stoi(kv.at("y")),
+                           std::stoi(kv.at("width")), std::stoi(kv.at("height")),
+                           std::stoi(kv.at("radius")), Color(rgba.r, rgba.g, rgba.b));
         return true;
     }
 
@@ -148,14 +207,12 @@ bool tryApplyDrawOperation(
             kv.find("rx") == kv.end() || kv.find("ry") == kv.end() || kv.find("rgba") == kv.end()) {
             throw std::runtime_error("draw-ellipse requires path= cx= cy= rx= ry= rgba=");
         }
-        Layer& layer = resolveLayerPath(document, kv.at("path"));
-        ImageBuffer& targetBuffer = resolveDrawTargetBuffer(layer, kv);
         const PixelRGBA8 rgba = parseRGBA(kv.at("rgba"), true);
-        BufferImageView view(targetBuffer, rgba.a, true);
-        Drawable drawable(view);
-        drawable.ellipse(std::stoi(kv.at("cx")), std::stoi(kv.at("cy")),
-                         std::stoi(kv.at("rx")), std::stoi(kv.at("ry")),
-                         Color(rgba.r, rgba.g, rgba.b));
+        list.setAlpha(rgba.a);
+        list.setBlend(parseDrawBlend(kv));
+        list.ellipse(std::stoi(kv.at("cx")), std::stoi(kv.at("cy")),
+                     std::stoi(kv.at("rx")), std::stoi(kv.at("ry")),
+                     Color(rgba.r, rgba.g, rgba.b));
         return true;
     }
 
@@ -164,14 +221,13 @@ bool tryApplyDrawOperation(
             kv.find("rx") == kv.end() || kv.find("ry") == kv.end() || kv.find("rgba") == kv.end()) {
             throw std::runtime_error("draw-fill-ellipse requires path= cx= cy= rx= ry= rgba=");
         }
-        Layer& layer = resolveLayerPath(document, kv.at("path"));
-        ImageBuffer& targetBuffer = resolveDrawTargetBuffer(layer, kv);
         const PixelRGBA8 rgba = parseRGBA(kv.at("rgba"), true);
-        BufferImageView view(targetBuffer, rgba.a, true);
-        Drawable drawable(view);
-        drawable.fillEllipse(std::stoi(kv.at("cx")), std::stoi(kv.at("cy")),
-                             std::stoi(kv.at("rx")), std::stoi(kv.at("ry")),
-                             Color(rgba.r, rgba.g, rgba.b));
+        list.setAlpha(rgba.a);
+        list.setBlend(parseDrawBlend(kv));
+        applyFillStyle(list, kv);
+        list.fillEllipse(std::stoi(kv.at("cx")), std::stoi(kv.at("cy")),
+                         std::stoi(kv.at("rx")), std::stoi(kv.at("ry")),
+                         Color(rgba.r, rgba.g, rgba.b));
         return true;
     }
 
@@ -179,13 +235,15 @@ bool tryApplyDrawOperation(
         if (kv.find("path") == kv.end() || kv.find("points") == kv.end() || kv.find("rgba") == kv.end()) {
             throw std::runtime_error("draw-polyline requires path= points= rgba=");
         }
-        Layer& layer = resolveLayerPath(document, kv.at("path"));
-        ImageBuffer& targetBuffer = resolveDrawTargetBuffer(layer, kv);
         const std::vector<std::pair<int, int>> points = parseDrawPoints(kv.at("points"), 2, "draw-polyline");
         const PixelRGBA8 rgba = parseRGBA(kv.at("rgba"), true);
-        BufferImageView view(targetBuffer, rgba.a, true);
-        Drawable drawable(view);
-        drawable.polyline(points, Color(rgba.r, rgba.g, rgba.b));
+        list.setAlpha(rgba.a);
+        list.setBlend(parseDrawBlend(kv));
+        if (applyStrokeStyle(list, kv)) {
+            strokePoints(list, points, false, Color(rgba.r, rgba.g, rgba.b));
+        } else {
+            list.polyline(points, Color(rgba.r, rgba.g, rgba.b));
+        }
         return true;
     }
 
@@ -193,13 +251,15 @@ bool tryApplyDrawOperation(
         if (kv.find("path") == kv.end() || kv.find("points") == kv.end() || kv.find("rgba") == kv.end()) {
             throw std::runtime_error("draw-polygon requires path= points= rgba=");
         }
-        Layer& layer = resolveLayerPath(document, kv.at("path"));
-        ImageBuffer& targetBuffer = resolveDrawTargetBuffer(layer, kv);
         const std::vector<std::pair<int, int>> points = parseDrawPoints(kv.at("points"), 3, "draw-polygon");
         const PixelRGBA8 rgba = parseRGBA(kv.at("rgba"), true);
-        BufferImageView view(targetBuffer, rgba.a, true);
-        Drawable drawable(view);
-        drawable.polygon(points, Color(rgba.r, rgba.g, rgba.b));
+        list.setAlpha(rgba.a);
+        list.setBlend(parseDrawBlend(kv));
+        if (applyStrokeStyle(list, kv)) {
+            strokePoints(list, points, true, Color(rgba.r, rgba.g, rgba.b));
+        } else {
+            list.polygon(points, Color(rgba.r, rgba.g, rgba.b));
+        }
         return true;
     }
 
@@ -207,29 +267,12 @@ bool tryApplyDrawOperation(
         if (kv.find("path") == kv.end() || kv.find("points") == kv.end() || kv.find("rgba") == kv.end()) {
             throw std::runtime_error("draw-fill-polygon requires path= points= rgba=");
         }
-        Layer& layer = resolveLayerPath(document, kv.at("path"));
-        ImageBuffer& targetBuffer = resolveDrawTargetBuffer(layer, kv);
         const std::vector<std::pair<int, int>> points = parseDrawPoints(kv.at("points"), 3, "draw-fill-polygon");
         const PixelRGBA8 rgba = parseRGBA(kv.at("rgba"), true);
-        BufferImageView view(targetBuffer, rgba.a, true);
-        Drawable drawable(view);
-        drawable.fillPolygon(points, Color(rgba.r, rgba.g, rgba.b));
-        return true;
-    }
-
-    if (action == "draw-flood-fill") {
-        if (kv.find("path") == kv.end() || kv.find("x") == kv.end() || kv.find("y") == kv.end() ||
-            kv.find("rgba") == kv.end()) {
-            throw std::runtime_error("draw-flood-fill requires path= x= y= rgba=");
-        }
-        Layer& layer = resolveLayerPath(document, kv.at("path"));
-        ImageBuffer& targetBuffer = resolveDrawTargetBuffer(layer, kv);
-        const int tolerance = kv.find("tolerance") == kv.end() ? 0 : std::stoi(kv.at("tolerance"));
-        const PixelRGBA8 rgba = parseRGBA(kv.at("rgba"), true);
-        BufferImageView view(targetBuffer, rgba.a, true);
-        Drawable drawable(view);
-        drawable.floodFill(std::stoi(kv.at("x")), std::stoi(kv.at("y")),
-                           Color(rgba.r, rgba.g, rgba.b), tolerance);
+        list.setAlpha(rgba.a);
+        list.setBlend(parseDrawBlend(kv));
+        applyFillStyle(list, kv);
+        list.fillPolygon(points, Color(rgba.r, rgba.g, rgba.b));
         return true;
     }
 
@@ -238,13 +281,11 @@ bool tryApplyDrawOperation(
             kv.find("radius") == kv.end() || kv.find("rgba") == kv.end()) {
             throw std::runtime_error("draw-circle requires path= cx= cy= radius= rgba=");
         }
-        Layer& layer = resolveLayerPath(document, kv.at("path"));
-        ImageBuffer& targetBuffer = resolveDrawTargetBuffer(layer, kv);
         const PixelRGBA8 rgba = parseRGBA(kv.at("rgba"), true);
-        BufferImageView view(targetBuffer, rgba.a, true);
-        Drawable drawable(view);
-        drawable.circle(std::stoi(kv.at("cx")), std::stoi(kv.at("cy")), std::stoi(kv.at("radius")),
-                        Color(rgba.r, rgba.g, rgba.b));
+        list.setAlpha(rgba.a);
+        list.setBlend(parseDrawBlend(kv));
+        list.circle(std::stoi(kv.at("cx")), std::stoi(kv.at("cy")), std::stoi(kv.at("radius")),
+                    Color(rgba.r, rgba.g, rgba.b));
         return true;
     }
 
@@ -253,13 +294,12 @@ bool tryApplyDrawOperation(
             kv.find("radius") == kv.end() || kv.find("rgba") == kv.end()) {
             throw std::runtime_error("draw-fill-circle requires path= cx= cy= radius= rgba=");
         }
-        Layer& layer = resolveLayerPath(document, kv.at("path"));
-        ImageBuffer& targetBuffer = resolveDrawTargetBuffer(layer, kv);
         const PixelRGBA8 rgba = parseRGBA(kv.at("rgba"), true);
-        BufferImageView view(targetBuffer, rgba.a, true);
-        Drawable drawable(view);
-        drawable.fillCircle(std::stoi(kv.at("cx")), std::stoi(kv.at("cy")), std::stoi(kv.at("radius")),
-                            Color(rgba.r, rgba.g, rgba.b));
+        list.setAlpha(rgba.a);
+        list.setBlend(parseDrawBlend(kv));
+        applyFillStyle(list, kv);
+        list.fillCircle(std::stoi(kv.at("cx")), std::stoi(kv.at("cy")), std::stoi(kv.at("radius")),
+                        Color(rgba.r, rgba.g, rgba.b));
         return true;
     }
 
@@ -268,12 +308,6 @@ bool tryApplyDrawOperation(
             kv.find("radius") == kv.end() || kv.find("rgba") == kv.end()) {
             throw std::runtime_error("draw-arc requires path= cx= cy= radius= rgba= and start/end");
         }
-        Layer& layer = resolveLayerPath(document, kv.at("path"));
-        ImageBuffer& targetBuffer = resolveDrawTargetBuffer(layer, kv);
-        const PixelRGBA8 rgba = parseRGBA(kv.at("rgba"), true);
-        BufferImageView view(targetBuffer, rgba.a, true);
-        Drawable drawable(view);
-
         float startRadians = 0.0f;
         float endRadians = 0.0f;
         if (kv.find("start_rad") != kv.end() && kv.find("end_rad") != kv.end()) {
@@ -287,8 +321,11 @@ bool tryApplyDrawOperation(
         }
         const bool counterclockwise = kv.find("counterclockwise") == kv.end() ? false : parseBoolFlag(kv.at("counterclockwise"));
 
-        drawable.arc(std::stoi(kv.at("cx")), std::stoi(kv.at("cy")), std::stoi(kv.at("radius")),
-                     startRadians, endRadians, Color(rgba.r, rgba.g, rgba.b), counterclockwise);
+        const PixelRGBA8 rgba = parseRGBA(kv.at("rgba"), true);
+        list.setAlpha(rgba.a);
+        list.setBlend(parseDrawBlend(kv));
+        list.arc(std::stoi(kv.at("cx")), std::stoi(kv.at("cy")), std::stoi(kv.at("radius")),
+                 startRadians, endRadians, Color(rgba.r, rgba.g, rgba.b), counterclockwise);
         return true;
     }
 
@@ -298,16 +335,15 @@ bool tryApplyDrawOperation(
             kv.find("x1") == kv.end() || kv.find("y1") == kv.end() || kv.find("rgba") == kv.end()) {
             throw std::runtime_error("draw-quadratic-bezier requires path= x0= y0= cx= cy= x1= y1= rgba=");
         }
-        Layer& layer = resolveLayerPath(document, kv.at("path"));
-        ImageBuffer& targetBuffer = resolveDrawTargetBuffer(layer, kv);
         const PixelRGBA8 rgba = parseRGBA(kv.at("rgba"), true);
-        BufferImageView view(targetBuffer, rgba.a, true);
-        Drawable drawable(view);
-        drawable.beginPath();
-        drawable.moveTo(std::stof(kv.at("x0")), std::stof(kv.at("y0")));
-        drawable.quadraticCurveTo(std::stof(kv.at("cx")), std::stof(kv.at("cy")),
-                                  std::stof(kv.at("x1")), std::stof(kv.at("y1")));
-        drawable.stroke(Color(rgba.r, rgba.g, rgba.b));
+        list.setAlpha(rgba.a);
+        list.setBlend(parseDrawBlend(kv));
+        applyStrokeStyle(list, kv);
+        list.beginPath();
+        list.moveTo(std::stof(kv.at("x0")), std::stof(kv.at("y0")));
+        list.quadraticCurveTo(std::stof(kv.at("cx")), std::stof(kv.at("cy")),
+                              std::stof(kv.at("x1")), std::stof(kv.at("y1")));
+        list.stroke(Color(rgba.r, rgba.g, rgba.b));
         return true;
     }
 
@@ -318,19 +354,104 @@ bool tryApplyDrawOperation(
             kv.find("x1") == kv.end() || kv.find("y1") == kv.end() || kv.find("rgba") == kv.end()) {
             throw std::runtime_error("draw-bezier requires path= x0= y0= cx1= cy1= cx2= cy2= x1= y1= rgba=");
         }
-        Layer& layer = resolveLayerPath(document, kv.at("path"));
-        ImageBuffer& targetBuffer = resolveDrawTargetBuffer(layer, kv);
         const PixelRGBA8 rgba = parseRGBA(kv.at("rgba"), true);
-        BufferImageView view(targetBuffer, rgba.a, true);
-        Drawable drawable(view);
-        drawable.beginPath();
-        drawable.moveTo(std::stof(kv.at("x0")), std::stof(kv.at("y0")));
-        drawable.bezierCurveTo(std::stof(kv.at("cx1")), std::stof(kv.at("cy1")),
-                               std::stof(kv.at("cx2")), std::stof(kv.at("cy2")),
-                               std::stof(kv.at("x1")), std::stof(kv.at("y1")));
-        drawable.stroke(Color(rgba.r, rgba.g, rgba.b));
+        list.setAlpha(rgba.a);
+        list.setBlend(parseDrawBlend(kv));
+        applyStrokeStyle(list, kv);
+        list.beginPath();
+        list.moveTo(std::stof(kv.at("x0")), std::stof(kv.at("y0")));
+        list.bezierCurveTo(std::stof(kv.at("cx1")), std::stof(kv.at("cy1")),
+                           std::stof(kv.at("cx2")), std::stof(kv.at("cy2")),
+                           std::stof(kv.at("x1")), std::stof(kv.at("y1")));
+        list.stroke(Color(rgba.r, rgba.g, rgba.b));
         return true;
     }
 
     return false;
 }
+
+void replayDrawOperations(Document& document, const DisplayList& list, const std::unordered_map<std::string, std::string>& kv, int threads) {
+    Layer& layer = resolveLayerPath(document, kv.at("path"));
+    const std::string target = drawTargetName(kv);
+    if (target == "mask") {
+        list.replay(drawMask(layer, kv), threads);
+        return;
+    }
+    if (target != "image") {
+        throw std::runtime_error("target must be image or mask");
+    }
+    list.replay(layer.image(), threads);
+}
+
+bool isDrawAction(const std::string& action) {
+    static const std::unordered_set<std::string> actions = {
+        "draw-fill", "draw-line", "draw-rect", "draw-fill-rect", "draw-round-rect", "draw-fill-round-rect",
+        "draw-ellipse", "draw-fill-ellipse", "draw-polyline", "draw-polygon", "draw-fill-polygon", "draw-circle",
+        "draw-fill-circle", "draw-arc", "draw-quadratic-bezier", "draw-bezier", "draw-flood-fill", "draw-batch",
+    };
+    return actions.count(action) != 0;
+}
+
+bool tryApplyDrawOperation(
+    const std::string& action,
+    Document& document,
+    const std::unordered_map<std::string, std::string>& kv,
+    int threads) {
+    if (action == "draw-flood-fill") {
+        if (kv.find("path") == kv.end() || kv.find("x") == kv.end() || kv.find("y") == kv.end() ||
+            kv.find("rgba") == kv.end()) {
+            throw std::runtime_error("draw-flood-fill requires path= x= y= rgba=");
+        }
+        Layer& layer = resolveLayerPath(document, kv.at("path"));
+        const int x = std::stoi(kv.at("x"));
+        const int y = std::stoi(kv.at("y"));
+        const int tolerance = kv.find("tolerance") == kv.end() ? 0 : std::stoi(kv.at("tolerance"));
+        const bool matchAlpha = kv.find("match_alpha") != kv.end() && parseBoolFlag(kv.at("match_alpha"));
+        const PixelRGBA8 rgba = parseRGBA(kv.at("rgba"), true);
+        if (drawTargetName(kv) == "mask") {
+            // Fills coverage in place instead of round-tripping the mask
+            // through an RGBA scratch buffer.
+            floodFill(drawMask(layer, kv), x, y, MaskBuffer::coverageFromPixel(rgba), tolerance);
+            return true;
+        }
+        DrawTargetBuffer drawTarget(layer, kv);
+        floodFill(drawTarget.buffer(), x, y, rgba, tolerance, matchAlpha);
+        return true;
+    }
+
+    if (action == "draw-batch") {
+        if (kv.find("path") == kv.end() || kv.find("file") == kv.end()) {
+            throw std::runtime_error("draw-batch requires path= file=");
+        }
+        std::ifstream file(kv.at("file"));
+        if (!file.is_open()) {
+            throw std::runtime_error("Failed to open draw-batch file: " + kv.at("file"));
+        }
+        std::vector<std::string> lines;
+        addOpsFromStream(file, lines);
+        DisplayList list;
+        for (const std::string& line : lines) {
+            const std::vector<std::string> tokens = tokenizeOpSpec(line);
+            if (tokens.empty()) {
+                continue;
+            }
+            std::unordered_map<std::string, std::string> lineKv = parseKeyValues(tokens, 1);
+            if (lineKv.find("path") != lineKv.end() || lineKv.find("target") != lineKv.end()) {
+                throw std::runtime_error("draw-batch lines take no path= or target=");
+            }
+            lineKv["path"] = kv.at("path");
+            if (!recordDrawOperation(list, tokens[0], lineKv)) {
+                throw std::runtime_error("draw-batch cannot hold: " + tokens[0]);
+            }
+        }
+        replayDrawOperations(document, list, kv, threads);
+        return true;
+    }
+
+    DisplayList list;
+    if (!recordDrawOperation(list, action, kv)) {
+        return false;
+    }
+    replayDrawOperations(document, list, kv, threads);
+    return true;
+}
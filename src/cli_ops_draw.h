@@ -1,14 +1,25 @@
 #ifndef CLI_OPS_DRAW_H
 #define CLI_OPS_DRAW_H
 
+#include "display_list.h"
 #include "layer.h"
 
 #include <string>
 #include <unordered_map>
 
+// Whether tryApplyDrawOperation handles action.
+bool isDrawAction(const std::string& action);
+// Draws replay on up to threads workers (parallelFor rules).
 bool tryApplyDrawOperation(
     const std::string& action,
     Document& document,
-    const std::unordered_map<std::string, std::string>& kv);
+    const std::unordered_map<std::string, std::string>& kv,
+    int threads);
+
+// Records a draw op that a display list can hold, path= and target= aside,
+// onto list; false for other actions. Throws on bad values.
+bool recordDrawOperation(DisplayList& list, const std::string& action, const std::unordered_map<std::string, std::string>& kv);
+// Replays list onto the target= of the layer at path=.
+void replayDrawOperations(Document& document, const DisplayList& list, const std::unordered_map<std::string, std::string>& kv, int threads);
 
 #endif
@@ -4,20 +4,44 @@
 #include "cli_parse.h"
 #include "cli_shared.h"
 
+#include "color_lut.h"
 #include "effects.h"
+#include "parallel.h"
 
 #include <algorithm>
 #include <array>
 #include <cmath>
 #include <cstdint>
-#include <deque>
+#include <cstring>
 #include <functional>
+#include <memory>
 #include <random>
 #include <stdexcept>
 #include <string>
 #include <unordered_map>
 #include <vector>
 
+// One step of a PointOpProgram. Tables map r, g, b and a; the other kinds
+// mix channels and round as their op does on its own.
+struct PointOpStage {
+    enum class Kind { Lut, Grayscale, Sepia, ChannelMix, Threshold, ReplaceColor, Cube };
+    Kind kind = Kind::Lut;
+    std::array<std::array<std::uint8_t, 256>, 4> luts{};
+    std::shared_ptr<const ColorLUT> cube;
+    // replace-color's mix for each squared rgb distance from its color.
+    std::shared_ptr<const std::vector<float>> mixByDistance;
+    PixelRGBA8 from;
+    PixelRGBA8 to;
+    bool preserveLuma = true;
+    std::array<float, 9> matrix{};
+    float low = 0.0f;
+    float high = 255.0f;
+    float strength = 1.0f;
+    int threshold = 128;
+    PixelRGBA8 lo;
+    PixelRGBA8 hi;
+};
+
 namespace {
 float clamp01(float value) {
     return std::max(0.0f, std::min(1.0f, value));
@@ -43,421 +67,707 @@ PixelRGBA8 lerpPixel(const PixelRGBA8& a, const PixelRGBA8& b, float t) {
         clampByte(static_cast<int>(std::lround(inv * static_cast<float>(a.a) + clamped * static_cast<float>(b.a)))));
 }
 
-double rgbDistance(const PixelRGBA8& a, const PixelRGBA8& b) {
-    const double dr = static_cast<double>(a.r) - static_cast<double>(b.r);
-    const double dg = static_cast<double>(a.g) - static_cast<double>(b.g);
-    const double db = static_cast<double>(a.b) - static_cast<double>(b.b);
-    return std::sqrt((dr * dr) + (dg * dg) + (db * db));
-}
-
-void applyReplaceColorToLayer(Layer& layer,
-                              const PixelRGBA8& fromColor,
-                              const PixelRGBA8& toColor,
-                              double tolerance,
-                              double softness,
-                              bool preserveLuma) {
-    const double clampedTolerance = std::max(0.0, tolerance);
-    const double clampedSoftness = std::max(0.0, softness);
-    const double hard = clampedTolerance;
-    const double softEnd = clampedTolerance + clampedSoftness;
-
-    ImageBuffer& image = layer.image();
-    for (int y = 0; y < image.height(); ++y) {
-        for (int x = 0; x < image.width(); ++x) {
-            const PixelRGBA8 src = image.getPixel(x, y);
-            const double dist = rgbDistance(src, fromColor);
-
-            float mix = 0.0f;
-            if (dist <= hard) {
-                mix = 1.0f;
-            } else if (softEnd > hard && dist < softEnd) {
-                mix = static_cast<float>(1.0 - ((dist - hard) / (softEnd - hard)));
-            }
-
-            if (mix <= 0.0f) {
-                continue;
-            }
+float luma01(const PixelRGBA8& p) {
+    return (0.299f * static_cast<float>(p.r) +
+            0.587f * static_cast<float>(p.g) +
+            0.114f * static_cast<float>(p.b)) / 255.0f;
+}
 
-            PixelRGBA8 adjusted = toColor;
-            adjusted.a = src.a;
-            if (preserveLuma) {
-                const float srcLuma = 0.299f * static_cast<float>(src.r) +
-                                      0.587f * static_cast<float>(src.g) +
-                                      0.114f * static_cast<float>(src.b);
-                const float dstLuma = 0.299f * static_cast<float>(adjusted.r) +
-                                      0.587f * static_cast<float>(adjusted.g) +
-                                      0.114f * static_cast<float>(adjusted.b);
-                if (dstLuma > 0.0f) {
-                    const float scale = srcLuma / dstLuma;
-                    adjusted.r = clampByte(static_cast<int>(std::lround(scale * static_cast<float>(adjusted.r))));
-                    adjusted.g = clampByte(static_cast<int>(std::lround(scale * static_cast<float>(adjusted.g))));
-                    adjusted.b = clampByte(static_cast<int>(std::lround(scale * static_cast<float>(adjusted.b))));
-                }
+// Kernels wider than this blur in constant time per pixel through a
+// cascade of box blurs, as long as they are not truncated well inside
+// their gaussian; narrower ones are convolved directly.
+constexpr int kBoxBlurMinRadius = 16;
+constexpr int kBlurWeightBits = 14;
+constexpr int kBlurBandRows = 16;
+constexpr std::size_t kBlurStripBytes = 1024;
+
+// out[i] is the weighted sum of sources[k][i] with 14-bit weights that sum
+// to one. Blocks of 16 bytes keep the sums in vector registers.
+void convolveSpans(const std::uint8_t* const* sources, const std::uint16_t* weights, int taps, std::uint8_t* out,
+                   std::size_t count) {
+    constexpr std::uint32_t kRound = 1u << (kBlurWeightBits - 1);
+    std::size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        std::uint32_t sums[16] = {};
+        for (int k = 0; k < taps; ++k) {
+            const std::uint8_t* src = sources[k] + i;
+            const std::uint32_t weight = weights[k];
+            for (int j = 0; j < 16; ++j) {
+                sums[j] += weight * src[j];
             }
-
-            image.setPixel(x, y, lerpPixel(src, adjusted, mix));
+        }
+        for (int j = 0; j < 16; ++j) {
+            out[i + j] = static_cast<std::uint8_t>((sums[j] + kRound) >> kBlurWeightBits);
         }
     }
+    for (; i < count; ++i) {
+        std::uint32_t sum = 0;
+        for (int k = 0; k < taps; ++k) {
+            sum += static_cast<std::uint32_t>(weights[k]) * sources[k][i];
+        }
+        out[i] = static_cast<std::uint8_t>((sum + kRound) >> kBlurWeightBits);
+    }
+}
+
+// Copies a row of pixels with radius copies of each edge pixel on either
+// side, so every horizontal tap is a plain offset into it.
+void padRow(const PixelRGBA8* row, int width, int radius, std::vector<PixelRGBA8>& padded) {
+    padded.resize(static_cast<std::size_t>(width + radius * 2));
+    std::fill(padded.begin(), padded.begin() + radius, row[0]);
+    std::copy(row, row + width, padded.begin() + radius);
+    std::fill(padded.begin() + radius + width, padded.end(), row[width - 1]);
 }
 
-void applyChannelMixToLayer(Layer& layer,
-                            const std::array<float, 9>& mixMatrix,
-                            float clampMin,
-                            float clampMax) {
-    const float minV = std::min(clampMin, clampMax);
-    const float maxV = std::max(clampMin, clampMax);
+const std::uint8_t* pixelBytes(const PixelRGBA8* pixels) {
+    return reinterpret_cast<const std::uint8_t*>(pixels);
+}
 
-    ImageBuffer& image = layer.image();
-    for (int y = 0; y < image.height(); ++y) {
-        for (int x = 0; x < image.width(); ++x) {
-            const PixelRGBA8 src = image.getPixel(x, y);
-            const float r = static_cast<float>(src.r);
-            const float g = static_cast<float>(src.g);
-            const float b = static_cast<float>(src.b);
+std::uint8_t* pixelBytes(PixelRGBA8* pixels) {
+    return reinterpret_cast<std::uint8_t*>(pixels);
+}
 
-            float outR = mixMatrix[0] * r + mixMatrix[1] * g + mixMatrix[2] * b;
-            float outG = mixMatrix[3] * r + mixMatrix[4] * g + mixMatrix[5] * b;
-            float outB = mixMatrix[6] * r + mixMatrix[7] * g + mixMatrix[8] * b;
+std::vector<std::uint16_t> gaussianWeights(int radius, double sigma) {
+    std::vector<double> kernel(static_cast<std::size_t>(radius * 2 + 1));
+    double sum = 0.0;
+    for (int i = -radius; i <= radius; ++i) {
+        const double x = static_cast<double>(i);
+        kernel[static_cast<std::size_t>(i + radius)] = std::exp(-(x * x) / (2.0 * sigma * sigma));
+        sum += kernel[static_cast<std::size_t>(i + radius)];
+    }
+    std::vector<std::uint16_t> weights(kernel.size());
+    int total = 0;
+    for (std::size_t i = 0; i < kernel.size(); ++i) {
+        weights[i] = static_cast<std::uint16_t>(std::lround(kernel[i] / sum * (1 << kBlurWeightBits)));
+        total += weights[i];
+    }
+    // The center tap absorbs rounding so the weights sum to exactly one.
+    weights[static_cast<std::size_t>(radius)] =
+        static_cast<std::uint16_t>(weights[static_cast<std::size_t>(radius)] + (1 << kBlurWeightBits) - total);
+    return weights;
+}
 
-            outR = std::max(minV, std::min(maxV, outR));
-            outG = std::max(minV, std::min(maxV, outG));
-            outB = std::max(minV, std::min(maxV, outB));
+void convolveGaussian(ImageBuffer& image, int radius, double sigma, int threads) {
+    const int width = image.width();
+    const int height = image.height();
+    const std::vector<std::uint16_t> weights = gaussianWeights(radius, sigma);
+    const int taps = radius * 2 + 1;
+    const std::size_t rowBytes = static_cast<std::size_t>(width) * 4;
+
+    // Vertical taps read whole rows; bands of rows are split into column
+    // strips so the taps of a strip stay in cache.
+    ImageBuffer out(width, height);
+    const PixelRGBA8* src = static_cast<const ImageBuffer&>(image).data();
+    PixelRGBA8* dst = out.data();
+    const int bands = (height + kBlurBandRows - 1) / kBlurBandRows;
+    parallelFor(bands, threads, [&](int band) {
+        std::vector<const std::uint8_t*> sources(static_cast<std::size_t>(taps));
+        const int yEnd = std::min(height, (band + 1) * kBlurBandRows);
+        for (std::size_t strip = 0; strip < rowBytes; strip += kBlurStripBytes) {
+            const std::size_t count = std::min(kBlurStripBytes, rowBytes - strip);
+            for (int y = band * kBlurBandRows; y < yEnd; ++y) {
+                for (int k = 0; k < taps; ++k) {
+                    const int sy = std::clamp(y + k - radius, 0, height - 1);
+                    sources[static_cast<std::size_t>(k)] = pixelBytes(src + static_cast<std::size_t>(sy) * width) + strip;
+                }
+                convolveSpans(sources.data(), weights.data(), taps, pixelBytes(dst + static_cast<std::size_t>(y) * width) + strip,
+                              count);
+            }
+        }
+    });
 
-            image.setPixel(x, y, PixelRGBA8(clampByte(static_cast<int>(std::lround(outR))),
-                                            clampByte(static_cast<int>(std::lround(outG))),
-                                            clampByte(static_cast<int>(std::lround(outB))),
-                                            src.a));
+    // Horizontal taps of a padded copy of each row are offsets into it.
+    std::vector<std::vector<PixelRGBA8>> padded(static_cast<std::size_t>(parallelWorkerCount(height, threads)));
+    parallelForWorkers(height, threads, [&](int y, int worker) {
+        std::vector<PixelRGBA8>& row = padded[static_cast<std::size_t>(worker)];
+        PixelRGBA8* line = dst + static_cast<std::size_t>(y) * width;
+        padRow(line, width, radius, row);
+        std::vector<const std::uint8_t*> sources(static_cast<std::size_t>(taps));
+        for (int k = 0; k < taps; ++k) {
+            sources[static_cast<std::size_t>(k)] = pixelBytes(row.data() + k);
         }
+        convolveSpans(sources.data(), weights.data(), taps, pixelBytes(line), rowBytes);
+    });
+    image = out;
+}
+
+// Radii of three box blurs whose cascade has the variance of the gaussian.
+std::array<int, 3> boxBlurRadii(double sigma) {
+    const double ideal = std::sqrt(12.0 * sigma * sigma / 3.0 + 1.0);
+    int lower = static_cast<int>(std::floor(ideal));
+    if (lower % 2 == 0) {
+        --lower;
+    }
+    const double lowerWidth = static_cast<double>(lower);
+    const int lowerCount = static_cast<int>(std::lround((12.0 * sigma * sigma - 3.0 * lowerWidth * lowerWidth - 12.0 * lowerWidth - 9.0) /
+                                                        (-4.0 * lowerWidth - 4.0)));
+    std::array<int, 3> radii{};
+    for (int i = 0; i < 3; ++i) {
+        radii[static_cast<std::size_t>(i)] = ((i < lowerCount ? lower : lower + 2) - 1) / 2;
     }
+    return radii;
 }
 
-void applyInvertToLayer(Layer& layer, bool preserveAlpha) {
-    ImageBuffer& image = layer.image();
-    for (int y = 0; y < image.height(); ++y) {
-        for (int x = 0; x < image.width(); ++x) {
-            const PixelRGBA8 src = image.getPixel(x, y);
-            image.setPixel(x, y, PixelRGBA8(static_cast<std::uint8_t>(255 - src.r),
-                                            static_cast<std::uint8_t>(255 - src.g),
-                                            static_cast<std::uint8_t>(255 - src.b),
-                                            preserveAlpha ? src.a : static_cast<std::uint8_t>(255 - src.a)));
+// Rounds sum / width to the nearest byte. Box widths are odd, so the mean
+// is never exactly halfway, and float error stays far below the gap.
+std::uint8_t boxMean(std::uint32_t sum, float inverse) {
+    return static_cast<std::uint8_t>(static_cast<float>(sum) * inverse + 0.5f);
+}
+
+// Running sums down each column of a strip, edges clamped. Blocks of 16
+// bytes keep the sums in vector registers.
+void boxBlurColumns(const std::uint8_t* src, std::uint8_t* dst, std::size_t rowBytes, int height, std::size_t begin,
+                    std::size_t count, int radius, std::vector<std::uint32_t>& sums) {
+    const float inverse = 1.0f / static_cast<float>(radius * 2 + 1);
+    sums.assign(count, 0);
+    const std::size_t blocked = count - count % 16;
+    const auto rowAt = [&](int y) { return src + static_cast<std::size_t>(std::clamp(y, 0, height - 1)) * rowBytes + begin; };
+    for (int k = -radius; k <= radius; ++k) {
+        const std::uint8_t* row = rowAt(k);
+        for (std::size_t i = 0; i < count; ++i) {
+            sums[i] += row[i];
+        }
+    }
+    std::uint32_t* sum = sums.data();
+    for (int y = 0; y < height; ++y) {
+        std::uint8_t* out = dst + static_cast<std::size_t>(y) * rowBytes + begin;
+        const std::uint8_t* entering = rowAt(y + radius + 1);
+        const std::uint8_t* leaving = rowAt(y - radius);
+        for (std::size_t i = 0; i < blocked; i += 16) {
+            for (int j = 0; j < 16; ++j) {
+                out[i + j] = boxMean(sum[i + j], inverse);
+                sum[i + j] += static_cast<std::uint32_t>(entering[i + j]) - leaving[i + j];
+            }
+        }
+        for (std::size_t i = blocked; i < count; ++i) {
+            out[i] = boxMean(sum[i], inverse);
+            sum[i] += static_cast<std::uint32_t>(entering[i]) - leaving[i];
         }
     }
 }
 
-void applyThresholdToLayer(Layer& layer, int threshold, const PixelRGBA8& lo, const PixelRGBA8& hi) {
-    const int t = std::max(0, std::min(255, threshold));
-    ImageBuffer& image = layer.image();
-    for (int y = 0; y < image.height(); ++y) {
-        for (int x = 0; x < image.width(); ++x) {
-            const PixelRGBA8 src = image.getPixel(x, y);
-            const int luma = static_cast<int>(std::lround(0.299 * static_cast<double>(src.r) +
-                                                          0.587 * static_cast<double>(src.g) +
-                                                          0.114 * static_cast<double>(src.b)));
-            image.setPixel(x, y, luma >= t ? hi : lo);
+// Running sums along a padded row, written back over the row.
+void boxBlurRow(PixelRGBA8* line, int width, int radius, std::vector<PixelRGBA8>& padded) {
+    padRow(line, width, radius, padded);
+    const int boxWidth = radius * 2 + 1;
+    const float inverse = 1.0f / static_cast<float>(boxWidth);
+    const std::uint8_t* row = pixelBytes(padded.data());
+    std::uint8_t* out = pixelBytes(line);
+    std::uint32_t sums[4] = {};
+    for (int k = 0; k < boxWidth; ++k) {
+        for (int c = 0; c < 4; ++c) {
+            sums[c] += row[k * 4 + c];
+        }
+    }
+    const std::uint8_t* entering = row + static_cast<std::size_t>(boxWidth) * 4;
+    for (int x = 0; x < width; ++x, out += 4, row += 4, entering += 4) {
+        for (int c = 0; c < 4; ++c) {
+            out[c] = boxMean(sums[c], inverse);
+        }
+        if (x + 1 < width) {
+            for (int c = 0; c < 4; ++c) {
+                sums[c] += static_cast<std::uint32_t>(entering[c]) - row[c];
+            }
         }
     }
 }
 
-float luma01(const PixelRGBA8& p) {
-    return (0.299f * static_cast<float>(p.r) +
-            0.587f * static_cast<float>(p.g) +
-            0.114f * static_cast<float>(p.b)) / 255.0f;
+void boxBlurGaussian(ImageBuffer& image, double sigma, int threads) {
+    const int width = image.width();
+    const int height = image.height();
+    const std::array<int, 3> radii = boxBlurRadii(sigma);
+    const std::size_t rowBytes = static_cast<std::size_t>(width) * 4;
+    const int strips = static_cast<int>((rowBytes + kBlurStripBytes - 1) / kBlurStripBytes);
+
+    // Each pass clamps at the edge of what it reads. Padding the image with
+    // its clamped edges by the reach of the passes before the last keeps
+    // those clamps on constant runs, so the cascade sees the same clamped
+    // source as the direct kernel instead of re-padding blurred edges.
+    const int pad = radii[0] + radii[1];
+    const int paddedHeight = height + pad * 2;
+
+    // Vertical passes ping-pong between two padded buffers, a column strip
+    // per task; horizontal passes then run per row on a padded copy.
+    ImageBuffer tall(width, paddedHeight);
+    ImageBuffer scratch(width, paddedHeight);
+    for (int y = 0; y < paddedHeight; ++y) {
+        const PixelRGBA8* src = static_cast<const ImageBuffer&>(image).row(std::clamp(y - pad, 0, height - 1));
+        std::copy(src, src + width, tall.row(y));
+    }
+    ImageBuffer* from = &tall;
+    ImageBuffer* to = &scratch;
+    std::vector<std::vector<std::uint32_t>> sums(static_cast<std::size_t>(parallelWorkerCount(strips, threads)));
+    for (int radius : radii) {
+        const std::uint8_t* src = pixelBytes(static_cast<const ImageBuffer&>(*from).data());
+        std::uint8_t* dst = pixelBytes(to->data());
+        parallelForWorkers(strips, threads, [&](int strip, int worker) {
+            const std::size_t begin = static_cast<std::size_t>(strip) * kBlurStripBytes;
+            boxBlurColumns(src, dst, rowBytes, paddedHeight, begin, std::min(kBlurStripBytes, rowBytes - begin), radius,
+                           sums[static_cast<std::size_t>(worker)]);
+        });
+        std::swap(from, to);
+    }
+
+    const ImageBuffer& columns = *from;
+    const int workers = parallelWorkerCount(height, threads);
+    std::vector<std::vector<PixelRGBA8>> lines(static_cast<std::size_t>(workers));
+    std::vector<std::vector<PixelRGBA8>> padded(static_cast<std::size_t>(workers));
+    parallelForWorkers(height, threads, [&](int y, int worker) {
+        std::vector<PixelRGBA8>& line = lines[static_cast<std::size_t>(worker)];
+        padRow(columns.row(y + pad), width, pad, line);
+        for (int radius : radii) {
+            boxBlurRow(line.data(), width + pad * 2, radius, padded[static_cast<std::size_t>(worker)]);
+        }
+        std::copy(line.begin() + pad, line.begin() + pad + width, image.row(y));
+    });
 }
 
-PixelRGBA8 sampleClamped(const ImageBuffer& image, int x, int y) {
-    const int sx = std::max(0, std::min(image.width() - 1, x));
-    const int sy = std::max(0, std::min(image.height() - 1, y));
-    return image.getPixel(sx, sy);
+double blurSigma(int radius, double sigma) {
+    return sigma > 0.0 ? sigma : (0.3 * static_cast<double>(radius) + 0.8);
 }
 
-void applyGaussianBlurToBuffer(ImageBuffer& image, int radius, double sigma) {
+bool usesBoxBlur(int radius, double effectiveSigma) {
+    return radius > kBoxBlurMinRadius && static_cast<double>(radius) >= 2.5 * effectiveSigma;
+}
+
+// Farthest a blurred pixel reads from, which is the halo a region needs.
+int gaussianBlurReach(int radius, double sigma) {
     if (radius <= 0) {
+        return 0;
+    }
+    const double effectiveSigma = blurSigma(radius, sigma);
+    if (!usesBoxBlur(radius, effectiveSigma)) {
+        return radius;
+    }
+    const std::array<int, 3> radii = boxBlurRadii(effectiveSigma);
+    return radii[0] + radii[1] + radii[2];
+}
+
+void applyGaussianBlurToBuffer(ImageBuffer& image, int radius, double sigma, int threads) {
+    if (radius <= 0 || image.width() <= 0 || image.height() <= 0) {
         return;
     }
-    const double effectiveSigma = sigma > 0.0 ? sigma : (0.3 * static_cast<double>(radius) + 0.8);
+    const double effectiveSigma = blurSigma(radius, sigma);
+    if (usesBoxBlur(radius, effectiveSigma)) {
+        boxBlurGaussian(image, effectiveSigma, threads);
+        return;
+    }
+    convolveGaussian(image, radius, effectiveSigma, threads);
+}
 
-    std::vector<float> kernel(static_cast<std::size_t>(radius * 2 + 1), 0.0f);
-    double sum = 0.0;
-    for (int i = -radius; i <= radius; ++i) {
-        const double x = static_cast<double>(i);
-        const double w = std::exp(-(x * x) / (2.0 * effectiveSigma * effectiveSigma));
-        kernel[static_cast<std::size_t>(i + radius)] = static_cast<float>(w);
-        sum += w;
-    }
-    for (float& w : kernel) {
-        w = static_cast<float>(w / sum);
-    }
-
-    ImageBuffer tmp(image.width(), image.height(), PixelRGBA8(0, 0, 0, 0));
-    for (int y = 0; y < image.height(); ++y) {
-        for (int x = 0; x < image.width(); ++x) {
-            double ar = 0.0;
-            double ag = 0.0;
-            double ab = 0.0;
-            double aa = 0.0;
-            for (int k = -radius; k <= radius; ++k) {
-                const PixelRGBA8 s = sampleClamped(image, x + k, y);
-                const float w = kernel[static_cast<std::size_t>(k + radius)];
-                ar += w * static_cast<double>(s.r);
-                ag += w * static_cast<double>(s.g);
-                ab += w * static_cast<double>(s.b);
-                aa += w * static_cast<double>(s.a);
-            }
-            tmp.setPixel(x, y, PixelRGBA8(clampByte(static_cast<int>(std::lround(ar))),
-                                          clampByte(static_cast<int>(std::lround(ag))),
-                                          clampByte(static_cast<int>(std::lround(ab))),
-                                          clampByte(static_cast<int>(std::lround(aa)))));
-        }
-    }
-
-    ImageBuffer out(image.width(), image.height(), PixelRGBA8(0, 0, 0, 0));
-    for (int y = 0; y < image.height(); ++y) {
-        for (int x = 0; x < image.width(); ++x) {
-            double ar = 0.0;
-            double ag = 0.0;
-            double ab = 0.0;
-            double aa = 0.0;
-            for (int k = -radius; k <= radius; ++k) {
-                const PixelRGBA8 s = sampleClamped(tmp, x, y + k);
-                const float w = kernel[static_cast<std::size_t>(k + radius)];
-                ar += w * static_cast<double>(s.r);
-                ag += w * static_cast<double>(s.g);
-                ab += w * static_cast<double>(s.b);
-                aa += w * static_cast<double>(s.a);
-            }
-            out.setPixel(x, y, PixelRGBA8(clampByte(static_cast<int>(std::lround(ar))),
-                                          clampByte(static_cast<int>(std::lround(ag))),
-                                          clampByte(static_cast<int>(std::lround(ab))),
-                                          clampByte(static_cast<int>(std::lround(aa)))));
+// Rows per edge-detect tile; each tile reads one halo row either side.
+constexpr int kEdgeBandRows = 32;
+// Context kept around a region for Canny, so edges that leave the region
+// and come back can still link up.
+constexpr int kCannyRegionHalo = 16;
+
+// Luma scaled to 0..255000, so integer gradients keep the precision of
+// luma01 while the plane is only computed once.
+void computeLumaPlane(const ImageBuffer& image, std::vector<std::int32_t>& luma, int threads) {
+    const int width = image.width();
+    luma.resize(static_cast<std::size_t>(width) * static_cast<std::size_t>(image.height()));
+    parallelFor(image.height(), threads, [&](int y) {
+        const PixelRGBA8* src = image.row(y);
+        std::int32_t* dst = luma.data() + static_cast<std::size_t>(y) * static_cast<std::size_t>(width);
+        for (int x = 0; x < width; ++x) {
+            dst[x] = 299 * src[x].r + 587 * src[x].g + 114 * src[x].b;
         }
+    });
+}
+
+// Sobel gradients of one row, with edge samples clamped.
+void sobelRow(const std::vector<std::int32_t>& luma, int width, int height, int y, std::int32_t* gx, std::int32_t* gy) {
+    const auto rowAt = [&](int row) {
+        return luma.data() + static_cast<std::size_t>(std::clamp(row, 0, height - 1)) * static_cast<std::size_t>(width);
+    };
+    const std::int32_t* up = rowAt(y - 1);
+    const std::int32_t* mid = rowAt(y);
+    const std::int32_t* down = rowAt(y + 1);
+    for (int x = 0; x < width; ++x) {
+        const int left = x > 0 ? x - 1 : 0;
+        const int right = x + 1 < width ? x + 1 : width - 1;
+        gx[x] = (up[right] - up[left]) + 2 * (mid[right] - mid[left]) + (down[right] - down[left]);
+        gy[x] = (down[left] - up[left]) + 2 * (down[x] - up[x]) + (down[right] - up[right]);
     }
-    image = out;
 }
 
-void applySobelToBuffer(ImageBuffer& image, bool keepAlpha) {
-    static const int kx[3][3] = {
-        {-1, 0, 1},
-        {-2, 0, 2},
-        {-1, 0, 1}};
-    static const int ky[3][3] = {
-        {-1, -2, -1},
-        {0, 0, 0},
-        {1, 2, 1}};
-
-    ImageBuffer out(image.width(), image.height(), PixelRGBA8(0, 0, 0, 255));
-    for (int y = 0; y < image.height(); ++y) {
-        for (int x = 0; x < image.width(); ++x) {
-            double gx = 0.0;
-            double gy = 0.0;
-            for (int j = -1; j <= 1; ++j) {
-                for (int i = -1; i <= 1; ++i) {
-                    const float l = luma01(sampleClamped(image, x + i, y + j));
-                    gx += static_cast<double>(kx[j + 1][i + 1]) * l;
-                    gy += static_cast<double>(ky[j + 1][i + 1]) * l;
-                }
+std::int64_t squaredMagnitude(std::int32_t gx, std::int32_t gy) {
+    return static_cast<std::int64_t>(gx) * gx + static_cast<std::int64_t>(gy) * gy;
+}
+
+void applySobelToBuffer(ImageBuffer& image, bool keepAlpha, int threads) {
+    const int width = image.width();
+    const int height = image.height();
+    if (width <= 0 || height <= 0) {
+        return;
+    }
+    std::vector<std::int32_t> luma;
+    computeLumaPlane(image, luma, threads);
+    const int bands = (height + kEdgeBandRows - 1) / kEdgeBandRows;
+    std::vector<std::vector<std::int32_t>> gradients(static_cast<std::size_t>(parallelWorkerCount(bands, threads)));
+    PixelRGBA8* pixels = image.data();
+    parallelForWorkers(bands, threads, [&](int band, int worker) {
+        std::vector<std::int32_t>& gradient = gradients[static_cast<std::size_t>(worker)];
+        gradient.resize(static_cast<std::size_t>(width) * 2);
+        std::int32_t* gx = gradient.data();
+        std::int32_t* gy = gx + width;
+        for (int y = band * kEdgeBandRows; y < std::min(height, (band + 1) * kEdgeBandRows); ++y) {
+            sobelRow(luma, width, height, y, gx, gy);
+            PixelRGBA8* dst = pixels + static_cast<std::size_t>(y) * static_cast<std::size_t>(width);
+            for (int x = 0; x < width; ++x) {
+                // 255 at a luma01 gradient of 4, that is 4000 in luma units.
+                const double magnitude = std::sqrt(static_cast<double>(squaredMagnitude(gx[x], gy[x]))) / 4000.0;
+                const auto m = static_cast<std::uint8_t>(std::min(255L, std::lround(magnitude)));
+                dst[x] = PixelRGBA8(m, m, m, keepAlpha ? dst[x].a : 255);
             }
-            const double mag = std::sqrt(gx * gx + gy * gy);
-            const int m = std::max(0, std::min(255, static_cast<int>(std::lround(255.0 * std::min(1.0, mag / 4.0)))));
-            const std::uint8_t alpha = keepAlpha ? image.getPixel(x, y).a : 255;
-            out.setPixel(x, y, PixelRGBA8(static_cast<std::uint8_t>(m),
-                                          static_cast<std::uint8_t>(m),
-                                          static_cast<std::uint8_t>(m),
-                                          alpha));
         }
+    });
+}
+
+enum class EdgeClass : std::uint8_t { None, Weak, Strong };
+
+std::uint32_t findEdgeRoot(std::vector<std::uint32_t>& parent, std::uint32_t i) {
+    while (parent[i] != i) {
+        parent[i] = parent[parent[i]];
+        i = parent[i];
     }
-    image = out;
+    return i;
 }
 
-void applyCannyToBuffer(ImageBuffer& image, int lowThreshold, int highThreshold, bool keepAlpha) {
+// Joins two weak or strong pixels; the root of a component is marked
+// strong when any of its pixels is.
+void joinEdges(std::vector<std::uint32_t>& parent, std::vector<EdgeClass>& classes, std::uint32_t a, std::uint32_t b) {
+    a = findEdgeRoot(parent, a);
+    b = findEdgeRoot(parent, b);
+    if (a == b) {
+        return;
+    }
+    if (b < a) {
+        std::swap(a, b);
+    }
+    parent[b] = a;
+    classes[a] = std::max(classes[a], classes[b]);
+}
+
+// Fused per tile: gradients with a halo row, non-maximum suppression,
+// threshold classes and union-find joins inside the tile. Joins across
+// tile edges run afterwards, so hysteresis needs no queue over the image.
+void applyCannyToBuffer(ImageBuffer& image, int lowThreshold, int highThreshold, bool keepAlpha, int threads) {
     const int w = image.width();
     const int h = image.height();
     if (w <= 0 || h <= 0) {
         return;
     }
+    std::vector<std::int32_t> luma;
+    computeLumaPlane(image, luma, threads);
+    // Thresholds on luma01 magnitudes, squared in luma units.
+    const std::int64_t low = static_cast<std::int64_t>(std::clamp(lowThreshold, 0, 255)) * 1000;
+    const std::int64_t high = static_cast<std::int64_t>(std::clamp(highThreshold, 0, 255)) * 1000;
+    const std::int64_t lowSquared = low * low;
+    const std::int64_t highSquared = high * high;
+    // tan(22.5) and tan(67.5) in 16.16 fixed point pick the direction
+    // sectors without atan2.
+    constexpr std::int64_t kTan22 = 27146;
+    constexpr std::int64_t kTan67 = 158217;
+
+    const std::size_t pixelCount = static_cast<std::size_t>(w) * static_cast<std::size_t>(h);
+    std::vector<EdgeClass> classes(pixelCount, EdgeClass::None);
+    std::vector<std::uint32_t> parent(pixelCount);
+    const auto idx = [w](int x, int y) {
+        return static_cast<std::uint32_t>(static_cast<std::size_t>(y) * static_cast<std::size_t>(w) + static_cast<std::size_t>(x));
+    };
 
-    std::vector<float> gx(static_cast<std::size_t>(w) * static_cast<std::size_t>(h), 0.0f);
-    std::vector<float> gy(static_cast<std::size_t>(w) * static_cast<std::size_t>(h), 0.0f);
-    std::vector<float> mag(static_cast<std::size_t>(w) * static_cast<std::size_t>(h), 0.0f);
-    std::vector<float> dir(static_cast<std::size_t>(w) * static_cast<std::size_t>(h), 0.0f);
-    auto idx = [w](int x, int y) { return static_cast<std::size_t>(y) * static_cast<std::size_t>(w) + static_cast<std::size_t>(x); };
-
-    static const int kx[3][3] = {
-        {-1, 0, 1},
-        {-2, 0, 2},
-        {-1, 0, 1}};
-    static const int ky[3][3] = {
-        {-1, -2, -1},
-        {0, 0, 0},
-        {1, 2, 1}};
+    struct TileScratch {
+        std::vector<std::int32_t> gx;
+        std::vector<std::int32_t> gy;
+        std::vector<std::int64_t> magnitude;
+    };
+    const int bands = (h + kEdgeBandRows - 1) / kEdgeBandRows;
+    std::vector<TileScratch> scratch(static_cast<std::size_t>(parallelWorkerCount(bands, threads)));
+    parallelForWorkers(bands, threads, [&](int band, int worker) {
+        const int y0 = band * kEdgeBandRows;
+        const int y1 = std::min(h, y0 + kEdgeBandRows);
+        TileScratch& tile = scratch[static_cast<std::size_t>(worker)];
+        const std::size_t rows = static_cast<std::size_t>(y1 - y0 + 2);
+        tile.gx.resize(rows * static_cast<std::size_t>(w));
+        tile.gy.resize(rows * static_cast<std::size_t>(w));
+        tile.magnitude.resize(rows * static_cast<std::size_t>(w));
+        const auto at = [&](int x, int y) { return static_cast<std::size_t>(y - y0 + 1) * static_cast<std::size_t>(w) + static_cast<std::size_t>(x); };
+        for (int y = std::max(y0 - 1, 0); y <= std::min(y1, h - 1); ++y) {
+            sobelRow(luma, w, h, y, tile.gx.data() + at(0, y), tile.gy.data() + at(0, y));
+            for (int x = 0; x < w; ++x) {
+                tile.magnitude[at(x, y)] = squaredMagnitude(tile.gx[at(x, y)], tile.gy[at(x, y)]);
+            }
+        }
 
-    for (int y = 0; y < h; ++y) {
-        for (int x = 0; x < w; ++x) {
-            float sx = 0.0f;
-            float sy = 0.0f;
-            for (int j = -1; j <= 1; ++j) {
-                for (int i = -1; i <= 1; ++i) {
-                    const float l = luma01(sampleClamped(image, x + i, y + j));
-                    sx += static_cast<float>(kx[j + 1][i + 1]) * l;
-                    sy += static_cast<float>(ky[j + 1][i + 1]) * l;
+        for (int y = std::max(y0, 1); y < std::min(y1, h - 1); ++y) {
+            for (int x = 1; x + 1 < w; ++x) {
+                const std::int64_t gx = tile.gx[at(x, y)];
+                const std::int64_t gy = tile.gy[at(x, y)];
+                const std::int64_t ax = std::abs(gx);
+                const std::int64_t ay = std::abs(gy) << 16;
+                std::size_t q = 0;
+                std::size_t r = 0;
+                if (ay < kTan22 * ax) {
+                    q = at(x + 1, y);
+                    r = at(x - 1, y);
+                } else if (ay >= kTan67 * ax) {
+                    q = at(x, y + 1);
+                    r = at(x, y - 1);
+                } else if ((gx < 0) == (gy < 0)) {
+                    q = at(x + 1, y - 1);
+                    r = at(x - 1, y + 1);
+                } else {
+                    q = at(x - 1, y - 1);
+                    r = at(x + 1, y + 1);
+                }
+                // Squared magnitudes are exact, so equal gradients tie and both
+                // pixels stay. The float path this replaced split such ties by
+                // an ulp of summation order and dropped a few edge pixels.
+                const std::int64_t m = tile.magnitude[at(x, y)];
+                const std::int64_t kept = m >= tile.magnitude[q] && m >= tile.magnitude[r] ? m : 0;
+                const std::uint32_t i = idx(x, y);
+                if (kept >= highSquared) {
+                    classes[i] = EdgeClass::Strong;
+                } else if (kept >= lowSquared) {
+                    classes[i] = EdgeClass::Weak;
+                } else {
+                    continue;
+                }
+                parent[i] = i;
+                for (int dx = -1; dx <= 1; ++dx) {
+                    if (y > y0 && classes[idx(x + dx, y - 1)] != EdgeClass::None) {
+                        joinEdges(parent, classes, i, idx(x + dx, y - 1));
+                    }
+                }
+                if (classes[idx(x - 1, y)] != EdgeClass::None) {
+                    joinEdges(parent, classes, i, idx(x - 1, y));
                 }
             }
-            gx[idx(x, y)] = sx;
-            gy[idx(x, y)] = sy;
-            mag[idx(x, y)] = std::sqrt(sx * sx + sy * sy);
-            dir[idx(x, y)] = std::atan2(sy, sx);
         }
-    }
+    });
 
-    std::vector<float> nms(static_cast<std::size_t>(w) * static_cast<std::size_t>(h), 0.0f);
-    for (int y = 1; y + 1 < h; ++y) {
+    for (int y = kEdgeBandRows; y < h; y += kEdgeBandRows) {
         for (int x = 1; x + 1 < w; ++x) {
-            const float angle = dir[idx(x, y)] * 180.0f / 3.14159265358979323846f;
-            float norm = angle;
-            if (norm < 0.0f) {
-                norm += 180.0f;
+            if (classes[idx(x, y)] == EdgeClass::None) {
+                continue;
             }
-
-            float q = 0.0f;
-            float r = 0.0f;
-            if ((norm >= 0.0f && norm < 22.5f) || (norm >= 157.5f && norm <= 180.0f)) {
-                q = mag[idx(x + 1, y)];
-                r = mag[idx(x - 1, y)];
-            } else if (norm >= 22.5f && norm < 67.5f) {
-                q = mag[idx(x + 1, y - 1)];
-                r = mag[idx(x - 1, y + 1)];
-            } else if (norm >= 67.5f && norm < 112.5f) {
-                q = mag[idx(x, y + 1)];
-                r = mag[idx(x, y - 1)];
-            } else {
-                q = mag[idx(x - 1, y - 1)];
-                r = mag[idx(x + 1, y + 1)];
+            for (int dx = -1; dx <= 1; ++dx) {
+                if (classes[idx(x + dx, y - 1)] != EdgeClass::None) {
+                    joinEdges(parent, classes, idx(x, y), idx(x + dx, y - 1));
+                }
             }
-
-            const float m = mag[idx(x, y)];
-            nms[idx(x, y)] = (m >= q && m >= r) ? m : 0.0f;
         }
     }
 
-    const float low = static_cast<float>(std::max(0, std::min(255, lowThreshold))) / 255.0f;
-    const float high = static_cast<float>(std::max(0, std::min(255, highThreshold))) / 255.0f;
-
-    std::vector<std::uint8_t> edges(static_cast<std::size_t>(w) * static_cast<std::size_t>(h), 0);
-    std::deque<std::pair<int, int>> q;
-    for (int y = 1; y + 1 < h; ++y) {
-        for (int x = 1; x + 1 < w; ++x) {
-            const float m = nms[idx(x, y)];
-            if (m >= high) {
-                edges[idx(x, y)] = 255;
-                q.emplace_back(x, y);
-            } else if (m >= low) {
-                edges[idx(x, y)] = 128;
+    PixelRGBA8* pixels = image.data();
+    parallelFor(h, threads, [&](int y) {
+        PixelRGBA8* dst = pixels + static_cast<std::size_t>(y) * static_cast<std::size_t>(w);
+        for (int x = 0; x < w; ++x) {
+            std::uint32_t root = idx(x, y);
+            bool edge = classes[root] != EdgeClass::None;
+            if (edge) {
+                // Read-only walk: other rows resolve their roots concurrently.
+                while (parent[root] != root) {
+                    root = parent[root];
+                }
+                edge = classes[root] == EdgeClass::Strong;
             }
+            const std::uint8_t v = edge ? 255 : 0;
+            dst[x] = PixelRGBA8(v, v, v, keepAlpha ? dst[x].a : 255);
         }
-    }
+    });
+}
 
-    while (!q.empty()) {
-        const auto [x, y] = q.front();
-        q.pop_front();
-        for (int j = -1; j <= 1; ++j) {
-            for (int i = -1; i <= 1; ++i) {
-                if (i == 0 && j == 0) {
-                    continue;
-                }
-                const int nx = x + i;
-                const int ny = y + j;
-                if (nx < 0 || nx >= w || ny < 0 || ny >= h) {
-                    continue;
-                }
-                std::uint8_t& e = edges[idx(nx, ny)];
-                if (e == 128) {
-                    e = 255;
-                    q.emplace_back(nx, ny);
-                }
-            }
+// Column strips for vertical min/max passes; small enough that a strip's
+// suffix scratch for a full column stays in cache.
+constexpr std::size_t kMorphologyStripBytes = 256;
+
+struct MaxOf {
+    std::uint8_t operator()(std::uint8_t a, std::uint8_t b) const { return std::max(a, b); }
+};
+
+struct MinOf {
+    std::uint8_t operator()(std::uint8_t a, std::uint8_t b) const { return std::min(a, b); }
+};
+
+template <typename Pick>
+void pickSpan(std::uint8_t* dst, const std::uint8_t* a, const std::uint8_t* b, std::size_t count, Pick pick) {
+    if (count == 4) {
+        for (int j = 0; j < 4; ++j) {
+            dst[j] = pick(a[j], b[j]);
         }
+        return;
+    }
+    std::size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        for (int j = 0; j < 16; ++j) {
+            dst[i + j] = pick(a[i + j], b[i + j]);
+        }
+    }
+    for (; i < count; ++i) {
+        dst[i] = pick(a[i], b[i]);
     }
+}
 
-    ImageBuffer out(w, h, PixelRGBA8(0, 0, 0, 255));
-    for (int y = 0; y < h; ++y) {
-        for (int x = 0; x < w; ++x) {
-            const std::uint8_t v = edges[idx(x, y)] == 255 ? 255 : 0;
-            const std::uint8_t alpha = keepAlpha ? image.getPixel(x, y).a : 255;
-            out.setPixel(x, y, PixelRGBA8(v, v, v, alpha));
+// Min or max over radius elements either side, along a line of n elements
+// that are count bytes wide and stride bytes apart; elements past the ends
+// are ignored. Van Herk/Gil-Werman: within blocks of 2r+1 elements a
+// backward pass keeps suffix extremes and a forward pass prefix extremes,
+// so every window is one pick of the two whatever the radius. The forward
+// pass only writes behind its read position, so this works in place.
+template <typename Pick>
+void extremeAlongLine(std::uint8_t* line, std::ptrdiff_t stride, int n, std::size_t count, int radius, Pick pick,
+                      std::vector<std::uint8_t>& scratch) {
+    if (radius <= 0 || n <= 1) {
+        return;
+    }
+    const int window = radius * 2 + 1;
+    scratch.resize((static_cast<std::size_t>(n) + 1) * count);
+    std::uint8_t* prefix = scratch.data() + static_cast<std::size_t>(n) * count;
+    const auto at = [&](int k) { return line + static_cast<std::ptrdiff_t>(k) * stride; };
+    const auto suffix = [&](int k) { return scratch.data() + static_cast<std::size_t>(k) * count; };
+    // Blocks start at -radius, so the window of element i starts a block
+    // exactly when i is a multiple of the window.
+    for (int k = n - 1; k >= 0; --k) {
+        if (k == n - 1 || (k + radius) % window == window - 1) {
+            std::memcpy(suffix(k), at(k), count);
+        } else {
+            pickSpan(suffix(k), at(k), suffix(k + 1), count, pick);
+        }
+    }
+    for (int k = 0; k < n; ++k) {
+        if (k == 0 || (k + radius) % window == 0) {
+            std::memcpy(prefix, at(k), count);
+        } else {
+            pickSpan(prefix, prefix, at(k), count, pick);
+        }
+        if (k >= radius) {
+            pickSpan(at(k - radius), suffix(std::max(k - radius * 2, 0)), prefix, count, pick);
+        }
+    }
+    for (int i = std::max(n - radius, 0); i < n; ++i) {
+        const int last = i + radius;
+        const int blockStart = last - (last + radius) % window;
+        if (blockStart < n) {
+            pickSpan(at(i), suffix(std::max(i - radius, 0)), prefix, count, pick);
+        } else {
+            std::memcpy(at(i), suffix(std::max(i - radius, 0)), count);
         }
     }
-    image = out;
 }
 
-void applyMorphologyToBuffer(ImageBuffer& image, const std::string& op, int radius, int iterations) {
-    if (radius <= 0 || iterations <= 0) {
+enum class MorphologyShape { Square, Line, Disc };
+
+// Runs one line element through the image: angle 0 is horizontal, 90
+// vertical, 45 and 135 the diagonals running down-right and down-left.
+template <typename Pick>
+void extremeAlongAngle(ImageBuffer& image, int angle, int radius, Pick pick, int threads) {
+    if (radius <= 0) {
         return;
     }
-    const bool dilate = op == "dilate";
-    const bool erode = op == "erode";
-    if (!dilate && !erode) {
-        throw std::runtime_error("morphology op must be erode or dilate");
+    const int width = image.width();
+    const int height = image.height();
+    std::uint8_t* pixels = pixelBytes(image.data());
+    const std::size_t rowBytes = static_cast<std::size_t>(width) * 4;
+    const auto rowStride = static_cast<std::ptrdiff_t>(rowBytes);
+    if (angle == 90) {
+        const int strips = static_cast<int>((rowBytes + kMorphologyStripBytes - 1) / kMorphologyStripBytes);
+        std::vector<std::vector<std::uint8_t>> scratch(static_cast<std::size_t>(parallelWorkerCount(strips, threads)));
+        parallelForWorkers(strips, threads, [&](int strip, int worker) {
+            const std::size_t begin = static_cast<std::size_t>(strip) * kMorphologyStripBytes;
+            extremeAlongLine(pixels + begin, rowStride, height, std::min(kMorphologyStripBytes, rowBytes - begin), radius,
+                             pick, scratch[static_cast<std::size_t>(worker)]);
+        });
+        return;
+    }
+    if (angle == 0) {
+        std::vector<std::vector<std::uint8_t>> scratch(static_cast<std::size_t>(parallelWorkerCount(height, threads)));
+        parallelForWorkers(height, threads, [&](int y, int worker) {
+            extremeAlongLine(pixels + static_cast<std::size_t>(y) * rowBytes, 4, width, 4, radius, pick,
+                             scratch[static_cast<std::size_t>(worker)]);
+        });
+        return;
     }
+    // Diagonals start along the top row, then down the left (45) or right
+    // (135) column.
+    const bool downRight = angle == 45;
+    const int diagonals = width + height - 1;
+    std::vector<std::vector<std::uint8_t>> scratch(static_cast<std::size_t>(parallelWorkerCount(diagonals, threads)));
+    parallelForWorkers(diagonals, threads, [&](int d, int worker) {
+        const int x = d < width ? d : (downRight ? 0 : width - 1);
+        const int y = d < width ? 0 : d - width + 1;
+        const int length = std::min(height - y, downRight ? width - x : x + 1);
+        extremeAlongLine(pixels + static_cast<std::size_t>(y) * rowBytes + static_cast<std::size_t>(x) * 4,
+                         downRight ? rowStride + 4 : rowStride - 4, length, 4, radius, pick,
+                         scratch[static_cast<std::size_t>(worker)]);
+    });
+}
 
-    for (int iter = 0; iter < iterations; ++iter) {
-        ImageBuffer out(image.width(), image.height(), PixelRGBA8(0, 0, 0, 0));
-        for (int y = 0; y < image.height(); ++y) {
-            for (int x = 0; x < image.width(); ++x) {
-                int bestR = dilate ? 0 : 255;
-                int bestG = dilate ? 0 : 255;
-                int bestB = dilate ? 0 : 255;
-                int bestA = dilate ? 0 : 255;
-                for (int j = -radius; j <= radius; ++j) {
-                    for (int i = -radius; i <= radius; ++i) {
-                        if ((i * i + j * j) > (radius * radius)) {
-                            continue;
-                        }
-                        const PixelRGBA8 s = sampleClamped(image, x + i, y + j);
-                        if (dilate) {
-                            bestR = std::max(bestR, static_cast<int>(s.r));
-                            bestG = std::max(bestG, static_cast<int>(s.g));
-                            bestB = std::max(bestB, static_cast<int>(s.b));
-                            bestA = std::max(bestA, static_cast<int>(s.a));
-                        } else {
-                            bestR = std::min(bestR, static_cast<int>(s.r));
-                            bestG = std::min(bestG, static_cast<int>(s.g));
-                            bestB = std::min(bestB, static_cast<int>(s.b));
-                            bestA = std::min(bestA, static_cast<int>(s.a));
-                        }
-                    }
-                }
-                out.setPixel(x, y, PixelRGBA8(static_cast<std::uint8_t>(bestR),
-                                              static_cast<std::uint8_t>(bestG),
-                                              static_cast<std::uint8_t>(bestB),
-                                              static_cast<std::uint8_t>(bestA)));
-            }
+// Min/max over the structuring element, in place. Every shape is a
+// Minkowski sum of line segments, so iterations multiply the segment
+// lengths instead of repeating passes. Discs are approximated by octagons
+// from horizontal, vertical and diagonal segments.
+template <typename Pick>
+void applyMorphology(ImageBuffer& image, MorphologyShape shape, int radius, int angle, Pick pick, int threads) {
+    switch (shape) {
+    case MorphologyShape::Square:
+        extremeAlongAngle(image, 0, radius, pick, threads);
+        extremeAlongAngle(image, 90, radius, pick, threads);
+        return;
+    case MorphologyShape::Line:
+        extremeAlongAngle(image, angle, radius, pick, threads);
+        return;
+    case MorphologyShape::Disc: {
+        // Diagonal segments alone only reach every other pixel, so the
+        // axis segments stay at least one pixel long.
+        int diagonal = static_cast<int>(std::lround(static_cast<double>(radius) * (1.0 - std::sqrt(0.5))));
+        if (radius - diagonal * 2 < 1) {
+            diagonal = (radius - 1) / 2;
         }
-        image = out;
+        const int axis = radius - diagonal * 2;
+        extremeAlongAngle(image, 0, axis, pick, threads);
+        extremeAlongAngle(image, 90, axis, pick, threads);
+        extremeAlongAngle(image, 45, diagonal, pick, threads);
+        extremeAlongAngle(image, 135, diagonal, pick, threads);
+        return;
+    }
+    }
+}
+
+void applyMorphologyToBuffer(ImageBuffer& image, const std::string& op, MorphologyShape shape, int radius, int angle,
+                             int iterations, int threads) {
+    const bool dilate = op == "dilate";
+    if (!dilate && op != "erode") {
+        throw std::runtime_error("morphology op must be erode or dilate");
+    }
+    if (radius <= 0 || iterations <= 0 || image.width() <= 0 || image.height() <= 0) {
+        return;
+    }
+    const int folded = static_cast<int>(std::min<long long>(static_cast<long long>(radius) * iterations,
+                                                            std::max(image.width(), image.height())));
+    if (dilate) {
+        applyMorphology(image, shape, folded, angle, MaxOf(), threads);
+    } else {
+        applyMorphology(image, shape, folded, angle, MinOf(), threads);
     }
 }
 
-void applyGammaToBuffer(ImageBuffer& image, double gamma) {
+using ChannelLut = std::array<std::uint8_t, 256>;
+
+ChannelLut gammaLut(double gamma) {
     if (gamma <= 0.0) {
         throw std::runtime_error("gamma must be > 0");
     }
     const double invGamma = 1.0 / gamma;
-    for (int y = 0; y < image.height(); ++y) {
-        for (int x = 0; x < image.width(); ++x) {
-            const PixelRGBA8 src = image.getPixel(x, y);
-            const auto map = [invGamma](std::uint8_t v) {
-                const double n = static_cast<double>(v) / 255.0;
-                return clampByte(static_cast<int>(std::lround(255.0 * std::pow(n, invGamma))));
-            };
-            image.setPixel(x, y, PixelRGBA8(map(src.r), map(src.g), map(src.b), src.a));
-        }
+    ChannelLut lut{};
+    for (int v = 0; v <= 255; ++v) {
+        const double n = static_cast<double>(v) / 255.0;
+        lut[static_cast<std::size_t>(v)] = clampByte(static_cast<int>(std::lround(255.0 * std::pow(n, invGamma))));
     }
+    return lut;
 }
 
-void applyLevelsToBuffer(ImageBuffer& image,
-                         int inBlack,
-                         int inWhite,
-                         double midGamma,
-                         int outBlack,
-                         int outWhite) {
+ChannelLut levelsLut(int inBlack, int inWhite, double midGamma, int outBlack, int outWhite) {
     const double inB = static_cast<double>(std::max(0, std::min(255, inBlack)));
     const double inW = static_cast<double>(std::max(0, std::min(255, inWhite)));
     if (inW <= inB) {
@@ -469,20 +779,15 @@ void applyLevelsToBuffer(ImageBuffer& image,
     const double outB = static_cast<double>(std::max(0, std::min(255, outBlack)));
     const double outW = static_cast<double>(std::max(0, std::min(255, outWhite)));
 
-    auto mapLevel = [&](std::uint8_t v) -> std::uint8_t {
+    ChannelLut lut{};
+    for (int v = 0; v <= 255; ++v) {
         double t = (static_cast<double>(v) - inB) / (inW - inB);
         t = std::max(0.0, std::min(1.0, t));
         t = std::pow(t, 1.0 / midGamma);
         const double out = outB + (outW - outB) * t;
-        return clampByte(static_cast<int>(std::lround(out)));
-    };
-
-    for (int y = 0; y < image.height(); ++y) {
-        for (int x = 0; x < image.width(); ++x) {
-            const PixelRGBA8 src = image.getPixel(x, y);
-            image.setPixel(x, y, PixelRGBA8(mapLevel(src.r), mapLevel(src.g), mapLevel(src.b), src.a));
-        }
+        lut[static_cast<std::size_t>(v)] = clampByte(static_cast<int>(std::lround(out)));
     }
+    return lut;
 }
 
 std::vector<std::pair<int, int>> parseCurvePoints(const std::string& text) {
@@ -501,8 +806,8 @@ std::vector<std::pair<int, int>> parseCurvePoints(const std::string& text) {
     return points;
 }
 
-std::array<std::uint8_t, 256> buildCurveLut(const std::vector<std::pair<int, int>>& points) {
-    std::array<std::uint8_t, 256> lut{};
+ChannelLut buildCurveLut(const std::vector<std::pair<int, int>>& points) {
+    ChannelLut lut{};
     std::size_t seg = 0;
     for (int x = 0; x <= 255; ++x) {
         while (seg + 1 < points.size() && x > points[seg + 1].first) {
@@ -527,31 +832,6 @@ std::array<std::uint8_t, 256> buildCurveLut(const std::vector<std::pair<int, int
     return lut;
 }
 
-void applyCurvesToBuffer(ImageBuffer& image,
-                         const std::array<std::uint8_t, 256>& rgbLut,
-                         const std::array<std::uint8_t, 256>* rLut,
-                         const std::array<std::uint8_t, 256>* gLut,
-                         const std::array<std::uint8_t, 256>* bLut) {
-    for (int y = 0; y < image.height(); ++y) {
-        for (int x = 0; x < image.width(); ++x) {
-            const PixelRGBA8 src = image.getPixel(x, y);
-            std::uint8_t r = rgbLut[src.r];
-            std::uint8_t g = rgbLut[src.g];
-            std::uint8_t b = rgbLut[src.b];
-            if (rLut) {
-                r = (*rLut)[r];
-            }
-            if (gLut) {
-                g = (*gLut)[g];
-            }
-            if (bLut) {
-                b = (*bLut)[b];
-            }
-            image.setPixel(x, y, PixelRGBA8(r, g, b, src.a));
-        }
-    }
-}
-
 float hashUnitNoise(int x, int y, std::uint32_t seed) {
     std::uint32_t n = static_cast<std::uint32_t>(x) * 374761393u;
     n ^= static_cast<std::uint32_t>(y) * 668265263u;
@@ -566,78 +846,153 @@ float smoothstep01(float t) {
     return c * c * (3.0f - 2.0f * c);
 }
 
-float valueNoise(float x, float y, std::uint32_t seed) {
-    const int x0 = static_cast<int>(std::floor(x));
-    const int y0 = static_cast<int>(std::floor(y));
-    const int x1 = x0 + 1;
-    const int y1 = y0 + 1;
-    const float tx = smoothstep01(x - static_cast<float>(x0));
-    const float ty = smoothstep01(y - static_cast<float>(y0));
-
-    const float v00 = hashUnitNoise(x0, y0, seed);
-    const float v10 = hashUnitNoise(x1, y0, seed);
-    const float v01 = hashUnitNoise(x0, y1, seed);
-    const float v11 = hashUnitNoise(x1, y1, seed);
-
-    const float a = v00 + (v10 - v00) * tx;
-    const float b = v01 + (v11 - v01) * tx;
-    return a + (b - a) * ty;
-}
-
-float fractalNoise(float x, float y, int octaves, float lacunarity, float gain, std::uint32_t seed) {
-    float amplitude = 1.0f;
+// One octave of one value-noise field on a w-pixel row: the lattice cell
+// and smoothstep weight of every column, shared by all rows.
+struct NoiseOctave {
+    std::uint32_t seed = 0;
     float frequency = 1.0f;
-    float sum = 0.0f;
-    float norm = 0.0f;
-    for (int o = 0; o < octaves; ++o) {
-        const std::uint32_t octaveSeed = seed + static_cast<std::uint32_t>(o * 1013);
-        sum += amplitude * valueNoise(x * frequency, y * frequency, octaveSeed);
-        norm += amplitude;
-        amplitude *= gain;
-        frequency *= lacunarity;
+    float amplitude = 1.0f;
+    std::vector<int> cells;
+    std::vector<float> weights;
+    int firstCell = 0;
+    int lastCell = 0;
+};
+
+// Fractal value noise sampled at (x / scale + offsetX, y / scale + offsetY),
+// for rows of width pixels starting at column originX.
+// Rows hash each lattice corner once per octave instead of once per pixel;
+// the arithmetic matches evaluating every pixel on its own.
+class NoiseField {
+public:
+    NoiseField(int width, int originX, float scale, float offsetX, float offsetY, int octaves, float lacunarity, float gain,
+               std::uint32_t seed)
+        : m_scale(scale),
+          m_offsetY(offsetY) {
+        float amplitude = 1.0f;
+        float frequency = 1.0f;
+        for (int o = 0; o < octaves; ++o) {
+            NoiseOctave octave;
+            octave.seed = seed + static_cast<std::uint32_t>(o * 1013);
+            octave.frequency = frequency;
+            octave.amplitude = amplitude;
+            octave.cells.resize(static_cast<std::size_t>(width));
+            octave.weights.resize(static_cast<std::size_t>(width));
+            for (int x = 0; x < width; ++x) {
+                const float px = (static_cast<float>(x + originX) / scale + offsetX) * frequency;
+                const int cell = static_cast<int>(std::floor(px));
+                octave.cells[static_cast<std::size_t>(x)] = cell;
+                octave.weights[static_cast<std::size_t>(x)] = smoothstep01(px - static_cast<float>(cell));
+            }
+            octave.firstCell = width > 0 ? *std::min_element(octave.cells.begin(), octave.cells.end()) : 0;
+            octave.lastCell = width > 0 ? *std::max_element(octave.cells.begin(), octave.cells.end()) + 1 : 0;
+            m_norm += amplitude;
+            m_octaves.push_back(std::move(octave));
+            amplitude *= gain;
+            frequency *= lacunarity;
+        }
     }
-    if (norm <= 0.0f) {
-        return 0.0f;
+
+    // Writes the noise of row y to out[0..width), using the lattice
+    // scratch vectors.
+    void sampleRow(int y, float* out, std::vector<float>& top, std::vector<float>& bottom) const {
+        const std::size_t width = m_octaves.empty() ? 0 : m_octaves.front().cells.size();
+        std::fill(out, out + width, 0.0f);
+        for (const NoiseOctave& octave : m_octaves) {
+            const float py = (static_cast<float>(y) / m_scale + m_offsetY) * octave.frequency;
+            const int cellY = static_cast<int>(std::floor(py));
+            const float ty = smoothstep01(py - static_cast<float>(cellY));
+            const std::size_t cellCount = static_cast<std::size_t>(octave.lastCell - octave.firstCell + 1);
+            top.resize(cellCount);
+            bottom.resize(cellCount);
+            for (std::size_t i = 0; i < cellCount; ++i) {
+                const int cellX = octave.firstCell + static_cast<int>(i);
+                top[i] = hashUnitNoise(cellX, cellY, octave.seed);
+                bottom[i] = hashUnitNoise(cellX, cellY + 1, octave.seed);
+            }
+            for (std::size_t x = 0; x < width; ++x) {
+                const std::size_t i = static_cast<std::size_t>(octave.cells[x] - octave.firstCell);
+                const float tx = octave.weights[x];
+                const float a = top[i] + (top[i + 1] - top[i]) * tx;
+                const float b = bottom[i] + (bottom[i + 1] - bottom[i]) * tx;
+                out[x] += octave.amplitude * (a + (b - a) * ty);
+            }
+        }
+        if (m_norm <= 0.0f) {
+            std::fill(out, out + width, 0.0f);
+            return;
+        }
+        for (std::size_t x = 0; x < width; ++x) {
+            out[x] /= m_norm;
+        }
     }
-    return sum / norm;
+
+private:
+    float m_scale;
+    float m_offsetY;
+    float m_norm = 0.0f;
+    std::vector<NoiseOctave> m_octaves;
+};
+
+// std::lround for floats, halves away from zero, without the libm call.
+int roundedDelta(float value) {
+    const double v = static_cast<double>(value);
+    return v >= 0.0 ? static_cast<int>(v + 0.5) : -static_cast<int>(0.5 - v);
 }
 
 void applyFractalNoiseToBuffer(ImageBuffer& image,
+                               int originX,
+                               int originY,
                                float scale,
                                int octaves,
                                float lacunarity,
                                float gain,
                                float amount,
                                std::uint32_t seed,
-                               bool monochrome) {
+                               bool monochrome,
+                               int threads) {
     const float s = scale <= 0.0f ? 64.0f : scale;
     const int oct = std::max(1, octaves);
     const float lac = std::max(1.01f, lacunarity);
     const float g = std::max(0.01f, std::min(1.0f, gain));
     const float mix = clamp01(amount);
+    const int width = image.width();
+    if (width <= 0 || image.height() <= 0) {
+        return;
+    }
 
-    for (int y = 0; y < image.height(); ++y) {
-        for (int x = 0; x < image.width(); ++x) {
-            const PixelRGBA8 src = image.getPixel(x, y);
-            const float nx = static_cast<float>(x) / s;
-            const float ny = static_cast<float>(y) / s;
-            const float n = fractalNoise(nx, ny, oct, lac, g, seed);
-            const float c = (n * 2.0f) - 1.0f;
-            int dr = static_cast<int>(std::lround(c * 255.0f * mix));
-            int dg = dr;
-            int db = dr;
-            if (!monochrome) {
-                const float n2 = fractalNoise(nx + 37.2f, ny + 11.7f, oct, lac, g, seed + 97u);
-                const float n3 = fractalNoise(nx + 73.9f, ny + 19.3f, oct, lac, g, seed + 211u);
-                dg = static_cast<int>(std::lround(((n2 * 2.0f) - 1.0f) * 255.0f * mix));
-                db = static_cast<int>(std::lround(((n3 * 2.0f) - 1.0f) * 255.0f * mix));
-            }
-            image.setPixel(x, y, PixelRGBA8(clampByte(static_cast<int>(src.r) + dr),
-                                            clampByte(static_cast<int>(src.g) + dg),
-                                            clampByte(static_cast<int>(src.b) + db),
-                                            src.a));
-        }
+    // Color noise offsets and reseeds the green and blue fields.
+    std::vector<NoiseField> fields;
+    fields.emplace_back(width, originX, s, 0.0f, 0.0f, oct, lac, g, seed);
+    if (!monochrome) {
+        fields.emplace_back(width, originX, s, 37.2f, 11.7f, oct, lac, g, seed + 97u);
+        fields.emplace_back(width, originX, s, 73.9f, 19.3f, oct, lac, g, seed + 211u);
     }
+    struct RowScratch {
+        std::vector<float> noise;
+        std::vector<float> top;
+        std::vector<float> bottom;
+    };
+    std::vector<RowScratch> scratch(static_cast<std::size_t>(parallelWorkerCount(image.height(), threads)));
+    PixelRGBA8* pixels = image.data();
+    parallelForWorkers(image.height(), threads, [&](int y, int worker) {
+        RowScratch& row = scratch[static_cast<std::size_t>(worker)];
+        row.noise.resize(static_cast<std::size_t>(width) * fields.size());
+        for (std::size_t f = 0; f < fields.size(); ++f) {
+            fields[f].sampleRow(y + originY, row.noise.data() + f * static_cast<std::size_t>(width), row.top, row.bottom);
+        }
+        const float* noise = row.noise.data();
+        const float* last = noise + (fields.size() - 1) * static_cast<std::size_t>(width);
+        const float* middle = noise + (fields.size() / 2) * static_cast<std::size_t>(width);
+        PixelRGBA8* dst = pixels + static_cast<std::size_t>(y) * static_cast<std::size_t>(width);
+        for (int x = 0; x < width; ++x) {
+            const auto delta = [&](float n) { return roundedDelta(((n * 2.0f) - 1.0f) * 255.0f * mix); };
+            const PixelRGBA8 src = dst[x];
+            dst[x] = PixelRGBA8(clampByte(static_cast<int>(src.r) + delta(noise[x])),
+                                clampByte(static_cast<int>(src.g) + delta(middle[x])),
+                                clampByte(static_cast<int>(src.b) + delta(last[x])),
+                                src.a);
+        }
+    });
 }
 
 bool hatchHit(int x, int y, int spacing, int width, int mode) {
@@ -656,25 +1011,33 @@ bool hatchHit(int x, int y, int spacing, int width, int mode) {
 }
 
 void applyHatchToBuffer(ImageBuffer& image,
+                        int originX,
+                        int originY,
                         int spacing,
                         int lineWidth,
                         const PixelRGBA8& ink,
                         float opacity,
-                        bool preserveHighlights) {
+                        bool preserveHighlights,
+                        int threads) {
     const float mixBase = clamp01(opacity);
-    for (int y = 0; y < image.height(); ++y) {
-        for (int x = 0; x < image.width(); ++x) {
-            const PixelRGBA8 src = image.getPixel(x, y);
+    const int width = image.width();
+    PixelRGBA8* pixels = image.data();
+    parallelFor(image.height(), threads, [&](int y) {
+        PixelRGBA8* row = pixels + static_cast<std::size_t>(y) * static_cast<std::size_t>(width);
+        for (int x = 0; x < width; ++x) {
+            const PixelRGBA8 src = row[x];
             const float darkness = 1.0f - luma01(src);
             if (darkness <= 0.05f && preserveHighlights) {
                 continue;
             }
 
+            const int hx = x + originX;
+            const int hy = y + originY;
             bool hit = false;
-            if (darkness > 0.18f) hit |= hatchHit(x, y, spacing, lineWidth, 0);
-            if (darkness > 0.35f) hit |= hatchHit(x, y, spacing + 2, lineWidth, 1);
-            if (darkness > 0.55f) hit |= hatchHit(x, y, spacing + 4, lineWidth, 2);
-            if (darkness > 0.75f) hit |= hatchHit(x, y, spacing + 6, lineWidth, 3);
+            if (darkness > 0.18f) hit |= hatchHit(hx, hy, spacing, lineWidth, 0);
+            if (darkness > 0.35f) hit |= hatchHit(hx, hy, spacing + 2, lineWidth, 1);
+            if (darkness > 0.55f) hit |= hatchHit(hx, hy, spacing + 4, lineWidth, 2);
+            if (darkness > 0.75f) hit |= hatchHit(hx, hy, spacing + 6, lineWidth, 3);
             if (!hit) {
                 continue;
             }
@@ -682,50 +1045,69 @@ void applyHatchToBuffer(ImageBuffer& image,
             const float mix = clamp01(mixBase * darkness);
             PixelRGBA8 target = ink;
             target.a = src.a;
-            image.setPixel(x, y, lerpPixel(src, target, mix));
+            row[x] = lerpPixel(src, target, mix);
         }
-    }
+    });
 }
 
-void blendPixelOver(ImageBuffer& image, int x, int y, const PixelRGBA8& color, float alpha) {
-    if (!image.inBounds(x, y) || alpha <= 0.0f) {
+// Pixels a stroke may draw to; strokes outside are clipped.
+struct StrokeBand {
+    PixelRGBA8* pixels;
+    int width;
+    int rowBegin;
+    int rowEnd;
+    int columnBegin;
+    int columnEnd;
+};
+
+void blendPixelOver(const StrokeBand& band, int x, int y, const PixelRGBA8& color, float alpha) {
+    if (x < band.columnBegin || x >= band.columnEnd || y < band.rowBegin || y >= band.rowEnd || alpha <= 0.0f) {
         return;
     }
     const float a = clamp01(alpha);
-    const PixelRGBA8 dst = image.getPixel(x, y);
-    image.setPixel(x, y, lerpPixel(dst, PixelRGBA8(color.r, color.g, color.b, dst.a), a));
-}
-
-void drawSoftLine(ImageBuffer& image,
-                  int x0,
-                  int y0,
-                  int x1,
-                  int y1,
-                  const PixelRGBA8& ink,
-                  float opacity,
-                  int thickness) {
-    const int dx = std::abs(x1 - x0);
-    const int dy = std::abs(y1 - y0);
+    PixelRGBA8& dst = band.pixels[static_cast<std::size_t>(y) * static_cast<std::size_t>(band.width) + static_cast<std::size_t>(x)];
+    dst = lerpPixel(dst, PixelRGBA8(color.r, color.g, color.b, dst.a), a);
+}
+
+struct PencilStroke {
+    int x0;
+    int y0;
+    int x1;
+    int y1;
+    float opacity;
+};
+
+void drawSoftLine(const StrokeBand& band, const PencilStroke& stroke, const PixelRGBA8& ink, int thickness) {
+    const int dx = std::abs(stroke.x1 - stroke.x0);
+    const int dy = std::abs(stroke.y1 - stroke.y0);
     const int steps = std::max(1, std::max(dx, dy));
     const float invSteps = 1.0f / static_cast<float>(steps);
     const int radius = std::max(0, thickness / 2);
 
     for (int i = 0; i <= steps; ++i) {
         const float t = static_cast<float>(i) * invSteps;
-        const int x = static_cast<int>(std::lround(static_cast<float>(x0) + (static_cast<float>(x1 - x0) * t)));
-        const int y = static_cast<int>(std::lround(static_cast<float>(y0) + (static_cast<float>(y1 - y0) * t)));
+        const int x = static_cast<int>(std::lround(static_cast<float>(stroke.x0) + (static_cast<float>(stroke.x1 - stroke.x0) * t)));
+        const int y = static_cast<int>(std::lround(static_cast<float>(stroke.y0) + (static_cast<float>(stroke.y1 - stroke.y0) * t)));
+        if (y + radius < band.rowBegin || y - radius >= band.rowEnd) {
+            continue;
+        }
 
         for (int oy = -radius; oy <= radius; ++oy) {
             for (int ox = -radius; ox <= radius; ++ox) {
                 const float d2 = static_cast<float>(ox * ox + oy * oy);
                 const float falloff = radius == 0 ? 1.0f : std::max(0.0f, 1.0f - (d2 / static_cast<float>((radius + 1) * (radius + 1))));
-                blendPixelOver(image, x + ox, y + oy, ink, opacity * falloff);
+                blendPixelOver(band, x + ox, y + oy, ink, stroke.opacity * falloff);
             }
         }
     }
 }
 
+// Strokes are placed from the image as it was before any of them, then
+// drawn in bands of rows across threads. Each band draws the strokes that
+// reach it in placement order, so overlaps blend as a sequential pass.
+// Only the window's rect is drawn; placement still reads the whole image.
 void applyPencilStrokesToBuffer(ImageBuffer& image,
+                                const OpWindow& window,
                                 int spacing,
                                 int length,
                                 int thickness,
@@ -735,7 +1117,8 @@ void applyPencilStrokesToBuffer(ImageBuffer& image,
                                 const PixelRGBA8& ink,
                                 float opacity,
                                 float minDarkness,
-                                std::uint32_t seed) {
+                                std::uint32_t seed,
+                                int threads) {
     const int step = std::max(1, spacing);
     const int strokeLength = std::max(1, length);
     const int jitter = std::max(0, positionJitter);
@@ -748,6 +1131,8 @@ void applyPencilStrokesToBuffer(ImageBuffer& image,
     std::uniform_int_distribution<int> posJitter(-jitter, jitter);
 
     const double baseRad = angleDegrees * 3.14159265358979323846 / 180.0;
+    const ImageBuffer& source = image;
+    std::vector<PencilStroke> strokes;
     for (int y = 0; y < image.height(); y += step) {
         for (int x = 0; x < image.width(); x += step) {
             const int sx = x + posJitter(rng);
@@ -756,7 +1141,7 @@ void applyPencilStrokesToBuffer(ImageBuffer& image,
                 continue;
             }
 
-            const float darkness = 1.0f - luma01(image.getPixel(sx, sy));
+            const float darkness = 1.0f - luma01(source.getPixel(sx, sy));
             if (darkness < minDark) {
                 continue;
             }
@@ -768,147 +1153,385 @@ void applyPencilStrokesToBuffer(ImageBuffer& image,
 
             const double theta = baseRad + (static_cast<double>(angleJitter(rng)) * 3.14159265358979323846 / 180.0);
             const double half = static_cast<double>(strokeLength) * 0.5;
-            const int x0 = static_cast<int>(std::lround(static_cast<double>(sx) - std::cos(theta) * half));
-            const int y0 = static_cast<int>(std::lround(static_cast<double>(sy) - std::sin(theta) * half));
-            const int x1 = static_cast<int>(std::lround(static_cast<double>(sx) + std::cos(theta) * half));
-            const int y1 = static_cast<int>(std::lround(static_cast<double>(sy) + std::sin(theta) * half));
-            const float strokeOpacity = clamp01(opacity * (0.45f + darkness * 0.9f));
-            drawSoftLine(image, x0, y0, x1, y1, ink, strokeOpacity, thickness);
+            strokes.push_back({static_cast<int>(std::lround(static_cast<double>(sx) - std::cos(theta) * half)),
+                               static_cast<int>(std::lround(static_cast<double>(sy) - std::sin(theta) * half)),
+                               static_cast<int>(std::lround(static_cast<double>(sx) + std::cos(theta) * half)),
+                               static_cast<int>(std::lround(static_cast<double>(sy) + std::sin(theta) * half)),
+                               clamp01(opacity * (0.45f + darkness * 0.9f))});
         }
     }
+    if (strokes.empty()) {
+        return;
+    }
+
+    // Bands are counted from the top of the window.
+    const int bandCount = (window.height + kEdgeBandRows - 1) / kEdgeBandRows;
+    const int radius = std::max(0, thickness / 2);
+    std::vector<std::vector<std::size_t>> bandStrokes(static_cast<std::size_t>(bandCount));
+    for (std::size_t i = 0; i < strokes.size(); ++i) {
+        const int top = std::min(strokes[i].y0, strokes[i].y1) - radius - window.y;
+        const int bottom = std::max(strokes[i].y0, strokes[i].y1) + radius - window.y;
+        if (bottom < 0 || top >= window.height) {
+            continue;
+        }
+        const int first = std::max(0, top / kEdgeBandRows);
+        const int last = std::min(bandCount - 1, bottom / kEdgeBandRows);
+        for (int band = first; band <= last; ++band) {
+            bandStrokes[static_cast<std::size_t>(band)].push_back(i);
+        }
+    }
+    PixelRGBA8* pixels = image.data();
+    parallelFor(bandCount, threads, [&](int band) {
+        const int rowBegin = window.y + band * kEdgeBandRows;
+        const StrokeBand rows = {pixels, image.width(), rowBegin, std::min(window.y + window.height, rowBegin + kEdgeBandRows),
+                                 window.x, window.x + window.width};
+        for (std::size_t i : bandStrokes[static_cast<std::size_t>(band)]) {
+            drawSoftLine(rows, strokes[i], ink, thickness);
+        }
+    });
 }
 
-bool tryApplyLambdaDispatchedOperation(
-    const std::string& action,
-    Document& document,
-    const std::unordered_map<std::string, std::string>& kv) {
-    using OpHandler = std::function<void()>;
-    const std::unordered_map<std::string, OpHandler> dispatch = {
-        {"apply-effect", [&]() {
-             if (kv.find("path") == kv.end() || kv.find("effect") == kv.end()) {
-                 throw std::runtime_error("apply-effect requires path= and effect=");
-             }
-             Layer& layer = resolveLayerPath(document, kv.at("path"));
-             const std::string effect = toLower(kv.at("effect"));
-             if (effect == "grayscale") {
-                 applyGrayscale(layer);
-                 return;
-             }
-             if (effect == "sepia") {
-                 const float strength = kv.find("strength") == kv.end() ? 1.0f : std::stof(kv.at("strength"));
-                 applySepia(layer, strength);
-                 return;
-             }
-             if (effect == "invert") {
-                 const bool preserveAlpha = kv.find("preserve_alpha") == kv.end() ? true : parseBoolFlag(kv.at("preserve_alpha"));
-                 applyInvertToLayer(layer, preserveAlpha);
-                 return;
-             }
-             if (effect == "threshold") {
-                 const int threshold = kv.find("threshold") == kv.end() ? 128 : std::stoi(kv.at("threshold"));
-                 const PixelRGBA8 lo = kv.find("lo") == kv.end() ? PixelRGBA8(0, 0, 0, 255) : parseRGBA(kv.at("lo"), true);
-                 const PixelRGBA8 hi = kv.find("hi") == kv.end() ? PixelRGBA8(255, 255, 255, 255) : parseRGBA(kv.at("hi"), true);
-                 applyThresholdToLayer(layer, threshold, lo, hi);
-                 return;
-             }
-             throw std::runtime_error("Unsupported effect: " + effect);
-         }},
-        {"gaussian-blur", [&]() {
+// Appends a LUT stage, composing it onto a table just before it.
+void appendLutStage(std::vector<PointOpStage>& stages, const std::array<ChannelLut, 4>& luts) {
+    if (stages.empty() || stages.back().kind != PointOpStage::Kind::Lut) {
+        PointOpStage stage;
+        stage.luts = luts;
+        stages.push_back(stage);
+        return;
+    }
+    PointOpStage& last = stages.back();
+    for (std::size_t c = 0; c < 4; ++c) {
+        for (std::size_t v = 0; v < 256; ++v) {
+            last.luts[c][v] = luts[c][last.luts[c][v]];
+        }
+    }
+}
+
+ChannelLut identityLut() {
+    ChannelLut lut{};
+    for (std::size_t v = 0; v < 256; ++v) {
+        lut[v] = static_cast<std::uint8_t>(v);
+    }
+    return lut;
+}
+
+// The stages of one color or tone op; false for other actions.
+bool compilePointOp(const std::string& action,
+                    const std::unordered_map<std::string, std::string>& kv,
+                    std::vector<PointOpStage>& stages) {
+    const ChannelLut identity = identityLut();
+    PointOpStage stage;
+    if (action == "apply-effect") {
+        if (kv.find("path") == kv.end() || kv.find("effect") == kv.end()) {
+            throw std::runtime_error("apply-effect requires path= and effect=");
+        }
+        const std::string effect = toLower(kv.at("effect"));
+        if (effect == "grayscale") {
+            stage.kind = PointOpStage::Kind::Grayscale;
+        } else if (effect == "sepia") {
+            stage.kind = PointOpStage::Kind::Sepia;
+            stage.strength = kv.find("strength") == kv.end() ? 1.0f : std::stof(kv.at("strength"));
+        } else if (effect == "invert") {
+            const bool preserveAlpha = kv.find("preserve_alpha") == kv.end() ? true : parseBoolFlag(kv.at("preserve_alpha"));
+            ChannelLut inverted{};
+            for (std::size_t v = 0; v < 256; ++v) {
+                inverted[v] = static_cast<std::uint8_t>(255 - v);
+            }
+            appendLutStage(stages, {inverted, inverted, inverted, preserveAlpha ? identity : inverted});
+            return true;
+        } else if (effect == "threshold") {
+            stage.kind = PointOpStage::Kind::Threshold;
+            stage.threshold = std::max(0, std::min(255, kv.find("threshold") == kv.end() ? 128 : std::stoi(kv.at("threshold"))));
+            stage.lo = kv.find("lo") == kv.end() ? PixelRGBA8(0, 0, 0, 255) : parseRGBA(kv.at("lo"), true);
+            stage.hi = kv.find("hi") == kv.end() ? PixelRGBA8(255, 255, 255, 255) : parseRGBA(kv.at("hi"), true);
+        } else {
+            throw std::runtime_error("Unsupported effect: " + effect);
+        }
+        stages.push_back(stage);
+        return true;
+    }
+    if (action == "channel-mix") {
+        stage.kind = PointOpStage::Kind::ChannelMix;
+        stage.matrix = {
+            kv.find("rr") == kv.end() ? 1.0f : std::stof(kv.at("rr")),
+            kv.find("rg") == kv.end() ? 0.0f : std::stof(kv.at("rg")),
+            kv.find("rb") == kv.end() ? 0.0f : std::stof(kv.at("rb")),
+            kv.find("gr") == kv.end() ? 0.0f : std::stof(kv.at("gr")),
+            kv.find("gg") == kv.end() ? 1.0f : std::stof(kv.at("gg")),
+            kv.find("gb") == kv.end() ? 0.0f : std::stof(kv.at("gb")),
+            kv.find("br") == kv.end() ? 0.0f : std::stof(kv.at("br")),
+            kv.find("bg") == kv.end() ? 0.0f : std::stof(kv.at("bg")),
+            kv.find("bb") == kv.end() ? 1.0f : std::stof(kv.at("bb"))};
+        const float clampMin = kv.find("min") == kv.end() ? 0.0f : std::stof(kv.at("min"));
+        const float clampMax = kv.find("max") == kv.end() ? 255.0f : std::stof(kv.at("max"));
+        stage.low = std::min(clampMin, clampMax);
+        stage.high = std::max(clampMin, clampMax);
+        stages.push_back(stage);
+        return true;
+    }
+    if (action == "replace-color") {
+        if (kv.find("path") == kv.end() || kv.find("from") == kv.end() || kv.find("to") == kv.end()) {
+            throw std::runtime_error("replace-color requires path= from= to=");
+        }
+        stage.kind = PointOpStage::Kind::ReplaceColor;
+        stage.from = parseRGBA(kv.at("from"), true);
+        stage.to = parseRGBA(kv.at("to"), true);
+        stage.preserveLuma = kv.find("preserve_luma") == kv.end() ? true : parseBoolFlag(kv.at("preserve_luma"));
+        const double tolerance = std::max(0.0, kv.find("tolerance") == kv.end() ? 36.0 : std::stod(kv.at("tolerance")));
+        const double softness = std::max(0.0, kv.find("softness") == kv.end() ? 24.0 : std::stod(kv.at("softness")));
+        const double softEnd = tolerance + softness;
+        // Squared distances are integers, so the sqrt and the ramp are
+        // tabulated once instead of evaluated per pixel.
+        std::vector<float> mixes(3 * 255 * 255 + 1, 0.0f);
+        for (std::size_t d2 = 0; d2 < mixes.size(); ++d2) {
+            const double dist = std::sqrt(static_cast<double>(d2));
+            if (dist <= tolerance) {
+                mixes[d2] = 1.0f;
+            } else if (softEnd > tolerance && dist < softEnd) {
+                mixes[d2] = static_cast<float>(1.0 - ((dist - tolerance) / (softEnd - tolerance)));
+            }
+        }
+        stage.mixByDistance = std::make_shared<const std::vector<float>>(std::move(mixes));
+        stages.push_back(stage);
+        return true;
+    }
+    if (action == "apply-lut") {
+        if (kv.find("path") == kv.end() || kv.find("file") == kv.end()) {
+            throw std::runtime_error("apply-lut requires path= and file=");
+        }
+        stage.kind = PointOpStage::Kind::Cube;
+        stage.cube = std::make_shared<const ColorLUT>(loadCubeLUT(kv.at("file")));
+        stages.push_back(stage);
+        return true;
+    }
+    if (action == "gamma") {
+        const double gamma = kv.find("value") == kv.end() ? (kv.find("gamma") == kv.end() ? 1.0 : std::stod(kv.at("gamma"))) : std::stod(kv.at("value"));
+        const ChannelLut lut = gammaLut(gamma);
+        appendLutStage(stages, {lut, lut, lut, identity});
+        return true;
+    }
+    if (action == "levels") {
+        const int inBlack = kv.find("in_black") == kv.end() ? 0 : std::stoi(kv.at("in_black"));
+        const int inWhite = kv.find("in_white") == kv.end() ? 255 : std::stoi(kv.at("in_white"));
+        const double midGamma = kv.find("gamma") == kv.end() ? 1.0 : std::stod(kv.at("gamma"));
+        const int outBlack = kv.find("out_black") == kv.end() ? 0 : std::stoi(kv.at("out_black"));
+        const int outWhite = kv.find("out_white") == kv.end() ? 255 : std::stoi(kv.at("out_white"));
+        const ChannelLut lut = levelsLut(inBlack, inWhite, midGamma, outBlack, outWhite);
+        appendLutStage(stages, {lut, lut, lut, identity});
+        return true;
+    }
+    if (action == "curves") {
+        const std::vector<std::pair<int, int>> rgbPoints = kv.find("rgb") == kv.end()
+                                                                ? std::vector<std::pair<int, int>>{{0, 0}, {255, 255}}
+                                                                : parseCurvePoints(kv.at("rgb"));
+        const ChannelLut rgbLut = buildCurveLut(rgbPoints);
+        // Per-channel curves apply after the rgb curve.
+        std::array<ChannelLut, 4> luts = {rgbLut, rgbLut, rgbLut, identity};
+        const char* channels[3] = {"r", "g", "b"};
+        for (std::size_t c = 0; c < 3; ++c) {
+            if (kv.find(channels[c]) != kv.end()) {
+                const ChannelLut channelLut = buildCurveLut(parseCurvePoints(kv.at(channels[c])));
+                for (std::size_t v = 0; v < 256; ++v) {
+                    luts[c][v] = channelLut[rgbLut[v]];
+                }
+            }
+        }
+        appendLutStage(stages, luts);
+        return true;
+    }
+    return false;
+}
+
+// std::lround as far as clampByte can tell: halves round up, and values
+// below zero still clamp to it. Exact, since a float plus 0.5 fits a double.
+int roundedInt(float value) {
+    return static_cast<int>(static_cast<double>(value) + 0.5);
+}
+
+void replaceColorSpan(const PointOpStage& stage, PixelRGBA8* pixels, std::size_t count) {
+    const float* mixes = stage.mixByDistance->data();
+    const int fromR = stage.from.r;
+    const int fromG = stage.from.g;
+    const int fromB = stage.from.b;
+    const float dstLuma = 0.299f * static_cast<float>(stage.to.r) + 0.587f * static_cast<float>(stage.to.g) +
+                          0.114f * static_cast<float>(stage.to.b);
+    for (std::size_t i = 0; i < count; ++i) {
+        const PixelRGBA8 src = pixels[i];
+        const int dr = src.r - fromR;
+        const int dg = src.g - fromG;
+        const int db = src.b - fromB;
+        const float mix = mixes[dr * dr + dg * dg + db * db];
+        if (mix <= 0.0f) {
+            continue;
+        }
+
+        PixelRGBA8 adjusted = stage.to;
+        adjusted.a = src.a;
+        if (stage.preserveLuma && dstLuma > 0.0f) {
+            const float srcLuma = 0.299f * static_cast<float>(src.r) + 0.587f * static_cast<float>(src.g) +
+                                  0.114f * static_cast<float>(src.b);
+            const float scale = srcLuma / dstLuma;
+            adjusted.r = clampByte(static_cast<int>(std::lround(scale * static_cast<float>(adjusted.r))));
+            adjusted.g = clampByte(static_cast<int>(std::lround(scale * static_cast<float>(adjusted.g))));
+            adjusted.b = clampByte(static_cast<int>(std::lround(scale * static_cast<float>(adjusted.b))));
+        }
+        pixels[i] = lerpPixel(src, adjusted, mix);
+    }
+}
+
+void runPointStage(const PointOpStage& stage, PixelRGBA8* pixels, std::size_t count) {
+    switch (stage.kind) {
+    case PointOpStage::Kind::Lut:
+        for (std::size_t i = 0; i < count; ++i) {
+            PixelRGBA8& p = pixels[i];
+            p = PixelRGBA8(stage.luts[0][p.r], stage.luts[1][p.g], stage.luts[2][p.b], stage.luts[3][p.a]);
+        }
+        return;
+    case PointOpStage::Kind::Grayscale:
+        applyGrayscale(pixels, count);
+        return;
+    case PointOpStage::Kind::Sepia:
+        applySepia(pixels, count, stage.strength);
+        return;
+    case PointOpStage::Kind::ChannelMix: {
+        const std::array<float, 9>& m = stage.matrix;
+        for (std::size_t i = 0; i < count; ++i) {
+            PixelRGBA8& p = pixels[i];
+            const float r = static_cast<float>(p.r);
+            const float g = static_cast<float>(p.g);
+            const float b = static_cast<float>(p.b);
+            const float outR = std::max(stage.low, std::min(stage.high, m[0] * r + m[1] * g + m[2] * b));
+            const float outG = std::max(stage.low, std::min(stage.high, m[3] * r + m[4] * g + m[5] * b));
+            const float outB = std::max(stage.low, std::min(stage.high, m[6] * r + m[7] * g + m[8] * b));
+            p = PixelRGBA8(clampByte(roundedInt(outR)), clampByte(roundedInt(outG)), clampByte(roundedInt(outB)), p.a);
+        }
+        return;
+    }
+    case PointOpStage::Kind::Threshold:
+        for (std::size_t i = 0; i < count; ++i) {
+            PixelRGBA8& p = pixels[i];
+            // The rounded luma reaches the threshold exactly when the luma
+            // is within half a level of it.
+            const double luma = 0.299 * static_cast<double>(p.r) + 0.587 * static_cast<double>(p.g) +
+                                0.114 * static_cast<double>(p.b);
+            p = luma >= stage.threshold - 0.5 ? stage.hi : stage.lo;
+        }
+        return;
+    case PointOpStage::Kind::ReplaceColor:
+        replaceColorSpan(stage, pixels, count);
+        return;
+    case PointOpStage::Kind::Cube:
+        stage.cube->apply(pixels, count);
+        return;
+    }
+}
+
+// Every stage runs over a row while it is in cache, rows across threads.
+void runPointStages(const std::vector<PointOpStage>& stages, ImageBuffer& image, int threads) {
+    if (stages.empty() || image.width() <= 0 || image.height() <= 0) {
+        return;
+    }
+    PixelRGBA8* pixels = image.data();
+    const auto width = static_cast<std::size_t>(image.width());
+    parallelFor(image.height(), threads, [&](int y) {
+        PixelRGBA8* row = pixels + static_cast<std::size_t>(y) * width;
+        for (const PointOpStage& stage : stages) {
+            runPointStage(stage, row, width);
+        }
+    });
+}
+
+// Ops that always edit the image ignore target=.
+std::unordered_map<std::string, std::string> imageOnly(const std::unordered_map<std::string, std::string>& kv, bool ignoreTarget) {
+    std::unordered_map<std::string, std::string> options = kv;
+    if (ignoreTarget) {
+        options.erase("target");
+    }
+    return options;
+}
+
+using OpHandler = void (*)(const std::string& action, Document& document, const std::unordered_map<std::string, std::string>& kv, int threads);
+
+// Color and tone ops share their stages with fused runs of them.
+void applyPointOp(const std::string& action, Document& document, const std::unordered_map<std::string, std::string>& kv, int threads) {
+    std::vector<PointOpStage> stages;
+    compilePointOp(action, kv, stages);
+    if (kv.find("path") == kv.end()) {
+        throw std::runtime_error(action + " requires path=");
+    }
+    Layer& layer = resolveLayerPath(document, kv.at("path"));
+    applyInRegion(layer, imageOnly(kv, action != "gamma" && action != "levels" && action != "curves"), 0,
+                  [&](ImageBuffer& target, const OpWindow&) { runPointStages(stages, target, threads); });
+}
+
+const std::unordered_map<std::string, OpHandler>& effectsDispatch() {
+    static const std::unordered_map<std::string, OpHandler> dispatch = {
+        {"apply-effect", applyPointOp},
+        {"gaussian-blur", [](const std::string&, Document& document, const std::unordered_map<std::string, std::string>& kv, int threads) {
              if (kv.find("path") == kv.end()) {
                  throw std::runtime_error("gaussian-blur requires path=");
              }
              Layer& layer = resolveLayerPath(document, kv.at("path"));
-             ImageBuffer& target = resolveDrawTargetBuffer(layer, kv);
              const int radius = kv.find("radius") == kv.end() ? 3 : std::stoi(kv.at("radius"));
              const double sigma = kv.find("sigma") == kv.end() ? 0.0 : std::stod(kv.at("sigma"));
-             applyGaussianBlurToBuffer(target, radius, sigma);
+             applyInRegion(layer, kv, gaussianBlurReach(radius, sigma),
+                           [&](ImageBuffer& target, const OpWindow&) { applyGaussianBlurToBuffer(target, radius, sigma, threads); });
          }},
-        {"edge-detect", [&]() {
+        {"edge-detect", [](const std::string&, Document& document, const std::unordered_map<std::string, std::string>& kv, int threads) {
              if (kv.find("path") == kv.end()) {
                  throw std::runtime_error("edge-detect requires path=");
              }
              Layer& layer = resolveLayerPath(document, kv.at("path"));
-             ImageBuffer& target = resolveDrawTargetBuffer(layer, kv);
              const std::string method = kv.find("method") == kv.end() ? "sobel" : toLower(kv.at("method"));
              const bool keepAlpha = kv.find("keep_alpha") == kv.end() ? true : parseBoolFlag(kv.at("keep_alpha"));
              if (method == "sobel") {
-                 applySobelToBuffer(target, keepAlpha);
+                 applyInRegion(layer, kv, 1, [&](ImageBuffer& target, const OpWindow&) { applySobelToBuffer(target, keepAlpha, threads); });
                  return;
              }
              if (method == "canny") {
                  const int low = kv.find("low") == kv.end() ? 40 : std::stoi(kv.at("low"));
                  const int high = kv.find("high") == kv.end() ? 90 : std::stoi(kv.at("high"));
-                 applyCannyToBuffer(target, low, high, keepAlpha);
+                 // Hysteresis only follows edges through the region and its halo.
+                 applyInRegion(layer, kv, kCannyRegionHalo,
+                               [&](ImageBuffer& target, const OpWindow&) { applyCannyToBuffer(target, low, high, keepAlpha, threads); });
                  return;
              }
              throw std::runtime_error("edge-detect method must be sobel or canny");
          }},
-        {"morphology", [&]() {
+        {"morphology", [](const std::string&, Document& document, const std::unordered_map<std::string, std::string>& kv, int threads) {
              if (kv.find("path") == kv.end()) {
                  throw std::runtime_error("morphology requires path=");
              }
              Layer& layer = resolveLayerPath(document, kv.at("path"));
-             ImageBuffer& target = resolveDrawTargetBuffer(layer, kv);
              const std::string op = kv.find("op") == kv.end() ? "dilate" : toLower(kv.at("op"));
              const int radius = kv.find("radius") == kv.end() ? 1 : std::stoi(kv.at("radius"));
              const int iterations = kv.find("iterations") == kv.end() ? 1 : std::stoi(kv.at("iterations"));
-             applyMorphologyToBuffer(target, op, radius, iterations);
-         }},
-        {"gamma", [&]() {
-             if (kv.find("path") == kv.end()) {
-                 throw std::runtime_error("gamma requires path=");
+             const std::string shapeName = kv.find("shape") == kv.end() ? "disc" : toLower(kv.at("shape"));
+             MorphologyShape shape = MorphologyShape::Disc;
+             if (shapeName == "square") {
+                 shape = MorphologyShape::Square;
+             } else if (shapeName == "line") {
+                 shape = MorphologyShape::Line;
+             } else if (shapeName != "disc") {
+                 throw std::runtime_error("morphology shape must be square, line or disc");
              }
-             Layer& layer = resolveLayerPath(document, kv.at("path"));
-             ImageBuffer& target = resolveDrawTargetBuffer(layer, kv);
-             const double gamma = kv.find("value") == kv.end() ? (kv.find("gamma") == kv.end() ? 1.0 : std::stod(kv.at("gamma"))) : std::stod(kv.at("value"));
-             applyGammaToBuffer(target, gamma);
-         }},
-        {"levels", [&]() {
-             if (kv.find("path") == kv.end()) {
-                 throw std::runtime_error("levels requires path=");
+             const int angle = kv.find("angle") == kv.end() ? 0 : std::stoi(kv.at("angle"));
+             if (angle != 0 && angle != 45 && angle != 90 && angle != 135) {
+                 throw std::runtime_error("morphology angle must be 0, 45, 90 or 135");
              }
-             Layer& layer = resolveLayerPath(document, kv.at("path"));
-             ImageBuffer& target = resolveDrawTargetBuffer(layer, kv);
-             const int inBlack = kv.find("in_black") == kv.end() ? 0 : std::stoi(kv.at("in_black"));
-             const int inWhite = kv.find("in_white") == kv.end() ? 255 : std::stoi(kv.at("in_white"));
-             const double midGamma = kv.find("gamma") == kv.end() ? 1.0 : std::stod(kv.at("gamma"));
-             const int outBlack = kv.find("out_black") == kv.end() ? 0 : std::stoi(kv.at("out_black"));
-             const int outWhite = kv.find("out_white") == kv.end() ? 255 : std::stoi(kv.at("out_white"));
-             applyLevelsToBuffer(target, inBlack, inWhite, midGamma, outBlack, outWhite);
+             const int reach = static_cast<int>(std::min<long long>(1 << 24, static_cast<long long>(std::max(0, radius)) * std::max(1, iterations)));
+             applyInRegion(layer, kv, reach, [&](ImageBuffer& target, const OpWindow&) {
+                 applyMorphologyToBuffer(target, op, shape, radius, angle, iterations, threads);
+             });
          }},
-        {"curves", [&]() {
-             if (kv.find("path") == kv.end()) {
-                 throw std::runtime_error("curves requires path=");
-             }
-             Layer& layer = resolveLayerPath(document, kv.at("path"));
-             ImageBuffer& target = resolveDrawTargetBuffer(layer, kv);
-             const std::vector<std::pair<int, int>> rgbPoints = kv.find("rgb") == kv.end()
-                                                                     ? std::vector<std::pair<int, int>>{{0, 0}, {255, 255}}
-                                                                     : parseCurvePoints(kv.at("rgb"));
-             const std::array<std::uint8_t, 256> rgbLut = buildCurveLut(rgbPoints);
-             std::array<std::uint8_t, 256> rLut{};
-             std::array<std::uint8_t, 256> gLut{};
-             std::array<std::uint8_t, 256> bLut{};
-             const bool hasR = kv.find("r") != kv.end();
-             const bool hasG = kv.find("g") != kv.end();
-             const bool hasB = kv.find("b") != kv.end();
-             if (hasR) {
-                 rLut = buildCurveLut(parseCurvePoints(kv.at("r")));
-             }
-             if (hasG) {
-                 gLut = buildCurveLut(parseCurvePoints(kv.at("g")));
-             }
-             if (hasB) {
-                 bLut = buildCurveLut(parseCurvePoints(kv.at("b")));
-             }
-             applyCurvesToBuffer(target, rgbLut, hasR ? &rLut : nullptr, hasG ? &gLut : nullptr, hasB ? &bLut : nullptr);
-         }},
-        {"fractal-noise", [&]() {
+        {"gamma", applyPointOp},
+        {"levels", applyPointOp},
+        {"curves", applyPointOp},
+        {"fractal-noise", [](const std::string&, Document& document, const std::unordered_map<std::string, std::string>& kv, int threads) {
              if (kv.find("path") == kv.end()) {
                  throw std::runtime_error("fractal-noise requires path=");
              }
              Layer& layer = resolveLayerPath(document, kv.at("path"));
-             ImageBuffer& target = resolveDrawTargetBuffer(layer, kv);
              const float scale = kv.find("scale") == kv.end() ? 64.0f : std::stof(kv.at("scale"));
              const int octaves = kv.find("octaves") == kv.end() ? 5 : std::stoi(kv.at("octaves"));
              const float lacunarity = kv.find("lacunarity") == kv.end() ? 2.0f : std::stof(kv.at("lacunarity"));
@@ -916,27 +1539,30 @@ bool tryApplyLambdaDispatchedOperation(
              const float amount = kv.find("amount") == kv.end() ? 0.2f : std::stof(kv.at("amount"));
              const std::uint32_t seed = kv.find("seed") == kv.end() ? 1337u : static_cast<std::uint32_t>(std::stoul(kv.at("seed")));
              const bool monochrome = kv.find("monochrome") == kv.end() ? true : parseBoolFlag(kv.at("monochrome"));
-             applyFractalNoiseToBuffer(target, scale, octaves, lacunarity, gain, amount, seed, monochrome);
+             applyInRegion(layer, kv, 0, [&](ImageBuffer& target, const OpWindow& window) {
+                 applyFractalNoiseToBuffer(target, window.originX, window.originY, scale, octaves, lacunarity, gain, amount, seed,
+                                           monochrome, threads);
+             });
          }},
-        {"hatch", [&]() {
+        {"hatch", [](const std::string&, Document& document, const std::unordered_map<std::string, std::string>& kv, int threads) {
              if (kv.find("path") == kv.end()) {
                  throw std::runtime_error("hatch requires path=");
              }
              Layer& layer = resolveLayerPath(document, kv.at("path"));
-             ImageBuffer& target = resolveDrawTargetBuffer(layer, kv);
              const int spacing = kv.find("spacing") == kv.end() ? 8 : std::stoi(kv.at("spacing"));
              const int lineWidth = kv.find("line_width") == kv.end() ? 1 : std::stoi(kv.at("line_width"));
              const PixelRGBA8 ink = kv.find("ink") == kv.end() ? PixelRGBA8(28, 28, 28, 255) : parseRGBA(kv.at("ink"), true);
              const float opacity = kv.find("opacity") == kv.end() ? 0.9f : std::stof(kv.at("opacity"));
              const bool preserveHighlights = kv.find("preserve_highlights") == kv.end() ? true : parseBoolFlag(kv.at("preserve_highlights"));
-             applyHatchToBuffer(target, spacing, lineWidth, ink, opacity, preserveHighlights);
+             applyInRegion(layer, kv, 0, [&](ImageBuffer& target, const OpWindow& window) {
+                 applyHatchToBuffer(target, window.originX, window.originY, spacing, lineWidth, ink, opacity, preserveHighlights, threads);
+             });
          }},
-        {"pencil-strokes", [&]() {
+        {"pencil-strokes", [](const std::string&, Document& document, const std::unordered_map<std::string, std::string>& kv, int threads) {
              if (kv.find("path") == kv.end()) {
                  throw std::runtime_error("pencil-strokes requires path=");
              }
              Layer& layer = resolveLayerPath(document, kv.at("path"));
-             ImageBuffer& target = resolveDrawTargetBuffer(layer, kv);
              const int spacing = kv.find("spacing") == kv.end() ? 8 : std::stoi(kv.at("spacing"));
              const int length = kv.find("length") == kv.end() ? 14 : std::stoi(kv.at("length"));
              const int thickness = kv.find("thickness") == kv.end() ? 1 : std::stoi(kv.at("thickness"));
@@ -947,53 +1573,62 @@ bool tryApplyLambdaDispatchedOperation(
              const float opacity = kv.find("opacity") == kv.end() ? 0.22f : std::stof(kv.at("opacity"));
              const float minDarkness = kv.find("min_darkness") == kv.end() ? 0.15f : std::stof(kv.at("min_darkness"));
              const std::uint32_t seed = kv.find("seed") == kv.end() ? 1337u : static_cast<std::uint32_t>(std::stoul(kv.at("seed")));
-             applyPencilStrokesToBuffer(target, spacing, length, thickness, angle, angleJitter, jitter, ink, opacity, minDarkness, seed);
-         }},
-        {"replace-color", [&]() {
-             if (kv.find("path") == kv.end() || kv.find("from") == kv.end() || kv.find("to") == kv.end()) {
-                 throw std::runtime_error("replace-color requires path= from= to=");
-             }
-             Layer& layer = resolveLayerPath(document, kv.at("path"));
-             const PixelRGBA8 fromColor = parseRGBA(kv.at("from"), true);
-             const PixelRGBA8 toColor = parseRGBA(kv.at("to"), true);
-             const double tolerance = kv.find("tolerance") == kv.end() ? 36.0 : std::stod(kv.at("tolerance"));
-             const double softness = kv.find("softness") == kv.end() ? 24.0 : std::stod(kv.at("softness"));
-             const bool preserveLuma = kv.find("preserve_luma") == kv.end() ? true : parseBoolFlag(kv.at("preserve_luma"));
-             applyReplaceColorToLayer(layer, fromColor, toColor, tolerance, softness, preserveLuma);
-         }},
-        {"channel-mix", [&]() {
-             if (kv.find("path") == kv.end()) {
-                 throw std::runtime_error("channel-mix requires path=");
-             }
-             Layer& layer = resolveLayerPath(document, kv.at("path"));
-             const std::array<float, 9> matrix = {
-                 kv.find("rr") == kv.end() ? 1.0f : std::stof(kv.at("rr")),
-                 kv.find("rg") == kv.end() ? 0.0f : std::stof(kv.at("rg")),
-                 kv.find("rb") == kv.end() ? 0.0f : std::stof(kv.at("rb")),
-                 kv.find("gr") == kv.end() ? 0.0f : std::stof(kv.at("gr")),
-                 kv.find("gg") == kv.end() ? 1.0f : std::stof(kv.at("gg")),
-                 kv.find("gb") == kv.end() ? 0.0f : std::stof(kv.at("gb")),
-                 kv.find("br") == kv.end() ? 0.0f : std::stof(kv.at("br")),
-                 kv.find("bg") == kv.end() ? 0.0f : std::stof(kv.at("bg")),
-                 kv.find("bb") == kv.end() ? 1.0f : std::stof(kv.at("bb"))};
-             const float clampMin = kv.find("min") == kv.end() ? 0.0f : std::stof(kv.at("min"));
-             const float clampMax = kv.find("max") == kv.end() ? 255.0f : std::stof(kv.at("max"));
-             applyChannelMixToLayer(layer, matrix, clampMin, clampMax);
+             // Stroke placement reads the whole layer, so the halo spans it.
+             const int halo = std::max(layer.image().width(), layer.image().height());
+             applyInRegion(layer, kv, halo, [&](ImageBuffer& target, const OpWindow& window) {
+                 applyPencilStrokesToBuffer(target, window, spacing, length, thickness, angle, angleJitter, jitter, ink, opacity,
+                                            minDarkness, seed, threads);
+             });
          }},
+        {"replace-color", applyPointOp},
+        {"apply-lut", applyPointOp},
+        {"channel-mix", applyPointOp},
     };
-
-    const auto dispatchIt = dispatch.find(action);
-    if (dispatchIt == dispatch.end()) {
-        return false;
-    }
-    dispatchIt->second();
-    return true;
+    return dispatch;
 }
 } // namespace
 
+bool isEffectsAction(const std::string& action) {
+    return effectsDispatch().count(action) != 0;
+}
+
 bool tryApplyEffectsOperation(
     const std::string& action,
     Document& document,
-    const std::unordered_map<std::string, std::string>& kv) {
-    return tryApplyLambdaDispatchedOperation(action, document, kv);
+    const std::unordered_map<std::string, std::string>& kv,
+    int threads) {
+    const auto dispatchIt = effectsDispatch().find(action);
+    if (dispatchIt == effectsDispatch().end()) {
+        return false;
+    }
+    dispatchIt->second(action, document, kv, threads);
+    return true;
+}
+
+PointOpProgram::PointOpProgram() = default;
+
+PointOpProgram::~PointOpProgram() = default;
+
+bool PointOpProgram::append(const std::string& action, const std::unordered_map<std::string, std::string>& kv) {
+    const auto pathIt = kv.find("path");
+    if (pathIt == kv.end() || kv.find("region") != kv.end() || (m_opCount > 0 && pathIt->second != m_layerPath)) {
+        return false;
+    }
+    // Mask targets round-trip through coverage after every op.
+    const bool drawsToTarget = action == "gamma" || action == "levels" || action == "curves";
+    if (drawsToTarget && kv.find("target") != kv.end() && toLower(kv.at("target")) != "image") {
+        return false;
+    }
+    std::vector<PointOpStage> stages = m_stages;
+    if (!compilePointOp(action, kv, stages)) {
+        return false;
+    }
+    m_stages = std::move(stages);
+    m_layerPath = pathIt->second;
+    ++m_opCount;
+    return true;
+}
+
+void PointOpProgram::apply(ImageBuffer& image, int threads) const {
+    runPointStages(m_stages, image, threads);
 }
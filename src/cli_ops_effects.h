@@ -3,12 +3,43 @@
 
 #include "layer.h"
 
+#include <cstddef>
 #include <string>
 #include <unordered_map>
+#include <vector>
 
+// Whether tryApplyEffectsOperation handles action.
+bool isEffectsAction(const std::string& action);
+// Effect kernels run on up to threads workers (parallelFor rules).
 bool tryApplyEffectsOperation(
     const std::string& action,
     Document& document,
-    const std::unordered_map<std::string, std::string>& kv);
+    const std::unordered_map<std::string, std::string>& kv,
+    int threads);
+
+struct PointOpStage;
+
+// Color and tone ops on one layer's image (apply-effect, levels, gamma,
+// curves, channel-mix) compiled into per-pixel stages that run in a single
+// threaded pass. Adjacent per-channel tables compose into one; the others
+// keep their own rounding, so the pixels match running the ops in order.
+class PointOpProgram {
+public:
+    PointOpProgram();
+    ~PointOpProgram();
+
+    // Adds the op and returns true if it is a point op on the same layer
+    // path as the ops before it, drawing to the layer image; otherwise
+    // returns false and leaves the program as it was. Throws on bad values.
+    bool append(const std::string& action, const std::unordered_map<std::string, std::string>& kv);
+    const std::string& layerPath() const { return m_layerPath; }
+    std::size_t opCount() const { return m_opCount; }
+    void apply(ImageBuffer& image, int threads) const;
+
+private:
+    std::string m_layerPath;
+    std::size_t m_opCount = 0;
+    std::vector<PointOpStage> m_stages;
+};
 
 #endif
@@ -3,6 +3,8 @@
 #include "cli_parse.h"
 #include "cli_shared.h"
 
+#include <algorithm>
+#include <cstdint>
 #include <stdexcept>
 #include <string>
 #include <vector>
@@ -36,6 +38,61 @@ std::vector<std::size_t> parsePathIndices(const std::string& path) {
     }
     return indices;
 }
+
+struct RegionRect {
+    int x0;
+    int y0;
+    int x1;
+    int y1;
+};
+
+// Bounds of the nonzero coverage; empty when there is none.
+RegionRect maskBounds(const MaskBuffer& mask) {
+    std::uint8_t solid = 0;
+    if (mask.trySolidCoverage(solid)) {
+        return solid == 0 ? RegionRect{0, 0, 0, 0} : RegionRect{0, 0, mask.width(), mask.height()};
+    }
+    RegionRect bounds{mask.width(), mask.height(), 0, 0};
+    for (int y = 0; y < mask.height(); ++y) {
+        const std::uint8_t* row = mask.row(y);
+        int first = 0;
+        while (first < mask.width() && row[first] == 0) {
+            ++first;
+        }
+        if (first == mask.width()) {
+            continue;
+        }
+        int last = mask.width();
+        while (row[last - 1] == 0) {
+            --last;
+        }
+        bounds = RegionRect{std::min(bounds.x0, first), std::min(bounds.y0, y), std::max(bounds.x1, last), y + 1};
+    }
+    return bounds.x0 < bounds.x1 ? bounds : RegionRect{0, 0, 0, 0};
+}
+
+RegionRect parseRegionRect(const std::string& value, int width, int height) {
+    const std::vector<std::string> parts = splitByChar(value, ',');
+    if (parts.size() != 4) {
+        throw std::runtime_error("region must be x,y,w,h or mask");
+    }
+    const int x = parseIntStrict(parts[0], "region x");
+    const int y = parseIntStrict(parts[1], "region y");
+    const int w = parseIntStrict(parts[2], "region w");
+    const int h = parseIntStrict(parts[3], "region h");
+    if (w <= 0 || h <= 0) {
+        throw std::runtime_error("region width and height must be > 0");
+    }
+    const auto clampTo = [](long long v, int limit) {
+        return static_cast<int>(std::max(0LL, std::min(static_cast<long long>(limit), v)));
+    };
+    return RegionRect{clampTo(x, width), clampTo(y, height), clampTo(static_cast<long long>(x) + w, width),
+                      clampTo(static_cast<long long>(y) + h, height)};
+}
+
+std::uint8_t fadeChannel(std::uint8_t from, std::uint8_t to, int weight) {
+    return static_cast<std::uint8_t>((static_cast<int>(from) * (255 - weight) + static_cast<int>(to) * weight + 127) / 255);
+}
 } // namespace
 
 LayerGroup& resolveGroupPath(Document& document, const std::string& path) {
@@ -76,17 +133,126 @@ Layer& resolveLayerPath(Document& document, const std::string& path) {
     return node.asLayer();
 }
 
-ImageBuffer& resolveDrawTargetBuffer(Layer& layer, const std::unordered_map<std::string, std::string>& kv) {
+DrawTargetBuffer::DrawTargetBuffer(Layer& layer, const std::unordered_map<std::string, std::string>& kv)
+    : m_image(nullptr),
+      m_mask(nullptr) {
     const std::string target = kv.find("target") == kv.end() ? "image" : toLower(kv.at("target"));
     if (target == "image") {
-        return layer.image();
+        m_image = &layer.image();
+        return;
     }
     if (target == "mask") {
         if (!layer.hasMask()) {
             const PixelRGBA8 maskFill = kv.find("mask_fill") == kv.end() ? PixelRGBA8(0, 0, 0, 255) : parseRGBA(kv.at("mask_fill"), true);
             layer.ensureMask(maskFill);
         }
-        return layer.maskOrThrow();
+        m_mask = &layer.maskOrThrow();
+        m_expanded = m_mask->toImage();
+        m_image = &m_expanded;
+        return;
     }
     throw std::runtime_error("target must be image or mask");
 }
+
+DrawTargetBuffer::~DrawTargetBuffer() {
+    if (m_mask) {
+        *m_mask = MaskBuffer::fromImage(m_expanded);
+    }
+}
+
+ImageBuffer& DrawTargetBuffer::buffer() {
+    return *m_image;
+}
+
+void applyInRegion(Layer& layer,
+                   const std::unordered_map<std::string, std::string>& kv,
+                   int halo,
+                   const std::function<void(ImageBuffer& pixels, const OpWindow& window)>& op) {
+    const auto regionIt = kv.find("region");
+    if (regionIt == kv.end()) {
+        DrawTargetBuffer target(layer, kv);
+        ImageBuffer& pixels = target.buffer();
+        OpWindow window;
+        window.width = pixels.width();
+        window.height = pixels.height();
+        op(pixels, window);
+        return;
+    }
+
+    const std::string target = kv.find("target") == kv.end() ? "image" : toLower(kv.at("target"));
+    if (target != "image" && target != "mask") {
+        throw std::runtime_error("target must be image or mask");
+    }
+    const bool byMask = toLower(regionIt->second) == "mask";
+    if (byMask && !layer.hasMask()) {
+        throw std::runtime_error("region=mask requires a layer mask");
+    }
+    if (target == "mask" && !layer.hasMask()) {
+        const PixelRGBA8 maskFill = kv.find("mask_fill") == kv.end() ? PixelRGBA8(0, 0, 0, 255) : parseRGBA(kv.at("mask_fill"), true);
+        layer.ensureMask(maskFill);
+    }
+
+    // Reads go through the const layer so only the rect counts as edited.
+    const Layer& source = layer;
+    const int width = source.image().width();
+    const int height = source.image().height();
+    const RegionRect region = byMask ? maskBounds(source.mask()) : parseRegionRect(regionIt->second, width, height);
+    if (region.x0 >= region.x1 || region.y0 >= region.y1) {
+        return;
+    }
+    const int reach = std::max(0, halo);
+    const RegionRect outer{std::max(0, region.x0 - reach), std::max(0, region.y0 - reach),
+                           static_cast<int>(std::min<long long>(width, static_cast<long long>(region.x1) + reach)),
+                           static_cast<int>(std::min<long long>(height, static_cast<long long>(region.y1) + reach))};
+
+    ImageBuffer pixels(outer.x1 - outer.x0, outer.y1 - outer.y0);
+    for (int y = outer.y0; y < outer.y1; ++y) {
+        PixelRGBA8* dst = pixels.row(y - outer.y0);
+        if (target == "image") {
+            const PixelRGBA8* src = source.image().row(y) + outer.x0;
+            std::copy(src, src + pixels.width(), dst);
+            continue;
+        }
+        const std::uint8_t* src = source.mask().row(y) + outer.x0;
+        for (int x = 0; x < pixels.width(); ++x) {
+            dst[x] = PixelRGBA8(src[x], src[x], src[x], 255);
+        }
+    }
+
+    OpWindow window;
+    window.originX = outer.x0;
+    window.originY = outer.y0;
+    window.x = region.x0 - outer.x0;
+    window.y = region.y0 - outer.y0;
+    window.width = region.x1 - region.x0;
+    window.height = region.y1 - region.y0;
+    op(pixels, window);
+
+    if (target == "image") {
+        ImageBuffer& image = layer.imageInRect(region.x0, region.y0, window.width, window.height);
+        for (int y = region.y0; y < region.y1; ++y) {
+            const PixelRGBA8* src = pixels.row(y - outer.y0) + window.x;
+            PixelRGBA8* dst = image.row(y) + region.x0;
+            const std::uint8_t* weight = byMask ? source.mask().row(y) + region.x0 : nullptr;
+            for (int x = 0; x < window.width; ++x) {
+                if (weight == nullptr) {
+                    dst[x] = src[x];
+                } else if (weight[x] != 0) {
+                    dst[x] = PixelRGBA8(fadeChannel(dst[x].r, src[x].r, weight[x]), fadeChannel(dst[x].g, src[x].g, weight[x]),
+                                        fadeChannel(dst[x].b, src[x].b, weight[x]), fadeChannel(dst[x].a, src[x].a, weight[x]));
+                }
+            }
+        }
+        return;
+    }
+
+    const CoverageView mask = layer.maskInRect(region.x0, region.y0, window.width, window.height).view();
+    for (int y = region.y0; y < region.y1; ++y) {
+        const PixelRGBA8* src = pixels.row(y - outer.y0) + window.x;
+        std::uint8_t* dst = mask.row(y) + region.x0;
+        for (int x = 0; x < window.width; ++x) {
+            const std::uint8_t coverage = MaskBuffer::coverageFromPixel(src[x]);
+            dst[x] = byMask ? fadeChannel(dst[x], coverage, dst[x]) : coverage;
+        }
+    }
+}
@@ -3,12 +3,49 @@
 
 #include "layer.h"
 
+#include <functional>
 #include <string>
 #include <unordered_map>
 
 LayerGroup& resolveGroupPath(Document& document, const std::string& path);
 LayerNode& resolveNodePath(Document& document, const std::string& path);
 Layer& resolveLayerPath(Document& document, const std::string& path);
-ImageBuffer& resolveDrawTargetBuffer(Layer& layer, const std::unordered_map<std::string, std::string>& kv);
+
+// Buffer selected by target=image|mask. Mask targets are expanded to an RGBA
+// scratch buffer and folded back to coverage when the target is destroyed.
+class DrawTargetBuffer {
+public:
+    DrawTargetBuffer(Layer& layer, const std::unordered_map<std::string, std::string>& kv);
+    ~DrawTargetBuffer();
+    DrawTargetBuffer(const DrawTargetBuffer&) = delete;
+    DrawTargetBuffer& operator=(const DrawTargetBuffer&) = delete;
+
+    ImageBuffer& buffer();
+
+private:
+    ImageBuffer* m_image;
+    MaskBuffer* m_mask;
+    ImageBuffer m_expanded;
+};
+
+// Where an op's buffer sits in its layer: the buffer's (0, 0) is at
+// (originX, originY), and the pixels it may change are the rect at (x, y).
+struct OpWindow {
+    int originX = 0;
+    int originY = 0;
+    int x = 0;
+    int y = 0;
+    int width = 0;
+    int height = 0;
+};
+
+// Runs op on the target=image|mask buffer of a layer. With region=x,y,w,h or
+// region=mask, op gets only that rect plus halo pixels of context on each
+// side, and only the rect is written back. region=mask covers the bounds of
+// the mask's nonzero coverage and fades the result in by coverage.
+void applyInRegion(Layer& layer,
+                   const std::unordered_map<std::string, std::string>& kv,
+                   int halo,
+                   const std::function<void(ImageBuffer& pixels, const OpWindow& window)>& op);
 
 #endif
@@ -65,6 +65,18 @@ std::vector<std::string> tokenizeOpSpec(const std::string& text) {
     return tokens;
 }
 
+std::unordered_map<std::string, std::string> parseKeyValues(const std::vector<std::string>& tokens, std::size_t startIndex) {
+    std::unordered_map<std::string, std::string> kv;
+    for (std::size_t i = startIndex; i < tokens.size(); ++i) {
+        const std::size_t split = tokens[i].find('=');
+        if (split == std::string::npos || split == 0 || split + 1 >= tokens[i].size()) {
+            throw std::runtime_error("Expected key=value token but got: " + tokens[i]);
+        }
+        kv[tokens[i].substr(0, split)] = tokens[i].substr(split + 1);
+    }
+    return kv;
+}
+
 std::vector<std::string> splitByChar(const std::string& text, char delimiter) {
     std::vector<std::string> parts;
     std::string current;
@@ -3,12 +3,16 @@
 
 #include "layer.h"
 
+#include <cstddef>
 #include <cstdint>
 #include <string>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
 std::vector<std::string> tokenizeOpSpec(const std::string& text);
+// key=value tokens from startIndex on; throws on any other token.
+std::unordered_map<std::string, std::string> parseKeyValues(const std::vector<std::string>& tokens, std::size_t startIndex);
 std::vector<std::string> splitByChar(const std::string& text, char delimiter);
 std::vector<std::string> splitNonEmptyByChar(const std::string& text, char delimiter);
 int parseIntStrict(const std::string& text, const std::string& fieldName);
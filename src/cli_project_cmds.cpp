@@ -1,36 +1,25 @@
 #include "cli_project_cmds.h"
 
 #include "cli_args.h"
+#include "cli_ops_core.h"
 #include "cli_parse.h"
 #include "cli_shared.h"
+#include "codec.h"
 #include "layer.h"
-#include "resize.h"
 
-#include "bmp.h"
-#include "gif.h"
-#include "jpg.h"
+#include "parallel.h"
 #include "png.h"
-#include "webp.h"
+#include "profile.h"
+#include "resample.h"
 
+#include <algorithm>
+#include <cmath>
 #include <filesystem>
 #include <iostream>
 #include <limits>
 #include <stdexcept>
 #include <string>
-
-namespace {
-void resizeLayerForNew(Layer& layer, int width, int height, ResizeFilter filter) {
-    PNGImage source(layer.image().width(), layer.image().height(), Color(0, 0, 0));
-    for (int y = 0; y < source.height(); ++y) {
-        for (int x = 0; x < source.width(); ++x) {
-            const PixelRGBA8& p = layer.image().getPixel(x, y);
-            source.setPixel(x, y, Color(p.r, p.g, p.b));
-        }
-    }
-    PNGImage resized = resizeImage(source, width, height, filter);
-    layer.setImageFromRaster(resized, 255);
-}
-} // namespace
+#include <utility>
 
 int runIFLOWNew(const std::vector<std::string>& args) {
     std::string widthValue;
@@ -64,38 +53,39 @@ int runIFLOWNew(const std::vector<std::string>& args) {
     bool addBaseLayer = false;
 
     if (hasFromImage) {
-        BMPImage bmp;
-        PNGImage png;
-        JPGImage jpg;
-        GIFImage gif;
-        WEBPImage webp;
-        RasterImage* source = loadImageByExtension(fromImagePath, bmp, png, jpg, gif, webp);
-        width = source->width();
-        height = source->height();
-        addBaseLayer = true;
-        baseLayer = Layer("Base", width, height, PixelRGBA8(0, 0, 0, 0));
-        baseLayer.setImageFromRaster(*source, 255);
-
+        // Parsed first so JPEG sources can decode close to the fitted size.
+        DecodeOptions decodeOptions;
         if (hasFit) {
             const std::size_t split = fitValue.find('x');
             if (split == std::string::npos || split == 0 || split + 1 >= fitValue.size()) {
                 throw std::runtime_error("Invalid --fit value; expected <w>x<h>");
             }
-            width = parseIntInRange(fitValue.substr(0, split), "fit width", 1, std::numeric_limits<int>::max());
-            height = parseIntInRange(fitValue.substr(split + 1), "fit height", 1, std::numeric_limits<int>::max());
-            const ResizeFilter filter = ResizeFilter::Bilinear;
-            resizeLayerForNew(baseLayer, width, height, filter);
+            decodeOptions.targetWidth = parseIntInRange(fitValue.substr(0, split), "fit width", 1, std::numeric_limits<int>::max());
+            decodeOptions.targetHeight = parseIntInRange(fitValue.substr(split + 1), "fit height", 1, std::numeric_limits<int>::max());
+            std::string filterValue;
+            if (getFlagValue(args, "--filter", filterValue)) {
+                decodeOptions.filter = parseResampleFilter(filterValue);
+            }
+            decodeOptions.threads = parseCompositeOptions(args).threads;
         }
+
+        ImageBuffer source = decodeImageFile(fromImagePath, decodeOptions);
+        width = source.width();
+        height = source.height();
+        addBaseLayer = true;
+        baseLayer = Layer("Base", width, height, PixelRGBA8(0, 0, 0, 0));
+        baseLayer.setImage(std::move(source));
     } else {
         width = parseIntInRange(widthValue, "width", 1, std::numeric_limits<int>::max());
         height = parseIntInRange(heightValue, "height", 1, std::numeric_limits<int>::max());
     }
 
+    const IFLOWSaveOptions saveOptions = parseIFLOWSaveOptions(args);
     Document document(width, height);
     if (addBaseLayer) {
-        document.addLayer(baseLayer);
+        document.addLayer(std::move(baseLayer));
     }
-    if (!saveDocumentIFLOW(document, outPath)) {
+    if (!saveDocumentIFLOW(document, outPath, saveOptions)) {
         std::cerr << "Failed saving IFLOW document: " << outPath << "\n";
         return 1;
     }
@@ -118,31 +108,101 @@ int runIFLOWInfo(const std::vector<std::string>& args) {
     Document document = loadDocumentIFLOW(inPath);
     std::cout << "Document: " << inPath << "\n";
     std::cout << "Size: " << document.width() << "x" << document.height() << "\n";
+    const MemoryUsage memory = documentMemoryUsage(document);
+    std::cout << "Memory: " << formatBytes(memory.full) << " decoded, " << formatBytes(memory.resident()) << " resident (pixels "
+              << formatBytes(memory.pixels) << ", masks " << formatBytes(memory.masks) << ", mips " << formatBytes(memory.mips) << ")\n";
     printGroupInfo(document.rootGroup(), "");
     return 0;
 }
 
 int runIFLOWRender(const std::vector<std::string>& args) {
     std::string inPath;
-    std::string outPath;
-    if (!getFlagValue(args, "--in", inPath) || !getFlagValue(args, "--out", outPath)) {
-        std::cerr << "Usage: image_flow render --in <project.iflow> --out <image.{png|bmp|jpg|gif|webp|svg}>\n";
+    const std::vector<std::string> outSpecs = getFlagValues(args, "--out");
+    if (!getFlagValue(args, "--in", inPath) || outSpecs.empty()) {
+        std::cerr << "Usage: image_flow render --in <project.iflow> --out <image.{png|bmp|jpg|gif|webp|svg}>[,scale=<f>][,quality=<n>][,level=<0-9>] [--out ...] [--scale <f>|--max-size <W>x<H>] [--threads <n>] [--memory-budget <MiB>] [--png-level <0-9>] [--profile <trace.json>]\n";
         return 1;
     }
 
-    Document document = loadDocumentIFLOW(inPath);
-    ImageBuffer composite = document.composite();
+    const ProfileSession profile(args);
+    CompositeOptions compositeOptions = parseCompositeOptions(args);
+    const ImageSaveOptions imageOptions = parseImageSaveOptions(args);
+    std::vector<RenderTarget> targets;
+    for (const std::string& spec : outSpecs) {
+        targets.push_back(parseRenderTarget(spec, imageOptions));
+    }
+    Document document = loadDocumentIFLOW(inPath, compositeOptions.threads);
+    // Proxies composite at the reduced size rather than shrinking a full one.
+    compositeOptions.scale = parseRenderScale(args, document.width(), document.height());
+
+    for (const RenderTarget& target : targets) {
+        const std::filesystem::path outFsPath(target.path);
+        if (outFsPath.has_parent_path()) {
+            std::filesystem::create_directories(outFsPath.parent_path());
+        }
+    }
+
+    // A lone full-size PNG is encoded band by band, so the full composite
+    // never exists.
+    if (targets.size() == 1 && targets[0].scale == 1.0 && extensionLower(targets[0].path) == "png") {
+        PNGStreamWriter writer(targets[0].path, scaledExtent(document.width(), compositeOptions.scale),
+                               scaledExtent(document.height(), compositeOptions.scale), targets[0].options.png);
+        document.compositeRows(compositeOptions, [&](int, const ConstImageView& rows) {
+            ProfileScope scope("encode", targets[0].path);
+            scope.addPixels(static_cast<std::uint64_t>(rows.width()) * static_cast<std::uint64_t>(rows.height()));
+            writer.writeRows(pixelRows(rows));
+        });
+        writer.finish();
+        std::cout << "Rendered " << inPath << " -> " << targets[0].path << "\n";
+        return 0;
+    }
+
+    // One composite feeds every target; each encoder keeps its own threads.
+    const ImageBuffer composite = document.composite(compositeOptions);
+    std::vector<char> written(targets.size(), 0);
+    parallelFor(static_cast<int>(targets.size()), static_cast<int>(targets.size()), [&](int index) {
+        const RenderTarget& target = targets[static_cast<std::size_t>(index)];
+        if (target.scale == 1.0) {
+            written[static_cast<std::size_t>(index)] = saveCompositeByExtension(composite, target.path, target.options);
+            return;
+        }
+        const ImageBuffer scaled = resampleBuffer(composite, scaledExtent(composite.width(), target.scale),
+                                                  scaledExtent(composite.height(), target.scale), compositeOptions.threads);
+        written[static_cast<std::size_t>(index)] = saveCompositeByExtension(scaled, target.path, target.options);
+    });
+
+    int status = 0;
+    for (std::size_t i = 0; i < targets.size(); ++i) {
+        if (!written[i]) {
+            std::cerr << "Failed writing image output: " << targets[i].path << "\n";
+            status = 1;
+            continue;
+        }
+        std::cout << "Rendered " << inPath << " -> " << targets[i].path << "\n";
+    }
+    return status;
+}
 
+int runBakeLUT(const std::vector<std::string>& args) {
+    std::string outPath;
+    const std::vector<std::string> ops = gatherOps(args);
+    if (!getFlagValue(args, "--out", outPath) || ops.empty()) {
+        std::cerr << "Usage: image_flow bake-lut --out <grade.cube> [--size <2-256>] [--title <text>] --op \"<color op>\" [--op ...]\n";
+        return 1;
+    }
+    std::string sizeValue;
+    const int size = getFlagValue(args, "--size", sizeValue) ? parseIntInRange(sizeValue, "size", 2, 256) : 33;
+    std::string title;
+    getFlagValue(args, "--title", title);
+
+    const ColorLUT lut = bakeColorOps(ops, size);
     const std::filesystem::path outFsPath(outPath);
     if (outFsPath.has_parent_path()) {
         std::filesystem::create_directories(outFsPath.parent_path());
     }
-
-    if (!saveCompositeByExtension(composite, outPath)) {
-        std::cerr << "Failed writing image output: " << outPath << "\n";
+    if (!saveCubeLUT(outPath, lut, title)) {
+        std::cerr << "Failed writing LUT: " << outPath << "\n";
         return 1;
     }
-
-    std::cout << "Rendered " << inPath << " -> " << outPath << "\n";
+    std::cout << "Baked " << ops.size() << " ops -> " << outPath << " (" << size << "^3)\n";
     return 0;
 }
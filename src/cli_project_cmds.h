@@ -7,5 +7,6 @@
 int runIFLOWNew(const std::vector<std::string>& args);
 int runIFLOWInfo(const std::vector<std::string>& args);
 int runIFLOWRender(const std::vector<std::string>& args);
+int runBakeLUT(const std::vector<std::string>& args);
 
 #endif
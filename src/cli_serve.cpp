@@ -0,0 +1,502 @@
+#include "cli_serve.h"
+
+#include "cli_args.h"
+#include "cli_help.h"
+#include "cli_ops_core.h"
+#include "cli_parse.h"
+#include "cli_shared.h"
+
+#include "layer.h"
+#include "png.h"
+#include "resample.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace {
+// Requests carry commands and ops, never pixels.
+constexpr std::size_t kMaxRequestBytes = std::size_t(64) << 20;
+
+// Requests are a decimal byte count and a newline, then that many bytes.
+// Replies are "ok <count>\n" or "error <count>\n", then the payload.
+class FrameChannel {
+public:
+    FrameChannel(int in, int out) : m_in(in), m_out(out) {}
+
+    // False when the peer closed the stream between frames; throws on a bad
+    // header or a frame cut short.
+    bool read(std::string& payload) {
+        std::string count;
+        for (;;) {
+            if (m_at == m_end && !fill()) {
+                if (count.empty()) {
+                    return false;
+                }
+                throw std::runtime_error("Truncated request header");
+            }
+            const char c = m_buffer[m_at++];
+            if (c == '\n') {
+                break;
+            }
+            if (c < '0' || c > '9' || count.size() >= 12) {
+                throw std::runtime_error("Request header must be a byte count and a newline");
+            }
+            count.push_back(c);
+        }
+        if (count.empty()) {
+            throw std::runtime_error("Request header must be a byte count and a newline");
+        }
+        const unsigned long long size = std::stoull(count);
+        if (size > kMaxRequestBytes) {
+            throw std::runtime_error("Request is larger than 64 MiB");
+        }
+        payload.resize(static_cast<std::size_t>(size));
+        std::size_t at = 0;
+        while (at < payload.size()) {
+            if (m_at == m_end && !fill()) {
+                throw std::runtime_error("Truncated request");
+            }
+            const std::size_t take = std::min(m_end - m_at, payload.size() - at);
+            std::memcpy(&payload[at], m_buffer + m_at, take);
+            m_at += take;
+            at += take;
+        }
+        return true;
+    }
+
+    void write(bool ok, const std::string& payload) {
+        const std::string header = (ok ? "ok " : "error ") + std::to_string(payload.size()) + "\n";
+        writeAll(header.data(), header.size());
+        writeAll(payload.data(), payload.size());
+    }
+
+private:
+    bool fill() {
+        for (;;) {
+            const ssize_t count = ::read(m_in, m_buffer, sizeof(m_buffer));
+            if (count < 0 && errno == EINTR) {
+                continue;
+            }
+            if (count < 0) {
+                throw std::runtime_error(std::string("Failed reading request: ") + std::strerror(errno));
+            }
+            m_at = 0;
+            m_end = static_cast<std::size_t>(count);
+            return count > 0;
+        }
+    }
+
+    void writeAll(const char* data, std::size_t size) {
+        while (size > 0) {
+            const ssize_t count = ::write(m_out, data, size);
+            if (count < 0 && errno == EINTR) {
+                continue;
+            }
+            if (count <= 0) {
+                throw std::runtime_error(std::string("Failed writing reply: ") + std::strerror(errno));
+            }
+            data += count;
+            size -= static_cast<std::size_t>(count);
+        }
+    }
+
+    int m_in;
+    int m_out;
+    char m_buffer[1 << 16];
+    std::size_t m_at = 0;
+    std::size_t m_end = 0;
+};
+
+class FileDescriptor {
+public:
+    explicit FileDescriptor(int fd) : m_fd(fd) {}
+    ~FileDescriptor() {
+        if (m_fd >= 0) {
+            ::close(m_fd);
+        }
+    }
+
+    FileDescriptor(const FileDescriptor&) = delete;
+    FileDescriptor& operator=(const FileDescriptor&) = delete;
+
+    int get() const {
+        return m_fd;
+    }
+
+private:
+    int m_fd;
+};
+
+struct ResidentDocument {
+    ResidentDocument(Document loaded, std::string file) : document(std::move(loaded)), path(std::move(file)) {}
+
+    Document document;
+    CompositeCache cache;
+    // Where save and close write the document; empty until one is named.
+    std::string path;
+    bool dirty = false;
+};
+
+const std::string& requiredValue(const std::unordered_map<std::string, std::string>& kv, const std::string& key, const std::string& command) {
+    const auto it = kv.find(key);
+    if (it == kv.end()) {
+        throw std::runtime_error(command + " requires " + key + "=");
+    }
+    return it->second;
+}
+
+// Only PNG has a stream encoder; other formats go through a scratch file.
+std::string encodeImage(const ImageBuffer& image, const RenderTarget& target) {
+    const std::string ext = extensionLower(target.path);
+    if (ext == "png") {
+        std::ostringstream out(std::ios::binary);
+        PNGStreamWriter writer(out, image.width(), image.height(), target.options.png);
+        writer.writeRows(pixelRows(image));
+        writer.finish();
+        return out.str();
+    }
+    const std::filesystem::path scratch =
+        std::filesystem::temp_directory_path() / ("image_flow-serve-" + std::to_string(::getpid()) + "." + ext);
+    if (!saveCompositeByExtension(image, scratch.string(), target.options)) {
+        std::filesystem::remove(scratch);
+        throw std::runtime_error("Failed encoding " + ext + " output");
+    }
+    std::ifstream in(scratch, std::ios::binary);
+    std::string bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    in.close();
+    std::filesystem::remove(scratch);
+    return bytes;
+}
+
+class DocumentServer {
+public:
+    DocumentServer(const CompositeOptions& compositeOptions, const IFLOWSaveOptions& saveOptions, const ImageSaveOptions& imageOptions)
+        : m_compositeOptions(compositeOptions), m_saveOptions(saveOptions), m_imageOptions(imageOptions) {}
+
+    // Runs one request and returns its reply payload; sets stop on quit.
+    // Failures throw and leave the server running.
+    std::string handle(const std::string& request, bool& stop) {
+        std::istringstream lines(request);
+        std::string header;
+        std::getline(lines, header);
+        const std::vector<std::string> tokens = tokenizeOpSpec(header);
+        if (tokens.empty()) {
+            throw std::runtime_error("Empty request");
+        }
+        const std::string& command = tokens[0];
+        const std::unordered_map<std::string, std::string> kv = parseKeyValues(tokens, 1);
+
+        if (command == "open") {
+            const std::string& name = requiredValue(kv, "name", command);
+            const std::string& file = requiredValue(kv, "file", command);
+            requireUnused(name);
+            auto resident = std::make_unique<ResidentDocument>(loadDocumentIFLOW(file, m_compositeOptions.threads), file);
+            const std::string reply = describe(name, *resident);
+            m_documents.emplace(name, std::move(resident));
+            return reply;
+        }
+        if (command == "new") {
+            const std::string& name = requiredValue(kv, "name", command);
+            const int width = parseIntInRange(requiredValue(kv, "width", command), "width", 1, std::numeric_limits<int>::max());
+            const int height = parseIntInRange(requiredValue(kv, "height", command), "height", 1, std::numeric_limits<int>::max());
+            requireUnused(name);
+            auto resident = std::make_unique<ResidentDocument>(Document(width, height), kv.find("file") == kv.end() ? "" : kv.at("file"));
+            resident->dirty = true;
+            const std::string reply = describe(name, *resident);
+            m_documents.emplace(name, std::move(resident));
+            return reply;
+        }
+        if (command == "ops") {
+            std::vector<std::string> opSpecs;
+            addOpsFromStream(lines, opSpecs);
+            return runOps(resident(kv, command), opSpecs);
+        }
+        if (command == "render") {
+            return render(resident(kv, command), kv);
+        }
+        if (command == "save") {
+            ResidentDocument& target = resident(kv, command);
+            if (kv.find("file") != kv.end()) {
+                target.path = kv.at("file");
+            }
+            save(target);
+            return "Saved " + kv.at("name") + " -> " + target.path;
+        }
+        if (command == "close") {
+            ResidentDocument& target = resident(kv, command);
+            if (kv.find("file") != kv.end()) {
+                target.path = kv.at("file");
+            }
+            const bool keep = kv.find("save") == kv.end() || parseBoolFlag(kv.at("save"));
+            if (keep && target.dirty) {
+                if (target.path.empty()) {
+                    throw std::runtime_error("close needs file= or save=false for a document that was never saved");
+                }
+                save(target);
+            }
+            m_documents.erase(kv.at("name"));
+            return "Closed " + kv.at("name");
+        }
+        if (command == "list") {
+            std::string reply;
+            for (const auto& entry : m_documents) {
+                reply += describe(entry.first, *entry.second) + "\n";
+            }
+            return reply;
+        }
+        if (command == "quit") {
+            stop = true;
+            persistAll();
+            return "Bye";
+        }
+        throw std::runtime_error("Unknown serve command: " + command);
+    }
+
+    // Saves every changed document that has a path; failures go to stderr.
+    void persistAll() {
+        for (auto& entry : m_documents) {
+            if (!entry.second->dirty || entry.second->path.empty()) {
+                continue;
+            }
+            try {
+                save(*entry.second);
+            } catch (const std::exception& ex) {
+                std::cerr << "Error: " << entry.first << ": " << ex.what() << "\n";
+            }
+        }
+    }
+
+private:
+    ResidentDocument& resident(const std::unordered_map<std::string, std::string>& kv, const std::string& command) {
+        const std::string& name = requiredValue(kv, "name", command);
+        const auto it = m_documents.find(name);
+        if (it == m_documents.end()) {
+            throw std::runtime_error("No open document named " + name);
+        }
+        return *it->second;
+    }
+
+    void requireUnused(const std::string& name) const {
+        if (m_documents.find(name) != m_documents.end()) {
+            throw std::runtime_error("A document named " + name + " is already open");
+        }
+    }
+
+    static std::string describe(const std::string& name, const ResidentDocument& resident) {
+        return name + " " + std::to_string(resident.document.width()) + "x" + std::to_string(resident.document.height()) +
+               (resident.path.empty() ? "" : " " + resident.path) + (resident.dirty ? " changed" : "");
+    }
+
+    // Every op is parsed before the first runs. A failing op stops the batch
+    // with the ops before it applied, and is reported with its index.
+    std::string runOps(ResidentDocument& target, const std::vector<std::string>& opSpecs) {
+        if (opSpecs.empty()) {
+            throw std::runtime_error("ops needs one op per line after the request line");
+        }
+        std::vector<CompiledOp> program;
+        program.reserve(opSpecs.size());
+        for (std::size_t i = 0; i < opSpecs.size(); ++i) {
+            try {
+                program.push_back(compileOp(opSpecs[i]));
+            } catch (const std::exception& ex) {
+                throw std::runtime_error(opFailure(i, opSpecs[i], ex.what()));
+            }
+        }
+        // Proxy-sized emits skip the cache so they leave it at full size.
+        const auto emitOutput = [&](const std::string& outputPath, double scale) {
+            const std::filesystem::path outFsPath(outputPath);
+            if (outFsPath.has_parent_path()) {
+                std::filesystem::create_directories(outFsPath.parent_path());
+            }
+            CompositeOptions options = m_compositeOptions;
+            options.scale = scale;
+            const ImageBuffer composite = scale == 1.0 ? target.document.composite(options, target.cache) : target.document.composite(options);
+            if (!saveCompositeByExtension(composite, outputPath, m_imageOptions)) {
+                throw std::runtime_error("Failed writing emit output: " + outputPath);
+            }
+        };
+        target.dirty = true;
+        for (std::size_t i = 0; i < program.size(); ++i) {
+            try {
+                std::size_t runEnd = applyIndependentOps(target.document, program, i, m_compositeOptions.threads, true);
+                if (runEnd == i) {
+                    runEnd = applyOpRun(target.document, program, i, m_compositeOptions.threads);
+                }
+                if (runEnd > i) {
+                    i = runEnd - 1;
+                    continue;
+                }
+                applyDocumentOperation(target.document, program[i], emitOutput, {}, {}, m_compositeOptions.threads);
+            } catch (const OpRunError& ex) {
+                throw std::runtime_error(opFailure(ex.index(), opSpecs[ex.index()], ex.what()));
+            } catch (const std::exception& ex) {
+                throw std::runtime_error(opFailure(i, opSpecs[i], ex.what()));
+            }
+        }
+        if (m_compositeOptions.memoryBudget > 0) {
+            enforceMemoryBudget(target.document, m_compositeOptions.memoryBudget, m_spill);
+        }
+        return "Applied " + std::to_string(program.size()) + " ops";
+    }
+
+    // format= picks the encoder (png by default); scale=, quality= and
+    // level= work as on render --out targets.
+    std::string render(ResidentDocument& source, const std::unordered_map<std::string, std::string>& kv) {
+        std::string spec = "render." + (kv.find("format") == kv.end() ? std::string("png") : toLower(kv.at("format")));
+        for (const char* key : {"scale", "quality", "level"}) {
+            if (kv.find(key) != kv.end()) {
+                spec += std::string(",") + key + "=" + kv.at(key);
+            }
+        }
+        const RenderTarget target = parseRenderTarget(spec, m_imageOptions);
+        const ImageBuffer composite = source.document.composite(m_compositeOptions, source.cache);
+        if (target.scale == 1.0) {
+            return encodeImage(composite, target);
+        }
+        const int width = std::max(1, static_cast<int>(std::lround(composite.width() * target.scale)));
+        const int height = std::max(1, static_cast<int>(std::lround(composite.height() * target.scale)));
+        return encodeImage(resampleBuffer(composite, width, height, m_compositeOptions.threads), target);
+    }
+
+    // The saved file is mapped back in, so edited pixels leave memory and
+    // the next save only appends what changes after this one.
+    void save(ResidentDocument& target) {
+        if (target.path.empty()) {
+            throw std::runtime_error("save needs file= for a document that was never saved");
+        }
+        const std::filesystem::path outFsPath(target.path);
+        if (outFsPath.has_parent_path()) {
+            std::filesystem::create_directories(outFsPath.parent_path());
+        }
+        if (!saveDocumentIFLOW(target.document, target.path, m_saveOptions)) {
+            throw std::runtime_error("Failed saving IFLOW document: " + target.path);
+        }
+        target.document = loadDocumentIFLOW(target.path, m_compositeOptions.threads);
+        target.cache.invalidate();
+        target.dirty = false;
+    }
+
+    CompositeOptions m_compositeOptions;
+    IFLOWSaveOptions m_saveOptions;
+    ImageSaveOptions m_imageOptions;
+    std::map<std::string, std::unique_ptr<ResidentDocument>> m_documents;
+    SpillFile m_spill;
+};
+
+void serveChannel(DocumentServer& server, FrameChannel& channel, bool& stop) {
+    std::string request;
+    while (!stop && channel.read(request)) {
+        std::string reply;
+        bool ok = true;
+        try {
+            reply = server.handle(request, stop);
+        } catch (const std::exception& ex) {
+            reply = ex.what();
+            ok = false;
+        }
+        channel.write(ok, reply);
+    }
+}
+
+int listenOn(const std::string& path) {
+    sockaddr_un address{};
+    if (path.empty() || path.size() >= sizeof(address.sun_path)) {
+        throw std::runtime_error("Socket path must be 1 to " + std::to_string(sizeof(address.sun_path) - 1) + " bytes");
+    }
+    std::error_code error;
+    if (std::filesystem::is_socket(path, error)) {
+        std::filesystem::remove(path, error);
+    } else if (std::filesystem::exists(path, error)) {
+        throw std::runtime_error("Socket path exists and is not a socket: " + path);
+    }
+    address.sun_family = AF_UNIX;
+    std::memcpy(address.sun_path, path.data(), path.size());
+    const int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        throw std::runtime_error(std::string("Failed creating socket: ") + std::strerror(errno));
+    }
+    if (::bind(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0 || ::listen(fd, 8) != 0) {
+        const std::string reason = std::strerror(errno);
+        ::close(fd);
+        throw std::runtime_error("Failed listening on " + path + ": " + reason);
+    }
+    return fd;
+}
+} // namespace
+
+int runIFLOWServe(const std::vector<std::string>& args) {
+    if (std::find(args.begin(), args.end(), "--help") != args.end() ||
+        std::find(args.begin(), args.end(), "-h") != args.end()) {
+        writeServeUsage();
+        return 0;
+    }
+
+    std::string socketPath;
+    const bool hasSocket = getFlagValue(args, "--socket", socketPath);
+    DocumentServer server(parseCompositeOptions(args), parseIFLOWSaveOptions(args), parseImageSaveOptions(args));
+    // A client that goes away shows up as a failed write instead.
+    std::signal(SIGPIPE, SIG_IGN);
+    bool stop = false;
+
+    if (!hasSocket) {
+        // Replies own stdout; anything else printed goes to stderr.
+        std::cout.flush();
+        std::streambuf* original = std::cout.rdbuf(std::cerr.rdbuf());
+        int status = 0;
+        try {
+            FrameChannel channel(STDIN_FILENO, STDOUT_FILENO);
+            serveChannel(server, channel, stop);
+        } catch (const std::exception& ex) {
+            std::cerr << "Error: " << ex.what() << "\n";
+            status = 1;
+        }
+        server.persistAll();
+        std::cout.rdbuf(original);
+        return status;
+    }
+
+    const FileDescriptor listener(listenOn(socketPath));
+    std::cout << "Serving on " << socketPath << std::endl;
+    // Clients are served one at a time; documents outlive connections.
+    while (!stop) {
+        const int fd = ::accept(listener.get(), nullptr, nullptr);
+        if (fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            std::cerr << "Error: Failed accepting a client: " << std::strerror(errno) << "\n";
+            break;
+        }
+        const FileDescriptor client(fd);
+        try {
+            FrameChannel channel(client.get(), client.get());
+            serveChannel(server, channel, stop);
+        } catch (const std::exception& ex) {
+            std::cerr << "Error: " << ex.what() << "\n";
+        }
+    }
+    server.persistAll();
+    std::remove(socketPath.c_str());
+    return 0;
+}
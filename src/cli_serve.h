@@ -0,0 +1,11 @@
+#ifndef CLI_SERVE_H
+#define CLI_SERVE_H
+
+#include <string>
+#include <vector>
+
+// Keeps named documents in memory and runs requests against them, read as
+// frames from stdin (replies on stdout) or from clients of a Unix socket.
+int runIFLOWServe(const std::vector<std::string>& args);
+
+#endif
@@ -1,26 +1,21 @@
 #include "cli_shared.h"
 
+#include "cli_args.h"
+#include "cli_parse.h"
+#include "profile.h"
 #include "svg.h"
 
 #include <algorithm>
 #include <cctype>
 #include <filesystem>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <limits>
+#include <sstream>
 #include <stdexcept>
 
 namespace {
-void copyBufferToImage(const ImageBuffer& source, Image& destination) {
-    if (source.width() != destination.width() || source.height() != destination.height()) {
-        throw std::invalid_argument("copyBufferToImage dimensions must match");
-    }
-    for (int y = 0; y < source.height(); ++y) {
-        for (int x = 0; x < source.width(); ++x) {
-            const PixelRGBA8& p = source.getPixel(x, y);
-            destination.setPixel(x, y, Color(p.r, p.g, p.b));
-        }
-    }
-}
-
 const char* blendModeName(BlendMode mode) {
     switch (mode) {
         case BlendMode::Normal:
@@ -49,6 +44,18 @@ const char* blendModeName(BlendMode mode) {
 }
 } // namespace
 
+std::string formatBytes(std::size_t bytes) {
+    std::ostringstream out;
+    if (bytes < 1024) {
+        out << bytes << "B";
+    } else if (bytes < (std::size_t(1) << 20)) {
+        out << std::fixed << std::setprecision(1) << static_cast<double>(bytes) / 1024.0 << "KiB";
+    } else {
+        out << std::fixed << std::setprecision(1) << static_cast<double>(bytes) / (1024.0 * 1024.0) << "MiB";
+    }
+    return out.str();
+}
+
 std::string toLower(std::string value) {
     std::transform(value.begin(), value.end(), value.begin(), [](unsigned char c) {
         return static_cast<char>(std::tolower(c));
@@ -65,72 +72,223 @@ std::string extensionLower(const std::string& path) {
     return toLower(ext);
 }
 
-bool saveCompositeByExtension(const ImageBuffer& composite, const std::string& outPath) {
+bool saveCompositeByExtension(const ImageBuffer& composite, const std::string& outPath, const ImageSaveOptions& options) {
     const std::string ext = extensionLower(outPath);
+    ProfileScope scope("encode", outPath);
+    scope.addPixels(static_cast<std::uint64_t>(composite.width()) * static_cast<std::uint64_t>(composite.height()));
 
+    // Encoders read the composite's rows directly; PNG keeps alpha.
     if (ext == "png") {
-        PNGImage out(composite.width(), composite.height(), Color(0, 0, 0));
-        copyToRasterImage(composite, out);
-        return out.save(outPath);
+        return PNGImage::saveRows(outPath, pixelRows(composite), options.png);
     }
     if (ext == "bmp") {
-        BMPImage out(composite.width(), composite.height(), Color(0, 0, 0));
-        copyToRasterImage(composite, out);
-        return out.save(outPath);
+        return BMPImage::saveRows(outPath, pixelRows(composite));
     }
     if (ext == "jpg" || ext == "jpeg") {
-        JPGImage out(composite.width(), composite.height(), Color(0, 0, 0));
-        copyToRasterImage(composite, out);
-        return out.save(outPath);
+        return JPGImage::saveRows(outPath, pixelRows(composite), options.jpg);
     }
     if (ext == "gif") {
-        GIFImage out(composite.width(), composite.height(), Color(0, 0, 0));
-        copyToRasterImage(composite, out);
-        return out.save(outPath);
+        return GIFImage::saveRows(outPath, pixelRows(composite), options.gif);
     }
     if (ext == "webp") {
-        if (!WEBPImage::isToolingAvailable()) {
-            throw std::runtime_error("WebP tooling unavailable (install cwebp and dwebp)");
-        }
-        WEBPImage out(composite.width(), composite.height(), Color(0, 0, 0));
-        copyToRasterImage(composite, out);
-        return out.save(outPath);
+        return WEBPImage::saveRows(outPath, pixelRows(composite), options.webp);
     }
     if (ext == "svg") {
-        SVGImage out(composite.width(), composite.height(), Color(0, 0, 0));
-        copyBufferToImage(composite, out);
-        return out.save(outPath);
+        return SVGImage::saveRows(outPath, pixelRows(composite), options.svg);
     }
 
     throw std::runtime_error("Unsupported output extension: " + ext);
 }
 
-RasterImage* loadImageByExtension(const std::string& imagePath, BMPImage& bmp, PNGImage& png, JPGImage& jpg, GIFImage& gif, WEBPImage& webp) {
-    const std::string ext = extensionLower(imagePath);
-    if (ext == "bmp") {
-        bmp = BMPImage::load(imagePath);
-        return &bmp;
+ProfileSession::ProfileSession(const std::vector<std::string>& args) {
+    if (getFlagValue(args, "--profile", m_tracePath)) {
+        takeProfileEvents();
+        setProfilingEnabled(true);
     }
-    if (ext == "png") {
-        png = PNGImage::load(imagePath);
-        return &png;
+}
+
+ProfileSession::~ProfileSession() {
+    if (m_tracePath.empty()) {
+        return;
     }
-    if (ext == "jpg" || ext == "jpeg") {
-        jpg = JPGImage::load(imagePath);
-        return &jpg;
+    setProfilingEnabled(false);
+    const std::vector<ProfileEvent> events = takeProfileEvents();
+    writeProfileSummary(std::cerr, events);
+    const std::filesystem::path traceFsPath(m_tracePath);
+    std::error_code error;
+    if (traceFsPath.has_parent_path()) {
+        std::filesystem::create_directories(traceFsPath.parent_path(), error);
     }
-    if (ext == "gif") {
-        gif = GIFImage::load(imagePath);
-        return &gif;
+    std::ofstream trace(m_tracePath);
+    writeChromeTrace(trace, events);
+    if (!trace) {
+        std::cerr << "Failed writing profile trace: " << m_tracePath << "\n";
+        return;
     }
-    if (ext == "webp") {
-        if (!WEBPImage::isToolingAvailable()) {
-            throw std::runtime_error("WebP tooling unavailable (install cwebp and dwebp)");
+    std::cerr << "Wrote profile trace " << m_tracePath << " (" << events.size() << " spans)\n";
+}
+
+CompositeOptions parseCompositeOptions(const std::vector<std::string>& args) {
+    CompositeOptions options;
+    std::string threadsValue;
+    if (getFlagValue(args, "--threads", threadsValue)) {
+        options.threads = parseIntInRange(threadsValue, "threads", 0, 1024);
+    }
+    // --max-memory is an alias; errors name the flag that was typed.
+    std::string budgetValue;
+    for (const char* flag : {"--memory-budget", "--max-memory"}) {
+        if (getFlagValue(args, flag, budgetValue)) {
+            options.memoryBudget = static_cast<std::size_t>(parseIntInRange(budgetValue, flag + 2, 0, 1 << 24)) << 20;
+            break;
+        }
+    }
+    return options;
+}
+
+double parseRenderScale(const std::vector<std::string>& args, int width, int height) {
+    double scale = 1.0;
+    std::string value;
+    if (getFlagValue(args, "--scale", value)) {
+        scale = parseDoubleStrict(value, "scale");
+        if (!(scale > 0.0 && scale <= 1.0)) {
+            throw std::runtime_error("--scale must be in (0, 1]");
+        }
+    }
+    if (getFlagValue(args, "--max-size", value)) {
+        const std::size_t x = toLower(value).find('x');
+        if (x == std::string::npos) {
+            throw std::runtime_error("--max-size must be <width>x<height>");
+        }
+        const int maxWidth = parseIntInRange(value.substr(0, x), "max-size width", 1, std::numeric_limits<int>::max());
+        const int maxHeight = parseIntInRange(value.substr(x + 1), "max-size height", 1, std::numeric_limits<int>::max());
+        scale = std::min({scale, static_cast<double>(maxWidth) / width, static_cast<double>(maxHeight) / height});
+    }
+    return scale;
+}
+
+IFLOWSaveOptions parseIFLOWSaveOptions(const std::vector<std::string>& args) {
+    IFLOWSaveOptions options;
+    options.threads = parseCompositeOptions(args).threads;
+    options.incremental = std::find(args.begin(), args.end(), "--compact") == args.end();
+    std::string compression;
+    if (!getFlagValue(args, "--compression", compression)) {
+        return options;
+    }
+    compression = toLower(compression);
+    if (compression == "auto") {
+        options.compression = IFLOWCompression::Auto;
+    } else if (compression == "none") {
+        options.compression = IFLOWCompression::None;
+    } else if (compression == "rle") {
+        options.compression = IFLOWCompression::RLE;
+    } else if (compression == "lz4") {
+        options.compression = IFLOWCompression::LZ4;
+    } else if (compression == "deflate") {
+        options.compression = IFLOWCompression::Deflate;
+    } else {
+        throw std::runtime_error("Invalid --compression value; expected auto|none|rle|lz4|deflate");
+    }
+    return options;
+}
+
+ImageSaveOptions parseImageSaveOptions(const std::vector<std::string>& args) {
+    ImageSaveOptions options;
+    options.png.threads = parseCompositeOptions(args).threads;
+    options.jpg.threads = options.png.threads;
+    std::string levelValue;
+    if (getFlagValue(args, "--png-level", levelValue)) {
+        options.png.level = parseIntInRange(levelValue, "png-level", 0, 9);
+    }
+    std::string qualityValue;
+    if (getFlagValue(args, "--jpeg-quality", qualityValue)) {
+        options.jpg.quality = parseIntInRange(qualityValue, "jpeg-quality", 1, 100);
+    }
+    std::string subsamplingValue;
+    if (getFlagValue(args, "--jpeg-subsampling", subsamplingValue)) {
+        if (subsamplingValue == "444") {
+            options.jpg.subsampling = JPGSubsampling::Yuv444;
+        } else if (subsamplingValue == "422") {
+            options.jpg.subsampling = JPGSubsampling::Yuv422;
+        } else if (subsamplingValue == "420") {
+            options.jpg.subsampling = JPGSubsampling::Yuv420;
+        } else {
+            throw std::runtime_error("jpeg-subsampling must be 444, 422 or 420");
+        }
+    }
+    std::string ditherValue;
+    if (getFlagValue(args, "--gif-dither", ditherValue)) {
+        if (ditherValue == "none") {
+            options.gif.dither = GIFDither::None;
+        } else if (ditherValue == "ordered") {
+            options.gif.dither = GIFDither::Ordered;
+        } else if (ditherValue == "fs") {
+            options.gif.dither = GIFDither::FloydSteinberg;
+        } else {
+            throw std::runtime_error("gif-dither must be none, ordered or fs");
+        }
+    }
+    std::string webpQualityValue;
+    if (getFlagValue(args, "--webp-quality", webpQualityValue)) {
+        options.webp.quality = parseIntInRange(webpQualityValue, "webp-quality", 0, 100);
+    }
+    std::string svgModeValue;
+    if (getFlagValue(args, "--svg-mode", svgModeValue)) {
+        if (svgModeValue == "auto") {
+            options.svg.mode = SVGExportMode::Auto;
+        } else if (svgModeValue == "rects") {
+            options.svg.mode = SVGExportMode::Rects;
+        } else if (svgModeValue == "png") {
+            options.svg.mode = SVGExportMode::EmbedPNG;
+        } else {
+            throw std::runtime_error("svg-mode must be auto, rects or png");
+        }
+    }
+    options.svg.png = options.png;
+    return options;
+}
+
+RenderTarget parseRenderTarget(const std::string& spec, const ImageSaveOptions& defaults) {
+    // Only trailing ,scale= ,quality= and ,level= segments are options, so
+    // commas elsewhere stay part of the path.
+    std::vector<std::string> parts;
+    std::size_t end = spec.size();
+    while (end > 0) {
+        const std::size_t comma = spec.rfind(',', end - 1);
+        if (comma == std::string::npos) {
+            break;
+        }
+        const std::string part = spec.substr(comma + 1, end - comma - 1);
+        if (part.rfind("scale=", 0) != 0 && part.rfind("quality=", 0) != 0 && part.rfind("level=", 0) != 0) {
+            break;
+        }
+        parts.insert(parts.begin(), part);
+        end = comma;
+    }
+    RenderTarget target;
+    target.path = spec.substr(0, end);
+    target.options = defaults;
+    const std::string ext = extensionLower(target.path);
+    if (ext != "png" && ext != "bmp" && ext != "jpg" && ext != "jpeg" && ext != "gif" && ext != "webp" && ext != "svg") {
+        throw std::runtime_error("Unsupported output extension: " + ext);
+    }
+    for (const std::string& part : parts) {
+        const std::size_t eq = part.find('=');
+        const std::string key = part.substr(0, eq);
+        const std::string value = part.substr(eq + 1);
+        if (key == "scale") {
+            target.scale = parseDoubleStrict(value, "scale");
+            if (!(target.scale > 0.0 && target.scale <= 16.0)) {
+                throw std::runtime_error("scale must be in (0, 16]");
+            }
+        } else if (key == "quality") {
+            target.options.jpg.quality = parseIntInRange(value, "quality", ext == "webp" ? 0 : 1, 100);
+            target.options.webp.quality = target.options.jpg.quality;
+        } else if (key == "level") {
+            target.options.png.level = parseIntInRange(value, "level", 0, 9);
+            target.options.svg.png.level = target.options.png.level;
         }
-        webp = WEBPImage::load(imagePath);
-        return &webp;
     }
-    throw std::runtime_error("Unsupported image format for --from-image: " + imagePath);
+    return target;
 }
 
 void printGroupInfo(const LayerGroup& group, const std::string& indent) {
@@ -154,6 +312,8 @@ void printGroupInfo(const LayerGroup& group, const std::string& indent) {
                   << " opacity=" << layer.opacity()
                   << " blendMode=" << blendModeName(layer.blendMode())
                   << " offset=(" << layer.offsetX() << "," << layer.offsetY() << ")"
-                  << " mask=" << (layer.hasMask() ? "true" : "false") << "\n";
+                  << " mask=" << (layer.hasMask() ? "true" : "false");
+        const MemoryUsage memory = layerMemoryUsage(layer);
+        std::cout << " memory=" << formatBytes(memory.full) << " resident=" << formatBytes(memory.resident()) << "\n";
     }
 }
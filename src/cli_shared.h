@@ -6,14 +6,60 @@
 #include "jpg.h"
 #include "layer.h"
 #include "png.h"
+#include "svg.h"
 #include "webp.h"
 
 #include <string>
+#include <vector>
 
 std::string toLower(std::string value);
 std::string extensionLower(const std::string& path);
-bool saveCompositeByExtension(const ImageBuffer& composite, const std::string& outPath);
-RasterImage* loadImageByExtension(const std::string& imagePath, BMPImage& bmp, PNGImage& png, JPGImage& jpg, GIFImage& gif, WEBPImage& webp);
+// Encoder settings for composite outputs; the extension picks which apply.
+struct ImageSaveOptions {
+    PNGSaveOptions png;
+    JPGSaveOptions jpg;
+    GIFSaveOptions gif;
+    WEBPSaveOptions webp;
+    SVGSaveOptions svg;
+};
+
+// One render output: its path, a scale applied to the composite and
+// per-target encoder settings.
+struct RenderTarget {
+    std::string path;
+    double scale = 1.0;
+    ImageSaveOptions options;
+};
+
+bool saveCompositeByExtension(const ImageBuffer& composite,
+                              const std::string& outPath,
+                              const ImageSaveOptions& options = ImageSaveOptions());
+// Profiles the rest of a command when args hold --profile <trace.json>:
+// on destruction it prints the span summary to stderr and writes the
+// Chrome trace.
+class ProfileSession {
+public:
+    explicit ProfileSession(const std::vector<std::string>& args);
+    ~ProfileSession();
+
+    ProfileSession(const ProfileSession&) = delete;
+    ProfileSession& operator=(const ProfileSession&) = delete;
+
+private:
+    std::string m_tracePath;
+};
+
+CompositeOptions parseCompositeOptions(const std::vector<std::string>& args);
+// The composite scale --scale <f> and --max-size <W>x<H> ask of a width x
+// height document; the smaller wins, and 1 is full size.
+double parseRenderScale(const std::vector<std::string>& args, int width, int height);
+IFLOWSaveOptions parseIFLOWSaveOptions(const std::vector<std::string>& args);
+ImageSaveOptions parseImageSaveOptions(const std::vector<std::string>& args);
+// Parses "<path>[,scale=<f>][,quality=<n>][,level=<0-9>]". quality sets the
+// JPEG or WebP quality, level the PNG level (also for PNGs embedded in SVG).
+RenderTarget parseRenderTarget(const std::string& spec, const ImageSaveOptions& defaults);
+// "512B", "3.2KiB" or "18.0MiB".
+std::string formatBytes(std::size_t bytes);
 void printGroupInfo(const LayerGroup& group, const std::string& indent);
 
 #endif
@@ -0,0 +1,160 @@
+#include "codec.h"
+
+#include "bmp.h"
+#include "gif.h"
+#include "jpg.h"
+#include "mapped_file.h"
+#include "png.h"
+#include "profile.h"
+#include "webp.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <stdexcept>
+#include <utility>
+
+namespace {
+bool startsWith(const std::uint8_t* data, std::size_t size, const char* magic, std::size_t length) {
+    return size >= length && std::memcmp(data, magic, length) == 0;
+}
+
+std::deque<ImageCodec> builtInCodecs() {
+    std::deque<ImageCodec> codecs;
+    codecs.push_back({"BMP", {"bmp"},
+                      [](const std::uint8_t* data, std::size_t size) { return startsWith(data, size, "BM", 2); },
+                      [](const std::uint8_t* data, std::size_t size, const PixelTarget& target, const DecodeOptions&) {
+                          BMPImage::decode(data, size, target);
+                      }});
+    codecs.push_back({"PNG", {"png"},
+                      [](const std::uint8_t* data, std::size_t size) { return startsWith(data, size, "\x89PNG\r\n\x1a\n", 8); },
+                      [](const std::uint8_t* data, std::size_t size, const PixelTarget& target, const DecodeOptions&) {
+                          PNGImage::decode(data, size, target);
+                      }});
+    codecs.push_back({"JPEG", {"jpg", "jpeg"},
+                      [](const std::uint8_t* data, std::size_t size) { return startsWith(data, size, "\xFF\xD8\xFF", 3); },
+                      [](const std::uint8_t* data, std::size_t size, const PixelTarget& target, const DecodeOptions& options) {
+                          JPGLoadOptions jpgOptions;
+                          jpgOptions.threads = options.threads;
+                          // Region coordinates are in full-size pixels.
+                          if (options.regionWidth == 0) {
+                              jpgOptions.targetWidth = options.targetWidth;
+                              jpgOptions.targetHeight = options.targetHeight;
+                          }
+                          JPGImage::decode(data, size, target, jpgOptions);
+                      }});
+    codecs.push_back({"GIF", {"gif"},
+                      [](const std::uint8_t* data, std::size_t size) {
+                          return startsWith(data, size, "GIF87a", 6) || startsWith(data, size, "GIF89a", 6);
+                      },
+                      [](const std::uint8_t* data, std::size_t size, const PixelTarget& target, const DecodeOptions&) {
+                          GIFImage::decode(data, size, target);
+                      }});
+    codecs.push_back({"WebP", {"webp"},
+                      [](const std::uint8_t* data, std::size_t size) {
+                          return size >= 12 && std::memcmp(data, "RIFF", 4) == 0 && std::memcmp(data + 8, "WEBP", 4) == 0;
+                      },
+                      [](const std::uint8_t* data, std::size_t size, const PixelTarget& target, const DecodeOptions&) {
+                          WEBPImage::decode(data, size, target);
+                      }});
+    return codecs;
+}
+
+// Element references stay valid as codecs are appended.
+std::mutex& registryMutex() {
+    static std::mutex mutex;
+    return mutex;
+}
+
+std::deque<ImageCodec>& registry() {
+    static std::deque<ImageCodec> codecs = builtInCodecs();
+    return codecs;
+}
+
+std::string lowerExtension(const std::string& path) {
+    const std::size_t dot = path.find_last_of('.');
+    const std::size_t slash = path.find_last_of("/\\");
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+        return "";
+    }
+    std::string ext = path.substr(dot + 1);
+    std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+    return ext;
+}
+
+ImageBuffer cropBuffer(const ImageBuffer& source, int x, int y, int width, int height) {
+    if (x < 0 || y < 0 || width <= 0 || height <= 0 || x > source.width() - width || y > source.height() - height) {
+        throw std::runtime_error("Decode region lies outside the image");
+    }
+    ImageBuffer out(width, height);
+    for (int row = 0; row < height; ++row) {
+        const PixelRGBA8* src = source.row(y + row) + x;
+        std::copy(src, src + width, out.row(row));
+    }
+    return out;
+}
+
+} // namespace
+
+void registerImageCodec(ImageCodec codec) {
+    if (!codec.sniff || !codec.decode) {
+        throw std::invalid_argument("Image codecs need sniff and decode functions");
+    }
+    const std::lock_guard<std::mutex> lock(registryMutex());
+    registry().push_back(std::move(codec));
+}
+
+const ImageCodec* findImageCodec(const std::uint8_t* data, std::size_t size, const std::string& path) {
+    const std::lock_guard<std::mutex> lock(registryMutex());
+    const std::deque<ImageCodec>& codecs = registry();
+    for (auto it = codecs.rbegin(); it != codecs.rend(); ++it) {
+        if (it->sniff(data, size)) {
+            return &*it;
+        }
+    }
+    const std::string ext = lowerExtension(path);
+    for (auto it = codecs.rbegin(); it != codecs.rend(); ++it) {
+        if (std::find(it->extensions.begin(), it->extensions.end(), ext) != it->extensions.end()) {
+            return &*it;
+        }
+    }
+    return nullptr;
+}
+
+ImageBuffer decodeImage(const std::uint8_t* data, std::size_t size, const std::string& path, const DecodeOptions& options) {
+    if ((options.targetWidth > 0) != (options.targetHeight > 0) || options.targetWidth < 0 || options.targetHeight < 0) {
+        throw std::invalid_argument("Decode target needs both width and height");
+    }
+    const ImageCodec* codec = findImageCodec(data, size, path);
+    if (codec == nullptr) {
+        throw std::runtime_error("Unrecognized image format: " + path);
+    }
+
+    ProfileScope scope("decode", path);
+    ImageBuffer image;
+    codec->decode(data, size,
+                  {4, [&image](int width, int height) {
+                       image = ImageBuffer(width, height);
+                       return reinterpret_cast<std::uint8_t*>(image.data());
+                   }},
+                  options);
+    if (options.regionWidth > 0 || options.regionHeight > 0) {
+        image = cropBuffer(image, options.regionX, options.regionY, options.regionWidth, options.regionHeight);
+    }
+    if (options.targetWidth > 0 && (image.width() != options.targetWidth || image.height() != options.targetHeight)) {
+        image = resampleBuffer(image, options.targetWidth, options.targetHeight, options.threads, options.filter);
+    }
+    scope.addPixels(static_cast<std::uint64_t>(image.width()) * static_cast<std::uint64_t>(image.height()));
+    return image;
+}
+
+ImageBuffer decodeImageFile(const std::string& path, const DecodeOptions& options) {
+    const MappedFile file(path);
+    return decodeImage(file.data(), file.size(), path, options);
+}
+
+std::future<ImageBuffer> decodeImageFileAsync(const std::string& path, const DecodeOptions& options) {
+    return std::async(std::launch::async, [path, options]() { return decodeImageFile(path, options); });
+}
@@ -0,0 +1,51 @@
+#ifndef CODEC_H
+#define CODEC_H
+
+#include "layer.h"
+#include "resample.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <string>
+#include <vector>
+
+// A region, in source pixels, is cropped first; an empty one keeps the whole
+// image. A target size then scales to exactly that size with filter: without
+// a region, JPEGs first decode at the smallest DCT scale that still covers
+// it. Worker threads apply to decoders and scaling; 0 uses all cores.
+struct DecodeOptions {
+    int targetWidth = 0;
+    int targetHeight = 0;
+    ResampleFilter filter = ResampleFilter::Bilinear;
+    int regionX = 0;
+    int regionY = 0;
+    int regionWidth = 0;
+    int regionHeight = 0;
+    int threads = 0;
+};
+
+// A raster format: the extensions it answers to, a test for its leading
+// bytes, and a decoder writing into a PixelTarget.
+struct ImageCodec {
+    std::string name;
+    std::vector<std::string> extensions;
+    std::function<bool(const std::uint8_t* data, std::size_t size)> sniff;
+    std::function<void(const std::uint8_t* data, std::size_t size, const PixelTarget& target, const DecodeOptions& options)> decode;
+};
+
+// Codecs registered later are tried first, so they can replace built-ins.
+void registerImageCodec(ImageCodec codec);
+// The codec whose magic bytes match data, else the one claiming path's
+// extension; null when neither does.
+const ImageCodec* findImageCodec(const std::uint8_t* data, std::size_t size, const std::string& path);
+
+// Decodes straight into an RGBA buffer; formats without alpha are opaque.
+// path only names the source in errors and breaks ties on extension.
+ImageBuffer decodeImage(const std::uint8_t* data, std::size_t size, const std::string& path, const DecodeOptions& options = DecodeOptions());
+ImageBuffer decodeImageFile(const std::string& path, const DecodeOptions& options = DecodeOptions());
+// Reads and decodes on a thread of its own; errors are rethrown by get().
+std::future<ImageBuffer> decodeImageFileAsync(const std::string& path, const DecodeOptions& options = DecodeOptions());
+
+#endif
@@ -0,0 +1,242 @@
+#include "color_lut.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iterator>
+#include <sstream>
+#include <stdexcept>
+#include <utility>
+
+namespace {
+constexpr int kFractionBits = 12;
+constexpr std::int32_t kFractionOne = 1 << kFractionBits;
+
+float parseCubeFloat(const std::string& token, const std::string& path) {
+    char* end = nullptr;
+    const float value = std::strtof(token.c_str(), &end);
+    if (token.empty() || end != token.c_str() + token.size() || !std::isfinite(value)) {
+        throw std::runtime_error("Invalid number '" + token + "' in LUT: " + path);
+    }
+    return value;
+}
+
+// Reads the three numbers of an entry line; false if it holds anything else.
+bool parseCubeEntry(const char* line, const char* end, float* rgb) {
+    for (int c = 0; c < 3; ++c) {
+        char* next = nullptr;
+        rgb[c] = std::strtof(line, &next);
+        if (next == line || next > end || !std::isfinite(rgb[c])) {
+            return false;
+        }
+        line = next;
+    }
+    while (line < end && std::isspace(static_cast<unsigned char>(*line))) {
+        ++line;
+    }
+    return line == end;
+}
+} // namespace
+
+ColorLUT::ColorLUT() : ColorLUT(2, {0, 0, 0, 1, 0, 0, 0, 1, 0, 1, 1, 0, 0, 0, 1, 1, 0, 1, 0, 1, 1, 1, 1, 1}) {}
+
+ColorLUT::ColorLUT(int size, std::vector<float> values, const std::array<float, 3>& domainMin, const std::array<float, 3>& domainMax)
+    : m_size(size), m_values(std::move(values)), m_domainMin(domainMin), m_domainMax(domainMax) {
+    if (size < 2 || size > 256) {
+        throw std::invalid_argument("LUT size must be in [2, 256]");
+    }
+    const std::size_t points = static_cast<std::size_t>(size) * static_cast<std::size_t>(size) * static_cast<std::size_t>(size);
+    if (m_values.size() != points * 3) {
+        throw std::invalid_argument("LUT needs size^3 rgb values");
+    }
+    m_fixed.resize(m_values.size());
+    for (std::size_t i = 0; i < m_values.size(); ++i) {
+        m_fixed[i] = static_cast<std::int32_t>(std::clamp(m_values[i], 0.0f, 1.0f) * (255.0f * 256.0f) + 0.5f);
+    }
+    // Cells are offset by 1 along red, size along green and size^2 along
+    // blue; the last lattice point only appears as a cell's far corner.
+    const std::int32_t strides[3] = {1, size, size * size};
+    for (int c = 0; c < 3; ++c) {
+        const float span = m_domainMax[c] - m_domainMin[c];
+        if (!(span > 0.0f)) {
+            throw std::invalid_argument("LUT domain max must exceed its min");
+        }
+        for (int v = 0; v < 256; ++v) {
+            const float unit = std::clamp((static_cast<float>(v) / 255.0f - m_domainMin[c]) / span, 0.0f, 1.0f);
+            const float position = unit * static_cast<float>(size - 1);
+            const int cell = std::min(static_cast<int>(position), size - 2);
+            m_offset[c][v] = cell * strides[c] * 3;
+            m_fraction[c][v] = static_cast<std::int32_t>((position - static_cast<float>(cell)) * kFractionOne + 0.5f);
+        }
+    }
+}
+
+void ColorLUT::apply(PixelRGBA8* pixels, std::size_t count) const {
+    // The cell splits into six tetrahedra along its diagonal. Comparing the
+    // fractions (r > g, g > b, r > b) picks the one holding the color; it
+    // runs from the near corner along the axes in decreasing fraction order.
+    // Codes 1 and 6 are contradictory.
+    static constexpr int kOrder[8][3] = {{2, 1, 0}, {0, 1, 2}, {1, 2, 0}, {1, 0, 2}, {2, 0, 1}, {0, 2, 1}, {0, 1, 2}, {0, 1, 2}};
+    const std::int32_t* lattice = m_fixed.data();
+    const std::int32_t steps[3] = {3, m_size * 3, m_size * m_size * 3};
+    // 8.8 values times 12-bit weights: the byte is bits 20 and up.
+    constexpr int kShift = kFractionBits + 8;
+    constexpr std::int32_t kHalf = 1 << (kShift - 1);
+    for (std::size_t i = 0; i < count; ++i) {
+        PixelRGBA8& p = pixels[i];
+        const std::int32_t f[3] = {m_fraction[0][p.r], m_fraction[1][p.g], m_fraction[2][p.b]};
+        const int* order = kOrder[(f[0] > f[1]) << 2 | (f[1] > f[2]) << 1 | (f[0] > f[2])];
+        const std::int32_t w0 = kFractionOne - f[order[0]];
+        const std::int32_t w1 = f[order[0]] - f[order[1]];
+        const std::int32_t w2 = f[order[1]] - f[order[2]];
+        const std::int32_t w3 = f[order[2]];
+        const std::int32_t* c0 = lattice + m_offset[0][p.r] + m_offset[1][p.g] + m_offset[2][p.b];
+        const std::int32_t* c1 = c0 + steps[order[0]];
+        const std::int32_t* c2 = c1 + steps[order[1]];
+        const std::int32_t* c3 = c0 + steps[0] + steps[1] + steps[2];
+        const std::int32_t r = c0[0] * w0 + c1[0] * w1 + c2[0] * w2 + c3[0] * w3;
+        const std::int32_t g = c0[1] * w0 + c1[1] * w1 + c2[1] * w2 + c3[1] * w3;
+        const std::int32_t b = c0[2] * w0 + c1[2] * w1 + c2[2] * w2 + c3[2] * w3;
+        p = PixelRGBA8(static_cast<std::uint8_t>((r + kHalf) >> kShift), static_cast<std::uint8_t>((g + kHalf) >> kShift),
+                       static_cast<std::uint8_t>((b + kHalf) >> kShift), p.a);
+    }
+}
+
+ColorLUT loadCubeLUT(const std::string& path) {
+    std::ifstream in(path);
+    if (!in) {
+        throw std::runtime_error("Cannot open LUT: " + path);
+    }
+    int size = 0;
+    std::array<float, 3> domainMin = {0.0f, 0.0f, 0.0f};
+    std::array<float, 3> domainMax = {1.0f, 1.0f, 1.0f};
+    std::vector<float> values;
+    const std::string text((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    std::size_t start = 0;
+    while (start < text.size()) {
+        std::size_t stop = text.find('\n', start);
+        if (stop == std::string::npos) {
+            stop = text.size();
+        }
+        const std::size_t contentEnd = static_cast<std::size_t>(
+            std::find(text.begin() + static_cast<std::ptrdiff_t>(start), text.begin() + static_cast<std::ptrdiff_t>(stop), '#') -
+            text.begin());
+        std::size_t first = start;
+        while (first < contentEnd && std::isspace(static_cast<unsigned char>(text[first]))) {
+            ++first;
+        }
+        const std::size_t lineStart = start;
+        start = stop + 1;
+        if (first == contentEnd) {
+            continue;
+        }
+        // Entries are the bulk of a file; only keyword lines get tokenized.
+        if (!std::isalpha(static_cast<unsigned char>(text[first]))) {
+            float rgb[3];
+            if (!parseCubeEntry(text.c_str() + first, text.c_str() + contentEnd, rgb)) {
+                throw std::runtime_error("LUT entries need three numbers: " + path);
+            }
+            values.insert(values.end(), rgb, rgb + 3);
+            continue;
+        }
+        std::istringstream fields(text.substr(lineStart, contentEnd - lineStart));
+        std::string keyword;
+        fields >> keyword;
+        if (keyword == "TITLE") {
+            continue;
+        }
+        if (keyword == "LUT_1D_SIZE") {
+            throw std::runtime_error("1D LUTs are not supported: " + path);
+        }
+        std::vector<std::string> tokens;
+        std::string token;
+        while (fields >> token) {
+            tokens.push_back(token);
+        }
+        if (keyword == "LUT_3D_SIZE") {
+            if (tokens.size() != 1) {
+                throw std::runtime_error("LUT_3D_SIZE needs one value: " + path);
+            }
+            const float value = parseCubeFloat(tokens[0], path);
+            if (value != std::floor(value) || value < 2.0f || value > 256.0f) {
+                throw std::runtime_error("LUT_3D_SIZE must be an integer in [2, 256]: " + path);
+            }
+            size = static_cast<int>(value);
+            values.reserve(static_cast<std::size_t>(size) * static_cast<std::size_t>(size) * static_cast<std::size_t>(size) * 3);
+        } else if (keyword == "DOMAIN_MIN" || keyword == "DOMAIN_MAX") {
+            if (tokens.size() != 3) {
+                throw std::runtime_error(keyword + " needs three values: " + path);
+            }
+            std::array<float, 3>& domain = keyword == "DOMAIN_MIN" ? domainMin : domainMax;
+            for (std::size_t c = 0; c < 3; ++c) {
+                domain[c] = parseCubeFloat(tokens[c], path);
+            }
+        }
+        // Vendor keywords (LUT_IN_VIDEO_RANGE and the like) are skipped.
+    }
+    if (size == 0) {
+        throw std::runtime_error("LUT has no LUT_3D_SIZE: " + path);
+    }
+    if (values.size() != static_cast<std::size_t>(size) * static_cast<std::size_t>(size) * static_cast<std::size_t>(size) * 3) {
+        throw std::runtime_error("LUT entry count does not match LUT_3D_SIZE: " + path);
+    }
+    for (std::size_t c = 0; c < 3; ++c) {
+        if (!(domainMax[c] > domainMin[c])) {
+            throw std::runtime_error("LUT DOMAIN_MAX must exceed DOMAIN_MIN: " + path);
+        }
+    }
+    return ColorLUT(size, std::move(values), domainMin, domainMax);
+}
+
+bool saveCubeLUT(const std::string& path, const ColorLUT& lut, const std::string& title) {
+    std::ofstream out(path);
+    if (!out) {
+        return false;
+    }
+    if (!title.empty()) {
+        out << "TITLE \"" << title << "\"\n";
+    }
+    out << "LUT_3D_SIZE " << lut.size() << "\n";
+    const std::array<float, 3>& lo = lut.domainMin();
+    const std::array<float, 3>& hi = lut.domainMax();
+    if (lo != std::array<float, 3>{0.0f, 0.0f, 0.0f} || hi != std::array<float, 3>{1.0f, 1.0f, 1.0f}) {
+        out << "DOMAIN_MIN " << lo[0] << ' ' << lo[1] << ' ' << lo[2] << "\n";
+        out << "DOMAIN_MAX " << hi[0] << ' ' << hi[1] << ' ' << hi[2] << "\n";
+    }
+    out << std::fixed << std::setprecision(6);
+    const std::vector<float>& values = lut.values();
+    for (std::size_t i = 0; i < values.size(); i += 3) {
+        out << values[i] << ' ' << values[i + 1] << ' ' << values[i + 2] << "\n";
+    }
+    return static_cast<bool>(out);
+}
+
+ColorLUT bakeColorLUT(int size, const std::function<void(PixelRGBA8*, std::size_t)>& transform) {
+    if (size < 2 || size > 256) {
+        throw std::invalid_argument("LUT size must be in [2, 256]");
+    }
+    const auto level = [size](int i) {
+        return static_cast<std::uint8_t>((i * 255 + (size - 1) / 2) / (size - 1));
+    };
+    std::vector<PixelRGBA8> lattice;
+    lattice.reserve(static_cast<std::size_t>(size) * static_cast<std::size_t>(size) * static_cast<std::size_t>(size));
+    for (int b = 0; b < size; ++b) {
+        for (int g = 0; g < size; ++g) {
+            for (int r = 0; r < size; ++r) {
+                lattice.emplace_back(level(r), level(g), level(b), 255);
+            }
+        }
+    }
+    transform(lattice.data(), lattice.size());
+    std::vector<float> values;
+    values.reserve(lattice.size() * 3);
+    for (const PixelRGBA8& p : lattice) {
+        values.push_back(static_cast<float>(p.r) / 255.0f);
+        values.push_back(static_cast<float>(p.g) / 255.0f);
+        values.push_back(static_cast<float>(p.b) / 255.0f);
+    }
+    return ColorLUT(size, std::move(values));
+}
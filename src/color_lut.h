@@ -0,0 +1,55 @@
+#ifndef COLOR_LUT_H
+#define COLOR_LUT_H
+
+#include "layer.h"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+// 3D lookup table over RGB, as exchanged by grading tools in .cube files.
+// Lattice points run red fastest, then green, then blue; values are 0..1.
+class ColorLUT {
+public:
+    ColorLUT();
+    // size is the lattice points per axis (2..256); values holds size^3 rgb
+    // triples. Inputs are mapped from [domainMin, domainMax] per channel.
+    ColorLUT(int size,
+             std::vector<float> values,
+             const std::array<float, 3>& domainMin = {0.0f, 0.0f, 0.0f},
+             const std::array<float, 3>& domainMax = {1.0f, 1.0f, 1.0f});
+
+    int size() const { return m_size; }
+    const std::vector<float>& values() const { return m_values; }
+    const std::array<float, 3>& domainMin() const { return m_domainMin; }
+    const std::array<float, 3>& domainMax() const { return m_domainMax; }
+
+    // Maps the rgb of count pixels by tetrahedral interpolation between the
+    // four lattice points around each color; alpha is kept.
+    void apply(PixelRGBA8* pixels, std::size_t count) const;
+
+private:
+    int m_size;
+    std::vector<float> m_values;
+    std::array<float, 3> m_domainMin;
+    std::array<float, 3> m_domainMax;
+    // Lattice values in 8.8 fixed point, and per channel the lattice cell
+    // and 12-bit position within it of each input byte.
+    std::vector<std::int32_t> m_fixed;
+    std::array<std::array<std::int32_t, 256>, 3> m_offset;
+    std::array<std::array<std::int32_t, 256>, 3> m_fraction;
+};
+
+// Parses a 3D .cube file (TITLE, LUT_3D_SIZE, DOMAIN_MIN, DOMAIN_MAX).
+// Throws std::runtime_error on 1D tables or malformed files.
+ColorLUT loadCubeLUT(const std::string& path);
+bool saveCubeLUT(const std::string& path, const ColorLUT& lut, const std::string& title = "");
+
+// Samples transform at every lattice point. It maps byte pixels in place,
+// so lattice colors are rounded to the nearest byte first.
+ColorLUT bakeColorLUT(int size, const std::function<void(PixelRGBA8*, std::size_t)>& transform);
+
+#endif
@@ -0,0 +1,1284 @@
+#include "compress.h"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <stdexcept>
+
+namespace {
+constexpr std::size_t kLZ4MinMatch = 4;
+constexpr std::size_t kLZ4LastLiterals = 5;
+constexpr std::size_t kLZ4MatchSafety = 12;
+constexpr std::size_t kLZ4MaxOffset = 65535;
+constexpr int kHashBits = 15;
+
+constexpr std::size_t kDeflateWindow = 32768;
+constexpr std::size_t kDeflateMinMatch = 3;
+constexpr std::size_t kDeflateMaxMatch = 258;
+constexpr std::size_t kDeflateBlockTokens = 16384;
+constexpr std::size_t kStoredBlockMax = 65535;
+// Chunks are encoded on every save, so they favour speed over the last few percent.
+constexpr int kChunkDeflateLevel = 4;
+
+constexpr std::array<std::uint16_t, 29> kLengthBase = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+constexpr std::array<std::uint8_t, 29> kLengthExtra = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+constexpr std::array<std::uint16_t, 30> kDistanceBase = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769,
+    1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+constexpr std::array<std::uint8_t, 30> kDistanceExtra = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+constexpr std::array<std::uint8_t, 19> kCodeLengthOrder = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+std::uint32_t read32(const std::uint8_t* p) {
+    std::uint32_t value = 0;
+    std::memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+std::uint16_t read16(const std::uint8_t* p) {
+    std::uint16_t value = 0;
+    std::memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+std::uint32_t hash4(const std::uint8_t* p) {
+    return (read32(p) * 2654435761u) >> (32 - kHashBits);
+}
+
+std::size_t matchLength(const std::uint8_t* a, const std::uint8_t* b, std::size_t limit) {
+    std::size_t n = 0;
+    while (n + 8 <= limit) {
+        std::uint64_t x = 0;
+        std::uint64_t y = 0;
+        std::memcpy(&x, a + n, sizeof(x));
+        std::memcpy(&y, b + n, sizeof(y));
+        if (x != y) {
+            break;
+        }
+        n += 8;
+    }
+    while (n < limit && a[n] == b[n]) {
+        ++n;
+    }
+    return n;
+}
+
+void writeLZ4Length(std::vector<std::uint8_t>& out, std::size_t length) {
+    while (length >= 255) {
+        out.push_back(255);
+        length -= 255;
+    }
+    out.push_back(static_cast<std::uint8_t>(length));
+}
+
+void writeLZ4Sequence(std::vector<std::uint8_t>& out,
+                      const std::uint8_t* literals,
+                      std::size_t literalCount,
+                      std::size_t offset,
+                      std::size_t matchCount) {
+    const std::size_t matchCode = matchCount >= kLZ4MinMatch ? matchCount - kLZ4MinMatch : 0;
+    const std::uint8_t token = static_cast<std::uint8_t>((std::min<std::size_t>(literalCount, 15) << 4) |
+                                                         (matchCount > 0 ? std::min<std::size_t>(matchCode, 15) : 0));
+    out.push_back(token);
+    if (literalCount >= 15) {
+        writeLZ4Length(out, literalCount - 15);
+    }
+    out.insert(out.end(), literals, literals + literalCount);
+    if (matchCount == 0) {
+        return;
+    }
+    out.push_back(static_cast<std::uint8_t>(offset & 0xFF));
+    out.push_back(static_cast<std::uint8_t>((offset >> 8) & 0xFF));
+    if (matchCode >= 15) {
+        writeLZ4Length(out, matchCode - 15);
+    }
+}
+
+std::size_t readLZ4Length(const std::uint8_t* data, std::size_t size, std::size_t& pos) {
+    std::size_t length = 0;
+    std::uint8_t byte = 255;
+    while (byte == 255) {
+        if (pos >= size) {
+            throw std::runtime_error("Truncated LZ4 length");
+        }
+        byte = data[pos++];
+        length += byte;
+    }
+    return length;
+}
+
+class BitWriter {
+public:
+    explicit BitWriter(std::vector<std::uint8_t>& out) : m_out(out), m_bits(0), m_count(0) {}
+
+    void put(std::uint32_t value, int count) {
+        m_bits |= static_cast<std::uint64_t>(value) << m_count;
+        m_count += count;
+        while (m_count >= 8) {
+            m_out.push_back(static_cast<std::uint8_t>(m_bits & 0xFF));
+            m_bits >>= 8;
+            m_count -= 8;
+        }
+    }
+
+    // Little-endian 16-bit value; the writer must be byte aligned.
+    void putBytes(std::uint16_t value) {
+        m_out.push_back(static_cast<std::uint8_t>(value & 0xFF));
+        m_out.push_back(static_cast<std::uint8_t>(value >> 8));
+    }
+
+    void putRaw(const std::uint8_t* data, std::size_t size) {
+        m_out.insert(m_out.end(), data, data + size);
+    }
+
+    void flush() {
+        if (m_count > 0) {
+            m_out.push_back(static_cast<std::uint8_t>(m_bits & 0xFF));
+        }
+        m_bits = 0;
+        m_count = 0;
+    }
+
+private:
+    std::vector<std::uint8_t>& m_out;
+    std::uint64_t m_bits;
+    int m_count;
+};
+
+// Search effort per level, after zlib's configuration table. Lazy levels
+// skip the second search once a match reaches maxLazy and search a quarter
+// of the chain once it reaches goodLength.
+struct DeflateLevel {
+    std::size_t goodLength;
+    std::size_t maxLazy;
+    std::size_t niceLength;
+    int maxChain;
+    bool lazy;
+};
+
+constexpr std::array<DeflateLevel, 10> kDeflateLevels = {{{0, 0, 0, 0, false},
+                                                          {4, 4, 8, 4, false},
+                                                          {4, 5, 16, 8, false},
+                                                          {4, 6, 32, 32, false},
+                                                          {4, 4, 16, 16, true},
+                                                          {8, 16, 32, 32, true},
+                                                          {8, 16, 128, 128, true},
+                                                          {8, 32, 128, 256, true},
+                                                          {32, 128, 258, 1024, true},
+                                                          {32, 258, 258, 4096, true}}};
+
+// A literal byte (distance 0) or a back reference.
+struct LZToken {
+    std::uint16_t value;
+    std::uint16_t distance;
+};
+
+int lengthSymbol(std::size_t length) {
+    static const std::array<std::uint8_t, 259> table = [] {
+        std::array<std::uint8_t, 259> codes{};
+        for (int code = 0; code < 29; ++code) {
+            const std::size_t end = code == 28 ? 259 : kLengthBase[static_cast<std::size_t>(code + 1)];
+            for (std::size_t length = kLengthBase[static_cast<std::size_t>(code)]; length < end; ++length) {
+                codes[length] = static_cast<std::uint8_t>(code);
+            }
+        }
+        codes[258] = 28;
+        return codes;
+    }();
+    return table[length];
+}
+
+// Distances up to 256 index the table directly; longer ones by their high bits.
+int distanceSymbol(std::size_t distance) {
+    static const std::array<std::uint8_t, 512> table = [] {
+        std::array<std::uint8_t, 512> codes{};
+        for (int code = 0; code < 30; ++code) {
+            const std::size_t first = kDistanceBase[static_cast<std::size_t>(code)];
+            const std::size_t end = first + (static_cast<std::size_t>(1) << kDistanceExtra[static_cast<std::size_t>(code)]);
+            for (std::size_t d = first; d < end; ++d) {
+                if (d <= 256) {
+                    codes[d - 1] = static_cast<std::uint8_t>(code);
+                } else {
+                    codes[256 + ((d - 1) >> 7)] = static_cast<std::uint8_t>(code);
+                }
+            }
+        }
+        return codes;
+    }();
+    return distance <= 256 ? table[distance - 1] : table[256 + ((distance - 1) >> 7)];
+}
+
+// LZ77 over base[start, end) with hash chains; base[0, start) is history that
+// matches may reach back into.
+std::vector<LZToken> lz77Parse(const std::uint8_t* base, std::size_t start, std::size_t end, const DeflateLevel& level) {
+    std::vector<LZToken> tokens;
+    tokens.reserve((end - start) / 3 + 16);
+    // Positions are stored plus one so that zero ends a chain.
+    std::vector<std::uint32_t> head(static_cast<std::size_t>(1) << kHashBits, 0);
+    std::vector<std::uint32_t> chain(kDeflateWindow, 0);
+    const auto hash3 = [base](std::size_t p) {
+        const std::uint32_t v = static_cast<std::uint32_t>(base[p]) | (static_cast<std::uint32_t>(base[p + 1]) << 8) |
+                                (static_cast<std::uint32_t>(base[p + 2]) << 16);
+        return (v * 2654435761u) >> (32 - kHashBits);
+    };
+    const auto insert = [&](std::size_t p) {
+        if (p + kDeflateMinMatch <= end) {
+            const std::uint32_t h = hash3(p);
+            chain[p % kDeflateWindow] = head[h];
+            head[h] = static_cast<std::uint32_t>(p + 1);
+        }
+    };
+    // Only matches longer than previousLength are reported; the byte pair
+    // ending such a match is compared first, as zlib does.
+    const auto findMatch = [&](std::size_t pos, std::size_t previousLength, std::size_t& bestDistance, int maxChain) {
+        if (pos + kDeflateMinMatch > end) {
+            return static_cast<std::size_t>(0);
+        }
+        const std::size_t limit = std::min(kDeflateMaxMatch, end - pos);
+        const std::size_t floor = pos > kDeflateWindow ? pos - kDeflateWindow : 0;
+        const std::uint8_t* scan = base + pos;
+        std::size_t bestLength = std::max(previousLength, kDeflateMinMatch - 1);
+        if (bestLength >= limit) {
+            return static_cast<std::size_t>(0);
+        }
+        const std::size_t initialLength = bestLength;
+        const std::uint16_t scanStart = read16(scan);
+        std::uint16_t scanEnd = read16(scan + bestLength - 1);
+        std::uint32_t candidate = head[hash3(pos)];
+        for (int steps = 0; candidate > floor && steps < maxChain; ++steps) {
+            const std::uint8_t* match = base + (candidate - 1);
+            if (read16(match + bestLength - 1) == scanEnd && read16(match) == scanStart) {
+                const std::size_t length = matchLength(match, scan, limit);
+                if (length > bestLength) {
+                    bestLength = length;
+                    bestDistance = pos - (candidate - 1);
+                    if (length >= level.niceLength || length == limit) {
+                        break;
+                    }
+                    scanEnd = read16(scan + bestLength - 1);
+                }
+            }
+            candidate = chain[(candidate - 1) % kDeflateWindow];
+        }
+        return bestLength > initialLength ? bestLength : 0;
+    };
+    const auto putMatch = [&](std::size_t length, std::size_t distance) {
+        tokens.push_back(LZToken{static_cast<std::uint16_t>(length), static_cast<std::uint16_t>(distance)});
+    };
+    const auto putLiteral = [&](std::size_t p) {
+        tokens.push_back(LZToken{base[p], 0});
+    };
+
+    for (std::size_t p = start > kDeflateWindow ? start - kDeflateWindow : 0; p < start; ++p) {
+        insert(p);
+    }
+
+    // With lazy matching a match is only taken if the next position does not
+    // start a longer one.
+    std::size_t pos = start;
+    bool pending = false;
+    std::size_t pendingLength = 0;
+    std::size_t pendingDistance = 0;
+    while (pos < end) {
+        std::size_t distance = 0;
+        std::size_t length = 0;
+        if (!pending) {
+            length = findMatch(pos, 0, distance, level.maxChain);
+        } else if (pendingLength < level.maxLazy) {
+            length = findMatch(pos, pendingLength, distance,
+                               pendingLength >= level.goodLength ? level.maxChain / 4 : level.maxChain);
+        }
+        insert(pos);
+        if (pending) {
+            if (pendingLength > 0 && length <= pendingLength) {
+                putMatch(pendingLength, pendingDistance);
+                const std::size_t matchEnd = pos - 1 + pendingLength;
+                for (++pos; pos < matchEnd; ++pos) {
+                    insert(pos);
+                }
+                pending = false;
+                continue;
+            }
+            putLiteral(pos - 1);
+            pending = false;
+        }
+        if (!level.lazy) {
+            if (length > 0) {
+                putMatch(length, distance);
+                const std::size_t matchEnd = pos + length;
+                for (++pos; pos < matchEnd; ++pos) {
+                    insert(pos);
+                }
+            } else {
+                putLiteral(pos++);
+            }
+            continue;
+        }
+        pending = true;
+        pendingLength = length;
+        pendingDistance = distance;
+        ++pos;
+    }
+    if (pending) {
+        if (pendingLength > 0) {
+            putMatch(pendingLength, pendingDistance);
+        } else {
+            putLiteral(pos - 1);
+        }
+    }
+    return tokens;
+}
+
+} // namespace
+
+// Code lengths limited to maxLength bits, by building a Huffman tree and then
+// rebalancing overlong leaves, so the code stays complete.
+std::vector<std::uint8_t> huffmanLengths(std::vector<std::uint32_t> freqs, int maxLength) {
+    std::vector<int> used;
+    for (std::size_t i = 0; i < freqs.size(); ++i) {
+        if (freqs[i] > 0) {
+            used.push_back(static_cast<int>(i));
+        }
+    }
+    // A complete code needs two symbols; inflaters reject lone codes.
+    for (int extra = 0; used.size() < 2; ++extra) {
+        if (freqs[static_cast<std::size_t>(extra)] == 0) {
+            freqs[static_cast<std::size_t>(extra)] = 1;
+            used.push_back(extra);
+        }
+    }
+    std::sort(used.begin(), used.end(), [&freqs](int a, int b) {
+        return freqs[static_cast<std::size_t>(a)] < freqs[static_cast<std::size_t>(b)] ||
+               (freqs[static_cast<std::size_t>(a)] == freqs[static_cast<std::size_t>(b)] && a < b);
+    });
+
+    // Two-queue Huffman construction over leaves sorted by frequency.
+    const std::size_t leaves = used.size();
+    std::vector<std::uint64_t> weight(2 * leaves);
+    std::vector<std::size_t> parent(2 * leaves, 0);
+    for (std::size_t i = 0; i < leaves; ++i) {
+        weight[i] = freqs[static_cast<std::size_t>(used[i])];
+    }
+    std::size_t nextLeaf = 0;
+    std::size_t nextNode = leaves;
+    std::size_t nodes = leaves;
+    const auto take = [&]() {
+        if (nextLeaf < leaves && (nextNode >= nodes || weight[nextLeaf] <= weight[nextNode])) {
+            return nextLeaf++;
+        }
+        return nextNode++;
+    };
+    while (nodes < 2 * leaves - 1) {
+        const std::size_t a = take();
+        const std::size_t b = take();
+        weight[nodes] = weight[a] + weight[b];
+        parent[a] = nodes;
+        parent[b] = nodes;
+        ++nodes;
+    }
+    std::vector<int> depth(nodes, 0);
+    for (std::size_t i = nodes - 1; i-- > 0;) {
+        depth[i] = depth[parent[i]] + 1;
+    }
+
+    std::vector<int> counts(static_cast<std::size_t>(maxLength) + 1, 0);
+    for (std::size_t i = 0; i < leaves; ++i) {
+        ++counts[static_cast<std::size_t>(std::min(depth[i], maxLength))];
+    }
+    // Clamping overlong leaves over-subscribes the code; move leaves down from
+    // shorter lengths, one unit of the Kraft sum at a time, until it is exact.
+    std::uint32_t total = 0;
+    for (int length = 1; length <= maxLength; ++length) {
+        total += static_cast<std::uint32_t>(counts[static_cast<std::size_t>(length)]) << (maxLength - length);
+    }
+    while (total > (1u << maxLength)) {
+        --counts[static_cast<std::size_t>(maxLength)];
+        for (int bits = maxLength - 1; bits > 0; --bits) {
+            if (counts[static_cast<std::size_t>(bits)] > 0) {
+                --counts[static_cast<std::size_t>(bits)];
+                counts[static_cast<std::size_t>(bits + 1)] += 2;
+                break;
+            }
+        }
+        --total;
+    }
+
+    // Least frequent symbols take the longest codes.
+    std::vector<std::uint8_t> lengths(freqs.size(), 0);
+    std::size_t next = 0;
+    for (int length = maxLength; length > 0; --length) {
+        for (int i = 0; i < counts[static_cast<std::size_t>(length)]; ++i) {
+            lengths[static_cast<std::size_t>(used[next++])] = static_cast<std::uint8_t>(length);
+        }
+    }
+    return lengths;
+}
+
+// Canonical codes, bit-reversed for the LSB-first writer.
+std::vector<std::uint16_t> canonicalCodes(const std::vector<std::uint8_t>& lengths) {
+    std::array<std::uint16_t, 16> counts{};
+    for (std::uint8_t length : lengths) {
+        ++counts[length];
+    }
+    counts[0] = 0;
+    std::array<std::uint16_t, 16> next{};
+    std::uint16_t code = 0;
+    for (int length = 1; length < 16; ++length) {
+        code = static_cast<std::uint16_t>((code + counts[static_cast<std::size_t>(length - 1)]) << 1);
+        next[static_cast<std::size_t>(length)] = code;
+    }
+    std::vector<std::uint16_t> codes(lengths.size(), 0);
+    for (std::size_t i = 0; i < lengths.size(); ++i) {
+        const int length = lengths[i];
+        if (length == 0) {
+            continue;
+        }
+        const std::uint16_t value = next[static_cast<std::size_t>(length)]++;
+        std::uint16_t reversed = 0;
+        for (int b = 0; b < length; ++b) {
+            reversed = static_cast<std::uint16_t>((reversed << 1) | ((value >> b) & 1u));
+        }
+        codes[i] = reversed;
+    }
+    return codes;
+}
+
+namespace {
+
+struct HuffmanTable {
+    std::vector<std::uint8_t> lengths;
+    std::vector<std::uint16_t> codes;
+
+    explicit HuffmanTable(std::vector<std::uint8_t> codeLengths)
+        : lengths(std::move(codeLengths)), codes(canonicalCodes(lengths)) {}
+};
+
+const HuffmanTable& fixedLiteralTable() {
+    static const HuffmanTable table = [] {
+        std::vector<std::uint8_t> lengths(288);
+        for (int i = 0; i < 288; ++i) {
+            lengths[static_cast<std::size_t>(i)] = i < 144 ? 8 : (i < 256 ? 9 : (i < 280 ? 7 : 8));
+        }
+        return HuffmanTable(std::move(lengths));
+    }();
+    return table;
+}
+
+const HuffmanTable& fixedDistanceTable() {
+    static const HuffmanTable table(std::vector<std::uint8_t>(30, 5));
+    return table;
+}
+
+// One entry of the run-length coded code-length sequence of a dynamic header.
+struct CodeLengthToken {
+    std::uint8_t symbol;
+    std::uint8_t extra;
+};
+
+std::vector<CodeLengthToken> encodeCodeLengths(const std::vector<std::uint8_t>& lengths) {
+    std::vector<CodeLengthToken> tokens;
+    std::size_t i = 0;
+    while (i < lengths.size()) {
+        const std::uint8_t value = lengths[i];
+        std::size_t run = 1;
+        while (i + run < lengths.size() && lengths[i + run] == value) {
+            ++run;
+        }
+        i += run;
+        if (value == 0) {
+            while (run >= 11) {
+                const std::size_t n = std::min<std::size_t>(run, 138);
+                tokens.push_back(CodeLengthToken{18, static_cast<std::uint8_t>(n - 11)});
+                run -= n;
+            }
+            if (run >= 3) {
+                tokens.push_back(CodeLengthToken{17, static_cast<std::uint8_t>(run - 3)});
+                run = 0;
+            }
+        } else {
+            tokens.push_back(CodeLengthToken{value, 0});
+            --run;
+            while (run >= 3) {
+                const std::size_t n = std::min<std::size_t>(run, 6);
+                tokens.push_back(CodeLengthToken{16, static_cast<std::uint8_t>(n - 3)});
+                run -= n;
+            }
+        }
+        while (run-- > 0) {
+            tokens.push_back(CodeLengthToken{value, 0});
+        }
+    }
+    return tokens;
+}
+
+int codeLengthExtraBits(int symbol) {
+    return symbol == 16 ? 2 : (symbol == 17 ? 3 : (symbol == 18 ? 7 : 0));
+}
+
+void putStoredBlocks(BitWriter& writer, const std::uint8_t* data, std::size_t size, bool last) {
+    std::size_t offset = 0;
+    do {
+        const std::size_t length = std::min(kStoredBlockMax, size - offset);
+        writer.put(last && offset + length == size ? 1 : 0, 1);
+        writer.put(0, 2);
+        writer.flush();
+        writer.putBytes(static_cast<std::uint16_t>(length));
+        writer.putBytes(static_cast<std::uint16_t>(~length));
+        writer.putRaw(data + offset, length);
+        offset += length;
+    } while (offset < size);
+}
+
+// Emits one block as whichever of dynamic Huffman, fixed Huffman or stored
+// is smallest.
+void putBlock(BitWriter& writer, const LZToken* tokens, std::size_t count, const std::uint8_t* raw, std::size_t rawSize, bool last) {
+    std::vector<std::uint32_t> literalFreqs(286, 0);
+    std::vector<std::uint32_t> distanceFreqs(30, 0);
+    std::uint64_t extraBits = 0;
+    for (std::size_t i = 0; i < count; ++i) {
+        const LZToken& token = tokens[i];
+        if (token.distance == 0) {
+            ++literalFreqs[token.value];
+            continue;
+        }
+        const int lengthCode = lengthSymbol(token.value);
+        const int distanceCode = distanceSymbol(token.distance);
+        ++literalFreqs[static_cast<std::size_t>(257 + lengthCode)];
+        ++distanceFreqs[static_cast<std::size_t>(distanceCode)];
+        extraBits += kLengthExtra[static_cast<std::size_t>(lengthCode)] + kDistanceExtra[static_cast<std::size_t>(distanceCode)];
+    }
+    literalFreqs[256] = 1;
+
+    const HuffmanTable literals(huffmanLengths(literalFreqs, 15));
+    const HuffmanTable distances(huffmanLengths(distanceFreqs, 15));
+    std::size_t literalCount = 286;
+    while (literalCount > 257 && literals.lengths[literalCount - 1] == 0) {
+        --literalCount;
+    }
+    std::size_t distanceCount = 30;
+    while (distanceCount > 1 && distances.lengths[distanceCount - 1] == 0) {
+        --distanceCount;
+    }
+    std::vector<std::uint8_t> headerLengths(literals.lengths.begin(), literals.lengths.begin() + static_cast<std::ptrdiff_t>(literalCount));
+    headerLengths.insert(headerLengths.end(), distances.lengths.begin(), distances.lengths.begin() + static_cast<std::ptrdiff_t>(distanceCount));
+    const std::vector<CodeLengthToken> headerTokens = encodeCodeLengths(headerLengths);
+    std::vector<std::uint32_t> codeLengthFreqs(19, 0);
+    for (const CodeLengthToken& token : headerTokens) {
+        ++codeLengthFreqs[token.symbol];
+    }
+    const HuffmanTable codeLengths(huffmanLengths(codeLengthFreqs, 7));
+    std::size_t codeLengthCount = 19;
+    while (codeLengthCount > 4 && codeLengths.lengths[kCodeLengthOrder[codeLengthCount - 1]] == 0) {
+        --codeLengthCount;
+    }
+
+    std::uint64_t dynamicBits = 3 + 5 + 5 + 4 + 3 * codeLengthCount + extraBits;
+    for (const CodeLengthToken& token : headerTokens) {
+        dynamicBits += codeLengths.lengths[token.symbol] + static_cast<std::uint64_t>(codeLengthExtraBits(token.symbol));
+    }
+    std::uint64_t fixedBits = 3 + extraBits;
+    for (std::size_t i = 0; i < 286; ++i) {
+        dynamicBits += static_cast<std::uint64_t>(literalFreqs[i]) * literals.lengths[i];
+        fixedBits += static_cast<std::uint64_t>(literalFreqs[i]) * fixedLiteralTable().lengths[i];
+    }
+    for (std::size_t i = 0; i < 30; ++i) {
+        dynamicBits += static_cast<std::uint64_t>(distanceFreqs[i]) * distances.lengths[i];
+        fixedBits += static_cast<std::uint64_t>(distanceFreqs[i]) * 5;
+    }
+    const std::uint64_t storedBits = (static_cast<std::uint64_t>(rawSize) + 5 * (rawSize / kStoredBlockMax + 1)) * 8 + 7;
+
+    if (storedBits <= dynamicBits && storedBits <= fixedBits) {
+        putStoredBlocks(writer, raw, rawSize, last);
+        return;
+    }
+
+    const bool dynamic = dynamicBits < fixedBits;
+    const HuffmanTable& literalTable = dynamic ? literals : fixedLiteralTable();
+    const HuffmanTable& distanceTable = dynamic ? distances : fixedDistanceTable();
+    writer.put(last ? 1 : 0, 1);
+    writer.put(dynamic ? 2 : 1, 2);
+    if (dynamic) {
+        writer.put(static_cast<std::uint32_t>(literalCount - 257), 5);
+        writer.put(static_cast<std::uint32_t>(distanceCount - 1), 5);
+        writer.put(static_cast<std::uint32_t>(codeLengthCount - 4), 4);
+        for (std::size_t i = 0; i < codeLengthCount; ++i) {
+            writer.put(codeLengths.lengths[kCodeLengthOrder[i]], 3);
+        }
+        for (const CodeLengthToken& token : headerTokens) {
+            writer.put(codeLengths.codes[token.symbol], codeLengths.lengths[token.symbol]);
+            writer.put(token.extra, codeLengthExtraBits(token.symbol));
+        }
+    }
+    for (std::size_t i = 0; i < count; ++i) {
+        const LZToken& token = tokens[i];
+        if (token.distance == 0) {
+            writer.put(literalTable.codes[token.value], literalTable.lengths[token.value]);
+            continue;
+        }
+        const std::size_t lengthCode = static_cast<std::size_t>(lengthSymbol(token.value));
+        const std::size_t distanceCode = static_cast<std::size_t>(distanceSymbol(token.distance));
+        writer.put(literalTable.codes[257 + lengthCode], literalTable.lengths[257 + lengthCode]);
+        writer.put(token.value - kLengthBase[lengthCode], kLengthExtra[lengthCode]);
+        writer.put(distanceTable.codes[distanceCode], distanceTable.lengths[distanceCode]);
+        writer.put(token.distance - kDistanceBase[distanceCode], kDistanceExtra[distanceCode]);
+    }
+    writer.put(literalTable.codes[256], literalTable.lengths[256]);
+}
+
+// Reads bits LSB-first from a sequence of input spans; the next span is
+// pulled from the source whenever the current one runs out.
+class BitReader {
+public:
+    explicit BitReader(Inflater::InputSource source)
+        : m_source(std::move(source)), m_data(nullptr), m_size(0), m_pos(0), m_bits(0), m_count(0) {}
+
+    void need(int count) {
+        fill(count);
+        if (m_count < count) {
+            throw std::runtime_error("Unexpected end of deflate stream");
+        }
+    }
+
+    // Fills as many bits as remain, up to count, without failing at the end.
+    void fill(int count) {
+        while (m_count < count) {
+            if (m_pos >= m_size && !nextSpan()) {
+                return;
+            }
+            m_bits |= static_cast<std::uint64_t>(m_data[m_pos++]) << m_count;
+            m_count += 8;
+        }
+    }
+
+    std::uint32_t bits(int count) {
+        if (count == 0) {
+            return 0;
+        }
+        need(count);
+        const std::uint32_t value = static_cast<std::uint32_t>(m_bits & ((1ull << count) - 1));
+        consume(count);
+        return value;
+    }
+
+    std::uint32_t peek() const { return static_cast<std::uint32_t>(m_bits); }
+    int available() const { return m_count; }
+
+    void consume(int count) {
+        m_bits >>= count;
+        m_count -= count;
+    }
+
+    void alignToByte() {
+        consume(m_count % 8);
+    }
+
+    // Copies up to size whole bytes; the reader must be byte aligned.
+    std::size_t readBytes(std::uint8_t* out, std::size_t size) {
+        std::size_t copied = 0;
+        while (copied < size && m_count >= 8) {
+            out[copied++] = static_cast<std::uint8_t>(m_bits & 0xFF);
+            consume(8);
+        }
+        while (copied < size && (m_pos < m_size || nextSpan())) {
+            const std::size_t n = std::min(size - copied, m_size - m_pos);
+            std::memcpy(out + copied, m_data + m_pos, n);
+            m_pos += n;
+            copied += n;
+        }
+        return copied;
+    }
+
+private:
+    bool nextSpan() {
+        const std::uint8_t* data = nullptr;
+        std::size_t size = 0;
+        while (m_source && m_source(data, size)) {
+            if (size > 0) {
+                m_data = data;
+                m_size = size;
+                m_pos = 0;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    Inflater::InputSource m_source;
+    const std::uint8_t* m_data;
+    std::size_t m_size;
+    std::size_t m_pos;
+    std::uint64_t m_bits;
+    int m_count;
+};
+
+// Canonical Huffman decoder with a direct lookup for short codes and a
+// per-length walk for the rest.
+class HuffmanDecoder {
+public:
+    static constexpr int kFastBits = 10;
+
+    void build(const std::uint8_t* lengths, int count) {
+        std::fill(m_counts.begin(), m_counts.end(), static_cast<std::uint16_t>(0));
+        for (int i = 0; i < count; ++i) {
+            ++m_counts[lengths[i]];
+        }
+        m_counts[0] = 0;
+        int left = 1;
+        for (int len = 1; len <= 15; ++len) {
+            left = (left << 1) - m_counts[static_cast<std::size_t>(len)];
+            if (left < 0) {
+                throw std::runtime_error("Over-subscribed Huffman code");
+            }
+        }
+
+        std::array<std::uint16_t, 16> offsets{};
+        for (int len = 1; len < 15; ++len) {
+            offsets[static_cast<std::size_t>(len + 1)] =
+                static_cast<std::uint16_t>(offsets[static_cast<std::size_t>(len)] + m_counts[static_cast<std::size_t>(len)]);
+        }
+        m_symbols.assign(static_cast<std::size_t>(count), 0);
+        for (int i = 0; i < count; ++i) {
+            if (lengths[i] != 0) {
+                m_symbols[offsets[lengths[i]]++] = static_cast<std::uint16_t>(i);
+            }
+        }
+
+        std::fill(m_fast.begin(), m_fast.end(), static_cast<std::uint16_t>(0));
+        int code = 0;
+        int index = 0;
+        for (int len = 1; len <= kFastBits; ++len) {
+            for (int i = 0; i < m_counts[static_cast<std::size_t>(len)]; ++i, ++index, ++code) {
+                int reversed = 0;
+                for (int b = 0; b < len; ++b) {
+                    reversed = (reversed << 1) | ((code >> b) & 1);
+                }
+                const std::uint16_t entry = static_cast<std::uint16_t>((m_symbols[static_cast<std::size_t>(index)] << 4) | len);
+                for (int fill = reversed; fill < (1 << kFastBits); fill += (1 << len)) {
+                    m_fast[static_cast<std::size_t>(fill)] = entry;
+                }
+            }
+            code <<= 1;
+        }
+    }
+
+    int decode(BitReader& reader) const {
+        if (reader.available() < 15) {
+            reader.fill(56);
+        }
+        const std::uint16_t entry = m_fast[reader.peek() & ((1u << kFastBits) - 1)];
+        const int fastLength = entry & 0xF;
+        if (fastLength != 0 && fastLength <= reader.available()) {
+            reader.consume(fastLength);
+            return entry >> 4;
+        }
+
+        int code = 0;
+        int first = 0;
+        int index = 0;
+        for (int len = 1; len <= 15; ++len) {
+            code |= static_cast<int>(reader.bits(1));
+            const int count = m_counts[static_cast<std::size_t>(len)];
+            if (code - count < first) {
+                return m_symbols[static_cast<std::size_t>(index + (code - first))];
+            }
+            index += count;
+            first += count;
+            first <<= 1;
+            code <<= 1;
+        }
+        throw std::runtime_error("Invalid Huffman code");
+    }
+
+private:
+    std::array<std::uint16_t, 16> m_counts{};
+    std::vector<std::uint16_t> m_symbols;
+    std::array<std::uint16_t, 1 << kFastBits> m_fast{};
+};
+
+void readDynamicTables(BitReader& reader, HuffmanDecoder& literals, HuffmanDecoder& distances) {
+    const int literalCount = static_cast<int>(reader.bits(5)) + 257;
+    const int distanceCount = static_cast<int>(reader.bits(5)) + 1;
+    const int codeLengthCount = static_cast<int>(reader.bits(4)) + 4;
+    if (literalCount > 286 || distanceCount > 30) {
+        throw std::runtime_error("Invalid deflate table sizes");
+    }
+
+    std::array<std::uint8_t, 19> codeLengths{};
+    for (int i = 0; i < codeLengthCount; ++i) {
+        codeLengths[kCodeLengthOrder[static_cast<std::size_t>(i)]] = static_cast<std::uint8_t>(reader.bits(3));
+    }
+    HuffmanDecoder codeLengthDecoder;
+    codeLengthDecoder.build(codeLengths.data(), 19);
+
+    std::array<std::uint8_t, 286 + 30> lengths{};
+    int index = 0;
+    while (index < literalCount + distanceCount) {
+        const int symbol = codeLengthDecoder.decode(reader);
+        if (symbol < 16) {
+            lengths[static_cast<std::size_t>(index++)] = static_cast<std::uint8_t>(symbol);
+            continue;
+        }
+        std::uint8_t value = 0;
+        int repeat = 0;
+        if (symbol == 16) {
+            if (index == 0) {
+                throw std::runtime_error("Deflate length repeat without previous length");
+            }
+            value = lengths[static_cast<std::size_t>(index - 1)];
+            repeat = 3 + static_cast<int>(reader.bits(2));
+        } else if (symbol == 17) {
+            repeat = 3 + static_cast<int>(reader.bits(3));
+        } else {
+            repeat = 11 + static_cast<int>(reader.bits(7));
+        }
+        if (index + repeat > literalCount + distanceCount) {
+            throw std::runtime_error("Deflate code lengths overflow table");
+        }
+        while (repeat-- > 0) {
+            lengths[static_cast<std::size_t>(index++)] = value;
+        }
+    }
+    if (lengths[256] == 0) {
+        throw std::runtime_error("Deflate table is missing end-of-block");
+    }
+    literals.build(lengths.data(), literalCount);
+    distances.build(lengths.data() + literalCount, distanceCount);
+}
+
+const HuffmanDecoder& fixedLiteralDecoder() {
+    static const HuffmanDecoder decoder = [] {
+        std::array<std::uint8_t, 288> lengths{};
+        for (int i = 0; i < 288; ++i) {
+            lengths[static_cast<std::size_t>(i)] = i < 144 ? 8 : (i < 256 ? 9 : (i < 280 ? 7 : 8));
+        }
+        HuffmanDecoder d;
+        d.build(lengths.data(), 288);
+        return d;
+    }();
+    return decoder;
+}
+
+const HuffmanDecoder& fixedDistanceDecoder() {
+    static const HuffmanDecoder decoder = [] {
+        std::array<std::uint8_t, 30> lengths{};
+        lengths.fill(5);
+        HuffmanDecoder d;
+        d.build(lengths.data(), 30);
+        return d;
+    }();
+    return decoder;
+}
+struct CRCTable {
+    std::uint32_t entries[256];
+
+    CRCTable() {
+        for (std::uint32_t i = 0; i < 256; ++i) {
+            std::uint32_t c = i;
+            for (int k = 0; k < 8; ++k) {
+                c = (c & 1u) ? (0xEDB88320u ^ (c >> 1)) : (c >> 1);
+            }
+            entries[i] = c;
+        }
+    }
+};
+} // namespace
+
+std::uint32_t crc32(const std::uint8_t* data, std::size_t size, std::uint32_t crc) {
+    static const CRCTable table;
+    std::uint32_t c = crc ^ 0xFFFFFFFFu;
+    for (std::size_t i = 0; i < size; ++i) {
+        c = table.entries[(c ^ data[i]) & 0xFFu] ^ (c >> 8);
+    }
+    return c ^ 0xFFFFFFFFu;
+}
+
+std::vector<std::uint8_t> rleCompress(const std::uint8_t* data, std::size_t size) {
+    std::vector<std::uint8_t> out;
+    out.reserve(size / 2 + 16);
+    std::size_t pos = 0;
+    std::size_t literalStart = 0;
+    const auto flushLiterals = [&](std::size_t end) {
+        while (literalStart < end) {
+            const std::size_t count = std::min<std::size_t>(128, end - literalStart);
+            out.push_back(static_cast<std::uint8_t>(count - 1));
+            out.insert(out.end(), data + literalStart, data + literalStart + count);
+            literalStart += count;
+        }
+    };
+
+    while (pos < size) {
+        std::size_t run = 1;
+        while (pos + run < size && run < 130 && data[pos + run] == data[pos]) {
+            ++run;
+        }
+        if (run >= 3) {
+            flushLiterals(pos);
+            out.push_back(static_cast<std::uint8_t>(128 + run - 3));
+            out.push_back(data[pos]);
+            pos += run;
+            literalStart = pos;
+        } else {
+            pos += run;
+        }
+    }
+    flushLiterals(size);
+    return out;
+}
+
+std::vector<std::uint8_t> rleDecompress(const std::uint8_t* data, std::size_t size, std::size_t rawSize) {
+    std::vector<std::uint8_t> out;
+    out.reserve(rawSize);
+    std::size_t pos = 0;
+    while (pos < size) {
+        const std::uint8_t header = data[pos++];
+        if (header < 128) {
+            const std::size_t count = static_cast<std::size_t>(header) + 1;
+            if (pos + count > size || out.size() + count > rawSize) {
+                throw std::runtime_error("Corrupt RLE literal run");
+            }
+            out.insert(out.end(), data + pos, data + pos + count);
+            pos += count;
+        } else {
+            const std::size_t count = static_cast<std::size_t>(header) - 128 + 3;
+            if (pos >= size || out.size() + count > rawSize) {
+                throw std::runtime_error("Corrupt RLE repeat run");
+            }
+            out.insert(out.end(), count, data[pos++]);
+        }
+    }
+    if (out.size() != rawSize) {
+        throw std::runtime_error("RLE chunk size mismatch");
+    }
+    return out;
+}
+
+std::vector<std::uint8_t> lz4Compress(const std::uint8_t* data, std::size_t size) {
+    std::vector<std::uint8_t> out;
+    out.reserve(size / 2 + 16);
+    if (size < kLZ4MatchSafety + 1) {
+        writeLZ4Sequence(out, data, size, 0, 0);
+        return out;
+    }
+
+    std::vector<std::int32_t> table(static_cast<std::size_t>(1) << kHashBits, -1);
+    const std::size_t matchLimit = size - kLZ4LastLiterals;
+    const std::size_t searchLimit = size - kLZ4MatchSafety;
+    std::size_t anchor = 0;
+    std::size_t pos = 0;
+    while (pos < searchLimit) {
+        const std::uint32_t h = hash4(data + pos);
+        const std::int32_t candidate = table[h];
+        table[h] = static_cast<std::int32_t>(pos);
+        if (candidate < 0 || pos - static_cast<std::size_t>(candidate) > kLZ4MaxOffset ||
+            read32(data + candidate) != read32(data + pos)) {
+            ++pos;
+            continue;
+        }
+
+        const std::size_t length = kLZ4MinMatch + matchLength(data + pos + kLZ4MinMatch,
+                                                              data + candidate + kLZ4MinMatch,
+                                                              matchLimit - pos - kLZ4MinMatch);
+        writeLZ4Sequence(out, data + anchor, pos - anchor, pos - static_cast<std::size_t>(candidate), length);
+        pos += length;
+        anchor = pos;
+        if (pos < searchLimit) {
+            table[hash4(data + pos - 2)] = static_cast<std::int32_t>(pos - 2);
+        }
+    }
+    writeLZ4Sequence(out, data + anchor, size - anchor, 0, 0);
+    return out;
+}
+
+std::vector<std::uint8_t> lz4Decompress(const std::uint8_t* data, std::size_t size, std::size_t rawSize) {
+    std::vector<std::uint8_t> out;
+    out.reserve(rawSize);
+    std::size_t pos = 0;
+    while (pos < size) {
+        const std::uint8_t token = data[pos++];
+        std::size_t literals = token >> 4;
+        if (literals == 15) {
+            literals += readLZ4Length(data, size, pos);
+        }
+        if (pos + literals > size || out.size() + literals > rawSize) {
+            throw std::runtime_error("Corrupt LZ4 literals");
+        }
+        out.insert(out.end(), data + pos, data + pos + literals);
+        pos += literals;
+        if (pos >= size) {
+            break;
+        }
+
+        if (pos + 2 > size) {
+            throw std::runtime_error("Truncated LZ4 offset");
+        }
+        const std::size_t offset = static_cast<std::size_t>(data[pos]) | (static_cast<std::size_t>(data[pos + 1]) << 8);
+        pos += 2;
+        std::size_t length = (token & 0xF);
+        if (length == 15) {
+            length += readLZ4Length(data, size, pos);
+        }
+        length += kLZ4MinMatch;
+        if (offset == 0 || offset > out.size() || out.size() + length > rawSize) {
+            throw std::runtime_error("Corrupt LZ4 match");
+        }
+        std::size_t from = out.size() - offset;
+        for (std::size_t i = 0; i < length; ++i) {
+            out.push_back(out[from++]);
+        }
+    }
+    if (out.size() != rawSize) {
+        throw std::runtime_error("LZ4 chunk size mismatch");
+    }
+    return out;
+}
+
+std::vector<std::uint8_t> deflateCompress(const std::uint8_t* data, std::size_t size, int level) {
+    return deflateSegment(data, size, 0, level, true);
+}
+
+std::vector<std::uint8_t> deflateSegment(const std::uint8_t* data, std::size_t size, std::size_t historySize, int level, bool last) {
+    if (level < 0 || level > 9) {
+        throw std::invalid_argument("Deflate level must be between 0 and 9");
+    }
+    std::vector<std::uint8_t> out;
+    out.reserve(size / 2 + 16);
+    BitWriter writer(out);
+    if (level == 0 || size == 0) {
+        putStoredBlocks(writer, data, size, last);
+    } else {
+        const std::size_t history = std::min(historySize, kDeflateWindow);
+        const std::uint8_t* base = data - history;
+        const std::vector<LZToken> tokens = lz77Parse(base, history, history + size, kDeflateLevels[static_cast<std::size_t>(level)]);
+        std::size_t rawOffset = 0;
+        for (std::size_t first = 0; first < tokens.size(); first += kDeflateBlockTokens) {
+            const std::size_t count = std::min(kDeflateBlockTokens, tokens.size() - first);
+            std::size_t rawSize = 0;
+            for (std::size_t i = first; i < first + count; ++i) {
+                rawSize += tokens[i].distance == 0 ? 1 : tokens[i].value;
+            }
+            putBlock(writer, tokens.data() + first, count, data + rawOffset, rawSize, last && first + count == tokens.size());
+            rawOffset += rawSize;
+        }
+        if (!last) {
+            // Sync flush: an empty stored block leaves the segment byte aligned.
+            putStoredBlocks(writer, nullptr, 0, false);
+        }
+    }
+    writer.flush();
+    return out;
+}
+
+struct Inflater::State {
+    enum class Mode { BlockHeader, Stored, Huffman, Done };
+
+    explicit State(InputSource input) : reader(std::move(input)), window(kDeflateWindow) {}
+
+    BitReader reader;
+    Mode mode = Mode::BlockHeader;
+    bool lastBlock = false;
+    std::size_t storedRemaining = 0;
+    HuffmanDecoder dynamicLiterals;
+    HuffmanDecoder dynamicDistances;
+    const HuffmanDecoder* literals = nullptr;
+    const HuffmanDecoder* distances = nullptr;
+    std::size_t copyLength = 0;
+    std::size_t copyDistance = 0;
+    std::vector<std::uint8_t> window;
+    std::size_t total = 0;
+};
+
+Inflater::Inflater(InputSource input) : m_state(std::make_unique<State>(std::move(input))) {}
+
+Inflater::~Inflater() = default;
+
+bool Inflater::finished() const {
+    return m_state->mode == State::Mode::Done && m_state->copyLength == 0;
+}
+
+// Output goes straight to out; back references inside it are copied from
+// there and older ones from the window, which is refreshed once per call.
+std::size_t Inflater::read(std::uint8_t* out, std::size_t size) {
+    State& state = *m_state;
+    BitReader& reader = state.reader;
+    const std::uint8_t* window = state.window.data();
+    constexpr std::size_t mask = kDeflateWindow - 1;
+    std::size_t produced = 0;
+    const auto copyMatch = [&]() {
+        const std::size_t n = std::min(state.copyLength, size - produced);
+        const std::size_t distance = state.copyDistance;
+        std::uint8_t* dst = out + produced;
+        std::size_t i = 0;
+        // The part of the match that still lies before this call's output.
+        for (; i < n && distance > produced + i; ++i) {
+            dst[i] = window[(state.total + produced + i - distance) & mask];
+        }
+        if (i < n) {
+            const std::uint8_t* src = dst + i - distance;
+            if (distance >= n - i) {
+                std::memcpy(dst + i, src, n - i);
+            } else {
+                for (; i < n; ++i) {
+                    dst[i] = dst[i - distance];
+                }
+            }
+        }
+        produced += n;
+        state.copyLength -= n;
+    };
+
+    while (produced < size) {
+        if (state.copyLength > 0) {
+            copyMatch();
+            continue;
+        }
+        if (state.mode == State::Mode::Done) {
+            break;
+        }
+        if (state.mode == State::Mode::BlockHeader) {
+            state.lastBlock = reader.bits(1) != 0;
+            const std::uint32_t type = reader.bits(2);
+            if (type == 0) {
+                reader.alignToByte();
+                const std::uint32_t length = reader.bits(16);
+                const std::uint32_t inverse = reader.bits(16);
+                if ((length ^ 0xFFFFu) != inverse) {
+                    throw std::runtime_error("Corrupt deflate stored block");
+                }
+                state.storedRemaining = length;
+                state.mode = State::Mode::Stored;
+            } else if (type == 1) {
+                state.literals = &fixedLiteralDecoder();
+                state.distances = &fixedDistanceDecoder();
+                state.mode = State::Mode::Huffman;
+            } else if (type == 2) {
+                readDynamicTables(reader, state.dynamicLiterals, state.dynamicDistances);
+                state.literals = &state.dynamicLiterals;
+                state.distances = &state.dynamicDistances;
+                state.mode = State::Mode::Huffman;
+            } else {
+                throw std::runtime_error("Invalid deflate block type");
+            }
+            continue;
+        }
+        if (state.mode == State::Mode::Stored) {
+            const std::size_t n = std::min(state.storedRemaining, size - produced);
+            if (reader.readBytes(out + produced, n) != n) {
+                throw std::runtime_error("Truncated deflate stored block");
+            }
+            produced += n;
+            state.storedRemaining -= n;
+            if (state.storedRemaining == 0) {
+                state.mode = state.lastBlock ? State::Mode::Done : State::Mode::BlockHeader;
+            }
+            continue;
+        }
+
+        while (produced < size) {
+            const int symbol = state.literals->decode(reader);
+            if (symbol < 256) {
+                out[produced++] = static_cast<std::uint8_t>(symbol);
+                continue;
+            }
+            if (symbol == 256) {
+                state.mode = state.lastBlock ? State::Mode::Done : State::Mode::BlockHeader;
+                break;
+            }
+            const int lengthCode = symbol - 257;
+            if (lengthCode >= 29) {
+                throw std::runtime_error("Invalid deflate length code");
+            }
+            const std::size_t length = kLengthBase[static_cast<std::size_t>(lengthCode)] +
+                                       reader.bits(kLengthExtra[static_cast<std::size_t>(lengthCode)]);
+            const int distanceCode = state.distances->decode(reader);
+            if (distanceCode >= 30) {
+                throw std::runtime_error("Invalid deflate distance code");
+            }
+            const std::size_t distance = kDistanceBase[static_cast<std::size_t>(distanceCode)] +
+                                         reader.bits(kDistanceExtra[static_cast<std::size_t>(distanceCode)]);
+            if (distance > state.total + produced) {
+                throw std::runtime_error("Deflate distance exceeds output");
+            }
+            state.copyLength = length;
+            state.copyDistance = distance;
+            copyMatch();
+        }
+    }
+
+    // Keep the last 32K of output for back references in later calls.
+    const std::size_t keep = std::min(produced, kDeflateWindow);
+    const std::uint8_t* tail = out + produced - keep;
+    std::size_t at = (state.total + produced - keep) & mask;
+    const std::size_t first = std::min(keep, kDeflateWindow - at);
+    std::memcpy(state.window.data() + at, tail, first);
+    std::memcpy(state.window.data(), tail + first, keep - first);
+    state.total += produced;
+    return produced;
+}
+
+std::vector<std::uint8_t> inflateRaw(const std::uint8_t* data, std::size_t size, std::size_t sizeHint, std::size_t maxSize) {
+    bool supplied = false;
+    Inflater inflater([&](const std::uint8_t*& span, std::size_t& spanSize) {
+        if (supplied) {
+            return false;
+        }
+        supplied = true;
+        span = data;
+        spanSize = size;
+        return true;
+    });
+    std::vector<std::uint8_t> out(std::max<std::size_t>(std::min(sizeHint, maxSize), 1));
+    std::size_t used = 0;
+    while (!inflater.finished()) {
+        if (used == out.size()) {
+            if (out.size() >= maxSize) {
+                std::uint8_t extra = 0;
+                if (inflater.read(&extra, 1) != 0) {
+                    throw std::runtime_error("Deflate output exceeds expected size");
+                }
+                break;
+            }
+            out.resize(out.size() > maxSize / 2 ? maxSize : out.size() * 2);
+        }
+        used += inflater.read(out.data() + used, out.size() - used);
+    }
+    out.resize(used);
+    return out;
+}
+
+std::vector<std::uint8_t> encodeChunk(ChunkCodec codec, const std::uint8_t* data, std::size_t size) {
+    switch (codec) {
+        case ChunkCodec::None:
+            return std::vector<std::uint8_t>(data, data + size);
+        case ChunkCodec::RLE:
+            return rleCompress(data, size);
+        case ChunkCodec::Deflate:
+            return deflateCompress(data, size, kChunkDeflateLevel);
+        case ChunkCodec::LZ4:
+            return lz4Compress(data, size);
+    }
+    throw std::invalid_argument("Unknown chunk codec");
+}
+
+std::vector<std::uint8_t> decodeChunk(ChunkCodec codec, const std::uint8_t* data, std::size_t size, std::size_t rawSize) {
+    switch (codec) {
+        case ChunkCodec::None:
+            if (size != rawSize) {
+                throw std::runtime_error("Uncompressed chunk size mismatch");
+            }
+            return std::vector<std::uint8_t>(data, data + size);
+        case ChunkCodec::RLE:
+            return rleDecompress(data, size, rawSize);
+        case ChunkCodec::Deflate: {
+            std::vector<std::uint8_t> out = inflateRaw(data, size, rawSize, rawSize);
+            if (out.size() != rawSize) {
+                throw std::runtime_error("Deflate chunk size mismatch");
+            }
+            return out;
+        }
+        case ChunkCodec::LZ4:
+            return lz4Decompress(data, size, rawSize);
+    }
+    throw std::runtime_error("Unknown chunk codec");
+}
@@ -0,0 +1,80 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+enum class ChunkCodec : std::uint8_t {
+    None = 0,
+    RLE = 1,
+    Deflate = 2,
+    LZ4 = 3
+};
+
+// Byte-oriented PackBits run-length coding.
+std::vector<std::uint8_t> rleCompress(const std::uint8_t* data, std::size_t size);
+std::vector<std::uint8_t> rleDecompress(const std::uint8_t* data, std::size_t size, std::size_t rawSize);
+
+// LZ4 block format (no frame header).
+std::vector<std::uint8_t> lz4Compress(const std::uint8_t* data, std::size_t size);
+std::vector<std::uint8_t> lz4Decompress(const std::uint8_t* data, std::size_t size, std::size_t rawSize);
+
+// Raw DEFLATE (RFC 1951) without a zlib wrapper. Levels follow zlib: 0
+// stores, 1-9 trade speed for size. Each block is emitted as dynamic Huffman,
+// fixed Huffman or stored, whichever is smallest. Inflate handles all three;
+// output beyond maxSize is an error.
+constexpr int kDefaultDeflateLevel = 6;
+
+std::vector<std::uint8_t> deflateCompress(const std::uint8_t* data, std::size_t size, int level = kDefaultDeflateLevel);
+// Compresses data[0, size) as one segment of a longer stream; matches may
+// reach into the historySize bytes before data. Non-final segments end with a
+// sync flush (an empty stored block), so independently compressed segments
+// concatenate into one valid stream.
+std::vector<std::uint8_t> deflateSegment(const std::uint8_t* data,
+                                         std::size_t size,
+                                         std::size_t historySize,
+                                         int level,
+                                         bool last);
+std::vector<std::uint8_t> inflateRaw(const std::uint8_t* data,
+                                     std::size_t size,
+                                     std::size_t sizeHint = 0,
+                                     std::size_t maxSize = SIZE_MAX);
+
+// Incremental raw DEFLATE decoder. Compressed input is pulled from source one
+// span at a time (it returns false at the end), so a stream split across
+// containers such as PNG IDAT chunks never has to be joined; output is read
+// in pieces of any size while the 32K window is kept internally.
+class Inflater {
+public:
+    using InputSource = std::function<bool(const std::uint8_t*& data, std::size_t& size)>;
+
+    explicit Inflater(InputSource source);
+    ~Inflater();
+
+    // Decodes up to size bytes into out; fewer are returned only once the
+    // final block has ended. Corrupt or truncated input throws.
+    std::size_t read(std::uint8_t* out, std::size_t size);
+    bool finished() const;
+
+private:
+    struct State;
+    std::unique_ptr<State> m_state;
+};
+
+// Huffman code lengths for freqs, limited to maxLength bits. The code is
+// always complete: a lone used symbol is paired with an unused one.
+std::vector<std::uint8_t> huffmanLengths(std::vector<std::uint32_t> freqs, int maxLength);
+// Canonical codes for lengths, bit-reversed for LSB-first bit writers.
+std::vector<std::uint16_t> canonicalCodes(const std::vector<std::uint8_t>& lengths);
+
+// CRC-32 (IEEE, as used by zlib and PNG). Pass a previous result as crc to
+// continue a running checksum.
+std::uint32_t crc32(const std::uint8_t* data, std::size_t size, std::uint32_t crc = 0);
+
+std::vector<std::uint8_t> encodeChunk(ChunkCodec codec, const std::uint8_t* data, std::size_t size);
+std::vector<std::uint8_t> decodeChunk(ChunkCodec codec, const std::uint8_t* data, std::size_t size, std::size_t rawSize);
+
+#endif
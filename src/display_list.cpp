@@ -0,0 +1,403 @@
+#include "display_list.h"
+
+#include "parallel.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+
+namespace {
+constexpr int kTileSize = 128;
+// Lists covering fewer pixels than this draw in one pass; thread startup
+// would cost more than the tiles save.
+constexpr double kMinParallelArea = 512.0 * 512.0;
+
+int floorToInt(double value) {
+    return static_cast<int>(std::clamp(std::floor(value), -1e9, 1e9));
+}
+
+int ceilToInt(double value) {
+    return static_cast<int>(std::clamp(std::ceil(value), -1e9, 1e9));
+}
+
+// Pixels within margin of the box [x0, x1] x [y0, y1].
+DrawClip boundsAround(double x0, double y0, double x1, double y1, double margin) {
+    return {floorToInt(std::min(x0, x1) - margin), floorToInt(std::min(y0, y1) - margin), ceilToInt(std::max(x0, x1) + margin) + 1,
+            ceilToInt(std::max(y0, y1) + margin) + 1};
+}
+
+template <typename Point>
+DrawClip boundsOfPoints(const std::vector<Point>& points, double margin) {
+    if (points.empty()) {
+        return {0, 0, 0, 0};
+    }
+    double x0 = points.front().first;
+    double y0 = points.front().second;
+    double x1 = x0;
+    double y1 = y0;
+    for (const Point& p : points) {
+        x0 = std::min(x0, static_cast<double>(p.first));
+        y0 = std::min(y0, static_cast<double>(p.second));
+        x1 = std::max(x1, static_cast<double>(p.first));
+        y1 = std::max(y1, static_cast<double>(p.second));
+    }
+    return boundsAround(x0, y0, x1, y1, margin);
+}
+
+void applyPaint(BufferTarget& target, std::uint8_t alpha, BufferTarget::Blend blend) {
+    target.setAlpha(alpha);
+    target.setBlend(blend);
+}
+
+void applyPaint(MaskTarget& target, std::uint8_t alpha, BufferTarget::Blend) {
+    target.setAlpha(alpha);
+}
+} // namespace
+
+void DisplayList::setLineWidth(int width) {
+    m_style.lineWidth = std::max(1, width);
+}
+
+void DisplayList::setLineCap(LineCap cap) {
+    m_style.cap = cap;
+}
+
+void DisplayList::setLineJoin(LineJoin join) {
+    m_style.join = join;
+}
+
+void DisplayList::setMiterLimit(float limit) {
+    m_style.miterLimit = std::max(1.0f, limit);
+}
+
+void DisplayList::setFillRule(FillRule rule) {
+    m_style.fillRule = rule;
+}
+
+void DisplayList::setAntialias(bool enabled) {
+    m_style.antialias = enabled;
+}
+
+void DisplayList::setAlpha(std::uint8_t alpha) {
+    m_style.alpha = alpha;
+}
+
+void DisplayList::setBlend(BufferTarget::Blend blend) {
+    m_style.blend = blend;
+}
+
+void DisplayList::resetStyle() {
+    m_style = Style();
+}
+
+DisplayList::Command& DisplayList::record(Kind kind, const Color& color, const DrawClip& bounds) {
+    Command command;
+    command.kind = kind;
+    command.style = m_style;
+    command.color = color;
+    command.bounds = bounds;
+    m_commands.push_back(std::move(command));
+    return m_commands.back();
+}
+
+float DisplayList::strokeReach() const {
+    if (m_style.lineWidth <= 1) {
+        return 1.0f;
+    }
+    const float half = static_cast<float>(m_style.lineWidth) * 0.5f;
+    const float joinReach = m_style.join == LineJoin::Miter ? m_style.miterLimit : 1.0f;
+    return half * std::max(joinReach, 1.5f) + 2.0f;
+}
+
+void DisplayList::fill(const Color& color) {
+    const int far = std::numeric_limits<int>::max() / 2;
+    record(Kind::Fill, color, {-far, -far, far, far});
+}
+
+void DisplayList::line(int x0, int y0, int x1, int y1, const Color& color) {
+    Command& command = record(Kind::Line, color, boundsAround(x0, y0, x1, y1, 0.0));
+    command.values[0] = x0;
+    command.values[1] = y0;
+    command.values[2] = x1;
+    command.values[3] = y1;
+}
+
+void DisplayList::rect(int x, int y, int width, int height, const Color& color) {
+    Command& command = record(Kind::Rect, color, boundsAround(x, y, static_cast<double>(x) + width, static_cast<double>(y) + height, 1.0));
+    command.values[0] = x;
+    command.values[1] = y;
+    command.values[2] = width;
+    command.values[3] = height;
+}
+
+void DisplayList::fillRect(int x, int y, int width, int height, const Color& color) {
+    rect(x, y, width, height, color);
+    m_commands.back().kind = Kind::FillRect;
+}
+
+void DisplayList::roundRect(int x, int y, int width, int height, int radius, const Color& color) {
+    rect(x, y, width, height, color);
+    m_commands.back().kind = Kind::RoundRect;
+    m_commands.back().values[4] = radius;
+}
+
+void DisplayList::fillRoundRect(int x, int y, int width, int height, int radius, const Color& color) {
+    roundRect(x, y, width, height, radius, color);
+    m_commands.back().kind = Kind::FillRoundRect;
+}
+
+void DisplayList::ellipse(int cx, int cy, int rx, int ry, const Color& color) {
+    const double ax = std::abs(static_cast<double>(rx));
+    const double ay = std::abs(static_cast<double>(ry));
+    Command& command = record(Kind::Ellipse, color, boundsAround(cx - ax, cy - ay, cx + ax, cy + ay, 2.0));
+    command.values[0] = cx;
+    command.values[1] = cy;
+    command.values[2] = rx;
+    command.values[3] = ry;
+}
+
+void DisplayList::fillEllipse(int cx, int cy, int rx, int ry, const Color& color) {
+    ellipse(cx, cy, rx, ry, color);
+    m_commands.back().kind = Kind::FillEllipse;
+}
+
+void DisplayList::polyline(const std::vector<std::pair<int, int>>& points, const Color& color) {
+    record(Kind::Polyline, color, boundsOfPoints(points, 0.0)).points = points;
+}
+
+void DisplayList::polygon(const std::vector<std::pair<int, int>>& points, const Color& color) {
+    record(Kind::Polygon, color, boundsOfPoints(points, 0.0)).points = points;
+}
+
+void DisplayList::fillPolygon(const std::vector<std::pair<int, int>>& points, const Color& color) {
+    record(Kind::FillPolygon, color, boundsOfPoints(points, 1.0)).points = points;
+}
+
+void DisplayList::circle(int cx, int cy, int radius, const Color& color) {
+    ellipse(cx, cy, radius, radius, color);
+    m_commands.back().kind = Kind::Circle;
+}
+
+void DisplayList::fillCircle(int cx, int cy, int radius, const Color& color) {
+    ellipse(cx, cy, radius, radius, color);
+    m_commands.back().kind = Kind::FillCircle;
+}
+
+void DisplayList::arc(int cx, int cy, int radius, float startRadians, float endRadians, const Color& color, bool counterclockwise) {
+    ellipse(cx, cy, radius, radius, color);
+    Command& command = m_commands.back();
+    command.kind = Kind::Arc;
+    command.angles[0] = startRadians;
+    command.angles[1] = endRadians;
+    command.counterclockwise = counterclockwise;
+}
+
+void DisplayList::addPathStep(PathStep::Verb verb, std::initializer_list<float> values) {
+    PathStep step{verb, {0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f}};
+    std::copy(values.begin(), values.end(), step.values);
+    m_path.push_back(step);
+}
+
+void DisplayList::beginPath() {
+    m_path.clear();
+}
+
+void DisplayList::moveTo(float x, float y) {
+    addPathStep(PathStep::Verb::Move, {x, y});
+}
+
+void DisplayList::lineTo(float x, float y) {
+    addPathStep(PathStep::Verb::Line, {x, y});
+}
+
+void DisplayList::quadraticCurveTo(float cx, float cy, float x, float y) {
+    addPathStep(PathStep::Verb::Quadratic, {cx, cy, x, y});
+}
+
+void DisplayList::bezierCurveTo(float cx1, float cy1, float cx2, float cy2, float x, float y) {
+    addPathStep(PathStep::Verb::Cubic, {cx1, cy1, cx2, cy2, x, y});
+}
+
+void DisplayList::closePath() {
+    addPathStep(PathStep::Verb::Close, {});
+}
+
+void DisplayList::stroke(const Color& color) {
+    // Curves stay inside the hull of their control points.
+    std::vector<std::pair<float, float>> points;
+    for (const PathStep& step : m_path) {
+        const int count = step.verb == PathStep::Verb::Quadratic ? 2 : step.verb == PathStep::Verb::Cubic ? 3 : step.verb == PathStep::Verb::Close ? 0 : 1;
+        for (int i = 0; i < count; ++i) {
+            points.push_back({step.values[i * 2], step.values[i * 2 + 1]});
+        }
+    }
+    record(Kind::Stroke, color, boundsOfPoints(points, strokeReach())).path = m_path;
+}
+
+void DisplayList::fillPath(const Color& color) {
+    stroke(color);
+    m_commands.back().kind = Kind::FillPath;
+}
+
+void DisplayList::clear() {
+    m_commands.clear();
+    m_path.clear();
+}
+
+template <typename Target>
+void DisplayList::play(BasicDrawable<Target>& drawable, const Command& command) {
+    const Style& style = command.style;
+    drawable.setLineWidth(style.lineWidth);
+    drawable.setLineCap(style.cap);
+    drawable.setLineJoin(style.join);
+    drawable.setMiterLimit(style.miterLimit);
+    drawable.setFillRule(style.fillRule);
+    drawable.setAntialias(style.antialias);
+    applyPaint(drawable.target(), style.alpha, style.blend);
+    const int* v = command.values;
+    const Color& color = command.color;
+    switch (command.kind) {
+    case Kind::Fill:
+        drawable.fill(color);
+        break;
+    case Kind::Line:
+        drawable.line(v[0], v[1], v[2], v[3], color);
+        break;
+    case Kind::Rect:
+        drawable.rect(v[0], v[1], v[2], v[3], color);
+        break;
+    case Kind::FillRect:
+        drawable.fillRect(v[0], v[1], v[2], v[3], color);
+        break;
+    case Kind::RoundRect:
+        drawable.roundRect(v[0], v[1], v[2], v[3], v[4], color);
+        break;
+    case Kind::FillRoundRect:
+        drawable.fillRoundRect(v[0], v[1], v[2], v[3], v[4], color);
+        break;
+    case Kind::Ellipse:
+        drawable.ellipse(v[0], v[1], v[2], v[3], color);
+        break;
+    case Kind::FillEllipse:
+        drawable.fillEllipse(v[0], v[1], v[2], v[3], color);
+        break;
+    case Kind::Polyline:
+        drawable.polyline(command.points, color);
+        break;
+    case Kind::Polygon:
+        drawable.polygon(command.points, color);
+        break;
+    case Kind::FillPolygon:
+        drawable.fillPolygon(command.points, color);
+        break;
+    case Kind::Circle:
+        drawable.circle(v[0], v[1], v[2], color);
+        break;
+    case Kind::FillCircle:
+        drawable.fillCircle(v[0], v[1], v[2], color);
+        break;
+    case Kind::Arc:
+        drawable.arc(v[0], v[1], v[2], command.angles[0], command.angles[1], color, command.counterclockwise);
+        break;
+    case Kind::Stroke:
+    case Kind::FillPath:
+        drawable.beginPath();
+        for (const PathStep& step : command.path) {
+            const float* p = step.values;
+            switch (step.verb) {
+            case PathStep::Verb::Move:
+                drawable.moveTo(p[0], p[1]);
+                break;
+            case PathStep::Verb::Line:
+                drawable.lineTo(p[0], p[1]);
+                break;
+            case PathStep::Verb::Quadratic:
+                drawable.quadraticCurveTo(p[0], p[1], p[2], p[3]);
+                break;
+            case PathStep::Verb::Cubic:
+                drawable.bezierCurveTo(p[0], p[1], p[2], p[3], p[4], p[5]);
+                break;
+            case PathStep::Verb::Close:
+                drawable.closePath();
+                break;
+            }
+        }
+        if (command.kind == Kind::Stroke) {
+            drawable.stroke(color);
+        } else {
+            drawable.fillPath(color);
+        }
+        break;
+    }
+}
+
+template <typename Target>
+void DisplayList::replayOnto(const Target& target, int threads) const {
+    const int width = target.width();
+    const int height = target.height();
+    const auto clipped = [width, height](const DrawClip& bounds) {
+        return DrawClip{std::max(bounds.left, 0), std::max(bounds.top, 0), std::min(bounds.right, width), std::min(bounds.bottom, height)};
+    };
+    double area = 0.0;
+    for (const Command& command : m_commands) {
+        const DrawClip b = clipped(command.bounds);
+        if (b.left < b.right && b.top < b.bottom) {
+            area += static_cast<double>(b.right - b.left) * static_cast<double>(b.bottom - b.top);
+        }
+    }
+    if (resolveThreadCount(threads) == 1 || area < kMinParallelArea) {
+        BasicDrawable<Target> drawable(target);
+        for (const Command& command : m_commands) {
+            play(drawable, command);
+        }
+        return;
+    }
+
+    // Bin commands by the tiles their bounds reach, in recording order.
+    const int tilesX = (width + kTileSize - 1) / kTileSize;
+    const int tilesY = (height + kTileSize - 1) / kTileSize;
+    std::vector<std::vector<std::uint32_t>> bins(static_cast<std::size_t>(tilesX) * static_cast<std::size_t>(tilesY));
+    for (std::size_t i = 0; i < m_commands.size(); ++i) {
+        const DrawClip b = clipped(m_commands[i].bounds);
+        if (b.left >= b.right || b.top >= b.bottom) {
+            continue;
+        }
+        for (int ty = b.top / kTileSize; ty <= (b.bottom - 1) / kTileSize; ++ty) {
+            for (int tx = b.left / kTileSize; tx <= (b.right - 1) / kTileSize; ++tx) {
+                bins[static_cast<std::size_t>(ty) * static_cast<std::size_t>(tilesX) + static_cast<std::size_t>(tx)].push_back(
+                    static_cast<std::uint32_t>(i));
+            }
+        }
+    }
+    std::vector<int> busy;
+    for (std::size_t tile = 0; tile < bins.size(); ++tile) {
+        if (!bins[tile].empty()) {
+            busy.push_back(static_cast<int>(tile));
+        }
+    }
+    const int count = static_cast<int>(busy.size());
+    std::vector<BasicDrawable<Target>> drawables(static_cast<std::size_t>(parallelWorkerCount(count, threads)), BasicDrawable<Target>(target));
+    parallelForWorkers(count, threads, [&](int index, int worker) {
+        const int tile = busy[static_cast<std::size_t>(index)];
+        const int x = tile % tilesX * kTileSize;
+        const int y = tile / tilesX * kTileSize;
+        BasicDrawable<Target>& drawable = drawables[static_cast<std::size_t>(worker)];
+        drawable.target().setClip({x, y, std::min(x + kTileSize, width), std::min(y + kTileSize, height)});
+        for (const std::uint32_t i : bins[static_cast<std::size_t>(tile)]) {
+            play(drawable, m_commands[i]);
+        }
+    });
+}
+
+void DisplayList::replay(ImageBuffer& image, int threads) const {
+    if (!m_commands.empty()) {
+        replayOnto(BufferTarget(image), threads);
+    }
+}
+
+void DisplayList::replay(MaskBuffer& mask, int threads) const {
+    if (!m_commands.empty()) {
+        replayOnto(MaskTarget(mask), threads);
+    }
+}
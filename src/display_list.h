@@ -0,0 +1,136 @@
+#ifndef DISPLAY_LIST_H
+#define DISPLAY_LIST_H
+
+#include "draw_target.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <utility>
+#include <vector>
+
+// Drawable calls recorded for replay onto layer pixels or a mask. The
+// recording side mirrors Drawable: style and paint setters apply to the
+// primitives recorded after them. Each command also keeps bounds on the
+// pixels it can touch, so a replay can split the target into tiles, give
+// each tile only the commands that reach it, and draw tiles in parallel.
+// Within a tile commands keep their order, and a command draws the same
+// pixels in any clip, so the result matches drawing them one by one.
+class DisplayList {
+public:
+    void setLineWidth(int width);
+    void setLineCap(LineCap cap);
+    void setLineJoin(LineJoin join);
+    void setMiterLimit(float limit);
+    void setFillRule(FillRule rule);
+    void setAntialias(bool enabled);
+    // Paint alpha and blend for the target; masks ignore the blend.
+    void setAlpha(std::uint8_t alpha);
+    void setBlend(BufferTarget::Blend blend);
+    // Back to Drawable's defaults, opaque source-over paint.
+    void resetStyle();
+
+    void fill(const Color& color);
+    void line(int x0, int y0, int x1, int y1, const Color& color);
+    void rect(int x, int y, int width, int height, const Color& color);
+    void fillRect(int x, int y, int width, int height, const Color& color);
+    void roundRect(int x, int y, int width, int height, int radius, const Color& color);
+    void fillRoundRect(int x, int y, int width, int height, int radius, const Color& color);
+    void ellipse(int cx, int cy, int rx, int ry, const Color& color);
+    void fillEllipse(int cx, int cy, int rx, int ry, const Color& color);
+    void polyline(const std::vector<std::pair<int, int>>& points, const Color& color);
+    void polygon(const std::vector<std::pair<int, int>>& points, const Color& color);
+    void fillPolygon(const std::vector<std::pair<int, int>>& points, const Color& color);
+    void circle(int cx, int cy, int radius, const Color& color);
+    void fillCircle(int cx, int cy, int radius, const Color& color);
+    void arc(int cx, int cy, int radius, float startRadians, float endRadians, const Color& color, bool counterclockwise = false);
+    void beginPath();
+    void moveTo(float x, float y);
+    void lineTo(float x, float y);
+    void quadraticCurveTo(float cx, float cy, float x, float y);
+    void bezierCurveTo(float cx1, float cy1, float cx2, float cy2, float x, float y);
+    void closePath();
+    void stroke(const Color& color);
+    void fillPath(const Color& color);
+
+    std::size_t size() const { return m_commands.size(); }
+    bool empty() const { return m_commands.empty(); }
+    void clear();
+
+    // Draws the commands in order. threads follows parallelFor; lists
+    // covering few pixels draw in one pass.
+    void replay(ImageBuffer& image, int threads = 0) const;
+    void replay(MaskBuffer& mask, int threads = 0) const;
+
+private:
+    enum class Kind {
+        Fill,
+        Line,
+        Rect,
+        FillRect,
+        RoundRect,
+        FillRoundRect,
+        Ellipse,
+        FillEllipse,
+        Polyline,
+        Polygon,
+        FillPolygon,
+        Circle,
+        FillCircle,
+        Arc,
+        Stroke,
+        FillPath,
+    };
+
+    struct PathStep {
+        enum class Verb {
+            Move,
+            Line,
+            Quadratic,
+            Cubic,
+            Close,
+        };
+        Verb verb;
+        float values[6];
+    };
+
+    struct Style {
+        int lineWidth = 1;
+        LineCap cap = LineCap::Butt;
+        LineJoin join = LineJoin::Miter;
+        float miterLimit = 10.0f;
+        FillRule fillRule = FillRule::EvenOdd;
+        bool antialias = false;
+        std::uint8_t alpha = 255;
+        BufferTarget::Blend blend = BufferTarget::Blend::Over;
+    };
+
+    struct Command {
+        Kind kind;
+        Style style;
+        Color color;
+        int values[5] = {0, 0, 0, 0, 0};
+        float angles[2] = {0.0f, 0.0f};
+        bool counterclockwise = false;
+        std::vector<std::pair<int, int>> points;
+        std::vector<PathStep> path;
+        // Conservative, possibly outside the target.
+        DrawClip bounds;
+    };
+
+    Command& record(Kind kind, const Color& color, const DrawClip& bounds);
+    void addPathStep(PathStep::Verb verb, std::initializer_list<float> values);
+    // Margin around outlines and stroked paths for the current style.
+    float strokeReach() const;
+
+    template <typename Target>
+    void replayOnto(const Target& target, int threads) const;
+    template <typename Target>
+    static void play(BasicDrawable<Target>& drawable, const Command& command);
+
+    Style m_style;
+    std::vector<PathStep> m_path;
+    std::vector<Command> m_commands;
+};
+
+#endif
@@ -0,0 +1,168 @@
+#ifndef DRAW_TARGET_H
+#define DRAW_TARGET_H
+
+#include "drawable.h"
+#include "layer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+// Layer pixels as a draw target, written a row span at a time. The paint
+// alpha applies to every color drawn: Over blends source-over, so a
+// translucent color tints what is below, and Copy replaces the pixels
+// with the color at that alpha. Antialiased edges scale the alpha by
+// coverage (Over) or mix toward the painted pixel (Copy).
+class BufferTarget {
+public:
+    enum class Blend {
+        Over,
+        Copy,
+    };
+
+    explicit BufferTarget(ImageBuffer& buffer, std::uint8_t alpha = 255, Blend blend = Blend::Over)
+        : BufferTarget(buffer.view(), alpha, blend) {}
+    // Views let several targets draw disjoint clips of one buffer at once.
+    explicit BufferTarget(const ImageView& view, std::uint8_t alpha = 255, Blend blend = Blend::Over)
+        : m_view(view), m_clip{0, 0, view.width(), view.height()}, m_alpha(alpha), m_blend(blend) {}
+
+    int width() const { return m_view.width(); }
+    int height() const { return m_view.height(); }
+    DrawClip clip() const { return m_clip; }
+    // Narrows drawing to a rect inside the buffer.
+    void setClip(const DrawClip& clip) { m_clip = clip; }
+    void setAlpha(std::uint8_t alpha) { m_alpha = alpha; }
+    void setBlend(Blend blend) { m_blend = blend; }
+
+    Color getPixel(int x, int y) const {
+        const PixelRGBA8& p = m_view.at(x, y);
+        return Color(p.r, p.g, p.b);
+    }
+
+    void setPixel(int x, int y, const Color& color) {
+        if (x >= m_clip.left && y >= m_clip.top && x < m_clip.right && y < m_clip.bottom) {
+            paint(m_view.row(y) + x, 1, color, 1.0f);
+        }
+    }
+
+    void fillSpan(int y, int x0, int x1, const Color& color, float coverage) {
+        if (y < m_clip.top || y >= m_clip.bottom) {
+            return;
+        }
+        x0 = std::max(x0, m_clip.left);
+        x1 = std::min(x1, m_clip.right);
+        if (x0 < x1) {
+            paint(m_view.row(y) + x0, x1 - x0, color, coverage);
+        }
+    }
+
+private:
+    void paint(PixelRGBA8* pixels, int count, const Color& color, float coverage) {
+        if (m_blend == Blend::Copy) {
+            const PixelRGBA8 source(color.r, color.g, color.b, m_alpha);
+            if (coverage >= 1.0f) {
+                std::fill(pixels, pixels + count, source);
+                return;
+            }
+            const int weight = static_cast<int>(std::lround(coverage * 255.0f));
+            const auto mix = [weight](int s, int d) { return static_cast<std::uint8_t>((s * weight + d * (255 - weight) + 127) / 255); };
+            for (int i = 0; i < count; ++i) {
+                PixelRGBA8& d = pixels[i];
+                d = PixelRGBA8(mix(source.r, d.r), mix(source.g, d.g), mix(source.b, d.b), mix(source.a, d.a));
+            }
+            return;
+        }
+        const int alpha = coverage >= 1.0f ? m_alpha : static_cast<int>(std::lround(coverage * static_cast<float>(m_alpha)));
+        if (alpha <= 0) {
+            return;
+        }
+        if (alpha == 255) {
+            std::fill(pixels, pixels + count, PixelRGBA8(color.r, color.g, color.b, 255));
+            return;
+        }
+        const int inverse = 255 - alpha;
+        for (int i = 0; i < count; ++i) {
+            PixelRGBA8& d = pixels[i];
+            if (d.a == 255) {
+                const auto mix = [alpha, inverse](int s, int dc) { return static_cast<std::uint8_t>((s * alpha + dc * inverse + 127) / 255); };
+                d = PixelRGBA8(mix(color.r, d.r), mix(color.g, d.g), mix(color.b, d.b), 255);
+                continue;
+            }
+            // Non-premultiplied over: weights alpha and d.a * (1 - alpha),
+            // both scaled by 255.
+            const int below = d.a * inverse;
+            const int total = alpha * 255 + below;
+            const auto mix = [alpha, below, total](int s, int dc) {
+                return static_cast<std::uint8_t>((s * alpha * 255 + dc * below + total / 2) / total);
+            };
+            d = PixelRGBA8(mix(color.r, d.r), mix(color.g, d.g), mix(color.b, d.b), static_cast<std::uint8_t>((total + 127) / 255));
+        }
+    }
+
+    ImageView m_view;
+    DrawClip m_clip;
+    std::uint8_t m_alpha;
+    Blend m_blend;
+};
+
+// Mask coverage as a draw target. A color paints the coverage the mask
+// stores for it at the paint alpha (luma times alpha); reads return that
+// coverage as gray, and antialiased edges mix toward it.
+class MaskTarget {
+public:
+    explicit MaskTarget(MaskBuffer& mask, std::uint8_t alpha = 255) : MaskTarget(mask.view(), alpha) {}
+    explicit MaskTarget(const CoverageView& view, std::uint8_t alpha = 255)
+        : m_view(view), m_clip{0, 0, view.width(), view.height()}, m_alpha(alpha) {}
+
+    int width() const { return m_view.width(); }
+    int height() const { return m_view.height(); }
+    DrawClip clip() const { return m_clip; }
+    void setClip(const DrawClip& clip) { m_clip = clip; }
+    void setAlpha(std::uint8_t alpha) { m_alpha = alpha; }
+
+    Color getPixel(int x, int y) const {
+        const std::uint8_t c = m_view.at(x, y);
+        return Color(c, c, c);
+    }
+
+    void setPixel(int x, int y, const Color& color) {
+        if (x >= m_clip.left && y >= m_clip.top && x < m_clip.right && y < m_clip.bottom) {
+            m_view.at(x, y) = coverageOf(color);
+        }
+    }
+
+    void fillSpan(int y, int x0, int x1, const Color& color, float coverage) {
+        if (y < m_clip.top || y >= m_clip.bottom) {
+            return;
+        }
+        x0 = std::max(x0, m_clip.left);
+        x1 = std::min(x1, m_clip.right);
+        if (x0 >= x1) {
+            return;
+        }
+        std::uint8_t* row = m_view.row(y);
+        const int value = coverageOf(color);
+        if (coverage >= 1.0f) {
+            std::fill(row + x0, row + x1, static_cast<std::uint8_t>(value));
+            return;
+        }
+        const int weight = static_cast<int>(std::lround(coverage * 255.0f));
+        for (int x = x0; x < x1; ++x) {
+            row[x] = static_cast<std::uint8_t>((value * weight + row[x] * (255 - weight) + 127) / 255);
+        }
+    }
+
+private:
+    std::uint8_t coverageOf(const Color& color) const {
+        return MaskBuffer::coverageFromPixel(PixelRGBA8(color.r, color.g, color.b, m_alpha));
+    }
+
+    CoverageView m_view;
+    DrawClip m_clip;
+    std::uint8_t m_alpha;
+};
+
+using BufferDrawable = BasicDrawable<BufferTarget>;
+using MaskDrawable = BasicDrawable<MaskTarget>;
+
+#endif
@@ -1,8 +1,11 @@
 #include "drawable.h"
 
+#include "draw_target.h"
+#include "flood_fill.h"
+
 #include <algorithm>
 #include <cmath>
-#include <deque>
+#include <utility>
 #include <vector>
 
 namespace {
@@ -67,27 +70,69 @@ std::vector<std::pair<int, int>> buildRoundedRectContour(int left, int top, int
     appendArc(tlCx, tlCy, pi, pi * 1.5f);
     return points;
 }
+
+using Contour = std::vector<std::pair<float, float>>;
+
+void addContour(std::vector<Contour>& contours, Contour contour) {
+    // Stroke pieces overlap; giving them all the same winding lets one
+    // nonzero fill take their union.
+    double area = 0.0;
+    for (std::size_t i = 0; i < contour.size(); ++i) {
+        const auto& a = contour[i];
+        const auto& b = contour[(i + 1) % contour.size()];
+        area += static_cast<double>(a.first) * b.second - static_cast<double>(b.first) * a.second;
+    }
+    if (area < 0.0) {
+        std::reverse(contour.begin(), contour.end());
+    }
+    contours.push_back(std::move(contour));
+}
+
+void addDisc(std::vector<Contour>& contours, float cx, float cy, float radius) {
+    const float twoPi = 6.28318530717958647692f;
+    const int steps = std::max(8, static_cast<int>(std::ceil(twoPi * radius / 2.0f)));
+    Contour disc;
+    disc.reserve(static_cast<std::size_t>(steps));
+    for (int i = 0; i < steps; ++i) {
+        const float angle = twoPi * static_cast<float>(i) / static_cast<float>(steps);
+        disc.push_back({cx + radius * std::cos(angle), cy + radius * std::sin(angle)});
+    }
+    addContour(contours, std::move(disc));
+}
+
 } // namespace
 
-Drawable::Drawable(Image& image) : m_image(image) {}
+template <typename Target>
+BasicDrawable<Target>::BasicDrawable(Target target) : m_target(std::move(target)) {}
 
-void Drawable::setPixel(int x, int y, const Color& color) {
-    m_image.setPixel(x, y, color);
+template <typename Target>
+void BasicDrawable<Target>::setPixel(int x, int y, const Color& color) {
+    m_target.setPixel(x, y, color);
 }
 
-const Color& Drawable::getPixel(int x, int y) const {
-    return m_image.getPixel(x, y);
+template <typename Target>
+Color BasicDrawable<Target>::getPixel(int x, int y) const {
+    return m_target.getPixel(x, y);
 }
 
-void Drawable::fill(const Color& color) {
-    for (int y = 0; y < m_image.height(); ++y) {
-        for (int x = 0; x < m_image.width(); ++x) {
-            m_image.setPixel(x, y, color);
-        }
+template <typename Target>
+void BasicDrawable<Target>::fill(const Color& color) {
+    const DrawClip clip = m_target.clip();
+    for (int y = clip.top; y < clip.bottom; ++y) {
+        m_target.fillSpan(y, clip.left, clip.right, color, 1.0f);
     }
 }
 
-void Drawable::line(int x0, int y0, int x1, int y1, const Color& color) {
+template <typename Target>
+void BasicDrawable<Target>::line(int x0, int y0, int x1, int y1, const Color& color) {
+    linePixels(x0, y0, x1, y1, color, false, false);
+}
+
+template <typename Target>
+void BasicDrawable<Target>::linePixels(int x0, int y0, int x1, int y1, const Color& color, bool skipFirst, bool skipLast) {
+    const int endX = x1;
+    const int endY = y1;
+    bool first = true;
     int dx = std::abs(x1 - x0);
     int sx = x0 < x1 ? 1 : -1;
     int dy = -std::abs(y1 - y0);
@@ -95,10 +140,14 @@ void Drawable::line(int x0, int y0, int x1, int y1, const Color& color) {
     int err = dx + dy;
 
     while (true) {
-        m_image.setPixel(x0, y0, color);
-        if (x0 == x1 && y0 == y1) {
+        const bool last = x0 == endX && y0 == endY;
+        if (!(first && skipFirst) && !(last && skipLast)) {
+            m_target.setPixel(x0, y0, color);
+        }
+        if (last) {
             break;
         }
+        first = false;
         const int e2 = 2 * err;
         if (e2 >= dy) {
             err += dy;
@@ -111,17 +160,20 @@ void Drawable::line(int x0, int y0, int x1, int y1, const Color& color) {
     }
 }
 
-void Drawable::beginPath() {
+template <typename Target>
+void BasicDrawable<Target>::beginPath() {
     m_path.clear();
 }
 
-void Drawable::moveTo(float x, float y) {
+template <typename Target>
+void BasicDrawable<Target>::moveTo(float x, float y) {
     SubPath sub;
     sub.points.push_back({x, y});
     m_path.push_back(sub);
 }
 
-void Drawable::lineTo(float x, float y) {
+template <typename Target>
+void BasicDrawable<Target>::lineTo(float x, float y) {
     if (m_path.empty()) {
         moveTo(x, y);
         return;
@@ -133,7 +185,8 @@ void Drawable::lineTo(float x, float y) {
     m_path.back().points.push_back({x, y});
 }
 
-void Drawable::quadraticCurveTo(float cx, float cy, float x, float y) {
+template <typename Target>
+void BasicDrawable<Target>::quadraticCurveTo(float cx, float cy, float x, float y) {
     if (m_path.empty() || m_path.back().points.empty() || m_path.back().closed) {
         moveTo(x, y);
         return;
@@ -151,7 +204,8 @@ void Drawable::quadraticCurveTo(float cx, float cy, float x, float y) {
     }
 }
 
-void Drawable::bezierCurveTo(float cx1, float cy1, float cx2, float cy2, float x, float y) {
+template <typename Target>
+void BasicDrawable<Target>::bezierCurveTo(float cx1, float cy1, float cx2, float cy2, float x, float y) {
     if (m_path.empty() || m_path.back().points.empty() || m_path.back().closed) {
         moveTo(x, y);
         return;
@@ -175,7 +229,8 @@ void Drawable::bezierCurveTo(float cx1, float cy1, float cx2, float cy2, float x
     }
 }
 
-void Drawable::closePath() {
+template <typename Target>
+void BasicDrawable<Target>::closePath() {
     if (m_path.empty()) {
         return;
     }
@@ -192,120 +247,195 @@ void Drawable::closePath() {
     sub.closed = true;
 }
 
-void Drawable::setLineWidth(int width) {
+template <typename Target>
+void BasicDrawable<Target>::setLineWidth(int width) {
     m_lineWidth = std::max(1, width);
 }
 
-void Drawable::setLineCap(LineCap cap) {
+template <typename Target>
+void BasicDrawable<Target>::setLineCap(LineCap cap) {
     m_lineCap = cap;
 }
 
-void Drawable::setLineJoin(LineJoin join) {
+template <typename Target>
+void BasicDrawable<Target>::setLineJoin(LineJoin join) {
     m_lineJoin = join;
 }
 
-void Drawable::setMiterLimit(float limit) {
+template <typename Target>
+void BasicDrawable<Target>::setMiterLimit(float limit) {
     m_miterLimit = std::max(1.0f, limit);
 }
 
-void Drawable::strokeSegment(float x0, float y0, float x1, float y1, const Color& color) {
-    if (m_lineWidth <= 1) {
-        line(static_cast<int>(std::lround(x0)),
-             static_cast<int>(std::lround(y0)),
-             static_cast<int>(std::lround(x1)),
-             static_cast<int>(std::lround(y1)),
-             color);
-        return;
-    }
+template <typename Target>
+void BasicDrawable<Target>::setFillRule(FillRule rule) {
+    m_fillRule = rule;
+}
 
-    const float dx = x1 - x0;
-    const float dy = y1 - y0;
-    const float len = std::sqrt(dx * dx + dy * dy);
-    if (len <= 0.0001f) {
-        fillCircle(static_cast<int>(std::lround(x0)), static_cast<int>(std::lround(y0)), m_lineWidth / 2, color);
+template <typename Target>
+void BasicDrawable<Target>::setAntialias(bool enabled) {
+    m_antialias = enabled;
+}
+
+template <typename Target>
+void BasicDrawable<Target>::fillEdges(std::vector<RasterEdge>& edges, FillRule rule, const Color& color, RasterSampling aliased) {
+    if (edges.empty()) {
         return;
     }
-
-    const float ux = dx / len;
-    const float uy = dy / len;
-    const float px = -uy;
-    const float py = ux;
-    const float half = static_cast<float>(m_lineWidth - 1) * 0.5f;
-
-    float sx0 = x0;
-    float sy0 = y0;
-    float sx1 = x1;
-    float sy1 = y1;
-    if (m_lineCap == LineCap::Square) {
-        sx0 -= ux * half;
-        sy0 -= uy * half;
-        sx1 += ux * half;
-        sy1 += uy * half;
+    double minY = edges.front().y0;
+    double maxY = edges.front().y1;
+    for (const RasterEdge& edge : edges) {
+        minY = std::min(minY, edge.y0);
+        maxY = std::max(maxY, edge.y1);
     }
+    const DrawClip clip = m_target.clip();
+    const int top = static_cast<int>(std::max(static_cast<double>(clip.top), std::floor(minY)));
+    const int bottom = static_cast<int>(std::min(static_cast<double>(clip.bottom), std::ceil(maxY)));
+    ScanlineRasterizer::sortEdges(edges.data(), edges.size());
+    m_rasterizer.rasterize(edges.data(), edges.size(), rule, m_antialias ? RasterSampling::Coverage : aliased, top, bottom, clip.left, clip.right,
+                           [this, &color](int y, const std::vector<CoverageSpan>& spans) {
+                               for (const CoverageSpan& span : spans) {
+                                   m_target.fillSpan(y, span.x, span.x + span.length, color, span.coverage);
+                               }
+                           });
+}
 
-    for (int i = 0; i < m_lineWidth; ++i) {
-        const float offset = static_cast<float>(i) - half;
-        line(static_cast<int>(std::lround(sx0 + px * offset)),
-             static_cast<int>(std::lround(sy0 + py * offset)),
-             static_cast<int>(std::lround(sx1 + px * offset)),
-             static_cast<int>(std::lround(sy1 + py * offset)),
-             color);
-    }
+template <typename Target>
+template <typename Point>
+void BasicDrawable<Target>::addFillEdges(std::vector<RasterEdge>& edges, const std::vector<Point>& points) const {
+    const double shift = m_antialias ? 0.5 : 0.0;
+    addPolygonEdges(edges, points, shift, shift);
+}
 
-    if (m_lineCap == LineCap::Round) {
-        fillCircle(static_cast<int>(std::lround(x0)), static_cast<int>(std::lround(y0)), m_lineWidth / 2, color);
-        fillCircle(static_cast<int>(std::lround(x1)), static_cast<int>(std::lround(y1)), m_lineWidth / 2, color);
+template <typename Target>
+void BasicDrawable<Target>::stroke(const Color& color) {
+    if (m_lineWidth <= 1) {
+        for (const SubPath& sub : m_path) {
+            for (std::size_t i = 1; i < sub.points.size(); ++i) {
+                linePixels(static_cast<int>(std::lround(sub.points[i - 1].first)), static_cast<int>(std::lround(sub.points[i - 1].second)),
+                           static_cast<int>(std::lround(sub.points[i].first)), static_cast<int>(std::lround(sub.points[i].second)), color, i > 1,
+                           sub.closed && i + 1 == sub.points.size() && sub.points.size() > 2);
+            }
+        }
+        return;
     }
-}
 
-void Drawable::stroke(const Color& color) {
+    // Wide strokes become outline polygons (a quad per segment plus joins
+    // and caps) that are filled together, so each pixel is written once.
+    const float half = static_cast<float>(m_lineWidth) * 0.5f;
+    std::vector<Contour> contours;
     for (const SubPath& sub : m_path) {
         if (sub.points.size() < 2) {
             continue;
         }
-        for (std::size_t i = 1; i < sub.points.size(); ++i) {
-            strokeSegment(sub.points[i - 1].first, sub.points[i - 1].second,
-                          sub.points[i].first, sub.points[i].second, color);
+        Contour points;
+        for (const auto& p : sub.points) {
+            if (points.empty() || std::hypot(p.first - points.back().first, p.second - points.back().second) > 1e-4f) {
+                points.push_back(p);
+            }
+        }
+        const bool closed = sub.closed && points.size() > 2;
+        if (closed && std::hypot(points.front().first - points.back().first, points.front().second - points.back().second) <= 1e-4f) {
+            points.pop_back();
+        }
+        // A zero-length segment still shows its caps.
+        if (points.size() == 1) {
+            if (m_lineCap == LineCap::Round) {
+                addDisc(contours, points[0].first, points[0].second, half);
+            } else if (m_lineCap == LineCap::Square) {
+                const float x = points[0].first;
+                const float y = points[0].second;
+                addContour(contours, {{x - half, y - half}, {x + half, y - half}, {x + half, y + half}, {x - half, y + half}});
+            }
+            continue;
         }
 
-        if (m_lineWidth > 1 && sub.points.size() > 2) {
-            const std::size_t joinEnd = sub.closed ? sub.points.size() - 1 : sub.points.size() - 2;
-            for (std::size_t i = 1; i <= joinEnd; ++i) {
-                const auto& p = sub.points[i];
-                const int jx = static_cast<int>(std::lround(p.first));
-                const int jy = static_cast<int>(std::lround(p.second));
-                if (m_lineJoin == LineJoin::Round) {
-                    fillCircle(jx, jy, m_lineWidth / 2, color);
-                } else if (m_lineJoin == LineJoin::Bevel) {
-                    const int side = std::max(1, m_lineWidth / 2);
-                    fillRect(jx - side, jy - side, side * 2 + 1, side * 2 + 1, color);
-                } else {
-                    (void)m_miterLimit;
+        const std::size_t segmentCount = closed ? points.size() : points.size() - 1;
+        std::vector<std::pair<float, float>> directions(segmentCount);
+        for (std::size_t i = 0; i < segmentCount; ++i) {
+            const auto& a = points[i];
+            const auto& b = points[(i + 1) % points.size()];
+            const float length = std::hypot(b.first - a.first, b.second - a.second);
+            directions[i] = {(b.first - a.first) / length, (b.second - a.second) / length};
+        }
+
+        for (std::size_t i = 0; i < segmentCount; ++i) {
+            auto a = points[i];
+            auto b = points[(i + 1) % points.size()];
+            const float ux = directions[i].first;
+            const float uy = directions[i].second;
+            if (!closed && m_lineCap == LineCap::Square) {
+                if (i == 0) {
+                    a = {a.first - ux * half, a.second - uy * half};
                 }
+                if (i + 1 == segmentCount) {
+                    b = {b.first + ux * half, b.second + uy * half};
+                }
+            }
+            const float nx = -uy * half;
+            const float ny = ux * half;
+            addContour(contours, {{a.first + nx, a.second + ny}, {b.first + nx, b.second + ny}, {b.first - nx, b.second - ny}, {a.first - nx, a.second - ny}});
+        }
+
+        const std::size_t firstJoin = closed ? 0 : 1;
+        for (std::size_t i = firstJoin; i < points.size() - (closed ? 0 : 1); ++i) {
+            const auto& p = points[i];
+            const auto& in = directions[(i + segmentCount - 1) % segmentCount];
+            const auto& out = directions[i % segmentCount];
+            const float cross = in.first * out.second - in.second * out.first;
+            if (m_lineJoin == LineJoin::Round) {
+                addDisc(contours, p.first, p.second, half);
+                continue;
+            }
+            if (std::fabs(cross) < 1e-6f && in.first * out.first + in.second * out.second > 0.0f) {
+                continue;
+            }
+            // The outer side of the turn is where the segment quads leave a
+            // notch; fill it with a bevel triangle or a miter.
+            const float side = cross > 0.0f ? -1.0f : 1.0f;
+            const std::pair<float, float> n0 = {-in.second * side, in.first * side};
+            const std::pair<float, float> n1 = {-out.second * side, out.first * side};
+            const std::pair<float, float> e0 = {p.first + n0.first * half, p.second + n0.second * half};
+            const std::pair<float, float> e1 = {p.first + n1.first * half, p.second + n1.second * half};
+            const float sumX = n0.first + n1.first;
+            const float sumY = n0.second + n1.second;
+            const float sumLength = std::hypot(sumX, sumY);
+            // The miter reaches 1/cos(turn/2) = 2/|n0 + n1| half widths out.
+            if (m_lineJoin == LineJoin::Miter && sumLength > 1e-6f && 2.0f / sumLength <= m_miterLimit) {
+                const float reach = half * 2.0f / (sumLength * sumLength);
+                addContour(contours, {p, e0, {p.first + sumX * reach, p.second + sumY * reach}, e1});
+            } else {
+                addContour(contours, {p, e0, e1});
             }
         }
+
+        if (!closed && m_lineCap == LineCap::Round) {
+            addDisc(contours, points.front().first, points.front().second, half);
+            addDisc(contours, points.back().first, points.back().second, half);
+        }
+    }
+    // Pixel centers sit on integer coordinates here, as for line().
+    std::vector<RasterEdge> edges;
+    for (const Contour& contour : contours) {
+        addPolygonEdges(edges, contour, 0.5, 0.5);
     }
+    fillEdges(edges, FillRule::NonZero, color);
 }
 
-void Drawable::fillPath(const Color& color) {
+template <typename Target>
+void BasicDrawable<Target>::fillPath(const Color& color) {
+    // Subpaths fill together, so inner ones can cut holes by the fill rule.
+    std::vector<RasterEdge> edges;
     for (const SubPath& sub : m_path) {
-        if (sub.points.size() < 3) {
-            continue;
+        if (sub.points.size() >= 3) {
+            addFillEdges(edges, sub.points);
         }
-        std::vector<std::pair<int, int>> polygonPoints;
-        polygonPoints.reserve(sub.points.size());
-        for (const auto& p : sub.points) {
-            polygonPoints.push_back({static_cast<int>(std::lround(p.first)),
-                                     static_cast<int>(std::lround(p.second))});
-        }
-        if (polygonPoints.front() != polygonPoints.back()) {
-            polygonPoints.push_back(polygonPoints.front());
-        }
-        fillPolygon(polygonPoints, color);
     }
+    fillEdges(edges, m_fillRule, color, RasterSampling::Inclusive);
 }
 
-void Drawable::rect(int x, int y, int width, int height, const Color& color) {
+template <typename Target>
+void BasicDrawable<Target>::rect(int x, int y, int width, int height, const Color& color) {
     int left = 0;
     int top = 0;
     int right = 0;
@@ -314,13 +444,18 @@ void Drawable::rect(int x, int y, int width, int height, const Color& color) {
         return;
     }
 
-    line(left, top, right, top, color);
-    line(right, top, right, bottom, color);
-    line(right, bottom, left, bottom, color);
-    line(left, bottom, left, top, color);
+    if (left == right || top == bottom) {
+        line(left, top, right, bottom, color);
+        return;
+    }
+    linePixels(left, top, right, top, color, false, false);
+    linePixels(right, top, right, bottom, color, true, false);
+    linePixels(right, bottom, left, bottom, color, true, false);
+    linePixels(left, bottom, left, top, color, true, true);
 }
 
-void Drawable::fillRect(int x, int y, int width, int height, const Color& color) {
+template <typename Target>
+void BasicDrawable<Target>::fillRect(int x, int y, int width, int height, const Color& color) {
     int left = 0;
     int top = 0;
     int right = 0;
@@ -330,13 +465,12 @@ void Drawable::fillRect(int x, int y, int width, int height, const Color& color)
     }
 
     for (int py = top; py <= bottom; ++py) {
-        for (int px = left; px <= right; ++px) {
-            m_image.setPixel(px, py, color);
-        }
+        m_target.fillSpan(py, left, right + 1, color, 1.0f);
     }
 }
 
-void Drawable::roundRect(int x, int y, int width, int height, int radius, const Color& color) {
+template <typename Target>
+void BasicDrawable<Target>::roundRect(int x, int y, int width, int height, int radius, const Color& color) {
     int left = 0;
     int top = 0;
     int right = 0;
@@ -356,7 +490,8 @@ void Drawable::roundRect(int x, int y, int width, int height, int radius, const
     polygon(contour, color);
 }
 
-void Drawable::fillRoundRect(int x, int y, int width, int height, int radius, const Color& color) {
+template <typename Target>
+void BasicDrawable<Target>::fillRoundRect(int x, int y, int width, int height, int radius, const Color& color) {
     int left = 0;
     int top = 0;
     int right = 0;
@@ -376,12 +511,30 @@ void Drawable::fillRoundRect(int x, int y, int width, int height, int radius, co
     fillPolygon(contour, color);
 }
 
-void Drawable::ellipse(int cx, int cy, int rx, int ry, const Color& color) {
+// Pixel-center ellipse fills reach about half a pixel past the radius, so
+// antialiased ones outline rx + 0.5 by ry + 0.5.
+template <typename Target>
+void BasicDrawable<Target>::fillEllipseOutline(float cx, float cy, float rx, float ry, const Color& color) {
+    const float twoPi = 6.28318530717958647692f;
+    const int steps = std::clamp(static_cast<int>(std::ceil(twoPi * std::max(rx, ry) / 2.0f)), 16, 1024);
+    Contour outline;
+    outline.reserve(static_cast<std::size_t>(steps));
+    for (int i = 0; i < steps; ++i) {
+        const float angle = twoPi * static_cast<float>(i) / static_cast<float>(steps);
+        outline.push_back({cx + rx * std::cos(angle), cy + ry * std::sin(angle)});
+    }
+    std::vector<RasterEdge> edges;
+    addPolygonEdges(edges, outline, 0.5, 0.5);
+    fillEdges(edges, FillRule::NonZero, color);
+}
+
+template <typename Target>
+void BasicDrawable<Target>::ellipse(int cx, int cy, int rx, int ry, const Color& color) {
     if (rx < 0 || ry < 0) {
         return;
     }
     if (rx == 0 && ry == 0) {
-        m_image.setPixel(cx, cy, color);
+        m_target.setPixel(cx, cy, color);
         return;
     }
     if (ry == 0) {
@@ -401,18 +554,24 @@ void Drawable::ellipse(int cx, int cy, int rx, int ry, const Color& color) {
         const float t = twoPi * static_cast<float>(i) / static_cast<float>(steps);
         const int x = static_cast<int>(std::lround(cx + static_cast<float>(rx) * std::cos(t)));
         const int y = static_cast<int>(std::lround(cy + static_cast<float>(ry) * std::sin(t)));
-        line(prevX, prevY, x, y, color);
+        // The last piece closes onto the first pixel drawn.
+        linePixels(prevX, prevY, x, y, color, i > 1, i == steps);
         prevX = x;
         prevY = y;
     }
 }
 
-void Drawable::fillEllipse(int cx, int cy, int rx, int ry, const Color& color) {
+template <typename Target>
+void BasicDrawable<Target>::fillEllipse(int cx, int cy, int rx, int ry, const Color& color) {
     if (rx < 0 || ry < 0) {
         return;
     }
+    if (m_antialias) {
+        fillEllipseOutline(static_cast<float>(cx), static_cast<float>(cy), rx + 0.5f, ry + 0.5f, color);
+        return;
+    }
     if (rx == 0 && ry == 0) {
-        m_image.setPixel(cx, cy, color);
+        m_target.setPixel(cx, cy, color);
         return;
     }
     if (ry == 0) {
@@ -428,83 +587,47 @@ void Drawable::fillEllipse(int cx, int cy, int rx, int ry, const Color& color) {
         const float t = static_cast<float>(dy) / static_cast<float>(ry);
         const float span = static_cast<float>(rx) * std::sqrt(std::max(0.0f, 1.0f - t * t));
         const int xSpan = static_cast<int>(std::floor(span + 0.5f));
-        for (int dx = -xSpan; dx <= xSpan; ++dx) {
-            m_image.setPixel(cx + dx, cy + dy, color);
-        }
+        m_target.fillSpan(cy + dy, cx - xSpan, cx + xSpan + 1, color, 1.0f);
     }
 }
 
-void Drawable::polyline(const std::vector<std::pair<int, int>>& points, const Color& color) {
+template <typename Target>
+void BasicDrawable<Target>::polyline(const std::vector<std::pair<int, int>>& points, const Color& color) {
     if (points.size() < 2) {
         return;
     }
     for (std::size_t i = 1; i < points.size(); ++i) {
-        line(points[i - 1].first, points[i - 1].second, points[i].first, points[i].second, color);
+        linePixels(points[i - 1].first, points[i - 1].second, points[i].first, points[i].second, color, i > 1, false);
     }
 }
 
-void Drawable::polygon(const std::vector<std::pair<int, int>>& points, const Color& color) {
+template <typename Target>
+void BasicDrawable<Target>::polygon(const std::vector<std::pair<int, int>>& points, const Color& color) {
     if (points.size() < 2) {
         return;
     }
     polyline(points, color);
-    line(points.back().first, points.back().second, points.front().first, points.front().second, color);
+    linePixels(points.back().first, points.back().second, points.front().first, points.front().second, color, true, points.size() > 2);
 }
 
-void Drawable::fillPolygon(const std::vector<std::pair<int, int>>& points, const Color& color) {
+template <typename Target>
+void BasicDrawable<Target>::fillPolygon(const std::vector<std::pair<int, int>>& points, const Color& color) {
     if (points.size() < 3) {
         return;
     }
-
-    int minY = points.front().second;
-    int maxY = points.front().second;
-    for (const auto& p : points) {
-        minY = std::min(minY, p.second);
-        maxY = std::max(maxY, p.second);
-    }
-
-    for (int y = minY; y <= maxY; ++y) {
-        const double scanY = static_cast<double>(y) + 0.5;
-        std::vector<double> intersections;
-        intersections.reserve(points.size());
-
-        for (std::size_t i = 0; i < points.size(); ++i) {
-            const auto& a = points[i];
-            const auto& b = points[(i + 1) % points.size()];
-            if (a.second == b.second) {
-                continue;
-            }
-
-            const int edgeMinY = std::min(a.second, b.second);
-            const int edgeMaxY = std::max(a.second, b.second);
-            if (!(scanY >= static_cast<double>(edgeMinY) && scanY < static_cast<double>(edgeMaxY))) {
-                continue;
-            }
-
-            const double t = (scanY - static_cast<double>(a.second)) /
-                             static_cast<double>(b.second - a.second);
-            const double x = static_cast<double>(a.first) + t * static_cast<double>(b.first - a.first);
-            intersections.push_back(x);
-        }
-
-        std::sort(intersections.begin(), intersections.end());
-        for (std::size_t i = 0; i + 1 < intersections.size(); i += 2) {
-            const int xStart = static_cast<int>(std::ceil(intersections[i]));
-            const int xEnd = static_cast<int>(std::floor(intersections[i + 1]));
-            for (int x = xStart; x <= xEnd; ++x) {
-                m_image.setPixel(x, y, color);
-            }
-        }
-    }
+    std::vector<RasterEdge> edges;
+    addFillEdges(edges, points);
+    fillEdges(edges, m_fillRule, color, RasterSampling::Inclusive);
 }
 
-void Drawable::floodFill(int x, int y, const Color& color, int tolerance) {
-    if (!m_image.inBounds(x, y)) {
+template <typename Target>
+void BasicDrawable<Target>::floodFill(int x, int y, const Color& color, int tolerance) {
+    if (x < 0 || y < 0 || x >= m_target.width() || y >= m_target.height()) {
         return;
     }
 
     const int clampedTolerance = std::max(0, std::min(255, tolerance));
-    const Color seed = m_image.getPixel(x, y);
+    const Color seed = m_target.getPixel(x, y);
     if (seed.r == color.r && seed.g == color.g && seed.b == color.b) {
         return;
     }
@@ -516,56 +639,28 @@ void Drawable::floodFill(int x, int y, const Color& color, int tolerance) {
         return std::max(dr, std::max(dg, db)) <= clampedTolerance;
     };
 
-    const int w = m_image.width();
-    const int h = m_image.height();
-    std::vector<std::uint8_t> visited(static_cast<std::size_t>(w) * static_cast<std::size_t>(h), 0);
-    auto indexOf = [w](int px, int py) {
-        return static_cast<std::size_t>(py) * static_cast<std::size_t>(w) + static_cast<std::size_t>(px);
-    };
-
-    std::deque<std::pair<int, int>> queue;
-    queue.push_back({x, y});
-    visited[indexOf(x, y)] = 1;
-
-    while (!queue.empty()) {
-        const auto [cx, cy] = queue.front();
-        queue.pop_front();
+    const auto matches = [this, &withinTolerance](int px, int py) { return withinTolerance(m_target.getPixel(px, py)); };
+    const auto fillSpan = [this, &color](int py, int x0, int x1) { m_target.fillSpan(py, x0, x1 + 1, color, 1.0f); };
+    detail::scanlineFloodFill(m_target.width(), m_target.height(), x, y, matches, fillSpan);
+}
 
-        const Color current = m_image.getPixel(cx, cy);
-        if (!withinTolerance(current)) {
-            continue;
+template <typename Target>
+void BasicDrawable<Target>::plotCircleOctants(int cx, int cy, int x, int y, const Color& color) {
+    // Mirror images coincide on the axes and diagonals; plot those once.
+    const int points[8][2] = {{x, y}, {-x, y}, {x, -y}, {-x, -y}, {y, x}, {-y, x}, {y, -x}, {-y, -x}};
+    for (int i = 0; i < 8; ++i) {
+        bool repeated = false;
+        for (int j = 0; j < i && !repeated; ++j) {
+            repeated = points[j][0] == points[i][0] && points[j][1] == points[i][1];
         }
-        m_image.setPixel(cx, cy, color);
-
-        const int offsets[4][2] = {{1, 0}, {-1, 0}, {0, 1}, {0, -1}};
-        for (const auto& offset : offsets) {
-            const int nx = cx + offset[0];
-            const int ny = cy + offset[1];
-            if (!m_image.inBounds(nx, ny)) {
-                continue;
-            }
-            const std::size_t idx = indexOf(nx, ny);
-            if (visited[idx] != 0) {
-                continue;
-            }
-            visited[idx] = 1;
-            queue.push_back({nx, ny});
+        if (!repeated) {
+            m_target.setPixel(cx + points[i][0], cy + points[i][1], color);
         }
     }
 }
 
-void Drawable::plotCircleOctants(int cx, int cy, int x, int y, const Color& color) {
-    m_image.setPixel(cx + x, cy + y, color);
-    m_image.setPixel(cx - x, cy + y, color);
-    m_image.setPixel(cx + x, cy - y, color);
-    m_image.setPixel(cx - x, cy - y, color);
-    m_image.setPixel(cx + y, cy + x, color);
-    m_image.setPixel(cx - y, cy + x, color);
-    m_image.setPixel(cx + y, cy - x, color);
-    m_image.setPixel(cx - y, cy - x, color);
-}
-
-void Drawable::circle(int cx, int cy, int radius, const Color& color) {
+template <typename Target>
+void BasicDrawable<Target>::circle(int cx, int cy, int radius, const Color& color) {
     if (radius < 0) {
         return;
     }
@@ -586,20 +681,24 @@ void Drawable::circle(int cx, int cy, int radius, const Color& color) {
     }
 }
 
-void Drawable::fillCircle(int cx, int cy, int radius, const Color& color) {
+template <typename Target>
+void BasicDrawable<Target>::fillCircle(int cx, int cy, int radius, const Color& color) {
     if (radius < 0) {
         return;
     }
+    if (m_antialias) {
+        fillEllipseOutline(static_cast<float>(cx), static_cast<float>(cy), radius + 0.5f, radius + 0.5f, color);
+        return;
+    }
 
     for (int y = -radius; y <= radius; ++y) {
         const int xSpan = static_cast<int>(std::sqrt(static_cast<float>(radius * radius - y * y)));
-        for (int x = -xSpan; x <= xSpan; ++x) {
-            m_image.setPixel(cx + x, cy + y, color);
-        }
+        m_target.fillSpan(cy + y, cx - xSpan, cx + xSpan + 1, color, 1.0f);
     }
 }
 
-void Drawable::arc(int cx, int cy, int radius, float startRadians, float endRadians, const Color& color, bool counterclockwise) {
+template <typename Target>
+void BasicDrawable<Target>::arc(int cx, int cy, int radius, float startRadians, float endRadians, const Color& color, bool counterclockwise) {
     if (radius <= 0) {
         return;
     }
@@ -624,8 +723,12 @@ void Drawable::arc(int cx, int cy, int radius, float startRadians, float endRadi
         const float angle = startRadians + sweep * t;
         const int x = static_cast<int>(std::lround(cx + radius * std::cos(angle)));
         const int y = static_cast<int>(std::lround(cy + radius * std::sin(angle)));
-        line(prevX, prevY, x, y, color);
+        linePixels(prevX, prevY, x, y, color, i > 1, false);
         prevX = x;
         prevY = y;
     }
 }
+
+template class BasicDrawable<ImageTarget>;
+template class BasicDrawable<BufferTarget>;
+template class BasicDrawable<MaskTarget>;
@@ -2,28 +2,87 @@
 #define DRAWABLE_H
 
 #include "image.h"
+#include "raster.h"
 
+#include <algorithm>
+#include <cmath>
 #include <utility>
 #include <vector>
 
-class Drawable {
+enum class LineCap {
+    Butt,
+    Round,
+    Square,
+};
+
+enum class LineJoin {
+    Miter,
+    Round,
+    Bevel,
+};
+
+// Pixels [left, right) x [top, bottom) a target may change.
+struct DrawClip {
+    int left;
+    int top;
+    int right;
+    int bottom;
+};
+
+// Draw targets hand BasicDrawable its pixels. Each has width(), height()
+// and clip(), getPixel(x, y) for in-bounds reads, setPixel(x, y, color) and
+// fillSpan(y, x0, x1, color, coverage) over columns [x0, x1), both clipped
+// to clip(). A coverage below 1 paints that fraction of the color.
+class ImageTarget {
 public:
-    enum class LineCap {
-        Butt,
-        Round,
-        Square,
-    };
+    ImageTarget(Image& image) : m_image(image) {}
 
-    enum class LineJoin {
-        Miter,
-        Round,
-        Bevel,
-    };
+    int width() const { return m_image.width(); }
+    int height() const { return m_image.height(); }
+    DrawClip clip() const { return {0, 0, m_image.width(), m_image.height()}; }
+    Color getPixel(int x, int y) const { return m_image.getPixel(x, y); }
+    void setPixel(int x, int y, const Color& color) { m_image.setPixel(x, y, color); }
+
+    void fillSpan(int y, int x0, int x1, const Color& color, float coverage) {
+        if (y < 0 || y >= m_image.height()) {
+            return;
+        }
+        x0 = std::max(x0, 0);
+        x1 = std::min(x1, m_image.width());
+        if (coverage >= 1.0f) {
+            for (int x = x0; x < x1; ++x) {
+                m_image.setPixel(x, y, color);
+            }
+            return;
+        }
+        const auto mix = [coverage](std::uint8_t source, std::uint8_t destination) {
+            return static_cast<std::uint8_t>(std::lround(destination + (source - destination) * coverage));
+        };
+        for (int x = x0; x < x1; ++x) {
+            const Color dst = m_image.getPixel(x, y);
+            m_image.setPixel(x, y, Color(mix(color.r, dst.r), mix(color.g, dst.g), mix(color.b, dst.b)));
+        }
+    }
 
-    explicit Drawable(Image& image);
+private:
+    Image& m_image;
+};
+
+// Canvas-style drawing onto a target. The members are defined in
+// drawable.cpp and instantiated there for ImageTarget and the layer
+// targets of draw_target.h.
+template <typename Target>
+class BasicDrawable {
+public:
+    using LineCap = ::LineCap;
+    using LineJoin = ::LineJoin;
+
+    explicit BasicDrawable(Target target);
+
+    Target& target() { return m_target; }
 
     void setPixel(int x, int y, const Color& color);
-    const Color& getPixel(int x, int y) const;
+    Color getPixel(int x, int y) const;
 
     void fill(const Color& color);
     void line(int x0, int y0, int x1, int y1, const Color& color);
@@ -37,6 +96,12 @@ public:
     void setLineCap(LineCap cap);
     void setLineJoin(LineJoin join);
     void setMiterLimit(float limit);
+    // Fill rule for fillPolygon and fillPath (even-odd by default). Strokes
+    // always fill nonzero.
+    void setFillRule(FillRule rule);
+    // With antialiasing, filled shapes and wide strokes blend their edge
+    // pixels by coverage instead of testing pixel centers.
+    void setAntialias(bool enabled);
     void stroke(const Color& color);
     void fillPath(const Color& color);
     void rect(int x, int y, int width, int height, const Color& color);
@@ -59,15 +124,30 @@ private:
         bool closed = false;
     };
 
-    Image& m_image;
+    Target m_target;
     std::vector<SubPath> m_path;
     int m_lineWidth = 1;
     LineCap m_lineCap = LineCap::Butt;
     LineJoin m_lineJoin = LineJoin::Miter;
     float m_miterLimit = 10.0f;
+    FillRule m_fillRule = FillRule::EvenOdd;
+    bool m_antialias = false;
+    ScanlineRasterizer m_rasterizer;
 
+    // Connected outlines skip the pixel a previous piece already drew, so
+    // translucent targets blend each pixel once.
+    void linePixels(int x0, int y0, int x1, int y1, const Color& color, bool skipFirst, bool skipLast);
     void plotCircleOctants(int cx, int cy, int x, int y, const Color& color);
-    void strokeSegment(float x0, float y0, float x1, float y1, const Color& color);
+    // Fills edges given in pixel space, where pixel (x, y) spans [x, x + 1),
+    // sampled as aliased unless antialiasing is on.
+    void fillEdges(std::vector<RasterEdge>& edges, FillRule rule, const Color& color, RasterSampling aliased = RasterSampling::Centers);
+    // Edges of a polygon in drawing coordinates: centered on pixel centers
+    // when antialiased, else as is for the inclusive integer polygon rule.
+    template <typename Point>
+    void addFillEdges(std::vector<RasterEdge>& edges, const std::vector<Point>& points) const;
+    void fillEllipseOutline(float cx, float cy, float rx, float ry, const Color& color);
 };
 
+using Drawable = BasicDrawable<ImageTarget>;
+
 #endif
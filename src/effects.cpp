@@ -5,9 +5,10 @@
 #include <cstdint>
 
 namespace {
+// Rounds halves up like std::lround; adding 0.5 in double is exact.
 std::uint8_t clampByte(float v) {
     const float clamped = std::max(0.0f, std::min(255.0f, v));
-    return static_cast<std::uint8_t>(std::lround(clamped));
+    return static_cast<std::uint8_t>(static_cast<double>(clamped) + 0.5);
 }
 
 float clamp01(float v) {
@@ -49,11 +50,7 @@ void applyGrayscale(RasterImage& image) {
 
 void applyGrayscale(ImageBuffer& buffer) {
     for (int y = 0; y < buffer.height(); ++y) {
-        for (int x = 0; x < buffer.width(); ++x) {
-            const PixelRGBA8 src = buffer.getPixel(x, y);
-            const std::uint8_t gray = grayscaleLuma(src.r, src.g, src.b);
-            buffer.setPixel(x, y, PixelRGBA8(gray, gray, gray, src.a));
-        }
+        applyGrayscale(buffer.row(y), static_cast<std::size_t>(buffer.width()));
     }
 }
 
@@ -72,14 +69,24 @@ void applySepia(RasterImage& image, float strength) {
 
 void applySepia(ImageBuffer& buffer, float strength) {
     for (int y = 0; y < buffer.height(); ++y) {
-        for (int x = 0; x < buffer.width(); ++x) {
-            const PixelRGBA8 src = buffer.getPixel(x, y);
-            const Color sepia = sepiaColor(Color(src.r, src.g, src.b), strength);
-            buffer.setPixel(x, y, PixelRGBA8(sepia.r, sepia.g, sepia.b, src.a));
-        }
+        applySepia(buffer.row(y), static_cast<std::size_t>(buffer.width()), strength);
     }
 }
 
 void applySepia(Layer& layer, float strength) {
     applySepia(layer.image(), strength);
 }
+
+void applyGrayscale(PixelRGBA8* pixels, std::size_t count) {
+    for (std::size_t i = 0; i < count; ++i) {
+        const std::uint8_t gray = grayscaleLuma(pixels[i].r, pixels[i].g, pixels[i].b);
+        pixels[i] = PixelRGBA8(gray, gray, gray, pixels[i].a);
+    }
+}
+
+void applySepia(PixelRGBA8* pixels, std::size_t count, float strength) {
+    for (std::size_t i = 0; i < count; ++i) {
+        const Color sepia = sepiaColor(Color(pixels[i].r, pixels[i].g, pixels[i].b), strength);
+        pixels[i] = PixelRGBA8(sepia.r, sepia.g, sepia.b, pixels[i].a);
+    }
+}
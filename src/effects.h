@@ -4,6 +4,8 @@
 #include "image.h"
 #include "layer.h"
 
+#include <cstddef>
+
 void applyGrayscale(RasterImage& image);
 void applyGrayscale(ImageBuffer& buffer);
 void applyGrayscale(Layer& layer);
@@ -12,4 +14,8 @@ void applySepia(RasterImage& image, float strength = 1.0f);
 void applySepia(ImageBuffer& buffer, float strength = 1.0f);
 void applySepia(Layer& layer, float strength = 1.0f);
 
+// Runs of pixels, for callers that chain several effects over each row.
+void applyGrayscale(PixelRGBA8* pixels, std::size_t count);
+void applySepia(PixelRGBA8* pixels, std::size_t count, float strength = 1.0f);
+
 #endif
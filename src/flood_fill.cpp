@@ -0,0 +1,39 @@
+#include "flood_fill.h"
+
+#include <algorithm>
+#include <cstdlib>
+
+std::size_t floodFill(ImageBuffer& image, int x, int y, const PixelRGBA8& fill, int tolerance, bool matchAlpha) {
+    if (!image.inBounds(x, y)) {
+        return 0;
+    }
+    const PixelRGBA8 seed = image.getPixel(x, y);
+    if (seed.r == fill.r && seed.g == fill.g && seed.b == fill.b && (!matchAlpha || seed.a == fill.a)) {
+        return 0;
+    }
+    const int limit = std::clamp(tolerance, 0, 255);
+    const int alphaLimit = matchAlpha ? limit : 255;
+    const ImageView view = image.view();
+    const auto matches = [&](int px, int py) {
+        const PixelRGBA8& p = view.at(px, py);
+        return std::abs(p.r - seed.r) <= limit && std::abs(p.g - seed.g) <= limit && std::abs(p.b - seed.b) <= limit &&
+               std::abs(p.a - seed.a) <= alphaLimit;
+    };
+    const auto fillSpan = [&](int py, int x0, int x1) { std::fill(view.row(py) + x0, view.row(py) + x1 + 1, fill); };
+    return detail::scanlineFloodFill(image.width(), image.height(), x, y, matches, fillSpan);
+}
+
+std::size_t floodFill(MaskBuffer& mask, int x, int y, std::uint8_t coverage, int tolerance) {
+    if (!mask.inBounds(x, y)) {
+        return 0;
+    }
+    const int seed = mask.coverage(x, y);
+    if (seed == coverage) {
+        return 0;
+    }
+    const int limit = std::clamp(tolerance, 0, 255);
+    const CoverageView view = mask.view();
+    const auto matches = [&](int px, int py) { return std::abs(view.at(px, py) - seed) <= limit; };
+    const auto fillSpan = [&](int py, int x0, int x1) { std::fill(view.row(py) + x0, view.row(py) + x1 + 1, coverage); };
+    return detail::scanlineFloodFill(mask.width(), mask.height(), x, y, matches, fillSpan);
+}
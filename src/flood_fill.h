@@ -0,0 +1,83 @@
+#ifndef FLOOD_FILL_H
+#define FLOOD_FILL_H
+
+#include "layer.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace detail {
+// Scanline seed fill over the 4-connected region around (x, y). matches(px,
+// py) says whether a pixel belongs to the region; it is asked at most a few
+// times per pixel and never again once its run is filled, so a fill may
+// change pixels into colors that still match. fillSpan(py, x0, x1) fills
+// the inclusive run [x0, x1] of row py. Returns the pixels filled.
+template <typename Matches, typename FillSpan>
+std::size_t scanlineFloodFill(int width, int height, int x, int y, Matches matches, FillSpan fillSpan) {
+    if (x < 0 || y < 0 || x >= width || y >= height) {
+        return 0;
+    }
+    const std::size_t rowWords = (static_cast<std::size_t>(width) + 63) / 64;
+    std::vector<std::uint64_t> filled(rowWords * static_cast<std::size_t>(height), 0);
+    const auto isFilled = [&filled, rowWords](int px, int py) {
+        return (filled[static_cast<std::size_t>(py) * rowWords + static_cast<std::size_t>(px) / 64] >> (px % 64) & 1u) != 0;
+    };
+    const auto open = [&](int px, int py) { return !isFilled(px, py) && matches(px, py); };
+
+    struct Seed {
+        int x;
+        int y;
+    };
+    std::vector<Seed> stack;
+    stack.push_back({x, y});
+    std::size_t count = 0;
+    while (!stack.empty()) {
+        const Seed seed = stack.back();
+        stack.pop_back();
+        if (!open(seed.x, seed.y)) {
+            continue;
+        }
+        int left = seed.x;
+        while (left > 0 && open(left - 1, seed.y)) {
+            --left;
+        }
+        int right = seed.x;
+        while (right + 1 < width && open(right + 1, seed.y)) {
+            ++right;
+        }
+        std::uint64_t* bits = filled.data() + static_cast<std::size_t>(seed.y) * rowWords;
+        for (int px = left; px <= right; ++px) {
+            bits[px / 64] |= std::uint64_t(1) << (px % 64);
+        }
+        fillSpan(seed.y, left, right);
+        count += static_cast<std::size_t>(right - left + 1);
+
+        // One seed per open run of the rows above and below.
+        for (const int ny : {seed.y - 1, seed.y + 1}) {
+            if (ny < 0 || ny >= height) {
+                continue;
+            }
+            bool inRun = false;
+            for (int px = left; px <= right; ++px) {
+                const bool isOpen = open(px, ny);
+                if (isOpen && !inRun) {
+                    stack.push_back({px, ny});
+                }
+                inRun = isOpen;
+            }
+        }
+    }
+    return count;
+}
+} // namespace detail
+
+// Fills the 4-connected region of pixels whose channels all lie within
+// tolerance of the seed pixel's. Alpha is compared only with matchAlpha.
+// Nothing changes when the seed already has the fill's compared channels.
+// Returns the pixels filled.
+std::size_t floodFill(ImageBuffer& image, int x, int y, const PixelRGBA8& fill, int tolerance = 0, bool matchAlpha = false);
+// Same over mask coverage.
+std::size_t floodFill(MaskBuffer& mask, int x, int y, std::uint8_t coverage, int tolerance = 0);
+
+#endif
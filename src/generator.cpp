@@ -0,0 +1,268 @@
+#include "generator.h"
+
+#include "parallel.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+
+namespace {
+float clamp01(float value) {
+    return std::max(0.0f, std::min(1.0f, value));
+}
+
+std::uint8_t clampByte(int value) {
+    if (value < 0) {
+        return 0;
+    }
+    if (value > 255) {
+        return 255;
+    }
+    return static_cast<std::uint8_t>(value);
+}
+
+PixelRGBA8 lerpPixel(const PixelRGBA8& a, const PixelRGBA8& b, float t) {
+    const float clamped = clamp01(t);
+    const float inv = 1.0f - clamped;
+    return PixelRGBA8(
+        clampByte(static_cast<int>(std::lround(inv * static_cast<float>(a.r) + clamped * static_cast<float>(b.r)))),
+        clampByte(static_cast<int>(std::lround(inv * static_cast<float>(a.g) + clamped * static_cast<float>(b.g)))),
+        clampByte(static_cast<int>(std::lround(inv * static_cast<float>(a.b) + clamped * static_cast<float>(b.b)))),
+        clampByte(static_cast<int>(std::lround(inv * static_cast<float>(a.a) + clamped * static_cast<float>(b.a)))));
+}
+
+int pixelNoise(int x, int y, std::uint32_t channel, std::uint32_t seed) {
+    std::uint32_t n = static_cast<std::uint32_t>(x) * 374761393u;
+    n ^= static_cast<std::uint32_t>(y) * 668265263u;
+    n ^= (seed + channel * 0x9E3779B9u) * 2246822519u;
+    n = (n ^ (n >> 13)) * 1274126177u;
+    n ^= (n >> 16);
+    return static_cast<int>((static_cast<std::uint64_t>(n) * 257u) >> 32) - 128;
+}
+
+// The sum stays above -128, so offsetting it lets truncation round.
+std::uint8_t addNoise(std::uint8_t value, float mix, int noise) {
+    const double sum = static_cast<double>(value) + static_cast<double>(mix * static_cast<float>(noise));
+    return clampByte(static_cast<int>(sum + 128.5) - 128);
+}
+
+class GeneratorSource : public PixelSource {
+public:
+    explicit GeneratorSource(LayerGenerator generator) : m_generator(std::move(generator)) {}
+
+    void load(std::uint8_t* pixels, int width, int height, int) const override {
+        m_generator.render(ImageView(reinterpret_cast<PixelRGBA8*>(pixels), width, height, width), 0, 0);
+    }
+
+    const LayerGenerator& generator() const {
+        return m_generator;
+    }
+
+private:
+    LayerGenerator m_generator;
+};
+
+class ByteWriter {
+public:
+    template <typename T>
+    void put(const T& value) {
+        const std::size_t at = m_bytes.size();
+        m_bytes.resize(at + sizeof(T));
+        std::memcpy(m_bytes.data() + at, &value, sizeof(T));
+    }
+
+    std::vector<std::uint8_t> take() {
+        return std::move(m_bytes);
+    }
+
+private:
+    std::vector<std::uint8_t> m_bytes;
+};
+
+class ByteReader {
+public:
+    ByteReader(const std::uint8_t* bytes, std::size_t size) : m_bytes(bytes), m_size(size), m_at(0) {}
+
+    template <typename T>
+    T get() {
+        if (m_size - m_at < sizeof(T)) {
+            throw std::runtime_error("Truncated layer generator");
+        }
+        T value;
+        std::memcpy(&value, m_bytes + m_at, sizeof(T));
+        m_at += sizeof(T);
+        return value;
+    }
+
+    bool done() const {
+        return m_at == m_size;
+    }
+
+private:
+    const std::uint8_t* m_bytes;
+    std::size_t m_size;
+    std::size_t m_at;
+};
+
+void putPixel(ByteWriter& out, const PixelRGBA8& pixel) {
+    out.put(pixel.r);
+    out.put(pixel.g);
+    out.put(pixel.b);
+    out.put(pixel.a);
+}
+
+PixelRGBA8 getPixel(ByteReader& in) {
+    PixelRGBA8 pixel;
+    pixel.r = in.get<std::uint8_t>();
+    pixel.g = in.get<std::uint8_t>();
+    pixel.b = in.get<std::uint8_t>();
+    pixel.a = in.get<std::uint8_t>();
+    return pixel;
+}
+} // namespace
+
+void NoisePass::apply(PixelRGBA8& pixel, int x, int y) const {
+    const float mix = clamp01(amount);
+    if (mix <= 0.0f) {
+        return;
+    }
+    const int baseNoise = pixelNoise(x, y, 0, seed);
+    pixel.r = addNoise(pixel.r, mix, baseNoise);
+    pixel.g = addNoise(pixel.g, mix, monochrome ? baseNoise : pixelNoise(x, y, 1, seed));
+    pixel.b = addNoise(pixel.b, mix, monochrome ? baseNoise : pixelNoise(x, y, 2, seed));
+    if (affectAlpha) {
+        pixel.a = addNoise(pixel.a, mix, monochrome ? baseNoise : pixelNoise(x, y, 3, seed));
+    }
+}
+
+void LayerGenerator::renderRow(PixelRGBA8* out, int x, int y, int count) const {
+    switch (kind) {
+    case Kind::Solid:
+        std::fill(out, out + count, from);
+        break;
+    case Kind::LinearGradient: {
+        const double dx = x1 - x0;
+        const double dy = y1 - y0;
+        const double denom = (dx * dx) + (dy * dy);
+        if (denom <= 0.0) {
+            std::fill(out, out + count, from);
+            break;
+        }
+        for (int i = 0; i < count; ++i) {
+            const double proj = ((static_cast<double>(x + i) - x0) * dx + (static_cast<double>(y) - y0) * dy) / denom;
+            out[i] = lerpPixel(from, to, clamp01(static_cast<float>(proj)));
+        }
+        break;
+    }
+    case Kind::RadialGradient:
+        for (int i = 0; i < count; ++i) {
+            const double dx = static_cast<double>(x + i) - x0;
+            const double dy = static_cast<double>(y) - y0;
+            const double dist = std::sqrt((dx * dx) + (dy * dy));
+            out[i] = lerpPixel(from, to, clamp01(static_cast<float>(dist / x1)));
+        }
+        break;
+    case Kind::Checker: {
+        const int cellY = static_cast<int>(std::floor(static_cast<double>(y + offsetY) / static_cast<double>(cellHeight)));
+        for (int i = 0; i < count; ++i) {
+            const int cellX = static_cast<int>(std::floor(static_cast<double>(x + i + offsetX) / static_cast<double>(cellWidth)));
+            out[i] = ((cellX + cellY) % 2) == 0 ? from : to;
+        }
+        break;
+    }
+    }
+    for (const NoisePass& pass : noise) {
+        for (int i = 0; i < count; ++i) {
+            pass.apply(out[i], x + i, y);
+        }
+    }
+}
+
+PixelRGBA8 LayerGenerator::at(int x, int y) const {
+    PixelRGBA8 pixel;
+    renderRow(&pixel, x, y, 1);
+    return pixel;
+}
+
+void LayerGenerator::render(const ImageView& out, int originX, int originY) const {
+    parallelFor(out.height(), 0, [&](int y) { renderRow(out.row(y), originX, originY + y, out.width()); });
+}
+
+std::vector<std::uint8_t> LayerGenerator::encode() const {
+    ByteWriter out;
+    out.put(static_cast<std::uint8_t>(kind));
+    putPixel(out, from);
+    putPixel(out, to);
+    out.put(x0);
+    out.put(y0);
+    out.put(x1);
+    out.put(y1);
+    out.put(static_cast<std::int32_t>(cellWidth));
+    out.put(static_cast<std::int32_t>(cellHeight));
+    out.put(static_cast<std::int32_t>(offsetX));
+    out.put(static_cast<std::int32_t>(offsetY));
+    out.put(static_cast<std::uint32_t>(noise.size()));
+    for (const NoisePass& pass : noise) {
+        out.put(pass.seed);
+        out.put(pass.amount);
+        out.put(static_cast<std::uint8_t>(pass.monochrome ? 1 : 0));
+        out.put(static_cast<std::uint8_t>(pass.affectAlpha ? 1 : 0));
+    }
+    return out.take();
+}
+
+LayerGenerator LayerGenerator::decode(const std::uint8_t* bytes, std::size_t size) {
+    ByteReader in(bytes, size);
+    LayerGenerator generator;
+    const std::uint8_t kind = in.get<std::uint8_t>();
+    if (kind > static_cast<std::uint8_t>(Kind::Checker)) {
+        throw std::runtime_error("Unknown layer generator kind");
+    }
+    generator.kind = static_cast<Kind>(kind);
+    generator.from = getPixel(in);
+    generator.to = getPixel(in);
+    generator.x0 = in.get<double>();
+    generator.y0 = in.get<double>();
+    generator.x1 = in.get<double>();
+    generator.y1 = in.get<double>();
+    generator.cellWidth = in.get<std::int32_t>();
+    generator.cellHeight = in.get<std::int32_t>();
+    generator.offsetX = in.get<std::int32_t>();
+    generator.offsetY = in.get<std::int32_t>();
+    if ((generator.kind == Kind::RadialGradient && !(generator.x1 > 0.0)) ||
+        (generator.kind == Kind::Checker && (generator.cellWidth <= 0 || generator.cellHeight <= 0))) {
+        throw std::runtime_error("Invalid layer generator parameters");
+    }
+    const std::uint32_t passes = in.get<std::uint32_t>();
+    for (std::uint32_t i = 0; i < passes; ++i) {
+        NoisePass pass;
+        pass.seed = in.get<std::uint32_t>();
+        pass.amount = in.get<float>();
+        pass.monochrome = in.get<std::uint8_t>() != 0;
+        pass.affectAlpha = in.get<std::uint8_t>() != 0;
+        generator.noise.push_back(pass);
+    }
+    if (!in.done()) {
+        throw std::runtime_error("Trailing bytes after layer generator");
+    }
+    return generator;
+}
+
+std::shared_ptr<const PixelSource> generatorSource(LayerGenerator generator) {
+    return std::make_shared<GeneratorSource>(std::move(generator));
+}
+
+ImageBuffer generatedImage(int width, int height, LayerGenerator generator) {
+    if (generator.kind == LayerGenerator::Kind::Solid && generator.noise.empty()) {
+        return ImageBuffer(width, height, generator.from);
+    }
+    return ImageBuffer(width, height, generatorSource(std::move(generator)));
+}
+
+const LayerGenerator* imageGenerator(const ImageBuffer& image) {
+    const auto* source = dynamic_cast<const GeneratorSource*>(image.pixelSource());
+    return source ? &source->generator() : nullptr;
+}
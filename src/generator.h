@@ -0,0 +1,69 @@
+#ifndef GENERATOR_H
+#define GENERATOR_H
+
+#include "layer.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Per-pixel noise in [-128, 128] hashed from the layer position, channel
+// and seed, so a pixel gets the same noise however the layer is filled.
+struct NoisePass {
+    std::uint32_t seed = 1337u;
+    float amount = 0.2f;
+    bool monochrome = false;
+    bool affectAlpha = false;
+
+    void apply(PixelRGBA8& pixel, int x, int y) const;
+};
+
+// Layer pixels described by parameters: a solid color, a linear or radial
+// gradient or a checkerboard, with noise passes on top. Positions are in
+// layer pixels.
+struct LayerGenerator {
+    enum class Kind : std::uint8_t {
+        Solid,
+        LinearGradient,
+        RadialGradient,
+        Checker,
+    };
+
+    Kind kind = Kind::Solid;
+    // Solid color, gradient start or inner color, or checker cell a.
+    PixelRGBA8 from;
+    // Gradient end or outer color, or checker cell b.
+    PixelRGBA8 to;
+    // Linear: from (x0, y0) to (x1, y1). Radial: center (x0, y0), radius x1.
+    double x0 = 0.0;
+    double y0 = 0.0;
+    double x1 = 0.0;
+    double y1 = 0.0;
+    int cellWidth = 1;
+    int cellHeight = 1;
+    int offsetX = 0;
+    int offsetY = 0;
+    std::vector<NoisePass> noise;
+
+    // count pixels of row y starting at column x.
+    void renderRow(PixelRGBA8* out, int x, int y, int count) const;
+    PixelRGBA8 at(int x, int y) const;
+    // Fills out as the layer rect whose top left is (originX, originY).
+    void render(const ImageView& out, int originX, int originY) const;
+
+    // Parameters as stored in IFLOW files; decode throws on bad bytes.
+    std::vector<std::uint8_t> encode() const;
+    static LayerGenerator decode(const std::uint8_t* bytes, std::size_t size);
+};
+
+// Pixel source computing generator's pixels on load.
+std::shared_ptr<const PixelSource> generatorSource(LayerGenerator generator);
+// Image whose pixels are computed from generator when something first reads
+// its rows; compositing evaluates them per visible span instead. The first
+// write bakes them to stored pixels.
+ImageBuffer generatedImage(int width, int height, LayerGenerator generator);
+// The generator an image's pixels still come from, or null.
+const LayerGenerator* imageGenerator(const ImageBuffer& image);
+
+#endif
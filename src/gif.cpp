@@ -5,10 +5,11 @@
 #include <cstddef>
 #include <cstdint>
 #include <fstream>
+#include <functional>
+#include <iterator>
 #include <limits>
 #include <stdexcept>
 #include <string>
-#include <unordered_map>
 #include <vector>
 
 namespace {
@@ -34,7 +35,7 @@ void writeU16LE(std::vector<std::uint8_t>& out, std::uint16_t value) {
     out.push_back(static_cast<std::uint8_t>((value >> 8) & 0xFF));
 }
 
-std::uint16_t readU16LE(const std::vector<std::uint8_t>& in, std::size_t pos) {
+std::uint16_t readU16LE(const std::uint8_t* in, std::size_t pos) {
     return static_cast<std::uint16_t>(in[pos]) |
            (static_cast<std::uint16_t>(in[pos + 1]) << 8);
 }
@@ -108,38 +109,66 @@ private:
     int m_bitPos;
 };
 
+// GIF LZW with the string table kept in an open-addressed hash keyed by
+// (prefix code, next index). The table is cleared once all 4096 codes are
+// assigned.
 std::vector<std::uint8_t> lzwCompress(const std::vector<std::uint8_t>& indices, int minCodeSize) {
     const int clearCode = 1 << minCodeSize;
     const int endCode = clearCode + 1;
+    constexpr std::size_t kHashBits = 13;
+    constexpr std::size_t kHashSize = std::size_t(1) << kHashBits;
 
     std::vector<std::uint8_t> bytes;
-    bytes.reserve(indices.size());
+    bytes.reserve(indices.size() / 2 + 16);
     BitPackerLSB bw(bytes);
 
+    std::vector<std::int32_t> keys(kHashSize, -1);
+    std::vector<std::uint16_t> codes(kHashSize, 0);
     int nextCode = endCode + 1;
     int codeSize = minCodeSize + 1;
-    bool haveOld = false;
 
     bw.put(clearCode, codeSize);
+    if (indices.empty()) {
+        bw.put(endCode, codeSize);
+        bw.flush();
+        return bytes;
+    }
 
-    for (std::size_t i = 0; i < indices.size(); ++i) {
-        if (haveOld && nextCode >= 4096) {
-            bw.put(clearCode, codeSize);
-            nextCode = endCode + 1;
-            codeSize = minCodeSize + 1;
-            haveOld = false;
+    int prefix = indices[0];
+    for (std::size_t i = 1; i < indices.size(); ++i) {
+        const std::int32_t key = (prefix << 8) | indices[i];
+        std::size_t slot = (static_cast<std::uint32_t>(key) * 2654435761u) >> (32 - kHashBits);
+        while (keys[slot] >= 0 && keys[slot] != key) {
+            slot = (slot + 1) & (kHashSize - 1);
+        }
+        if (keys[slot] == key) {
+            prefix = codes[slot];
+            continue;
         }
 
-        bw.put(indices[i], codeSize);
-        if (haveOld) {
-            ++nextCode;
+        bw.put(prefix, codeSize);
+        if (nextCode < 4096) {
+            keys[slot] = key;
+            codes[slot] = static_cast<std::uint16_t>(nextCode);
             if (nextCode == (1 << codeSize) && codeSize < 12) {
                 ++codeSize;
             }
+            ++nextCode;
+        } else {
+            bw.put(clearCode, codeSize);
+            std::fill(keys.begin(), keys.end(), -1);
+            nextCode = endCode + 1;
+            codeSize = minCodeSize + 1;
         }
-        haveOld = true;
+        prefix = indices[i];
     }
 
+    bw.put(prefix, codeSize);
+    // The decoder adds its entry for the last code before reading the end
+    // code, so it may already have grown the code size.
+    if (nextCode < 4096 && nextCode == (1 << codeSize) && codeSize < 12) {
+        ++codeSize;
+    }
     bw.put(endCode, codeSize);
     bw.flush();
     return bytes;
@@ -256,6 +285,284 @@ std::vector<std::uint8_t> lzwDecompress(const std::vector<std::uint8_t>& data, i
     return out;
 }
 
+// Pixels flagged in keep (null flags none) are left for the previous frame
+// and get index 0 here; the caller points them at the transparent entry.
+
+// Collects the exact palette and indices when there are at most maxColors
+// colors; returns false as soon as one more appears.
+bool exactPalette(const PixelRows& pixels,
+                  const std::uint8_t* keep,
+                  std::size_t maxColors,
+                  std::vector<Color>& palette,
+                  std::vector<std::uint8_t>& indices) {
+    constexpr std::size_t kSlots = 1024;
+    std::array<std::int32_t, kSlots> keys;
+    std::array<std::uint8_t, kSlots> slotIndex{};
+    keys.fill(-1);
+    palette.clear();
+    std::int32_t lastKey = -1;
+    std::uint8_t lastIndex = 0;
+    std::size_t out = 0;
+    for (int y = 0; y < pixels.height; ++y) {
+        const std::uint8_t* c = pixels.row(y);
+        for (int x = 0; x < pixels.width; ++x, c += pixels.channels) {
+            if (keep != nullptr && keep[out] != 0) {
+                indices[out++] = 0;
+                continue;
+            }
+            const std::int32_t key = (static_cast<std::int32_t>(c[0]) << 16) | (static_cast<std::int32_t>(c[1]) << 8) | c[2];
+            if (key != lastKey) {
+                std::size_t slot = (static_cast<std::uint32_t>(key) * 2654435761u) >> 22;
+                while (keys[slot] >= 0 && keys[slot] != key) {
+                    slot = (slot + 1) & (kSlots - 1);
+                }
+                if (keys[slot] < 0) {
+                    if (palette.size() == maxColors) {
+                        return false;
+                    }
+                    keys[slot] = key;
+                    slotIndex[slot] = static_cast<std::uint8_t>(palette.size());
+                    palette.emplace_back(c[0], c[1], c[2]);
+                }
+                lastKey = key;
+                lastIndex = slotIndex[slot];
+            }
+            indices[out++] = lastIndex;
+        }
+    }
+    return true;
+}
+
+int colorKey15(int r, int g, int b) {
+    return ((r >> 3) << 10) | ((g >> 3) << 5) | (b >> 3);
+}
+
+// Median cut over a 5-bit-per-channel histogram: the box with the largest
+// pixel count times longest side is split at the pixel median of that side
+// until there are maxColors boxes. Entries are the boxes' mean colors.
+std::vector<Color> medianCutPalette(const std::vector<std::uint32_t>& counts,
+                                    const std::vector<std::array<std::uint64_t, 3>>& sums,
+                                    std::size_t maxColors) {
+    struct Box {
+        int lo[3];
+        int hi[3];
+        std::uint64_t pixels;
+    };
+    const auto shrink = [&](Box& box) {
+        int lo[3] = {31, 31, 31};
+        int hi[3] = {0, 0, 0};
+        box.pixels = 0;
+        for (int r = box.lo[0]; r <= box.hi[0]; ++r) {
+            for (int g = box.lo[1]; g <= box.hi[1]; ++g) {
+                for (int b = box.lo[2]; b <= box.hi[2]; ++b) {
+                    const std::uint32_t n = counts[static_cast<std::size_t>((r << 10) | (g << 5) | b)];
+                    if (n == 0) {
+                        continue;
+                    }
+                    box.pixels += n;
+                    const int v[3] = {r, g, b};
+                    for (int k = 0; k < 3; ++k) {
+                        lo[k] = std::min(lo[k], v[k]);
+                        hi[k] = std::max(hi[k], v[k]);
+                    }
+                }
+            }
+        }
+        for (int k = 0; k < 3; ++k) {
+            box.lo[k] = lo[k];
+            box.hi[k] = hi[k];
+        }
+    };
+
+    std::vector<Box> boxes;
+    boxes.push_back(Box{{0, 0, 0}, {31, 31, 31}, 0});
+    shrink(boxes[0]);
+    while (boxes.size() < maxColors) {
+        int best = -1;
+        std::uint64_t bestScore = 0;
+        for (std::size_t i = 0; i < boxes.size(); ++i) {
+            const Box& box = boxes[i];
+            const int extent = std::max({box.hi[0] - box.lo[0], box.hi[1] - box.lo[1], box.hi[2] - box.lo[2]});
+            const std::uint64_t score = box.pixels * static_cast<std::uint64_t>(extent);
+            if (score > bestScore) {
+                bestScore = score;
+                best = static_cast<int>(i);
+            }
+        }
+        if (best < 0) {
+            break;
+        }
+        Box box = boxes[static_cast<std::size_t>(best)];
+        int axis = 0;
+        for (int k = 1; k < 3; ++k) {
+            if (box.hi[k] - box.lo[k] > box.hi[axis] - box.lo[axis]) {
+                axis = k;
+            }
+        }
+        // Pixel count of each slice along the axis, then the median slice.
+        std::array<std::uint64_t, 32> slices{};
+        for (int r = box.lo[0]; r <= box.hi[0]; ++r) {
+            for (int g = box.lo[1]; g <= box.hi[1]; ++g) {
+                for (int b = box.lo[2]; b <= box.hi[2]; ++b) {
+                    const int v[3] = {r, g, b};
+                    slices[static_cast<std::size_t>(v[axis])] += counts[static_cast<std::size_t>((r << 10) | (g << 5) | b)];
+                }
+            }
+        }
+        int cut = box.lo[axis];
+        std::uint64_t below = slices[static_cast<std::size_t>(cut)];
+        while (cut + 1 < box.hi[axis] && below * 2 < box.pixels) {
+            ++cut;
+            below += slices[static_cast<std::size_t>(cut)];
+        }
+        Box upper = box;
+        box.hi[axis] = cut;
+        upper.lo[axis] = cut + 1;
+        shrink(box);
+        shrink(upper);
+        boxes[static_cast<std::size_t>(best)] = box;
+        boxes.push_back(upper);
+    }
+
+    std::vector<Color> palette;
+    palette.reserve(boxes.size());
+    for (const Box& box : boxes) {
+        std::array<std::uint64_t, 3> total{};
+        for (int r = box.lo[0]; r <= box.hi[0]; ++r) {
+            for (int g = box.lo[1]; g <= box.hi[1]; ++g) {
+                for (int b = box.lo[2]; b <= box.hi[2]; ++b) {
+                    const std::array<std::uint64_t, 3>& sum = sums[static_cast<std::size_t>((r << 10) | (g << 5) | b)];
+                    for (int k = 0; k < 3; ++k) {
+                        total[static_cast<std::size_t>(k)] += sum[static_cast<std::size_t>(k)];
+                    }
+                }
+            }
+        }
+        const std::uint64_t n = std::max<std::uint64_t>(1, box.pixels);
+        palette.emplace_back(static_cast<std::uint8_t>((total[0] + n / 2) / n), static_cast<std::uint8_t>((total[1] + n / 2) / n),
+                             static_cast<std::uint8_t>((total[2] + n / 2) / n));
+    }
+    return palette;
+}
+
+// Maps colors to their nearest palette entry, memoized per 15-bit color.
+class PaletteLookup {
+public:
+    explicit PaletteLookup(const std::vector<Color>& palette) : m_palette(palette), m_cache(32768, -1) {}
+
+    std::uint8_t nearest(int r, int g, int b) {
+        const int key = colorKey15(r, g, b);
+        std::int16_t& cached = m_cache[static_cast<std::size_t>(key)];
+        if (cached < 0) {
+            const int cr = ((key >> 10) << 3) | 4;
+            const int cg = (((key >> 5) & 31) << 3) | 4;
+            const int cb = ((key & 31) << 3) | 4;
+            int best = 0;
+            int bestDistance = std::numeric_limits<int>::max();
+            for (std::size_t i = 0; i < m_palette.size(); ++i) {
+                const int dr = m_palette[i].r - cr;
+                const int dg = m_palette[i].g - cg;
+                const int db = m_palette[i].b - cb;
+                const int distance = dr * dr + dg * dg + db * db;
+                if (distance < bestDistance) {
+                    bestDistance = distance;
+                    best = static_cast<int>(i);
+                }
+            }
+            cached = static_cast<std::int16_t>(best);
+        }
+        return static_cast<std::uint8_t>(cached);
+    }
+
+private:
+    const std::vector<Color>& m_palette;
+    std::vector<std::int16_t> m_cache;
+};
+
+int clampChannel(int value) {
+    return std::max(0, std::min(255, value));
+}
+
+void quantizeToPalette(const PixelRows& pixels,
+                       GIFDither dither,
+                       const std::uint8_t* keep,
+                       std::size_t maxColors,
+                       std::vector<Color>& palette,
+                       std::vector<std::uint8_t>& indices) {
+    std::vector<std::uint32_t> counts(32768, 0);
+    std::vector<std::array<std::uint64_t, 3>> sums(32768, std::array<std::uint64_t, 3>{});
+    std::size_t index = 0;
+    for (int y = 0; y < pixels.height; ++y) {
+        const std::uint8_t* c = pixels.row(y);
+        for (int x = 0; x < pixels.width; ++x, c += pixels.channels) {
+            if (keep != nullptr && keep[index++] != 0) {
+                continue;
+            }
+            const std::size_t key = static_cast<std::size_t>(colorKey15(c[0], c[1], c[2]));
+            ++counts[key];
+            sums[key][0] += c[0];
+            sums[key][1] += c[1];
+            sums[key][2] += c[2];
+        }
+    }
+    palette = medianCutPalette(counts, sums, maxColors);
+    PaletteLookup lookup(palette);
+
+    static constexpr std::uint8_t kBayer8[64] = {
+        0,  32, 8,  40, 2,  34, 10, 42, 48, 16, 56, 24, 50, 18, 58, 26, 12, 44, 4,  36, 14, 46, 6,  38, 60, 28, 52, 20, 62, 30, 54, 22,
+        3,  35, 11, 43, 1,  33, 9,  41, 51, 19, 59, 27, 49, 17, 57, 25, 15, 47, 7,  39, 13, 45, 5,  37, 63, 31, 55, 23, 61, 29, 53, 21};
+    const std::size_t width = static_cast<std::size_t>(pixels.width);
+    // Floyd-Steinberg carries error in two rows of per-channel sums (in
+    // sixteenths), padded by one pixel on each side.
+    std::vector<int> errorRows[2];
+    if (dither == GIFDither::FloydSteinberg) {
+        errorRows[0].assign((width + 2) * 3, 0);
+        errorRows[1].assign((width + 2) * 3, 0);
+    }
+    std::size_t out = 0;
+    for (int y = 0; y < pixels.height; ++y) {
+        const std::uint8_t* c = pixels.row(y);
+        if (dither == GIFDither::FloydSteinberg) {
+            std::swap(errorRows[0], errorRows[1]);
+            std::fill(errorRows[1].begin(), errorRows[1].end(), 0);
+        }
+        for (int x = 0; x < pixels.width; ++x, c += pixels.channels) {
+            if (keep != nullptr && keep[out] != 0) {
+                indices[out++] = 0;
+                continue;
+            }
+            int r = c[0];
+            int g = c[1];
+            int b = c[2];
+            if (dither == GIFDither::Ordered) {
+                const int offset = (static_cast<int>(kBayer8[(y & 7) * 8 + (x & 7)]) - 32) / 2;
+                r = clampChannel(r + offset);
+                g = clampChannel(g + offset);
+                b = clampChannel(b + offset);
+            } else if (dither == GIFDither::FloydSteinberg) {
+                const int* carried = errorRows[0].data() + (static_cast<std::size_t>(x) + 1) * 3;
+                r = clampChannel(r + carried[0] / 16);
+                g = clampChannel(g + carried[1] / 16);
+                b = clampChannel(b + carried[2] / 16);
+            }
+            const std::uint8_t index = lookup.nearest(r, g, b);
+            indices[out++] = index;
+            if (dither == GIFDither::FloydSteinberg) {
+                const Color& chosen = palette[index];
+                const int error[3] = {r - chosen.r, g - chosen.g, b - chosen.b};
+                int* right = errorRows[0].data() + (static_cast<std::size_t>(x) + 2) * 3;
+                int* below = errorRows[1].data() + static_cast<std::size_t>(x) * 3;
+                for (int k = 0; k < 3; ++k) {
+                    right[k] += error[k] * 7;
+                    below[k] += error[k] * 3;
+                    below[3 + k] += error[k] * 5;
+                    below[6 + k] += error[k];
+                }
+            }
+        }
+    }
+}
+
 void writeSubBlocks(std::vector<std::uint8_t>& out, const std::vector<std::uint8_t>& bytes) {
     std::size_t pos = 0;
     while (pos < bytes.size()) {
@@ -268,155 +575,93 @@ void writeSubBlocks(std::vector<std::uint8_t>& out, const std::vector<std::uint8
     out.push_back(0x00);
 }
 
-std::vector<std::uint8_t> readSubBlocks(const std::vector<std::uint8_t>& bytes, std::size_t& pos) {
+std::vector<std::uint8_t> readSubBlocks(const std::uint8_t* bytes, std::size_t size, std::size_t& pos) {
     std::vector<std::uint8_t> out;
     while (true) {
-        if (pos >= bytes.size()) {
+        if (pos >= size) {
             throw std::runtime_error("Corrupt GIF sub-block stream");
         }
         const std::uint8_t len = bytes[pos++];
         if (len == 0) {
             break;
         }
-        if (pos + len > bytes.size()) {
+        if (pos + len > size) {
             throw std::runtime_error("Corrupt GIF sub-block length");
         }
-        out.insert(out.end(), bytes.begin() + static_cast<std::ptrdiff_t>(pos),
-                   bytes.begin() + static_cast<std::ptrdiff_t>(pos + len));
+        out.insert(out.end(), bytes + static_cast<std::ptrdiff_t>(pos),
+                   bytes + static_cast<std::ptrdiff_t>(pos + len));
         pos += len;
     }
     return out;
 }
-} // namespace
-
-GIFImage::GIFImage() : m_width(0), m_height(0) {}
 
-GIFImage::GIFImage(int width, int height, const Color& fill)
-    : m_width(width), m_height(height), m_pixels(static_cast<std::size_t>(width) * static_cast<std::size_t>(height), fill) {
-    if (width <= 0 || height <= 0) {
-        throw std::invalid_argument("Image dimensions must be positive");
+void indexPixels(const PixelRows& pixels,
+                 GIFDither dither,
+                 const std::uint8_t* keep,
+                 std::size_t maxColors,
+                 std::vector<Color>& palette,
+                 std::vector<std::uint8_t>& indices) {
+    indices.resize(static_cast<std::size_t>(pixels.width) * static_cast<std::size_t>(pixels.height));
+    if (!exactPalette(pixels, keep, maxColors, palette, indices)) {
+        quantizeToPalette(pixels, dither, keep, maxColors, palette, indices);
     }
 }
 
-int GIFImage::width() const {
-    return m_width;
-}
-
-int GIFImage::height() const {
-    return m_height;
-}
-
-bool GIFImage::inBounds(int x, int y) const {
-    return x >= 0 && x < m_width && y >= 0 && y < m_height;
-}
-
-const Color& GIFImage::getPixel(int x, int y) const {
-    if (!inBounds(x, y)) {
-        throw std::out_of_range("Pixel out of bounds");
-    }
-    return m_pixels[pixelIndex(x, y, m_width)];
-}
-
-void GIFImage::setPixel(int x, int y, const Color& color) {
-    if (!inBounds(x, y)) {
-        return;
-    }
-    m_pixels[pixelIndex(x, y, m_width)] = color;
-}
-
-bool GIFImage::save(const std::string& filename) const {
-    if (m_width <= 0 || m_height <= 0) {
-        return false;
-    }
-
-    std::unordered_map<std::uint32_t, std::uint8_t> colorToIndex;
-    std::vector<Color> palette;
-    palette.reserve(256);
-    std::vector<std::uint8_t> indices;
-    indices.resize(m_pixels.size());
-
-    for (std::size_t i = 0; i < m_pixels.size(); ++i) {
-        const Color& c = m_pixels[i];
-        const std::uint32_t key = (static_cast<std::uint32_t>(c.r) << 16) |
-                                  (static_cast<std::uint32_t>(c.g) << 8) |
-                                  static_cast<std::uint32_t>(c.b);
-        const auto it = colorToIndex.find(key);
-        if (it != colorToIndex.end()) {
-            indices[i] = it->second;
-            continue;
-        }
-        if (palette.size() >= 256) {
-            return false;
-        }
-        const std::uint8_t idx = static_cast<std::uint8_t>(palette.size());
-        palette.push_back(c);
-        colorToIndex.emplace(key, idx);
-        indices[i] = idx;
-    }
-
+// Appends a color table padded to a power of two; returns its size in bits.
+int appendColorTable(std::vector<std::uint8_t>& out, const std::vector<Color>& palette) {
     const int colorCount = static_cast<int>(palette.size());
     const int tableBits = std::max(1, ceilLog2(std::max(2, colorCount)));
-    const int tableSize = 1 << tableBits;
-    const int minCodeSize = std::max(2, tableBits);
-
-    std::vector<std::uint8_t> out;
-    out.reserve(static_cast<std::size_t>(m_width) * static_cast<std::size_t>(m_height));
-
-    out.push_back('G');
-    out.push_back('I');
-    out.push_back('F');
-    out.push_back('8');
-    out.push_back('9');
-    out.push_back('a');
-
-    writeU16LE(out, static_cast<std::uint16_t>(m_width));
-    writeU16LE(out, static_cast<std::uint16_t>(m_height));
-    const std::uint8_t packed = static_cast<std::uint8_t>(0x80 | (7 << 4) | (tableBits - 1));
-    out.push_back(packed);
-    out.push_back(0x00);
-    out.push_back(0x00);
-
-    for (int i = 0; i < tableSize; ++i) {
-        if (i < colorCount) {
-            out.push_back(palette[static_cast<std::size_t>(i)].r);
-            out.push_back(palette[static_cast<std::size_t>(i)].g);
-            out.push_back(palette[static_cast<std::size_t>(i)].b);
-        } else {
-            out.push_back(0);
-            out.push_back(0);
-            out.push_back(0);
-        }
+    for (int i = 0; i < (1 << tableBits); ++i) {
+        const Color c = i < colorCount ? palette[static_cast<std::size_t>(i)] : Color(0, 0, 0);
+        out.push_back(c.r);
+        out.push_back(c.g);
+        out.push_back(c.b);
     }
+    return tableBits;
+}
 
+// Appends an image descriptor, its local color table when one is given, and
+// the LZW-coded indices.
+void appendImage(std::vector<std::uint8_t>& out,
+                 int left,
+                 int top,
+                 int width,
+                 int height,
+                 const std::vector<Color>* localPalette,
+                 int tableBits,
+                 const std::vector<std::uint8_t>& indices) {
     out.push_back(0x2C);
-    writeU16LE(out, 0);
-    writeU16LE(out, 0);
-    writeU16LE(out, static_cast<std::uint16_t>(m_width));
-    writeU16LE(out, static_cast<std::uint16_t>(m_height));
-    out.push_back(0x00);
-
-    out.push_back(static_cast<std::uint8_t>(minCodeSize));
-    const std::vector<std::uint8_t> compressed = lzwCompress(indices, minCodeSize);
-    writeSubBlocks(out, compressed);
-
-    out.push_back(0x3B);
-
-    std::ofstream file(filename, std::ios::binary);
-    if (!file) {
-        return false;
+    writeU16LE(out, static_cast<std::uint16_t>(left));
+    writeU16LE(out, static_cast<std::uint16_t>(top));
+    writeU16LE(out, static_cast<std::uint16_t>(width));
+    writeU16LE(out, static_cast<std::uint16_t>(height));
+    if (localPalette != nullptr) {
+        std::vector<std::uint8_t> table;
+        tableBits = appendColorTable(table, *localPalette);
+        out.push_back(static_cast<std::uint8_t>(0x80 | (tableBits - 1)));
+        out.insert(out.end(), table.begin(), table.end());
+    } else {
+        out.push_back(0x00);
     }
-    file.write(reinterpret_cast<const char*>(out.data()), static_cast<std::streamsize>(out.size()));
-    return static_cast<bool>(file);
+    const int minCodeSize = std::max(2, tableBits);
+    out.push_back(static_cast<std::uint8_t>(minCodeSize));
+    writeSubBlocks(out, lzwCompress(indices, minCodeSize));
 }
 
-GIFImage GIFImage::load(const std::string& filename) {
+std::vector<std::uint8_t> readGIFFile(const std::string& filename) {
     std::ifstream in(filename, std::ios::binary);
     if (!in) {
         throw std::runtime_error("Cannot open GIF file: " + filename);
     }
-    const std::vector<std::uint8_t> bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    return std::vector<std::uint8_t>((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+}
 
-    if (bytes.size() < 13) {
+// Composites frames onto a canvas from target (starting transparent black)
+// the way a viewer shows them: transparent pixels keep what is there, and
+// each frame's disposal method applies before the next one. frameDone runs
+// after every frame and returns whether to decode the next.
+void decodeGIF(const std::uint8_t* bytes, std::size_t size, const PixelTarget& target, const std::function<bool()>& frameDone) {
+    if (size < 13) {
         throw std::runtime_error("GIF file too small");
     }
     const bool sig87 = bytes[0] == 'G' && bytes[1] == 'I' && bytes[2] == 'F' && bytes[3] == '8' && bytes[4] == '7' && bytes[5] == 'a';
@@ -437,7 +682,7 @@ GIFImage GIFImage::load(const std::string& filename) {
     if ((lsdPacked & 0x80) != 0) {
         const int sizeBits = (lsdPacked & 0x07) + 1;
         const int gctSize = 1 << sizeBits;
-        if (pos + static_cast<std::size_t>(gctSize) * 3 > bytes.size()) {
+        if (pos + static_cast<std::size_t>(gctSize) * 3 > size) {
             throw std::runtime_error("Corrupt GIF global color table");
         }
         globalPalette.resize(static_cast<std::size_t>(gctSize));
@@ -447,29 +692,37 @@ GIFImage GIFImage::load(const std::string& filename) {
         }
     }
 
-    bool gotImage = false;
-    GIFImage image(canvasW, canvasH, Color(0, 0, 0));
+    const int channels = target.channels;
+    const std::size_t canvasStride = static_cast<std::size_t>(canvasW) * static_cast<std::size_t>(channels);
+    std::uint8_t* canvas = target.allocate(canvasW, canvasH);
+    std::fill(canvas, canvas + canvasStride * static_cast<std::size_t>(canvasH), std::uint8_t{0});
+    bool decodedFrame = false;
+    int transparentIndex = -1;
+    int disposal = 0;
 
-    while (pos < bytes.size()) {
+    while (pos < size) {
         const std::uint8_t introducer = bytes[pos++];
         if (introducer == 0x3B) {
             break;
         }
 
         if (introducer == 0x21) {
-            if (pos >= bytes.size()) {
+            if (pos >= size) {
                 throw std::runtime_error("Corrupt GIF extension block");
             }
-            ++pos;
-            (void)readSubBlocks(bytes, pos);
+            const std::uint8_t label = bytes[pos++];
+            const std::vector<std::uint8_t> data = readSubBlocks(bytes, size, pos);
+            if (label == 0xF9 && data.size() >= 4) {
+                disposal = (data[0] >> 2) & 0x07;
+                transparentIndex = (data[0] & 0x01) != 0 ? data[3] : -1;
+            }
             continue;
         }
 
         if (introducer != 0x2C) {
             throw std::runtime_error("Unsupported GIF block type");
         }
-
-        if (pos + 9 > bytes.size()) {
+        if (pos + 9 > size) {
             throw std::runtime_error("Corrupt GIF image descriptor");
         }
         const int left = readU16LE(bytes, pos);
@@ -485,7 +738,7 @@ GIFImage GIFImage::load(const std::string& filename) {
         if ((idPacked & 0x80) != 0) {
             const int sizeBits = (idPacked & 0x07) + 1;
             const int lctSize = 1 << sizeBits;
-            if (pos + static_cast<std::size_t>(lctSize) * 3 > bytes.size()) {
+            if (pos + static_cast<std::size_t>(lctSize) * 3 > size) {
                 throw std::runtime_error("Corrupt GIF local color table");
             }
             palette.resize(static_cast<std::size_t>(lctSize));
@@ -499,52 +752,327 @@ GIFImage GIFImage::load(const std::string& filename) {
             throw std::runtime_error("GIF has no color table");
         }
 
-        if (pos >= bytes.size()) {
+        if (pos >= size) {
             throw std::runtime_error("Corrupt GIF LZW header");
         }
         const int minCodeSize = bytes[pos++];
-        const std::vector<std::uint8_t> compressed = readSubBlocks(bytes, pos);
+        const std::vector<std::uint8_t> compressed = readSubBlocks(bytes, size, pos);
         const std::vector<std::uint8_t> indices =
             lzwDecompress(compressed, minCodeSize, static_cast<std::size_t>(imageW) * static_cast<std::size_t>(imageH));
 
         const bool interlaced = (idPacked & 0x40) != 0;
+        // Frames are clipped to the canvas.
+        const int x0 = std::min(left, canvasW);
+        const int y0 = std::min(top, canvasH);
+        const int x1 = std::min(left + imageW, canvasW);
+        const int y1 = std::min(top + imageH, canvasH);
+        std::vector<std::uint8_t> previous;
+        if (disposal == 3) {
+            previous.resize(static_cast<std::size_t>(x1 - x0) * static_cast<std::size_t>(channels) * static_cast<std::size_t>(y1 - y0));
+            for (int y = y0; y < y1; ++y) {
+                const std::uint8_t* row = canvas + static_cast<std::size_t>(y) * canvasStride + static_cast<std::size_t>(x0) * static_cast<std::size_t>(channels);
+                std::copy(row, row + static_cast<std::size_t>(x1 - x0) * static_cast<std::size_t>(channels),
+                          previous.begin() + static_cast<std::ptrdiff_t>(static_cast<std::size_t>(y - y0) * static_cast<std::size_t>(x1 - x0) * static_cast<std::size_t>(channels)));
+            }
+        }
         std::size_t src = 0;
+        const auto drawRow = [&](int y) {
+            const std::uint8_t* rowIndices = indices.data() + src;
+            src += static_cast<std::size_t>(imageW);
+            if (top + y >= canvasH) {
+                return;
+            }
+            std::uint8_t* out = canvas + static_cast<std::size_t>(top + y) * canvasStride + static_cast<std::size_t>(left) * static_cast<std::size_t>(channels);
+            for (int x = 0; x < x1 - left; ++x, out += channels) {
+                const std::uint8_t idx = rowIndices[x];
+                if (idx >= palette.size() || idx == transparentIndex) {
+                    continue;
+                }
+                const Color& c = palette[idx];
+                out[0] = c.r;
+                out[1] = c.g;
+                out[2] = c.b;
+                if (channels == 4) {
+                    out[3] = 255;
+                }
+            }
+        };
         if (!interlaced) {
             for (int y = 0; y < imageH; ++y) {
-                for (int x = 0; x < imageW; ++x) {
-                    const std::uint8_t idx = indices[src++];
-                    if (idx >= palette.size()) {
-                        continue;
-                    }
-                    image.setPixel(left + x, top + y, palette[idx]);
-                }
+                drawRow(y);
             }
         } else {
             const int starts[4] = {0, 4, 2, 1};
             const int steps[4] = {8, 8, 4, 2};
             for (int pass = 0; pass < 4; ++pass) {
                 for (int y = starts[pass]; y < imageH; y += steps[pass]) {
-                    for (int x = 0; x < imageW; ++x) {
-                        if (src >= indices.size()) {
-                            break;
-                        }
-                        const std::uint8_t idx = indices[src++];
-                        if (idx >= palette.size()) {
-                            continue;
-                        }
-                        image.setPixel(left + x, top + y, palette[idx]);
-                    }
+                    drawRow(y);
                 }
             }
         }
 
-        gotImage = true;
-        break;
+        decodedFrame = true;
+        if (!frameDone()) {
+            return;
+        }
+        for (int y = y0; y < y1 && disposal >= 2; ++y) {
+            std::uint8_t* row = canvas + static_cast<std::size_t>(y) * canvasStride + static_cast<std::size_t>(x0) * static_cast<std::size_t>(channels);
+            const std::size_t rowBytes = static_cast<std::size_t>(x1 - x0) * static_cast<std::size_t>(channels);
+            if (disposal == 2) {
+                std::fill(row, row + rowBytes, std::uint8_t{0});
+            } else if (disposal == 3) {
+                const auto saved = previous.begin() + static_cast<std::ptrdiff_t>(static_cast<std::size_t>(y - y0) * rowBytes);
+                std::copy(saved, saved + static_cast<std::ptrdiff_t>(rowBytes), row);
+            }
+        }
+        transparentIndex = -1;
+        disposal = 0;
     }
 
-    if (!gotImage) {
+    if (!decodedFrame) {
         throw std::runtime_error("GIF file has no image frame");
     }
+}
+} // namespace
+
+GIFImage::GIFImage() : m_width(0), m_height(0) {}
+
+GIFImage::GIFImage(int width, int height, const Color& fill)
+    : m_width(width), m_height(height), m_pixels(static_cast<std::size_t>(width) * static_cast<std::size_t>(height), fill) {
+    if (width <= 0 || height <= 0) {
+        throw std::invalid_argument("Image dimensions must be positive");
+    }
+}
+
+int GIFImage::width() const {
+    return m_width;
+}
+
+int GIFImage::height() const {
+    return m_height;
+}
+
+bool GIFImage::inBounds(int x, int y) const {
+    return x >= 0 && x < m_width && y >= 0 && y < m_height;
+}
+
+const Color& GIFImage::getPixel(int x, int y) const {
+    if (!inBounds(x, y)) {
+        throw std::out_of_range("Pixel out of bounds");
+    }
+    return m_pixels[pixelIndex(x, y, m_width)];
+}
+
+void GIFImage::setPixel(int x, int y, const Color& color) {
+    if (!inBounds(x, y)) {
+        return;
+    }
+    m_pixels[pixelIndex(x, y, m_width)] = color;
+}
+
+bool GIFImage::save(const std::string& filename, const GIFSaveOptions& options) const {
+    if (m_width <= 0 || m_height <= 0) {
+        return false;
+    }
+    return saveRows(filename, colorRows(m_pixels.data(), m_width, m_height), options);
+}
+
+bool GIFImage::saveRows(const std::string& filename, const PixelRows& pixels, const GIFSaveOptions& options) {
+    if (pixels.width <= 0 || pixels.height <= 0 || pixels.width > 65535 || pixels.height > 65535) {
+        return false;
+    }
+
+    std::vector<Color> palette;
+    std::vector<std::uint8_t> indices;
+    indexPixels(pixels, options.dither, nullptr, 256, palette, indices);
+
+    std::vector<std::uint8_t> out;
+    out.reserve(indices.size() / 2 + 1024);
+    out.insert(out.end(), {'G', 'I', 'F', '8', '9', 'a'});
+    writeU16LE(out, static_cast<std::uint16_t>(pixels.width));
+    writeU16LE(out, static_cast<std::uint16_t>(pixels.height));
+    std::vector<std::uint8_t> table;
+    const int tableBits = appendColorTable(table, palette);
+    out.push_back(static_cast<std::uint8_t>(0x80 | (7 << 4) | (tableBits - 1)));
+    out.push_back(0x00);
+    out.push_back(0x00);
+    out.insert(out.end(), table.begin(), table.end());
+    appendImage(out, 0, 0, pixels.width, pixels.height, nullptr, tableBits, indices);
+
+    out.push_back(0x3B);
+
+    std::ofstream file(filename, std::ios::binary);
+    if (!file) {
+        return false;
+    }
+    file.write(reinterpret_cast<const char*>(out.data()), static_cast<std::streamsize>(out.size()));
+    return static_cast<bool>(file);
+}
 
+GIFImage GIFImage::load(const std::string& filename) {
+    const std::vector<std::uint8_t> bytes = readGIFFile(filename);
+    GIFImage image;
+    decode(bytes.data(), bytes.size(), {3, [&image](int width, int height) {
+                                            image = GIFImage(width, height);
+                                            return reinterpret_cast<std::uint8_t*>(image.m_pixels.data());
+                                        }});
     return image;
 }
+
+std::vector<GIFImage> GIFImage::loadFrames(const std::string& filename) {
+    const std::vector<std::uint8_t> bytes = readGIFFile(filename);
+    std::vector<GIFImage> frames;
+    GIFImage canvas;
+    decodeGIF(bytes.data(), bytes.size(),
+              {3, [&canvas](int width, int height) {
+                   canvas = GIFImage(width, height);
+                   return reinterpret_cast<std::uint8_t*>(canvas.m_pixels.data());
+               }},
+              [&]() {
+                  frames.push_back(canvas);
+                  return true;
+              });
+    return frames;
+}
+
+void GIFImage::decode(const std::uint8_t* data, std::size_t size, const PixelTarget& target) {
+    decodeGIF(data, size, target, []() { return false; });
+}
+
+GIFAnimationWriter::GIFAnimationWriter(const std::string& filename, int width, int height, const GIFSaveOptions& options)
+    : m_out(filename, std::ios::binary), m_options(options), m_width(width), m_height(height), m_frames(0), m_finished(false) {
+    if (width <= 0 || height <= 0 || width > 65535 || height > 65535) {
+        throw std::invalid_argument("Invalid GIF animation dimensions");
+    }
+    if (!m_out) {
+        throw std::runtime_error("Cannot open GIF file for writing: " + filename);
+    }
+    std::vector<std::uint8_t> header = {'G', 'I', 'F', '8', '9', 'a'};
+    writeU16LE(header, static_cast<std::uint16_t>(width));
+    writeU16LE(header, static_cast<std::uint16_t>(height));
+    header.insert(header.end(), {0x70, 0x00, 0x00});
+    // NETSCAPE2.0 application extension: loop forever.
+    header.insert(header.end(), {0x21, 0xFF, 0x0B, 'N', 'E', 'T', 'S', 'C', 'A', 'P', 'E', '2', '.', '0', 0x03, 0x01, 0x00, 0x00, 0x00});
+    m_out.write(reinterpret_cast<const char*>(header.data()), static_cast<std::streamsize>(header.size()));
+}
+
+void GIFAnimationWriter::addFrame(const PixelRows& pixels, int delayCentiseconds) {
+    if (m_finished) {
+        throw std::logic_error("GIF animation is already finished");
+    }
+    if (pixels.width != m_width || pixels.height != m_height) {
+        throw std::invalid_argument("GIF animation frames must match the canvas size");
+    }
+    const std::size_t stride = static_cast<std::size_t>(m_width) * 3;
+    m_current.resize(stride * static_cast<std::size_t>(m_height));
+    for (int y = 0; y < m_height; ++y) {
+        const std::uint8_t* src = pixels.row(y);
+        std::uint8_t* dst = m_current.data() + static_cast<std::size_t>(y) * stride;
+        for (int x = 0; x < m_width; ++x, src += pixels.channels, dst += 3) {
+            dst[0] = src[0];
+            dst[1] = src[1];
+            dst[2] = src[2];
+        }
+    }
+
+    int left = 0;
+    int top = 0;
+    int right = m_width - 1;
+    int bottom = m_height - 1;
+    const bool delta = m_frames > 0;
+    if (delta) {
+        left = m_width;
+        top = m_height;
+        right = -1;
+        bottom = -1;
+        for (int y = 0; y < m_height; ++y) {
+            const std::uint8_t* a = m_current.data() + static_cast<std::size_t>(y) * stride;
+            const std::uint8_t* b = m_previous.data() + static_cast<std::size_t>(y) * stride;
+            if (std::equal(a, a + stride, b)) {
+                continue;
+            }
+            int x0 = 0;
+            while (a[x0 * 3] == b[x0 * 3] && a[x0 * 3 + 1] == b[x0 * 3 + 1] && a[x0 * 3 + 2] == b[x0 * 3 + 2]) {
+                ++x0;
+            }
+            int x1 = m_width - 1;
+            while (a[x1 * 3] == b[x1 * 3] && a[x1 * 3 + 1] == b[x1 * 3 + 1] && a[x1 * 3 + 2] == b[x1 * 3 + 2]) {
+                --x1;
+            }
+            left = std::min(left, x0);
+            right = std::max(right, x1);
+            top = std::min(top, y);
+            bottom = y;
+        }
+        if (right < 0) {
+            // Nothing changed: a single transparent pixel still carries the delay.
+            left = 0;
+            top = 0;
+            right = 0;
+            bottom = 0;
+        }
+    }
+
+    const int rectW = right - left + 1;
+    const int rectH = bottom - top + 1;
+    const std::size_t offset = static_cast<std::size_t>(top) * stride + static_cast<std::size_t>(left) * 3;
+    const PixelRows rect{m_current.data() + offset, rectW, rectH, 3, stride};
+    std::vector<std::uint8_t> keep;
+    if (delta) {
+        keep.resize(static_cast<std::size_t>(rectW) * static_cast<std::size_t>(rectH));
+        for (int y = 0; y < rectH; ++y) {
+            const std::uint8_t* a = rect.row(y);
+            const std::uint8_t* b = m_previous.data() + offset + static_cast<std::size_t>(y) * stride;
+            for (int x = 0; x < rectW; ++x) {
+                keep[static_cast<std::size_t>(y) * static_cast<std::size_t>(rectW) + static_cast<std::size_t>(x)] =
+                    a[x * 3] == b[x * 3] && a[x * 3 + 1] == b[x * 3 + 1] && a[x * 3 + 2] == b[x * 3 + 2] ? 1 : 0;
+            }
+        }
+    }
+
+    std::vector<Color> palette;
+    std::vector<std::uint8_t> indices;
+    indexPixels(rect, m_options.dither, delta ? keep.data() : nullptr, delta ? 255 : 256, palette, indices);
+    const std::uint8_t transparent = static_cast<std::uint8_t>(palette.size());
+    if (delta) {
+        palette.emplace_back(0, 0, 0);
+        for (std::size_t i = 0; i < keep.size(); ++i) {
+            if (keep[i] != 0) {
+                indices[i] = transparent;
+            }
+        }
+    }
+
+    // Graphic control extension: keep this frame in place under the next one.
+    const std::uint16_t delay = static_cast<std::uint16_t>(std::max(0, std::min(delayCentiseconds, 65535)));
+    std::vector<std::uint8_t> frame = {0x21, 0xF9, 0x04, static_cast<std::uint8_t>((1 << 2) | (delta ? 1 : 0))};
+    writeU16LE(frame, delay);
+    frame.push_back(delta ? transparent : 0);
+    frame.push_back(0x00);
+    appendImage(frame, left, top, rectW, rectH, &palette, 0, indices);
+    m_out.write(reinterpret_cast<const char*>(frame.data()), static_cast<std::streamsize>(frame.size()));
+    if (!m_out) {
+        throw std::runtime_error("Failed writing GIF animation frame");
+    }
+    m_previous.swap(m_current);
+    ++m_frames;
+}
+
+void GIFAnimationWriter::finish() {
+    if (m_finished) {
+        return;
+    }
+    if (m_frames == 0) {
+        throw std::logic_error("GIF animation has no frames");
+    }
+    m_out.put(0x3B);
+    m_out.close();
+    if (!m_out) {
+        throw std::runtime_error("Failed finishing GIF animation");
+    }
+    m_finished = true;
+}
+
+int GIFAnimationWriter::frameCount() const {
+    return m_frames;
+}
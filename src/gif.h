@@ -3,9 +3,24 @@
 
 #include "image.h"
 
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
 #include <string>
 #include <vector>
 
+enum class GIFDither {
+    None,
+    Ordered,
+    FloydSteinberg,
+};
+
+// Images with up to 256 colors are stored exactly; others are reduced to a
+// 256-color median-cut palette, optionally dithered.
+struct GIFSaveOptions {
+    GIFDither dither = GIFDither::None;
+};
+
 class GIFImage : public RasterImage {
 public:
     GIFImage();
@@ -18,8 +33,13 @@ public:
     const Color& getPixel(int x, int y) const override;
     void setPixel(int x, int y, const Color& color) override;
 
-    bool save(const std::string& filename) const;
+    bool save(const std::string& filename, const GIFSaveOptions& options = GIFSaveOptions()) const;
+    static bool saveRows(const std::string& filename, const PixelRows& pixels, const GIFSaveOptions& options = GIFSaveOptions());
     static GIFImage load(const std::string& filename);
+    // Every frame of an animation, composited as a viewer would show it.
+    static std::vector<GIFImage> loadFrames(const std::string& filename);
+    // Decodes the first frame; RGBA targets keep transparent pixels clear.
+    static void decode(const std::uint8_t* data, std::size_t size, const PixelTarget& target);
 
 private:
     int m_width;
@@ -27,4 +47,27 @@ private:
     std::vector<Color> m_pixels;
 };
 
+// Writes a looping animated GIF one frame at a time. After the first frame,
+// each frame stores only the bounding box of pixels that changed, with the
+// unchanged pixels inside it transparent so the previous frame shows
+// through. Delays are in hundredths of a second. Failures throw.
+class GIFAnimationWriter {
+public:
+    GIFAnimationWriter(const std::string& filename, int width, int height, const GIFSaveOptions& options = GIFSaveOptions());
+
+    void addFrame(const PixelRows& pixels, int delayCentiseconds);
+    void finish();
+    int frameCount() const;
+
+private:
+    std::ofstream m_out;
+    GIFSaveOptions m_options;
+    std::vector<std::uint8_t> m_previous;
+    std::vector<std::uint8_t> m_current;
+    int m_width;
+    int m_height;
+    int m_frames;
+    bool m_finished;
+};
+
 #endif
@@ -1,7 +1,9 @@
 #ifndef IMAGE_H
 #define IMAGE_H
 
+#include <cstddef>
 #include <cstdint>
+#include <functional>
 
 struct Color {
     std::uint8_t r;
@@ -13,6 +15,32 @@ struct Color {
         : r(red), g(green), b(blue) {}
 };
 
+static_assert(sizeof(Color) == 3, "Color must be packed RGB8");
+
+// Borrowed 8-bit rows handed straight to encoders: 3 channels (RGB, the
+// layout of Color) or 4 (RGBA). Formats without alpha ignore the fourth.
+struct PixelRows {
+    const std::uint8_t* data = nullptr;
+    int width = 0;
+    int height = 0;
+    int channels = 3;
+    std::size_t strideBytes = 0;
+
+    const std::uint8_t* row(int y) const { return data + static_cast<std::size_t>(y) * strideBytes; }
+};
+
+inline PixelRows colorRows(const Color* pixels, int width, int height) {
+    return {reinterpret_cast<const std::uint8_t*>(pixels), width, height, 3, static_cast<std::size_t>(width) * 3};
+}
+
+// Where a decoder writes its pixels. Once the size is known, allocate
+// returns tightly packed rows of `channels` bytes per pixel: 3 for RGB in
+// the layout of Color, or 4 for RGBA (formats without alpha write 255).
+struct PixelTarget {
+    int channels = 3;
+    std::function<std::uint8_t*(int width, int height)> allocate;
+};
+
 class Image {
 public:
     virtual ~Image() = default;
@@ -1,5 +1,7 @@
 #include "jpg.h"
 
+#include "parallel.h"
+
 #include <algorithm>
 #include <array>
 #include <cmath>
@@ -9,10 +11,10 @@
 #include <limits>
 #include <stdexcept>
 #include <string>
+#include <utility>
 #include <vector>
 
 namespace {
-constexpr double kPi = 3.14159265358979323846;
 constexpr std::size_t kMaxImagePixels = 100000000;
 
 constexpr std::array<int, 64> kZigZag = {
@@ -152,6 +154,9 @@ void writeU16BE(std::vector<std::uint8_t>& out, std::uint16_t value) {
     out.push_back(static_cast<std::uint8_t>(value & 0xFF));
 }
 
+// Codes up to this long decode with one table lookup.
+constexpr int kHuffmanLookupBits = 9;
+
 struct HuffmanTable {
     std::array<std::uint8_t, 17> bits{};
     std::vector<std::uint8_t> values;
@@ -160,6 +165,9 @@ struct HuffmanTable {
     std::array<int, 17> valPtr{};
     std::array<std::uint16_t, 256> code{};
     std::array<std::uint8_t, 256> codeLen{};
+    // Indexed by the next kHuffmanLookupBits bits: code length << 8 | symbol,
+    // or 0 for longer codes.
+    std::array<std::uint16_t, 1 << kHuffmanLookupBits> lookup{};
     bool defined = false;
 };
 
@@ -184,14 +192,24 @@ void buildHuffmanTable(HuffmanTable& table) {
 
     table.code.fill(0);
     table.codeLen.fill(0);
+    table.lookup.fill(0);
 
     code = 0;
     k = 0;
     for (int i = 1; i <= 16; ++i) {
         for (int j = 0; j < table.bits[i]; ++j) {
+            if (code >= (1 << i)) {
+                throw std::runtime_error("Corrupt JPEG Huffman table");
+            }
             const std::uint8_t symbol = table.values[static_cast<std::size_t>(k++)];
             table.code[symbol] = static_cast<std::uint16_t>(code);
             table.codeLen[symbol] = static_cast<std::uint8_t>(i);
+            if (i <= kHuffmanLookupBits) {
+                const int shift = kHuffmanLookupBits - i;
+                for (int fill = 0; fill < (1 << shift); ++fill) {
+                    table.lookup[static_cast<std::size_t>((code << shift) | fill)] = static_cast<std::uint16_t>((i << 8) | symbol);
+                }
+            }
             ++code;
         }
         code <<= 1;
@@ -211,25 +229,19 @@ class BitWriter {
 public:
     explicit BitWriter(std::vector<std::uint8_t>& out) : m_out(out), m_acc(0), m_bits(0) {}
 
-    void putBits(std::uint16_t bits, int bitCount) {
-        for (int i = bitCount - 1; i >= 0; --i) {
-            const std::uint8_t bit = static_cast<std::uint8_t>((bits >> i) & 1U);
-            m_acc = static_cast<std::uint8_t>((m_acc << 1) | bit);
-            ++m_bits;
-            if (m_bits == 8) {
-                flushByte(m_acc);
-                m_bits = 0;
-                m_acc = 0;
-            }
+    void putBits(std::uint32_t bits, int bitCount) {
+        m_acc = (m_acc << bitCount) | (bits & ((1u << bitCount) - 1u));
+        m_bits += bitCount;
+        while (m_bits >= 8) {
+            m_bits -= 8;
+            flushByte(static_cast<std::uint8_t>(m_acc >> m_bits));
         }
     }
 
+    // Pads the last byte with one bits, as required before a marker.
     void flush() {
         if (m_bits > 0) {
-            const std::uint8_t padded = static_cast<std::uint8_t>((m_acc << (8 - m_bits)) | ((1U << (8 - m_bits)) - 1U));
-            flushByte(padded);
-            m_bits = 0;
-            m_acc = 0;
+            putBits((1u << (8 - m_bits)) - 1u, 8 - m_bits);
         }
     }
 
@@ -242,73 +254,59 @@ private:
     }
 
     std::vector<std::uint8_t>& m_out;
-    std::uint8_t m_acc;
+    std::uint64_t m_acc;
     int m_bits;
 };
 
+// Reads one entropy-coded segment (the bytes between restart markers, with
+// 0xFF00 stuffing still in place). Past the end it supplies zero bits, as
+// decoders must for the final byte, but gives up on grossly truncated data.
 class BitReader {
 public:
-    explicit BitReader(const std::vector<std::uint8_t>& data)
-        : m_data(data), m_pos(0), m_bitsLeft(0), m_cur(0), m_hitMarker(false) {}
+    BitReader(const std::uint8_t* data, std::size_t size)
+        : m_data(data), m_size(size), m_pos(0), m_acc(0), m_bits(0), m_padding(0) {}
 
-    std::uint32_t readBit() {
-        if (m_bitsLeft == 0) {
+    std::uint32_t peekBits(int n) {
+        while (m_bits < n) {
             fillByte();
         }
-        --m_bitsLeft;
-        return (m_cur >> m_bitsLeft) & 1U;
+        return static_cast<std::uint32_t>(m_acc >> (m_bits - n)) & ((1u << n) - 1u);
     }
 
-    std::uint32_t readBits(int n) {
-        std::uint32_t v = 0;
-        for (int i = 0; i < n; ++i) {
-            v = (v << 1) | readBit();
-        }
-        return v;
+    void skipBits(int n) {
+        m_bits -= n;
     }
 
-    bool hitMarker() const {
-        return m_hitMarker;
+    std::uint32_t readBits(int n) {
+        if (n == 0) {
+            return 0;
+        }
+        const std::uint32_t value = peekBits(n);
+        m_bits -= n;
+        return value;
     }
 
 private:
     void fillByte() {
-        if (m_pos >= m_data.size()) {
-            throw std::runtime_error("Unexpected end of JPEG scan data");
-        }
-
-        std::uint8_t byte = m_data[m_pos++];
-        if (byte == 0xFF) {
-            while (m_pos < m_data.size() && m_data[m_pos] == 0xFF) {
-                ++m_pos;
-            }
-            if (m_pos >= m_data.size()) {
-                throw std::runtime_error("Unexpected end of JPEG marker");
-            }
-
-            const std::uint8_t next = m_data[m_pos];
-            if (next == 0x00) {
-                ++m_pos;
-                byte = 0xFF;
-            } else if (next >= 0xD0 && next <= 0xD7) {
+        std::uint8_t byte = 0;
+        if (m_pos < m_size) {
+            byte = m_data[m_pos++];
+            if (byte == 0xFF && m_pos < m_size && m_data[m_pos] == 0x00) {
                 ++m_pos;
-                fillByte();
-                return;
-            } else {
-                m_hitMarker = true;
-                throw std::runtime_error("Unexpected marker in JPEG scan");
             }
+        } else if (++m_padding > 16) {
+            throw std::runtime_error("Unexpected end of JPEG scan data");
         }
-
-        m_cur = byte;
-        m_bitsLeft = 8;
+        m_acc = (m_acc << 8) | byte;
+        m_bits += 8;
     }
 
-    const std::vector<std::uint8_t>& m_data;
+    const std::uint8_t* m_data;
+    std::size_t m_size;
     std::size_t m_pos;
-    int m_bitsLeft;
-    std::uint8_t m_cur;
-    bool m_hitMarker;
+    std::uint64_t m_acc;
+    int m_bits;
+    int m_padding;
 };
 
 int magnitudeCategory(int value) {
@@ -345,62 +343,144 @@ int extendSign(std::uint32_t bits, int category) {
     return static_cast<int>(bits) - ((1 << category) - 1);
 }
 
-std::array<double, 64> fdct8x8(const std::array<double, 64>& in) {
-    std::array<double, 64> out{};
+// AAN scale factors, cos(k * pi / 16) * sqrt(2) with k = 0 taken as 1. The
+// transforms below leave coefficient (u, v) multiplied by
+// kAanScale[u] * kAanScale[v] (and by 8 going forward); the quantization
+// tables absorb both, so no separate scaling pass is needed.
+constexpr std::array<float, 8> kAanScale = {1.0f,         1.387039845f, 1.306562965f, 1.175875602f,
+                                            1.0f,         0.785694958f, 0.541196100f, 0.275899379f};
+
+// One 8-point forward AAN DCT over samples stride apart, in place.
+void forwardDct1D(float* p, std::size_t stride) {
+    const std::size_t s = stride;
+    const float tmp0 = p[0] + p[7 * s];
+    const float tmp7 = p[0] - p[7 * s];
+    const float tmp1 = p[s] + p[6 * s];
+    const float tmp6 = p[s] - p[6 * s];
+    const float tmp2 = p[2 * s] + p[5 * s];
+    const float tmp5 = p[2 * s] - p[5 * s];
+    const float tmp3 = p[3 * s] + p[4 * s];
+    const float tmp4 = p[3 * s] - p[4 * s];
+
+    const float even0 = tmp0 + tmp3;
+    const float even3 = tmp0 - tmp3;
+    const float even1 = tmp1 + tmp2;
+    const float even2 = tmp1 - tmp2;
+    p[0] = even0 + even1;
+    p[4 * s] = even0 - even1;
+    const float z1 = (even2 + even3) * 0.707106781f;
+    p[2 * s] = even3 + z1;
+    p[6 * s] = even3 - z1;
+
+    const float odd0 = tmp4 + tmp5;
+    const float odd1 = tmp5 + tmp6;
+    const float odd2 = tmp6 + tmp7;
+    const float z5 = (odd0 - odd2) * 0.382683433f;
+    const float z2 = 0.541196100f * odd0 + z5;
+    const float z4 = 1.306562965f * odd2 + z5;
+    const float z3 = odd1 * 0.707106781f;
+    const float z11 = tmp7 + z3;
+    const float z13 = tmp7 - z3;
+    p[5 * s] = z13 + z2;
+    p[3 * s] = z13 - z2;
+    p[s] = z11 + z4;
+    p[7 * s] = z11 - z4;
+}
 
-    for (int v = 0; v < 8; ++v) {
-        for (int u = 0; u < 8; ++u) {
-            double sum = 0.0;
-            for (int y = 0; y < 8; ++y) {
-                for (int x = 0; x < 8; ++x) {
-                    sum += in[static_cast<std::size_t>(y) * 8 + x] *
-                           std::cos(((2.0 * x + 1.0) * u * kPi) / 16.0) *
-                           std::cos(((2.0 * y + 1.0) * v * kPi) / 16.0);
-                }
-            }
-            const double cu = (u == 0) ? (1.0 / std::sqrt(2.0)) : 1.0;
-            const double cv = (v == 0) ? (1.0 / std::sqrt(2.0)) : 1.0;
-            out[static_cast<std::size_t>(v) * 8 + u] = 0.25 * cu * cv * sum;
-        }
+// One 8-point inverse AAN DCT over coefficients stride apart, in place.
+void inverseDct1D(float* p, std::size_t stride) {
+    const std::size_t s = stride;
+    const float even10 = p[0] + p[4 * s];
+    const float even11 = p[0] - p[4 * s];
+    const float even13 = p[2 * s] + p[6 * s];
+    const float even12 = (p[2 * s] - p[6 * s]) * 1.414213562f - even13;
+    const float tmp0 = even10 + even13;
+    const float tmp3 = even10 - even13;
+    const float tmp1 = even11 + even12;
+    const float tmp2 = even11 - even12;
+
+    const float z13 = p[5 * s] + p[3 * s];
+    const float z10 = p[5 * s] - p[3 * s];
+    const float z11 = p[s] + p[7 * s];
+    const float z12 = p[s] - p[7 * s];
+    const float tmp7 = z11 + z13;
+    const float odd11 = (z11 - z13) * 1.414213562f;
+    const float z5 = (z10 + z12) * 1.847759065f;
+    const float odd10 = 1.082392200f * z12 - z5;
+    const float odd12 = -2.613125930f * z10 + z5;
+    const float tmp6 = odd12 - tmp7;
+    const float tmp5 = odd11 - tmp6;
+    const float tmp4 = odd10 + tmp5;
+
+    p[0] = tmp0 + tmp7;
+    p[7 * s] = tmp0 - tmp7;
+    p[s] = tmp1 + tmp6;
+    p[6 * s] = tmp1 - tmp6;
+    p[2 * s] = tmp2 + tmp5;
+    p[5 * s] = tmp2 - tmp5;
+    p[4 * s] = tmp3 + tmp4;
+    p[3 * s] = tmp3 - tmp4;
+}
+
+void forwardDct8x8(float* block) {
+    for (int row = 0; row < 8; ++row) {
+        forwardDct1D(block + row * 8, 1);
     }
+    for (int column = 0; column < 8; ++column) {
+        forwardDct1D(block + column, 8);
+    }
+}
 
-    return out;
+void inverseDct8x8(float* block) {
+    for (int column = 0; column < 8; ++column) {
+        inverseDct1D(block + column, 8);
+    }
+    for (int row = 0; row < 8; ++row) {
+        inverseDct1D(block + row * 8, 1);
+    }
 }
 
-std::array<double, 64> idct8x8(const std::array<double, 64>& in) {
-    std::array<double, 64> out{};
+// Per-coefficient multipliers, in natural order, that quantize forward DCT
+// output (encoder) or dequantize coefficients for inverseDct8x8 (decoder).
+std::array<float, 64> quantizationMultipliers(const std::array<std::uint8_t, 64>& q) {
+    std::array<float, 64> out{};
+    for (std::size_t k = 0; k < 64; ++k) {
+        out[k] = 1.0f / (static_cast<float>(q[k]) * kAanScale[k / 8] * kAanScale[k % 8] * 8.0f);
+    }
+    return out;
+}
 
-    for (int y = 0; y < 8; ++y) {
-        for (int x = 0; x < 8; ++x) {
-            double sum = 0.0;
-            for (int v = 0; v < 8; ++v) {
-                for (int u = 0; u < 8; ++u) {
-                    const double cu = (u == 0) ? (1.0 / std::sqrt(2.0)) : 1.0;
-                    const double cv = (v == 0) ? (1.0 / std::sqrt(2.0)) : 1.0;
-                    sum += cu * cv * in[static_cast<std::size_t>(v) * 8 + u] *
-                           std::cos(((2.0 * x + 1.0) * u * kPi) / 16.0) *
-                           std::cos(((2.0 * y + 1.0) * v * kPi) / 16.0);
-                }
-            }
-            out[static_cast<std::size_t>(y) * 8 + x] = 0.25 * sum;
-        }
+std::array<float, 64> dequantizationMultipliers(const std::array<std::uint8_t, 64>& q) {
+    std::array<float, 64> out{};
+    for (std::size_t k = 0; k < 64; ++k) {
+        out[k] = static_cast<float>(q[k]) * kAanScale[k / 8] * kAanScale[k % 8] / 8.0f;
     }
+    return out;
+}
 
+// Scales a base table the way the IJG encoder does: quality 50 keeps it,
+// higher qualities shrink the divisors and lower ones grow them.
+std::array<std::uint8_t, 64> scaledQuantTable(const std::array<std::uint8_t, 64>& base, int quality) {
+    const int scale = quality < 50 ? 5000 / quality : 200 - quality * 2;
+    std::array<std::uint8_t, 64> out{};
+    for (std::size_t k = 0; k < 64; ++k) {
+        out[k] = static_cast<std::uint8_t>(std::min(std::max((base[k] * scale + 50) / 100, 1), 255));
+    }
     return out;
 }
 
-void emitDQT(std::vector<std::uint8_t>& out) {
+void emitDQT(std::vector<std::uint8_t>& out, const std::array<std::uint8_t, 64>& luma, const std::array<std::uint8_t, 64>& chroma) {
     writeMarker(out, 0xDB);
     writeU16BE(out, 2 + (1 + 64) * 2);
 
     out.push_back(0x00);
     for (int i = 0; i < 64; ++i) {
-        out.push_back(kQuantLuma[static_cast<std::size_t>(kZigZag[i])]);
+        out.push_back(luma[static_cast<std::size_t>(kZigZag[i])]);
     }
 
     out.push_back(0x01);
     for (int i = 0; i < 64; ++i) {
-        out.push_back(kQuantChroma[static_cast<std::size_t>(kZigZag[i])]);
+        out.push_back(chroma[static_cast<std::size_t>(kZigZag[i])]);
     }
 }
 
@@ -439,20 +519,532 @@ void emitDHT(std::vector<std::uint8_t>& out) {
 }
 
 int decodeHuffmanSymbol(BitReader& br, const HuffmanTable& ht) {
-    int code = 0;
-    for (int len = 1; len <= 16; ++len) {
-        code = (code << 1) | static_cast<int>(br.readBit());
+    const std::uint16_t entry = ht.lookup[br.peekBits(kHuffmanLookupBits)];
+    if (entry != 0) {
+        br.skipBits(entry >> 8);
+        return entry & 0xFF;
+    }
+    const int bits = static_cast<int>(br.peekBits(16));
+    for (int len = kHuffmanLookupBits + 1; len <= 16; ++len) {
+        const int code = bits >> (16 - len);
         if (ht.minCode[len] >= 0 && code <= ht.maxCode[len]) {
-            const int idx = ht.valPtr[len] + (code - ht.minCode[len]);
-            if (idx < 0 || idx >= static_cast<int>(ht.values.size())) {
-                throw std::runtime_error("Corrupt Huffman table");
-            }
-            return ht.values[static_cast<std::size_t>(idx)];
+            br.skipBits(len);
+            return ht.values[static_cast<std::size_t>(ht.valPtr[len] + (code - ht.minCode[len]))];
         }
     }
     throw std::runtime_error("Invalid Huffman code");
 }
 
+struct JPGEncodeTables {
+    HuffmanTable dcY;
+    HuffmanTable acY;
+    HuffmanTable dcC;
+    HuffmanTable acC;
+    std::array<float, 64> quantY;
+    std::array<float, 64> quantC;
+};
+
+void encodeBlock(BitWriter& bw,
+                 float* block,
+                 const std::array<float, 64>& quant,
+                 const HuffmanTable& dc,
+                 const HuffmanTable& ac,
+                 int& prevDC) {
+    forwardDct8x8(block);
+
+    std::array<int, 64> zz{};
+    for (int i = 0; i < 64; ++i) {
+        const std::size_t natural = static_cast<std::size_t>(kZigZag[static_cast<std::size_t>(i)]);
+        // Rounds half away from zero via an offset that keeps the value positive.
+        zz[static_cast<std::size_t>(i)] = static_cast<int>(block[natural] * quant[natural] + 16384.5f) - 16384;
+    }
+
+    const int dcDiff = zz[0] - prevDC;
+    prevDC = zz[0];
+
+    const int dcCat = magnitudeCategory(dcDiff);
+    bw.putBits(dc.code[static_cast<std::size_t>(dcCat)], dc.codeLen[static_cast<std::size_t>(dcCat)]);
+    if (dcCat > 0) {
+        bw.putBits(magnitudeBits(dcDiff, dcCat), dcCat);
+    }
+
+    int run = 0;
+    for (int i = 1; i < 64; ++i) {
+        const int coeff = zz[static_cast<std::size_t>(i)];
+        if (coeff == 0) {
+            ++run;
+            continue;
+        }
+
+        while (run >= 16) {
+            const std::uint8_t zrl = 0xF0;
+            bw.putBits(ac.code[zrl], ac.codeLen[zrl]);
+            run -= 16;
+        }
+
+        const int cat = magnitudeCategory(coeff);
+        const std::uint8_t symbol = static_cast<std::uint8_t>((run << 4) | cat);
+        bw.putBits(ac.code[symbol], ac.codeLen[symbol]);
+        bw.putBits(magnitudeBits(coeff, cat), cat);
+        run = 0;
+    }
+
+    if (run > 0) {
+        const std::uint8_t eob = 0x00;
+        bw.putBits(ac.code[eob], ac.codeLen[eob]);
+    }
+}
+
+// Entropy-codes one row of MCUs as a complete restart interval: DC
+// predictors start at zero and the last byte is padded. Luma is sampled
+// lumaH x lumaV times per chroma sample; chroma averages those pixels.
+void encodeMcuRow(const PixelRows& pixels,
+                  int mcuRow,
+                  int lumaH,
+                  int lumaV,
+                  const JPGEncodeTables& tables,
+                  std::vector<std::uint8_t>& out) {
+    const int mcuWidth = 8 * lumaH;
+    const int mcuHeight = 8 * lumaV;
+    const int mcuCount = (pixels.width + mcuWidth - 1) / mcuWidth;
+    const std::size_t stripWidth = static_cast<std::size_t>(mcuCount) * static_cast<std::size_t>(mcuWidth);
+
+    // Level-shifted YCbCr for the strip; edges repeat the last column and row.
+    std::vector<float> luma(static_cast<std::size_t>(mcuHeight) * stripWidth);
+    std::vector<float> cb(luma.size());
+    std::vector<float> cr(luma.size());
+    for (int r = 0; r < mcuHeight; ++r) {
+        const std::uint8_t* src = pixels.row(std::min(mcuRow * mcuHeight + r, pixels.height - 1));
+        const std::size_t base = static_cast<std::size_t>(r) * stripWidth;
+        for (std::size_t x = 0; x < stripWidth; ++x) {
+            const std::uint8_t* px =
+                src + std::min<std::size_t>(x, static_cast<std::size_t>(pixels.width - 1)) * static_cast<std::size_t>(pixels.channels);
+            const float red = px[0];
+            const float green = px[1];
+            const float blue = px[2];
+            luma[base + x] = 0.299f * red + 0.587f * green + 0.114f * blue - 128.0f;
+            cb[base + x] = -0.168736f * red - 0.331264f * green + 0.5f * blue;
+            cr[base + x] = 0.5f * red - 0.418688f * green - 0.081312f * blue;
+        }
+    }
+
+    BitWriter bw(out);
+    int prevDCY = 0;
+    int prevDCCb = 0;
+    int prevDCCr = 0;
+    std::array<float, 64> block{};
+    const float chromaWeight = 1.0f / static_cast<float>(lumaH * lumaV);
+    for (int mx = 0; mx < mcuCount; ++mx) {
+        const std::size_t x0 = static_cast<std::size_t>(mx) * static_cast<std::size_t>(mcuWidth);
+        for (int yBlock = 0; yBlock < lumaV; ++yBlock) {
+            for (int xBlock = 0; xBlock < lumaH; ++xBlock) {
+                for (int by = 0; by < 8; ++by) {
+                    const float* src = luma.data() + static_cast<std::size_t>(yBlock * 8 + by) * stripWidth + x0 +
+                                       static_cast<std::size_t>(xBlock) * 8;
+                    std::copy(src, src + 8, block.begin() + by * 8);
+                }
+                encodeBlock(bw, block.data(), tables.quantY, tables.dcY, tables.acY, prevDCY);
+            }
+        }
+
+        for (int plane = 0; plane < 2; ++plane) {
+            const std::vector<float>& chroma = plane == 0 ? cb : cr;
+            for (int by = 0; by < 8; ++by) {
+                for (int bx = 0; bx < 8; ++bx) {
+                    float sum = 0.0f;
+                    for (int sy = 0; sy < lumaV; ++sy) {
+                        const float* src = chroma.data() + static_cast<std::size_t>(by * lumaV + sy) * stripWidth + x0 +
+                                           static_cast<std::size_t>(bx * lumaH);
+                        for (int sx = 0; sx < lumaH; ++sx) {
+                            sum += src[sx];
+                        }
+                    }
+                    block[static_cast<std::size_t>(by * 8 + bx)] = sum * chromaWeight;
+                }
+            }
+            encodeBlock(bw, block.data(), tables.quantC, tables.dcC, tables.acC, plane == 0 ? prevDCCb : prevDCCr);
+        }
+    }
+    bw.flush();
+}
+
+struct JPGComponent {
+    int id = 0;
+    int h = 1;
+    int v = 1;
+    int qt = 0;
+    // Block grid padded to whole MCUs, and the part of it covering the image
+    // (the only blocks a single-component scan codes).
+    int blocksW = 0;
+    int blocksH = 0;
+    int usedBlocksW = 0;
+    int usedBlocksH = 0;
+    // 64 quantized coefficients per block, in natural order.
+    std::vector<std::int16_t> coefficients;
+
+    std::int16_t* block(int bx, int by) {
+        return coefficients.data() + (static_cast<std::size_t>(by) * static_cast<std::size_t>(blocksW) + static_cast<std::size_t>(bx)) * 64;
+    }
+};
+
+struct JPGFrame {
+    int width = 0;
+    int height = 0;
+    bool progressive = false;
+    int maxH = 1;
+    int maxV = 1;
+    int mcuW = 0;
+    int mcuH = 0;
+    std::vector<JPGComponent> components;
+};
+
+struct JPGScan {
+    std::vector<int> components;
+    std::vector<const HuffmanTable*> dc;
+    std::vector<const HuffmanTable*> ac;
+    int ss = 0;
+    int se = 63;
+    int ah = 0;
+    int al = 0;
+};
+
+// Decoder state that restarts with every restart interval.
+struct JPGScanState {
+    std::array<int, 4> prevDC{};
+    int eobRun = 0;
+};
+
+void decodeScanBlock(BitReader& br,
+                     const JPGFrame& frame,
+                     const JPGScan& scan,
+                     const HuffmanTable& dc,
+                     const HuffmanTable& ac,
+                     int& prevDC,
+                     int& eobRun,
+                     std::int16_t* coef) {
+    if (scan.ss == 0) {
+        if (scan.ah == 0) {
+            const int size = decodeHuffmanSymbol(br, dc);
+            if (size > 11) {
+                throw std::runtime_error("Corrupt JPEG DC coefficient");
+            }
+            prevDC += extendSign(br.readBits(size), size);
+            coef[0] = static_cast<std::int16_t>(prevDC * (1 << scan.al));
+        } else if (br.readBits(1) != 0) {
+            coef[0] = static_cast<std::int16_t>(coef[0] | (1 << scan.al));
+        }
+        if (frame.progressive) {
+            return;
+        }
+        // Sequential scans carry the whole block.
+        for (int k = 1; k < 64;) {
+            const int symbol = decodeHuffmanSymbol(br, ac);
+            const int run = symbol >> 4;
+            const int size = symbol & 0x0F;
+            if (size == 0) {
+                if (run != 15) {
+                    break;
+                }
+                k += 16;
+                continue;
+            }
+            k += run;
+            if (k > 63) {
+                throw std::runtime_error("Corrupt JPEG AC coefficients");
+            }
+            coef[kZigZag[static_cast<std::size_t>(k)]] = static_cast<std::int16_t>(extendSign(br.readBits(size), size));
+            ++k;
+        }
+        return;
+    }
+
+    if (scan.ah == 0) {
+        // First pass over a band of AC coefficients.
+        if (eobRun > 0) {
+            --eobRun;
+            return;
+        }
+        for (int k = scan.ss; k <= scan.se; ++k) {
+            const int symbol = decodeHuffmanSymbol(br, ac);
+            const int run = symbol >> 4;
+            const int size = symbol & 0x0F;
+            if (size == 0) {
+                if (run != 15) {
+                    eobRun = (1 << run) - 1 + static_cast<int>(br.readBits(run));
+                    break;
+                }
+                k += 15;
+                continue;
+            }
+            k += run;
+            if (k > scan.se) {
+                throw std::runtime_error("Corrupt JPEG AC coefficients");
+            }
+            coef[kZigZag[static_cast<std::size_t>(k)]] = static_cast<std::int16_t>(extendSign(br.readBits(size), size) * (1 << scan.al));
+        }
+        return;
+    }
+
+    // Refinement: one more bit for coefficients already nonzero, and new
+    // coefficients of magnitude 1 placed by runs of still-zero ones.
+    const int p1 = 1 << scan.al;
+    const int m1 = -p1;
+    const auto refine = [&](std::int16_t& value) {
+        if (br.readBits(1) != 0 && (value & p1) == 0) {
+            value = static_cast<std::int16_t>(value + (value >= 0 ? p1 : m1));
+        }
+    };
+    int k = scan.ss;
+    if (eobRun == 0) {
+        for (; k <= scan.se; ++k) {
+            const int symbol = decodeHuffmanSymbol(br, ac);
+            int run = symbol >> 4;
+            const int size = symbol & 0x0F;
+            int value = 0;
+            if (size != 0) {
+                value = br.readBits(1) != 0 ? p1 : m1;
+            } else if (run != 15) {
+                eobRun = (1 << run) + static_cast<int>(br.readBits(run));
+                break;
+            }
+            for (; k <= scan.se; ++k) {
+                std::int16_t& current = coef[kZigZag[static_cast<std::size_t>(k)]];
+                if (current != 0) {
+                    refine(current);
+                } else if (--run < 0) {
+                    break;
+                }
+            }
+            if (value != 0 && k <= scan.se) {
+                coef[kZigZag[static_cast<std::size_t>(k)]] = static_cast<std::int16_t>(value);
+            }
+        }
+    }
+    if (eobRun > 0) {
+        for (; k <= scan.se; ++k) {
+            std::int16_t& current = coef[kZigZag[static_cast<std::size_t>(k)]];
+            if (current != 0) {
+                refine(current);
+            }
+        }
+        --eobRun;
+    }
+}
+
+// Decodes one scan into the frame's coefficient buffers. Restart intervals
+// are independent, so each is entropy-decoded on its own worker.
+void decodeScan(JPGFrame& frame,
+                const JPGScan& scan,
+                const std::vector<std::pair<const std::uint8_t*, std::size_t>>& segments,
+                int restartInterval,
+                int threads) {
+    const bool interleaved = scan.components.size() > 1;
+    JPGComponent& single = frame.components[static_cast<std::size_t>(scan.components[0])];
+    const int mcusPerRow = interleaved ? frame.mcuW : single.usedBlocksW;
+    const long long mcuCount = interleaved ? static_cast<long long>(frame.mcuW) * frame.mcuH
+                                           : static_cast<long long>(single.usedBlocksW) * single.usedBlocksH;
+    const long long interval = restartInterval > 0 ? restartInterval : mcuCount;
+    const long long intervals = (mcuCount + interval - 1) / interval;
+    if (static_cast<long long>(segments.size()) < intervals) {
+        throw std::runtime_error("JPEG scan is missing restart intervals");
+    }
+
+    parallelFor(static_cast<int>(intervals), threads, [&](int segment) {
+        BitReader br(segments[static_cast<std::size_t>(segment)].first, segments[static_cast<std::size_t>(segment)].second);
+        JPGScanState state;
+        const long long first = segment * interval;
+        const long long last = std::min(mcuCount, first + interval);
+        for (long long mcu = first; mcu < last; ++mcu) {
+            const int mx = static_cast<int>(mcu % mcusPerRow);
+            const int my = static_cast<int>(mcu / mcusPerRow);
+            for (std::size_t s = 0; s < scan.components.size(); ++s) {
+                JPGComponent& comp = frame.components[static_cast<std::size_t>(scan.components[s])];
+                if (!interleaved) {
+                    decodeScanBlock(br, frame, scan, *scan.dc[s], *scan.ac[s], state.prevDC[s], state.eobRun, comp.block(mx, my));
+                    continue;
+                }
+                for (int vy = 0; vy < comp.v; ++vy) {
+                    for (int hx = 0; hx < comp.h; ++hx) {
+                        decodeScanBlock(br, frame, scan, *scan.dc[s], *scan.ac[s], state.prevDC[s], state.eobRun,
+                                        comp.block(mx * comp.h + hx, my * comp.v + vy));
+                    }
+                }
+            }
+        }
+    });
+}
+
+// Dequantizes and inverse-transforms the block rows of one MCU row into
+// 8-bit planes, then upsamples (by replication) and converts them to RGB.
+// Row weights that map the 8 frequencies of a block edge straight to size
+// outputs, indexed [x * 8 + u]: each output is the mean of 8 / size samples
+// of the full 8-point inverse DCT, so a reduced block is the box-filtered
+// full block without computing it.
+const std::array<float, 32>& reducedIdctBasis(int size) {
+    static const auto build = [](int n) {
+        std::array<float, 32> basis{};
+        const double pi = 3.14159265358979323846;
+        const int span = 8 / n;
+        for (int x = 0; x < n; ++x) {
+            for (int u = 0; u < 8; ++u) {
+                const double c = u == 0 ? std::sqrt(0.5) : 1.0;
+                double sum = 0.0;
+                for (int j = 0; j < span; ++j) {
+                    sum += std::cos((2.0 * (x * span + j) + 1.0) * u * pi / 16.0);
+                }
+                basis[static_cast<std::size_t>(x * 8 + u)] = static_cast<float>(0.5 * c * sum / span);
+            }
+        }
+        return basis;
+    };
+    static const std::array<float, 32> basis2 = build(2);
+    static const std::array<float, 32> basis4 = build(4);
+    return size == 2 ? basis2 : basis4;
+}
+
+// Writes the size x size samples of one block (before the +128 level shift)
+// to out, row by row. Full-size blocks use the AAN transform with its scale
+// folded into dequant; reduced sizes take plain dequantization factors.
+void inverseTransformBlock(const std::int16_t* coef, const std::array<float, 64>& dequant, int size, float* out) {
+    if (size == 8) {
+        for (std::size_t k = 0; k < 64; ++k) {
+            out[k] = static_cast<float>(coef[k]) * dequant[k];
+        }
+        inverseDct8x8(out);
+        return;
+    }
+    if (size == 1) {
+        out[0] = static_cast<float>(coef[0]) * dequant[0] / 8.0f;
+        return;
+    }
+    const std::array<float, 32>& basis = reducedIdctBasis(size);
+    float columns[32];
+    for (int v = 0; v < 8; ++v) {
+        float row[8];
+        bool empty = true;
+        for (int u = 0; u < 8; ++u) {
+            const std::size_t k = static_cast<std::size_t>(v * 8 + u);
+            row[u] = static_cast<float>(coef[k]) * dequant[k];
+            empty = empty && coef[k] == 0;
+        }
+        for (int x = 0; x < size; ++x) {
+            float sum = 0.0f;
+            for (int u = 0; !empty && u < 8; ++u) {
+                sum += basis[static_cast<std::size_t>(x * 8 + u)] * row[u];
+            }
+            columns[v * size + x] = sum;
+        }
+    }
+    for (int y = 0; y < size; ++y) {
+        for (int x = 0; x < size; ++x) {
+            float sum = 0.0f;
+            for (int v = 0; v < 8; ++v) {
+                sum += basis[static_cast<std::size_t>(y * 8 + v)] * columns[v * size + x];
+            }
+            out[y * size + x] = sum;
+        }
+    }
+}
+
+// Transform size for a component when luma blocks decode at blockSize:
+// subsampled components grow it, up to 8, instead of being upsampled.
+int componentBlockSize(const JPGFrame& frame, const JPGComponent& comp, int blockSize) {
+    const int ratioX = frame.maxH / comp.h * blockSize;
+    const int ratioY = frame.maxV / comp.v * blockSize;
+    int size = blockSize;
+    while (size < 8 && ratioX % (size * 2) == 0 && ratioY % (size * 2) == 0) {
+        size *= 2;
+    }
+    return size;
+}
+
+// Rebuilds the output rows of one MCU row. Blocks are inverse transformed
+// into 8-bit component planes at blockSize (8 / blockSize is the decode
+// scale), then upsampled by replication and converted to RGB, or to opaque
+// RGBA when channels is 4.
+void outputMcuRow(JPGFrame& frame,
+                  const std::array<std::array<float, 64>, 4>& dequant,
+                  int blockSize,
+                  int mcuRow,
+                  int outWidth,
+                  int outHeight,
+                  std::uint8_t* pixels,
+                  int channels) {
+    std::array<std::vector<std::uint8_t>, 4> planes;
+    std::array<std::size_t, 4> planeWidths{};
+    std::array<int, 4> stepX{};
+    std::array<int, 4> stepY{};
+    std::array<float, 64> block{};
+    for (std::size_t c = 0; c < frame.components.size(); ++c) {
+        JPGComponent& comp = frame.components[c];
+        const int size = componentBlockSize(frame, comp, blockSize);
+        stepX[c] = frame.maxH / comp.h * blockSize / size;
+        stepY[c] = frame.maxV / comp.v * blockSize / size;
+        const std::size_t n = static_cast<std::size_t>(size);
+        planeWidths[c] = static_cast<std::size_t>(comp.blocksW) * n;
+        planes[c].resize(planeWidths[c] * static_cast<std::size_t>(comp.v) * n);
+        const std::array<float, 64>& q = dequant[static_cast<std::size_t>(c)];
+        for (int vy = 0; vy < comp.v; ++vy) {
+            for (int bx = 0; bx < comp.blocksW; ++bx) {
+                inverseTransformBlock(comp.block(bx, mcuRow * comp.v + vy), q, size, block.data());
+                for (std::size_t y = 0; y < n; ++y) {
+                    std::uint8_t* dst = planes[c].data() + (static_cast<std::size_t>(vy) * n + y) * planeWidths[c] +
+                                        static_cast<std::size_t>(bx) * n;
+                    for (std::size_t x = 0; x < n; ++x) {
+                        // Component samples are clamped to 8 bits before color conversion.
+                        dst[x] = clampToByte(static_cast<int>(std::lround(block[y * n + x] + 128.0f)));
+                    }
+                }
+            }
+        }
+    }
+
+    const int rowHeight = frame.maxV * blockSize;
+    const int y0 = mcuRow * rowHeight;
+    const int y1 = std::min(outHeight, y0 + rowHeight);
+    for (int y = y0; y < y1; ++y) {
+        std::uint8_t* out = pixels + static_cast<std::size_t>(y) * static_cast<std::size_t>(outWidth) * static_cast<std::size_t>(channels);
+        std::array<const std::uint8_t*, 4> rows{};
+        for (std::size_t c = 0; c < frame.components.size(); ++c) {
+            rows[c] = planes[c].data() + static_cast<std::size_t>((y - y0) / stepY[c]) * planeWidths[c];
+        }
+        if (frame.components.size() == 1) {
+            for (int x = 0; x < outWidth; ++x, out += channels) {
+                out[0] = out[1] = out[2] = rows[0][x / stepX[0]];
+                if (channels == 4) {
+                    out[3] = 255;
+                }
+            }
+            continue;
+        }
+        for (int x = 0; x < outWidth; ++x, out += channels) {
+            const float luma = rows[0][x / stepX[0]];
+            const float cb = static_cast<float>(rows[1][x / stepX[1]]) - 128.0f;
+            const float cr = static_cast<float>(rows[2][x / stepX[2]]) - 128.0f;
+            out[0] = clampToByte(static_cast<int>(std::lround(luma + 1.402f * cr)));
+            out[1] = clampToByte(static_cast<int>(std::lround(luma - 0.344136f * cb - 0.714136f * cr)));
+            out[2] = clampToByte(static_cast<int>(std::lround(luma + 1.772f * cb)));
+            if (channels == 4) {
+                out[3] = 255;
+            }
+        }
+    }
+}
+
+// The largest power-of-two reduction, up to 1/8, that still leaves at least
+// targetWidth x targetHeight pixels; a zero target leaves that axis free.
+int scaleForTarget(int width, int height, int targetWidth, int targetHeight) {
+    if (targetWidth <= 0 && targetHeight <= 0) {
+        return 1;
+    }
+    int scale = 1;
+    while (scale < 8 && (width + 2 * scale - 1) / (2 * scale) >= targetWidth &&
+           (height + 2 * scale - 1) / (2 * scale) >= targetHeight) {
+        scale *= 2;
+    }
+    return scale;
+}
+
 std::vector<std::uint8_t> readFileBytes(const std::string& filename) {
     std::ifstream in(filename, std::ios::binary);
     if (!in) {
@@ -498,18 +1090,37 @@ void JPGImage::setPixel(int x, int y, const Color& color) {
     m_pixels[pixelIndex(x, y, m_width)] = color;
 }
 
-bool JPGImage::save(const std::string& filename) const {
+bool JPGImage::save(const std::string& filename, const JPGSaveOptions& options) const {
     if (m_width <= 0 || m_height <= 0) {
         return false;
     }
+    return saveRows(filename, colorRows(m_pixels.data(), m_width, m_height), options);
+}
 
-    HuffmanTable dcY = makeHuffmanTable(kDcLumaBits, kDcLumaVals.data(), kDcLumaVals.size());
-    HuffmanTable acY = makeHuffmanTable(kAcLumaBits, kAcLumaVals.data(), kAcLumaVals.size());
-    HuffmanTable dcC = makeHuffmanTable(kDcChromaBits, kDcChromaVals.data(), kDcChromaVals.size());
-    HuffmanTable acC = makeHuffmanTable(kAcChromaBits, kAcChromaVals.data(), kAcChromaVals.size());
+bool JPGImage::saveRows(const std::string& filename, const PixelRows& pixels, const JPGSaveOptions& options) {
+    if (pixels.width <= 0 || pixels.height <= 0 || pixels.width > 65535 || pixels.height > 65535) {
+        return false;
+    }
+    if (options.quality < 1 || options.quality > 100) {
+        throw std::invalid_argument("JPEG quality must be between 1 and 100");
+    }
+    const int lumaH = options.subsampling == JPGSubsampling::Yuv444 ? 1 : 2;
+    const int lumaV = options.subsampling == JPGSubsampling::Yuv420 ? 2 : 1;
+    const std::array<std::uint8_t, 64> quantLuma = scaledQuantTable(kQuantLuma, options.quality);
+    const std::array<std::uint8_t, 64> quantChroma = scaledQuantTable(kQuantChroma, options.quality);
+
+    JPGEncodeTables tables;
+    tables.dcY = makeHuffmanTable(kDcLumaBits, kDcLumaVals.data(), kDcLumaVals.size());
+    tables.acY = makeHuffmanTable(kAcLumaBits, kAcLumaVals.data(), kAcLumaVals.size());
+    tables.dcC = makeHuffmanTable(kDcChromaBits, kDcChromaVals.data(), kDcChromaVals.size());
+    tables.acC = makeHuffmanTable(kAcChromaBits, kAcChromaVals.data(), kAcChromaVals.size());
+    tables.quantY = quantizationMultipliers(quantLuma);
+    tables.quantC = quantizationMultipliers(quantChroma);
+    const int mcuW = (pixels.width + 8 * lumaH - 1) / (8 * lumaH);
+    const int mcuH = (pixels.height + 8 * lumaV - 1) / (8 * lumaV);
 
     std::vector<std::uint8_t> out;
-    out.reserve(static_cast<std::size_t>(m_width) * static_cast<std::size_t>(m_height));
+    out.reserve(static_cast<std::size_t>(pixels.width) * static_cast<std::size_t>(pixels.height));
 
     writeMarker(out, 0xD8); // SOI
 
@@ -529,17 +1140,17 @@ bool JPGImage::save(const std::string& filename) const {
     out.push_back(0);
     out.push_back(0);
 
-    emitDQT(out);
+    emitDQT(out, quantLuma, quantChroma);
 
     writeMarker(out, 0xC0); // SOF0
     writeU16BE(out, 17);
     out.push_back(8);
-    writeU16BE(out, static_cast<std::uint16_t>(m_height));
-    writeU16BE(out, static_cast<std::uint16_t>(m_width));
+    writeU16BE(out, static_cast<std::uint16_t>(pixels.height));
+    writeU16BE(out, static_cast<std::uint16_t>(pixels.width));
     out.push_back(3);
 
     out.push_back(1);
-    out.push_back(0x22);
+    out.push_back(static_cast<std::uint8_t>((lumaH << 4) | lumaV));
     out.push_back(0);
 
     out.push_back(2);
@@ -552,6 +1163,12 @@ bool JPGImage::save(const std::string& filename) const {
 
     emitDHT(out);
 
+    // Every MCU row is one restart interval, so rows are entropy-coded on
+    // separate threads and joined with RSTn markers.
+    writeMarker(out, 0xDD); // DRI
+    writeU16BE(out, 4);
+    writeU16BE(out, static_cast<std::uint16_t>(mcuW));
+
     writeMarker(out, 0xDA); // SOS
     writeU16BE(out, 12);
     out.push_back(3);
@@ -565,130 +1182,17 @@ bool JPGImage::save(const std::string& filename) const {
     out.push_back(63);
     out.push_back(0);
 
-    BitWriter bw(out);
-    int prevDCY = 0;
-    int prevDCCb = 0;
-    int prevDCCr = 0;
-
-    const int mcuW = (m_width + 15) / 16;
-    const int mcuH = (m_height + 15) / 16;
-
-    auto encodeBlock = [&](const std::array<double, 64>& spatial,
-                           const std::array<std::uint8_t, 64>& q,
-                           const HuffmanTable& dc,
-                           const HuffmanTable& ac,
-                           int& prevDC) {
-        std::array<double, 64> freq = fdct8x8(spatial);
-
-        std::array<int, 64> zz{};
-        for (int i = 0; i < 64; ++i) {
-            const int natural = kZigZag[static_cast<std::size_t>(i)];
-            const double qv = static_cast<double>(q[static_cast<std::size_t>(natural)]);
-            zz[static_cast<std::size_t>(i)] = static_cast<int>(std::lround(freq[static_cast<std::size_t>(natural)] / qv));
-        }
-
-        const int dcDiff = zz[0] - prevDC;
-        prevDC = zz[0];
-
-        const int dcCat = magnitudeCategory(dcDiff);
-        bw.putBits(dc.code[static_cast<std::size_t>(dcCat)], dc.codeLen[static_cast<std::size_t>(dcCat)]);
-        if (dcCat > 0) {
-            bw.putBits(magnitudeBits(dcDiff, dcCat), dcCat);
-        }
-
-        int run = 0;
-        for (int i = 1; i < 64; ++i) {
-            const int coeff = zz[static_cast<std::size_t>(i)];
-            if (coeff == 0) {
-                ++run;
-                continue;
-            }
-
-            while (run >= 16) {
-                const std::uint8_t zrl = 0xF0;
-                bw.putBits(ac.code[zrl], ac.codeLen[zrl]);
-                run -= 16;
-            }
-
-            const int cat = magnitudeCategory(coeff);
-            const std::uint8_t symbol = static_cast<std::uint8_t>((run << 4) | cat);
-            bw.putBits(ac.code[symbol], ac.codeLen[symbol]);
-            bw.putBits(magnitudeBits(coeff, cat), cat);
-            run = 0;
-        }
-
-        if (run > 0) {
-            const std::uint8_t eob = 0x00;
-            bw.putBits(ac.code[eob], ac.codeLen[eob]);
-        }
-    };
-
-    std::array<double, 64> blockY{};
-    std::array<double, 64> blockCb{};
-    std::array<double, 64> blockCr{};
-
-    auto getYCbCr = [&](int x, int y, double& outY, double& outCb, double& outCr) {
-        const int clampedX = std::min(std::max(x, 0), m_width - 1);
-        const int clampedY = std::min(std::max(y, 0), m_height - 1);
-        const Color& c = m_pixels[pixelIndex(clampedX, clampedY, m_width)];
-        const double r = static_cast<double>(c.r);
-        const double g = static_cast<double>(c.g);
-        const double b = static_cast<double>(c.b);
-        outY = 0.299 * r + 0.587 * g + 0.114 * b;
-        outCb = -0.168736 * r - 0.331264 * g + 0.5 * b + 128.0;
-        outCr = 0.5 * r - 0.418688 * g - 0.081312 * b + 128.0;
-    };
-
+    std::vector<std::vector<std::uint8_t>> rows(static_cast<std::size_t>(mcuH));
+    parallelFor(mcuH, options.threads, [&](int my) {
+        encodeMcuRow(pixels, my, lumaH, lumaV, tables, rows[static_cast<std::size_t>(my)]);
+    });
     for (int my = 0; my < mcuH; ++my) {
-        for (int mx = 0; mx < mcuW; ++mx) {
-            // 4 Y blocks in a 16x16 MCU (4:2:0).
-            for (int yBlock = 0; yBlock < 2; ++yBlock) {
-                for (int xBlock = 0; xBlock < 2; ++xBlock) {
-                    for (int by = 0; by < 8; ++by) {
-                        for (int bx = 0; bx < 8; ++bx) {
-                            const int x = mx * 16 + xBlock * 8 + bx;
-                            const int y = my * 16 + yBlock * 8 + by;
-                            double Y = 0.0;
-                            double Cb = 0.0;
-                            double Cr = 0.0;
-                            getYCbCr(x, y, Y, Cb, Cr);
-                            const std::size_t idx = static_cast<std::size_t>(by) * 8 + bx;
-                            blockY[idx] = Y - 128.0;
-                        }
-                    }
-                    encodeBlock(blockY, kQuantLuma, dcY, acY, prevDCY);
-                }
-            }
-
-            // One Cb and one Cr block per 16x16 MCU by averaging 2x2 source samples.
-            for (int by = 0; by < 8; ++by) {
-                for (int bx = 0; bx < 8; ++bx) {
-                    double cbSum = 0.0;
-                    double crSum = 0.0;
-                    for (int sy = 0; sy < 2; ++sy) {
-                        for (int sx = 0; sx < 2; ++sx) {
-                            const int x = mx * 16 + bx * 2 + sx;
-                            const int y = my * 16 + by * 2 + sy;
-                            double Y = 0.0;
-                            double Cb = 0.0;
-                            double Cr = 0.0;
-                            getYCbCr(x, y, Y, Cb, Cr);
-                            cbSum += Cb;
-                            crSum += Cr;
-                        }
-                    }
-                    const std::size_t idx = static_cast<std::size_t>(by) * 8 + bx;
-                    blockCb[idx] = (cbSum * 0.25) - 128.0;
-                    blockCr[idx] = (crSum * 0.25) - 128.0;
-                }
-            }
-
-            encodeBlock(blockCb, kQuantChroma, dcC, acC, prevDCCb);
-            encodeBlock(blockCr, kQuantChroma, dcC, acC, prevDCCr);
+        const std::vector<std::uint8_t>& row = rows[static_cast<std::size_t>(my)];
+        out.insert(out.end(), row.begin(), row.end());
+        if (my + 1 < mcuH) {
+            writeMarker(out, static_cast<std::uint8_t>(0xD0 + (my & 7)));
         }
     }
-
-    bw.flush();
     writeMarker(out, 0xD9); // EOI
 
     std::ofstream file(filename, std::ios::binary);
@@ -699,9 +1203,20 @@ bool JPGImage::save(const std::string& filename) const {
     return static_cast<bool>(file);
 }
 
-JPGImage JPGImage::load(const std::string& filename) {
+JPGImage JPGImage::load(const std::string& filename, const JPGLoadOptions& options) {
     const std::vector<std::uint8_t> bytes = readFileBytes(filename);
-    if (bytes.size() < 4 || bytes[0] != 0xFF || bytes[1] != 0xD8) {
+    JPGImage image;
+    decode(bytes.data(), bytes.size(),
+           {3, [&image](int width, int height) {
+                image = JPGImage(width, height);
+                return reinterpret_cast<std::uint8_t*>(image.m_pixels.data());
+            }},
+           options);
+    return image;
+}
+
+void JPGImage::decode(const std::uint8_t* data, std::size_t size, const PixelTarget& target, const JPGLoadOptions& options) {
+    if (size < 4 || data[0] != 0xFF || data[1] != 0xD8) {
         throw std::runtime_error("Not a JPEG file");
     }
 
@@ -711,100 +1226,37 @@ JPGImage JPGImage::load(const std::string& filename) {
     std::array<HuffmanTable, 4> dcTables;
     std::array<HuffmanTable, 4> acTables;
 
-    int width = 0;
-    int height = 0;
-    struct Component {
-        int id = 0;
-        int h = 1;
-        int v = 1;
-        int qt = 0;
-        int dc = 0;
-        int ac = 0;
-    };
-    std::array<Component, 3> components{};
-    int compCount = 0;
-    std::array<int, 3> scanOrder{};
+    JPGFrame frame;
+    bool gotFrame = false;
     int scanCount = 0;
-
+    int restartInterval = 0;
     std::size_t pos = 2;
-    std::vector<std::uint8_t> scanData;
 
-    while (pos + 1 < bytes.size()) {
-        if (bytes[pos] != 0xFF) {
+    while (pos + 1 < size) {
+        if (data[pos] != 0xFF) {
             ++pos;
             continue;
         }
-        while (pos < bytes.size() && bytes[pos] == 0xFF) {
+        while (pos < size && data[pos] == 0xFF) {
             ++pos;
         }
-        if (pos >= bytes.size()) {
+        if (pos >= size) {
             break;
         }
 
-        const std::uint8_t marker = bytes[pos++];
+        const std::uint8_t marker = data[pos++];
         if (marker == 0xD9) {
             break;
         }
-        if (marker == 0xDA) {
-            if (pos + 2 > bytes.size()) {
-                throw std::runtime_error("Corrupt JPEG SOS");
-            }
-            const std::uint16_t segLen = (static_cast<std::uint16_t>(bytes[pos]) << 8) | bytes[pos + 1];
-            if (segLen < 2 || pos + segLen > bytes.size()) {
-                throw std::runtime_error("Invalid JPEG SOS length");
-            }
-            pos += 2;
-            if (segLen < 8) {
-                throw std::runtime_error("Unsupported JPEG SOS");
-            }
-            const int scanComps = bytes[pos++];
-            if (scanComps != 3) {
-                throw std::runtime_error("Only 3-component JPEG is supported");
-            }
-            scanCount = scanComps;
-            for (int i = 0; i < scanComps; ++i) {
-                const int cid = bytes[pos++];
-                const int sel = bytes[pos++];
-                bool found = false;
-                for (int c = 0; c < compCount; ++c) {
-                    if (components[static_cast<std::size_t>(c)].id == cid) {
-                        components[static_cast<std::size_t>(c)].dc = (sel >> 4) & 0x0F;
-                        components[static_cast<std::size_t>(c)].ac = sel & 0x0F;
-                        scanOrder[static_cast<std::size_t>(i)] = c;
-                        found = true;
-                        break;
-                    }
-                }
-                if (!found) {
-                    throw std::runtime_error("SOS references unknown JPEG component");
-                }
-            }
-            pos += 3; // Ss, Se, AhAl
-
-            const std::size_t scanStart = pos;
-            std::size_t scanEnd = scanStart;
-            while (scanEnd + 1 < bytes.size()) {
-                if (bytes[scanEnd] == 0xFF && bytes[scanEnd + 1] != 0x00) {
-                    if (bytes[scanEnd + 1] == 0xD9) {
-                        break;
-                    }
-                    if (bytes[scanEnd + 1] >= 0xD0 && bytes[scanEnd + 1] <= 0xD7) {
-                        scanEnd += 2;
-                        continue;
-                    }
-                }
-                ++scanEnd;
-            }
-            scanData.assign(bytes.begin() + static_cast<std::ptrdiff_t>(scanStart),
-                            bytes.begin() + static_cast<std::ptrdiff_t>(scanEnd));
-            break;
+        if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) {
+            continue;
         }
 
-        if (pos + 2 > bytes.size()) {
+        if (pos + 2 > size) {
             throw std::runtime_error("Corrupt JPEG segment length");
         }
-        const std::uint16_t segLen = (static_cast<std::uint16_t>(bytes[pos]) << 8) | bytes[pos + 1];
-        if (segLen < 2 || pos + segLen > bytes.size()) {
+        const std::uint16_t segLen = (static_cast<std::uint16_t>(data[pos]) << 8) | data[pos + 1];
+        if (segLen < 2 || pos + segLen > size) {
             throw std::runtime_error("Invalid JPEG segment length");
         }
         pos += 2;
@@ -812,10 +1264,15 @@ JPGImage JPGImage::load(const std::string& filename) {
         const std::size_t segStart = pos;
         const std::size_t segDataLen = segLen - 2;
 
-        if (marker == 0xDB) {
+        if (marker == 0xDD) {
+            if (segDataLen < 2) {
+                throw std::runtime_error("Corrupt JPEG DRI");
+            }
+            restartInterval = (static_cast<int>(data[segStart]) << 8) | data[segStart + 1];
+        } else if (marker == 0xDB) {
             std::size_t p = segStart;
             while (p < segStart + segDataLen) {
-                const std::uint8_t pqTq = bytes[p++];
+                const std::uint8_t pqTq = data[p++];
                 const int precision = (pqTq >> 4) & 0x0F;
                 const int tq = pqTq & 0x0F;
                 if (precision != 0 || tq < 0 || tq > 3) {
@@ -825,43 +1282,65 @@ JPGImage JPGImage::load(const std::string& filename) {
                     throw std::runtime_error("Corrupt JPEG DQT");
                 }
                 for (int i = 0; i < 64; ++i) {
-                    quantTables[static_cast<std::size_t>(tq)][static_cast<std::size_t>(kZigZag[i])] = bytes[p++];
+                    quantTables[static_cast<std::size_t>(tq)][static_cast<std::size_t>(kZigZag[i])] = data[p++];
                 }
                 quantDefined[static_cast<std::size_t>(tq)] = true;
             }
-        } else if (marker == 0xC0) {
+        } else if (marker == 0xC0 || marker == 0xC1 || marker == 0xC2) {
+            if (gotFrame) {
+                throw std::runtime_error("JPEG has more than one frame");
+            }
             if (segDataLen < 6) {
-                throw std::runtime_error("Corrupt JPEG SOF0");
+                throw std::runtime_error("Corrupt JPEG SOF");
             }
-            const std::uint8_t precision = bytes[segStart];
+            const std::uint8_t precision = data[segStart];
             if (precision != 8) {
                 throw std::runtime_error("Only 8-bit JPEG is supported");
             }
-            height = (static_cast<int>(bytes[segStart + 1]) << 8) | bytes[segStart + 2];
-            width = (static_cast<int>(bytes[segStart + 3]) << 8) | bytes[segStart + 4];
-            compCount = bytes[segStart + 5];
-            validateJPGDimensions(width, height);
-            if (compCount != 3) {
-                throw std::runtime_error("Only 3-component JPEG is supported");
+            frame.progressive = marker == 0xC2;
+            frame.height = (static_cast<int>(data[segStart + 1]) << 8) | data[segStart + 2];
+            frame.width = (static_cast<int>(data[segStart + 3]) << 8) | data[segStart + 4];
+            const int compCount = data[segStart + 5];
+            validateJPGDimensions(frame.width, frame.height);
+            if (compCount != 1 && compCount != 3) {
+                throw std::runtime_error("Only grayscale and 3-component JPEG is supported");
             }
             if (segDataLen < static_cast<std::size_t>(6 + compCount * 3)) {
-                throw std::runtime_error("Corrupt JPEG SOF0 components");
+                throw std::runtime_error("Corrupt JPEG SOF components");
             }
+            frame.components.resize(static_cast<std::size_t>(compCount));
             std::size_t p = segStart + 6;
-            for (int i = 0; i < compCount; ++i) {
-                components[static_cast<std::size_t>(i)].id = bytes[p++];
-                const std::uint8_t hv = bytes[p++];
-                components[static_cast<std::size_t>(i)].h = (hv >> 4) & 0x0F;
-                components[static_cast<std::size_t>(i)].v = hv & 0x0F;
-                components[static_cast<std::size_t>(i)].qt = bytes[p++];
-                if (components[static_cast<std::size_t>(i)].h <= 0 || components[static_cast<std::size_t>(i)].v <= 0) {
+            for (JPGComponent& comp : frame.components) {
+                comp.id = data[p++];
+                const std::uint8_t hv = data[p++];
+                comp.h = (hv >> 4) & 0x0F;
+                comp.v = hv & 0x0F;
+                comp.qt = data[p++];
+                if (comp.h <= 0 || comp.v <= 0 || comp.h > 4 || comp.v > 4 || comp.qt > 3) {
                     throw std::runtime_error("Invalid JPEG sampling factors");
                 }
+                frame.maxH = std::max(frame.maxH, comp.h);
+                frame.maxV = std::max(frame.maxV, comp.v);
             }
+            frame.mcuW = (frame.width + frame.maxH * 8 - 1) / (frame.maxH * 8);
+            frame.mcuH = (frame.height + frame.maxV * 8 - 1) / (frame.maxV * 8);
+            for (JPGComponent& comp : frame.components) {
+                if ((frame.maxH % comp.h) != 0 || (frame.maxV % comp.v) != 0) {
+                    throw std::runtime_error("Unsupported JPEG sampling ratio");
+                }
+                comp.blocksW = frame.mcuW * comp.h;
+                comp.blocksH = frame.mcuH * comp.v;
+                comp.usedBlocksW = ((frame.width * comp.h + frame.maxH - 1) / frame.maxH + 7) / 8;
+                comp.usedBlocksH = ((frame.height * comp.v + frame.maxV - 1) / frame.maxV + 7) / 8;
+                comp.coefficients.assign(static_cast<std::size_t>(comp.blocksW) * static_cast<std::size_t>(comp.blocksH) * 64, 0);
+            }
+            gotFrame = true;
+        } else if ((marker >= 0xC3 && marker <= 0xCF) && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+            throw std::runtime_error("Unsupported JPEG coding process");
         } else if (marker == 0xC4) {
             std::size_t p = segStart;
             while (p < segStart + segDataLen) {
-                const std::uint8_t tcTh = bytes[p++];
+                const std::uint8_t tcTh = data[p++];
                 const int tc = (tcTh >> 4) & 0x0F;
                 const int th = tcTh & 0x0F;
                 if (th < 0 || th > 3 || tc > 1) {
@@ -874,16 +1353,16 @@ JPGImage JPGImage::load(const std::string& filename) {
                     if (p >= segStart + segDataLen) {
                         throw std::runtime_error("Corrupt JPEG DHT bits");
                     }
-                    bits[static_cast<std::size_t>(i)] = bytes[p++];
+                    bits[static_cast<std::size_t>(i)] = data[p++];
                     total += bits[static_cast<std::size_t>(i)];
                 }
-                if (p + static_cast<std::size_t>(total) > segStart + segDataLen) {
+                if (total > 256 || p + static_cast<std::size_t>(total) > segStart + segDataLen) {
                     throw std::runtime_error("Corrupt JPEG DHT values");
                 }
                 HuffmanTable ht;
                 ht.bits = bits;
-                ht.values.assign(bytes.begin() + static_cast<std::ptrdiff_t>(p),
-                                 bytes.begin() + static_cast<std::ptrdiff_t>(p + total));
+                ht.values.assign(data + static_cast<std::ptrdiff_t>(p),
+                                 data + static_cast<std::ptrdiff_t>(p + total));
                 ht.defined = true;
                 buildHuffmanTable(ht);
                 p += static_cast<std::size_t>(total);
@@ -894,176 +1373,110 @@ JPGImage JPGImage::load(const std::string& filename) {
                     acTables[static_cast<std::size_t>(th)] = ht;
                 }
             }
-        }
-
-        pos = segStart + segDataLen;
-    }
-
-    if (scanData.empty()) {
-        throw std::runtime_error("Incomplete JPEG file");
-    }
-    if (scanCount != 3) {
-        throw std::runtime_error("Unsupported JPEG scan layout");
-    }
-
-    for (int i = 0; i < compCount; ++i) {
-        const Component& c = components[static_cast<std::size_t>(i)];
-        if (c.qt < 0 || c.qt > 3 || !quantDefined[static_cast<std::size_t>(c.qt)]) {
-            throw std::runtime_error("Missing JPEG quantization table");
-        }
-        if (!dcTables[static_cast<std::size_t>(c.dc)].defined || !acTables[static_cast<std::size_t>(c.ac)].defined) {
-            throw std::runtime_error("Missing JPEG Huffman table");
-        }
-    }
-
-    int maxH = 1;
-    int maxV = 1;
-    for (int i = 0; i < compCount; ++i) {
-        maxH = std::max(maxH, components[static_cast<std::size_t>(i)].h);
-        maxV = std::max(maxV, components[static_cast<std::size_t>(i)].v);
-    }
-    if (maxH <= 0 || maxV <= 0 || maxH > 4 || maxV > 4) {
-        throw std::runtime_error("Unsupported JPEG sampling factors");
-    }
-    for (int i = 0; i < compCount; ++i) {
-        if ((maxH % components[static_cast<std::size_t>(i)].h) != 0 ||
-            (maxV % components[static_cast<std::size_t>(i)].v) != 0) {
-            throw std::runtime_error("Unsupported JPEG sampling ratio");
-        }
-    }
-
-    JPGImage image(width, height, Color(0, 0, 0));
-
-    BitReader br(scanData);
-    int prevDC[3] = {0, 0, 0};
-    const int mcuPixelW = maxH * 8;
-    const int mcuPixelH = maxV * 8;
-    const int mcuW = (width + mcuPixelW - 1) / mcuPixelW;
-    const int mcuH = (height + mcuPixelH - 1) / mcuPixelH;
-
-    std::array<std::vector<std::array<double, 64>>, 3> compSpatial{};
-
-    auto decodeBlock = [&](int compIdx, std::array<double, 64>& outSpatial) {
-        const Component& comp = components[static_cast<std::size_t>(compIdx)];
-        const HuffmanTable& dc = dcTables[static_cast<std::size_t>(comp.dc)];
-        const HuffmanTable& ac = acTables[static_cast<std::size_t>(comp.ac)];
-        const auto& q = quantTables[static_cast<std::size_t>(comp.qt)];
-
-        std::array<int, 64> zz{};
-
-        const int dcLen = decodeHuffmanSymbol(br, dc);
-        const int dcBits = (dcLen > 0) ? extendSign(br.readBits(dcLen), dcLen) : 0;
-        prevDC[compIdx] += dcBits;
-        zz[0] = prevDC[compIdx];
-
-        int k = 1;
-        while (k < 64) {
-            const int symbol = decodeHuffmanSymbol(br, ac);
-            if (symbol == 0x00) {
-                while (k < 64) {
-                    zz[static_cast<std::size_t>(k++)] = 0;
+        } else if (marker == 0xDA) {
+            if (!gotFrame) {
+                throw std::runtime_error("JPEG scan before frame header");
+            }
+            const int scanComps = segDataLen > 0 ? data[segStart] : 0;
+            if (scanComps < 1 || scanComps > static_cast<int>(frame.components.size()) ||
+                segDataLen < static_cast<std::size_t>(4 + scanComps * 2)) {
+                throw std::runtime_error("Unsupported JPEG SOS");
+            }
+            JPGScan scan;
+            std::size_t p = segStart + 1;
+            for (int i = 0; i < scanComps; ++i) {
+                const int cid = data[p++];
+                const int sel = data[p++];
+                int found = -1;
+                for (std::size_t c = 0; c < frame.components.size(); ++c) {
+                    if (frame.components[c].id == cid) {
+                        found = static_cast<int>(c);
+                    }
                 }
-                break;
+                if (found < 0) {
+                    throw std::runtime_error("SOS references unknown JPEG component");
+                }
+                scan.components.push_back(found);
+                scan.dc.push_back(&dcTables[static_cast<std::size_t>((sel >> 4) & 0x03)]);
+                scan.ac.push_back(&acTables[static_cast<std::size_t>(sel & 0x03)]);
             }
-            if (symbol == 0xF0) {
-                for (int i = 0; i < 16 && k < 64; ++i) {
-                    zz[static_cast<std::size_t>(k++)] = 0;
+            scan.ss = data[p];
+            scan.se = data[p + 1];
+            scan.ah = data[p + 2] >> 4;
+            scan.al = data[p + 2] & 0x0F;
+            if (!frame.progressive) {
+                scan.ss = 0;
+                scan.se = 63;
+                scan.ah = 0;
+                scan.al = 0;
+            } else if (scan.se > 63 || scan.ss > scan.se || (scan.ss == 0 && scan.se != 0) ||
+                       (scan.ss > 0 && scanComps != 1) || scan.al > 13) {
+                throw std::runtime_error("Invalid JPEG progressive scan");
+            }
+            for (std::size_t s = 0; s < scan.components.size(); ++s) {
+                const bool needsDC = scan.ss == 0 && scan.ah == 0;
+                const bool needsAC = scan.se > 0;
+                if ((needsDC && !scan.dc[s]->defined) || (needsAC && !scan.ac[s]->defined)) {
+                    throw std::runtime_error("Missing JPEG Huffman table");
                 }
-                continue;
             }
 
-            const int run = (symbol >> 4) & 0x0F;
-            const int size = symbol & 0x0F;
-            for (int i = 0; i < run && k < 64; ++i) {
-                zz[static_cast<std::size_t>(k++)] = 0;
-            }
-            if (k >= 64) {
+            // Entropy-coded data runs to the next marker other than RSTn,
+            // which split it into independently decodable intervals.
+            std::vector<std::pair<const std::uint8_t*, std::size_t>> segments;
+            std::size_t segmentStart = segStart + segDataLen;
+            std::size_t end = segmentStart;
+            while (end + 1 < size) {
+                if (data[end] != 0xFF || data[end + 1] == 0x00 || data[end + 1] == 0xFF) {
+                    end += data[end] == 0xFF && data[end + 1] == 0x00 ? 2 : 1;
+                    continue;
+                }
+                if (data[end + 1] >= 0xD0 && data[end + 1] <= 0xD7) {
+                    segments.emplace_back(data + segmentStart, end - segmentStart);
+                    end += 2;
+                    segmentStart = end;
+                    continue;
+                }
                 break;
             }
-            const int acBits = extendSign(br.readBits(size), size);
-            zz[static_cast<std::size_t>(k++)] = acBits;
-        }
-
-        std::array<double, 64> freq{};
-        for (int i = 0; i < 64; ++i) {
-            const int natural = kZigZag[static_cast<std::size_t>(i)];
-            freq[static_cast<std::size_t>(natural)] =
-                static_cast<double>(zz[static_cast<std::size_t>(i)] * static_cast<int>(q[static_cast<std::size_t>(natural)]));
+            if (end + 1 >= size) {
+                end = size;
+            }
+            segments.emplace_back(data + segmentStart, end - segmentStart);
+            decodeScan(frame, scan, segments, restartInterval, options.threads);
+            ++scanCount;
+            pos = end;
+            continue;
         }
 
-        outSpatial = idct8x8(freq);
-    };
-
-    for (int ci = 0; ci < compCount; ++ci) {
-        const Component& c = components[static_cast<std::size_t>(ci)];
-        compSpatial[static_cast<std::size_t>(ci)].resize(static_cast<std::size_t>(c.h * c.v));
-    }
-
-    int idxY = 0;
-    int idxCb = 1;
-    int idxCr = 2;
-    for (int i = 0; i < compCount; ++i) {
-        if (components[static_cast<std::size_t>(i)].id == 1) {
-            idxY = i;
-        } else if (components[static_cast<std::size_t>(i)].id == 2) {
-            idxCb = i;
-        } else if (components[static_cast<std::size_t>(i)].id == 3) {
-            idxCr = i;
-        }
+        pos = segStart + segDataLen;
     }
 
-    auto sampleFromComponent = [&](int compIdx, int localX, int localY) -> double {
-        const Component& c = components[static_cast<std::size_t>(compIdx)];
-        const int scaleX = maxH / c.h;
-        const int scaleY = maxV / c.v;
-        int cx = localX / scaleX;
-        int cy = localY / scaleY;
-        const int maxCX = c.h * 8 - 1;
-        const int maxCY = c.v * 8 - 1;
-        cx = std::min(std::max(cx, 0), maxCX);
-        cy = std::min(std::max(cy, 0), maxCY);
-        const int blockX = cx / 8;
-        const int blockY = cy / 8;
-        const int blockIdx = blockY * c.h + blockX;
-        const int inX = cx % 8;
-        const int inY = cy % 8;
-        return compSpatial[static_cast<std::size_t>(compIdx)][static_cast<std::size_t>(blockIdx)]
-                          [static_cast<std::size_t>(inY) * 8 + inX];
-    };
-
-    for (int my = 0; my < mcuH; ++my) {
-        for (int mx = 0; mx < mcuW; ++mx) {
-            for (int s = 0; s < scanCount; ++s) {
-                const int compIdx = scanOrder[static_cast<std::size_t>(s)];
-                const Component& c = components[static_cast<std::size_t>(compIdx)];
-                for (int vy = 0; vy < c.v; ++vy) {
-                    for (int hx = 0; hx < c.h; ++hx) {
-                        const int blockIdx = vy * c.h + hx;
-                        decodeBlock(compIdx, compSpatial[static_cast<std::size_t>(compIdx)][static_cast<std::size_t>(blockIdx)]);
-                    }
-                }
-            }
-
-            for (int by = 0; by < mcuPixelH; ++by) {
-                for (int bx = 0; bx < mcuPixelW; ++bx) {
-                    const int x = mx * mcuPixelW + bx;
-                    const int y = my * mcuPixelH + by;
-                    if (x >= width || y >= height) {
-                        continue;
-                    }
-                    const double Y = sampleFromComponent(idxY, bx, by) + 128.0;
-                    const double Cb = sampleFromComponent(idxCb, bx, by) + 128.0;
-                    const double Cr = sampleFromComponent(idxCr, bx, by) + 128.0;
-
-                    const int r = static_cast<int>(std::lround(Y + 1.402 * (Cr - 128.0)));
-                    const int g = static_cast<int>(std::lround(Y - 0.344136 * (Cb - 128.0) - 0.714136 * (Cr - 128.0)));
-                    const int b = static_cast<int>(std::lround(Y + 1.772 * (Cb - 128.0)));
-
-                    image.setPixel(x, y, Color(clampToByte(r), clampToByte(g), clampToByte(b)));
-                }
-            }
+    if (!gotFrame || scanCount == 0) {
+        throw std::runtime_error("Incomplete JPEG file");
+    }
+    const int scale = scaleForTarget(frame.width, frame.height, options.targetWidth, options.targetHeight);
+    const int blockSize = 8 / scale;
+    // Per component: AAN-scaled factors for full 8x8 transforms, plain ones
+    // for reduced sizes.
+    std::array<std::array<float, 64>, 4> dequant{};
+    for (std::size_t c = 0; c < frame.components.size(); ++c) {
+        const JPGComponent& comp = frame.components[c];
+        const std::array<std::uint8_t, 64>& q = quantTables[static_cast<std::size_t>(comp.qt)];
+        if (!quantDefined[static_cast<std::size_t>(comp.qt)]) {
+            throw std::runtime_error("Missing JPEG quantization table");
+        }
+        if (componentBlockSize(frame, comp, blockSize) == 8) {
+            dequant[c] = dequantizationMultipliers(q);
+        } else {
+            std::copy(q.begin(), q.end(), dequant[c].begin());
         }
     }
 
-    return image;
+    const int outWidth = (frame.width + scale - 1) / scale;
+    const int outHeight = (frame.height + scale - 1) / scale;
+    std::uint8_t* pixels = target.allocate(outWidth, outHeight);
+    parallelFor(frame.mcuH, options.threads, [&](int mcuRow) {
+        outputMcuRow(frame, dequant, blockSize, mcuRow, outWidth, outHeight, pixels, target.channels);
+    });
 }
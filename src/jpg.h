@@ -3,9 +3,36 @@
 
 #include "image.h"
 
+#include <cstddef>
+#include <cstdint>
 #include <string>
 #include <vector>
 
+enum class JPGSubsampling {
+    Yuv444,
+    Yuv422,
+    Yuv420,
+};
+
+// Quality 1-100 scales the standard quantization tables (50 keeps them).
+// Chroma is stored at full, half-width or half-size resolution. Worker
+// threads default to all cores; output does not depend on the thread count.
+struct JPGSaveOptions {
+    int quality = 50;
+    JPGSubsampling subsampling = JPGSubsampling::Yuv420;
+    int threads = 0;
+};
+
+// Worker threads for entropy decoding across restart intervals and for the
+// inverse DCT; 0 uses all cores. A target size decodes at the smallest scale
+// of 1/2, 1/4 or 1/8 that still covers it, inside the inverse DCT; frames
+// already at or below the target decode at full size.
+struct JPGLoadOptions {
+    int threads = 0;
+    int targetWidth = 0;
+    int targetHeight = 0;
+};
+
 class JPGImage : public RasterImage {
 public:
     JPGImage();
@@ -18,8 +45,10 @@ public:
     const Color& getPixel(int x, int y) const override;
     void setPixel(int x, int y, const Color& color) override;
 
-    bool save(const std::string& filename) const;
-    static JPGImage load(const std::string& filename);
+    bool save(const std::string& filename, const JPGSaveOptions& options = JPGSaveOptions()) const;
+    static bool saveRows(const std::string& filename, const PixelRows& pixels, const JPGSaveOptions& options = JPGSaveOptions());
+    static JPGImage load(const std::string& filename, const JPGLoadOptions& options = JPGLoadOptions());
+    static void decode(const std::uint8_t* data, std::size_t size, const PixelTarget& target, const JPGLoadOptions& options = JPGLoadOptions());
 
 private:
     int m_width;
@@ -1,13 +1,37 @@
 #include "layer.h"
 
+#include "compress.h"
+#include "generator.h"
+#include "mapped_file.h"
+#include "parallel.h"
+#include "profile.h"
+
 #include <algorithm>
+#include <atomic>
 #include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <iterator>
 #include <limits>
+#include <mutex>
+#include <sstream>
 #include <stdexcept>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 namespace {
+// Limit per pixel buffer. Documents may be larger; those are rendered in
+// bands through Document::compositeRows.
 constexpr std::size_t kMaxImagePixels = 100000000;
 constexpr std::uint32_t kMaxIFLOWStringBytes = 1u << 20;
 constexpr std::uint32_t kMaxIFLOWNodes = 1000000;
@@ -16,7 +40,7 @@ std::size_t pixelIndex(int x, int y, int width) {
     return static_cast<std::size_t>(y) * static_cast<std::size_t>(width) + static_cast<std::size_t>(x);
 }
 
-std::size_t checkedPixelCount(int width, int height, const char* context) {
+std::size_t checkedPixelCount(int width, int height, const char* context, std::size_t limit = kMaxImagePixels) {
     if (width <= 0 || height <= 0) {
         throw std::invalid_argument(std::string(context) + " dimensions must be positive");
     }
@@ -26,263 +50,1865 @@ std::size_t checkedPixelCount(int width, int height, const char* context) {
         throw std::invalid_argument(std::string(context) + " dimensions overflow pixel count");
     }
     const std::size_t pixels = w * h;
-    if (pixels > kMaxImagePixels) {
+    if (pixels > limit) {
         throw std::invalid_argument(std::string(context) + " exceeds maximum pixel count");
     }
     return pixels;
 }
 
-float clamp01(float v) {
-    if (v < 0.0f) {
-        return 0.0f;
+std::uint64_t nextRevisionStamp() {
+    static std::atomic<std::uint64_t> counter(0);
+    return counter.fetch_add(1) + 1;
+}
+
+float clamp01(float v) {
+    if (v < 0.0f) {
+        return 0.0f;
+    }
+    if (v > 1.0f) {
+        return 1.0f;
+    }
+    return v;
+}
+
+float srgbToLinear(float c) {
+    if (c <= 0.04045f) {
+        return c / 12.92f;
+    }
+    return std::pow((c + 0.055f) / 1.055f, 2.4f);
+}
+
+float linearToSrgb(float c) {
+    const float clamped = clamp01(c);
+    if (clamped <= 0.0031308f) {
+        return clamped * 12.92f;
+    }
+    return 1.055f * std::pow(clamped, 1.0f / 2.4f) - 0.055f;
+}
+
+std::uint8_t toByte(float unit) {
+    const float clamped = clamp01(unit);
+    return static_cast<std::uint8_t>(std::lround(clamped * 255.0f));
+}
+
+constexpr int kSpanBlock = 16;
+constexpr int kEncodeBuckets = 4096;
+
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__) && defined(__linux__)
+#define IFLOW_SPAN_CLONES __attribute__((target_clones("avx2", "default")))
+#else
+#define IFLOW_SPAN_CLONES
+#endif
+
+std::uint8_t encodeSrgbReference(float linear) {
+    return toByte(linearToSrgb(linear));
+}
+
+struct TransferTables {
+    float decode[256];
+    float thresholds[256];
+    std::uint8_t bucketStart[kEncodeBuckets + 1];
+
+    TransferTables() {
+        for (int i = 0; i < 256; ++i) {
+            decode[i] = srgbToLinear(static_cast<float>(i) / 255.0f);
+        }
+
+        thresholds[0] = 0.0f;
+        std::uint32_t lowBits = 0;
+        for (int code = 1; code < 256; ++code) {
+            std::uint32_t lo = lowBits;
+            std::uint32_t hi = floatBits(1.0f);
+            while (lo < hi) {
+                const std::uint32_t mid = lo + (hi - lo) / 2;
+                if (encodeSrgbReference(bitsFloat(mid)) >= code) {
+                    hi = mid;
+                } else {
+                    lo = mid + 1;
+                }
+            }
+            thresholds[code] = bitsFloat(lo);
+            lowBits = lo;
+        }
+
+        for (int i = 0; i <= kEncodeBuckets; ++i) {
+            bucketStart[i] = encodeSrgbReference(static_cast<float>(i) / static_cast<float>(kEncodeBuckets));
+        }
+    }
+
+    static std::uint32_t floatBits(float value) {
+        std::uint32_t bits = 0;
+        std::memcpy(&bits, &value, sizeof(bits));
+        return bits;
+    }
+
+    static float bitsFloat(std::uint32_t bits) {
+        float value = 0.0f;
+        std::memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+
+    std::uint8_t encode(float linear) const {
+        if (!(linear > 0.0f)) {
+            return 0;
+        }
+        if (linear >= 1.0f) {
+            return 255;
+        }
+        int code = bucketStart[static_cast<int>(linear * static_cast<float>(kEncodeBuckets))];
+        while (code < 255 && linear >= thresholds[code + 1]) {
+            ++code;
+        }
+        while (code > 0 && linear < thresholds[code]) {
+            --code;
+        }
+        return static_cast<std::uint8_t>(code);
+    }
+};
+
+const TransferTables& transferTables() {
+    static const TransferTables tables;
+    return tables;
+}
+
+struct LinearPixel {
+    float r;
+    float g;
+    float b;
+    float a;
+};
+
+struct LinearBlock {
+    float r[kSpanBlock];
+    float g[kSpanBlock];
+    float b[kSpanBlock];
+    float a[kSpanBlock];
+};
+
+template <BlendMode Mode>
+inline float blendChannelT(float d, float s) {
+    if constexpr (Mode == BlendMode::Multiply) {
+        return d * s;
+    } else if constexpr (Mode == BlendMode::Screen) {
+        return 1.0f - (1.0f - d) * (1.0f - s);
+    } else if constexpr (Mode == BlendMode::Overlay) {
+        return d < 0.5f ? (2.0f * d * s) : (1.0f - 2.0f * (1.0f - d) * (1.0f - s));
+    } else if constexpr (Mode == BlendMode::Darken) {
+        return std::min(d, s);
+    } else if constexpr (Mode == BlendMode::Lighten) {
+        return std::max(d, s);
+    } else if constexpr (Mode == BlendMode::Add) {
+        return std::min(1.0f, d + s);
+    } else if constexpr (Mode == BlendMode::Subtract) {
+        return std::max(0.0f, d - s);
+    } else if constexpr (Mode == BlendMode::Difference) {
+        return std::abs(d - s);
+    } else if constexpr (Mode == BlendMode::ColorDodge) {
+        const float dodged = std::min(1.0f, d / std::max(1e-6f, 1.0f - s));
+        return s >= 1.0f ? 1.0f : dodged;
+    } else {
+        return s;
+    }
+}
+
+template <BlendMode Mode>
+inline float blendPremultiplied(float dp, float da, float s, float sa) {
+    if constexpr (Mode == BlendMode::Normal) {
+        return dp * (1.0f - sa) + s * sa;
+    } else {
+        const float d = dp / (da > 0.0f ? da : 1.0f);
+        return dp * (1.0f - sa) + s * sa * (1.0f - da) + blendChannelT<Mode>(d, s) * sa * da;
+    }
+}
+
+// Source channels are straight linear colour; destination channels are premultiplied.
+template <BlendMode Mode>
+IFLOW_SPAN_CLONES void blendBlock(const LinearBlock& src, LinearBlock& dst) {
+    for (int i = 0; i < kSpanBlock; ++i) {
+        const float sa = src.a[i];
+        const float da = dst.a[i];
+        dst.r[i] = blendPremultiplied<Mode>(dst.r[i], da, src.r[i], sa);
+        dst.g[i] = blendPremultiplied<Mode>(dst.g[i], da, src.g[i], sa);
+        dst.b[i] = blendPremultiplied<Mode>(dst.b[i], da, src.b[i], sa);
+        dst.a[i] = sa + da * (1.0f - sa);
+    }
+}
+
+void loadDestination(LinearBlock& block, const LinearPixel* dst, int n) {
+    for (int i = 0; i < kSpanBlock; ++i) {
+        const LinearPixel p = i < n ? dst[i] : LinearPixel{0.0f, 0.0f, 0.0f, 0.0f};
+        block.r[i] = p.r;
+        block.g[i] = p.g;
+        block.b[i] = p.b;
+        block.a[i] = p.a;
+    }
+}
+
+void storeDestination(const LinearBlock& block, const LinearBlock& src, LinearPixel* dst, int n) {
+    for (int i = 0; i < n; ++i) {
+        if (src.a[i] > 0.0f) {
+            dst[i] = LinearPixel{block.r[i], block.g[i], block.b[i], block.a[i]};
+        }
+    }
+}
+
+template <BlendMode Mode>
+void compositeSpanT(LinearPixel* dst, const PixelRGBA8* src, int count, float opacity, const std::uint8_t* coverage) {
+    const TransferTables& tables = transferTables();
+    const float opacityScale = clamp01(opacity);
+    const float coverageScale = opacityScale / (255.0f * 255.0f);
+    LinearBlock srcBlock;
+    LinearBlock dstBlock;
+
+    for (int base = 0; base < count; base += kSpanBlock) {
+        const int n = std::min(kSpanBlock, count - base);
+        bool any = false;
+        for (int i = 0; i < kSpanBlock; ++i) {
+            if (i >= n) {
+                srcBlock.r[i] = srcBlock.g[i] = srcBlock.b[i] = srcBlock.a[i] = 0.0f;
+                continue;
+            }
+            const PixelRGBA8& s = src[base + i];
+            srcBlock.a[i] = coverage ? static_cast<float>(static_cast<int>(s.a) * coverage[base + i]) * coverageScale
+                                     : (static_cast<float>(s.a) / 255.0f) * opacityScale;
+            srcBlock.r[i] = tables.decode[s.r];
+            srcBlock.g[i] = tables.decode[s.g];
+            srcBlock.b[i] = tables.decode[s.b];
+            any = any || srcBlock.a[i] > 0.0f;
+        }
+        if (!any) {
+            continue;
+        }
+
+        loadDestination(dstBlock, dst + base, n);
+        blendBlock<Mode>(srcBlock, dstBlock);
+        storeDestination(dstBlock, srcBlock, dst + base, n);
+    }
+}
+
+template <BlendMode Mode>
+void compositeSurfaceSpanT(LinearPixel* dst, const LinearPixel* src, int count, float opacity) {
+    const float scale = clamp01(opacity);
+    LinearBlock srcBlock;
+    LinearBlock dstBlock;
+
+    for (int base = 0; base < count; base += kSpanBlock) {
+        const int n = std::min(kSpanBlock, count - base);
+        bool any = false;
+        for (int i = 0; i < kSpanBlock; ++i) {
+            const LinearPixel s = i < n ? src[base + i] : LinearPixel{0.0f, 0.0f, 0.0f, 0.0f};
+            const float inverseAlpha = s.a > 0.0f ? 1.0f / s.a : 0.0f;
+            srcBlock.a[i] = s.a * scale;
+            srcBlock.r[i] = s.r * inverseAlpha;
+            srcBlock.g[i] = s.g * inverseAlpha;
+            srcBlock.b[i] = s.b * inverseAlpha;
+            any = any || srcBlock.a[i] > 0.0f;
+        }
+        if (!any) {
+            continue;
+        }
+
+        loadDestination(dstBlock, dst + base, n);
+        blendBlock<Mode>(srcBlock, dstBlock);
+        storeDestination(dstBlock, srcBlock, dst + base, n);
+    }
+}
+
+template <typename Fn>
+void dispatchBlendMode(BlendMode mode, Fn&& fn) {
+    switch (mode) {
+        case BlendMode::Multiply:
+            fn(std::integral_constant<BlendMode, BlendMode::Multiply>());
+            return;
+        case BlendMode::Screen:
+            fn(std::integral_constant<BlendMode, BlendMode::Screen>());
+            return;
+        case BlendMode::Overlay:
+            fn(std::integral_constant<BlendMode, BlendMode::Overlay>());
+            return;
+        case BlendMode::Darken:
+            fn(std::integral_constant<BlendMode, BlendMode::Darken>());
+            return;
+        case BlendMode::Lighten:
+            fn(std::integral_constant<BlendMode, BlendMode::Lighten>());
+            return;
+        case BlendMode::Add:
+            fn(std::integral_constant<BlendMode, BlendMode::Add>());
+            return;
+        case BlendMode::Subtract:
+            fn(std::integral_constant<BlendMode, BlendMode::Subtract>());
+            return;
+        case BlendMode::Difference:
+            fn(std::integral_constant<BlendMode, BlendMode::Difference>());
+            return;
+        case BlendMode::ColorDodge:
+            fn(std::integral_constant<BlendMode, BlendMode::ColorDodge>());
+            return;
+        case BlendMode::Normal:
+        default:
+            fn(std::integral_constant<BlendMode, BlendMode::Normal>());
+            return;
+    }
+}
+
+void compositeSpan(BlendMode mode, LinearPixel* dst, const PixelRGBA8* src, int count, float opacity, const std::uint8_t* coverage) {
+    dispatchBlendMode(mode, [&](auto tag) {
+        compositeSpanT<decltype(tag)::value>(dst, src, count, opacity, coverage);
+    });
+}
+
+void compositeSurfaceSpan(BlendMode mode, LinearPixel* dst, const LinearPixel* src, int count, float opacity) {
+    dispatchBlendMode(mode, [&](auto tag) {
+        compositeSurfaceSpanT<decltype(tag)::value>(dst, src, count, opacity);
+    });
+}
+
+PixelRGBA8 encodeLinearPixel(const LinearPixel& p) {
+    if (!(p.a > 0.0f)) {
+        return PixelRGBA8(0, 0, 0, 0);
+    }
+    const TransferTables& tables = transferTables();
+    const float inverseAlpha = 1.0f / p.a;
+    return PixelRGBA8(tables.encode(p.r * inverseAlpha), tables.encode(p.g * inverseAlpha), tables.encode(p.b * inverseAlpha), toByte(p.a));
+}
+
+Transform2D combineTransform(const Transform2D& parent, int offsetX, int offsetY, const Transform2D& local) {
+    Transform2D combined = parent;
+    combined *= Transform2D::translation(static_cast<double>(offsetX), static_cast<double>(offsetY));
+    combined *= local;
+    return combined;
+}
+
+enum class MappingKind {
+    IntegerTranslation,
+    AxisAligned,
+    General
+};
+
+MappingKind classifyMapping(const Transform2D& inverse) {
+    if (inverse.b() != 0.0 || inverse.c() != 0.0) {
+        return MappingKind::General;
+    }
+    const double limit = 1e9;
+    if (inverse.a() == 1.0 && inverse.d() == 1.0 &&
+        std::abs(inverse.tx()) < limit && std::abs(inverse.ty()) < limit &&
+        inverse.tx() == std::floor(inverse.tx()) && inverse.ty() == std::floor(inverse.ty())) {
+        return MappingKind::IntegerTranslation;
+    }
+    return MappingKind::AxisAligned;
+}
+
+void clipLinearSpan(double slope, double intercept, double limit, double& lo, double& hi) {
+    if (slope == 0.0) {
+        if (intercept < 0.0 || intercept >= limit) {
+            lo = 1.0;
+            hi = 0.0;
+        }
+        return;
+    }
+    double a = (0.0 - intercept) / slope - 0.5;
+    double b = (limit - intercept) / slope - 0.5;
+    if (a > b) {
+        std::swap(a, b);
+    }
+    lo = std::max(lo, a);
+    hi = std::min(hi, b);
+}
+
+struct PixelRect {
+    int x0;
+    int y0;
+    int x1;
+    int y1;
+
+    bool empty() const {
+        return x0 >= x1 || y0 >= y1;
+    }
+
+    int width() const {
+        return x1 - x0;
+    }
+
+    int height() const {
+        return y1 - y0;
+    }
+
+    std::int64_t area() const {
+        return empty() ? 0 : static_cast<std::int64_t>(width()) * height();
+    }
+};
+
+PixelRect intersectRects(const PixelRect& a, const PixelRect& b) {
+    return PixelRect{std::max(a.x0, b.x0), std::max(a.y0, b.y0), std::min(a.x1, b.x1), std::min(a.y1, b.y1)};
+}
+
+PixelRect unionRects(const PixelRect& a, const PixelRect& b) {
+    if (a.empty()) {
+        return b;
+    }
+    if (b.empty()) {
+        return a;
+    }
+    return PixelRect{std::min(a.x0, b.x0), std::min(a.y0, b.y0), std::max(a.x1, b.x1), std::max(a.y1, b.y1)};
+}
+
+int clampToPixelRange(double value) {
+    const double limit = 1.0e9;
+    return static_cast<int>(std::max(-limit, std::min(limit, value)));
+}
+
+PixelRect transformedRect(const Transform2D& transform, int x0, int y0, int x1, int y1) {
+    double minX = std::numeric_limits<double>::max();
+    double minY = std::numeric_limits<double>::max();
+    double maxX = std::numeric_limits<double>::lowest();
+    double maxY = std::numeric_limits<double>::lowest();
+
+    const std::pair<double, double> corners[4] = {
+        transform.apply(static_cast<double>(x0), static_cast<double>(y0)),
+        transform.apply(static_cast<double>(x1), static_cast<double>(y0)),
+        transform.apply(static_cast<double>(x0), static_cast<double>(y1)),
+        transform.apply(static_cast<double>(x1), static_cast<double>(y1))};
+
+    for (const auto& c : corners) {
+        minX = std::min(minX, c.first);
+        minY = std::min(minY, c.second);
+        maxX = std::max(maxX, c.first);
+        maxY = std::max(maxY, c.second);
+    }
+
+    return PixelRect{clampToPixelRange(std::floor(minX)), clampToPixelRange(std::floor(minY)),
+                     clampToPixelRange(std::ceil(maxX)), clampToPixelRange(std::ceil(maxY))};
+}
+
+PixelRect transformedBounds(const Transform2D& transform, int width, int height) {
+    return transformedRect(transform, 0, 0, width, height);
+}
+
+PixelRect nodeBounds(const LayerNode& node, const Transform2D& parentTransform) {
+    if (node.isLayer()) {
+        const Layer& layer = node.asLayer();
+        if (!layer.visible() || layer.opacity() <= 0.0f) {
+            return PixelRect{0, 0, 0, 0};
+        }
+        const Transform2D transform = combineTransform(parentTransform, layer.offsetX(), layer.offsetY(), layer.transform());
+        return transformedBounds(transform, layer.image().width(), layer.image().height());
+    }
+
+    const LayerGroup& group = node.asGroup();
+    if (!group.visible() || group.opacity() <= 0.0f) {
+        return PixelRect{0, 0, 0, 0};
+    }
+    const Transform2D groupTransform = combineTransform(parentTransform, group.offsetX(), group.offsetY(), group.transform());
+    PixelRect bounds{0, 0, 0, 0};
+    for (std::size_t i = 0; i < group.nodeCount(); ++i) {
+        bounds = unionRects(bounds, nodeBounds(group.node(i), groupTransform));
+    }
+    return bounds;
+}
+
+struct Surface {
+    PixelRect rect{0, 0, 0, 0};
+    std::vector<LinearPixel> pixels;
+
+    LinearPixel* at(int x, int y) {
+        return pixels.data() + pixelIndex(x - rect.x0, y - rect.y0, rect.width());
+    }
+
+    const LinearPixel* at(int x, int y) const {
+        return pixels.data() + pixelIndex(x - rect.x0, y - rect.y0, rect.width());
+    }
+};
+
+class SurfacePool {
+public:
+    Surface acquire(const PixelRect& rect) {
+        const std::size_t pixels = static_cast<std::size_t>(rect.width()) * static_cast<std::size_t>(rect.height());
+        const std::size_t bucket = bucketFor(pixels);
+        if (bucket >= m_free.size()) {
+            m_free.resize(bucket + 1);
+        }
+
+        Surface surface;
+        surface.rect = rect;
+        if (!m_free[bucket].empty()) {
+            surface.pixels = std::move(m_free[bucket].back());
+            m_free[bucket].pop_back();
+        } else {
+            surface.pixels.reserve(std::size_t(1) << bucket);
+            profileAllocation(surface.pixels.capacity() * sizeof(LinearPixel));
+        }
+        surface.pixels.assign(pixels, LinearPixel{0.0f, 0.0f, 0.0f, 0.0f});
+        return surface;
+    }
+
+    void release(Surface&& surface) {
+        const std::size_t capacity = surface.pixels.capacity();
+        if (capacity == 0) {
+            return;
+        }
+        std::size_t bucket = bucketFor(capacity);
+        if ((std::size_t(1) << bucket) > capacity) {
+            --bucket;
+        }
+        if (bucket >= m_free.size()) {
+            m_free.resize(bucket + 1);
+        }
+        m_free[bucket].push_back(std::move(surface.pixels));
+    }
+
+private:
+    static std::size_t bucketFor(std::size_t pixels) {
+        std::size_t bucket = 0;
+        while ((std::size_t(1) << bucket) < pixels) {
+            ++bucket;
+        }
+        return bucket;
+    }
+
+    std::vector<std::vector<std::vector<LinearPixel>>> m_free;
+};
+
+// Picks the mip levels bracketing the layer area one output pixel covers
+// when the transform shrinks the layer: level and level + 1, weighted by
+// blend towards the coarser one. Level 0 is the layer itself.
+bool chooseMipLevels(const Transform2D& inverse, int width, int height, int& level, float& blend) {
+    const double footprint = std::max(std::hypot(inverse.a(), inverse.b()), std::hypot(inverse.c(), inverse.d()));
+    int top = 0;
+    for (int size = std::max(width, height); size > 1; size = (size + 1) / 2) {
+        ++top;
+    }
+    if (!(footprint > 1.0 + 1.0e-6) || top == 0) {
+        return false;
+    }
+    const double lod = std::log2(footprint);
+    level = static_cast<int>(std::floor(lod));
+    blend = static_cast<float>(lod - level);
+    if (level >= top) {
+        level = top;
+        blend = 0.0f;
+    }
+    return true;
+}
+
+// Noise-free gradients barely change within one output pixel's footprint,
+// so a shrunken one is evaluated at the pixel centers instead of rendering
+// every layer pixel into mip levels.
+bool sampledDirectly(const ImageBuffer& image) {
+    PixelRGBA8 color;
+    if (image.trySolidColor(color)) {
+        return true;
+    }
+    const LayerGenerator* generator = imageGenerator(image);
+    return generator && generator->noise.empty() && generator->kind != LayerGenerator::Kind::Checker;
+}
+
+// Scales the document onto an output of scaledExtent sides.
+Transform2D rootTransform(int width, int height, double scale) {
+    if (scale == 1.0) {
+        return Transform2D::identity();
+    }
+    return Transform2D::scaling(static_cast<double>(scaledExtent(width, scale)) / width,
+                                static_cast<double>(scaledExtent(height, scale)) / height);
+}
+
+void checkCompositeScale(double scale) {
+    if (!(scale > 0.0 && scale <= 1.0)) {
+        throw std::invalid_argument("Composite scale must be in (0, 1]");
+    }
+}
+
+// A mip level seen from layer space; level pixel i covers layer pixels
+// [i / scale, (i + 1) / scale).
+struct MipLevelView {
+    ConstImageView image;
+    ConstCoverageView mask;
+    int width;
+    int height;
+    double scale;
+};
+
+MipLevelView mipLevelView(const Layer& layer, int index, bool color, bool coverage) {
+    const MipCache::Level* level = index > 0 ? &layer.mipLevel(index) : nullptr;
+    const ImageBuffer& image = level ? level->image : layer.image();
+    MipLevelView view{ConstImageView(), ConstCoverageView(), image.width(), image.height(), std::ldexp(1.0, -index)};
+    if (color) {
+        view.image = image.view();
+    }
+    if (coverage) {
+        view.mask = level ? level->mask.view() : layer.mask().view();
+    }
+    return view;
+}
+
+// Neighbouring level pixels around a layer-space coordinate, clamped to the
+// level's edges, and the weight of the second.
+struct AxisTap {
+    int i0;
+    int i1;
+    float f;
+};
+
+AxisTap axisTap(double position, double scale, int size) {
+    const double x = position * scale - 0.5;
+    const double left = std::floor(x);
+    const int i = static_cast<int>(left);
+    return AxisTap{std::clamp(i, 0, size - 1), std::clamp(i + 1, 0, size - 1), static_cast<float>(x - left)};
+}
+
+struct BilinearTaps {
+    AxisTap x;
+    AxisTap y;
+};
+
+// Adds the alpha-weighted color at the taps, scaled by weight, to sum.
+void accumulateColor(const MipLevelView& level, const BilinearTaps& taps, float weight, float* sum) {
+    const PixelRGBA8* upper = level.image.row(taps.y.i0);
+    const PixelRGBA8* lower = level.image.row(taps.y.i1);
+    const PixelRGBA8 corners[4] = {upper[taps.x.i0], upper[taps.x.i1], lower[taps.x.i0], lower[taps.x.i1]};
+    const float fx = taps.x.f;
+    const float fy = taps.y.f;
+    const float weights[4] = {(1.0f - fx) * (1.0f - fy), fx * (1.0f - fy), (1.0f - fx) * fy, fx * fy};
+    for (int i = 0; i < 4; ++i) {
+        const float a = static_cast<float>(corners[i].a) * weights[i] * weight;
+        sum[0] += static_cast<float>(corners[i].r) * a;
+        sum[1] += static_cast<float>(corners[i].g) * a;
+        sum[2] += static_cast<float>(corners[i].b) * a;
+        sum[3] += a;
+    }
+}
+
+float sampleCoverage(const MipLevelView& level, const BilinearTaps& taps) {
+    const std::uint8_t* upper = level.mask.row(taps.y.i0);
+    const std::uint8_t* lower = level.mask.row(taps.y.i1);
+    const float top = upper[taps.x.i0] + (static_cast<float>(upper[taps.x.i1]) - upper[taps.x.i0]) * taps.x.f;
+    const float bottom = lower[taps.x.i0] + (static_cast<float>(lower[taps.x.i1]) - lower[taps.x.i0]) * taps.x.f;
+    return top + (bottom - top) * taps.y.f;
+}
+
+PixelRGBA8 straightPixel(const float* sum) {
+    if (sum[3] < 0.5f) {
+        return PixelRGBA8(0, 0, 0, 0);
+    }
+    const float inverseAlpha = 1.0f / sum[3];
+    const auto channel = [](float value) { return static_cast<std::uint8_t>(std::min(255.0f, value + 0.5f)); };
+    return PixelRGBA8(channel(sum[0] * inverseAlpha), channel(sum[1] * inverseAlpha), channel(sum[2] * inverseAlpha), channel(sum[3]));
+}
+
+void compositeLayerOnto(Surface& out, const Layer& layer, const Transform2D& parentTransform) {
+    if (!layer.visible() || layer.opacity() <= 0.0f) {
+        return;
+    }
+
+    const Transform2D transform = combineTransform(parentTransform, layer.offsetX(), layer.offsetY(), layer.transform());
+
+    const int srcW = layer.image().width();
+    const int srcH = layer.image().height();
+
+    const PixelRect bounds = intersectRects(transformedBounds(transform, srcW, srcH), out.rect);
+    if (bounds.empty()) {
+        return;
+    }
+    const int startX = bounds.x0;
+    const int startY = bounds.y0;
+    const int endX = bounds.x1;
+    const int endY = bounds.y1;
+
+    const ImageBuffer& image = layer.image();
+    const MaskBuffer* mask = layer.hasMask() ? &layer.mask() : nullptr;
+    const Transform2D inverse = transform.inverse();
+
+    const std::size_t spanWidth = static_cast<std::size_t>(endX - startX);
+    std::vector<PixelRGBA8> srcRow(spanWidth);
+    std::vector<std::uint8_t> coverageRow(mask ? spanWidth : 0);
+
+    // Solid planes are never expanded; their row buffer holds the value.
+    PixelRGBA8 solidColor;
+    std::uint8_t solidCoverage = 0;
+    const bool solidImage = image.trySolidColor(solidColor);
+    const bool solidMask = mask && mask->trySolidCoverage(solidCoverage);
+    if (solidImage) {
+        std::fill(srcRow.begin(), srcRow.end(), solidColor);
+    }
+    if (solidMask) {
+        std::fill(coverageRow.begin(), coverageRow.end(), solidCoverage);
+    }
+    if (solidMask && solidCoverage == 0) {
+        return;
+    }
+    // Generated pixels are evaluated for the spans drawn, skipping pixels
+    // the mask hides, unless a shrinking transform needs their mip levels.
+    int mipIndex = 0;
+    float mipBlend = 0.0f;
+    const bool directImage = solidImage || sampledDirectly(image);
+    const bool downscaled = (!directImage || (mask && !solidMask)) && chooseMipLevels(inverse, srcW, srcH, mipIndex, mipBlend);
+    const LayerGenerator* generator = solidImage || downscaled ? nullptr : imageGenerator(image);
+    const ConstImageView source = solidImage || generator || downscaled ? ConstImageView() : image.view();
+    const ConstCoverageView maskView = mask && !solidMask ? mask->view() : ConstCoverageView();
+    const auto gather = [&](int i, int sx, int sy) {
+        const std::size_t at = static_cast<std::size_t>(i);
+        if (mask && !solidMask) {
+            coverageRow[at] = maskView.at(sx, sy);
+        }
+        if (generator) {
+            if (!mask || coverageRow[at] != 0) {
+                srcRow[at] = generator->at(sx, sy);
+            }
+        } else if (!solidImage) {
+            srcRow[at] = source.at(sx, sy);
+        }
+    };
+    const auto blendRun = [&](int dy, int x0, int count) {
+        compositeSpan(layer.blendMode(), out.at(x0, dy), srcRow.data(), count, layer.opacity(), mask ? coverageRow.data() : nullptr);
+    };
+
+    if (classifyMapping(inverse) == MappingKind::IntegerTranslation) {
+        const int shiftX = static_cast<int>(inverse.tx());
+        const int shiftY = static_cast<int>(inverse.ty());
+        const int x0 = std::max(startX, -shiftX);
+        const int x1 = std::min(endX, srcW - shiftX);
+        if (x0 >= x1) {
+            return;
+        }
+        for (int dy = std::max(startY, -shiftY); dy < std::min(endY, srcH - shiftY); ++dy) {
+            const std::uint8_t* maskRow = solidMask ? coverageRow.data()
+                                          : mask    ? maskView.row(dy + shiftY) + (x0 + shiftX)
+                                                    : nullptr;
+            if (!generator) {
+                const PixelRGBA8* sourceRow = solidImage ? srcRow.data() : source.row(dy + shiftY) + (x0 + shiftX);
+                compositeSpan(layer.blendMode(), out.at(x0, dy), sourceRow, x1 - x0, layer.opacity(), maskRow);
+                continue;
+            }
+            int runX0 = x0;
+            int runX1 = x1;
+            if (maskRow && !solidMask) {
+                while (runX0 < runX1 && maskRow[runX0 - x0] == 0) {
+                    ++runX0;
+                }
+                while (runX1 > runX0 && maskRow[runX1 - 1 - x0] == 0) {
+                    --runX1;
+                }
+            }
+            if (runX0 == runX1) {
+                continue;
+            }
+            generator->renderRow(srcRow.data(), runX0 + shiftX, dy + shiftY, runX1 - runX0);
+            compositeSpan(layer.blendMode(), out.at(runX0, dy), srcRow.data(), runX1 - runX0, layer.opacity(),
+                          maskRow ? maskRow + (solidMask ? 0 : runX0 - x0) : nullptr);
+        }
+        return;
+    }
+
+    if (classifyMapping(inverse) == MappingKind::AxisAligned && !downscaled) {
+        std::vector<int> columns(spanWidth);
+        int x0 = endX;
+        int x1 = startX;
+        for (int dx = startX; dx < endX; ++dx) {
+            const int sx = static_cast<int>(std::floor(inverse.a() * (static_cast<double>(dx) + 0.5) + inverse.tx()));
+            columns[static_cast<std::size_t>(dx - startX)] = sx;
+            if (sx >= 0 && sx < srcW) {
+                x0 = std::min(x0, dx);
+                x1 = std::max(x1, dx + 1);
+            }
+        }
+        if (x0 >= x1) {
+            return;
+        }
+        for (int dy = startY; dy < endY; ++dy) {
+            const int sy = static_cast<int>(std::floor(inverse.d() * (static_cast<double>(dy) + 0.5) + inverse.ty()));
+            if (sy < 0 || sy >= srcH) {
+                continue;
+            }
+            for (int dx = x0; dx < x1; ++dx) {
+                gather(dx - x0, columns[static_cast<std::size_t>(dx - startX)], sy);
+            }
+            blendRun(dy, x0, x1 - x0);
+        }
+        return;
+    }
+
+    // Output pixels [x0, x1) of row dy whose centers land on the layer.
+    const auto coveredSpan = [&](int dy, int& x0, int& x1) {
+        const double py = static_cast<double>(dy) + 0.5;
+        const double rowX = inverse.c() * py;
+        const double rowY = inverse.d() * py;
+        const auto covered = [&](int dx) {
+            const double px = static_cast<double>(dx) + 0.5;
+            const int sx = static_cast<int>(std::floor(inverse.a() * px + rowX + inverse.tx()));
+            const int sy = static_cast<int>(std::floor(inverse.b() * px + rowY + inverse.ty()));
+            return sx >= 0 && sx < srcW && sy >= 0 && sy < srcH;
+        };
+
+        double lo = static_cast<double>(startX);
+        double hi = static_cast<double>(endX);
+        clipLinearSpan(inverse.a(), rowX + inverse.tx(), static_cast<double>(srcW), lo, hi);
+        clipLinearSpan(inverse.b(), rowY + inverse.ty(), static_cast<double>(srcH), lo, hi);
+        if (lo > hi) {
+            return false;
+        }
+
+        x0 = std::max(startX, static_cast<int>(std::floor(lo)) - 2);
+        x1 = std::min(endX, static_cast<int>(std::ceil(hi)) + 2);
+        while (x0 < x1 && !covered(x0)) {
+            ++x0;
+        }
+        while (x1 > x0 && !covered(x1 - 1)) {
+            --x1;
+        }
+        return x0 < x1;
+    };
+
+    if (downscaled) {
+        // Trilinear: bilinear taps in the two levels bracketing the
+        // footprint, blended by mipBlend.
+        const bool color = !solidImage;
+        const bool coverage = mask && !solidMask;
+        const MipLevelView fine = mipLevelView(layer, mipIndex, color, coverage);
+        const MipLevelView coarse = mipBlend > 0.0f ? mipLevelView(layer, mipIndex + 1, color, coverage) : fine;
+        const auto tapsAt = [](const MipLevelView& level, double u, double v) {
+            return BilinearTaps{axisTap(u, level.scale, level.width), axisTap(v, level.scale, level.height)};
+        };
+        // Axis-aligned mappings reuse one set of column taps for every row.
+        const bool axisAligned = inverse.b() == 0.0 && inverse.c() == 0.0;
+        std::vector<AxisTap> fineColumns;
+        std::vector<AxisTap> coarseColumns;
+        if (axisAligned) {
+            for (int dx = startX; dx < endX; ++dx) {
+                const double u = inverse.a() * (static_cast<double>(dx) + 0.5) + inverse.tx();
+                fineColumns.push_back(axisTap(u, fine.scale, fine.width));
+                coarseColumns.push_back(axisTap(u, coarse.scale, coarse.width));
+            }
+        }
+        for (int dy = startY; dy < endY; ++dy) {
+            int x0 = 0;
+            int x1 = 0;
+            if (!coveredSpan(dy, x0, x1)) {
+                continue;
+            }
+            const double py = static_cast<double>(dy) + 0.5;
+            const double rowV = inverse.d() * py + inverse.ty();
+            const AxisTap fineRow = axisTap(rowV, fine.scale, fine.height);
+            const AxisTap coarseRow = axisTap(rowV, coarse.scale, coarse.height);
+            for (int dx = x0; dx < x1; ++dx) {
+                BilinearTaps fineTaps{};
+                BilinearTaps coarseTaps{};
+                if (axisAligned) {
+                    fineTaps = BilinearTaps{fineColumns[static_cast<std::size_t>(dx - startX)], fineRow};
+                    coarseTaps = BilinearTaps{coarseColumns[static_cast<std::size_t>(dx - startX)], coarseRow};
+                } else {
+                    const double px = static_cast<double>(dx) + 0.5;
+                    const double u = inverse.a() * px + inverse.c() * py + inverse.tx();
+                    const double v = inverse.b() * px + rowV;
+                    fineTaps = tapsAt(fine, u, v);
+                    coarseTaps = tapsAt(coarse, u, v);
+                }
+                const std::size_t i = static_cast<std::size_t>(dx - x0);
+                if (color) {
+                    float sum[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+                    accumulateColor(fine, fineTaps, 1.0f - mipBlend, sum);
+                    if (mipBlend > 0.0f) {
+                        accumulateColor(coarse, coarseTaps, mipBlend, sum);
+                    }
+                    srcRow[i] = straightPixel(sum);
+                }
+                if (coverage) {
+                    float value = sampleCoverage(fine, fineTaps) * (1.0f - mipBlend);
+                    if (mipBlend > 0.0f) {
+                        value += sampleCoverage(coarse, coarseTaps) * mipBlend;
+                    }
+                    coverageRow[i] = static_cast<std::uint8_t>(std::min(255.0f, value + 0.5f));
+                }
+            }
+            blendRun(dy, x0, x1 - x0);
+        }
+        return;
+    }
+
+    for (int dy = startY; dy < endY; ++dy) {
+        int x0 = 0;
+        int x1 = 0;
+        if (!coveredSpan(dy, x0, x1)) {
+            continue;
+        }
+        const double py = static_cast<double>(dy) + 0.5;
+        const double rowX = inverse.c() * py;
+        const double rowY = inverse.d() * py;
+        for (int dx = x0; dx < x1; ++dx) {
+            const double px = static_cast<double>(dx) + 0.5;
+            gather(dx - x0, static_cast<int>(std::floor(inverse.a() * px + rowX + inverse.tx())),
+                   static_cast<int>(std::floor(inverse.b() * px + rowY + inverse.ty())));
+        }
+        blendRun(dy, x0, x1 - x0);
+    }
+}
+
+void compositeSurfaceOnto(Surface& out, const Surface& src, BlendMode mode, float opacity) {
+    const PixelRect overlap = intersectRects(out.rect, src.rect);
+    if (overlap.empty()) {
+        return;
+    }
+    for (int y = overlap.y0; y < overlap.y1; ++y) {
+        compositeSurfaceSpan(mode, out.at(overlap.x0, y), src.at(overlap.x0, y), overlap.width(), opacity);
+    }
+}
+
+// path names the node in profiles and is only built while profiling.
+void compositeNodeOnto(Surface& out, const LayerNode& node, const Transform2D& parentTransform, SurfacePool& pool,
+                       const std::string& path) {
+    ProfileScope scope("composite");
+    if (scope.active()) {
+        scope.setName(path + " " + (node.isLayer() ? node.asLayer().name() : node.asGroup().name()));
+        scope.addPixels(static_cast<std::uint64_t>(intersectRects(nodeBounds(node, parentTransform), out.rect).area()));
+    }
+    if (node.isLayer()) {
+        compositeLayerOnto(out, node.asLayer(), parentTransform);
+        return;
+    }
+
+    const LayerGroup& group = node.asGroup();
+    if (!group.visible() || group.opacity() <= 0.0f) {
+        return;
+    }
+
+    const PixelRect bounds = intersectRects(nodeBounds(node, parentTransform), out.rect);
+    if (bounds.empty()) {
+        return;
+    }
+
+    Surface groupSurface = pool.acquire(bounds);
+    const Transform2D groupTransform = combineTransform(parentTransform, group.offsetX(), group.offsetY(), group.transform());
+
+    for (std::size_t i = 0; i < group.nodeCount(); ++i) {
+        compositeNodeOnto(groupSurface, group.node(i), groupTransform, pool,
+                          scope.active() ? path + "/" + std::to_string(i) : std::string());
+    }
+
+    compositeSurfaceOnto(out, groupSurface, group.blendMode(), group.opacity());
+    pool.release(std::move(groupSurface));
+}
+
+bool sameRect(const PixelRect& a, const PixelRect& b) {
+    return a.x0 == b.x0 && a.y0 == b.y0 && a.x1 == b.x1 && a.y1 == b.y1;
+}
+
+struct TileGrid {
+    int width;
+    int height;
+    int tileSize;
+
+    int columns() const {
+        return (width + tileSize - 1) / tileSize;
+    }
+
+    int count() const {
+        return columns() * ((height + tileSize - 1) / tileSize);
+    }
+
+    PixelRect tile(int index) const {
+        const int x = (index % columns()) * tileSize;
+        const int y = (index / columns()) * tileSize;
+        return PixelRect{x, y, std::min(x + tileSize, width), std::min(y + tileSize, height)};
+    }
+};
+
+// Visible layers whose pixels land in region, in tree order.
+void collectLayersIn(const LayerGroup& group, const Transform2D& transform, const PixelRect& region,
+                     std::vector<const Layer*>& layers) {
+    for (std::size_t i = 0; i < group.nodeCount(); ++i) {
+        const LayerNode& node = group.node(i);
+        if (intersectRects(nodeBounds(node, transform), region).empty()) {
+            continue;
+        }
+        if (node.isGroup()) {
+            const LayerGroup& child = node.asGroup();
+            collectLayersIn(child, combineTransform(transform, child.offsetX(), child.offsetY(), child.transform()), region,
+                            layers);
+        } else {
+            layers.push_back(&node.asLayer());
+        }
+    }
+}
+
+bool planeResident(const ImageBuffer& image) {
+    PixelRGBA8 color;
+    return image.resident() || image.trySolidColor(color) || imageGenerator(image);
+}
+
+bool planeResident(const MaskBuffer& mask) {
+    std::uint8_t value = 0;
+    return mask.resident() || mask.trySolidCoverage(value);
+}
+
+// Solid and generated planes count as resident: compositing never expands
+// them, unless a generated one is drawn shrunken.
+bool layerResident(const Layer& layer) {
+    return planeResident(layer.image()) && (!layer.hasMask() || planeResident(layer.mask()));
+}
+
+// Lazily loaded layers are decoded up front, one per worker, rather than by
+// whichever tile happens to reach them first while the others wait.
+void makeLayersResident(const std::vector<const Layer*>& layers, int threads) {
+    std::vector<const Layer*> pending;
+    for (const Layer* layer : layers) {
+        if (!layerResident(*layer)) {
+            pending.push_back(layer);
+        }
+    }
+    parallelFor(static_cast<int>(pending.size()), threads, [&pending](int i) {
+        const Layer& layer = *pending[static_cast<std::size_t>(i)];
+        if (!planeResident(layer.image())) {
+            layer.image().makeResident();
+        }
+        if (layer.hasMask() && !planeResident(layer.mask())) {
+            layer.mask().makeResident();
+        }
+    });
+}
+
+// Mip levels of the shrunken layers in region are built here with all the
+// threads, before the tiles that sample them start.
+void buildMipLevels(const LayerGroup& group, const Transform2D& transform, const PixelRect& region, int threads) {
+    for (std::size_t i = 0; i < group.nodeCount(); ++i) {
+        const LayerNode& node = group.node(i);
+        if (intersectRects(nodeBounds(node, transform), region).empty()) {
+            continue;
+        }
+        if (node.isGroup()) {
+            const LayerGroup& child = node.asGroup();
+            buildMipLevels(child, combineTransform(transform, child.offsetX(), child.offsetY(), child.transform()), region, threads);
+            continue;
+        }
+        const Layer& layer = node.asLayer();
+        if (sampledDirectly(layer.image()) && !layer.hasMask()) {
+            continue;
+        }
+        const Transform2D inverse = combineTransform(transform, layer.offsetX(), layer.offsetY(), layer.transform()).inverse();
+        int level = 0;
+        float blend = 0.0f;
+        if (!chooseMipLevels(inverse, layer.image().width(), layer.image().height(), level, blend)) {
+            continue;
+        }
+        const int coarsest = blend > 0.0f ? level + 1 : level;
+        if (coarsest > 0) {
+            layer.mipLevel(coarsest, threads);
+        }
+    }
+}
+
+// Tiles are written to out with row originY of the grid at out's row 0;
+// transform maps the root group onto the grid.
+void compositeTiles(const LayerGroup& root, const Transform2D& transform, const TileGrid& grid, const std::vector<int>& tiles,
+                    int threads, ImageBuffer& out, int originY = 0) {
+    const int count = static_cast<int>(tiles.size());
+    ProfileScope scope("composite", "tiles");
+    if (scope.active()) {
+        for (int tile : tiles) {
+            scope.addPixels(static_cast<std::uint64_t>(grid.tile(tile).area()));
+        }
+    }
+    if (count > 0) {
+        std::vector<const Layer*> layers;
+        collectLayersIn(root, transform, PixelRect{0, originY, grid.width, originY + out.height()}, layers);
+        makeLayersResident(layers, threads);
+        buildMipLevels(root, transform, PixelRect{0, originY, grid.width, originY + out.height()}, threads);
+    }
+    PixelRGBA8* pixels = out.data();
+    std::vector<SurfacePool> pools(static_cast<std::size_t>(parallelWorkerCount(count, threads)));
+    parallelForWorkers(count, threads, [&](int index, int worker) {
+        SurfacePool& pool = pools[static_cast<std::size_t>(worker)];
+        const PixelRect region = grid.tile(tiles[static_cast<std::size_t>(index)]);
+
+        Surface tile = pool.acquire(region);
+        for (std::size_t i = 0; i < root.nodeCount(); ++i) {
+            compositeNodeOnto(tile, root.node(i), transform, pool,
+                              scope.active() ? "/" + std::to_string(i) : std::string());
+        }
+
+        for (int y = region.y0; y < region.y1; ++y) {
+            const LinearPixel* row = tile.at(region.x0, y);
+            PixelRGBA8* dst = pixels + pixelIndex(region.x0, y - originY, out.width());
+            for (int x = 0; x < region.width(); ++x) {
+                dst[x] = encodeLinearPixel(row[x]);
+            }
+        }
+        pool.release(std::move(tile));
+    });
+}
+
+// Keeps the decoded pixels of file-backed layers a streaming composite has
+// touched within a byte budget by releasing the least recently used ones.
+class ResidencyBudget {
+public:
+    explicit ResidencyBudget(std::size_t budget) : m_budget(budget), m_used(0) {}
+
+    // Makes room for the layers band needs, then faults them in.
+    void acquire(const std::vector<const Layer*>& layers, int band, int threads) {
+        std::size_t incoming = 0;
+        for (const Layer* layer : layers) {
+            const auto found = m_entries.find(layer);
+            if (found != m_entries.end()) {
+                found->second.lastBand = band;
+                continue;
+            }
+            const std::size_t bytes = releasableBytes(*layer);
+            if (bytes > 0) {
+                m_entries.emplace(layer, Entry{band, bytes});
+                incoming += bytes;
+            }
+        }
+        while (m_budget > 0 && m_used + incoming > m_budget && releaseOldest(band)) {
+        }
+        m_used += incoming;
+        makeLayersResident(layers, threads);
+    }
+
+private:
+    struct Entry {
+        int lastBand;
+        std::size_t bytes;
+    };
+
+    static std::size_t releasableBytes(const Layer& layer) {
+        std::size_t bytes = 0;
+        PixelRGBA8 color;
+        std::uint8_t value = 0;
+        if (layer.image().pixelSource() && !layer.image().trySolidColor(color) && !imageGenerator(layer.image())) {
+            bytes += static_cast<std::size_t>(layer.image().width()) * static_cast<std::size_t>(layer.image().height()) * 4;
+        }
+        if (layer.hasMask() && layer.mask().pixelSource() && !layer.mask().trySolidCoverage(value)) {
+            bytes += static_cast<std::size_t>(layer.mask().width()) * static_cast<std::size_t>(layer.mask().height());
+        }
+        return bytes;
+    }
+
+    bool releaseOldest(int band) {
+        auto oldest = m_entries.end();
+        for (auto it = m_entries.begin(); it != m_entries.end(); ++it) {
+            if (it->second.lastBand < band && (oldest == m_entries.end() || it->second.lastBand < oldest->second.lastBand)) {
+                oldest = it;
+            }
+        }
+        if (oldest == m_entries.end()) {
+            return false;
+        }
+        const Layer& layer = *oldest->first;
+        layer.image().releaseResident();
+        if (layer.hasMask()) {
+            layer.mask().releaseResident();
+        }
+        m_used -= oldest->second.bytes;
+        m_entries.erase(oldest);
+        return true;
+    }
+
+    std::size_t m_budget;
+    std::size_t m_used;
+    std::unordered_map<const Layer*, Entry> m_entries;
+};
+
+void collectStamps(const LayerGroup& group, const Transform2D& transform, std::vector<CompositeCache::NodeStamp>& stamps) {
+    for (std::size_t i = 0; i < group.nodeCount(); ++i) {
+        const LayerNode& node = group.node(i);
+        const PixelRect bounds = nodeBounds(node, transform);
+        CompositeCache::NodeStamp stamp{};
+        stamp.group = node.isGroup();
+        stamp.childCount = node.isGroup() ? node.asGroup().nodeCount() : 0;
+        stamp.revision = node.isGroup() ? node.asGroup().revision() : node.asLayer().revision();
+        stamp.x0 = bounds.x0;
+        stamp.y0 = bounds.y0;
+        stamp.x1 = bounds.x1;
+        stamp.y1 = bounds.y1;
+        int x0 = 0;
+        int y0 = 0;
+        int x1 = 0;
+        int y1 = 0;
+        if (node.isLayer() && node.asLayer().changedRect(stamp.rectBase, x0, y0, x1, y1)) {
+            const Layer& layer = node.asLayer();
+            const Transform2D layerTransform = combineTransform(transform, layer.offsetX(), layer.offsetY(), layer.transform());
+            // Padded a pixel for the sample positions of transformed layers,
+            // or by the reach of the coarser sampled mip level.
+            int pad = 1;
+            int level = 0;
+            float blend = 0.0f;
+            if (chooseMipLevels(layerTransform.inverse(), layer.image().width(), layer.image().height(), level, blend)) {
+                pad = (4 << level) + 1;
+            }
+            const PixelRect rect = transformedRect(layerTransform, x0 - pad, y0 - pad, x1 + pad, y1 + pad);
+            stamp.rectX0 = rect.x0;
+            stamp.rectY0 = rect.y0;
+            stamp.rectX1 = rect.x1;
+            stamp.rectY1 = rect.y1;
+        }
+        stamps.push_back(stamp);
+        if (node.isGroup()) {
+            const LayerGroup& child = node.asGroup();
+            collectStamps(child, combineTransform(transform, child.offsetX(), child.offsetY(), child.transform()), stamps);
+        }
+    }
+}
+
+// Plane whose every pixel has one value. Buffers created with a fill keep it
+// as their source, so they need no pixel memory until something reads their
+// rows, and compositing can use the value directly.
+template <typename T>
+class SolidPlaneSource : public PixelSource {
+public:
+    explicit SolidPlaneSource(const T& value) : m_value(value) {}
+
+    void load(std::uint8_t* pixels, int width, int height, int) const override {
+        T* values = reinterpret_cast<T*>(pixels);
+        std::fill(values, values + static_cast<std::size_t>(width) * static_cast<std::size_t>(height), m_value);
+    }
+
+    const T& value() const {
+        return m_value;
+    }
+
+private:
+    T m_value;
+};
+
+template <typename T>
+std::shared_ptr<const PixelSource> solidPlane(const T& value) {
+    return std::make_shared<SolidPlaneSource<T>>(value);
+}
+
+template <typename T>
+const SolidPlaneSource<T>* asSolidPlane(const PixelSource* source) {
+    return dynamic_cast<const SolidPlaneSource<T>*>(source);
+}
+
+} // namespace
+
+namespace {
+struct SpillDescriptor {
+    int fd = -1;
+
+    ~SpillDescriptor() {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+};
+
+class SpilledPlane : public PixelSource {
+public:
+    SpilledPlane(std::shared_ptr<const SpillDescriptor> file, off_t offset, std::size_t storedSize, std::size_t rawSize)
+        : m_file(std::move(file)), m_offset(offset), m_storedSize(storedSize), m_rawSize(rawSize) {}
+
+    void load(std::uint8_t* pixels, int width, int height, int channels) const override {
+        if (static_cast<std::size_t>(width) * static_cast<std::size_t>(height) * static_cast<std::size_t>(channels) != m_rawSize) {
+            throw std::runtime_error("Spilled pixels do not match their buffer");
+        }
+        std::vector<std::uint8_t> stored(m_storedSize);
+        std::size_t done = 0;
+        while (done < m_storedSize) {
+            const ssize_t got = ::pread(m_file->fd, stored.data() + done, m_storedSize - done, m_offset + static_cast<off_t>(done));
+            if (got <= 0) {
+                throw std::runtime_error("Failed to read spilled pixels");
+            }
+            done += static_cast<std::size_t>(got);
+        }
+        const std::vector<std::uint8_t> raw = lz4Decompress(stored.data(), stored.size(), m_rawSize);
+        std::memcpy(pixels, raw.data(), m_rawSize);
+    }
+
+private:
+    std::shared_ptr<const SpillDescriptor> m_file;
+    off_t m_offset;
+    std::size_t m_storedSize;
+    std::size_t m_rawSize;
+};
+} // namespace
+
+struct SpillFile::State {
+    std::mutex mutex;
+    std::shared_ptr<SpillDescriptor> file;
+    off_t end = 0;
+};
+
+SpillFile::SpillFile() : m_state(std::make_shared<State>()) {}
+
+SpillFile::~SpillFile() = default;
+
+std::shared_ptr<const PixelSource> SpillFile::store(const std::uint8_t* data, std::size_t size) {
+    const std::vector<std::uint8_t> stored = lz4Compress(data, size);
+    const std::lock_guard<std::mutex> lock(m_state->mutex);
+    if (!m_state->file) {
+        std::string path = (std::filesystem::temp_directory_path() / "image_flow-spill-XXXXXX").string();
+        auto file = std::make_shared<SpillDescriptor>();
+        file->fd = ::mkstemp(path.data());
+        if (file->fd < 0) {
+            throw std::runtime_error("Failed to create spill file in " + std::filesystem::temp_directory_path().string());
+        }
+        ::unlink(path.c_str());
+        m_state->file = std::move(file);
+    }
+    const off_t offset = m_state->end;
+    std::size_t done = 0;
+    while (done < stored.size()) {
+        const ssize_t wrote = ::pwrite(m_state->file->fd, stored.data() + done, stored.size() - done, offset + static_cast<off_t>(done));
+        if (wrote <= 0) {
+            throw std::runtime_error("Failed to write spill file");
+        }
+        done += static_cast<std::size_t>(wrote);
+    }
+    m_state->end += static_cast<off_t>(stored.size());
+    return std::make_shared<SpilledPlane>(m_state->file, offset, stored.size(), size);
+}
+
+std::size_t SpillFile::bytesWritten() const {
+    const std::lock_guard<std::mutex> lock(m_state->mutex);
+    return static_cast<std::size_t>(m_state->end);
+}
+
+// Pixel plane shared between copy-on-write buffers. A plane built from a
+// PixelSource stays empty until its first access and decodes once, even when
+// several threads reach it together. While the source is kept, the decoded
+// pixels may be released again and fault back in on the next access.
+template <typename T>
+class PlaneStore {
+public:
+    explicit PlaneStore(const std::vector<T>& values) : m_values(values), m_width(0), m_height(0), m_ready(true) {
+        profileAllocation(values.size() * sizeof(T));
+    }
+    PlaneStore(int width, int height, std::shared_ptr<const PixelSource> source)
+        : m_width(width), m_height(height), m_source(std::move(source)), m_ready(false) {}
+
+    std::vector<T>& values() {
+        if (!m_ready.load(std::memory_order_acquire)) {
+            std::lock_guard<std::mutex> lock(m_loading);
+            if (!m_ready.load(std::memory_order_relaxed)) {
+                ProfileScope scope("load");
+                if (scope.active()) {
+                    scope.setName(std::to_string(m_width) + "x" + std::to_string(m_height) + (sizeof(T) == 1 ? " mask" : " pixels"));
+                    scope.addPixels(static_cast<std::uint64_t>(m_width) * static_cast<std::uint64_t>(m_height));
+                }
+                std::vector<T> values(static_cast<std::size_t>(m_width) * static_cast<std::size_t>(m_height));
+                profileAllocation(values.size() * sizeof(T));
+                m_source->load(reinterpret_cast<std::uint8_t*>(values.data()), m_width, m_height,
+                               static_cast<int>(sizeof(T)));
+                m_values = std::move(values);
+                m_ready.store(true, std::memory_order_release);
+            }
+        }
+        return m_values;
+    }
+
+    // Not safe while another thread may be reading the pixels.
+    bool release() {
+        if (!m_source || !ready()) {
+            return false;
+        }
+        m_values = std::vector<T>();
+        m_ready.store(false, std::memory_order_release);
+        return true;
+    }
+
+    // Pixels without a source are stored in spill first, so release can
+    // drop them. Same rules as release.
+    bool spill(SpillFile& spill, int width, int height) {
+        if (!ready()) {
+            return false;
+        }
+        if (!m_source) {
+            if (m_values.empty()) {
+                return false;
+            }
+            m_source = spill.store(reinterpret_cast<const std::uint8_t*>(m_values.data()), m_values.size() * sizeof(T));
+            m_width = width;
+            m_height = height;
+        }
+        return release();
+    }
+
+    std::size_t residentBytes() {
+        return ready() ? m_values.size() * sizeof(T) : 0;
+    }
+
+    // Called by the sole owner before writing: the source no longer
+    // describes the pixels once they change.
+    std::vector<T>& writableValues() {
+        values();
+        m_source.reset();
+        return m_values;
+    }
+
+    bool ready() const {
+        return m_ready.load(std::memory_order_acquire);
+    }
+
+    const PixelSource* source() const {
+        return m_source.get();
+    }
+
+private:
+    std::vector<T> m_values;
+    int m_width;
+    int m_height;
+    std::shared_ptr<const PixelSource> m_source;
+    std::mutex m_loading;
+    std::atomic<bool> m_ready;
+};
+
+ImageBuffer::ImageBuffer() : m_width(0), m_height(0) {}
+
+ImageBuffer::ImageBuffer(int width, int height, const PixelRGBA8& fill) : m_width(width), m_height(height) {
+    checkedPixelCount(width, height, "ImageBuffer");
+    m_pixels = std::make_shared<PlaneStore<PixelRGBA8>>(width, height, solidPlane(fill));
+}
+
+ImageBuffer::ImageBuffer(int width, int height, std::shared_ptr<const PixelSource> source)
+    : m_width(width), m_height(height) {
+    checkedPixelCount(width, height, "ImageBuffer");
+    if (!source) {
+        throw std::invalid_argument("ImageBuffer pixel source must not be null");
+    }
+    m_pixels = std::make_shared<PlaneStore<PixelRGBA8>>(width, height, std::move(source));
+}
+
+int ImageBuffer::width() const {
+    return m_width;
+}
+
+int ImageBuffer::height() const {
+    return m_height;
+}
+
+bool ImageBuffer::inBounds(int x, int y) const {
+    return x >= 0 && x < m_width && y >= 0 && y < m_height;
+}
+
+const PixelRGBA8& ImageBuffer::getPixel(int x, int y) const {
+    if (!inBounds(x, y)) {
+        throw std::out_of_range("ImageBuffer pixel out of bounds");
     }
-    if (v > 1.0f) {
-        return 1.0f;
+    return m_pixels->values()[pixelIndex(x, y, m_width)];
+}
+
+bool ImageBuffer::trySetPixel(int x, int y, const PixelRGBA8& pixel) {
+    if (!inBounds(x, y)) {
+        return false;
     }
-    return v;
+    detach();
+    m_pixels->values()[pixelIndex(x, y, m_width)] = pixel;
+    return true;
 }
 
-float srgbToLinear(float c) {
-    if (c <= 0.04045f) {
-        return c / 12.92f;
+void ImageBuffer::setPixel(int x, int y, const PixelRGBA8& pixel) {
+    if (!trySetPixel(x, y, pixel)) {
+        throw std::out_of_range("ImageBuffer pixel out of bounds");
     }
-    return std::pow((c + 0.055f) / 1.055f, 2.4f);
 }
 
-float linearToSrgb(float c) {
-    const float clamped = clamp01(c);
-    if (clamped <= 0.0031308f) {
-        return clamped * 12.92f;
+void ImageBuffer::fill(const PixelRGBA8& pixel) {
+    if (!m_pixels) {
+        return;
     }
-    return 1.055f * std::pow(clamped, 1.0f / 2.4f) - 0.055f;
+    m_pixels = std::make_shared<PlaneStore<PixelRGBA8>>(m_width, m_height, solidPlane(pixel));
 }
 
-std::uint8_t toByte(float unit) {
-    const float clamped = clamp01(unit);
-    return static_cast<std::uint8_t>(std::lround(clamped * 255.0f));
+PixelRGBA8* ImageBuffer::data() {
+    detach();
+    return m_pixels ? m_pixels->values().data() : nullptr;
 }
 
-float blendChannel(BlendMode mode, float d, float s) {
-    switch (mode) {
-        case BlendMode::Normal:
-            return s;
-        case BlendMode::Multiply:
-            return d * s;
-        case BlendMode::Screen:
-            return 1.0f - (1.0f - d) * (1.0f - s);
-        case BlendMode::Overlay:
-            return d < 0.5f ? (2.0f * d * s) : (1.0f - 2.0f * (1.0f - d) * (1.0f - s));
-        case BlendMode::Darken:
-            return std::min(d, s);
-        case BlendMode::Lighten:
-            return std::max(d, s);
-        case BlendMode::Add:
-            return std::min(1.0f, d + s);
-        case BlendMode::Subtract:
-            return std::max(0.0f, d - s);
-        case BlendMode::Difference:
-            return std::abs(d - s);
-        case BlendMode::ColorDodge:
-            if (s >= 1.0f) {
-                return 1.0f;
-            }
-            return std::min(1.0f, d / std::max(1e-6f, 1.0f - s));
-        default:
-            return s;
-    }
+const PixelRGBA8* ImageBuffer::data() const {
+    return m_pixels ? m_pixels->values().data() : nullptr;
 }
 
-float maskWeight(const PixelRGBA8& maskPixel) {
-    const float alpha = static_cast<float>(maskPixel.a) / 255.0f;
-    const float luma = (static_cast<float>(maskPixel.r) + static_cast<float>(maskPixel.g) + static_cast<float>(maskPixel.b)) / (255.0f * 3.0f);
-    return clamp01(alpha * luma);
+PixelRGBA8* ImageBuffer::row(int y) {
+    if (y < 0 || y >= m_height) {
+        throw std::out_of_range("ImageBuffer row out of bounds");
+    }
+    return data() + pixelIndex(0, y, m_width);
 }
 
-void compositePixel(PixelRGBA8& dst, const PixelRGBA8& src, BlendMode mode, float sourceOpacityScale) {
-    const float sa = (static_cast<float>(src.a) / 255.0f) * clamp01(sourceOpacityScale);
-    if (sa <= 0.0f) {
-        return;
+const PixelRGBA8* ImageBuffer::row(int y) const {
+    if (y < 0 || y >= m_height) {
+        throw std::out_of_range("ImageBuffer row out of bounds");
     }
+    return data() + pixelIndex(0, y, m_width);
+}
 
-    const float da = static_cast<float>(dst.a) / 255.0f;
+ImageView ImageBuffer::view() {
+    return ImageView(data(), m_width, m_height, m_width);
+}
 
-    const float sr = srgbToLinear(static_cast<float>(src.r) / 255.0f);
-    const float sg = srgbToLinear(static_cast<float>(src.g) / 255.0f);
-    const float sb = srgbToLinear(static_cast<float>(src.b) / 255.0f);
+ConstImageView ImageBuffer::view() const {
+    return ConstImageView(data(), m_width, m_height, m_width);
+}
 
-    const float dr = srgbToLinear(static_cast<float>(dst.r) / 255.0f);
-    const float dg = srgbToLinear(static_cast<float>(dst.g) / 255.0f);
-    const float db = srgbToLinear(static_cast<float>(dst.b) / 255.0f);
+ImageView ImageBuffer::view(int x, int y, int width, int height) {
+    return view().subview(x, y, width, height);
+}
 
-    const float br = blendChannel(mode, dr, sr);
-    const float bg = blendChannel(mode, dg, sg);
-    const float bb = blendChannel(mode, db, sb);
+ConstImageView ImageBuffer::view(int x, int y, int width, int height) const {
+    return view().subview(x, y, width, height);
+}
 
-    const float outA = sa + da * (1.0f - sa);
+bool ImageBuffer::sharesPixelsWith(const ImageBuffer& other) const {
+    return m_pixels && m_pixels == other.m_pixels;
+}
 
-    float outR = 0.0f;
-    float outG = 0.0f;
-    float outB = 0.0f;
+bool ImageBuffer::resident() const {
+    return !m_pixels || m_pixels->ready();
+}
 
-    if (outA > 0.0f) {
-        const float premR = dr * da * (1.0f - sa) + sr * sa * (1.0f - da) + br * sa * da;
-        const float premG = dg * da * (1.0f - sa) + sg * sa * (1.0f - da) + bg * sa * da;
-        const float premB = db * da * (1.0f - sa) + sb * sa * (1.0f - da) + bb * sa * da;
-        outR = premR / outA;
-        outG = premG / outA;
-        outB = premB / outA;
+void ImageBuffer::makeResident() const {
+    if (m_pixels) {
+        m_pixels->values();
     }
+}
 
-    dst = PixelRGBA8(toByte(linearToSrgb(outR)), toByte(linearToSrgb(outG)), toByte(linearToSrgb(outB)), toByte(outA));
+const PixelSource* ImageBuffer::pixelSource() const {
+    return m_pixels ? m_pixels->source() : nullptr;
 }
 
-Transform2D combineTransform(const Transform2D& parent, int offsetX, int offsetY, const Transform2D& local) {
-    Transform2D combined = parent;
-    combined *= Transform2D::translation(static_cast<double>(offsetX), static_cast<double>(offsetY));
-    combined *= local;
-    return combined;
+bool ImageBuffer::releaseResident() const {
+    return m_pixels && m_pixels->release();
 }
 
-void compositeLayerOnto(ImageBuffer& out, const Layer& layer, const Transform2D& parentTransform) {
-    if (!layer.visible() || layer.opacity() <= 0.0f) {
-        return;
-    }
+bool ImageBuffer::spillResident(SpillFile& spill) const {
+    return m_pixels && m_pixels->spill(spill, m_width, m_height);
+}
 
-    const Transform2D transform = combineTransform(parentTransform, layer.offsetX(), layer.offsetY(), layer.transform());
+std::size_t ImageBuffer::residentBytes() const {
+    return m_pixels ? m_pixels->residentBytes() : 0;
+}
 
-    const int srcW = layer.image().width();
-    const int srcH = layer.image().height();
+bool ImageBuffer::trySolidColor(PixelRGBA8& color) const {
+    const SolidPlaneSource<PixelRGBA8>* solid = m_pixels ? asSolidPlane<PixelRGBA8>(m_pixels->source()) : nullptr;
+    if (!solid) {
+        return false;
+    }
+    color = solid->value();
+    return true;
+}
 
-    double minX = std::numeric_limits<double>::max();
-    double minY = std::numeric_limits<double>::max();
-    double maxX = std::numeric_limits<double>::lowest();
-    double maxY = std::numeric_limits<double>::lowest();
+void ImageBuffer::detach() {
+    if (!m_pixels) {
+        return;
+    }
+    if (m_pixels.use_count() > 1) {
+        m_pixels = std::make_shared<PlaneStore<PixelRGBA8>>(m_pixels->values());
+        return;
+    }
+    m_pixels->writableValues();
+}
 
-    const std::pair<double, double> corners[4] = {
-        transform.apply(0.0, 0.0),
-        transform.apply(static_cast<double>(srcW), 0.0),
-        transform.apply(0.0, static_cast<double>(srcH)),
-        transform.apply(static_cast<double>(srcW), static_cast<double>(srcH))};
+MaskBuffer::MaskBuffer() : m_width(0), m_height(0) {}
 
-    for (const auto& c : corners) {
-        minX = std::min(minX, c.first);
-        minY = std::min(minY, c.second);
-        maxX = std::max(maxX, c.first);
-        maxY = std::max(maxY, c.second);
+MaskBuffer::MaskBuffer(int width, int height, std::uint8_t fill) : m_width(width), m_height(height) {
+    checkedPixelCount(width, height, "MaskBuffer");
+    m_coverage = std::make_shared<PlaneStore<std::uint8_t>>(width, height, solidPlane(fill));
+}
+
+MaskBuffer::MaskBuffer(int width, int height, std::shared_ptr<const PixelSource> source)
+    : m_width(width), m_height(height) {
+    checkedPixelCount(width, height, "MaskBuffer");
+    if (!source) {
+        throw std::invalid_argument("MaskBuffer pixel source must not be null");
     }
+    m_coverage = std::make_shared<PlaneStore<std::uint8_t>>(width, height, std::move(source));
+}
 
-    int startX = static_cast<int>(std::floor(minX));
-    int startY = static_cast<int>(std::floor(minY));
-    int endX = static_cast<int>(std::ceil(maxX));
-    int endY = static_cast<int>(std::ceil(maxY));
+MaskBuffer::MaskBuffer(int width, int height, const PixelRGBA8& fill)
+    : MaskBuffer(width, height, coverageFromPixel(fill)) {}
 
-    startX = std::max(startX, 0);
-    startY = std::max(startY, 0);
-    endX = std::min(endX, out.width());
-    endY = std::min(endY, out.height());
+std::uint8_t MaskBuffer::coverageFromPixel(const PixelRGBA8& pixel) {
+    const int luma = static_cast<int>(pixel.r) + static_cast<int>(pixel.g) + static_cast<int>(pixel.b);
+    return static_cast<std::uint8_t>((luma * static_cast<int>(pixel.a) + 382) / 765);
+}
 
-    for (int dy = startY; dy < endY; ++dy) {
-        for (int dx = startX; dx < endX; ++dx) {
-            const auto srcPos = transform.applyInverse(static_cast<double>(dx) + 0.5, static_cast<double>(dy) + 0.5);
-            const int sx = static_cast<int>(std::floor(srcPos.first));
-            const int sy = static_cast<int>(std::floor(srcPos.second));
-            if (!layer.image().inBounds(sx, sy)) {
-                continue;
-            }
+MaskBuffer MaskBuffer::fromImage(const ImageBuffer& image) {
+    MaskBuffer mask(image.width(), image.height(), static_cast<std::uint8_t>(0));
+    const ConstImageView source = image.view();
+    const CoverageView target = mask.view();
+    for (int y = 0; y < source.height(); ++y) {
+        const PixelRGBA8* src = source.row(y);
+        std::uint8_t* dst = target.row(y);
+        for (int x = 0; x < source.width(); ++x) {
+            dst[x] = coverageFromPixel(src[x]);
+        }
+    }
+    return mask;
+}
+
+int MaskBuffer::width() const {
+    return m_width;
+}
 
-            const PixelRGBA8& src = layer.image().getPixel(sx, sy);
-            PixelRGBA8 dst = out.getPixel(dx, dy);
+int MaskBuffer::height() const {
+    return m_height;
+}
 
-            float opacityScale = layer.opacity();
-            if (layer.hasMask()) {
-                opacityScale *= maskWeight(layer.mask().getPixel(sx, sy));
-            }
+bool MaskBuffer::inBounds(int x, int y) const {
+    return x >= 0 && x < m_width && y >= 0 && y < m_height;
+}
 
-            compositePixel(dst, src, layer.blendMode(), opacityScale);
-            out.setPixel(dx, dy, dst);
-        }
+std::uint8_t MaskBuffer::coverage(int x, int y) const {
+    if (!inBounds(x, y)) {
+        throw std::out_of_range("MaskBuffer pixel out of bounds");
     }
+    return m_coverage->values()[pixelIndex(x, y, m_width)];
 }
 
-void compositeBufferOnto(ImageBuffer& out, const ImageBuffer& src, BlendMode mode, float opacity) {
-    for (int y = 0; y < out.height(); ++y) {
-        for (int x = 0; x < out.width(); ++x) {
-            const PixelRGBA8& p = src.getPixel(x, y);
-            PixelRGBA8 dst = out.getPixel(x, y);
-            compositePixel(dst, p, mode, opacity);
-            out.setPixel(x, y, dst);
-        }
+void MaskBuffer::setCoverage(int x, int y, std::uint8_t value) {
+    if (!inBounds(x, y)) {
+        throw std::out_of_range("MaskBuffer pixel out of bounds");
     }
+    detach();
+    m_coverage->values()[pixelIndex(x, y, m_width)] = value;
 }
 
-void compositeNodeOnto(ImageBuffer& out, const LayerNode& node, const Transform2D& parentTransform) {
-    if (node.isLayer()) {
-        compositeLayerOnto(out, node.asLayer(), parentTransform);
+PixelRGBA8 MaskBuffer::getPixel(int x, int y) const {
+    const std::uint8_t value = coverage(x, y);
+    return PixelRGBA8(value, value, value, 255);
+}
+
+void MaskBuffer::setPixel(int x, int y, const PixelRGBA8& pixel) {
+    setCoverage(x, y, coverageFromPixel(pixel));
+}
+
+void MaskBuffer::fill(std::uint8_t value) {
+    if (!m_coverage) {
         return;
     }
+    m_coverage = std::make_shared<PlaneStore<std::uint8_t>>(m_width, m_height, solidPlane(value));
+}
 
-    const LayerGroup& group = node.asGroup();
-    if (!group.visible() || group.opacity() <= 0.0f) {
-        return;
+const std::uint8_t* MaskBuffer::row(int y) const {
+    if (y < 0 || y >= m_height) {
+        throw std::out_of_range("MaskBuffer row out of bounds");
     }
+    return m_coverage->values().data() + pixelIndex(0, y, m_width);
+}
 
-    ImageBuffer groupSurface(out.width(), out.height(), PixelRGBA8(0, 0, 0, 0));
-    const Transform2D groupTransform = combineTransform(parentTransform, group.offsetX(), group.offsetY(), group.transform());
+CoverageView MaskBuffer::view() {
+    detach();
+    return CoverageView(m_coverage ? m_coverage->values().data() : nullptr, m_width, m_height, m_width);
+}
 
-    for (std::size_t i = 0; i < group.nodeCount(); ++i) {
-        compositeNodeOnto(groupSurface, group.node(i), groupTransform);
+ConstCoverageView MaskBuffer::view() const {
+    return ConstCoverageView(m_coverage ? m_coverage->values().data() : nullptr, m_width, m_height, m_width);
+}
+
+ImageBuffer MaskBuffer::toImage() const {
+    ImageBuffer image(m_width, m_height, PixelRGBA8(0, 0, 0, 255));
+    const ConstCoverageView source = view();
+    const ImageView target = image.view();
+    for (int y = 0; y < m_height; ++y) {
+        const std::uint8_t* src = source.row(y);
+        PixelRGBA8* dst = target.row(y);
+        for (int x = 0; x < m_width; ++x) {
+            dst[x] = PixelRGBA8(src[x], src[x], src[x], 255);
+        }
     }
+    return image;
+}
 
-    compositeBufferOnto(out, groupSurface, group.blendMode(), group.opacity());
+bool MaskBuffer::resident() const {
+    return !m_coverage || m_coverage->ready();
 }
-} // namespace
 
-ImageBuffer::ImageBuffer() : m_width(0), m_height(0) {}
+void MaskBuffer::makeResident() const {
+    if (m_coverage) {
+        m_coverage->values();
+    }
+}
 
-ImageBuffer::ImageBuffer(int width, int height, const PixelRGBA8& fill) : m_width(width), m_height(height) {
-    const std::size_t pixels = checkedPixelCount(width, height, "ImageBuffer");
-    m_pixels.assign(pixels, fill);
+const PixelSource* MaskBuffer::pixelSource() const {
+    return m_coverage ? m_coverage->source() : nullptr;
 }
 
-int ImageBuffer::width() const {
-    return m_width;
+bool MaskBuffer::releaseResident() const {
+    return m_coverage && m_coverage->release();
 }
 
-int ImageBuffer::height() const {
-    return m_height;
+bool MaskBuffer::spillResident(SpillFile& spill) const {
+    return m_coverage && m_coverage->spill(spill, m_width, m_height);
 }
 
-bool ImageBuffer::inBounds(int x, int y) const {
-    return x >= 0 && x < m_width && y >= 0 && y < m_height;
+std::size_t MaskBuffer::residentBytes() const {
+    return m_coverage ? m_coverage->residentBytes() : 0;
 }
 
-const PixelRGBA8& ImageBuffer::getPixel(int x, int y) const {
-    if (!inBounds(x, y)) {
-        throw std::out_of_range("ImageBuffer pixel out of bounds");
-    }
-    return m_pixels[pixelIndex(x, y, m_width)];
+bool MaskBuffer::sharesCoverageWith(const MaskBuffer& other) const {
+    return m_coverage && m_coverage == other.m_coverage;
 }
 
-bool ImageBuffer::trySetPixel(int x, int y, const PixelRGBA8& pixel) {
-    if (!inBounds(x, y)) {
+bool MaskBuffer::trySolidCoverage(std::uint8_t& value) const {
+    const SolidPlaneSource<std::uint8_t>* solid = m_coverage ? asSolidPlane<std::uint8_t>(m_coverage->source()) : nullptr;
+    if (!solid) {
         return false;
     }
-    m_pixels[pixelIndex(x, y, m_width)] = pixel;
+    value = solid->value();
     return true;
 }
 
-void ImageBuffer::setPixel(int x, int y, const PixelRGBA8& pixel) {
-    if (!trySetPixel(x, y, pixel)) {
-        throw std::out_of_range("ImageBuffer pixel out of bounds");
+void MaskBuffer::detach() {
+    if (!m_coverage) {
+        return;
+    }
+    if (m_coverage.use_count() > 1) {
+        m_coverage = std::make_shared<PlaneStore<std::uint8_t>>(m_coverage->values());
+        return;
     }
+    m_coverage->writableValues();
 }
 
-void ImageBuffer::fill(const PixelRGBA8& pixel) {
-    std::fill(m_pixels.begin(), m_pixels.end(), pixel);
+namespace {
+// 2x2 box average; an odd last row or column averages with itself. Colors
+// are weighted by alpha like the compositor's own blending.
+ImageBuffer halveImage(const ImageBuffer& image, int threads) {
+    const int width = (image.width() + 1) / 2;
+    const int height = (image.height() + 1) / 2;
+    ImageBuffer out(width, height);
+    const ConstImageView source = image.view();
+    PixelRGBA8* pixels = out.data();
+    parallelFor(height, threads, [&](int y) {
+        const PixelRGBA8* upper = source.row(2 * y);
+        const PixelRGBA8* lower = source.row(std::min(2 * y + 1, image.height() - 1));
+        PixelRGBA8* dst = pixels + pixelIndex(0, y, width);
+        for (int x = 0; x < width; ++x) {
+            const int left = 2 * x;
+            const int right = std::min(left + 1, image.width() - 1);
+            const PixelRGBA8 p[4] = {upper[left], upper[right], lower[left], lower[right]};
+            const int alpha = p[0].a + p[1].a + p[2].a + p[3].a;
+            if (alpha == 4 * 255) {
+                dst[x] = PixelRGBA8(static_cast<std::uint8_t>((p[0].r + p[1].r + p[2].r + p[3].r + 2) >> 2),
+                                    static_cast<std::uint8_t>((p[0].g + p[1].g + p[2].g + p[3].g + 2) >> 2),
+                                    static_cast<std::uint8_t>((p[0].b + p[1].b + p[2].b + p[3].b + 2) >> 2), 255);
+                continue;
+            }
+            if (alpha == 0) {
+                dst[x] = PixelRGBA8(0, 0, 0, 0);
+                continue;
+            }
+            int r = 0;
+            int g = 0;
+            int b = 0;
+            for (const PixelRGBA8& q : p) {
+                r += q.r * q.a;
+                g += q.g * q.a;
+                b += q.b * q.a;
+            }
+            dst[x] = PixelRGBA8(static_cast<std::uint8_t>((r + alpha / 2) / alpha), static_cast<std::uint8_t>((g + alpha / 2) / alpha),
+                                static_cast<std::uint8_t>((b + alpha / 2) / alpha), static_cast<std::uint8_t>((alpha + 2) >> 2));
+        }
+    });
+    return out;
+}
+
+MaskBuffer halveMask(const MaskBuffer& mask, int threads) {
+    const int width = (mask.width() + 1) / 2;
+    const int height = (mask.height() + 1) / 2;
+    MaskBuffer out(width, height, static_cast<std::uint8_t>(0));
+    const ConstCoverageView source = mask.view();
+    const CoverageView target = out.view();
+    parallelFor(height, threads, [&](int y) {
+        const std::uint8_t* upper = source.row(2 * y);
+        const std::uint8_t* lower = source.row(std::min(2 * y + 1, mask.height() - 1));
+        std::uint8_t* dst = target.row(y);
+        for (int x = 0; x < width; ++x) {
+            const int left = 2 * x;
+            const int right = std::min(left + 1, mask.width() - 1);
+            dst[x] = static_cast<std::uint8_t>((upper[left] + upper[right] + lower[left] + lower[right] + 2) >> 2);
+        }
+    });
+    return out;
+}
+
+MipCache::Level halveLevel(const ImageBuffer& image, const MaskBuffer* mask, int threads) {
+    MipCache::Level level;
+    PixelRGBA8 color;
+    level.image = image.trySolidColor(color) ? ImageBuffer((image.width() + 1) / 2, (image.height() + 1) / 2, color)
+                                             : halveImage(image, threads);
+    std::uint8_t value = 0;
+    if (mask && mask->trySolidCoverage(value)) {
+        level.mask = MaskBuffer((mask->width() + 1) / 2, (mask->height() + 1) / 2, value);
+    } else if (mask) {
+        level.mask = halveMask(*mask, threads);
+    }
+    return level;
+}
+} // namespace
+
+// Levels are only appended while the revision holds, so references handed
+// out stay valid for the rest of a composite.
+struct MipCache::State {
+    std::mutex mutex;
+    std::uint64_t revision = 0;
+    std::deque<Level> levels;
+};
+
+MipCache::MipCache() : m_state(std::make_unique<State>()) {}
+
+MipCache::MipCache(const MipCache&) : m_state(std::make_unique<State>()) {}
+
+MipCache::MipCache(MipCache&& other) noexcept = default;
+
+MipCache& MipCache::operator=(const MipCache& other) {
+    if (this != &other) {
+        m_state = std::make_unique<State>();
+    }
+    return *this;
+}
+
+MipCache& MipCache::operator=(MipCache&& other) noexcept {
+    m_state.swap(other.m_state);
+    return *this;
+}
+
+MipCache::~MipCache() = default;
+
+std::size_t MipCache::residentBytes() const {
+    if (!m_state) {
+        return 0;
+    }
+    const std::lock_guard<std::mutex> lock(m_state->mutex);
+    std::size_t bytes = 0;
+    for (const Level& level : m_state->levels) {
+        bytes += level.image.residentBytes() + level.mask.residentBytes();
+    }
+    return bytes;
+}
+
+void MipCache::clear() const {
+    if (!m_state) {
+        return;
+    }
+    const std::lock_guard<std::mutex> lock(m_state->mutex);
+    m_state->levels.clear();
+    m_state->revision = 0;
+}
+
+const MipCache::Level& MipCache::level(const ImageBuffer& image, const MaskBuffer* mask, std::uint64_t revision, int index,
+                                       int threads) const {
+    if (index < 1) {
+        throw std::invalid_argument("Mip levels start at 1");
+    }
+    if (!m_state) {
+        throw std::logic_error("Mip cache was moved from");
+    }
+    const std::lock_guard<std::mutex> lock(m_state->mutex);
+    std::deque<Level>& levels = m_state->levels;
+    if (m_state->revision != revision) {
+        levels.clear();
+        m_state->revision = revision;
+    }
+    while (static_cast<int>(levels.size()) < index) {
+        const bool first = levels.empty();
+        const MaskBuffer* above = mask && !first ? &levels.back().mask : mask;
+        levels.push_back(halveLevel(first ? image : levels.back().image, above, threads));
+    }
+    return levels[static_cast<std::size_t>(index - 1)];
 }
 
 Layer::Layer()
-    : m_name("Layer"),
+    : m_revision(nextRevisionStamp()),
+      m_pixelRevision(m_revision),
+      m_name("Layer"),
       m_visible(true),
       m_opacity(1.0f),
       m_blendMode(BlendMode::Normal),
@@ -291,7 +1917,9 @@ Layer::Layer()
       m_hasMask(false) {}
 
 Layer::Layer(const std::string& name, int width, int height, const PixelRGBA8& fill)
-    : m_name(name),
+    : m_revision(nextRevisionStamp()),
+      m_pixelRevision(m_revision),
+      m_name(name),
       m_visible(true),
       m_opacity(1.0f),
       m_blendMode(BlendMode::Normal),
@@ -313,6 +1941,7 @@ bool Layer::visible() const {
 }
 
 void Layer::setVisible(bool visible) {
+    touchProperties();
     m_visible = visible;
 }
 
@@ -321,6 +1950,7 @@ float Layer::opacity() const {
 }
 
 void Layer::setOpacity(float opacity) {
+    touchProperties();
     m_opacity = clamp01(opacity);
 }
 
@@ -329,6 +1959,7 @@ BlendMode Layer::blendMode() const {
 }
 
 void Layer::setBlendMode(BlendMode mode) {
+    touchProperties();
     m_blendMode = mode;
 }
 
@@ -341,6 +1972,7 @@ int Layer::offsetY() const {
 }
 
 void Layer::setOffset(int x, int y) {
+    touchProperties();
     m_offsetX = x;
     m_offsetY = y;
 }
@@ -349,27 +1981,39 @@ bool Layer::hasMask() const {
     return m_hasMask;
 }
 
-ImageBuffer& Layer::ensureMask(const PixelRGBA8& fill) {
+MaskBuffer& Layer::ensureMask(const PixelRGBA8& fill) {
+    touch();
     if (!m_hasMask) {
-        m_mask = ImageBuffer(m_image.width(), m_image.height(), fill);
+        m_mask = MaskBuffer(m_image.width(), m_image.height(), fill);
         m_hasMask = true;
     }
     return m_mask;
 }
 
 void Layer::enableMask(const PixelRGBA8& fill) {
-    m_mask = ImageBuffer(m_image.width(), m_image.height(), fill);
+    touch();
+    m_mask = MaskBuffer(m_image.width(), m_image.height(), fill);
+    m_hasMask = true;
+}
+
+void Layer::setMask(MaskBuffer mask) {
+    if (mask.width() != m_image.width() || mask.height() != m_image.height()) {
+        throw std::invalid_argument("Layer mask dimensions must match layer image");
+    }
+    touch();
+    m_mask = std::move(mask);
     m_hasMask = true;
 }
 
-ImageBuffer& Layer::maskOrThrow() {
+MaskBuffer& Layer::maskOrThrow() {
+    touch();
     if (!m_hasMask) {
         throw std::logic_error("Layer mask is not enabled");
     }
     return m_mask;
 }
 
-const ImageBuffer& Layer::maskOrThrow() const {
+const MaskBuffer& Layer::maskOrThrow() const {
     if (!m_hasMask) {
         throw std::logic_error("Layer mask is not enabled");
     }
@@ -377,19 +2021,21 @@ const ImageBuffer& Layer::maskOrThrow() const {
 }
 
 void Layer::clearMask() {
-    m_mask = ImageBuffer();
+    touch();
+    m_mask = MaskBuffer();
     m_hasMask = false;
 }
 
-ImageBuffer& Layer::mask() {
+MaskBuffer& Layer::mask() {
     return maskOrThrow();
 }
 
-const ImageBuffer& Layer::mask() const {
+const MaskBuffer& Layer::mask() const {
     return maskOrThrow();
 }
 
 ImageBuffer& Layer::image() {
+    touch();
     return m_image;
 }
 
@@ -397,31 +2043,104 @@ const ImageBuffer& Layer::image() const {
     return m_image;
 }
 
-LayerNode::LayerNode(const Layer& layer) : m_kind(Kind::Layer), m_layer(layer) {}
+ImageBuffer& Layer::imageInRect(int x, int y, int width, int height) {
+    touchRect(x, y, width, height);
+    return m_image;
+}
+
+MaskBuffer& Layer::maskInRect(int x, int y, int width, int height) {
+    if (!m_hasMask) {
+        throw std::logic_error("Layer mask is not enabled");
+    }
+    touchRect(x, y, width, height);
+    return m_mask;
+}
+
+std::uint64_t Layer::revision() const {
+    return m_revision;
+}
+
+const MipCache::Level& Layer::mipLevel(int index, int threads) const {
+    return m_mips.level(m_image, m_hasMask ? &m_mask : nullptr, m_pixelRevision, index, threads);
+}
+
+const MipCache& Layer::mipCache() const {
+    return m_mips;
+}
+
+bool Layer::changedRect(std::uint64_t& since, int& x0, int& y0, int& x1, int& y1) const {
+    if (m_rectRevision != m_revision) {
+        return false;
+    }
+    since = m_rectBase;
+    x0 = m_rectX0;
+    y0 = m_rectY0;
+    x1 = m_rectX1;
+    y1 = m_rectY1;
+    return true;
+}
+
+void Layer::transformWillChange() {
+    touchProperties();
+}
+
+void Layer::touch() {
+    m_revision = nextRevisionStamp();
+    m_pixelRevision = m_revision;
+}
+
+void Layer::touchProperties() {
+    m_revision = nextRevisionStamp();
+}
+
+void Layer::touchRect(int x, int y, int width, int height) {
+    const int x1 = x + std::max(0, width);
+    const int y1 = y + std::max(0, height);
+    if (m_rectRevision == m_revision) {
+        m_rectX0 = std::min(m_rectX0, x);
+        m_rectY0 = std::min(m_rectY0, y);
+        m_rectX1 = std::max(m_rectX1, x1);
+        m_rectY1 = std::max(m_rectY1, y1);
+    } else {
+        m_rectBase = m_revision;
+        m_rectX0 = x;
+        m_rectY0 = y;
+        m_rectX1 = x1;
+        m_rectY1 = y1;
+    }
+    m_revision = nextRevisionStamp();
+    m_pixelRevision = m_revision;
+    m_rectRevision = m_revision;
+}
+
+LayerNode::LayerNode(const Layer& layer) : m_node(std::in_place_type<Layer>, layer) {}
 
-LayerNode::LayerNode(const LayerGroup& group)
-    : m_kind(Kind::Group),
-      m_group(std::make_unique<LayerGroup>(group)) {}
+LayerNode::LayerNode(Layer&& layer) : m_node(std::in_place_type<Layer>, std::move(layer)) {}
 
-LayerNode::LayerNode(const LayerNode& other) : m_kind(other.m_kind), m_layer(other.m_layer) {
-    if (other.m_group) {
-        m_group = std::make_unique<LayerGroup>(*other.m_group);
+LayerNode::LayerNode(const LayerGroup& group) : m_node(std::make_unique<LayerGroup>(group)) {}
+
+LayerNode::LayerNode(LayerGroup&& group) : m_node(std::make_unique<LayerGroup>(std::move(group))) {}
+
+LayerNode::LayerNode(std::unique_ptr<LayerGroup> group) : m_node(std::move(group)) {
+    if (!std::get<std::unique_ptr<LayerGroup>>(m_node)) {
+        throw std::invalid_argument("LayerNode group must not be null");
     }
 }
 
+LayerNode::LayerNode(const LayerNode& other)
+    : m_node(other.isLayer() ? decltype(m_node)(std::in_place_type<Layer>, std::get<Layer>(other.m_node))
+                             : decltype(m_node)(std::make_unique<LayerGroup>(other.asGroup()))) {}
+
 LayerNode& LayerNode::operator=(const LayerNode& other) {
     if (this == &other) {
         return *this;
     }
 
-    m_kind = other.m_kind;
-    m_layer = other.m_layer;
-    if (other.m_group) {
-        m_group = std::make_unique<LayerGroup>(*other.m_group);
+    if (other.isLayer()) {
+        m_node = std::get<Layer>(other.m_node);
     } else {
-        m_group.reset();
+        m_node = std::make_unique<LayerGroup>(other.asGroup());
     }
-
     return *this;
 }
 
@@ -432,47 +2151,48 @@ LayerNode& LayerNode::operator=(LayerNode&& other) noexcept = default;
 LayerNode::~LayerNode() = default;
 
 LayerNode::Kind LayerNode::kind() const {
-    return m_kind;
+    return isLayer() ? Kind::Layer : Kind::Group;
 }
 
 bool LayerNode::isLayer() const {
-    return m_kind == Kind::Layer;
+    return std::holds_alternative<Layer>(m_node);
 }
 
 bool LayerNode::isGroup() const {
-    return m_kind == Kind::Group;
+    return !isLayer();
 }
 
 Layer& LayerNode::asLayer() {
     if (!isLayer()) {
         throw std::logic_error("LayerNode is not a layer");
     }
-    return m_layer;
+    return std::get<Layer>(m_node);
 }
 
 const Layer& LayerNode::asLayer() const {
     if (!isLayer()) {
         throw std::logic_error("LayerNode is not a layer");
     }
-    return m_layer;
+    return std::get<Layer>(m_node);
 }
 
 LayerGroup& LayerNode::asGroup() {
-    if (!isGroup() || !m_group) {
+    if (!isGroup()) {
         throw std::logic_error("LayerNode is not a group");
     }
-    return *m_group;
+    return *std::get<std::unique_ptr<LayerGroup>>(m_node);
 }
 
 const LayerGroup& LayerNode::asGroup() const {
-    if (!isGroup() || !m_group) {
+    if (!isGroup()) {
         throw std::logic_error("LayerNode is not a group");
     }
-    return *m_group;
+    return *std::get<std::unique_ptr<LayerGroup>>(m_node);
 }
 
 LayerGroup::LayerGroup()
-    : m_name("Group"),
+    : m_revision(nextRevisionStamp()),
+      m_name("Group"),
       m_visible(true),
       m_opacity(1.0f),
       m_blendMode(BlendMode::Normal),
@@ -480,7 +2200,8 @@ LayerGroup::LayerGroup()
       m_offsetY(0) {}
 
 LayerGroup::LayerGroup(const std::string& name)
-    : m_name(name),
+    : m_revision(nextRevisionStamp()),
+      m_name(name),
       m_visible(true),
       m_opacity(1.0f),
       m_blendMode(BlendMode::Normal),
@@ -500,6 +2221,7 @@ bool LayerGroup::visible() const {
 }
 
 void LayerGroup::setVisible(bool visible) {
+    touch();
     m_visible = visible;
 }
 
@@ -508,6 +2230,7 @@ float LayerGroup::opacity() const {
 }
 
 void LayerGroup::setOpacity(float opacity) {
+    touch();
     m_opacity = clamp01(opacity);
 }
 
@@ -516,6 +2239,7 @@ BlendMode LayerGroup::blendMode() const {
 }
 
 void LayerGroup::setBlendMode(BlendMode mode) {
+    touch();
     m_blendMode = mode;
 }
 
@@ -528,24 +2252,51 @@ int LayerGroup::offsetY() const {
 }
 
 void LayerGroup::setOffset(int x, int y) {
+    touch();
     m_offsetX = x;
     m_offsetY = y;
 }
 
 Layer& LayerGroup::addLayer(const Layer& layer) {
+    touch();
     m_nodes.emplace_back(layer);
     return m_nodes.back().asLayer();
 }
 
+Layer& LayerGroup::addLayer(Layer&& layer) {
+    touch();
+    m_nodes.emplace_back(std::move(layer));
+    return m_nodes.back().asLayer();
+}
+
 LayerGroup& LayerGroup::addGroup(const LayerGroup& group) {
+    touch();
     m_nodes.emplace_back(group);
     return m_nodes.back().asGroup();
 }
 
+LayerGroup& LayerGroup::addGroup(LayerGroup&& group) {
+    touch();
+    m_nodes.emplace_back(std::move(group));
+    return m_nodes.back().asGroup();
+}
+
 std::size_t LayerGroup::nodeCount() const {
     return m_nodes.size();
 }
 
+std::uint64_t LayerGroup::revision() const {
+    return m_revision;
+}
+
+void LayerGroup::transformWillChange() {
+    touch();
+}
+
+void LayerGroup::touch() {
+    m_revision = nextRevisionStamp();
+}
+
 LayerNode& LayerGroup::node(std::size_t index) {
     return m_nodes.at(index);
 }
@@ -610,10 +2361,18 @@ Layer& Document::addLayer(const Layer& layer) {
     return m_root.addLayer(layer);
 }
 
+Layer& Document::addLayer(Layer&& layer) {
+    return m_root.addLayer(std::move(layer));
+}
+
 LayerGroup& Document::addGroup(const LayerGroup& group) {
     return m_root.addGroup(group);
 }
 
+LayerGroup& Document::addGroup(LayerGroup&& group) {
+    return m_root.addGroup(std::move(group));
+}
+
 std::size_t Document::nodeCount() const {
     return m_root.nodeCount();
 }
@@ -647,13 +2406,205 @@ const LayerGroup& Document::rootGroup() const {
 }
 
 ImageBuffer Document::composite() const {
-    ImageBuffer out(m_width, m_height, PixelRGBA8(0, 0, 0, 0));
+    return composite(CompositeOptions());
+}
+
+ImageBuffer Document::composite(const CompositeOptions& options) const {
+    checkCompositeScale(options.scale);
+    const int width = scaledExtent(m_width, options.scale);
+    const int height = scaledExtent(m_height, options.scale);
+    ImageBuffer out(width, height, PixelRGBA8(0, 0, 0, 0));
+    const int tileSize = std::max(1, options.tileSize);
+    const TileGrid grid{width, height, tileSize};
+    std::vector<int> tiles(static_cast<std::size_t>(grid.count()));
+    for (int i = 0; i < grid.count(); ++i) {
+        tiles[static_cast<std::size_t>(i)] = i;
+    }
+    compositeTiles(m_root, rootTransform(m_width, m_height, options.scale), grid, tiles, options.threads, out);
+    return out;
+}
 
-    for (std::size_t i = 0; i < m_root.nodeCount(); ++i) {
-        compositeNodeOnto(out, m_root.node(i), Transform2D::identity());
+ImageBuffer Document::composite(const CompositeOptions& options, CompositeCache& cache) const {
+    checkCompositeScale(options.scale);
+    const int width = scaledExtent(m_width, options.scale);
+    const int height = scaledExtent(m_height, options.scale);
+    const int tileSize = std::max(1, options.tileSize);
+    const TileGrid grid{width, height, tileSize};
+    const Transform2D transform = rootTransform(m_width, m_height, options.scale);
+
+    std::vector<CompositeCache::NodeStamp> stamps;
+    collectStamps(m_root, transform, stamps);
+
+    std::vector<PixelRect> dirty;
+    bool full = !cache.m_valid || cache.m_width != width || cache.m_height != height || cache.m_scale != options.scale ||
+                cache.m_tileSize != tileSize || cache.m_stamps.size() != stamps.size();
+    for (std::size_t i = 0; !full && i < stamps.size(); ++i) {
+        const CompositeCache::NodeStamp& before = cache.m_stamps[i];
+        const CompositeCache::NodeStamp& after = stamps[i];
+        if (before.group != after.group || before.childCount != after.childCount) {
+            full = true;
+            break;
+        }
+        const PixelRect beforeRect{before.x0, before.y0, before.x1, before.y1};
+        const PixelRect afterRect{after.x0, after.y0, after.x1, after.y1};
+        if (before.revision != after.revision && sameRect(beforeRect, afterRect) && after.rectBase != 0 &&
+            before.revision >= after.rectBase) {
+            dirty.push_back(intersectRects(afterRect, PixelRect{after.rectX0, after.rectY0, after.rectX1, after.rectY1}));
+        } else if (before.revision != after.revision || !sameRect(beforeRect, afterRect)) {
+            dirty.push_back(beforeRect);
+            dirty.push_back(afterRect);
+        }
     }
 
-    return out;
+    std::vector<int> tiles;
+    if (full) {
+        cache.m_output = ImageBuffer(width, height, PixelRGBA8(0, 0, 0, 0));
+        for (int i = 0; i < grid.count(); ++i) {
+            tiles.push_back(i);
+        }
+    } else {
+        for (int i = 0; i < grid.count(); ++i) {
+            const PixelRect tile = grid.tile(i);
+            for (const PixelRect& rect : dirty) {
+                if (!intersectRects(tile, rect).empty()) {
+                    tiles.push_back(i);
+                    break;
+                }
+            }
+        }
+    }
+
+    compositeTiles(m_root, transform, grid, tiles, options.threads, cache.m_output);
+
+    cache.m_valid = true;
+    cache.m_width = width;
+    cache.m_height = height;
+    cache.m_scale = options.scale;
+    cache.m_tileSize = tileSize;
+    cache.m_lastTiles = tiles.size();
+    cache.m_stamps = std::move(stamps);
+    return cache.m_output;
+}
+
+void Document::compositeRows(const CompositeOptions& options,
+                             const std::function<void(int y, const ConstImageView& rows)>& sink) const {
+    checkCompositeScale(options.scale);
+    const int width = scaledExtent(m_width, options.scale);
+    const int height = scaledExtent(m_height, options.scale);
+    const int tileSize = std::max(1, options.tileSize);
+    const TileGrid grid{width, height, tileSize};
+    const Transform2D transform = rootTransform(m_width, m_height, options.scale);
+    const int columns = grid.columns();
+    ImageBuffer band(width, std::min(tileSize, height));
+    ResidencyBudget residency(options.memoryBudget);
+    std::vector<int> tiles(static_cast<std::size_t>(columns));
+    for (int y = 0, bandIndex = 0; y < height; y += tileSize, ++bandIndex) {
+        const int rows = std::min(tileSize, height - y);
+        std::vector<const Layer*> layers;
+        collectLayersIn(m_root, transform, PixelRect{0, y, width, y + rows}, layers);
+        residency.acquire(layers, bandIndex, options.threads);
+        for (int c = 0; c < columns; ++c) {
+            tiles[static_cast<std::size_t>(c)] = bandIndex * columns + c;
+        }
+        compositeTiles(m_root, transform, grid, tiles, options.threads, band, y);
+        sink(y, static_cast<const ImageBuffer&>(band).view(0, 0, width, rows));
+    }
+}
+
+CompositeCache::CompositeCache() : m_valid(false), m_width(0), m_height(0), m_scale(1.0), m_tileSize(0), m_lastTiles(0) {}
+
+void CompositeCache::invalidate() {
+    m_valid = false;
+    m_stamps.clear();
+}
+
+std::size_t CompositeCache::lastTilesComposited() const {
+    return m_lastTiles;
+}
+
+namespace {
+void collectAllLayers(const LayerGroup& group, std::vector<const Layer*>& layers) {
+    for (std::size_t i = 0; i < group.nodeCount(); ++i) {
+        const LayerNode& node = group.node(i);
+        if (node.isLayer()) {
+            layers.push_back(&node.asLayer());
+        } else {
+            collectAllLayers(node.asGroup(), layers);
+        }
+    }
+}
+} // namespace
+
+int scaledExtent(int size, double scale) {
+    return std::max(1, static_cast<int>(std::lround(size * scale)));
+}
+
+MemoryUsage layerMemoryUsage(const Layer& layer) {
+    MemoryUsage usage;
+    usage.full = static_cast<std::size_t>(layer.image().width()) * static_cast<std::size_t>(layer.image().height()) * sizeof(PixelRGBA8);
+    usage.pixels = layer.image().residentBytes();
+    if (layer.hasMask()) {
+        usage.full += static_cast<std::size_t>(layer.mask().width()) * static_cast<std::size_t>(layer.mask().height());
+        usage.masks = layer.mask().residentBytes();
+    }
+    usage.mips = layer.mipCache().residentBytes();
+    return usage;
+}
+
+MemoryUsage documentMemoryUsage(const Document& document) {
+    std::vector<const Layer*> layers;
+    collectAllLayers(document.rootGroup(), layers);
+    MemoryUsage usage;
+    for (std::size_t i = 0; i < layers.size(); ++i) {
+        const Layer& layer = *layers[i];
+        const MemoryUsage own = layerMemoryUsage(layer);
+        bool sharedImage = false;
+        bool sharedMask = false;
+        for (std::size_t j = 0; j < i; ++j) {
+            sharedImage = sharedImage || layer.image().sharesPixelsWith(layers[j]->image());
+            sharedMask = sharedMask || (layer.hasMask() && layers[j]->hasMask() && layer.mask().sharesCoverageWith(layers[j]->mask()));
+        }
+        const std::size_t imageFull =
+            static_cast<std::size_t>(layer.image().width()) * static_cast<std::size_t>(layer.image().height()) * sizeof(PixelRGBA8);
+        usage.full += own.full - (sharedImage ? imageFull : 0) - (sharedMask ? own.full - imageFull : 0);
+        usage.pixels += sharedImage ? 0 : own.pixels;
+        usage.masks += sharedMask ? 0 : own.masks;
+        usage.mips += own.mips;
+    }
+    return usage;
+}
+
+std::size_t enforceMemoryBudget(const Document& document, std::size_t budget, SpillFile& spill,
+                                const std::vector<const Layer*>& keep) {
+    std::size_t used = documentMemoryUsage(document).resident();
+    if (budget == 0 || used <= budget) {
+        return 0;
+    }
+    std::vector<const Layer*> layers;
+    collectAllLayers(document.rootGroup(), layers);
+    layers.erase(std::remove_if(layers.begin(), layers.end(),
+                                [&](const Layer* layer) { return std::find(keep.begin(), keep.end(), layer) != keep.end(); }),
+                 layers.end());
+    std::stable_sort(layers.begin(), layers.end(), [](const Layer* a, const Layer* b) { return a->revision() < b->revision(); });
+    std::size_t freed = 0;
+    for (const Layer* layer : layers) {
+        if (used <= budget) {
+            break;
+        }
+        const std::size_t before = layerMemoryUsage(*layer).resident();
+        if (before == 0) {
+            continue;
+        }
+        layer->image().spillResident(spill);
+        if (layer->hasMask()) {
+            layer->mask().spillResident(spill);
+        }
+        layer->mipCache().clear();
+        const std::size_t gone = before - std::min(before, layerMemoryUsage(*layer).resident());
+        freed += gone;
+        used -= std::min(used, gone);
+    }
+    return freed;
 }
 
 ImageBuffer fromRasterImage(const RasterImage& source, std::uint8_t alpha) {
@@ -680,15 +2631,32 @@ void copyToRasterImage(const ImageBuffer& source, RasterImage& destination) {
     }
 }
 
+PixelRows pixelRows(const ImageBuffer& image) {
+    return pixelRows(image.view());
+}
+
+PixelRows pixelRows(const ConstImageView& view) {
+    static_assert(sizeof(PixelRGBA8) == 4, "PixelRGBA8 must be packed RGBA8");
+    return {reinterpret_cast<const std::uint8_t*>(view.row(0)), view.width(), view.height(), 4,
+            static_cast<std::size_t>(view.stride()) * sizeof(PixelRGBA8)};
+}
+
 void Layer::setImageFromRaster(const RasterImage& source, std::uint8_t alpha) {
-    m_image = fromRasterImage(source, alpha);
+    setImage(fromRasterImage(source, alpha));
+}
+
+void Layer::setImage(ImageBuffer image) {
+    touch();
+    m_image = std::move(image);
     m_hasMask = false;
-    m_mask = ImageBuffer();
+    m_mask = MaskBuffer();
 }
 
 namespace {
 constexpr char kIFLOWMagic[8] = {'I', 'F', 'L', 'O', 'W', '0', '1', '\0'};
-constexpr std::uint32_t kIFLOWVersion = 2;
+constexpr std::uint32_t kIFLOWVersion = 7;
+constexpr std::size_t kIFLOWChunkBytes = 1u << 18;
+constexpr std::size_t kIFLOWDeflateSampleBytes = 1u << 14;
 
 template <typename T>
 void writeBinary(std::ostream& out, const T& value) {
@@ -744,47 +2712,676 @@ std::string readString(std::istream& in) {
     return value;
 }
 
-void writeImageBuffer(std::ostream& out, const ImageBuffer& image) {
-    writeBinary(out, static_cast<std::int32_t>(image.width()));
-    writeBinary(out, static_cast<std::int32_t>(image.height()));
+static_assert(sizeof(PixelRGBA8) == 4, "IFLOW pixel I/O expects packed RGBA8");
 
-    for (int y = 0; y < image.height(); ++y) {
-        for (int x = 0; x < image.width(); ++x) {
-            const PixelRGBA8& p = image.getPixel(x, y);
-            out.put(static_cast<char>(p.r));
-            out.put(static_cast<char>(p.g));
-            out.put(static_cast<char>(p.b));
-            out.put(static_cast<char>(p.a));
-        }
-    }
+ImageBuffer readImageBuffer(std::istream& in) {
+    const std::int32_t width = readBinary<std::int32_t>(in);
+    const std::int32_t height = readBinary<std::int32_t>(in);
+    checkedPixelCount(width, height, "IFLOW image");
 
-    if (!out.good()) {
-        throw std::runtime_error("Failed writing IFLOW image buffer");
+    ImageBuffer image(width, height, PixelRGBA8(0, 0, 0, 0));
+    const ImageView pixels = image.view();
+    for (int y = 0; y < height; ++y) {
+        in.read(reinterpret_cast<char*>(pixels.row(y)), static_cast<std::streamsize>(width) * 4);
+        if (!in.good()) {
+            throw std::runtime_error("Failed reading IFLOW image pixels");
+        }
     }
+    return image;
 }
 
-ImageBuffer readImageBuffer(std::istream& in) {
+MaskBuffer readMaskBuffer(std::istream& in) {
     const std::int32_t width = readBinary<std::int32_t>(in);
     const std::int32_t height = readBinary<std::int32_t>(in);
-    checkedPixelCount(width, height, "IFLOW image");
+    checkedPixelCount(width, height, "IFLOW mask");
 
-    ImageBuffer image(width, height, PixelRGBA8(0, 0, 0, 0));
+    MaskBuffer mask(width, height, static_cast<std::uint8_t>(0));
+    const CoverageView coverage = mask.view();
     for (int y = 0; y < height; ++y) {
-        for (int x = 0; x < width; ++x) {
-            const auto r = static_cast<std::uint8_t>(in.get());
-            const auto g = static_cast<std::uint8_t>(in.get());
-            const auto b = static_cast<std::uint8_t>(in.get());
-            const auto a = static_cast<std::uint8_t>(in.get());
-            if (!in.good()) {
-                throw std::runtime_error("Failed reading IFLOW image pixels");
+        in.read(reinterpret_cast<char*>(coverage.row(y)), width);
+        if (!in.good()) {
+            throw std::runtime_error("Failed reading IFLOW mask coverage");
+        }
+    }
+    return mask;
+}
+
+int planeChunkRows(int width, int channels) {
+    const std::size_t rowBytes = static_cast<std::size_t>(std::max(1, width)) * static_cast<std::size_t>(channels);
+    return static_cast<int>(std::max<std::size_t>(1, std::min<std::size_t>(kIFLOWChunkBytes / rowBytes, 1u << 20)));
+}
+
+// Chunks are stored channel-planar with each row delta-coded from its left
+// neighbour, which turns flat and gradient regions into long zero runs.
+std::vector<std::uint8_t> splitPlaneBand(const std::uint8_t* pixels, int width, int rows, int channels) {
+    std::vector<std::uint8_t> raw(static_cast<std::size_t>(width) * static_cast<std::size_t>(rows) * static_cast<std::size_t>(channels));
+    std::size_t o = 0;
+    for (int c = 0; c < channels; ++c) {
+        for (int y = 0; y < rows; ++y) {
+            const std::uint8_t* src = pixels + static_cast<std::size_t>(y) * static_cast<std::size_t>(width) * static_cast<std::size_t>(channels) + c;
+            std::uint8_t previous = 0;
+            for (int x = 0; x < width; ++x) {
+                const std::uint8_t v = src[static_cast<std::size_t>(x) * static_cast<std::size_t>(channels)];
+                raw[o++] = static_cast<std::uint8_t>(v - previous);
+                previous = v;
             }
-            image.setPixel(x, y, PixelRGBA8(r, g, b, a));
         }
     }
-    return image;
+    return raw;
+}
+
+void mergePlaneBand(const std::vector<std::uint8_t>& raw, std::uint8_t* pixels, int width, int rows, int channels) {
+    std::size_t i = 0;
+    for (int c = 0; c < channels; ++c) {
+        for (int y = 0; y < rows; ++y) {
+            std::uint8_t* dst = pixels + static_cast<std::size_t>(y) * static_cast<std::size_t>(width) * static_cast<std::size_t>(channels) + c;
+            std::uint8_t previous = 0;
+            for (int x = 0; x < width; ++x) {
+                previous = static_cast<std::uint8_t>(previous + raw[i++]);
+                dst[static_cast<std::size_t>(x) * static_cast<std::size_t>(channels)] = previous;
+            }
+        }
+    }
+}
+
+struct EncodedChunk {
+    ChunkCodec codec = ChunkCodec::None;
+    std::vector<std::uint8_t> bytes;
+};
+
+EncodedChunk encodePlaneBand(const std::uint8_t* pixels, int width, int rows, int channels, IFLOWCompression compression) {
+    const std::vector<std::uint8_t> raw = splitPlaneBand(pixels, width, rows, channels);
+    EncodedChunk chunk{ChunkCodec::None, raw};
+    const auto tryCodec = [&](ChunkCodec codec) {
+        std::vector<std::uint8_t> encoded = encodeChunk(codec, raw.data(), raw.size());
+        if (encoded.size() < chunk.bytes.size()) {
+            chunk.codec = codec;
+            chunk.bytes = std::move(encoded);
+        }
+    };
+    switch (compression) {
+        case IFLOWCompression::None:
+            break;
+        case IFLOWCompression::RLE:
+            tryCodec(ChunkCodec::RLE);
+            break;
+        case IFLOWCompression::LZ4:
+            tryCodec(ChunkCodec::LZ4);
+            break;
+        case IFLOWCompression::Deflate:
+            tryCodec(ChunkCodec::Deflate);
+            break;
+        case IFLOWCompression::Auto:
+            tryCodec(ChunkCodec::RLE);
+            tryCodec(ChunkCodec::LZ4);
+            // Deflate is several times slower; only pay for it when the byte
+            // coders leave most of the chunk and a sample says it will help.
+            if (chunk.bytes.size() > raw.size() / 2) {
+                const std::size_t sample = std::min<std::size_t>(raw.size(), kIFLOWDeflateSampleBytes);
+                const std::size_t sampleSize = deflateCompress(raw.data(), sample).size();
+                if (static_cast<double>(sampleSize) / static_cast<double>(sample) <
+                    0.9 * static_cast<double>(chunk.bytes.size()) / static_cast<double>(raw.size())) {
+                    tryCodec(ChunkCodec::Deflate);
+                }
+            }
+            break;
+    }
+    return chunk;
+}
+
+bool isKnownChunkCodec(ChunkCodec codec) {
+    return codec == ChunkCodec::None || codec == ChunkCodec::RLE || codec == ChunkCodec::Deflate ||
+           codec == ChunkCodec::LZ4;
+}
+
+struct IFLOWChunkRef {
+    ChunkCodec codec;
+    std::uint64_t offset;
+    std::uint32_t size;
+};
+
+// One pixel plane of a version 5 file, decoded from the mapping on demand.
+class IFLOWPlaneSource : public PixelSource {
+public:
+    IFLOWPlaneSource(std::shared_ptr<const MappedFile> file, int rowsPerChunk, std::vector<IFLOWChunkRef> chunks)
+        : m_file(std::move(file)), m_rowsPerChunk(rowsPerChunk), m_chunks(std::move(chunks)) {}
+
+    void load(std::uint8_t* pixels, int width, int height, int channels) const override {
+        const std::size_t rowBytes = static_cast<std::size_t>(width) * static_cast<std::size_t>(channels);
+        for (std::size_t i = 0; i < m_chunks.size(); ++i) {
+            const IFLOWChunkRef& chunk = m_chunks[i];
+            const int y = static_cast<int>(i) * m_rowsPerChunk;
+            const int rows = std::min(m_rowsPerChunk, height - y);
+            const std::vector<std::uint8_t> raw = decodeChunk(chunk.codec, m_file->data() + chunk.offset, chunk.size,
+                                                              rowBytes * static_cast<std::size_t>(rows));
+            mergePlaneBand(raw, pixels + static_cast<std::size_t>(y) * rowBytes, width, rows, channels);
+        }
+    }
+
+    const MappedFile& file() const {
+        return *m_file;
+    }
+
+    int rowsPerChunk() const {
+        return m_rowsPerChunk;
+    }
+
+    const std::vector<IFLOWChunkRef>& chunks() const {
+        return m_chunks;
+    }
+
+private:
+    std::shared_ptr<const MappedFile> m_file;
+    int m_rowsPerChunk;
+    std::vector<IFLOWChunkRef> m_chunks;
+};
+
+// Version 5 files start with a fixed header and two superblock slots. Each
+// slot names a tree block holding the layer tree and the chunk index of
+// every plane; the valid slot with the highest sequence wins.
+constexpr std::size_t kIFLOWSlotBytes = 32;
+constexpr std::size_t kIFLOWSlotOffsets[2] = {16, 16 + kIFLOWSlotBytes};
+constexpr std::uint64_t kIFLOWDataOffset = 16 + 2 * kIFLOWSlotBytes;
+
+struct IFLOWSuperblock {
+    std::uint64_t sequence = 0;
+    std::uint64_t treeOffset = 0;
+    std::uint64_t treeSize = 0;
+    std::uint32_t treeCrc = 0;
+};
+
+void writeSuperblock(std::ostream& out, const IFLOWSuperblock& block) {
+    std::uint8_t bytes[kIFLOWSlotBytes] = {};
+    std::memcpy(bytes, &block.sequence, 8);
+    std::memcpy(bytes + 8, &block.treeOffset, 8);
+    std::memcpy(bytes + 16, &block.treeSize, 8);
+    std::memcpy(bytes + 24, &block.treeCrc, 4);
+    const std::uint32_t slotCrc = crc32(bytes, 28);
+    std::memcpy(bytes + 28, &slotCrc, 4);
+    out.write(reinterpret_cast<const char*>(bytes), sizeof(bytes));
+}
+
+// A slot torn by a crash fails its checksum and is ignored.
+bool decodeSuperblock(const std::uint8_t* bytes, IFLOWSuperblock& block) {
+    std::uint32_t slotCrc = 0;
+    std::memcpy(&block.sequence, bytes, 8);
+    std::memcpy(&block.treeOffset, bytes + 8, 8);
+    std::memcpy(&block.treeSize, bytes + 16, 8);
+    std::memcpy(&block.treeCrc, bytes + 24, 4);
+    std::memcpy(&slotCrc, bytes + 28, 4);
+    return block.sequence != 0 && slotCrc == crc32(bytes, 28);
+}
+
+bool readSuperblock(const MappedFile& file, std::size_t slot, IFLOWSuperblock& block) {
+    if (!decodeSuperblock(file.data() + kIFLOWSlotOffsets[slot], block)) {
+        return false;
+    }
+    if (block.treeOffset < kIFLOWDataOffset || block.treeOffset > file.size() ||
+        block.treeSize > file.size() - block.treeOffset) {
+        return false;
+    }
+    return crc32(file.data() + block.treeOffset, static_cast<std::size_t>(block.treeSize)) == block.treeCrc;
 }
 
-void writeLayer(std::ostream& out, const Layer& layer) {
+std::uint64_t hashPlaneBytes(const std::uint8_t* data, std::size_t size) {
+    std::uint64_t hash = 0x9E3779B97F4A7C15ull ^ size;
+    std::size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        std::uint64_t word = 0;
+        std::memcpy(&word, data + i, sizeof(word));
+        hash = (hash ^ word) * 0xFF51AFD7ED558CCDull;
+        hash ^= hash >> 32;
+    }
+    for (; i < size; ++i) {
+        hash = (hash ^ data[i]) * 0x100000001B3ull;
+    }
+    return hash;
+}
+
+// Saving collects every pixel plane first so chunks can be encoded in
+// parallel, then writes them ahead of the tree block that indexes them.
+// Planes still backed by an IFLOW file are copied through without decoding,
+// solid planes are stored as their value, generated ones as their
+// parameters, and planes with the same content share one set of chunks.
+class PlaneWriter {
+public:
+    explicit PlaneWriter(const IFLOWSaveOptions& options) : m_options(options), m_next(0) {}
+
+    void collect(const LayerGroup& group) {
+        for (std::size_t i = 0; i < group.nodeCount(); ++i) {
+            const LayerNode& node = group.node(i);
+            if (node.isGroup()) {
+                collect(node.asGroup());
+                continue;
+            }
+            const Layer& layer = node.asLayer();
+            const ImageBuffer& image = layer.image();
+            PixelRGBA8 color;
+            if (image.trySolidColor(color)) {
+                addSolid(image.width(), image.height(), reinterpret_cast<const std::uint8_t*>(&color), 4);
+            } else if (const LayerGenerator* generator = imageGenerator(image)) {
+                addGenerated(image.width(), image.height(), generator->encode());
+            } else if (const IFLOWPlaneSource* source = reusableSource(image.pixelSource())) {
+                addCopy(source, image.width(), image.height());
+            } else {
+                add(reinterpret_cast<const std::uint8_t*>(image.data()), image.width(), image.height(), 4);
+            }
+            if (!layer.hasMask()) {
+                continue;
+            }
+            const MaskBuffer& mask = layer.mask();
+            std::uint8_t coverage = 0;
+            if (mask.trySolidCoverage(coverage)) {
+                addSolid(mask.width(), mask.height(), &coverage, 1);
+            } else if (const IFLOWPlaneSource* source = reusableSource(mask.pixelSource())) {
+                addCopy(source, mask.width(), mask.height());
+            } else {
+                add(mask.row(0), mask.width(), mask.height(), 1);
+            }
+        }
+    }
+
+    void encode() {
+        m_encoded.resize(m_jobs.size());
+        parallelFor(static_cast<int>(m_jobs.size()), m_options.threads, [this](int i) {
+            const Job& job = m_jobs[static_cast<std::size_t>(i)];
+            const Plane& plane = m_planes[job.plane];
+            const std::size_t rowBytes = static_cast<std::size_t>(plane.width) * static_cast<std::size_t>(plane.channels);
+            m_encoded[static_cast<std::size_t>(i)] = encodePlaneBand(plane.pixels + static_cast<std::size_t>(job.y) * rowBytes,
+                                                                     plane.width, job.rows, plane.channels, m_options.compression);
+        });
+    }
+
+    // The file that copied-through planes were mapped from, if path still
+    // names it.
+    const MappedFile* sourceFileAt(const std::string& path) const {
+        for (const Plane& plane : m_planes) {
+            if (plane.copy && plane.copy->file().isFileAt(path)) {
+                return &plane.copy->file();
+            }
+        }
+        return nullptr;
+    }
+
+    // Chunk bytes already in inPlace (reused) and those writeChunks would
+    // have to write after them (fresh).
+    void measure(const MappedFile* inPlace, std::uint64_t& reused, std::uint64_t& fresh) const {
+        reused = 0;
+        fresh = 0;
+        for (const Plane& plane : m_planes) {
+            if (plane.solid || plane.sameAs != kNoPlane) {
+                continue;
+            }
+            if (plane.copy) {
+                std::uint64_t& total = &plane.copy->file() == inPlace ? reused : fresh;
+                for (const IFLOWChunkRef& chunk : plane.copy->chunks()) {
+                    total += chunk.size;
+                }
+                continue;
+            }
+            for (std::size_t i = plane.firstJob; i < plane.firstJob + plane.jobCount; ++i) {
+                fresh += m_encoded[i].bytes.size();
+            }
+        }
+    }
+
+    // Writes chunk payloads starting at file position offset and returns the
+    // position after the last one. Planes copied from inPlace keep pointing
+    // at their existing chunks instead.
+    std::uint64_t writeChunks(std::ostream& out, std::uint64_t offset, const MappedFile* inPlace = nullptr) {
+        const auto emit = [&](Plane& plane, ChunkCodec codec, const std::uint8_t* bytes, std::uint32_t size) {
+            out.write(reinterpret_cast<const char*>(bytes), static_cast<std::streamsize>(size));
+            plane.chunks.push_back(IFLOWChunkRef{codec, offset, size});
+            offset += size;
+        };
+        for (Plane& plane : m_planes) {
+            if (plane.solid) {
+                continue;
+            }
+            if (plane.sameAs != kNoPlane) {
+                plane.chunks = m_planes[plane.sameAs].chunks;
+                continue;
+            }
+            if (plane.copy && &plane.copy->file() == inPlace) {
+                plane.chunks = plane.copy->chunks();
+                continue;
+            }
+            if (plane.copy) {
+                for (const IFLOWChunkRef& chunk : plane.copy->chunks()) {
+                    emit(plane, chunk.codec, plane.copy->file().data() + chunk.offset, chunk.size);
+                }
+                continue;
+            }
+            for (std::size_t i = plane.firstJob; i < plane.firstJob + plane.jobCount; ++i) {
+                EncodedChunk& chunk = m_encoded[i];
+                emit(plane, chunk.codec, chunk.bytes.data(), static_cast<std::uint32_t>(chunk.bytes.size()));
+                chunk.bytes = std::vector<std::uint8_t>();
+            }
+        }
+        if (!out.good()) {
+            throw std::runtime_error("Failed writing IFLOW pixel chunks");
+        }
+        return offset;
+    }
+
+    // Writes the chunk index of the next plane in tree order.
+    void writeNext(std::ostream& out) {
+        if (m_next >= m_planes.size()) {
+            throw std::logic_error("IFLOW plane writer is out of planes");
+        }
+        const Plane& plane = m_planes[m_next++];
+        writeBinary(out, static_cast<std::int32_t>(plane.width));
+        writeBinary(out, static_cast<std::int32_t>(plane.height));
+        // Version 6: a zero chunk height marks a solid plane, stored as one
+        // value. Version 7: a chunk count of 1 after it marks a generated
+        // plane, stored as its encoded parameters.
+        if (plane.solid) {
+            writeBinary(out, static_cast<std::uint32_t>(0));
+            if (!plane.generator.empty()) {
+                writeBinary(out, static_cast<std::uint32_t>(1));
+                writeBinary(out, static_cast<std::uint32_t>(plane.generator.size()));
+                out.write(reinterpret_cast<const char*>(plane.generator.data()), static_cast<std::streamsize>(plane.generator.size()));
+                return;
+            }
+            writeBinary(out, static_cast<std::uint32_t>(0));
+            out.write(reinterpret_cast<const char*>(plane.value), plane.channels);
+            return;
+        }
+        writeBinary(out, static_cast<std::uint32_t>(plane.rowsPerChunk));
+        writeBinary(out, static_cast<std::uint32_t>(plane.chunks.size()));
+        for (const IFLOWChunkRef& chunk : plane.chunks) {
+            writeBinary(out, static_cast<std::uint8_t>(chunk.codec));
+            writeBinary(out, chunk.offset);
+            writeBinary(out, chunk.size);
+        }
+    }
+
+private:
+    static constexpr std::size_t kNoPlane = std::numeric_limits<std::size_t>::max();
+
+    struct Plane {
+        const std::uint8_t* pixels = nullptr;
+        int width = 0;
+        int height = 0;
+        int channels = 0;
+        int rowsPerChunk = 0;
+        std::size_t firstJob = 0;
+        std::size_t jobCount = 0;
+        const IFLOWPlaneSource* copy = nullptr;
+        std::size_t sameAs = kNoPlane;
+        bool solid = false;
+        std::uint8_t value[4] = {};
+        // Encoded LayerGenerator of a generated plane, which is also solid.
+        std::vector<std::uint8_t> generator;
+        std::vector<IFLOWChunkRef> chunks;
+    };
+
+    struct Job {
+        std::size_t plane;
+        int y;
+        int rows;
+    };
+
+    // An explicit codec asks for the planes to be re-encoded.
+    const IFLOWPlaneSource* reusableSource(const PixelSource* source) const {
+        if (m_options.compression != IFLOWCompression::Auto) {
+            return nullptr;
+        }
+        return dynamic_cast<const IFLOWPlaneSource*>(source);
+    }
+
+    void add(const std::uint8_t* pixels, int width, int height, int channels) {
+        Plane plane;
+        plane.pixels = pixels;
+        plane.width = width;
+        plane.height = height;
+        plane.channels = channels;
+        plane.rowsPerChunk = planeChunkRows(width, channels);
+        plane.firstJob = m_jobs.size();
+
+        // Copy-on-write copies share storage; other planes are matched by content.
+        const auto shared = m_byStorage.find(pixels);
+        if (shared != m_byStorage.end()) {
+            plane.sameAs = shared->second;
+            m_planes.push_back(std::move(plane));
+            return;
+        }
+        const std::size_t bytes = static_cast<std::size_t>(width) * static_cast<std::size_t>(height) * channels;
+        std::vector<std::size_t>& candidates = m_byContent[hashPlaneBytes(pixels, bytes)];
+        for (std::size_t candidate : candidates) {
+            const Plane& other = m_planes[candidate];
+            if (other.width == width && other.height == height && other.channels == channels &&
+                std::memcmp(other.pixels, pixels, bytes) == 0) {
+                plane.sameAs = candidate;
+                m_byStorage.emplace(pixels, candidate);
+                m_planes.push_back(std::move(plane));
+                return;
+            }
+        }
+        candidates.push_back(m_planes.size());
+        m_byStorage.emplace(pixels, m_planes.size());
+
+        for (int y = 0; y < height; y += plane.rowsPerChunk) {
+            m_jobs.push_back(Job{m_planes.size(), y, std::min(plane.rowsPerChunk, height - y)});
+            ++plane.jobCount;
+        }
+        m_planes.push_back(std::move(plane));
+    }
+
+    void addCopy(const IFLOWPlaneSource* source, int width, int height) {
+        Plane plane;
+        plane.width = width;
+        plane.height = height;
+        plane.rowsPerChunk = source->rowsPerChunk();
+        plane.firstJob = m_jobs.size();
+        const auto shared = m_byStorage.find(source);
+        if (shared != m_byStorage.end()) {
+            plane.sameAs = shared->second;
+        } else {
+            plane.copy = source;
+            m_byStorage.emplace(source, m_planes.size());
+        }
+        m_planes.push_back(std::move(plane));
+    }
+
+    void addSolid(int width, int height, const std::uint8_t* value, int channels) {
+        Plane plane;
+        plane.width = width;
+        plane.height = height;
+        plane.channels = channels;
+        plane.firstJob = m_jobs.size();
+        plane.solid = true;
+        std::memcpy(plane.value, value, static_cast<std::size_t>(channels));
+        m_planes.push_back(std::move(plane));
+    }
+
+    void addGenerated(int width, int height, std::vector<std::uint8_t> generator) {
+        Plane plane;
+        plane.width = width;
+        plane.height = height;
+        plane.channels = 4;
+        plane.firstJob = m_jobs.size();
+        plane.solid = true;
+        plane.generator = std::move(generator);
+        m_planes.push_back(std::move(plane));
+    }
+
+    IFLOWSaveOptions m_options;
+    std::vector<Plane> m_planes;
+    std::vector<Job> m_jobs;
+    std::vector<EncodedChunk> m_encoded;
+    std::unordered_map<const void*, std::size_t> m_byStorage;
+    std::unordered_map<std::uint64_t, std::vector<std::size_t>> m_byContent;
+    std::size_t m_next;
+};
+
+// Version 4 files interleave chunk payloads with the tree; those are read in
+// file order and decoded together once the whole tree is known. Version 5
+// files only carry a chunk index in the tree, which becomes a lazy source.
+class PlaneReader {
+public:
+    PlaneReader() = default;
+    explicit PlaneReader(std::shared_ptr<const MappedFile> file) : m_file(std::move(file)) {}
+
+    void readInto(std::istream& in, std::uint8_t* pixels, int width, int height, int channels) {
+        const std::uint32_t rowsPerChunk = readBinary<std::uint32_t>(in);
+        if (rowsPerChunk == 0) {
+            throw std::runtime_error("Invalid IFLOW chunk height");
+        }
+        const std::size_t rowBytes = static_cast<std::size_t>(width) * static_cast<std::size_t>(channels);
+        for (std::int64_t y = 0; y < height; y += rowsPerChunk) {
+            const int rows = static_cast<int>(std::min<std::int64_t>(rowsPerChunk, height - y));
+            Chunk chunk;
+            chunk.codec = static_cast<ChunkCodec>(readBinary<std::uint8_t>(in));
+            if (!isKnownChunkCodec(chunk.codec)) {
+                throw std::runtime_error("Unknown IFLOW chunk codec");
+            }
+            const std::uint32_t storedSize = readBinary<std::uint32_t>(in);
+            const std::size_t rawSize = rowBytes * static_cast<std::size_t>(rows);
+            if (storedSize > rawSize) {
+                throw std::runtime_error("IFLOW chunk is larger than its pixels");
+            }
+            chunk.stored.resize(storedSize);
+            in.read(reinterpret_cast<char*>(chunk.stored.data()), static_cast<std::streamsize>(storedSize));
+            if (!in.good()) {
+                throw std::runtime_error("Failed reading IFLOW pixel chunk");
+            }
+            chunk.pixels = pixels + static_cast<std::size_t>(y) * rowBytes;
+            chunk.width = width;
+            chunk.rows = rows;
+            chunk.channels = channels;
+            m_chunks.push_back(std::move(chunk));
+        }
+    }
+
+    std::shared_ptr<const PixelSource> readIndex(std::istream& in, int width, int height, int channels) {
+        if (!m_file) {
+            throw std::logic_error("IFLOW chunk index read without a mapped file");
+        }
+        const std::uint32_t rowsPerChunk = readBinary<std::uint32_t>(in);
+        if (rowsPerChunk == 0) {
+            return readSolid(in, channels);
+        }
+        if (rowsPerChunk > static_cast<std::uint32_t>(std::numeric_limits<int>::max())) {
+            throw std::runtime_error("Invalid IFLOW chunk height");
+        }
+        const std::uint64_t expected = (static_cast<std::uint64_t>(height) + rowsPerChunk - 1) / rowsPerChunk;
+        if (readBinary<std::uint32_t>(in) != expected) {
+            throw std::runtime_error("IFLOW chunk count does not match plane height");
+        }
+        const std::size_t rowBytes = static_cast<std::size_t>(width) * static_cast<std::size_t>(channels);
+        std::vector<IFLOWChunkRef> chunks;
+        chunks.reserve(static_cast<std::size_t>(expected));
+        for (std::uint64_t y = 0; y < static_cast<std::uint64_t>(height); y += rowsPerChunk) {
+            const std::uint64_t rows = std::min<std::uint64_t>(rowsPerChunk, static_cast<std::uint64_t>(height) - y);
+            IFLOWChunkRef chunk{};
+            chunk.codec = static_cast<ChunkCodec>(readBinary<std::uint8_t>(in));
+            chunk.offset = readBinary<std::uint64_t>(in);
+            chunk.size = readBinary<std::uint32_t>(in);
+            if (!isKnownChunkCodec(chunk.codec)) {
+                throw std::runtime_error("Unknown IFLOW chunk codec");
+            }
+            if (chunk.size > rowBytes * rows) {
+                throw std::runtime_error("IFLOW chunk is larger than its pixels");
+            }
+            if (chunk.offset < kIFLOWDataOffset || chunk.offset > m_file->size() ||
+                chunk.size > m_file->size() - chunk.offset) {
+                throw std::runtime_error("IFLOW chunk lies outside the file");
+            }
+            chunks.push_back(chunk);
+        }
+        return std::make_shared<IFLOWPlaneSource>(m_file, static_cast<int>(rowsPerChunk), std::move(chunks));
+    }
+
+    // Planes whose index names the same chunks load into one copy-on-write buffer.
+    ImageBuffer readImage(std::istream& in, int width, int height) {
+        return shareIdentical(m_images, ImageBuffer(width, height, readIndex(in, width, height, 4)));
+    }
+
+    MaskBuffer readMask(std::istream& in, int width, int height) {
+        return shareIdentical(m_masks, MaskBuffer(width, height, readIndex(in, width, height, 1)));
+    }
+
+    void decode(int threads) {
+        parallelFor(static_cast<int>(m_chunks.size()), threads, [this](int i) {
+            Chunk& chunk = m_chunks[static_cast<std::size_t>(i)];
+            const std::size_t rawSize = static_cast<std::size_t>(chunk.width) * static_cast<std::size_t>(chunk.rows) *
+                                        static_cast<std::size_t>(chunk.channels);
+            const std::vector<std::uint8_t> raw = decodeChunk(chunk.codec, chunk.stored.data(), chunk.stored.size(), rawSize);
+            mergePlaneBand(raw, chunk.pixels, chunk.width, chunk.rows, chunk.channels);
+            chunk.stored = std::vector<std::uint8_t>();
+        });
+    }
+
+private:
+    static constexpr std::uint32_t kMaxGeneratorBytes = 1u << 20;
+
+    static std::shared_ptr<const PixelSource> readSolid(std::istream& in, int channels) {
+        const std::uint32_t kind = readBinary<std::uint32_t>(in);
+        if (kind == 1 && channels == 4) {
+            const std::uint32_t size = readBinary<std::uint32_t>(in);
+            if (size > kMaxGeneratorBytes) {
+                throw std::runtime_error("IFLOW layer generator is too large");
+            }
+            std::vector<std::uint8_t> bytes(size);
+            in.read(reinterpret_cast<char*>(bytes.data()), static_cast<std::streamsize>(size));
+            if (!in.good()) {
+                throw std::runtime_error("Failed reading IFLOW layer generator");
+            }
+            return generatorSource(LayerGenerator::decode(bytes.data(), bytes.size()));
+        }
+        if (kind != 0) {
+            throw std::runtime_error("IFLOW solid plane has chunks");
+        }
+        if (channels == 4) {
+            PixelRGBA8 color;
+            color.r = readBinary<std::uint8_t>(in);
+            color.g = readBinary<std::uint8_t>(in);
+            color.b = readBinary<std::uint8_t>(in);
+            color.a = readBinary<std::uint8_t>(in);
+            return solidPlane(color);
+        }
+        return solidPlane(readBinary<std::uint8_t>(in));
+    }
+
+    template <typename Buffer>
+    static Buffer shareIdentical(std::unordered_map<std::uint64_t, std::vector<Buffer>>& seen, Buffer buffer) {
+        const auto* source = dynamic_cast<const IFLOWPlaneSource*>(buffer.pixelSource());
+        if (!source) {
+            return buffer;
+        }
+        std::vector<Buffer>& candidates = seen[source->chunks().front().offset];
+        for (const Buffer& other : candidates) {
+            const auto* otherSource = static_cast<const IFLOWPlaneSource*>(other.pixelSource());
+            if (other.width() == buffer.width() && other.height() == buffer.height() &&
+                otherSource->rowsPerChunk() == source->rowsPerChunk() &&
+                std::equal(otherSource->chunks().begin(), otherSource->chunks().end(), source->chunks().begin(),
+                           source->chunks().end(), [](const IFLOWChunkRef& a, const IFLOWChunkRef& b) {
+                               return a.codec == b.codec && a.offset == b.offset && a.size == b.size;
+                           })) {
+                return other;
+            }
+        }
+        candidates.push_back(buffer);
+        return buffer;
+    }
+
+    struct Chunk {
+        ChunkCodec codec = ChunkCodec::None;
+        std::vector<std::uint8_t> stored;
+        std::uint8_t* pixels = nullptr;
+        int width = 0;
+        int rows = 0;
+        int channels = 0;
+    };
+
+    std::shared_ptr<const MappedFile> m_file;
+    std::vector<Chunk> m_chunks;
+    std::unordered_map<std::uint64_t, std::vector<ImageBuffer>> m_images;
+    std::unordered_map<std::uint64_t, std::vector<MaskBuffer>> m_masks;
+};
+
+void writeLayer(std::ostream& out, const Layer& layer, PlaneWriter& planes) {
     writeString(out, layer.name());
     writeBinary(out, static_cast<std::uint8_t>(layer.visible() ? 1 : 0));
     writeBinary(out, layer.opacity());
@@ -797,21 +3394,21 @@ void writeLayer(std::ostream& out, const Layer& layer) {
     writeBinary(out, static_cast<float>(layer.transform().d()));
     writeBinary(out, static_cast<float>(layer.transform().tx()));
     writeBinary(out, static_cast<float>(layer.transform().ty()));
-    writeImageBuffer(out, layer.image());
+    planes.writeNext(out);
     writeBinary(out, static_cast<std::uint8_t>(layer.hasMask() ? 1 : 0));
     if (layer.hasMask()) {
-        writeImageBuffer(out, layer.mask());
+        planes.writeNext(out);
     }
 }
 
-Layer readLayer(std::istream& in, std::uint32_t version) {
-    const std::string name = readString(in);
-    const bool visible = readBinary<std::uint8_t>(in) != 0;
-    const float opacity = readBinary<float>(in);
-    const BlendMode blendMode = intToBlendMode(readBinary<std::int32_t>(in));
+void readLayerInto(std::istream& in, std::uint32_t version, Layer& layer, PlaneReader& planes) {
+    layer.setName(readString(in));
+    layer.setVisible(readBinary<std::uint8_t>(in) != 0);
+    layer.setOpacity(readBinary<float>(in));
+    layer.setBlendMode(intToBlendMode(readBinary<std::int32_t>(in)));
     const int offsetX = readBinary<std::int32_t>(in);
     const int offsetY = readBinary<std::int32_t>(in);
-    Transform2D transform;
+    layer.setOffset(offsetX, offsetY);
     if (version >= 2) {
         const double a = readBinary<float>(in);
         const double b = readBinary<float>(in);
@@ -819,32 +3416,51 @@ Layer readLayer(std::istream& in, std::uint32_t version) {
         const double d = readBinary<float>(in);
         const double tx = readBinary<float>(in);
         const double ty = readBinary<float>(in);
-        transform = Transform2D::fromMatrix(a, b, c, d, tx, ty);
+        layer.transform() = Transform2D::fromMatrix(a, b, c, d, tx, ty);
     }
-    ImageBuffer image = readImageBuffer(in);
-    const bool hasMask = readBinary<std::uint8_t>(in) != 0;
 
-    Layer layer(name, image.width(), image.height(), PixelRGBA8(0, 0, 0, 0));
-    layer.setVisible(visible);
-    layer.setOpacity(opacity);
-    layer.setBlendMode(blendMode);
-    layer.setOffset(offsetX, offsetY);
-    layer.transform() = transform;
-    layer.image() = image;
+    // Version 4 stores pixel planes as compressed chunks; version 5 moves
+    // them out of the tree and indexes them instead.
+    if (version >= 5) {
+        const std::int32_t width = readBinary<std::int32_t>(in);
+        const std::int32_t height = readBinary<std::int32_t>(in);
+        checkedPixelCount(width, height, "IFLOW image");
+        layer.image() = planes.readImage(in, width, height);
+    } else if (version == 4) {
+        const std::int32_t width = readBinary<std::int32_t>(in);
+        const std::int32_t height = readBinary<std::int32_t>(in);
+        checkedPixelCount(width, height, "IFLOW image");
+        layer.image() = ImageBuffer(width, height);
+        planes.readInto(in, reinterpret_cast<std::uint8_t*>(layer.image().data()), width, height, 4);
+    } else {
+        layer.image() = readImageBuffer(in);
+    }
+    const bool hasMask = readBinary<std::uint8_t>(in) != 0;
 
     if (hasMask) {
-        ImageBuffer mask = readImageBuffer(in);
-        if (mask.width() != image.width() || mask.height() != image.height()) {
+        MaskBuffer mask;
+        if (version >= 4) {
+            const std::int32_t width = readBinary<std::int32_t>(in);
+            const std::int32_t height = readBinary<std::int32_t>(in);
+            checkedPixelCount(width, height, "IFLOW mask");
+            mask = version >= 5 ? planes.readMask(in, width, height)
+                                : MaskBuffer(width, height, static_cast<std::uint8_t>(0));
+        } else {
+            // Before version 3 masks were stored as full RGBA buffers.
+            mask = version >= 3 ? readMaskBuffer(in) : MaskBuffer::fromImage(readImageBuffer(in));
+        }
+        if (mask.width() != layer.image().width() || mask.height() != layer.image().height()) {
             throw std::runtime_error("IFLOW layer mask dimensions do not match layer image");
         }
-        layer.enableMask();
-        layer.mask() = mask;
+        layer.setMask(std::move(mask));
+        if (version == 4) {
+            const CoverageView coverage = layer.mask().view();
+            planes.readInto(in, coverage.row(0), coverage.width(), coverage.height(), 1);
+        }
     }
-
-    return layer;
 }
 
-void writeGroup(std::ostream& out, const LayerGroup& group) {
+void writeGroup(std::ostream& out, const LayerGroup& group, PlaneWriter& planes) {
     writeString(out, group.name());
     writeBinary(out, static_cast<std::uint8_t>(group.visible() ? 1 : 0));
     writeBinary(out, group.opacity());
@@ -863,20 +3479,22 @@ void writeGroup(std::ostream& out, const LayerGroup& group) {
         const LayerNode& node = group.node(i);
         if (node.isLayer()) {
             writeBinary(out, static_cast<std::uint8_t>(0));
-            writeLayer(out, node.asLayer());
+            writeLayer(out, node.asLayer(), planes);
         } else {
             writeBinary(out, static_cast<std::uint8_t>(1));
-            writeGroup(out, node.asGroup());
+            writeGroup(out, node.asGroup(), planes);
         }
     }
 }
 
-LayerGroup readGroup(std::istream& in, std::uint32_t version) {
-    LayerGroup group(readString(in));
+void readGroupInto(std::istream& in, std::uint32_t version, LayerGroup& group, PlaneReader& planes) {
+    group.setName(readString(in));
     group.setVisible(readBinary<std::uint8_t>(in) != 0);
     group.setOpacity(readBinary<float>(in));
     group.setBlendMode(intToBlendMode(readBinary<std::int32_t>(in)));
-    group.setOffset(readBinary<std::int32_t>(in), readBinary<std::int32_t>(in));
+    const int offsetX = readBinary<std::int32_t>(in);
+    const int offsetY = readBinary<std::int32_t>(in);
+    group.setOffset(offsetX, offsetY);
     if (version >= 2) {
         const double a = readBinary<float>(in);
         const double b = readBinary<float>(in);
@@ -894,39 +3512,193 @@ LayerGroup readGroup(std::istream& in, std::uint32_t version) {
     for (std::uint32_t i = 0; i < nodeCount; ++i) {
         const std::uint8_t nodeType = readBinary<std::uint8_t>(in);
         if (nodeType == 0) {
-            group.addLayer(readLayer(in, version));
+            readLayerInto(in, version, group.emplaceLayer(), planes);
         } else if (nodeType == 1) {
-            group.addGroup(readGroup(in, version));
+            readGroupInto(in, version, group.emplaceGroup(), planes);
         } else {
             throw std::runtime_error("Invalid IFLOW node type");
         }
     }
+}
 
-    return group;
+void syncFile(const std::string& path) {
+#if defined(__unix__) || defined(__APPLE__)
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    const bool synced = fd >= 0 && ::fsync(fd) == 0;
+    if (fd >= 0) {
+        ::close(fd);
+    }
+    if (!synced) {
+        throw std::runtime_error("Failed syncing IFLOW document");
+    }
+#else
+    (void)path;
+#endif
+}
+
+void writeTreeBlock(std::ostream& out, const Document& document, PlaneWriter& planes, IFLOWSuperblock& block) {
+    std::ostringstream tree;
+    writeBinary(tree, static_cast<std::int32_t>(document.width()));
+    writeBinary(tree, static_cast<std::int32_t>(document.height()));
+    writeGroup(tree, document.rootGroup(), planes);
+    const std::string treeBytes = tree.str();
+    block.treeSize = treeBytes.size();
+    block.treeCrc = crc32(reinterpret_cast<const std::uint8_t*>(treeBytes.data()), treeBytes.size());
+    out.write(treeBytes.data(), static_cast<std::streamsize>(treeBytes.size()));
+}
+
+// Layers loaded from path may still be mapped from it, so the new file is
+// written beside it and renamed over it only once complete.
+void rewriteDocumentIFLOW(const Document& document, const std::string& path, PlaneWriter& planes) {
+    const std::string tempPath = path + ".tmp";
+    try {
+        std::ofstream out(tempPath, std::ios::binary | std::ios::trunc);
+        if (!out.is_open()) {
+            throw std::runtime_error("Failed to open IFLOW file for writing");
+        }
+        out.write(kIFLOWMagic, sizeof(kIFLOWMagic));
+        writeBinary(out, kIFLOWVersion);
+        writeBinary(out, static_cast<std::uint32_t>(0));
+        const char emptySlots[2 * kIFLOWSlotBytes] = {};
+        out.write(emptySlots, sizeof(emptySlots));
+
+        IFLOWSuperblock block;
+        block.sequence = 1;
+        block.treeOffset = planes.writeChunks(out, kIFLOWDataOffset);
+        writeTreeBlock(out, document, planes, block);
+        out.seekp(static_cast<std::streamoff>(kIFLOWSlotOffsets[0]));
+        writeSuperblock(out, block);
+        out.close();
+        if (out.fail()) {
+            throw std::runtime_error("Failed writing IFLOW document");
+        }
+        syncFile(tempPath);
+        if (std::rename(tempPath.c_str(), path.c_str()) != 0) {
+            throw std::runtime_error("Failed to replace IFLOW file");
+        }
+    } catch (...) {
+        std::remove(tempPath.c_str());
+        throw;
+    }
 }
-} // namespace
 
-bool saveDocumentIFLOW(const Document& document, const std::string& path) {
-    std::ofstream out(path, std::ios::binary | std::ios::trunc);
-    if (!out.is_open()) {
+// Saving back to the file a document was loaded from appends the chunks of
+// changed planes and a new tree block, then publishes them by rewriting the
+// older superblock slot. Live chunks are never overwritten, so a crash at
+// any point leaves the previous tree intact. Returns false when path is not
+// that file, or when the space earlier saves left dead calls for a rewrite.
+bool appendDocumentIFLOW(const Document& document, const std::string& path, PlaneWriter& planes) {
+    const MappedFile* source = planes.sourceFileAt(path);
+    if (!source) {
+        return false;
+    }
+    std::fstream file(path, std::ios::binary | std::ios::in | std::ios::out);
+    if (!file.is_open()) {
+        return false;
+    }
+    std::uint8_t header[kIFLOWDataOffset] = {};
+    file.read(reinterpret_cast<char*>(header), sizeof(header));
+    std::uint32_t version = 0;
+    std::memcpy(&version, header + sizeof(kIFLOWMagic), sizeof(version));
+    if (!file.good() || std::memcmp(header, kIFLOWMagic, sizeof(kIFLOWMagic)) != 0 || version != kIFLOWVersion) {
+        return false;
+    }
+    IFLOWSuperblock current;
+    std::size_t currentSlot = 2;
+    for (std::size_t slot = 0; slot < 2; ++slot) {
+        IFLOWSuperblock candidate;
+        if (decodeSuperblock(header + kIFLOWSlotOffsets[slot], candidate) &&
+            (currentSlot == 2 || candidate.sequence > current.sequence)) {
+            current = candidate;
+            currentSlot = slot;
+        }
+    }
+    if (currentSlot == 2) {
+        return false;
+    }
+
+    file.seekp(0, std::ios::end);
+    const std::uint64_t end = static_cast<std::uint64_t>(file.tellp());
+    std::uint64_t reused = 0;
+    std::uint64_t fresh = 0;
+    planes.measure(source, reused, fresh);
+    if (end + fresh > 2 * (kIFLOWDataOffset + reused + fresh)) {
         return false;
     }
 
+    IFLOWSuperblock block;
+    block.sequence = current.sequence + 1;
+    block.treeOffset = planes.writeChunks(file, end, source);
+    writeTreeBlock(file, document, planes, block);
+    file.flush();
+    if (!file.good()) {
+        throw std::runtime_error("Failed appending to IFLOW document");
+    }
+    syncFile(path);
+
+    file.seekp(static_cast<std::streamoff>(kIFLOWSlotOffsets[1 - currentSlot]));
+    writeSuperblock(file, block);
+    file.flush();
+    if (!file.good()) {
+        throw std::runtime_error("Failed publishing IFLOW superblock");
+    }
+    syncFile(path);
+    return true;
+}
+
+// Only the tree block is parsed; pixel planes stay in the mapping until the
+// first access to each buffer.
+Document loadMappedDocument(const std::string& path, std::uint32_t version) {
+    const std::shared_ptr<const MappedFile> file = std::make_shared<const MappedFile>(path);
+    if (file->size() < kIFLOWDataOffset) {
+        throw std::runtime_error("Failed to read IFLOW header");
+    }
+    IFLOWSuperblock block;
+    bool found = false;
+    for (std::size_t slot = 0; slot < 2; ++slot) {
+        IFLOWSuperblock candidate;
+        if (readSuperblock(*file, slot, candidate) && (!found || candidate.sequence > block.sequence)) {
+            block = candidate;
+            found = true;
+        }
+    }
+    if (!found) {
+        throw std::runtime_error("IFLOW file has no valid superblock");
+    }
+
+    std::istringstream tree(std::string(reinterpret_cast<const char*>(file->data() + block.treeOffset),
+                                        static_cast<std::size_t>(block.treeSize)));
+    const std::int32_t width = readBinary<std::int32_t>(tree);
+    const std::int32_t height = readBinary<std::int32_t>(tree);
+    checkedPixelCount(width, height, "IFLOW document", std::numeric_limits<std::size_t>::max());
+
+    Document document(width, height);
+    PlaneReader planes(file);
+    readGroupInto(tree, version, document.rootGroup(), planes);
+    return document;
+}
+} // namespace
+
+bool saveDocumentIFLOW(const Document& document, const std::string& path) {
+    return saveDocumentIFLOW(document, path, IFLOWSaveOptions());
+}
+
+bool saveDocumentIFLOW(const Document& document, const std::string& path, const IFLOWSaveOptions& options) {
     try {
-        out.write(kIFLOWMagic, sizeof(kIFLOWMagic));
-        writeBinary(out, kIFLOWVersion);
-        writeBinary(out, static_cast<std::int32_t>(document.width()));
-        writeBinary(out, static_cast<std::int32_t>(document.height()));
-        writeGroup(out, document.rootGroup());
+        PlaneWriter planes(options);
+        planes.collect(document.rootGroup());
+        planes.encode();
+        if (!options.incremental || !appendDocumentIFLOW(document, path, planes)) {
+            rewriteDocumentIFLOW(document, path, planes);
+        }
     } catch (const std::exception& ex) {
         std::cerr << "saveDocumentIFLOW failed for '" << path << "': " << ex.what() << "\n";
         return false;
     }
-
-    return out.good();
+    return true;
 }
 
-Document loadDocumentIFLOW(const std::string& path) {
+Document loadDocumentIFLOW(const std::string& path, int threads) {
     std::ifstream in(path, std::ios::binary);
     if (!in.is_open()) {
         throw std::runtime_error("Failed to open IFLOW file");
@@ -944,15 +3716,21 @@ Document loadDocumentIFLOW(const std::string& path) {
     }
 
     const std::uint32_t version = readBinary<std::uint32_t>(in);
-    if (version != kIFLOWVersion && version != 1) {
+    if (version < 1 || version > kIFLOWVersion) {
         throw std::runtime_error("Unsupported IFLOW version");
     }
+    if (version >= 5) {
+        in.close();
+        return loadMappedDocument(path, version);
+    }
 
     const std::int32_t width = readBinary<std::int32_t>(in);
     const std::int32_t height = readBinary<std::int32_t>(in);
-    checkedPixelCount(width, height, "IFLOW document");
+    checkedPixelCount(width, height, "IFLOW document", std::numeric_limits<std::size_t>::max());
 
     Document document(width, height);
-    document.rootGroup() = readGroup(in, version);
+    PlaneReader planes;
+    readGroupInto(in, version, document.rootGroup(), planes);
+    planes.decode(threads);
     return document;
 }
@@ -4,9 +4,15 @@
 #include "image.h"
 #include "transform.h"
 
+#include <cstddef>
 #include <cstdint>
+#include <functional>
 #include <memory>
+#include <stdexcept>
 #include <string>
+#include <type_traits>
+#include <utility>
+#include <variant>
 #include <vector>
 
 enum class BlendMode {
@@ -33,10 +39,81 @@ struct PixelRGBA8 {
         : r(red), g(green), b(blue), a(alpha) {}
 };
 
+// Strided pixel view. Mutable views of an ImageBuffer stay valid until the
+// buffer is copied, reassigned or destroyed.
+template <typename PixelT>
+class BasicImageView {
+public:
+    BasicImageView() : m_data(nullptr), m_width(0), m_height(0), m_stride(0) {}
+    BasicImageView(PixelT* data, int width, int height, std::ptrdiff_t stride)
+        : m_data(data), m_width(width), m_height(height), m_stride(stride) {}
+
+    template <typename OtherT, typename = std::enable_if_t<std::is_convertible_v<OtherT*, PixelT*>>>
+    BasicImageView(const BasicImageView<OtherT>& other)
+        : m_data(other.row(0)), m_width(other.width()), m_height(other.height()), m_stride(other.stride()) {}
+
+    int width() const { return m_width; }
+    int height() const { return m_height; }
+    std::ptrdiff_t stride() const { return m_stride; }
+    bool empty() const { return m_width <= 0 || m_height <= 0; }
+
+    PixelT* row(int y) const { return m_data + static_cast<std::ptrdiff_t>(y) * m_stride; }
+    PixelT& at(int x, int y) const { return row(y)[x]; }
+
+    BasicImageView subview(int x, int y, int width, int height) const {
+        if (x < 0 || y < 0 || width < 0 || height < 0 || x > m_width - width || y > m_height - height) {
+            throw std::out_of_range("Image view rectangle out of bounds");
+        }
+        return BasicImageView(row(y) + x, width, height, m_stride);
+    }
+
+private:
+    PixelT* m_data;
+    int m_width;
+    int m_height;
+    std::ptrdiff_t m_stride;
+};
+
+using ImageView = BasicImageView<PixelRGBA8>;
+using ConstImageView = BasicImageView<const PixelRGBA8>;
+
+// Backing data a buffer faults its pixels in from on first access. A buffer
+// keeps its source until the pixels are first written.
+class PixelSource {
+public:
+    virtual ~PixelSource() = default;
+    virtual void load(std::uint8_t* pixels, int width, int height, int channels) const = 0;
+};
+
+// Unlinked temp file that cold pixels are LZ4-compressed into, so they can
+// leave memory and fault back in on their next access. The file is created
+// on first use and closes with the last source referring to it.
+class SpillFile {
+public:
+    SpillFile();
+    ~SpillFile();
+
+    SpillFile(const SpillFile&) = delete;
+    SpillFile& operator=(const SpillFile&) = delete;
+
+    // Appends size bytes; the returned source loads them back. Throws when
+    // the file cannot be created or written.
+    std::shared_ptr<const PixelSource> store(const std::uint8_t* data, std::size_t size);
+    std::size_t bytesWritten() const;
+
+private:
+    struct State;
+    std::shared_ptr<State> m_state;
+};
+
+template <typename T>
+class PlaneStore;
+
 class ImageBuffer {
 public:
     ImageBuffer();
     ImageBuffer(int width, int height, const PixelRGBA8& fill = PixelRGBA8(0, 0, 0, 0));
+    ImageBuffer(int width, int height, std::shared_ptr<const PixelSource> source);
 
     int width() const;
     int height() const;
@@ -47,10 +124,114 @@ public:
     void setPixel(int x, int y, const PixelRGBA8& pixel);
     void fill(const PixelRGBA8& pixel);
 
+    PixelRGBA8* data();
+    const PixelRGBA8* data() const;
+    PixelRGBA8* row(int y);
+    const PixelRGBA8* row(int y) const;
+    ImageView view();
+    ConstImageView view() const;
+    ImageView view(int x, int y, int width, int height);
+    ConstImageView view(int x, int y, int width, int height) const;
+    bool sharesPixelsWith(const ImageBuffer& other) const;
+
+    bool resident() const;
+    void makeResident() const;
+    const PixelSource* pixelSource() const;
+    // Drops decoded pixels the source can provide again. Must not race with
+    // readers of this buffer; returns whether anything was released.
+    bool releaseResident() const;
+    // Like releaseResident, but pixels no source describes are first
+    // written to spill, which becomes their source.
+    bool spillResident(SpillFile& spill) const;
+    // Bytes of decoded pixels held; 0 while they are still at their source.
+    std::size_t residentBytes() const;
+    // True while every pixel still has the value the buffer was created or
+    // last filled with; such buffers hold no pixel memory until read.
+    bool trySolidColor(PixelRGBA8& color) const;
+
 private:
+    void detach();
+
     int m_width;
     int m_height;
-    std::vector<PixelRGBA8> m_pixels;
+    std::shared_ptr<PlaneStore<PixelRGBA8>> m_pixels;
+};
+
+using CoverageView = BasicImageView<std::uint8_t>;
+using ConstCoverageView = BasicImageView<const std::uint8_t>;
+
+// Single-channel 8-bit layer mask. RGBA pixels are folded to coverage
+// (luma times alpha) when written; reads expand coverage to opaque gray.
+class MaskBuffer {
+public:
+    MaskBuffer();
+    MaskBuffer(int width, int height, std::uint8_t fill = 255);
+    MaskBuffer(int width, int height, const PixelRGBA8& fill);
+    MaskBuffer(int width, int height, std::shared_ptr<const PixelSource> source);
+
+    static std::uint8_t coverageFromPixel(const PixelRGBA8& pixel);
+    static MaskBuffer fromImage(const ImageBuffer& image);
+
+    int width() const;
+    int height() const;
+
+    bool inBounds(int x, int y) const;
+    std::uint8_t coverage(int x, int y) const;
+    void setCoverage(int x, int y, std::uint8_t value);
+    PixelRGBA8 getPixel(int x, int y) const;
+    void setPixel(int x, int y, const PixelRGBA8& pixel);
+    void fill(std::uint8_t value);
+
+    const std::uint8_t* row(int y) const;
+    CoverageView view();
+    ConstCoverageView view() const;
+    ImageBuffer toImage() const;
+
+    bool resident() const;
+    void makeResident() const;
+    const PixelSource* pixelSource() const;
+    bool releaseResident() const;
+    bool spillResident(SpillFile& spill) const;
+    std::size_t residentBytes() const;
+    bool sharesCoverageWith(const MaskBuffer& other) const;
+    bool trySolidCoverage(std::uint8_t& value) const;
+
+private:
+    void detach();
+
+    int m_width;
+    int m_height;
+    std::shared_ptr<PlaneStore<std::uint8_t>> m_coverage;
+};
+
+// Half-size copies of a layer's pixels and mask, built when a composite
+// draws the layer scaled down. Copies of a layer start with an empty cache;
+// moves keep it.
+class MipCache {
+public:
+    struct Level {
+        ImageBuffer image;
+        MaskBuffer mask;
+    };
+
+    MipCache();
+    MipCache(const MipCache& other);
+    MipCache(MipCache&& other) noexcept;
+    MipCache& operator=(const MipCache& other);
+    MipCache& operator=(MipCache&& other) noexcept;
+    ~MipCache();
+
+    // Level `index` (1 is half size) of image and mask as of `revision`,
+    // rebuilding the chain when the revision moved. Safe to call from
+    // several composite workers at once.
+    const Level& level(const ImageBuffer& image, const MaskBuffer* mask, std::uint64_t revision, int index, int threads) const;
+    std::size_t residentBytes() const;
+    // Drops every level; not safe while a composite may be reading them.
+    void clear() const;
+
+private:
+    struct State;
+    std::unique_ptr<State> m_state;
 };
 
 class Layer : public Transformable {
@@ -75,19 +256,53 @@ public:
     void setOffset(int x, int y);
 
     bool hasMask() const;
-    ImageBuffer& ensureMask(const PixelRGBA8& fill = PixelRGBA8(255, 255, 255, 255));
+    MaskBuffer& ensureMask(const PixelRGBA8& fill = PixelRGBA8(255, 255, 255, 255));
     void enableMask(const PixelRGBA8& fill = PixelRGBA8(255, 255, 255, 255));
+    void setMask(MaskBuffer mask);
     void clearMask();
-    ImageBuffer& maskOrThrow();
-    const ImageBuffer& maskOrThrow() const;
-    ImageBuffer& mask();
-    const ImageBuffer& mask() const;
+    MaskBuffer& maskOrThrow();
+    const MaskBuffer& maskOrThrow() const;
+    MaskBuffer& mask();
+    const MaskBuffer& mask() const;
 
     ImageBuffer& image();
     const ImageBuffer& image() const;
     void setImageFromRaster(const RasterImage& source, std::uint8_t alpha = 255);
+    // Replaces the pixels, dropping any mask sized for the old ones.
+    void setImage(ImageBuffer image);
+    // Mutable pixels or mask for an edit confined to a layer-local rect. A
+    // cached composite then redoes only the tiles under the rects edited
+    // since its previous call, if nothing else about the layer changed.
+    ImageBuffer& imageInRect(int x, int y, int width, int height);
+    MaskBuffer& maskInRect(int x, int y, int width, int height);
+
+    std::uint64_t revision() const;
+    // Mip level `index` >= 1 of the pixels and mask (1 is half size), built
+    // with `threads` on first use after the pixels change.
+    const MipCache::Level& mipLevel(int index, int threads = 1) const;
+    const MipCache& mipCache() const;
+    // Union of the rects edited since revision `since`, when every edit
+    // after it was a rect edit.
+    bool changedRect(std::uint64_t& since, int& x0, int& y0, int& x1, int& y1) const;
+
+protected:
+    void transformWillChange() override;
 
 private:
+    // touch() is for pixel and mask edits, touchProperties() for the rest.
+    void touch();
+    void touchProperties();
+    void touchRect(int x, int y, int width, int height);
+
+    std::uint64_t m_revision;
+    std::uint64_t m_pixelRevision;
+    // Rect edits since m_rectBase, valid while m_revision is m_rectRevision.
+    std::uint64_t m_rectBase = 0;
+    std::uint64_t m_rectRevision = 0;
+    int m_rectX0 = 0;
+    int m_rectY0 = 0;
+    int m_rectX1 = 0;
+    int m_rectY1 = 0;
     std::string m_name;
     bool m_visible;
     float m_opacity;
@@ -96,7 +311,8 @@ private:
     int m_offsetY;
     ImageBuffer m_image;
     bool m_hasMask;
-    ImageBuffer m_mask;
+    MaskBuffer m_mask;
+    MipCache m_mips;
 };
 
 class LayerGroup;
@@ -109,7 +325,12 @@ public:
     };
 
     explicit LayerNode(const Layer& layer);
+    explicit LayerNode(Layer&& layer);
     explicit LayerNode(const LayerGroup& group);
+    explicit LayerNode(LayerGroup&& group);
+    explicit LayerNode(std::unique_ptr<LayerGroup> group);
+    template <typename... Args>
+    explicit LayerNode(std::in_place_type_t<Layer> tag, Args&&... args) : m_node(tag, std::forward<Args>(args)...) {}
     LayerNode(const LayerNode& other);
     LayerNode& operator=(const LayerNode& other);
     LayerNode(LayerNode&& other) noexcept;
@@ -127,9 +348,7 @@ public:
     const LayerGroup& asGroup() const;
 
 private:
-    Kind m_kind;
-    Layer m_layer;
-    std::unique_ptr<LayerGroup> m_group;
+    std::variant<Layer, std::unique_ptr<LayerGroup>> m_node;
 };
 
 class LayerGroup : public Transformable {
@@ -154,7 +373,23 @@ public:
     void setOffset(int x, int y);
 
     Layer& addLayer(const Layer& layer);
+    Layer& addLayer(Layer&& layer);
     LayerGroup& addGroup(const LayerGroup& group);
+    LayerGroup& addGroup(LayerGroup&& group);
+
+    template <typename... Args>
+    Layer& emplaceLayer(Args&&... args) {
+        touch();
+        m_nodes.emplace_back(std::in_place_type<Layer>, std::forward<Args>(args)...);
+        return m_nodes.back().asLayer();
+    }
+
+    template <typename... Args>
+    LayerGroup& emplaceGroup(Args&&... args) {
+        touch();
+        m_nodes.emplace_back(std::make_unique<LayerGroup>(std::forward<Args>(args)...));
+        return m_nodes.back().asGroup();
+    }
 
     std::size_t nodeCount() const;
     LayerNode& node(std::size_t index);
@@ -164,7 +399,15 @@ public:
     Layer& layer(std::size_t index);
     const Layer& layer(std::size_t index) const;
 
+    std::uint64_t revision() const;
+
+protected:
+    void transformWillChange() override;
+
 private:
+    void touch();
+
+    std::uint64_t m_revision;
     std::string m_name;
     bool m_visible;
     float m_opacity;
@@ -174,6 +417,62 @@ private:
     std::vector<LayerNode> m_nodes;
 };
 
+struct CompositeOptions {
+    int threads = 0;
+    int tileSize = 128;
+    // Bytes of decoded, file-backed layer pixels compositeRows keeps
+    // resident; least recently used layers are released beyond it. 0 keeps
+    // everything.
+    std::size_t memoryBudget = 0;
+    // Composites straight at this fraction of the document size, in (0, 1]:
+    // the root is scaled onto the smaller output, so layers shrink through
+    // their mip levels and group surfaces are proxy sized.
+    double scale = 1.0;
+};
+
+// A document side composited at scale, rounded and at least 1.
+int scaledExtent(int size, double scale);
+
+// Holds the previous composite so later calls only redo tiles touched by
+// nodes whose revision or bounds changed. Edits must go through the
+// non-const Layer/LayerGroup accessors after the previous composite call.
+class CompositeCache {
+public:
+    CompositeCache();
+
+    struct NodeStamp {
+        bool group;
+        std::size_t childCount;
+        std::uint64_t revision;
+        int x0;
+        int y0;
+        int x1;
+        int y1;
+        // Document bounds of a layer's rect edits since revision rectBase;
+        // rectBase is 0 when its last edit was not a rect edit.
+        std::uint64_t rectBase;
+        int rectX0;
+        int rectY0;
+        int rectX1;
+        int rectY1;
+    };
+
+    void invalidate();
+    std::size_t lastTilesComposited() const;
+
+private:
+    friend class Document;
+
+    bool m_valid;
+    int m_width;
+    int m_height;
+    double m_scale;
+    int m_tileSize;
+    std::size_t m_lastTiles;
+    ImageBuffer m_output;
+    std::vector<NodeStamp> m_stamps;
+};
+
 class Document {
 public:
     Document(int width, int height);
@@ -182,7 +481,19 @@ public:
     int height() const;
 
     Layer& addLayer(const Layer& layer);
+    Layer& addLayer(Layer&& layer);
     LayerGroup& addGroup(const LayerGroup& group);
+    LayerGroup& addGroup(LayerGroup&& group);
+
+    template <typename... Args>
+    Layer& emplaceLayer(Args&&... args) {
+        return m_root.emplaceLayer(std::forward<Args>(args)...);
+    }
+
+    template <typename... Args>
+    LayerGroup& emplaceGroup(Args&&... args) {
+        return m_root.emplaceGroup(std::forward<Args>(args)...);
+    }
 
     std::size_t nodeCount() const;
     LayerNode& node(std::size_t index);
@@ -196,6 +507,13 @@ public:
     const LayerGroup& rootGroup() const;
 
     ImageBuffer composite() const;
+    ImageBuffer composite(const CompositeOptions& options) const;
+    ImageBuffer composite(const CompositeOptions& options, CompositeCache& cache) const;
+    // Streams the composite to sink one band of tileSize rows at a time, top
+    // to bottom, so the whole image never has to exist at once. The view is
+    // only valid during the call.
+    void compositeRows(const CompositeOptions& options,
+                       const std::function<void(int y, const ConstImageView& rows)>& sink) const;
 
 private:
     int m_width;
@@ -203,9 +521,56 @@ private:
     LayerGroup m_root;
 };
 
+// Pixel memory in bytes: full is what the pixels and mask take decoded,
+// the rest what is decoded right now. documentMemoryUsage counts planes
+// shared between layers once.
+struct MemoryUsage {
+    std::size_t full = 0;
+    std::size_t pixels = 0;
+    std::size_t masks = 0;
+    std::size_t mips = 0;
+
+    std::size_t resident() const {
+        return pixels + masks + mips;
+    }
+};
+
+MemoryUsage layerMemoryUsage(const Layer& layer);
+MemoryUsage documentMemoryUsage(const Document& document);
+// Frees decoded layer pixels, least recently edited layer first, until the
+// document's resident bytes fit budget. Pixels a source reproduces (file,
+// generator, solid color) are dropped and others spilled; mip levels go
+// with them. Layers in keep stay. Returns the bytes freed. Not safe while
+// anything reads the document.
+std::size_t enforceMemoryBudget(const Document& document, std::size_t budget, SpillFile& spill,
+                                const std::vector<const Layer*>& keep = {});
+
 ImageBuffer fromRasterImage(const RasterImage& source, std::uint8_t alpha = 255);
 void copyToRasterImage(const ImageBuffer& source, RasterImage& destination);
+// Borrows RGBA rows for the encoders. The rows stay valid while the pixels
+// are neither written nor destroyed.
+PixelRows pixelRows(const ImageBuffer& image);
+PixelRows pixelRows(const ConstImageView& view);
+enum class IFLOWCompression {
+    Auto,
+    None,
+    RLE,
+    LZ4,
+    Deflate
+};
+
+struct IFLOWSaveOptions {
+    // Auto picks the smallest fast codec per chunk and falls back to deflate
+    // for chunks those leave mostly uncompressed.
+    IFLOWCompression compression = IFLOWCompression::Auto;
+    int threads = 0;
+    // Saving to the file the document was loaded from appends changed planes
+    // and a new tree instead of rewriting it, until half the file is dead.
+    bool incremental = true;
+};
+
 bool saveDocumentIFLOW(const Document& document, const std::string& path);
-Document loadDocumentIFLOW(const std::string& path);
+bool saveDocumentIFLOW(const Document& document, const std::string& path, const IFLOWSaveOptions& options);
+Document loadDocumentIFLOW(const std::string& path, int threads = 0);
 
 #endif
@@ -0,0 +1,165 @@
+#include "mapped_file.h"
+
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::MappedFile(const std::string& path)
+    : m_data(nullptr), m_size(0), m_mapped(false), m_device(0), m_inode(0) {
+#if defined(__unix__) || defined(__APPLE__)
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Cannot open file: " + path);
+    }
+    struct stat info {};
+    if (::fstat(fd, &info) == 0) {
+        m_device = static_cast<std::uint64_t>(info.st_dev);
+        m_inode = static_cast<std::uint64_t>(info.st_ino);
+    }
+    if (m_inode != 0 && info.st_size > 0 && S_ISREG(info.st_mode)) {
+        void* mapped = ::mmap(nullptr, static_cast<std::size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped != MAP_FAILED) {
+            m_data = static_cast<const std::uint8_t*>(mapped);
+            m_size = static_cast<std::size_t>(info.st_size);
+            m_mapped = true;
+        }
+    }
+    ::close(fd);
+    if (m_mapped) {
+        return;
+    }
+#endif
+    std::ifstream in(path, std::ios::binary);
+    if (!in.is_open()) {
+        throw std::runtime_error("Cannot open file: " + path);
+    }
+    m_copy.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    m_data = m_copy.data();
+    m_size = m_copy.size();
+}
+
+MappedFile::~MappedFile() {
+#if defined(__unix__) || defined(__APPLE__)
+    if (m_mapped) {
+        ::munmap(const_cast<std::uint8_t*>(m_data), m_size);
+    }
+#endif
+}
+
+const std::uint8_t* MappedFile::data() const {
+    return m_data;
+}
+
+std::size_t MappedFile::size() const {
+    return m_size;
+}
+
+bool MappedFile::isFileAt(const std::string& path) const {
+#if defined(__unix__) || defined(__APPLE__)
+    struct stat info {};
+    return m_inode != 0 && ::stat(path.c_str(), &info) == 0 &&
+           static_cast<std::uint64_t>(info.st_dev) == m_device && static_cast<std::uint64_t>(info.st_ino) == m_inode &&
+           static_cast<std::uint64_t>(info.st_size) >= m_size;
+#else
+    (void)path;
+    return false;
+#endif
+}
+
+MappedOutputFile::MappedOutputFile(const std::string& path, std::size_t size)
+    : m_path(path), m_data(nullptr), m_size(size), m_open(false), m_mapped(false), m_fd(-1) {
+#if defined(__unix__) || defined(__APPLE__)
+    m_fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (m_fd < 0) {
+        return;
+    }
+    // Reserving the blocks up front turns a full disk into a failed save
+    // instead of a fault while the mapping is written.
+#if defined(__linux__)
+    const bool reserved = size == 0 || ::posix_fallocate(m_fd, 0, static_cast<off_t>(size)) == 0;
+#else
+    const bool reserved = false;
+#endif
+    if (reserved && size > 0 && ::ftruncate(m_fd, static_cast<off_t>(size)) == 0) {
+        void* mapped = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+        if (mapped != MAP_FAILED) {
+            m_data = static_cast<std::uint8_t*>(mapped);
+            m_mapped = true;
+            m_open = true;
+            return;
+        }
+    }
+    if (::ftruncate(m_fd, 0) != 0) {
+        release();
+        return;
+    }
+#endif
+    m_copy.assign(size, 0);
+    m_data = m_copy.data();
+    m_open = true;
+}
+
+MappedOutputFile::~MappedOutputFile() {
+    release();
+}
+
+bool MappedOutputFile::isOpen() const {
+    return m_open;
+}
+
+std::uint8_t* MappedOutputFile::data() {
+    return m_data;
+}
+
+std::size_t MappedOutputFile::size() const {
+    return m_size;
+}
+
+bool MappedOutputFile::commit() {
+    if (!m_open) {
+        return false;
+    }
+    bool ok = true;
+    if (!m_mapped) {
+#if defined(__unix__) || defined(__APPLE__)
+        const std::uint8_t* cursor = m_copy.data();
+        std::size_t remaining = m_copy.size();
+        while (ok && remaining > 0) {
+            const ssize_t written = ::write(m_fd, cursor, remaining);
+            ok = written > 0;
+            if (ok) {
+                cursor += written;
+                remaining -= static_cast<std::size_t>(written);
+            }
+        }
+#else
+        std::ofstream out(m_path, std::ios::binary);
+        out.write(reinterpret_cast<const char*>(m_copy.data()), static_cast<std::streamsize>(m_copy.size()));
+        ok = static_cast<bool>(out);
+#endif
+    }
+    release();
+    return ok;
+}
+
+void MappedOutputFile::release() {
+#if defined(__unix__) || defined(__APPLE__)
+    if (m_mapped) {
+        ::munmap(m_data, m_size);
+        m_mapped = false;
+    }
+    if (m_fd >= 0) {
+        ::close(m_fd);
+        m_fd = -1;
+    }
+#endif
+    m_data = nullptr;
+    m_open = false;
+}
@@ -0,0 +1,63 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Read-only view of a whole file. Mapped where the platform allows, so pages
+// nobody reads are never read from disk; otherwise the file is read into
+// memory.
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& path);
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const std::uint8_t* data() const;
+    std::size_t size() const;
+    // True when path still names the file that was mapped, and that file
+    // has not shrunk since.
+    bool isFileAt(const std::string& path) const;
+
+private:
+    const std::uint8_t* m_data;
+    std::size_t m_size;
+    bool m_mapped;
+    std::uint64_t m_device;
+    std::uint64_t m_inode;
+    std::vector<std::uint8_t> m_copy;
+};
+
+// A file of known size filled in place. Where the platform allows, data()
+// is a shared mapping of the file itself; otherwise it is a buffer that
+// commit() writes out. A file that is never committed is left truncated.
+class MappedOutputFile {
+public:
+    MappedOutputFile(const std::string& path, std::size_t size);
+    ~MappedOutputFile();
+
+    MappedOutputFile(const MappedOutputFile&) = delete;
+    MappedOutputFile& operator=(const MappedOutputFile&) = delete;
+
+    bool isOpen() const;
+    std::uint8_t* data();
+    std::size_t size() const;
+    bool commit();
+
+private:
+    void release();
+
+    std::string m_path;
+    std::uint8_t* m_data;
+    std::size_t m_size;
+    bool m_open;
+    bool m_mapped;
+    int m_fd;
+    std::vector<std::uint8_t> m_copy;
+};
+
+#endif
@@ -0,0 +1,157 @@
+#include "parallel.h"
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace {
+// Threads a loop started on this thread may use (0: no enclosing loop),
+// and this thread's slot among those its outermost loop runs on.
+struct WorkerContext {
+    int budget = 0;
+    int slot = 0;
+    int origin = -1;
+};
+
+thread_local WorkerContext t_context;
+
+// Origin ids of threads that started loops themselves; an exited thread's id
+// goes to the next one, so short-lived threads do not use up new ids.
+class OriginIds {
+public:
+    int acquire() {
+        const std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_free.empty()) {
+            return m_next++;
+        }
+        const auto smallest = std::min_element(m_free.begin(), m_free.end());
+        const int id = *smallest;
+        m_free.erase(smallest);
+        return id;
+    }
+
+    void release(int id) {
+        const std::lock_guard<std::mutex> lock(m_mutex);
+        m_free.push_back(id);
+    }
+
+private:
+    std::mutex m_mutex;
+    std::vector<int> m_free;
+    int m_next = 0;
+};
+
+// Never destroyed, so threads exiting during shutdown can still release.
+OriginIds& originIds() {
+    static OriginIds* ids = new OriginIds;
+    return *ids;
+}
+
+struct OwnOrigin {
+    int id = -1;
+
+    ~OwnOrigin() {
+        if (id >= 0) {
+            originIds().release(id);
+        }
+    }
+};
+
+thread_local OwnOrigin t_ownOrigin;
+
+int threadOrigin() {
+    if (t_context.origin >= 0) {
+        return t_context.origin;
+    }
+    if (t_ownOrigin.id < 0) {
+        t_ownOrigin.id = originIds().acquire();
+    }
+    return t_ownOrigin.id;
+}
+} // namespace
+
+int resolveThreadCount(int requested) {
+    int threads = requested;
+    if (threads <= 0) {
+        const unsigned int hardware = std::thread::hardware_concurrency();
+        threads = hardware == 0 ? 1 : static_cast<int>(hardware);
+    }
+    return t_context.budget > 0 ? std::min(threads, t_context.budget) : threads;
+}
+
+int parallelWorkerCount(int count, int threads) {
+    return std::max(1, std::min(resolveThreadCount(threads), count));
+}
+
+void parallelThreadPosition(int& origin, int& slot) {
+    origin = threadOrigin();
+    slot = t_context.slot;
+}
+
+void parallelFor(int count, int threads, const std::function<void(int)>& task) {
+    parallelForWorkers(count, threads, [&task](int index, int) {
+        task(index);
+    });
+}
+
+void parallelForWorkers(int count, int threads, const std::function<void(int index, int worker)>& task) {
+    if (count <= 0) {
+        return;
+    }
+
+    const int budget = resolveThreadCount(threads);
+    const int workers = std::max(1, std::min(budget, count));
+    if (workers <= 1) {
+        for (int i = 0; i < count; ++i) {
+            task(i, 0);
+        }
+        return;
+    }
+
+    std::atomic<int> next(0);
+    std::exception_ptr failure;
+    std::mutex failureMutex;
+    // Each worker's nested loops get an equal share of the threads, so the
+    // whole tree never runs more than budget at once.
+    const WorkerContext parent{t_context.budget, t_context.slot, threadOrigin()};
+    const int share = std::max(1, budget / workers);
+
+    const auto run = [&](int worker) {
+        const WorkerContext saved = t_context;
+        t_context = WorkerContext{share, parent.slot + worker * share, parent.origin};
+        for (;;) {
+            const int index = next.fetch_add(1);
+            if (index >= count) {
+                break;
+            }
+            try {
+                task(index, worker);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(failureMutex);
+                if (!failure) {
+                    failure = std::current_exception();
+                }
+                next.store(count);
+                break;
+            }
+        }
+        t_context = saved;
+    };
+
+    std::vector<std::thread> pool;
+    pool.reserve(static_cast<std::size_t>(workers - 1));
+    for (int i = 1; i < workers; ++i) {
+        pool.emplace_back(run, i);
+    }
+    run(0);
+    for (std::thread& thread : pool) {
+        thread.join();
+    }
+
+    if (failure) {
+        std::rethrow_exception(failure);
+    }
+}
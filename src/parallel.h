@@ -0,0 +1,18 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <functional>
+
+// Inside a parallel loop, counts are capped at the calling worker's share of
+// the loop's threads, so nested loops (an op in a concurrently run layer, an
+// encoder per render target) split the threads instead of multiplying them.
+int resolveThreadCount(int requested);
+int parallelWorkerCount(int count, int threads);
+// origin numbers the thread that started the outermost loop around the
+// caller, smallest free id first, and slot, below that loop's thread count,
+// tells apart the threads running under it at the same time; 0 outside.
+void parallelThreadPosition(int& origin, int& slot);
+void parallelFor(int count, int threads, const std::function<void(int)>& task);
+void parallelForWorkers(int count, int threads, const std::function<void(int index, int worker)>& task);
+
+#endif
@@ -1,17 +1,26 @@
 #include "png.h"
 
+#include "compress.h"
+#include "parallel.h"
+
+#include <algorithm>
 #include <array>
 #include <cstddef>
 #include <cstdint>
+#include <cstdlib>
 #include <fstream>
 #include <limits>
 #include <stdexcept>
 #include <string>
+#include <utility>
 #include <vector>
 
 namespace {
 constexpr std::uint8_t kPNGSignature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
 constexpr std::size_t kMaxImagePixels = 100000000;
+constexpr std::size_t kDeflateSegmentBytes = 256 * 1024;
+// PNGImage::saveRows hands the stream writer bands of about this many bytes.
+constexpr std::size_t kSaveBandBytes = 16 * kDeflateSegmentBytes;
 
 std::size_t pixelIndex(int x, int y, int width) {
     return static_cast<std::size_t>(y) * static_cast<std::size_t>(width) + static_cast<std::size_t>(x);
@@ -28,7 +37,7 @@ void validatePNGDimensions(int width, int height) {
     }
 }
 
-std::uint32_t readU32BE(const std::vector<std::uint8_t>& bytes, std::size_t offset) {
+std::uint32_t readU32BE(const std::uint8_t* bytes, std::size_t offset) {
     return (static_cast<std::uint32_t>(bytes[offset]) << 24) |
            (static_cast<std::uint32_t>(bytes[offset + 1]) << 16) |
            (static_cast<std::uint32_t>(bytes[offset + 2]) << 8) |
@@ -42,37 +51,42 @@ void writeU32BE(std::vector<std::uint8_t>& out, std::uint32_t value) {
     out.push_back(static_cast<std::uint8_t>(value & 0xFF));
 }
 
-std::uint32_t crc32(const std::uint8_t* data, std::size_t len) {
-    static std::array<std::uint32_t, 256> table{};
-    static bool initialized = false;
-    if (!initialized) {
-        for (std::uint32_t i = 0; i < 256; ++i) {
-            std::uint32_t c = i;
-            for (int k = 0; k < 8; ++k) {
-                c = (c & 1U) ? (0xEDB88320U ^ (c >> 1)) : (c >> 1);
-            }
-            table[i] = c;
+std::uint32_t adler32(const std::uint8_t* data, std::size_t len, std::uint32_t adler = 1) {
+    constexpr std::uint32_t mod = 65521;
+    // Largest run of bytes whose sums cannot overflow 32 bits between reductions.
+    constexpr std::size_t nmax = 5552;
+    std::uint32_t a = adler & 0xFFFFU;
+    std::uint32_t b = adler >> 16;
+
+    while (len > 0) {
+        const std::size_t run = len < nmax ? len : nmax;
+        for (std::size_t i = 0; i < run; ++i) {
+            a += data[i];
+            b += a;
         }
-        initialized = true;
+        a %= mod;
+        b %= mod;
+        data += run;
+        len -= run;
     }
-
-    std::uint32_t c = 0xFFFFFFFFU;
-    for (std::size_t i = 0; i < len; ++i) {
-        c = table[(c ^ data[i]) & 0xFFU] ^ (c >> 8);
-    }
-    return c ^ 0xFFFFFFFFU;
+    return (b << 16) | a;
 }
 
-std::uint32_t adler32(const std::uint8_t* data, std::size_t len) {
-    constexpr std::uint32_t mod = 65521;
-    std::uint32_t a = 1;
-    std::uint32_t b = 0;
-
-    for (std::size_t i = 0; i < len; ++i) {
-        a = (a + data[i]) % mod;
-        b = (b + a) % mod;
-    }
-    return (b << 16) | a;
+void appendStoredBlocks(std::vector<std::uint8_t>& out, const std::uint8_t* data, std::size_t size, bool finalBlock) {
+    std::size_t offset = 0;
+    do {
+        const std::size_t remaining = size - offset;
+        const std::uint16_t blockLen = static_cast<std::uint16_t>(remaining > 65535 ? 65535 : remaining);
+        const bool last = finalBlock && offset + blockLen == size;
+        out.push_back(last ? 0x01 : 0x00);
+        const std::uint16_t nlen = static_cast<std::uint16_t>(~blockLen);
+        out.push_back(static_cast<std::uint8_t>(blockLen & 0xFF));
+        out.push_back(static_cast<std::uint8_t>((blockLen >> 8) & 0xFF));
+        out.push_back(static_cast<std::uint8_t>(nlen & 0xFF));
+        out.push_back(static_cast<std::uint8_t>((nlen >> 8) & 0xFF));
+        out.insert(out.end(), data + offset, data + offset + blockLen);
+        offset += blockLen;
+    } while (offset < size);
 }
 
 void appendChunk(std::vector<std::uint8_t>& out, const char type[4], const std::vector<std::uint8_t>& data) {
@@ -87,205 +101,297 @@ void appendChunk(std::vector<std::uint8_t>& out, const char type[4], const std::
     writeU32BE(out, crc);
 }
 
-std::vector<std::uint8_t> zlibCompressStored(const std::vector<std::uint8_t>& input) {
-    std::vector<std::uint8_t> out;
-    out.reserve(input.size() + input.size() / 65535 + 16);
-
-    out.push_back(0x78); // CMF: deflate, 32K window
-    out.push_back(0x01); // FLG: fastest/low compression
-
-    std::size_t offset = 0;
-    while (offset < input.size()) {
-        const std::size_t remaining = input.size() - offset;
-        const std::uint16_t blockLen = static_cast<std::uint16_t>(remaining > 65535 ? 65535 : remaining);
-        const bool finalBlock = (offset + blockLen == input.size());
+// zlib header advertising the level class, as FLEVEL in RFC 1950.
+void appendZlibHeader(std::vector<std::uint8_t>& out, int level) {
+    const int levelClass = level < 2 ? 0 : (level < 6 ? 1 : (level == 6 ? 2 : 3));
+    const int cmf = 0x78; // deflate, 32K window
+    int flg = levelClass << 6;
+    flg += 31 - ((cmf << 8) + flg) % 31;
+    out.push_back(static_cast<std::uint8_t>(cmf));
+    out.push_back(static_cast<std::uint8_t>(flg));
+}
 
-        out.push_back(finalBlock ? 0x01 : 0x00); // BFINAL + BTYPE=00 with padding
+// Deflates data as independent segments on the worker pool, as pigz does.
+// Each segment may still match into the 32K before it, so the ratio stays
+// close to a serial encode.
+void appendDeflateSegments(std::vector<std::uint8_t>& out,
+                           const std::uint8_t* data,
+                           std::size_t size,
+                           std::size_t historySize,
+                           int level,
+                           int threads,
+                           bool last) {
+    const std::size_t segments = std::max<std::size_t>(1, (size + kDeflateSegmentBytes - 1) / kDeflateSegmentBytes);
+    std::vector<std::vector<std::uint8_t>> encoded(segments);
+    parallelFor(static_cast<int>(segments), threads, [&](int index) {
+        const std::size_t offset = static_cast<std::size_t>(index) * kDeflateSegmentBytes;
+        const std::size_t length = std::min(kDeflateSegmentBytes, size - std::min(size, offset));
+        encoded[static_cast<std::size_t>(index)] =
+            deflateSegment(data + offset, length, offset + historySize, level, last && static_cast<std::size_t>(index) + 1 == segments);
+    });
+    for (const std::vector<std::uint8_t>& segment : encoded) {
+        out.insert(out.end(), segment.begin(), segment.end());
+    }
+}
 
-        const std::uint16_t nlen = static_cast<std::uint16_t>(~blockLen);
-        out.push_back(static_cast<std::uint8_t>(blockLen & 0xFF));
-        out.push_back(static_cast<std::uint8_t>((blockLen >> 8) & 0xFF));
-        out.push_back(static_cast<std::uint8_t>(nlen & 0xFF));
-        out.push_back(static_cast<std::uint8_t>((nlen >> 8) & 0xFF));
+std::uint8_t paethPredictor(std::uint8_t a, std::uint8_t b, std::uint8_t c) {
+    const int p = static_cast<int>(a) + static_cast<int>(b) - static_cast<int>(c);
+    const int pa = (p > static_cast<int>(a)) ? (p - static_cast<int>(a)) : (static_cast<int>(a) - p);
+    const int pb = (p > static_cast<int>(b)) ? (p - static_cast<int>(b)) : (static_cast<int>(b) - p);
+    const int pc = (p > static_cast<int>(c)) ? (p - static_cast<int>(c)) : (static_cast<int>(c) - p);
 
-        out.insert(out.end(), input.begin() + static_cast<std::ptrdiff_t>(offset),
-                   input.begin() + static_cast<std::ptrdiff_t>(offset + blockLen));
-        offset += blockLen;
+    if (pa <= pb && pa <= pc) {
+        return a;
     }
-
-    const std::uint32_t adler = adler32(input.data(), input.size());
-    writeU32BE(out, adler);
-    return out;
+    if (pb <= pc) {
+        return b;
+    }
+    return c;
 }
 
-class BitReader {
-public:
-    BitReader(const std::uint8_t* bytes, std::size_t length)
-        : m_bytes(bytes), m_length(length), m_pos(0), m_bit(0) {}
-
-    std::uint32_t readBits(int count) {
-        std::uint32_t value = 0;
-        for (int i = 0; i < count; ++i) {
-            if (m_pos >= m_length) {
-                throw std::runtime_error("Unexpected end of deflate stream");
+// Filters raw scanlines, rawStride bytes apart, into out (a filter byte plus
+// residuals per row), picking per row the filter with the smallest sum of
+// absolute signed residuals, as libpng's heuristic does. previousRow is the
+// raw row above the first one, or null at the top of the image. Level 0
+// leaves rows unfiltered.
+void filterScanlines(const std::uint8_t* raw,
+                     std::size_t rawStride,
+                     const std::uint8_t* previousRow,
+                     std::size_t rowBytes,
+                     std::size_t bpp,
+                     int rows,
+                     int level,
+                     int threads,
+                     std::uint8_t* out) {
+    constexpr int kRowsPerTask = 16;
+    const std::vector<std::uint8_t> zeros(previousRow ? 0 : rowBytes, 0);
+    const std::uint8_t* top = previousRow ? previousRow : zeros.data();
+    const int tasks = (rows + kRowsPerTask - 1) / kRowsPerTask;
+    parallelFor(tasks, threads, [&](int task) {
+        std::vector<std::uint8_t> candidates(5 * rowBytes);
+        const int end = std::min(rows, (task + 1) * kRowsPerTask);
+        for (int y = task * kRowsPerTask; y < end; ++y) {
+            const std::uint8_t* row = raw + static_cast<std::size_t>(y) * rawStride;
+            const std::uint8_t* up = y == 0 ? top : row - rawStride;
+            std::uint8_t* dst = out + static_cast<std::size_t>(y) * (rowBytes + 1);
+            if (level == 0) {
+                dst[0] = 0;
+                std::copy(row, row + rowBytes, dst + 1);
+                continue;
             }
-            const std::uint8_t current = m_bytes[m_pos];
-            const std::uint32_t bitVal = (current >> m_bit) & 1U;
-            value |= (bitVal << i);
-
-            ++m_bit;
-            if (m_bit == 8) {
-                m_bit = 0;
-                ++m_pos;
+            std::array<std::uint64_t, 5> cost{};
+            for (std::size_t x = 0; x < rowBytes; ++x) {
+                const std::uint8_t a = x >= bpp ? row[x - bpp] : 0;
+                const std::uint8_t b = up[x];
+                const std::uint8_t c = x >= bpp ? up[x - bpp] : 0;
+                const std::uint8_t residuals[5] = {
+                    row[x],
+                    static_cast<std::uint8_t>(row[x] - a),
+                    static_cast<std::uint8_t>(row[x] - b),
+                    static_cast<std::uint8_t>(row[x] - static_cast<std::uint8_t>((static_cast<int>(a) + static_cast<int>(b)) / 2)),
+                    static_cast<std::uint8_t>(row[x] - paethPredictor(a, b, c))};
+                for (std::size_t f = 0; f < 5; ++f) {
+                    candidates[f * rowBytes + x] = residuals[f];
+                    cost[f] += static_cast<std::uint64_t>(std::abs(static_cast<int>(static_cast<std::int8_t>(residuals[f]))));
+                }
             }
+            const std::size_t best = static_cast<std::size_t>(std::min_element(cost.begin(), cost.end()) - cost.begin());
+            dst[0] = static_cast<std::uint8_t>(best);
+            std::copy(candidates.begin() + static_cast<std::ptrdiff_t>(best * rowBytes),
+                      candidates.begin() + static_cast<std::ptrdiff_t>((best + 1) * rowBytes), dst + 1);
         }
-        return value;
-    }
+    });
+}
 
-    void alignToByte() {
-        if (m_bit != 0) {
-            m_bit = 0;
-            ++m_pos;
-        }
+// Reverses a row's filter in place; previous is the reconstructed row above
+// (all zero for the first row of a pass).
+void unfilterScanline(std::uint8_t filter, std::uint8_t* row, const std::uint8_t* previous, std::size_t rowBytes, std::size_t bpp) {
+    switch (filter) {
+        case 0:
+            return;
+        case 1:
+            for (std::size_t x = bpp; x < rowBytes; ++x) {
+                row[x] = static_cast<std::uint8_t>(row[x] + row[x - bpp]);
+            }
+            return;
+        case 2:
+            for (std::size_t x = 0; x < rowBytes; ++x) {
+                row[x] = static_cast<std::uint8_t>(row[x] + previous[x]);
+            }
+            return;
+        case 3:
+            for (std::size_t x = 0; x < rowBytes; ++x) {
+                const int a = x >= bpp ? row[x - bpp] : 0;
+                row[x] = static_cast<std::uint8_t>(row[x] + ((a + previous[x]) >> 1));
+            }
+            return;
+        case 4:
+            for (std::size_t x = 0; x < rowBytes; ++x) {
+                const std::uint8_t a = x >= bpp ? row[x - bpp] : 0;
+                const std::uint8_t c = x >= bpp ? previous[x - bpp] : 0;
+                row[x] = static_cast<std::uint8_t>(row[x] + paethPredictor(a, previous[x], c));
+            }
+            return;
+        default:
+            throw std::runtime_error("Unsupported PNG filter type");
     }
+}
 
-    std::uint8_t readByteAligned() {
-        if (m_bit != 0) {
-            throw std::runtime_error("Deflate reader not aligned");
-        }
-        if (m_pos >= m_length) {
-            throw std::runtime_error("Unexpected end of deflate stream");
+struct PNGHeader {
+    int width = 0;
+    int height = 0;
+    int bitDepth = 0;
+    int colorType = -1;
+    bool interlaced = false;
+
+    int channels() const {
+        switch (colorType) {
+            case 0:
+            case 3:
+                return 1;
+            case 2:
+                return 3;
+            case 4:
+                return 2;
+            default:
+                return 4;
         }
-        return m_bytes[m_pos++];
     }
 
-private:
-    const std::uint8_t* m_bytes;
-    std::size_t m_length;
-    std::size_t m_pos;
-    int m_bit;
-};
-
-std::vector<std::uint8_t> zlibDecompressStoredOnly(const std::vector<std::uint8_t>& input) {
-    if (input.size() < 6) {
-        throw std::runtime_error("Invalid zlib stream");
+    std::size_t rowBytes(int pixels) const {
+        return (static_cast<std::size_t>(pixels) * static_cast<std::size_t>(channels() * bitDepth) + 7) / 8;
     }
 
-    const std::uint8_t cmf = input[0];
-    const std::uint8_t flg = input[1];
-    if ((cmf & 0x0F) != 8) {
-        throw std::runtime_error("Unsupported zlib compression method");
+    // Filters operate on whole pixels, or single bytes below 8 bits per pixel.
+    std::size_t filterStride() const {
+        return std::max<std::size_t>(1, static_cast<std::size_t>(channels() * bitDepth) / 8);
     }
-    if (((static_cast<int>(cmf) << 8) + static_cast<int>(flg)) % 31 != 0) {
-        throw std::runtime_error("Corrupt zlib header");
+};
+
+void validatePNGFormat(const PNGHeader& header) {
+    const int depth = header.bitDepth;
+    bool valid = false;
+    switch (header.colorType) {
+        case 0:
+            valid = depth == 1 || depth == 2 || depth == 4 || depth == 8 || depth == 16;
+            break;
+        case 3:
+            valid = depth == 1 || depth == 2 || depth == 4 || depth == 8;
+            break;
+        case 2:
+        case 4:
+        case 6:
+            valid = depth == 8 || depth == 16;
+            break;
+        default:
+            break;
     }
-    if ((flg & 0x20) != 0) {
-        throw std::runtime_error("Preset dictionary not supported");
+    if (!valid) {
+        throw std::runtime_error("Unsupported PNG color type or bit depth");
     }
+}
 
-    const std::size_t deflateOffset = 2;
-    const std::size_t adlerOffset = input.size() - 4;
-    BitReader br(input.data() + deflateOffset, adlerOffset - deflateOffset);
+// Adam7 pass origins and steps; a non-interlaced image is a single pass.
+struct PNGPass {
+    int x0;
+    int y0;
+    int dx;
+    int dy;
+};
 
-    std::vector<std::uint8_t> out;
+constexpr PNGPass kAdam7Passes[7] = {{0, 0, 8, 8}, {4, 0, 8, 8}, {0, 4, 4, 8}, {2, 0, 4, 4},
+                                     {0, 2, 2, 4}, {1, 0, 2, 2}, {0, 1, 1, 2}};
+constexpr PNGPass kSinglePass = {0, 0, 1, 1};
 
-    bool finalBlock = false;
-    while (!finalBlock) {
-        finalBlock = br.readBits(1) != 0;
-        const std::uint32_t btype = br.readBits(2);
-        if (btype != 0) {
-            throw std::runtime_error("Only deflate stored blocks are supported");
-        }
+// Transparency from tRNS: alpha per palette entry, or the one gray or RGB
+// sample value (at the file's bit depth) that is fully transparent.
+struct PNGTransparency {
+    std::vector<std::uint8_t> paletteAlpha;
+    bool hasKey = false;
+    std::uint32_t key[3] = {0, 0, 0};
+};
 
-        br.alignToByte();
-        const std::uint16_t len = static_cast<std::uint16_t>(br.readByteAligned()) |
-                                  (static_cast<std::uint16_t>(br.readByteAligned()) << 8);
-        const std::uint16_t nlen = static_cast<std::uint16_t>(br.readByteAligned()) |
-                                   (static_cast<std::uint16_t>(br.readByteAligned()) << 8);
-        if (static_cast<std::uint16_t>(~len) != nlen) {
-            throw std::runtime_error("Corrupt deflate stored block");
+// Converts one reconstructed row of samples to 8-bit RGB or RGBA (channels
+// is 3 or 4), writing pixel i of the row at out + i * outStep. Sub-byte
+// samples are scaled to 8 bits and 16-bit samples are rounded to 8.
+void expandScanline(const PNGHeader& header,
+                    const std::vector<Color>& palette,
+                    const PNGTransparency& transparency,
+                    const std::uint8_t* row,
+                    int count,
+                    std::uint8_t* out,
+                    std::size_t outStep,
+                    int channels) {
+    const int depth = header.bitDepth;
+    const int samples = header.channels();
+    const std::uint32_t maxSample = (1u << depth) - 1;
+    const auto raw = [&](int index) -> std::uint32_t {
+        if (depth == 8) {
+            return row[index];
         }
-
-        for (std::uint16_t i = 0; i < len; ++i) {
-            out.push_back(br.readByteAligned());
+        if (depth == 16) {
+            return (static_cast<std::uint32_t>(row[2 * index]) << 8) | row[2 * index + 1];
         }
-    }
-
-    const std::uint32_t expectedAdler = readU32BE(input, adlerOffset);
-    const std::uint32_t actualAdler = adler32(out.data(), out.size());
-    if (expectedAdler != actualAdler) {
-        throw std::runtime_error("zlib Adler-32 mismatch");
-    }
-
-    return out;
-}
-
-std::uint8_t paethPredictor(std::uint8_t a, std::uint8_t b, std::uint8_t c) {
-    const int p = static_cast<int>(a) + static_cast<int>(b) - static_cast<int>(c);
-    const int pa = (p > static_cast<int>(a)) ? (p - static_cast<int>(a)) : (static_cast<int>(a) - p);
-    const int pb = (p > static_cast<int>(b)) ? (p - static_cast<int>(b)) : (static_cast<int>(b) - p);
-    const int pc = (p > static_cast<int>(c)) ? (p - static_cast<int>(c)) : (static_cast<int>(c) - p);
-
-    if (pa <= pb && pa <= pc) {
-        return a;
-    }
-    if (pb <= pc) {
-        return b;
-    }
-    return c;
-}
-
-std::vector<std::uint8_t> unfilterScanlines(const std::vector<std::uint8_t>& filtered, int width, int height, int bpp) {
-    const std::size_t rowBytes = static_cast<std::size_t>(width) * static_cast<std::size_t>(bpp);
-    const std::size_t expected = static_cast<std::size_t>(height) * (1 + rowBytes);
-    if (filtered.size() != expected) {
-        throw std::runtime_error("Unexpected PNG scanline size");
-    }
-
-    std::vector<std::uint8_t> out(static_cast<std::size_t>(height) * rowBytes);
-    std::vector<std::uint8_t> prevRow(rowBytes, 0);
-    std::vector<std::uint8_t> curRow(rowBytes, 0);
-
-    std::size_t src = 0;
-    std::size_t dst = 0;
-    for (int y = 0; y < height; ++y) {
-        const std::uint8_t filter = filtered[src++];
-        for (std::size_t x = 0; x < rowBytes; ++x) {
-            const std::uint8_t raw = filtered[src++];
-            const std::uint8_t a = (x >= static_cast<std::size_t>(bpp)) ? curRow[x - bpp] : 0;
-            const std::uint8_t b = prevRow[x];
-            const std::uint8_t c = (x >= static_cast<std::size_t>(bpp)) ? prevRow[x - bpp] : 0;
-
-            std::uint8_t recon = 0;
-            switch (filter) {
-                case 0:
-                    recon = raw;
-                    break;
-                case 1:
-                    recon = static_cast<std::uint8_t>(raw + a);
-                    break;
-                case 2:
-                    recon = static_cast<std::uint8_t>(raw + b);
-                    break;
-                case 3:
-                    recon = static_cast<std::uint8_t>(raw + static_cast<std::uint8_t>((static_cast<int>(a) + static_cast<int>(b)) / 2));
-                    break;
-                case 4:
-                    recon = static_cast<std::uint8_t>(raw + paethPredictor(a, b, c));
-                    break;
-                default:
-                    throw std::runtime_error("Unsupported PNG filter type");
+        const int bit = index * depth;
+        return (row[bit / 8] >> (8 - depth - bit % 8)) & maxSample;
+    };
+    const auto scale = [&](std::uint32_t value) -> std::uint8_t {
+        if (depth == 8) {
+            return static_cast<std::uint8_t>(value);
+        }
+        if (depth == 16) {
+            return static_cast<std::uint8_t>((value * 255 + 32767) / 65535);
+        }
+        return static_cast<std::uint8_t>(value * 255 / maxSample);
+    };
+    for (int i = 0; i < count; ++i, out += outStep) {
+        const int base = i * samples;
+        std::uint8_t alpha = 255;
+        switch (header.colorType) {
+            case 0:
+            case 4: {
+                const std::uint32_t gray = raw(base);
+                out[0] = out[1] = out[2] = scale(gray);
+                if (header.colorType == 4) {
+                    alpha = scale(raw(base + 1));
+                } else if (transparency.hasKey && gray == transparency.key[0]) {
+                    alpha = 0;
+                }
+                break;
+            }
+            case 3: {
+                const std::uint32_t index = raw(base);
+                if (index >= palette.size()) {
+                    throw std::runtime_error("PNG palette index out of range");
+                }
+                const Color& c = palette[index];
+                out[0] = c.r;
+                out[1] = c.g;
+                out[2] = c.b;
+                if (index < transparency.paletteAlpha.size()) {
+                    alpha = transparency.paletteAlpha[index];
+                }
+                break;
+            }
+            default: {
+                const std::uint32_t r = raw(base);
+                const std::uint32_t g = raw(base + 1);
+                const std::uint32_t b = raw(base + 2);
+                out[0] = scale(r);
+                out[1] = scale(g);
+                out[2] = scale(b);
+                if (header.colorType == 6) {
+                    alpha = scale(raw(base + 3));
+                } else if (transparency.hasKey && r == transparency.key[0] && g == transparency.key[1] && b == transparency.key[2]) {
+                    alpha = 0;
+                }
+                break;
             }
-            curRow[x] = recon;
         }
-
-        for (std::size_t x = 0; x < rowBytes; ++x) {
-            out[dst++] = curRow[x];
+        if (channels == 4) {
+            out[3] = alpha;
         }
-        prevRow.swap(curRow);
     }
-
-    return out;
 }
 } // namespace
 
@@ -324,49 +430,172 @@ void PNGImage::setPixel(int x, int y, const Color& color) {
     m_pixels[pixelIndex(x, y, m_width)] = color;
 }
 
-bool PNGImage::save(const std::string& filename) const {
+bool PNGImage::save(const std::string& filename, const PNGSaveOptions& options) const {
     if (m_width <= 0 || m_height <= 0) {
         return false;
     }
+    return saveRows(filename, colorRows(m_pixels.data(), m_width, m_height), options);
+}
+
+bool PNGImage::saveRows(const std::string& filename, const PixelRows& pixels, const PNGSaveOptions& options) {
+    if (pixels.width <= 0 || pixels.height <= 0) {
+        return false;
+    }
+    PNGSaveOptions fileOptions = options;
+    fileOptions.alpha = options.alpha && pixels.channels == 4;
+    const std::size_t rowBytes = static_cast<std::size_t>(pixels.width) * (fileOptions.alpha ? 4 : 3);
+    const int bandRows = static_cast<int>(std::max<std::size_t>(1, kSaveBandBytes / rowBytes));
+    try {
+        PNGStreamWriter writer(filename, pixels.width, pixels.height, fileOptions);
+        for (int y = 0; y < pixels.height; y += bandRows) {
+            PixelRows band = pixels;
+            band.data = pixels.row(y);
+            band.height = std::min(bandRows, pixels.height - y);
+            writer.writeRows(band);
+        }
+        writer.finish();
+    } catch (const std::runtime_error&) {
+        return false;
+    }
+    return true;
+}
+
+PNGStreamWriter::PNGStreamWriter(const std::string& filename, int width, int height, const PNGSaveOptions& options)
+    : m_file(filename, std::ios::binary | std::ios::trunc),
+      m_out(m_file),
+      m_options(options),
+      m_width(width),
+      m_height(height),
+      m_channels(options.alpha ? 4 : 3),
+      m_rowsWritten(0),
+      m_adler(1),
+      m_finished(false) {
+    if (width <= 0 || height <= 0) {
+        throw std::runtime_error("Invalid PNG dimensions");
+    }
+    if (!m_file) {
+        throw std::runtime_error("Cannot open PNG file for writing: " + filename);
+    }
+    writeHeader();
+}
+
+PNGStreamWriter::PNGStreamWriter(std::ostream& out, int width, int height, const PNGSaveOptions& options)
+    : m_out(out),
+      m_options(options),
+      m_width(width),
+      m_height(height),
+      m_channels(options.alpha ? 4 : 3),
+      m_rowsWritten(0),
+      m_adler(1),
+      m_finished(false) {
+    if (width <= 0 || height <= 0) {
+        throw std::runtime_error("Invalid PNG dimensions");
+    }
+    writeHeader();
+}
 
-    std::vector<std::uint8_t> file;
-    file.insert(file.end(), kPNGSignature, kPNGSignature + 8);
+void PNGStreamWriter::writeHeader() {
+    m_out.write(reinterpret_cast<const char*>(kPNGSignature), sizeof(kPNGSignature));
 
     std::vector<std::uint8_t> ihdr;
-    ihdr.reserve(13);
     writeU32BE(ihdr, static_cast<std::uint32_t>(m_width));
     writeU32BE(ihdr, static_cast<std::uint32_t>(m_height));
     ihdr.push_back(8); // bit depth
-    ihdr.push_back(2); // color type RGB
+    ihdr.push_back(m_options.alpha ? 6 : 2); // color type RGBA or RGB
     ihdr.push_back(0); // compression
     ihdr.push_back(0); // filter
     ihdr.push_back(0); // interlace
-    appendChunk(file, "IHDR", ihdr);
-
-    std::vector<std::uint8_t> raw;
-    const std::size_t rowBytes = static_cast<std::size_t>(m_width) * 3;
-    raw.reserve(static_cast<std::size_t>(m_height) * (1 + rowBytes));
-
-    for (int y = 0; y < m_height; ++y) {
-        raw.push_back(0); // filter type 0
-        for (int x = 0; x < m_width; ++x) {
-            const Color& px = m_pixels[pixelIndex(x, y, m_width)];
-            raw.push_back(px.r);
-            raw.push_back(px.g);
-            raw.push_back(px.b);
+    writeChunk("IHDR", ihdr);
+}
+
+void PNGStreamWriter::writeRows(const PixelRows& rows) {
+    if (m_finished || rows.height < 0 || rows.height > m_height - m_rowsWritten) {
+        throw std::logic_error("PNG stream received more rows than its height");
+    }
+    if (rows.width != m_width || (rows.channels != 3 && rows.channels != 4)) {
+        throw std::invalid_argument("PNG stream rows do not match the image");
+    }
+    if (rows.height == 0) {
+        return;
+    }
+    const std::size_t rowBytes = static_cast<std::size_t>(m_width) * static_cast<std::size_t>(m_channels);
+
+    // Rows already in the file's layout are filtered where they are; others
+    // are repacked into m_packed first.
+    const std::uint8_t* raw = rows.data;
+    std::size_t rawStride = rows.strideBytes;
+    if (rows.channels != m_channels) {
+        m_packed.resize(static_cast<std::size_t>(rows.height) * rowBytes);
+        std::uint8_t* dst = m_packed.data();
+        for (int y = 0; y < rows.height; ++y) {
+            const std::uint8_t* src = rows.row(y);
+            for (int x = 0; x < m_width; ++x, src += rows.channels, dst += m_channels) {
+                dst[0] = src[0];
+                dst[1] = src[1];
+                dst[2] = src[2];
+                if (m_channels == 4) {
+                    dst[3] = 255;
+                }
+            }
         }
+        raw = m_packed.data();
+        rawStride = rowBytes;
     }
 
-    std::vector<std::uint8_t> compressed = zlibCompressStored(raw);
-    appendChunk(file, "IDAT", compressed);
-    appendChunk(file, "IEND", {});
+    // The deflate window spans bands: the previous band's tail is kept as history.
+    const std::size_t history = m_history.size();
+    m_history.resize(history + static_cast<std::size_t>(rows.height) * (1 + rowBytes));
+    std::uint8_t* filtered = m_history.data() + history;
+    filterScanlines(raw, rawStride, m_previousRow.empty() ? nullptr : m_previousRow.data(), rowBytes,
+                    static_cast<std::size_t>(m_channels), rows.height, m_options.level, m_options.threads, filtered);
+    const std::size_t filteredSize = m_history.size() - history;
 
-    std::ofstream out(filename, std::ios::binary);
-    if (!out) {
-        return false;
+    std::vector<std::uint8_t> idat;
+    if (m_rowsWritten == 0) {
+        appendZlibHeader(idat, m_options.level);
+    }
+    appendDeflateSegments(idat, filtered, filteredSize, history, m_options.level, m_options.threads, false);
+    m_adler = adler32(filtered, filteredSize, m_adler);
+    m_rowsWritten += rows.height;
+    writeChunk("IDAT", idat);
+
+    const std::uint8_t* last = raw + static_cast<std::size_t>(rows.height - 1) * rawStride;
+    m_previousRow.assign(last, last + rowBytes);
+    const std::size_t keep = std::min<std::size_t>(m_history.size(), 32768);
+    m_history.erase(m_history.begin(), m_history.end() - static_cast<std::ptrdiff_t>(keep));
+}
+
+void PNGStreamWriter::finish() {
+    if (m_finished) {
+        return;
+    }
+    if (m_rowsWritten != m_height) {
+        throw std::logic_error("PNG stream finished before all rows were written");
+    }
+    std::vector<std::uint8_t> tail;
+    appendStoredBlocks(tail, nullptr, 0, true);
+    writeU32BE(tail, m_adler);
+    writeChunk("IDAT", tail);
+    writeChunk("IEND", {});
+    if (m_file.is_open()) {
+        m_file.close();
+    } else {
+        m_out.flush();
+    }
+    m_finished = true;
+    if (!m_out) {
+        throw std::runtime_error("Failed writing PNG stream");
+    }
+}
+
+void PNGStreamWriter::writeChunk(const char type[4], const std::vector<std::uint8_t>& data) {
+    std::vector<std::uint8_t> chunk;
+    chunk.reserve(data.size() + 12);
+    appendChunk(chunk, type, data);
+    m_out.write(reinterpret_cast<const char*>(chunk.data()), static_cast<std::streamsize>(chunk.size()));
+    if (!m_out) {
+        throw std::runtime_error("Failed writing PNG stream");
     }
-    out.write(reinterpret_cast<const char*>(file.data()), static_cast<std::streamsize>(file.size()));
-    return static_cast<bool>(out);
 }
 
 PNGImage PNGImage::load(const std::string& filename) {
@@ -374,71 +603,91 @@ PNGImage PNGImage::load(const std::string& filename) {
     if (!in) {
         throw std::runtime_error("Cannot open PNG file: " + filename);
     }
+    const std::vector<std::uint8_t> bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    PNGImage image;
+    decode(bytes.data(), bytes.size(), {3, [&image](int width, int height) {
+                                            image = PNGImage(width, height);
+                                            return reinterpret_cast<std::uint8_t*>(image.m_pixels.data());
+                                        }});
+    return image;
+}
 
-    std::vector<std::uint8_t> bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
-    if (bytes.size() < 8 || !std::equal(kPNGSignature, kPNGSignature + 8, bytes.begin())) {
+void PNGImage::decode(const std::uint8_t* data, std::size_t size, const PixelTarget& target) {
+    if (size < 8 || !std::equal(kPNGSignature, kPNGSignature + 8, data)) {
         throw std::runtime_error("Not a PNG file");
     }
 
+    // Chunks are checked up front; IDAT payloads are then inflated in place.
     std::size_t pos = 8;
-    int width = 0;
-    int height = 0;
-    int bitDepth = 0;
-    int colorType = -1;
-    int interlace = 0;
+    PNGHeader header;
     bool gotIHDR = false;
     bool gotIEND = false;
-    std::vector<std::uint8_t> idat;
+    std::vector<Color> palette;
+    PNGTransparency transparency;
+    std::vector<std::pair<const std::uint8_t*, std::size_t>> idat;
+    std::size_t idatSize = 0;
 
-    while (pos + 12 <= bytes.size()) {
-        const std::uint32_t length = readU32BE(bytes, pos);
+    while (pos + 12 <= size) {
+        const std::uint32_t length = readU32BE(data, pos);
         pos += 4;
 
-        if (pos + 4 + static_cast<std::size_t>(length) + 4 > bytes.size()) {
+        if (pos + 4 + static_cast<std::size_t>(length) + 4 > size) {
             throw std::runtime_error("Corrupt PNG chunk length");
         }
 
         const std::size_t chunkStart = pos;
-        const char type[5] = {
-            static_cast<char>(bytes[pos]),
-            static_cast<char>(bytes[pos + 1]),
-            static_cast<char>(bytes[pos + 2]),
-            static_cast<char>(bytes[pos + 3]),
-            '\0'};
+        const std::string type(reinterpret_cast<const char*>(data + pos), 4);
         pos += 4;
 
-        const std::uint8_t* dataPtr = bytes.data() + pos;
+        const std::uint8_t* dataPtr = data + pos;
         const std::size_t dataSize = length;
 
-        const std::uint32_t expectedCRC = readU32BE(bytes, pos + dataSize);
-        const std::uint32_t actualCRC = crc32(bytes.data() + chunkStart, 4 + dataSize);
+        const std::uint32_t expectedCRC = readU32BE(data, pos + dataSize);
+        const std::uint32_t actualCRC = crc32(data + chunkStart, 4 + dataSize);
         if (expectedCRC != actualCRC) {
             throw std::runtime_error("PNG CRC mismatch");
         }
 
-        if (std::string(type) == "IHDR") {
+        if (type == "IHDR") {
             if (length != 13) {
                 throw std::runtime_error("Invalid IHDR size");
             }
-            width = static_cast<int>(readU32BE(bytes, pos));
-            height = static_cast<int>(readU32BE(bytes, pos + 4));
-            bitDepth = bytes[pos + 8];
-            colorType = bytes[pos + 9];
-            const std::uint8_t compression = bytes[pos + 10];
-            const std::uint8_t filterMethod = bytes[pos + 11];
-            interlace = bytes[pos + 12];
-
-            validatePNGDimensions(width, height);
-            if (bitDepth != 8 || colorType != 2) {
-                throw std::runtime_error("Only 24-bit RGB PNG is supported");
-            }
-            if (compression != 0 || filterMethod != 0 || interlace != 0) {
+            header.width = static_cast<int>(readU32BE(data, pos));
+            header.height = static_cast<int>(readU32BE(data, pos + 4));
+            header.bitDepth = data[pos + 8];
+            header.colorType = data[pos + 9];
+            const std::uint8_t compression = data[pos + 10];
+            const std::uint8_t filterMethod = data[pos + 11];
+            const std::uint8_t interlace = data[pos + 12];
+
+            validatePNGDimensions(header.width, header.height);
+            validatePNGFormat(header);
+            if (compression != 0 || filterMethod != 0 || interlace > 1) {
                 throw std::runtime_error("Unsupported PNG compression/filter/interlace");
             }
+            header.interlaced = interlace == 1;
             gotIHDR = true;
-        } else if (std::string(type) == "IDAT") {
-            idat.insert(idat.end(), dataPtr, dataPtr + dataSize);
-        } else if (std::string(type) == "IEND") {
+        } else if (type == "PLTE") {
+            if (length % 3 != 0 || length / 3 > 256) {
+                throw std::runtime_error("Invalid PNG palette");
+            }
+            palette.clear();
+            for (std::size_t i = 0; i < dataSize; i += 3) {
+                palette.emplace_back(dataPtr[i], dataPtr[i + 1], dataPtr[i + 2]);
+            }
+        } else if (type == "tRNS") {
+            if (header.colorType == 3) {
+                transparency.paletteAlpha.assign(dataPtr, dataPtr + std::min<std::size_t>(dataSize, 256));
+            } else if ((header.colorType == 0 && dataSize == 2) || (header.colorType == 2 && dataSize == 6)) {
+                transparency.hasKey = true;
+                for (std::size_t c = 0; c < dataSize / 2; ++c) {
+                    transparency.key[c] = (static_cast<std::uint32_t>(dataPtr[2 * c]) << 8) | dataPtr[2 * c + 1];
+                }
+            }
+        } else if (type == "IDAT") {
+            idat.emplace_back(dataPtr, dataSize);
+            idatSize += dataSize;
+        } else if (type == "IEND") {
             gotIEND = true;
             pos += dataSize + 4;
             break;
@@ -450,21 +699,87 @@ PNGImage PNGImage::load(const std::string& filename) {
     if (!gotIHDR || !gotIEND) {
         throw std::runtime_error("PNG missing IHDR or IEND");
     }
-    if (idat.empty()) {
+    if (idatSize < 6) {
         throw std::runtime_error("PNG missing IDAT");
     }
+    if (header.colorType == 3 && palette.empty()) {
+        throw std::runtime_error("PNG palette image missing PLTE");
+    }
 
-    std::vector<std::uint8_t> filtered = zlibDecompressStoredOnly(idat);
-    std::vector<std::uint8_t> raw = unfilterScanlines(filtered, width, height, 3);
-
-    PNGImage image(width, height, Color(0, 0, 0));
-    std::size_t i = 0;
-    for (int y = 0; y < height; ++y) {
-        for (int x = 0; x < width; ++x) {
-            image.setPixel(x, y, Color(raw[i], raw[i + 1], raw[i + 2]));
-            i += 3;
+    // The zlib header and Adler-32 trailer may straddle IDAT chunks.
+    std::size_t frontSpan = 0;
+    const auto takeFront = [&idat, &frontSpan]() {
+        while (idat[frontSpan].second == 0) {
+            ++frontSpan;
         }
+        --idat[frontSpan].second;
+        return *idat[frontSpan].first++;
+    };
+    const std::uint8_t cmf = takeFront();
+    const std::uint8_t flg = takeFront();
+    if ((cmf & 0x0F) != 8) {
+        throw std::runtime_error("Unsupported zlib compression method");
+    }
+    if (((static_cast<int>(cmf) << 8) + static_cast<int>(flg)) % 31 != 0) {
+        throw std::runtime_error("Corrupt zlib header");
+    }
+    if ((flg & 0x20) != 0) {
+        throw std::runtime_error("Preset dictionary not supported");
+    }
+    std::uint32_t expectedAdler = 0;
+    for (int i = 0; i < 4; ++i) {
+        while (idat.back().second == 0) {
+            idat.pop_back();
+        }
+        expectedAdler |= static_cast<std::uint32_t>(idat.back().first[--idat.back().second]) << (8 * i);
     }
 
-    return image;
+    std::size_t nextSpan = frontSpan;
+    Inflater inflater([&idat, &nextSpan](const std::uint8_t*& data, std::size_t& size) {
+        if (nextSpan >= idat.size()) {
+            return false;
+        }
+        data = idat[nextSpan].first;
+        size = idat[nextSpan].second;
+        ++nextSpan;
+        return true;
+    });
+
+    // Scanlines are unfiltered and expanded as they are inflated.
+    const int channels = target.channels;
+    std::uint8_t* pixels = target.allocate(header.width, header.height);
+    const std::size_t stride = header.filterStride();
+    std::uint32_t adler = 1;
+    const PNGPass* passes = header.interlaced ? kAdam7Passes : &kSinglePass;
+    const int passCount = header.interlaced ? 7 : 1;
+    for (int p = 0; p < passCount; ++p) {
+        const PNGPass& pass = passes[p];
+        const int passWidth = header.width > pass.x0 ? (header.width - pass.x0 + pass.dx - 1) / pass.dx : 0;
+        const int passHeight = header.height > pass.y0 ? (header.height - pass.y0 + pass.dy - 1) / pass.dy : 0;
+        if (passWidth == 0 || passHeight == 0) {
+            continue;
+        }
+        const std::size_t rowBytes = header.rowBytes(passWidth);
+        std::vector<std::uint8_t> previous(rowBytes, 0);
+        std::vector<std::uint8_t> current(rowBytes + 1);
+        for (int row = 0; row < passHeight; ++row) {
+            if (inflater.read(current.data(), current.size()) != current.size()) {
+                throw std::runtime_error("Truncated PNG image data");
+            }
+            adler = adler32(current.data(), current.size(), adler);
+            unfilterScanline(current[0], current.data() + 1, previous.data(), rowBytes, stride);
+            const int y = pass.y0 + row * pass.dy;
+            expandScanline(header, palette, transparency, current.data() + 1, passWidth,
+                           pixels + pixelIndex(pass.x0, y, header.width) * static_cast<std::size_t>(channels),
+                           static_cast<std::size_t>(pass.dx * channels), channels);
+            std::copy(current.begin() + 1, current.end(), previous.begin());
+        }
+    }
+    std::uint8_t extra = 0;
+    if (inflater.read(&extra, 1) != 0) {
+        throw std::runtime_error("PNG image data is longer than expected");
+    }
+    if (adler != expectedAdler) {
+        throw std::runtime_error("zlib Adler-32 mismatch");
+    }
 }
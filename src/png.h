@@ -1,11 +1,25 @@
 #ifndef PNG_H
 #define PNG_H
 
+#include "compress.h"
 #include "image.h"
 
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <ostream>
 #include <string>
 #include <vector>
 
+// Deflate level (0 stores, 9 is smallest) and worker threads for the
+// parallel encoder; 0 threads uses all cores. RGBA rows keep their alpha as
+// color type 6 unless alpha is off.
+struct PNGSaveOptions {
+    int level = kDefaultDeflateLevel;
+    int threads = 0;
+    bool alpha = true;
+};
+
 class PNGImage : public RasterImage {
 public:
     PNGImage();
@@ -18,8 +32,12 @@ public:
     const Color& getPixel(int x, int y) const override;
     void setPixel(int x, int y, const Color& color) override;
 
-    bool save(const std::string& filename) const;
+    bool save(const std::string& filename, const PNGSaveOptions& options = PNGSaveOptions()) const;
+    // Encodes borrowed rows band by band without copying the whole image.
+    static bool saveRows(const std::string& filename, const PixelRows& pixels, const PNGSaveOptions& options = PNGSaveOptions());
     static PNGImage load(const std::string& filename);
+    // RGBA targets keep alpha from the file, including tRNS transparency.
+    static void decode(const std::uint8_t* data, std::size_t size, const PixelTarget& target);
 
 private:
     int m_width;
@@ -27,4 +45,36 @@ private:
     std::vector<Color> m_pixels;
 };
 
+// Encodes a PNG as rows arrive, writing each band as its own IDAT chunk, so
+// images larger than memory can be saved while they are produced. The file is
+// RGBA when options.alpha is set (RGB bands are then opaque) and RGB
+// otherwise. Bands already in the file's layout are filtered in place.
+// Failures throw. The stream constructor writes to out, which must outlive
+// the writer.
+class PNGStreamWriter {
+public:
+    PNGStreamWriter(const std::string& filename, int width, int height, const PNGSaveOptions& options = PNGSaveOptions());
+    PNGStreamWriter(std::ostream& out, int width, int height, const PNGSaveOptions& options = PNGSaveOptions());
+
+    void writeRows(const PixelRows& rows);
+    void finish();
+
+private:
+    void writeHeader();
+    void writeChunk(const char type[4], const std::vector<std::uint8_t>& data);
+
+    std::ofstream m_file;
+    std::ostream& m_out;
+    PNGSaveOptions m_options;
+    std::vector<std::uint8_t> m_previousRow;
+    std::vector<std::uint8_t> m_packed;
+    std::vector<std::uint8_t> m_history;
+    int m_width;
+    int m_height;
+    int m_channels;
+    int m_rowsWritten;
+    std::uint32_t m_adler;
+    bool m_finished;
+};
+
 #endif
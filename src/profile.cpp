@@ -0,0 +1,196 @@
+#include "profile.h"
+
+#include "parallel.h"
+
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <atomic>
+#include <iomanip>
+#include <map>
+#include <mutex>
+#include <utility>
+
+namespace {
+std::atomic<bool> g_enabled(false);
+std::atomic<std::uint64_t> g_allocations(0);
+std::atomic<std::uint64_t> g_allocatedBytes(0);
+
+struct ProfileLog {
+    std::mutex mutex;
+    std::vector<ProfileEvent> events;
+    std::chrono::steady_clock::time_point origin = std::chrono::steady_clock::now();
+};
+
+ProfileLog& profileLog() {
+    static ProfileLog log;
+    return log;
+}
+
+// Trace rows follow parallel worker slots rather than thread identity, since
+// every parallel loop starts new threads: row 1000 * origin + slot, so the
+// main thread (normally origin 0) and its workers fill rows below
+// --threads, and emit writers or background decodes get their own range.
+int profileThreadId() {
+    int origin = 0;
+    int slot = 0;
+    parallelThreadPosition(origin, slot);
+    return origin * 1000 + slot;
+}
+
+long peakRssKiB() {
+    rusage usage{};
+    return getrusage(RUSAGE_SELF, &usage) == 0 ? usage.ru_maxrss : 0;
+}
+
+std::string jsonString(const std::string& value) {
+    std::string out = "\"";
+    for (char c : value) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            out += ' ';
+        } else {
+            out += c;
+        }
+    }
+    return out + "\"";
+}
+} // namespace
+
+void setProfilingEnabled(bool enabled) {
+    profileLog();
+    g_enabled.store(enabled, std::memory_order_relaxed);
+}
+
+bool profilingEnabled() {
+    return g_enabled.load(std::memory_order_relaxed);
+}
+
+void profileAllocation(std::size_t bytes) {
+    if (!profilingEnabled()) {
+        return;
+    }
+    g_allocations.fetch_add(1, std::memory_order_relaxed);
+    g_allocatedBytes.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+std::vector<ProfileEvent> takeProfileEvents() {
+    ProfileLog& log = profileLog();
+    const std::lock_guard<std::mutex> lock(log.mutex);
+    std::vector<ProfileEvent> events = std::move(log.events);
+    log.events.clear();
+    std::sort(events.begin(), events.end(),
+              [](const ProfileEvent& a, const ProfileEvent& b) { return a.startNs < b.startNs; });
+    return events;
+}
+
+ProfileScope::ProfileScope(const char* category) : m_active(profilingEnabled()), m_category(category) {
+    if (m_active) {
+        m_allocations = g_allocations.load(std::memory_order_relaxed);
+        m_allocatedBytes = g_allocatedBytes.load(std::memory_order_relaxed);
+        m_start = std::chrono::steady_clock::now();
+    }
+}
+
+ProfileScope::ProfileScope(const char* category, const std::string& name) : ProfileScope(category) {
+    if (m_active) {
+        m_name = name;
+    }
+}
+
+ProfileScope::~ProfileScope() {
+    if (!m_active) {
+        return;
+    }
+    const auto stop = std::chrono::steady_clock::now();
+    ProfileLog& log = profileLog();
+    ProfileEvent event;
+    event.category = m_category;
+    event.name = std::move(m_name);
+    event.startNs = static_cast<std::uint64_t>(
+        std::max<std::int64_t>(0, std::chrono::duration_cast<std::chrono::nanoseconds>(m_start - log.origin).count()));
+    event.durationNs = static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(stop - m_start).count());
+    event.pixels = m_pixels;
+    event.allocations = g_allocations.load(std::memory_order_relaxed) - m_allocations;
+    event.allocatedBytes = g_allocatedBytes.load(std::memory_order_relaxed) - m_allocatedBytes;
+    event.peakRssKiB = peakRssKiB();
+    event.thread = profileThreadId();
+    const std::lock_guard<std::mutex> lock(log.mutex);
+    log.events.push_back(std::move(event));
+}
+
+void ProfileScope::setName(std::string name) {
+    if (m_active) {
+        m_name = std::move(name);
+    }
+}
+
+void ProfileScope::addPixels(std::uint64_t pixels) {
+    m_pixels += pixels;
+}
+
+void writeProfileSummary(std::ostream& out, const std::vector<ProfileEvent>& events) {
+    struct Total {
+        std::size_t count = 0;
+        std::uint64_t durationNs = 0;
+        std::uint64_t pixels = 0;
+        std::uint64_t allocations = 0;
+        std::uint64_t allocatedBytes = 0;
+        long peakRssKiB = 0;
+    };
+    std::map<std::pair<std::string, std::string>, Total> totals;
+    for (const ProfileEvent& event : events) {
+        Total& total = totals[{event.category, event.name}];
+        ++total.count;
+        total.durationNs += event.durationNs;
+        total.pixels += event.pixels;
+        total.allocations += event.allocations;
+        total.allocatedBytes += event.allocatedBytes;
+        total.peakRssKiB = std::max(total.peakRssKiB, event.peakRssKiB);
+    }
+    std::vector<std::pair<std::pair<std::string, std::string>, Total>> rows(totals.begin(), totals.end());
+    std::stable_sort(rows.begin(), rows.end(),
+                     [](const auto& a, const auto& b) { return a.second.durationNs > b.second.durationNs; });
+
+    const std::ios::fmtflags flags = out.flags();
+    const std::streamsize precision = out.precision();
+    out << std::left << std::setw(10) << "category" << std::setw(40) << "name" << std::right << std::setw(7) << "count"
+        << std::setw(12) << "total ms" << std::setw(11) << "mean ms" << std::setw(13) << "pixels" << std::setw(8) << "allocs"
+        << std::setw(10) << "alloc MiB" << std::setw(10) << "peak MiB" << "\n";
+    out << std::fixed;
+    for (const auto& row : rows) {
+        const Total& total = row.second;
+        std::string name = row.first.second;
+        if (name.size() > 38) {
+            name = name.substr(0, 35) + "...";
+        }
+        out << std::left << std::setw(10) << row.first.first << std::setw(40) << name << std::right << std::setw(7)
+            << total.count << std::setprecision(2) << std::setw(12) << static_cast<double>(total.durationNs) / 1e6
+            << std::setprecision(3) << std::setw(11) << static_cast<double>(total.durationNs) / 1e6 / static_cast<double>(total.count)
+            << std::setw(13) << total.pixels << std::setw(8) << total.allocations << std::setprecision(1) << std::setw(10)
+            << static_cast<double>(total.allocatedBytes) / (1024.0 * 1024.0) << std::setw(10)
+            << static_cast<double>(total.peakRssKiB) / 1024.0 << "\n";
+    }
+    out.flags(flags);
+    out.precision(precision);
+}
+
+void writeChromeTrace(std::ostream& out, const std::vector<ProfileEvent>& events) {
+    const std::ios::fmtflags flags = out.flags();
+    const std::streamsize precision = out.precision();
+    out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n" << std::fixed << std::setprecision(3);
+    for (std::size_t i = 0; i < events.size(); ++i) {
+        const ProfileEvent& event = events[i];
+        out << "{\"name\": " << jsonString(event.name.empty() ? event.category : event.name)
+            << ", \"cat\": " << jsonString(event.category) << ", \"ph\": \"X\", \"pid\": 1, \"tid\": " << event.thread
+            << ", \"ts\": " << static_cast<double>(event.startNs) / 1e3 << ", \"dur\": " << static_cast<double>(event.durationNs) / 1e3
+            << ", \"args\": {\"pixels\": " << event.pixels << ", \"allocations\": " << event.allocations
+            << ", \"allocated_bytes\": " << event.allocatedBytes << ", \"peak_rss_kib\": " << event.peakRssKiB << "}}"
+            << (i + 1 < events.size() ? ",\n" : "\n");
+    }
+    out << "]}\n";
+    out.flags(flags);
+    out.precision(precision);
+}
@@ -0,0 +1,68 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// One timed span. Allocation counts are process-wide while the span was
+// open, so spans running concurrently share them; peak RSS is the process
+// high-water mark when the span closed.
+struct ProfileEvent {
+    std::string category;
+    std::string name;
+    std::uint64_t startNs = 0;
+    std::uint64_t durationNs = 0;
+    std::uint64_t pixels = 0;
+    std::uint64_t allocations = 0;
+    std::uint64_t allocatedBytes = 0;
+    long peakRssKiB = 0;
+    int thread = 0;
+};
+
+// Spans are only recorded while profiling is on; otherwise opening one is a
+// single atomic load.
+void setProfilingEnabled(bool enabled);
+bool profilingEnabled();
+// Counts a pixel buffer allocation toward the spans open at the time.
+void profileAllocation(std::size_t bytes);
+// The spans recorded so far, oldest first; clears them.
+std::vector<ProfileEvent> takeProfileEvents();
+
+// Records a span from construction to destruction when profiling was on at
+// construction. Names are set afterwards so disabled spans build none.
+class ProfileScope {
+public:
+    explicit ProfileScope(const char* category);
+    ProfileScope(const char* category, const std::string& name);
+    ~ProfileScope();
+
+    ProfileScope(const ProfileScope&) = delete;
+    ProfileScope& operator=(const ProfileScope&) = delete;
+
+    bool active() const {
+        return m_active;
+    }
+    void setName(std::string name);
+    void addPixels(std::uint64_t pixels);
+
+private:
+    bool m_active;
+    const char* m_category;
+    std::string m_name;
+    std::uint64_t m_pixels = 0;
+    std::uint64_t m_allocations = 0;
+    std::uint64_t m_allocatedBytes = 0;
+    std::chrono::steady_clock::time_point m_start;
+};
+
+// Spans grouped by category and name, slowest total first.
+void writeProfileSummary(std::ostream& out, const std::vector<ProfileEvent>& events);
+// Chrome trace-event JSON (chrome://tracing, Perfetto) with one complete
+// event per span.
+void writeChromeTrace(std::ostream& out, const std::vector<ProfileEvent>& events);
+
+#endif
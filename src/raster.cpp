@@ -0,0 +1,144 @@
+#include "raster.h"
+
+#include <algorithm>
+#include <cmath>
+
+void ScanlineRasterizer::sortEdges(RasterEdge* edges, std::size_t count) {
+    std::sort(edges, edges + count, [](const RasterEdge& a, const RasterEdge& b) { return a.y0 < b.y0; });
+}
+
+void ScanlineRasterizer::addCoverage(double x0, double x1) {
+    x0 = std::max(x0, static_cast<double>(m_left));
+    x1 = std::min(x1, static_cast<double>(m_right));
+    if (x1 <= x0) {
+        return;
+    }
+    const int i0 = static_cast<int>(std::floor(x0));
+    const int i1 = static_cast<int>(std::floor(x1));
+    m_touchedLeft = std::min(m_touchedLeft, i0);
+    m_touchedRight = std::max(m_touchedRight, i1);
+    const std::size_t j0 = static_cast<std::size_t>(i0 - m_left);
+    const std::size_t j1 = static_cast<std::size_t>(i1 - m_left);
+    if (i0 == i1) {
+        m_partial[j0] += static_cast<float>(x1 - x0);
+        return;
+    }
+    m_partial[j0] += static_cast<float>(i0 + 1 - x0);
+    m_full[j0 + 1] += 1;
+    m_full[j1] -= 1;
+    m_partial[j1] += static_cast<float>(x1 - i1);
+}
+
+void ScanlineRasterizer::rasterize(const RasterEdge* edges,
+                                   std::size_t count,
+                                   FillRule rule,
+                                   RasterSampling sampling,
+                                   int top,
+                                   int bottom,
+                                   int left,
+                                   int right,
+                                   const RowSink& emit) {
+    if (count == 0 || top >= bottom || left >= right) {
+        return;
+    }
+    m_left = left;
+    m_right = right;
+    const bool antialias = sampling == RasterSampling::Coverage;
+    const std::size_t columns = static_cast<std::size_t>(right - left) + 2;
+    if (antialias && m_partial.size() < columns) {
+        m_partial.assign(columns, 0.0f);
+        m_full.assign(columns, 0);
+    }
+    m_active.clear();
+    std::size_t next = 0;
+    const int samples = antialias ? kSubScanlines : 1;
+    for (int y = top; y < bottom; ++y) {
+        m_spans.clear();
+        m_touchedLeft = right;
+        m_touchedRight = left - 1;
+        for (int sub = 0; sub < samples; ++sub) {
+            const double sampleY = y + (sub + 0.5) / samples;
+            while (next < count && edges[next].y0 <= sampleY) {
+                if (edges[next].y1 > sampleY) {
+                    m_active.push_back(&edges[next]);
+                }
+                ++next;
+            }
+            m_active.erase(std::remove_if(m_active.begin(), m_active.end(), [sampleY](const RasterEdge* e) { return e->y1 <= sampleY; }),
+                           m_active.end());
+            if (m_active.size() < 2) {
+                continue;
+            }
+            m_crossings.clear();
+            for (const RasterEdge* e : m_active) {
+                const double t = (sampleY - e->y0) / (e->y1 - e->y0);
+                m_crossings.emplace_back(e->x0 + t * (e->x1 - e->x0), e->winding);
+            }
+            // Crossings keep nearly the same order from sample to sample.
+            for (std::size_t i = 1; i < m_crossings.size(); ++i) {
+                for (std::size_t j = i; j > 0 && m_crossings[j].first < m_crossings[j - 1].first; --j) {
+                    std::swap(m_crossings[j], m_crossings[j - 1]);
+                }
+            }
+            int winding = 0;
+            for (std::size_t i = 0; i + 1 < m_crossings.size(); ++i) {
+                winding += m_crossings[i].second;
+                const bool inside = rule == FillRule::EvenOdd ? (winding & 1) != 0 : winding != 0;
+                if (!inside) {
+                    continue;
+                }
+                if (antialias) {
+                    addCoverage(m_crossings[i].first, m_crossings[i + 1].first);
+                    continue;
+                }
+                // Pixels whose center x + 0.5 lies in [crossing, next crossing),
+                // or for Inclusive the columns from ceil to floor of the pair.
+                int x0 = 0;
+                int x1 = 0;
+                if (sampling == RasterSampling::Inclusive) {
+                    x0 = std::max(left, static_cast<int>(std::ceil(m_crossings[i].first)));
+                    x1 = std::min(right, static_cast<int>(std::floor(m_crossings[i + 1].first)) + 1);
+                    // Spans meeting on a column share it rather than cover it twice.
+                    if (!m_spans.empty()) {
+                        x0 = std::max(x0, m_spans.back().x + m_spans.back().length);
+                    }
+                } else {
+                    x0 = std::max(left, static_cast<int>(std::ceil(m_crossings[i].first - 0.5)));
+                    x1 = std::min(right, static_cast<int>(std::ceil(m_crossings[i + 1].first - 0.5)));
+                }
+                if (x0 >= x1) {
+                    continue;
+                }
+                if (!m_spans.empty() && m_spans.back().x + m_spans.back().length == x0) {
+                    m_spans.back().length += x1 - x0;
+                } else {
+                    m_spans.push_back({x0, x1 - x0, 1.0f});
+                }
+            }
+        }
+        if (antialias) {
+            int fullCount = 0;
+            for (int x = m_touchedLeft; x <= m_touchedRight; ++x) {
+                const std::size_t j = static_cast<std::size_t>(x - left);
+                fullCount += m_full[j];
+                const float coverage = std::min(1.0f, (static_cast<float>(fullCount) + m_partial[j]) / kSubScanlines);
+                m_full[j] = 0;
+                m_partial[j] = 0.0f;
+                if (x >= right || coverage <= 0.0f) {
+                    continue;
+                }
+                if (!m_spans.empty() && m_spans.back().x + m_spans.back().length == x && m_spans.back().coverage == coverage) {
+                    ++m_spans.back().length;
+                } else {
+                    m_spans.push_back({x, 1, coverage});
+                }
+            }
+        }
+        if (!m_spans.empty()) {
+            emit(y, m_spans);
+        }
+        if (next == count && m_active.empty()) {
+            break;
+        }
+    }
+}
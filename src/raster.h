@@ -0,0 +1,101 @@
+#ifndef RASTER_H
+#define RASTER_H
+
+#include <cstddef>
+#include <functional>
+#include <utility>
+#include <vector>
+
+enum class FillRule { NonZero, EvenOdd };
+
+// How rasterize decides which pixels a span between two crossings takes:
+// those whose center is in [a, b), every column in [a, b] (the integer
+// polygon rule, so vertical edges on whole columns keep both ends), or the
+// exact antialiased coverage.
+enum class RasterSampling { Centers, Inclusive, Coverage };
+
+// Polygon edge in pixel space, where pixel (x, y) covers [x, x + 1) x
+// [y, y + 1). Edges run top to bottom (y0 < y1); winding records the
+// original direction.
+struct RasterEdge {
+    double x0;
+    double y0;
+    double x1;
+    double y1;
+    int winding;
+};
+
+// Appends the edge from a to b, dropping horizontal ones.
+inline void addRasterEdge(std::vector<RasterEdge>& edges, double ax, double ay, double bx, double by) {
+    if (ay == by) {
+        return;
+    }
+    if (ay < by) {
+        edges.push_back({ax, ay, bx, by, 1});
+    } else {
+        edges.push_back({bx, by, ax, ay, -1});
+    }
+}
+
+// Appends the closed polygon through points, shifted by (dx, dy).
+template <typename Point>
+void addPolygonEdges(std::vector<RasterEdge>& edges, const std::vector<Point>& points, double dx = 0.0, double dy = 0.0) {
+    for (std::size_t i = 0; i < points.size(); ++i) {
+        const Point& a = points[i];
+        const Point& b = points[(i + 1) % points.size()];
+        addRasterEdge(edges, static_cast<double>(a.first) + dx, static_cast<double>(a.second) + dy, static_cast<double>(b.first) + dx,
+                      static_cast<double>(b.second) + dy);
+    }
+}
+
+// Run of pixels [x, x + length) on one row sharing a coverage in (0, 1].
+struct CoverageSpan {
+    int x;
+    int length;
+    float coverage;
+};
+
+// Scanline polygon fill over a sorted edge table. Edges enter an active
+// list as the sample line reaches their top and leave past their bottom,
+// so each sample only looks at the edges crossing it. With Coverage, every
+// row is sampled on four sub-scanlines and each inside span adds its exact
+// horizontal extent to the pixels it crosses; otherwise rows are sampled
+// at their center. One rasterizer per thread; it keeps its scratch.
+class ScanlineRasterizer {
+public:
+    static constexpr int kSubScanlines = 4;
+
+    using RowSink = std::function<void(int y, const std::vector<CoverageSpan>& spans)>;
+
+    // Sorts edges by their top, as rasterize expects.
+    static void sortEdges(RasterEdge* edges, std::size_t count);
+
+    // Emits the covered spans of rows [top, bottom), clipped to columns
+    // [left, right), for rows that have any.
+    void rasterize(const RasterEdge* edges,
+                   std::size_t count,
+                   FillRule rule,
+                   RasterSampling sampling,
+                   int top,
+                   int bottom,
+                   int left,
+                   int right,
+                   const RowSink& emit);
+
+private:
+    void addCoverage(double x0, double x1);
+
+    std::vector<const RasterEdge*> m_active;
+    std::vector<std::pair<double, int>> m_crossings;
+    std::vector<CoverageSpan> m_spans;
+    // Partial coverage of span end pixels, and a difference array of fully
+    // covered pixels, both summed over the row's sub-scanlines.
+    std::vector<float> m_partial;
+    std::vector<int> m_full;
+    int m_left = 0;
+    int m_right = 0;
+    int m_touchedLeft = 0;
+    int m_touchedRight = 0;
+};
+
+#endif
@@ -0,0 +1,275 @@
+#include "resample.h"
+
+#include "parallel.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace {
+// Source taps of each output index along one axis: a contiguous run of
+// count indices from start, with weights that sum to one.
+struct AxisWeights {
+    std::vector<int> start;
+    std::vector<int> count;
+    std::vector<std::size_t> offset;
+    std::vector<float> weights;
+};
+
+constexpr double kPi = 3.14159265358979323846;
+
+double lanczos3(double x) {
+    const double t = std::abs(x);
+    if (t < 1.0e-9) {
+        return 1.0;
+    }
+    if (t >= 3.0) {
+        return 0.0;
+    }
+    const double px = kPi * t;
+    return 3.0 * std::sin(px) * std::sin(px / 3.0) / (px * px);
+}
+
+// Mitchell-Netravali cubic with parameters b and c, nonzero on (-2, 2).
+double cubicBC(double x, double b, double c) {
+    const double t = std::abs(x);
+    if (t < 1.0) {
+        return ((12.0 - 9.0 * b - 6.0 * c) * t * t * t + (-18.0 + 12.0 * b + 6.0 * c) * t * t + (6.0 - 2.0 * b)) / 6.0;
+    }
+    if (t < 2.0) {
+        return ((-b - 6.0 * c) * t * t * t + (6.0 * b + 30.0 * c) * t * t + (-12.0 * b - 48.0 * c) * t + (8.0 * b + 24.0 * c)) / 6.0;
+    }
+    return 0.0;
+}
+
+double kernelRadius(ResampleFilter filter) {
+    return filter == ResampleFilter::Lanczos3 ? 3.0 : 2.0;
+}
+
+double kernelWeight(ResampleFilter filter, double x) {
+    switch (filter) {
+    case ResampleFilter::Lanczos3:
+        return lanczos3(x);
+    case ResampleFilter::Mitchell:
+        return cubicBC(x, 1.0 / 3.0, 1.0 / 3.0);
+    default:
+        return cubicBC(x, 0.0, 0.5);
+    }
+}
+
+// Taps of output index i for the filters that are not a kernel.
+int simpleTaps(int srcSize, int dstSize, int i, ResampleFilter filter, std::vector<double>& taps) {
+    const double scale = static_cast<double>(srcSize) / static_cast<double>(dstSize);
+    if (filter == ResampleFilter::Nearest) {
+        taps.push_back(1.0);
+        return std::clamp(static_cast<int>(std::floor((static_cast<double>(i) + 0.5) * scale)), 0, srcSize - 1);
+    }
+    if (filter == ResampleFilter::Area && dstSize < srcSize) {
+        const double left = static_cast<double>(i) * scale;
+        const double right = static_cast<double>(i + 1) * scale;
+        const int first = std::min(srcSize - 1, static_cast<int>(std::floor(left)));
+        const int last = std::min(srcSize - 1, static_cast<int>(std::ceil(right)) - 1);
+        for (int j = first; j <= last; ++j) {
+            taps.push_back(std::max(0.0, std::min(right, static_cast<double>(j + 1)) - std::max(left, static_cast<double>(j))));
+        }
+        return first;
+    }
+    const double center = (static_cast<double>(i) + 0.5) * scale - 0.5;
+    const int lower = static_cast<int>(std::floor(center));
+    const double fraction = center - static_cast<double>(lower);
+    const int first = std::clamp(lower, 0, srcSize - 1);
+    const int second = std::clamp(lower + 1, 0, srcSize - 1);
+    if (second == first) {
+        taps.push_back(1.0);
+    } else {
+        taps.push_back(1.0 - fraction);
+        taps.push_back(fraction);
+    }
+    return first;
+}
+
+// Kernel taps, stretched by the scale when shrinking. Taps past an edge
+// fold onto the edge pixel.
+int kernelTaps(int srcSize, int dstSize, int i, ResampleFilter filter, std::vector<double>& taps) {
+    const double scale = static_cast<double>(srcSize) / static_cast<double>(dstSize);
+    const double stretch = std::max(1.0, scale);
+    const double support = kernelRadius(filter) * stretch;
+    const double center = (static_cast<double>(i) + 0.5) * scale;
+    const int low = static_cast<int>(std::ceil(center - support - 0.5));
+    const int high = static_cast<int>(std::floor(center + support - 0.5));
+    const int first = std::clamp(low, 0, srcSize - 1);
+    const int last = std::clamp(high, 0, srcSize - 1);
+    taps.assign(static_cast<std::size_t>(last - first + 1), 0.0);
+    for (int j = low; j <= high; ++j) {
+        const double weight = kernelWeight(filter, (static_cast<double>(j) + 0.5 - center) / stretch);
+        taps[static_cast<std::size_t>(std::clamp(j, 0, srcSize - 1) - first)] += weight;
+    }
+    return first;
+}
+
+AxisWeights buildAxisWeights(int srcSize, int dstSize, ResampleFilter filter) {
+    AxisWeights axis;
+    axis.start.resize(static_cast<std::size_t>(dstSize));
+    axis.count.resize(static_cast<std::size_t>(dstSize));
+    axis.offset.resize(static_cast<std::size_t>(dstSize));
+    const bool kernel = filter == ResampleFilter::Lanczos3 || filter == ResampleFilter::Mitchell || filter == ResampleFilter::CatmullRom;
+    std::vector<double> taps;
+    for (int i = 0; i < dstSize; ++i) {
+        taps.clear();
+        const int first = kernel ? kernelTaps(srcSize, dstSize, i, filter, taps) : simpleTaps(srcSize, dstSize, i, filter, taps);
+        double total = 0.0;
+        for (double tap : taps) {
+            total += tap;
+        }
+        const std::size_t index = static_cast<std::size_t>(i);
+        axis.start[index] = first;
+        axis.count[index] = static_cast<int>(taps.size());
+        axis.offset[index] = axis.weights.size();
+        for (double tap : taps) {
+            axis.weights.push_back(static_cast<float>(total != 0.0 ? tap / total : 1.0 / static_cast<double>(taps.size())));
+        }
+    }
+    return axis;
+}
+
+// Values are clamped first, so adding a half rounds.
+std::uint8_t toByte(float value) {
+    return static_cast<std::uint8_t>(std::clamp(value, 0.0f, 255.0f) + 0.5f);
+}
+
+bool opaque(const ImageBuffer& image) {
+    const PixelRGBA8* pixels = image.data();
+    const std::size_t count = static_cast<std::size_t>(image.width()) * static_cast<std::size_t>(image.height());
+    for (std::size_t i = 0; i < count; ++i) {
+        if (pixels[i].a != 255) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// sums[k] += src[k] * weight, in fixed blocks the compiler vectorizes.
+// Each block is loaded before any store, since bytes may alias the sums.
+void accumulateBytes(const std::uint8_t* src, float weight, float* sums, std::size_t count) {
+    constexpr std::size_t kBlock = 16;
+    std::size_t i = 0;
+    for (; i + kBlock <= count; i += kBlock) {
+        float block[kBlock];
+        for (std::size_t k = 0; k < kBlock; ++k) {
+            block[k] = static_cast<float>(src[i + k]);
+        }
+        for (std::size_t k = 0; k < kBlock; ++k) {
+            sums[i + k] += block[k] * weight;
+        }
+    }
+    for (; i < count; ++i) {
+        sums[i] += static_cast<float>(src[i]) * weight;
+    }
+}
+
+// Colors times alpha, alpha itself in the fourth slot, four pixels a block.
+void accumulatePremultiplied(const PixelRGBA8* src, float weight, float* sums, int count) {
+    const std::uint8_t* bytes = reinterpret_cast<const std::uint8_t*>(src);
+    int x = 0;
+    for (; x + 4 <= count; x += 4) {
+        float block[16];
+        for (int k = 0; k < 16; ++k) {
+            block[k] = static_cast<float>(bytes[static_cast<std::size_t>(x) * 4 + static_cast<std::size_t>(k)]);
+        }
+        float* sum = sums + static_cast<std::size_t>(x) * 4;
+        for (int p = 0; p < 4; ++p) {
+            const float alpha = block[p * 4 + 3] * weight;
+            sum[p * 4] += block[p * 4] * alpha;
+            sum[p * 4 + 1] += block[p * 4 + 1] * alpha;
+            sum[p * 4 + 2] += block[p * 4 + 2] * alpha;
+            sum[p * 4 + 3] += alpha;
+        }
+    }
+    for (; x < count; ++x) {
+        const float alpha = static_cast<float>(src[x].a) * weight;
+        float* sum = sums + static_cast<std::size_t>(x) * 4;
+        sum[0] += static_cast<float>(src[x].r) * alpha;
+        sum[1] += static_cast<float>(src[x].g) * alpha;
+        sum[2] += static_cast<float>(src[x].b) * alpha;
+        sum[3] += alpha;
+    }
+}
+} // namespace
+
+ResampleFilter parseResampleFilter(const std::string& name) {
+    std::string lowered = name;
+    std::transform(lowered.begin(), lowered.end(), lowered.begin(), [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+    if (lowered == "nearest") return ResampleFilter::Nearest;
+    if (lowered == "bilinear") return ResampleFilter::Bilinear;
+    if (lowered == "box" || lowered == "boxaverage" || lowered == "box_average" || lowered == "area") return ResampleFilter::Area;
+    if (lowered == "lanczos3" || lowered == "lanczos") return ResampleFilter::Lanczos3;
+    if (lowered == "mitchell") return ResampleFilter::Mitchell;
+    if (lowered == "catmull-rom" || lowered == "catmullrom" || lowered == "catrom") return ResampleFilter::CatmullRom;
+    throw std::runtime_error("Unsupported resize filter: " + name);
+}
+
+ImageBuffer resampleBuffer(const ImageBuffer& source, int width, int height, int threads, ResampleFilter filter) {
+    const int srcWidth = source.width();
+    const int srcHeight = source.height();
+    if (srcWidth <= 0 || srcHeight <= 0 || width <= 0 || height <= 0) {
+        throw std::invalid_argument("Resample dimensions must be positive");
+    }
+    if (width == srcWidth && height == srcHeight) {
+        return source;
+    }
+
+    const AxisWeights columns = buildAxisWeights(srcWidth, width, filter);
+    const AxisWeights rows = buildAxisWeights(srcHeight, height, filter);
+    ImageBuffer out(width, height);
+    const PixelRGBA8* srcPixels = source.data();
+    PixelRGBA8* outPixels = out.data();
+    // Opaque sources sum raw channels; others premultiply by alpha first.
+    const bool solid = opaque(source);
+    // Each output row sums its source rows into floats, then filters that
+    // row horizontally.
+    const std::size_t rowFloats = static_cast<std::size_t>(srcWidth) * 4;
+    std::vector<std::vector<float>> scratch(static_cast<std::size_t>(parallelWorkerCount(height, threads)),
+                                            std::vector<float>(rowFloats));
+    parallelForWorkers(height, threads, [&](int y, int worker) {
+        float* sums = scratch[static_cast<std::size_t>(worker)].data();
+        std::fill(sums, sums + rowFloats, 0.0f);
+        const std::size_t yIndex = static_cast<std::size_t>(y);
+        const float* rowWeights = rows.weights.data() + rows.offset[yIndex];
+        for (int tap = 0; tap < rows.count[yIndex]; ++tap) {
+            const PixelRGBA8* src = srcPixels + static_cast<std::size_t>(rows.start[yIndex] + tap) * static_cast<std::size_t>(srcWidth);
+            if (solid) {
+                accumulateBytes(reinterpret_cast<const std::uint8_t*>(src), rowWeights[tap], sums, rowFloats);
+            } else {
+                accumulatePremultiplied(src, rowWeights[tap], sums, srcWidth);
+            }
+        }
+
+        PixelRGBA8* dst = outPixels + yIndex * static_cast<std::size_t>(width);
+        for (int x = 0; x < width; ++x) {
+            const std::size_t xIndex = static_cast<std::size_t>(x);
+            const float* columnWeights = columns.weights.data() + columns.offset[xIndex];
+            const float* sum = sums + static_cast<std::size_t>(columns.start[xIndex]) * 4;
+            float acc[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+            for (int tap = 0; tap < columns.count[xIndex]; ++tap, sum += 4) {
+                for (int c = 0; c < 4; ++c) {
+                    acc[c] += sum[c] * columnWeights[tap];
+                }
+            }
+            if (solid) {
+                dst[x] = PixelRGBA8(toByte(acc[0]), toByte(acc[1]), toByte(acc[2]), 255);
+                continue;
+            }
+            if (acc[3] < 0.5f) {
+                dst[x] = PixelRGBA8(0, 0, 0, 0);
+                continue;
+            }
+            const float inverse = 1.0f / acc[3];
+            dst[x] = PixelRGBA8(toByte(acc[0] * inverse), toByte(acc[1] * inverse), toByte(acc[2] * inverse), toByte(acc[3]));
+        }
+    });
+    return out;
+}
@@ -0,0 +1,34 @@
+#ifndef RESAMPLE_H
+#define RESAMPLE_H
+
+#include "layer.h"
+
+#include <string>
+
+enum class ResampleFilter {
+    // Averages the source area under each output pixel when shrinking and
+    // interpolates linearly when growing.
+    Area,
+    Nearest,
+    // Interpolates between the two nearest source pixels at either scale.
+    Bilinear,
+    Lanczos3,
+    // Cubic B-splines with B = C = 1/3, and B = 0, C = 1/2.
+    Mitchell,
+    CatmullRom
+};
+
+// Parses nearest|bilinear|box|area|lanczos3|mitchell|catmull-rom.
+ResampleFilter parseResampleFilter(const std::string& name);
+
+// Separable resampling of RGBA buffers with per-axis weight tables built
+// once. Colors are weighted by alpha so transparent pixels do not bleed
+// into their neighbours. Kernel filters widen with the scale when an axis
+// shrinks. Output rows are spread across threads (0 uses all cores).
+ImageBuffer resampleBuffer(const ImageBuffer& source,
+                           int width,
+                           int height,
+                           int threads = 0,
+                           ResampleFilter filter = ResampleFilter::Area);
+
+#endif
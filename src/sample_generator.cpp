@@ -60,15 +60,10 @@ int runSampleGenerator() {
         return 1;
     }
 
-    const bool hasWebP = WEBPImage::isToolingAvailable();
-    if (hasWebP) {
-        WEBPImage smileyWebp = example_api::createSmiley256WEBP();
-        if (!smileyWebp.save(outDir + "/smiley.webp")) {
-            std::cerr << "Failed to write smiley.webp\n";
-            return 1;
-        }
-    } else {
-        std::cout << "Skipping WebP output (install cwebp and dwebp to enable)\n";
+    WEBPImage smileyWebp = example_api::createSmiley256WEBP();
+    if (!smileyWebp.save(outDir + "/smiley.webp")) {
+        std::cerr << "Failed to write smiley.webp\n";
+        return 1;
     }
 
     SVGImage smileySvg = example_api::createSmiley256SVG();
@@ -168,12 +163,10 @@ int runSampleGenerator() {
         return 1;
     }
 
-    if (hasWebP) {
-        WEBPImage webpDecoded = WEBPImage::load(outDir + "/smiley.webp");
-        if (!webpDecoded.save(outDir + "/smiley_copy.webp")) {
-            std::cerr << "Failed to write smiley_copy.webp\n";
-            return 1;
-        }
+    WEBPImage webpDecoded = WEBPImage::load(outDir + "/smiley.webp");
+    if (!webpDecoded.save(outDir + "/smiley_copy.webp")) {
+        std::cerr << "Failed to write smiley_copy.webp\n";
+        return 1;
     }
 
     SVGImage svgDecoded = SVGImage::load(outDir + "/smiley.svg");
@@ -186,7 +179,7 @@ int runSampleGenerator() {
     if (!std::filesystem::exists(tahoeInputWebp)) {
         std::cout << "Skipping Tahoe effect samples (missing " << tahoeInputWebp << ")\n";
     } else if (!WEBPImage::isToolingAvailable()) {
-        std::cout << "Skipping Tahoe effect samples (install cwebp and dwebp to enable WebP decode)\n";
+        std::cout << "Skipping Tahoe effect samples (install dwebp to decode the lossy sample)\n";
     } else {
         WEBPImage tahoeWebp = WEBPImage::load(tahoeInputWebp);
 
@@ -227,9 +220,9 @@ int runSampleGenerator() {
         }
     }
 
-    std::cout << "Wrote smiley.bmp, smiley.png, smiley.jpg, smiley.gif, "
+    std::cout << "Wrote smiley.bmp, smiley.png, smiley.jpg, smiley.gif, smiley.webp, "
                  "smiley.svg, smiley_svg_rasterized_512.png, smiley_copy.bmp, smiley_copy.png, smiley_copy.jpg, smiley_copy.gif, "
-                 "smiley_copy.svg, layered_blend.png, smiley_resize_128.png, smiley_resize_512.png, smiley_resize_512_nearest.png, "
+                 "smiley_copy.webp, smiley_copy.svg, layered_blend.png, smiley_resize_128.png, smiley_resize_512.png, smiley_resize_512_nearest.png, "
                  "smiley_resize_512_box_average.png, "
                  "smiley_direct.png, smiley_layered.png, smiley_layer_diff.png, "
                  "build/output/images/tahoe200-original.png, build/output/images/tahoe200-grayscale.png, "
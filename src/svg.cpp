@@ -1,18 +1,63 @@
 #include "svg.h"
 
 #include "layer.h"
+#include "parallel.h"
+#include "raster.h"
 #include "transform.h"
 
 #include <algorithm>
 #include <cctype>
+#include <charconv>
 #include <cmath>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
+#include <istream>
+#include <limits>
+#include <memory>
+#include <ostream>
 #include <sstream>
 #include <stdexcept>
+#include <streambuf>
+#include <string_view>
+#include <system_error>
 #include <unordered_map>
 #include <vector>
 
 namespace {
+constexpr double kPi = 3.14159265358979323846;
+constexpr double kCircleKappa = 0.5522847498307936;
+constexpr std::size_t kReadChunkBytes = 1 << 16;
+constexpr int kBandRows = 32;
+
+// Attributes of one tag. Slots keep their strings' capacity from tag to tag,
+// so parsing a long run of similar elements stops allocating.
+class XmlAttributes {
+public:
+    using Item = std::pair<std::string, std::string>;
+    using const_iterator = std::vector<Item>::const_iterator;
+
+    const_iterator begin() const { return m_items.begin(); }
+    const_iterator end() const { return m_items.begin() + static_cast<std::ptrdiff_t>(m_count); }
+
+    const_iterator find(std::string_view name) const {
+        return std::find_if(begin(), end(), [name](const Item& item) { return item.first == name; });
+    }
+
+    void clear() { m_count = 0; }
+
+    Item& append() {
+        if (m_count == m_items.size()) {
+            m_items.emplace_back();
+        }
+        return m_items[m_count++];
+    }
+
+private:
+    std::vector<Item> m_items;
+    std::size_t m_count = 0;
+};
+
 std::size_t pixelIndex(int x, int y, int width) {
     return static_cast<std::size_t>(y) * static_cast<std::size_t>(width) + static_cast<std::size_t>(x);
 }
@@ -30,168 +75,209 @@ int hexValue(char c) {
     return 0;
 }
 
-struct XmlNode {
+struct XmlTag {
     std::string name;
-    std::unordered_map<std::string, std::string> attrs;
-    std::vector<XmlNode> children;
+    XmlAttributes attrs;
+    bool closing = false;
+    bool selfClosing = false;
 };
 
-class XmlParser {
+// Pulls one tag at a time from a stream, skipping text, comments, CDATA,
+// doctypes and processing instructions. Only the unread tail of the current
+// chunk and the tag being parsed are held in memory.
+class XmlTagReader {
 public:
-    explicit XmlParser(const std::string& text) : m_text(text), m_pos(0) {}
+    explicit XmlTagReader(std::istream& in) : m_in(in), m_pos(0) {}
 
-    XmlNode parse() {
-        skipProlog();
-        skipWhitespace();
-        XmlNode root = parseElement();
-        return root;
-    }
-
-private:
-    const std::string& m_text;
-    std::size_t m_pos;
-
-    void skipWhitespace() {
-        while (m_pos < m_text.size() && std::isspace(static_cast<unsigned char>(m_text[m_pos]))) {
-            ++m_pos;
-        }
-    }
-
-    bool startsWith(const std::string& token) const {
-        return m_text.compare(m_pos, token.size(), token) == 0;
-    }
-
-    void skipProlog() {
-        skipWhitespace();
-        if (startsWith("<?xml")) {
-            std::size_t end = m_text.find("?>", m_pos);
-            if (end == std::string::npos) {
-                throw std::runtime_error("Malformed XML prolog");
-            }
-            m_pos = end + 2;
-        }
+    // Returns false once the input is exhausted.
+    bool next(XmlTag& tag) {
         while (true) {
-            skipWhitespace();
-            if (startsWith("<!--")) {
-                std::size_t end = m_text.find("-->", m_pos);
-                if (end == std::string::npos) {
-                    throw std::runtime_error("Unterminated XML comment");
+            while (true) {
+                if (!available(1)) {
+                    return false;
                 }
-                m_pos = end + 3;
-                continue;
+                const std::size_t open = m_buffer.find('<', m_pos);
+                if (open != std::string::npos) {
+                    m_pos = open;
+                    break;
+                }
+                m_pos = m_buffer.size();
+            }
+            if (startsWith("<!--")) {
+                skipPast("-->", "Unterminated XML comment");
+            } else if (startsWith("<![CDATA[")) {
+                skipPast("]]>", "Unterminated XML CDATA section");
+            } else if (startsWith("<?")) {
+                skipPast("?>", "Malformed XML prolog");
+            } else if (startsWith("<!")) {
+                skipPast(">", "Malformed XML declaration");
+            } else {
+                break;
             }
-            break;
         }
-    }
 
-    XmlNode parseElement() {
-        expect('<');
-        if (m_pos < m_text.size() && m_text[m_pos] == '/') {
-            throw std::runtime_error("Unexpected closing tag");
+        ++m_pos;
+        tag.attrs.clear();
+        tag.closing = peek() == '/';
+        tag.selfClosing = false;
+        if (tag.closing) {
+            ++m_pos;
         }
-
-        XmlNode node;
-        node.name = parseName();
+        parseName(tag.name);
         skipWhitespace();
-        while (m_pos < m_text.size() && m_text[m_pos] != '>' && m_text[m_pos] != '/') {
-            const std::string key = parseName();
+        if (tag.closing) {
+            expect('>');
+            return true;
+        }
+        while (peek() != '>' && peek() != '/') {
+            XmlAttributes::Item& attr = tag.attrs.append();
+            parseName(attr.first);
             skipWhitespace();
             expect('=');
             skipWhitespace();
-            const std::string value = parseQuoted();
-            node.attrs[key] = value;
+            parseQuoted(attr.second);
             skipWhitespace();
         }
-
-        if (m_pos < m_text.size() && m_text[m_pos] == '/') {
+        if (peek() == '/') {
             ++m_pos;
-            expect('>');
-            return node;
+            tag.selfClosing = true;
         }
-
         expect('>');
+        return true;
+    }
 
-        while (true) {
-            skipWhitespace();
-            if (startsWith("<!--")) {
-                std::size_t end = m_text.find("-->", m_pos);
-                if (end == std::string::npos) {
-                    throw std::runtime_error("Unterminated XML comment");
-                }
-                m_pos = end + 3;
-                continue;
-            }
-            if (startsWith("</")) {
-                m_pos += 2;
-                const std::string closeName = parseName();
-                skipWhitespace();
-                expect('>');
-                if (closeName != node.name) {
-                    throw std::runtime_error("Mismatched XML closing tag");
-                }
-                break;
+private:
+    // Makes at least count unread bytes available, compacting consumed
+    // bytes away before reading more.
+    bool available(std::size_t count) {
+        while (m_buffer.size() - m_pos < count) {
+            if (!m_in) {
+                return false;
             }
-            if (m_pos >= m_text.size()) {
-                throw std::runtime_error("Unexpected end of XML");
+            m_buffer.erase(0, m_pos);
+            m_pos = 0;
+            const std::size_t used = m_buffer.size();
+            m_buffer.resize(used + kReadChunkBytes);
+            m_in.read(&m_buffer[used], static_cast<std::streamsize>(kReadChunkBytes));
+            m_buffer.resize(used + static_cast<std::size_t>(m_in.gcount()));
+        }
+        return true;
+    }
+
+    int peek() { return available(1) ? static_cast<unsigned char>(m_buffer[m_pos]) : -1; }
+
+    bool startsWith(const char* token) {
+        const std::size_t length = std::strlen(token);
+        return available(length) && m_buffer.compare(m_pos, length, token) == 0;
+    }
+
+    void skipPast(const char* token, const char* error) {
+        const std::size_t length = std::strlen(token);
+        while (true) {
+            const std::size_t found = m_buffer.find(token, m_pos);
+            if (found != std::string::npos) {
+                m_pos = found + length;
+                return;
             }
-            if (m_text[m_pos] == '<') {
-                node.children.push_back(parseElement());
-            } else {
-                skipText();
+            // Keep a partial match at the end of the chunk.
+            m_pos = std::max(m_pos, m_buffer.size() - std::min(m_buffer.size(), length - 1));
+            if (!available(m_buffer.size() - m_pos + 1)) {
+                throw std::runtime_error(error);
             }
         }
-
-        return node;
     }
 
-    void skipText() {
-        while (m_pos < m_text.size() && m_text[m_pos] != '<') {
+    void skipWhitespace() {
+        while (available(1) && std::isspace(static_cast<unsigned char>(m_buffer[m_pos]))) {
             ++m_pos;
         }
     }
 
     void expect(char c) {
-        if (m_pos >= m_text.size() || m_text[m_pos] != c) {
+        if (peek() != static_cast<unsigned char>(c)) {
             throw std::runtime_error("Malformed XML");
         }
         ++m_pos;
     }
 
-    std::string parseName() {
-        if (m_pos >= m_text.size() || !(std::isalpha(static_cast<unsigned char>(m_text[m_pos])) || m_text[m_pos] == '_')) {
+    void parseName(std::string& name) {
+        const int first = peek();
+        if (first < 0 || !(std::isalpha(first) || first == '_')) {
             throw std::runtime_error("Expected XML name");
         }
-        std::size_t start = m_pos++;
-        while (m_pos < m_text.size()) {
-            const char c = m_text[m_pos];
-            if (std::isalnum(static_cast<unsigned char>(c)) || c == '_' || c == '-' || c == ':') {
+        name.clear();
+        while (available(1)) {
+            const std::size_t start = m_pos;
+            while (m_pos < m_buffer.size() && isNameChar(m_buffer[m_pos])) {
                 ++m_pos;
-            } else {
+            }
+            name.append(m_buffer, start, m_pos - start);
+            if (m_pos < m_buffer.size()) {
                 break;
             }
         }
-        return m_text.substr(start, m_pos - start);
     }
 
-    std::string parseQuoted() {
-        if (m_pos >= m_text.size() || (m_text[m_pos] != '"' && m_text[m_pos] != '\'')) {
+    static bool isNameChar(char c) {
+        return std::isalnum(static_cast<unsigned char>(c)) || c == '_' || c == '-' || c == ':' || c == '.';
+    }
+
+    void parseQuoted(std::string& value) {
+        const int quote = peek();
+        if (quote != '"' && quote != '\'') {
             throw std::runtime_error("Expected quoted XML attribute");
         }
-        const char quote = m_text[m_pos++];
-        std::size_t start = m_pos;
-        while (m_pos < m_text.size() && m_text[m_pos] != quote) {
-            ++m_pos;
+        ++m_pos;
+        value.clear();
+        while (true) {
+            if (!available(1)) {
+                throw std::runtime_error("Unterminated XML attribute");
+            }
+            const std::size_t end = m_buffer.find(static_cast<char>(quote), m_pos);
+            if (end != std::string::npos) {
+                value.append(m_buffer, m_pos, end - m_pos);
+                m_pos = end + 1;
+                break;
+            }
+            value.append(m_buffer, m_pos, std::string::npos);
+            m_pos = m_buffer.size();
         }
-        if (m_pos >= m_text.size()) {
-            throw std::runtime_error("Unterminated XML attribute");
+        if (value.find('&') != std::string::npos) {
+            value = decodeEntities(value);
         }
-        std::string value = m_text.substr(start, m_pos - start);
-        ++m_pos;
-        return value;
     }
+
+    static std::string decodeEntities(const std::string& value) {
+        std::size_t amp = value.find('&');
+        static const std::pair<const char*, char> kEntities[] = {
+            {"&amp;", '&'}, {"&lt;", '<'}, {"&gt;", '>'}, {"&quot;", '"'}, {"&apos;", '\''}};
+        std::string out;
+        out.reserve(value.size());
+        std::size_t pos = 0;
+        while (amp != std::string::npos) {
+            out.append(value, pos, amp - pos);
+            pos = amp + 1;
+            out.push_back('&');
+            for (const auto& entity : kEntities) {
+                const std::size_t length = std::strlen(entity.first);
+                if (value.compare(amp, length, entity.first) == 0) {
+                    out.back() = entity.second;
+                    pos = amp + length;
+                    break;
+                }
+            }
+            amp = value.find('&', pos);
+        }
+        out.append(value, pos, std::string::npos);
+        return out;
+    }
+
+    std::istream& m_in;
+    std::string m_buffer;
+    std::size_t m_pos;
 };
 
-bool parseIntAttr(const std::unordered_map<std::string, std::string>& attrs, const std::string& name, int& out) {
+bool parseIntAttr(const XmlAttributes& attrs, std::string_view name, int& out) {
     auto it = attrs.find(name);
     if (it == attrs.end()) {
         return false;
@@ -211,12 +297,42 @@ bool parseIntAttr(const std::unordered_map<std::string, std::string>& attrs, con
     return true;
 }
 
-bool parseViewBox(const std::unordered_map<std::string, std::string>& attrs, double& outMinX, double& outMinY, double& outW, double& outH) {
+// Reads a decimal number, skipping leading whitespace and a plus sign as
+// strtod would; returns begin when there is none.
+const char* readNumber(const char* begin, const char* end, double& out) {
+    const char* cursor = begin;
+    while (cursor != end && std::isspace(static_cast<unsigned char>(*cursor))) {
+        ++cursor;
+    }
+    if (cursor != end && *cursor == '+') {
+        ++cursor;
+    }
+    const std::from_chars_result result = std::from_chars(cursor, end, out);
+    return result.ec == std::errc() ? result.ptr : begin;
+}
+
+bool parseNumberAttr(const XmlAttributes& attrs, std::string_view name, double& out) {
+    auto it = attrs.find(name);
+    if (it == attrs.end()) {
+        return false;
+    }
+    const char* begin = it->second.data();
+    double value = 0.0;
+    if (readNumber(begin, begin + it->second.size(), value) == begin) {
+        return false;
+    }
+    out = value;
+    return true;
+}
+
+bool parseViewBox(const XmlAttributes& attrs, double& outMinX, double& outMinY, double& outW, double& outH) {
     auto it = attrs.find("viewBox");
     if (it == attrs.end()) {
         return false;
     }
-    std::stringstream ss(it->second);
+    std::string normalized = it->second;
+    std::replace(normalized.begin(), normalized.end(), ',', ' ');
+    std::stringstream ss(normalized);
     double values[4] = {0.0, 0.0, 0.0, 0.0};
     int idx = 0;
     while (idx < 4) {
@@ -236,18 +352,25 @@ bool parseViewBox(const std::unordered_map<std::string, std::string>& attrs, dou
 }
 
 std::vector<double> parseTransformArgs(const std::string& payload) {
-    std::string normalized = payload;
-    std::replace(normalized.begin(), normalized.end(), ',', ' ');
-    std::stringstream ss(normalized);
     std::vector<double> values;
-    double v = 0.0;
-    while (ss >> v) {
-        values.push_back(v);
+    const char* cursor = payload.data();
+    const char* end = cursor + payload.size();
+    while (true) {
+        while (cursor != end && (std::isspace(static_cast<unsigned char>(*cursor)) || *cursor == ',')) {
+            ++cursor;
+        }
+        double value = 0.0;
+        const char* next = readNumber(cursor, end, value);
+        if (next == cursor) {
+            return values;
+        }
+        values.push_back(value);
+        cursor = next;
     }
-    return values;
 }
 
-Transform2D parseTransform(const std::unordered_map<std::string, std::string>& attrs) {
+// Operations compose left to right, so the last one applies to points first.
+Transform2D parseTransform(const XmlAttributes& attrs) {
     auto it = attrs.find("transform");
     if (it == attrs.end()) {
         return Transform2D::identity();
@@ -258,7 +381,7 @@ Transform2D parseTransform(const std::unordered_map<std::string, std::string>& a
     Transform2D total = Transform2D::identity();
 
     while (pos < value.size()) {
-        while (pos < value.size() && std::isspace(static_cast<unsigned char>(value[pos]))) {
+        while (pos < value.size() && (std::isspace(static_cast<unsigned char>(value[pos])) || value[pos] == ',')) {
             ++pos;
         }
         if (pos >= value.size()) {
@@ -288,19 +411,22 @@ Transform2D parseTransform(const std::unordered_map<std::string, std::string>& a
 
         const std::vector<double> args = parseTransformArgs(payload);
         if (name == "translate" && !args.empty()) {
-            const double dx = args[0];
-            const double dy = args.size() > 1 ? args[1] : 0.0;
-            Transform2D op = Transform2D::translation(dx, dy);
-            total = op * total;
+            total *= Transform2D::translation(args[0], args.size() > 1 ? args[1] : 0.0);
         } else if (name == "rotate" && !args.empty()) {
-            const double angle = args[0];
+            const double radians = args[0] * kPi / 180.0;
             if (args.size() >= 3) {
-                Transform2D op = Transform2D::rotationRadians(angle * 3.14159265358979323846 / 180.0, args[1], args[2]);
-                total = op * total;
+                total *= Transform2D::rotationRadians(radians, args[1], args[2]);
             } else {
-                Transform2D op = Transform2D::rotationRadians(angle * 3.14159265358979323846 / 180.0);
-                total = op * total;
+                total *= Transform2D::rotationRadians(radians);
             }
+        } else if (name == "scale" && !args.empty()) {
+            total *= Transform2D::scaling(args[0], args.size() > 1 ? args[1] : args[0]);
+        } else if (name == "matrix" && args.size() == 6) {
+            total *= Transform2D::fromMatrix(args[0], args[1], args[2], args[3], args[4], args[5]);
+        } else if (name == "skewX" && !args.empty()) {
+            total *= Transform2D::fromMatrix(1.0, 0.0, std::tan(args[0] * kPi / 180.0), 1.0, 0.0, 0.0);
+        } else if (name == "skewY" && !args.empty()) {
+            total *= Transform2D::fromMatrix(1.0, std::tan(args[0] * kPi / 180.0), 0.0, 1.0, 0.0, 0.0);
         } else {
             // Skip unsupported transform types.
         }
@@ -317,7 +443,7 @@ struct PreserveAspectRatio {
     double alignY = 0.5;
 };
 
-PreserveAspectRatio parsePreserveAspectRatio(const std::unordered_map<std::string, std::string>& attrs) {
+PreserveAspectRatio parsePreserveAspectRatio(const XmlAttributes& attrs) {
     PreserveAspectRatio par;
     auto it = attrs.find("preserveAspectRatio");
     if (it == attrs.end()) {
@@ -377,12 +503,8 @@ PreserveAspectRatio parsePreserveAspectRatio(const std::unordered_map<std::strin
     return par;
 }
 
-bool parseColorAttr(const std::unordered_map<std::string, std::string>& attrs, Color& out) {
-    auto it = attrs.find("fill");
-    if (it == attrs.end()) {
-        return false;
-    }
-    const std::string& value = it->second;
+// Accepts rgb(), #rgb, #rrggbb and a few basic color names.
+bool parseColor(const std::string& value, Color& out) {
     if (value.compare(0, 4, "rgb(") == 0) {
         std::size_t start = 4;
         std::size_t end = value.find(')', start);
@@ -395,7 +517,7 @@ bool parseColorAttr(const std::unordered_map<std::string, std::string>& attrs, C
         int values[3] = {0, 0, 0};
         int idx = 0;
         while (std::getline(ss, token, ',') && idx < 3) {
-            values[idx++] = std::stoi(token);
+            values[idx++] = std::clamp(std::atoi(token.c_str()), 0, 255);
         }
         if (idx != 3) {
             return false;
@@ -412,6 +534,21 @@ bool parseColorAttr(const std::unordered_map<std::string, std::string>& attrs, C
         out = Color(static_cast<std::uint8_t>(r), static_cast<std::uint8_t>(g), static_cast<std::uint8_t>(b));
         return true;
     }
+    if (value.size() == 4 && value[0] == '#') {
+        out = Color(static_cast<std::uint8_t>(hexValue(value[1]) * 17), static_cast<std::uint8_t>(hexValue(value[2]) * 17),
+                    static_cast<std::uint8_t>(hexValue(value[3]) * 17));
+        return true;
+    }
+    static const std::pair<const char*, Color> kNamed[] = {
+        {"black", Color(0, 0, 0)},     {"white", Color(255, 255, 255)}, {"red", Color(255, 0, 0)},
+        {"green", Color(0, 128, 0)},   {"lime", Color(0, 255, 0)},      {"blue", Color(0, 0, 255)},
+        {"yellow", Color(255, 255, 0)}, {"gray", Color(128, 128, 128)}, {"grey", Color(128, 128, 128)}};
+    for (const auto& named : kNamed) {
+        if (value == named.first) {
+            out = named.second;
+            return true;
+        }
+    }
     return false;
 }
 } // namespace
@@ -451,200 +588,1183 @@ void SVGImage::setPixel(int x, int y, const Color& color) {
     m_pixels[pixelIndex(x, y, m_width)] = color;
 }
 
-bool SVGImage::save(const std::string& filename) const {
-    if (m_width <= 0 || m_height <= 0) {
-        return false;
+namespace {
+constexpr std::size_t kWriterBufferBytes = 1 << 16;
+constexpr std::size_t kAutoPixelsPerRect = 16;
+
+// Collects output in a fixed buffer and hands it to the file in large writes.
+class SVGWriter {
+public:
+    explicit SVGWriter(const std::string& filename) : m_out(filename, std::ios::binary | std::ios::trunc) {
+        m_buffer.reserve(kWriterBufferBytes + 256);
     }
 
-    std::ofstream out(filename);
-    if (!out) {
-        return false;
+    bool isOpen() const { return static_cast<bool>(m_out); }
+
+    void write(const char* text) { write(text, std::strlen(text)); }
+
+    void write(const char* data, std::size_t size) {
+        m_buffer.append(data, size);
+        flushIfFull();
     }
 
-    const Color background = m_pixels.empty() ? Color(255, 255, 255) : m_pixels.front();
+    void writeInt(int value) {
+        char digits[16];
+        const std::to_chars_result result = std::to_chars(digits, digits + sizeof(digits), value);
+        write(digits, static_cast<std::size_t>(result.ptr - digits));
+    }
+
+    void writeHexColor(std::uint32_t rgb) {
+        static const char kHex[] = "0123456789abcdef";
+        char text[7] = {'#'};
+        for (int i = 0; i < 6; ++i) {
+            text[1 + i] = kHex[(rgb >> (20 - 4 * i)) & 0xF];
+        }
+        write(text, sizeof(text));
+    }
 
-    out << "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"" << m_width
-        << "\" height=\"" << m_height << "\" viewBox=\"0 0 " << m_width << " " << m_height << "\">\n";
-    out << "  <rect width=\"" << m_width << "\" height=\"" << m_height
-        << "\" fill=\"rgb(" << static_cast<int>(background.r) << "," << static_cast<int>(background.g) << ","
-        << static_cast<int>(background.b) << ")\"/>\n";
+    void put(char c) {
+        m_buffer.push_back(c);
+        flushIfFull();
+    }
 
-    for (int y = 0; y < m_height; ++y) {
-        for (int x = 0; x < m_width; ++x) {
-            const Color& px = m_pixels[pixelIndex(x, y, m_width)];
-            if (px.r == background.r && px.g == background.g && px.b == background.b) {
-                continue;
+    bool finish() {
+        flush();
+        m_out.close();
+        return static_cast<bool>(m_out);
+    }
+
+private:
+    void flushIfFull() {
+        if (m_buffer.size() >= kWriterBufferBytes) {
+            flush();
+        }
+    }
+
+    void flush() {
+        m_out.write(m_buffer.data(), static_cast<std::streamsize>(m_buffer.size()));
+        m_buffer.clear();
+    }
+
+    std::ofstream m_out;
+    std::string m_buffer;
+};
+
+// Base64-encodes bytes written to it straight into an SVGWriter.
+class Base64StreamBuf : public std::streambuf {
+public:
+    explicit Base64StreamBuf(SVGWriter& out) : m_out(out) {}
+
+    void finish() {
+        if (m_count == 0) {
+            return;
+        }
+        std::fill(m_pending + m_count, m_pending + 3, static_cast<std::uint8_t>(0));
+        const int count = m_count;
+        emit();
+        for (int i = count + 1; i < 4; ++i) {
+            m_last[i] = '=';
+        }
+        m_out.write(m_last, 4);
+    }
+
+protected:
+    int_type overflow(int_type ch) override {
+        if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+            push(static_cast<std::uint8_t>(ch));
+        }
+        return traits_type::not_eof(ch);
+    }
+
+    std::streamsize xsputn(const char* data, std::streamsize size) override {
+        for (std::streamsize i = 0; i < size; ++i) {
+            push(static_cast<std::uint8_t>(data[i]));
+        }
+        return size;
+    }
+
+private:
+    void push(std::uint8_t byte) {
+        m_pending[m_count++] = byte;
+        if (m_count == 3) {
+            emit();
+            m_out.write(m_last, 4);
+        }
+    }
+
+    // Encodes the pending group into m_last and clears it.
+    void emit() {
+        static const char kAlphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        const std::uint32_t group = (static_cast<std::uint32_t>(m_pending[0]) << 16) |
+                                    (static_cast<std::uint32_t>(m_pending[1]) << 8) | m_pending[2];
+        for (int i = 0; i < 4; ++i) {
+            m_last[i] = kAlphabet[(group >> (18 - 6 * i)) & 0x3F];
+        }
+        m_count = 0;
+    }
+
+    SVGWriter& m_out;
+    std::uint8_t m_pending[3] = {0, 0, 0};
+    int m_count = 0;
+    char m_last[4] = {0, 0, 0, 0};
+};
+
+struct SVGRect {
+    int x;
+    int y;
+    int width;
+    int height;
+    std::uint32_t color;
+};
+
+// RGB with alpha in the top byte; every fully transparent pixel packs to 0,
+// so transparent areas never need a rect.
+std::uint32_t packPixel(const std::uint8_t* pixel, int channels) {
+    const std::uint32_t alpha = channels == 4 ? pixel[3] : 255;
+    if (alpha == 0) {
+        return 0;
+    }
+    return (alpha << 24) | (static_cast<std::uint32_t>(pixel[0]) << 16) | (static_cast<std::uint32_t>(pixel[1]) << 8) | pixel[2];
+}
+
+bool opaqueColor(std::uint32_t color) {
+    return (color >> 24) == 255;
+}
+
+// opaque is cleared when any pixel has alpha below 255.
+std::uint32_t mostCommonColor(const PixelRows& pixels, bool& opaque) {
+    opaque = true;
+    std::unordered_map<std::uint32_t, std::size_t> counts;
+    std::uint32_t best = 0;
+    std::size_t bestCount = 0;
+    for (int y = 0; y < pixels.height; ++y) {
+        const std::uint8_t* row = pixels.row(y);
+        int x = 0;
+        while (x < pixels.width) {
+            const std::uint32_t color = packPixel(row + static_cast<std::size_t>(x) * pixels.channels, pixels.channels);
+            int end = x + 1;
+            while (end < pixels.width && packPixel(row + static_cast<std::size_t>(end) * pixels.channels, pixels.channels) == color) {
+                ++end;
+            }
+            opaque = opaque && opaqueColor(color);
+            std::size_t& count = counts[color];
+            count += static_cast<std::size_t>(end - x);
+            if (count > bestCount) {
+                best = color;
+                bestCount = count;
             }
-            out << "  <rect x=\"" << x << "\" y=\"" << y << "\" width=\"1\" height=\"1\" fill=\"rgb("
-                << static_cast<int>(px.r) << "," << static_cast<int>(px.g) << "," << static_cast<int>(px.b)
-                << ")\"/>\n";
+            x = end;
         }
     }
+    return best;
+}
 
-    out << "</svg>\n";
-    return static_cast<bool>(out);
+// Covers every pixel that is not the background with rectangles: runs of
+// one color on a row, stacked downward while the rows below repeat the run
+// exactly. Returns false as soon as more than maxRects would be needed.
+bool mergeRects(const PixelRows& pixels, std::uint32_t background, std::size_t maxRects, std::vector<SVGRect>& rects) {
+    std::vector<SVGRect> open;
+    std::vector<SVGRect> next;
+    for (int y = 0; y < pixels.height; ++y) {
+        const std::uint8_t* row = pixels.row(y);
+        std::size_t openIndex = 0;
+        next.clear();
+        int x = 0;
+        while (x < pixels.width) {
+            const std::uint32_t color = packPixel(row + static_cast<std::size_t>(x) * pixels.channels, pixels.channels);
+            int end = x + 1;
+            while (end < pixels.width && packPixel(row + static_cast<std::size_t>(end) * pixels.channels, pixels.channels) == color) {
+                ++end;
+            }
+            if (color != background) {
+                while (openIndex < open.size() && open[openIndex].x < x) {
+                    rects.push_back(open[openIndex++]);
+                }
+                SVGRect run{x, y, end - x, 1, color};
+                if (openIndex < open.size() && open[openIndex].x == x) {
+                    const SVGRect& above = open[openIndex++];
+                    if (above.width == run.width && above.color == color) {
+                        run.y = above.y;
+                        run.height = above.height + 1;
+                    } else {
+                        rects.push_back(above);
+                    }
+                }
+                next.push_back(run);
+                if (rects.size() + next.size() > maxRects) {
+                    return false;
+                }
+            }
+            x = end;
+        }
+        rects.insert(rects.end(), open.begin() + static_cast<std::ptrdiff_t>(openIndex), open.end());
+        open.swap(next);
+    }
+    rects.insert(rects.end(), open.begin(), open.end());
+    return rects.size() <= maxRects;
 }
 
-namespace {
-SVGImage loadSVGImpl(const std::string& filename, int forcedWidth, int forcedHeight, bool useForcedSize) {
-    std::ifstream in(filename);
-    if (!in) {
-        throw std::runtime_error("Cannot open SVG file: " + filename);
+void writeSVGOpen(SVGWriter& out, int width, int height) {
+    out.write("<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"");
+    out.writeInt(width);
+    out.write("\" height=\"");
+    out.writeInt(height);
+    out.write("\" viewBox=\"0 0 ");
+    out.writeInt(width);
+    out.put(' ');
+    out.writeInt(height);
+    out.write("\" shape-rendering=\"crispEdges\">\n");
+}
+
+void writeRect(SVGWriter& out, const SVGRect& rect) {
+    out.write("<rect x=\"");
+    out.writeInt(rect.x);
+    out.write("\" y=\"");
+    out.writeInt(rect.y);
+    out.write("\" width=\"");
+    out.writeInt(rect.width);
+    out.write("\" height=\"");
+    out.writeInt(rect.height);
+    out.write("\" fill=\"");
+    out.writeHexColor(rect.color);
+    if (!opaqueColor(rect.color)) {
+        // Three decimals tell every alpha byte apart.
+        const int thousandths = static_cast<int>(std::lround((rect.color >> 24) * 1000.0 / 255.0));
+        const char digits[] = {'0', '.', static_cast<char>('0' + thousandths / 100), static_cast<char>('0' + thousandths / 10 % 10),
+                               static_cast<char>('0' + thousandths % 10)};
+        out.write("\" fill-opacity=\"");
+        out.write(digits, sizeof(digits));
     }
+    out.write("\"/>\n");
+}
 
-    std::ostringstream buffer;
-    buffer << in.rdbuf();
-    const std::string content = buffer.str();
+void writeEmbeddedPNG(SVGWriter& out, const PixelRows& pixels, const PNGSaveOptions& options) {
+    out.write("<image width=\"");
+    out.writeInt(pixels.width);
+    out.write("\" height=\"");
+    out.writeInt(pixels.height);
+    out.write("\" href=\"data:image/png;base64,");
+    Base64StreamBuf base64(out);
+    std::ostream encoded(&base64);
+    PNGSaveOptions pngOptions = options;
+    pngOptions.alpha = options.alpha && pixels.channels == 4;
+    PNGStreamWriter png(encoded, pixels.width, pixels.height, pngOptions);
+    const std::size_t rowBytes = static_cast<std::size_t>(pixels.width) * static_cast<std::size_t>(pixels.channels);
+    const int bandRows = static_cast<int>(std::max<std::size_t>(1, kWriterBufferBytes * 16 / rowBytes));
+    for (int y = 0; y < pixels.height; y += bandRows) {
+        PixelRows band = pixels;
+        band.data = pixels.row(y);
+        band.height = std::min(bandRows, pixels.height - y);
+        png.writeRows(band);
+    }
+    png.finish();
+    base64.finish();
+    out.write("\"/>\n");
+}
+} // namespace
 
-    XmlParser parser(content);
-    XmlNode root = parser.parse();
-    if (root.name != "svg") {
-        throw std::runtime_error("Root element is not svg");
+Color* SVGImage::data() {
+    return m_pixels.data();
+}
+
+const Color* SVGImage::data() const {
+    return m_pixels.data();
+}
+
+bool SVGImage::save(const std::string& filename, const SVGSaveOptions& options) const {
+    if (m_width <= 0 || m_height <= 0) {
+        return false;
+    }
+    return saveRows(filename, colorRows(m_pixels.data(), m_width, m_height), options);
+}
+
+bool SVGImage::saveRows(const std::string& filename, const PixelRows& pixels, const SVGSaveOptions& options) {
+    if (pixels.width <= 0 || pixels.height <= 0) {
+        return false;
     }
+
+    std::vector<SVGRect> rects;
+    std::uint32_t background = 0;
+    bool embed = options.mode == SVGExportMode::EmbedPNG;
+    if (!embed) {
+        const std::size_t pixelCount = static_cast<std::size_t>(pixels.width) * static_cast<std::size_t>(pixels.height);
+        const std::size_t maxRects = options.mode == SVGExportMode::Auto ? pixelCount / kAutoPixelsPerRect + 1 : pixelCount;
+        bool opaque = true;
+        background = mostCommonColor(pixels, opaque);
+        // Translucent rects would blend over a background rect, so images
+        // with alpha get rects for every pixel that is not fully transparent.
+        if (!opaque) {
+            background = 0;
+        }
+        embed = !mergeRects(pixels, background, maxRects, rects);
+    }
+
+    SVGWriter out(filename);
+    if (!out.isOpen()) {
+        return false;
+    }
+    writeSVGOpen(out, pixels.width, pixels.height);
+    if (embed) {
+        try {
+            writeEmbeddedPNG(out, pixels, options.png);
+        } catch (const std::runtime_error&) {
+            return false;
+        }
+    } else {
+        if (background != 0) {
+            writeRect(out, SVGRect{0, 0, pixels.width, pixels.height, background});
+        }
+        for (const SVGRect& rect : rects) {
+            writeRect(out, rect);
+        }
+    }
+    out.write("</svg>\n");
+    return out.finish();
+}
+
+namespace {
+// Decodes RFC 4648 base64, skipping whitespace; stops at padding.
+std::vector<std::uint8_t> decodeBase64(const std::string& text, std::size_t start) {
+    std::vector<std::uint8_t> bytes;
+    bytes.reserve((text.size() - start) / 4 * 3);
+    std::uint32_t bits = 0;
+    int count = 0;
+    for (std::size_t i = start; i < text.size(); ++i) {
+        const char c = text[i];
+        int value = -1;
+        if (c >= 'A' && c <= 'Z') {
+            value = c - 'A';
+        } else if (c >= 'a' && c <= 'z') {
+            value = 26 + (c - 'a');
+        } else if (c >= '0' && c <= '9') {
+            value = 52 + (c - '0');
+        } else if (c == '+') {
+            value = 62;
+        } else if (c == '/') {
+            value = 63;
+        } else if (c == '=') {
+            break;
+        } else if (std::isspace(static_cast<unsigned char>(c))) {
+            continue;
+        } else {
+            throw std::runtime_error("Malformed base64 data in SVG image");
+        }
+        bits = (bits << 6) | static_cast<std::uint32_t>(value);
+        count += 6;
+        if (count >= 8) {
+            count -= 8;
+            bytes.push_back(static_cast<std::uint8_t>(bits >> count));
+        }
+    }
+    return bytes;
+}
+
+struct SVGBitmap {
+    std::vector<std::uint8_t> rgba;
     int width = 0;
     int height = 0;
-    double viewMinX = 0.0;
-    double viewMinY = 0.0;
-    double viewW = 0.0;
-    double viewH = 0.0;
-    const bool hasViewBox = parseViewBox(root.attrs, viewMinX, viewMinY, viewW, viewH);
-    if (useForcedSize) {
-        if (forcedWidth <= 0 || forcedHeight <= 0) {
-            throw std::runtime_error("Invalid forced raster size");
-        }
-        width = forcedWidth;
-        height = forcedHeight;
-    } else {
-        const bool hasWidth = parseIntAttr(root.attrs, "width", width);
-        const bool hasHeight = parseIntAttr(root.attrs, "height", height);
-        if (!hasWidth || !hasHeight) {
-            if (hasViewBox) {
-                if (!hasWidth) {
-                    width = static_cast<int>(std::lround(viewW));
+    double x0 = 0.0;
+    double y0 = 0.0;
+    double x1 = 0.0;
+    double y1 = 0.0;
+    Transform2D toLocal;
+};
+
+// One filled shape or embedded image in device pixels, in document order.
+// A shape's edges are a range of the document's shared edge list. Rows
+// [top, bottom) and columns [left, right) bound what it touches.
+struct SVGPaint {
+    std::size_t firstEdge = 0;
+    std::size_t edgeCount = 0;
+    std::shared_ptr<SVGBitmap> bitmap;
+    Color color;
+    double alpha = 1.0;
+    FillRule rule = FillRule::NonZero;
+    int left = 0;
+    int top = 0;
+    int right = 0;
+    int bottom = 0;
+};
+
+// Flattens subpaths given in user space into device-space edges.
+class PathFlattener {
+public:
+    PathFlattener(const Transform2D& transform, std::vector<RasterEdge>& edges) : m_transform(transform), m_edges(edges) {}
+
+    void moveTo(double x, double y) {
+        close();
+        m_start = m_transform.apply(x, y);
+        m_current = m_start;
+        m_open = true;
+    }
+
+    void lineTo(double x, double y) {
+        if (!m_open) {
+            moveTo(x, y);
+            return;
+        }
+        const std::pair<double, double> next = m_transform.apply(x, y);
+        addEdge(m_current, next);
+        m_current = next;
+    }
+
+    void cubicTo(double x1, double y1, double x2, double y2, double x3, double y3) {
+        if (!m_open) {
+            moveTo(x1, y1);
+        }
+        const std::pair<double, double> p0 = m_current;
+        const std::pair<double, double> p1 = m_transform.apply(x1, y1);
+        const std::pair<double, double> p2 = m_transform.apply(x2, y2);
+        const std::pair<double, double> p3 = m_transform.apply(x3, y3);
+        const int steps = curveSteps(distance(p0, p1) + distance(p1, p2) + distance(p2, p3));
+        for (int i = 1; i <= steps; ++i) {
+            const double t = static_cast<double>(i) / steps;
+            const double u = 1.0 - t;
+            const double a = u * u * u;
+            const double b = 3.0 * u * u * t;
+            const double c = 3.0 * u * t * t;
+            const double d = t * t * t;
+            const std::pair<double, double> next = {a * p0.first + b * p1.first + c * p2.first + d * p3.first,
+                                                    a * p0.second + b * p1.second + c * p2.second + d * p3.second};
+            addEdge(m_current, next);
+            m_current = next;
+        }
+    }
+
+    void close() {
+        if (m_open) {
+            addEdge(m_current, m_start);
+            m_current = m_start;
+            m_open = false;
+        }
+    }
+
+private:
+    static double distance(const std::pair<double, double>& a, const std::pair<double, double>& b) {
+        const double dx = b.first - a.first;
+        const double dy = b.second - a.second;
+        return std::sqrt(dx * dx + dy * dy);
+    }
+
+    // About one segment per 3 device pixels of control polygon keeps the
+    // chord error well under a tenth of a pixel for typical curvature.
+    static int curveSteps(double length) {
+        return std::clamp(static_cast<int>(std::ceil(length / 3.0)), 4, 512);
+    }
+
+    void addEdge(const std::pair<double, double>& a, const std::pair<double, double>& b) {
+        addRasterEdge(m_edges, a.first, a.second, b.first, b.second);
+    }
+
+    Transform2D m_transform;
+    std::vector<RasterEdge>& m_edges;
+    std::pair<double, double> m_start = {0.0, 0.0};
+    std::pair<double, double> m_current = {0.0, 0.0};
+    bool m_open = false;
+};
+
+// Appends an ellipse arc from angle start sweeping by sweep radians, as
+// cubic segments of at most a quarter turn each.
+void appendArc(PathFlattener& path, double cx, double cy, double rx, double ry, double rotation, double start, double sweep) {
+    const int segments = std::max(1, static_cast<int>(std::ceil(std::abs(sweep) / (kPi / 2.0) - 1e-9)));
+    const double step = sweep / segments;
+    const double k = 4.0 / 3.0 * std::tan(step / 4.0);
+    const double cosR = std::cos(rotation);
+    const double sinR = std::sin(rotation);
+    const auto point = [&](double ux, double uy) {
+        return std::pair<double, double>{cx + ux * cosR - uy * sinR, cy + ux * sinR + uy * cosR};
+    };
+    double angle = start;
+    for (int i = 0; i < segments; ++i) {
+        const double a0 = angle;
+        const double a1 = angle + step;
+        const double c0 = std::cos(a0);
+        const double s0 = std::sin(a0);
+        const double c1 = std::cos(a1);
+        const double s1 = std::sin(a1);
+        const auto p1 = point(rx * (c0 - k * s0), ry * (s0 + k * c0));
+        const auto p2 = point(rx * (c1 + k * s1), ry * (s1 - k * c1));
+        const auto p3 = point(rx * c1, ry * s1);
+        path.cubicTo(p1.first, p1.second, p2.first, p2.second, p3.first, p3.second);
+        angle = a1;
+    }
+}
+
+// Endpoint arc parameters to center form, as in SVG 1.1 appendix F.6.5.
+void appendEndpointArc(PathFlattener& path, double x0, double y0, double rx, double ry, double degrees, bool largeArc, bool sweep,
+                       double x, double y) {
+    rx = std::abs(rx);
+    ry = std::abs(ry);
+    if (x0 == x && y0 == y) {
+        return;
+    }
+    if (rx == 0.0 || ry == 0.0) {
+        path.lineTo(x, y);
+        return;
+    }
+    const double phi = degrees * kPi / 180.0;
+    const double cosPhi = std::cos(phi);
+    const double sinPhi = std::sin(phi);
+    const double dx = (x0 - x) / 2.0;
+    const double dy = (y0 - y) / 2.0;
+    const double x1p = cosPhi * dx + sinPhi * dy;
+    const double y1p = -sinPhi * dx + cosPhi * dy;
+    const double lambda = (x1p * x1p) / (rx * rx) + (y1p * y1p) / (ry * ry);
+    if (lambda > 1.0) {
+        rx *= std::sqrt(lambda);
+        ry *= std::sqrt(lambda);
+    }
+    const double numerator = rx * rx * ry * ry - rx * rx * y1p * y1p - ry * ry * x1p * x1p;
+    const double denominator = rx * rx * y1p * y1p + ry * ry * x1p * x1p;
+    double factor = std::sqrt(std::max(0.0, numerator / denominator));
+    if (largeArc == sweep) {
+        factor = -factor;
+    }
+    const double cxp = factor * rx * y1p / ry;
+    const double cyp = -factor * ry * x1p / rx;
+    const double cx = cosPhi * cxp - sinPhi * cyp + (x0 + x) / 2.0;
+    const double cy = sinPhi * cxp + cosPhi * cyp + (y0 + y) / 2.0;
+    const double start = std::atan2((y1p - cyp) / ry, (x1p - cxp) / rx);
+    double delta = std::atan2((-y1p - cyp) / ry, (-x1p - cxp) / rx) - start;
+    if (sweep && delta < 0.0) {
+        delta += 2.0 * kPi;
+    } else if (!sweep && delta > 0.0) {
+        delta -= 2.0 * kPi;
+    }
+    appendArc(path, cx, cy, rx, ry, phi, start, delta);
+}
+
+// Reads path data numbers and flags; commas and whitespace separate them.
+class PathDataReader {
+public:
+    explicit PathDataReader(const std::string& text) : m_text(text), m_pos(0) {}
+
+    bool atEnd() {
+        skipSeparators();
+        return m_pos >= m_text.size();
+    }
+
+    bool nextIsNumber() {
+        skipSeparators();
+        if (m_pos >= m_text.size()) {
+            return false;
+        }
+        const char c = m_text[m_pos];
+        return std::isdigit(static_cast<unsigned char>(c)) || c == '-' || c == '+' || c == '.';
+    }
+
+    char command() { return m_text[m_pos++]; }
+
+    double number() {
+        skipSeparators();
+        const char* begin = m_text.data() + m_pos;
+        double value = 0.0;
+        const char* end = readNumber(begin, m_text.data() + m_text.size(), value);
+        if (end == begin) {
+            throw std::runtime_error("Malformed SVG path data");
+        }
+        m_pos += static_cast<std::size_t>(end - begin);
+        return value;
+    }
+
+    bool flag() {
+        skipSeparators();
+        if (m_pos >= m_text.size() || (m_text[m_pos] != '0' && m_text[m_pos] != '1')) {
+            throw std::runtime_error("Malformed SVG arc flag");
+        }
+        return m_text[m_pos++] == '1';
+    }
+
+private:
+    void skipSeparators() {
+        while (m_pos < m_text.size() && (std::isspace(static_cast<unsigned char>(m_text[m_pos])) || m_text[m_pos] == ',')) {
+            ++m_pos;
+        }
+    }
+
+    const std::string& m_text;
+    std::size_t m_pos;
+};
+
+void appendPathData(PathFlattener& path, const std::string& data) {
+    PathDataReader reader(data);
+    double x = 0.0;
+    double y = 0.0;
+    double startX = 0.0;
+    double startY = 0.0;
+    // Reflected control point for S and T, valid after a matching curve.
+    double controlX = 0.0;
+    double controlY = 0.0;
+    char previous = 0;
+    char command = 0;
+    while (!reader.atEnd()) {
+        if (!reader.nextIsNumber()) {
+            command = reader.command();
+        } else if (command == 0) {
+            throw std::runtime_error("SVG path data must start with a command");
+        }
+        const bool relative = std::islower(static_cast<unsigned char>(command)) != 0;
+        const double baseX = relative ? x : 0.0;
+        const double baseY = relative ? y : 0.0;
+        const char upper = static_cast<char>(std::toupper(static_cast<unsigned char>(command)));
+        switch (upper) {
+            case 'M':
+                x = baseX + reader.number();
+                y = baseY + reader.number();
+                path.moveTo(x, y);
+                startX = x;
+                startY = y;
+                // Further pairs are implicit line-tos.
+                command = relative ? 'l' : 'L';
+                break;
+            case 'L':
+                x = baseX + reader.number();
+                y = baseY + reader.number();
+                path.lineTo(x, y);
+                break;
+            case 'H':
+                x = baseX + reader.number();
+                path.lineTo(x, y);
+                break;
+            case 'V':
+                y = baseY + reader.number();
+                path.lineTo(x, y);
+                break;
+            case 'C':
+            case 'S': {
+                double x1 = 2.0 * x - controlX;
+                double y1 = 2.0 * y - controlY;
+                if (upper == 'C') {
+                    x1 = baseX + reader.number();
+                    y1 = baseY + reader.number();
+                } else if (previous != 'C' && previous != 'S') {
+                    x1 = x;
+                    y1 = y;
                 }
-                if (!hasHeight) {
-                    height = static_cast<int>(std::lround(viewH));
+                const double x2 = baseX + reader.number();
+                const double y2 = baseY + reader.number();
+                const double x3 = baseX + reader.number();
+                const double y3 = baseY + reader.number();
+                path.cubicTo(x1, y1, x2, y2, x3, y3);
+                controlX = x2;
+                controlY = y2;
+                x = x3;
+                y = y3;
+                break;
+            }
+            case 'Q':
+            case 'T': {
+                double qx = 2.0 * x - controlX;
+                double qy = 2.0 * y - controlY;
+                if (upper == 'Q') {
+                    qx = baseX + reader.number();
+                    qy = baseY + reader.number();
+                } else if (previous != 'Q' && previous != 'T') {
+                    qx = x;
+                    qy = y;
                 }
+                const double x3 = baseX + reader.number();
+                const double y3 = baseY + reader.number();
+                path.cubicTo(x + 2.0 / 3.0 * (qx - x), y + 2.0 / 3.0 * (qy - y), x3 + 2.0 / 3.0 * (qx - x3),
+                             y3 + 2.0 / 3.0 * (qy - y3), x3, y3);
+                controlX = qx;
+                controlY = qy;
+                x = x3;
+                y = y3;
+                break;
+            }
+            case 'A': {
+                const double rx = reader.number();
+                const double ry = reader.number();
+                const double rotation = reader.number();
+                const bool largeArc = reader.flag();
+                const bool sweep = reader.flag();
+                const double endX = baseX + reader.number();
+                const double endY = baseY + reader.number();
+                appendEndpointArc(path, x, y, rx, ry, rotation, largeArc, sweep, endX, endY);
+                x = endX;
+                y = endY;
+                break;
             }
+            case 'Z':
+                path.close();
+                x = startX;
+                y = startY;
+                break;
+            default:
+                throw std::runtime_error(std::string("Unsupported SVG path command: ") + command);
+        }
+        previous = upper;
+    }
+    path.close();
+}
+
+std::vector<double> parseNumberList(const std::string& text) {
+    std::vector<double> values;
+    PathDataReader reader(text);
+    while (reader.nextIsNumber()) {
+        values.push_back(reader.number());
+    }
+    return values;
+}
+
+// Inherited painting state: the user-to-device transform and fill.
+struct SVGStyle {
+    Transform2D transform;
+    Color fill;
+    bool fillNone = false;
+    double fillOpacity = 1.0;
+    double opacity = 1.0;
+    FillRule rule = FillRule::NonZero;
+};
+
+// Applies one presentation property, from an attribute or a style
+// declaration. Unknown properties and values are ignored.
+void applyStyleProperty(SVGStyle& style, const std::string& name, const std::string& value) {
+    if (name == "fill") {
+        if (value == "none") {
+            style.fillNone = true;
+        } else if (parseColor(value, style.fill)) {
+            style.fillNone = false;
         }
-        if (width <= 0 || height <= 0) {
-            throw std::runtime_error("Invalid SVG dimensions (missing width/height or viewBox)");
+    } else if (name == "fill-rule") {
+        if (value == "evenodd") {
+            style.rule = FillRule::EvenOdd;
+        } else if (value == "nonzero") {
+            style.rule = FillRule::NonZero;
+        }
+    } else if (name == "fill-opacity" || name == "opacity") {
+        const double parsed = std::clamp(std::atof(value.c_str()), 0.0, 1.0);
+        if (name == "opacity") {
+            style.opacity *= parsed;
+        } else {
+            style.fillOpacity = parsed;
         }
     }
+}
 
-    SVGImage image(width, height, Color(255, 255, 255));
+std::string trimmed(const std::string& text) {
+    const std::size_t begin = text.find_first_not_of(" \t\r\n");
+    if (begin == std::string::npos) {
+        return "";
+    }
+    const std::size_t end = text.find_last_not_of(" \t\r\n");
+    return text.substr(begin, end - begin + 1);
+}
 
-    PreserveAspectRatio par = parsePreserveAspectRatio(root.attrs);
-    if (hasViewBox && !par.valid) {
-        throw std::runtime_error("Invalid preserveAspectRatio");
+// Group opacity is folded into each child's fill, so overlapping children
+// inside a translucent group show through each other.
+SVGStyle childStyle(const SVGStyle& parent, const XmlAttributes& attrs) {
+    SVGStyle style = parent;
+    style.transform = parent.transform * parseTransform(attrs);
+    for (const char* name : {"fill", "fill-rule", "fill-opacity", "opacity"}) {
+        const auto it = attrs.find(name);
+        if (it != attrs.end()) {
+            applyStyleProperty(style, name, trimmed(it->second));
+        }
     }
-    if (!hasViewBox) {
-        par.none = true;
+    const auto css = attrs.find("style");
+    if (css != attrs.end()) {
+        std::stringstream declarations(css->second);
+        std::string declaration;
+        while (std::getline(declarations, declaration, ';')) {
+            const std::size_t colon = declaration.find(':');
+            if (colon != std::string::npos) {
+                applyStyleProperty(style, trimmed(declaration.substr(0, colon)), trimmed(declaration.substr(colon + 1)));
+            }
+        }
     }
+    return style;
+}
 
-    double scaleX = 1.0;
-    double scaleY = 1.0;
-    double alignOffsetX = 0.0;
-    double alignOffsetY = 0.0;
+double numberAttr(const XmlAttributes& attrs, const char* name, double fallback = 0.0) {
+    double value = fallback;
+    parseNumberAttr(attrs, name, value);
+    return value;
+}
 
-    if (hasViewBox) {
-        const double sx = static_cast<double>(width) / viewW;
-        const double sy = static_cast<double>(height) / viewH;
-        if (par.none) {
-            scaleX = sx;
-            scaleY = sy;
-        } else {
-            const double scale = par.slice ? std::max(sx, sy) : std::min(sx, sy);
-            scaleX = scale;
-            scaleY = scale;
-            const double contentW = viewW * scale;
-            const double contentH = viewH * scale;
-            alignOffsetX = (static_cast<double>(width) - contentW) * par.alignX;
-            alignOffsetY = (static_cast<double>(height) - contentH) * par.alignY;
-        }
-    }
-
-    Transform2D viewTransform = Transform2D::identity();
-    if (hasViewBox) {
-        viewTransform = Transform2D::translation(-viewMinX, -viewMinY);
-        Transform2D scale = Transform2D::fromMatrix(scaleX, 0.0, 0.0, scaleY, alignOffsetX, alignOffsetY);
-        viewTransform = scale * viewTransform;
-    }
-
-    std::function<void(const XmlNode&, const Transform2D&)> visit = [&](const XmlNode& node, const Transform2D& parentTransform) {
-        const Transform2D localTransform = parseTransform(node.attrs);
-        const Transform2D combinedTransform = parentTransform * localTransform;
-        if (node.name == "rect") {
-            int rectW = 0;
-            int rectH = 0;
-            int rectX = 0;
-            int rectY = 0;
-            const bool hasW = parseIntAttr(node.attrs, "width", rectW);
-            const bool hasH = parseIntAttr(node.attrs, "height", rectH);
-            const bool hasX = parseIntAttr(node.attrs, "x", rectX);
-            const bool hasY = parseIntAttr(node.attrs, "y", rectY);
-            Color fill;
-            const bool hasFill = parseColorAttr(node.attrs, fill);
-
-            if (hasW && hasH && hasFill) {
-                const double x0 = static_cast<double>(hasX ? rectX : 0);
-                const double y0 = static_cast<double>(hasY ? rectY : 0);
-                const double x1 = x0 + static_cast<double>(rectW);
-                const double y1 = y0 + static_cast<double>(rectH);
-
-                const Transform2D totalTransform = viewTransform * combinedTransform;
-
-                const auto c1 = totalTransform.apply(x0, y0);
-                const auto c2 = totalTransform.apply(x1, y0);
-                const auto c3 = totalTransform.apply(x0, y1);
-                const auto c4 = totalTransform.apply(x1, y1);
-
-                double minX = std::min(std::min(c1.first, c2.first), std::min(c3.first, c4.first));
-                double minY = std::min(std::min(c1.second, c2.second), std::min(c3.second, c4.second));
-                double maxX = std::max(std::max(c1.first, c2.first), std::max(c3.first, c4.first));
-                double maxY = std::max(std::max(c1.second, c2.second), std::max(c3.second, c4.second));
-
-                int startX = std::max(0, static_cast<int>(std::floor(minX)));
-                int startY = std::max(0, static_cast<int>(std::floor(minY)));
-                int endX = std::min(width, static_cast<int>(std::ceil(maxX)));
-                int endY = std::min(height, static_cast<int>(std::ceil(maxY)));
-
-                if (startX == 0 && startY == 0 && endX == width && endY == height && combinedTransform.isIdentity()) {
-                    for (int py = 0; py < height; ++py) {
-                        for (int px = 0; px < width; ++px) {
-                            image.setPixel(px, py, fill);
-                        }
-                    }
-                } else {
-                    for (int py = startY; py < endY; ++py) {
-                        for (int px = startX; px < endX; ++px) {
-                            const auto local = totalTransform.applyInverse(static_cast<double>(px) + 0.5, static_cast<double>(py) + 0.5);
-                            if (local.first >= x0 && local.first < x1 && local.second >= y0 && local.second < y1) {
-                                image.setPixel(px, py, fill);
-                            }
-                        }
-                    }
+// Builds the outline of a basic shape or path; false for elements that do
+// not fill anything.
+bool appendShapeOutline(const std::string& name, const XmlAttributes& attrs, PathFlattener& path) {
+    if (name == "rect") {
+        const double x = numberAttr(attrs, "x");
+        const double y = numberAttr(attrs, "y");
+        const double width = numberAttr(attrs, "width");
+        const double height = numberAttr(attrs, "height");
+        if (width <= 0.0 || height <= 0.0) {
+            return false;
+        }
+        double rx = -1.0;
+        double ry = -1.0;
+        parseNumberAttr(attrs, "rx", rx);
+        parseNumberAttr(attrs, "ry", ry);
+        if (rx < 0.0) {
+            rx = ry;
+        }
+        if (ry < 0.0) {
+            ry = rx;
+        }
+        rx = std::clamp(rx, 0.0, width / 2.0);
+        ry = std::clamp(ry, 0.0, height / 2.0);
+        if (rx <= 0.0 || ry <= 0.0) {
+            path.moveTo(x, y);
+            path.lineTo(x + width, y);
+            path.lineTo(x + width, y + height);
+            path.lineTo(x, y + height);
+            path.close();
+            return true;
+        }
+        path.moveTo(x + rx, y);
+        path.lineTo(x + width - rx, y);
+        appendArc(path, x + width - rx, y + ry, rx, ry, 0.0, -kPi / 2.0, kPi / 2.0);
+        path.lineTo(x + width, y + height - ry);
+        appendArc(path, x + width - rx, y + height - ry, rx, ry, 0.0, 0.0, kPi / 2.0);
+        path.lineTo(x + rx, y + height);
+        appendArc(path, x + rx, y + height - ry, rx, ry, 0.0, kPi / 2.0, kPi / 2.0);
+        path.lineTo(x, y + ry);
+        appendArc(path, x + rx, y + ry, rx, ry, 0.0, kPi, kPi / 2.0);
+        path.close();
+        return true;
+    }
+    if (name == "circle" || name == "ellipse") {
+        const double cx = numberAttr(attrs, "cx");
+        const double cy = numberAttr(attrs, "cy");
+        const double rx = name == "circle" ? numberAttr(attrs, "r") : numberAttr(attrs, "rx");
+        const double ry = name == "circle" ? rx : numberAttr(attrs, "ry");
+        if (rx <= 0.0 || ry <= 0.0) {
+            return false;
+        }
+        // Four quarter-turn cubics; kappa places their control points.
+        const double kx = rx * kCircleKappa;
+        const double ky = ry * kCircleKappa;
+        path.moveTo(cx + rx, cy);
+        path.cubicTo(cx + rx, cy + ky, cx + kx, cy + ry, cx, cy + ry);
+        path.cubicTo(cx - kx, cy + ry, cx - rx, cy + ky, cx - rx, cy);
+        path.cubicTo(cx - rx, cy - ky, cx - kx, cy - ry, cx, cy - ry);
+        path.cubicTo(cx + kx, cy - ry, cx + rx, cy - ky, cx + rx, cy);
+        path.close();
+        return true;
+    }
+    if (name == "polygon" || name == "polyline") {
+        const auto it = attrs.find("points");
+        if (it == attrs.end()) {
+            return false;
+        }
+        const std::vector<double> points = parseNumberList(it->second);
+        if (points.size() < 6) {
+            return false;
+        }
+        path.moveTo(points[0], points[1]);
+        for (std::size_t i = 2; i + 1 < points.size(); i += 2) {
+            path.lineTo(points[i], points[i + 1]);
+        }
+        path.close();
+        return true;
+    }
+    if (name == "path") {
+        const auto it = attrs.find("d");
+        if (it == attrs.end()) {
+            return false;
+        }
+        appendPathData(path, it->second);
+        return true;
+    }
+    return false;
+}
+
+void setPaintBounds(SVGPaint& paint, double minX, double minY, double maxX, double maxY, int width, int height) {
+    paint.left = std::clamp(static_cast<int>(std::floor(minX)), 0, width);
+    paint.top = std::clamp(static_cast<int>(std::floor(minY)), 0, height);
+    paint.right = std::clamp(static_cast<int>(std::ceil(maxX)) + 1, 0, width);
+    paint.bottom = std::clamp(static_cast<int>(std::ceil(maxY)), 0, height);
+}
+
+// Decodes an <image> holding a base64 PNG data URI; other references are
+// ignored.
+bool makeBitmapPaint(const XmlAttributes& attrs, const SVGStyle& style, int width, int height, SVGPaint& paint) {
+    static const std::string kPrefix = "data:image/png;base64,";
+    auto href = attrs.find("href");
+    if (href == attrs.end()) {
+        href = attrs.find("xlink:href");
+    }
+    const double imageW = numberAttr(attrs, "width");
+    const double imageH = numberAttr(attrs, "height");
+    if (href == attrs.end() || href->second.compare(0, kPrefix.size(), kPrefix) != 0 || imageW <= 0.0 || imageH <= 0.0) {
+        return false;
+    }
+
+    auto bitmap = std::make_shared<SVGBitmap>();
+    const std::vector<std::uint8_t> png = decodeBase64(href->second, kPrefix.size());
+    PNGImage::decode(png.data(), png.size(), {4, [&bitmap](int w, int h) {
+                                                  bitmap->width = w;
+                                                  bitmap->height = h;
+                                                  bitmap->rgba.resize(static_cast<std::size_t>(w) * static_cast<std::size_t>(h) * 4);
+                                                  return bitmap->rgba.data();
+                                              }});
+    bitmap->x0 = numberAttr(attrs, "x");
+    bitmap->y0 = numberAttr(attrs, "y");
+    bitmap->x1 = bitmap->x0 + imageW;
+    bitmap->y1 = bitmap->y0 + imageH;
+    bitmap->toLocal = style.transform.inverse();
+
+    double minX = std::numeric_limits<double>::max();
+    double minY = std::numeric_limits<double>::max();
+    double maxX = std::numeric_limits<double>::lowest();
+    double maxY = std::numeric_limits<double>::lowest();
+    for (const auto& corner : {style.transform.apply(bitmap->x0, bitmap->y0), style.transform.apply(bitmap->x1, bitmap->y0),
+                               style.transform.apply(bitmap->x0, bitmap->y1), style.transform.apply(bitmap->x1, bitmap->y1)}) {
+        minX = std::min(minX, corner.first);
+        minY = std::min(minY, corner.second);
+        maxX = std::max(maxX, corner.first);
+        maxY = std::max(maxY, corner.second);
+    }
+    setPaintBounds(paint, minX, minY, maxX, maxY, width, height);
+    paint.bitmap = std::move(bitmap);
+    paint.alpha = style.opacity;
+    return true;
+}
+
+std::uint8_t blendChannel(std::uint8_t source, std::uint8_t destination, double alpha) {
+    return static_cast<std::uint8_t>(std::lround(destination + (source - destination) * alpha));
+}
+
+// Samples the nearest source pixel for each device pixel center and blends
+// it by its alpha.
+void drawBitmapRows(const SVGPaint& paint, int top, int bottom, SVGImage& image) {
+    const SVGBitmap& bitmap = *paint.bitmap;
+    const double scaleX = bitmap.width / (bitmap.x1 - bitmap.x0);
+    const double scaleY = bitmap.height / (bitmap.y1 - bitmap.y0);
+    for (int py = std::max(top, paint.top); py < std::min(bottom, paint.bottom); ++py) {
+        for (int px = paint.left; px < paint.right; ++px) {
+            const auto local = bitmap.toLocal.apply(px + 0.5, py + 0.5);
+            if (local.first < bitmap.x0 || local.first >= bitmap.x1 || local.second < bitmap.y0 || local.second >= bitmap.y1) {
+                continue;
+            }
+            const int sx = std::min(bitmap.width - 1, static_cast<int>((local.first - bitmap.x0) * scaleX));
+            const int sy = std::min(bitmap.height - 1, static_cast<int>((local.second - bitmap.y0) * scaleY));
+            const std::uint8_t* src =
+                bitmap.rgba.data() + (static_cast<std::size_t>(sy) * static_cast<std::size_t>(bitmap.width) + static_cast<std::size_t>(sx)) * 4;
+            const double alpha = paint.alpha * src[3] / 255.0;
+            if (alpha <= 0.0) {
+                continue;
+            }
+            Color& dst = image.data()[pixelIndex(px, py, image.width())];
+            dst = Color(blendChannel(src[0], dst.r, alpha), blendChannel(src[1], dst.g, alpha), blendChannel(src[2], dst.b, alpha));
+        }
+    }
+}
+
+// Blends the coverage spans of each band row of a shape into the image.
+void fillShapeRows(const SVGPaint& paint, const RasterEdge* edges, int top, int bottom, int width, SVGImage& image, ScanlineRasterizer& rasterizer) {
+    top = std::max(top, paint.top);
+    bottom = std::min(bottom, paint.bottom);
+    rasterizer.rasterize(edges + paint.firstEdge, paint.edgeCount, paint.rule, RasterSampling::Coverage, top, bottom, 0, width,
+                         [&](int y, const std::vector<CoverageSpan>& spans) {
+                             Color* pixels = image.data() + pixelIndex(0, y, width);
+                             for (const CoverageSpan& span : spans) {
+                                 const double alpha = paint.alpha * span.coverage;
+                                 Color* dst = pixels + span.x;
+                                 if (alpha >= 1.0) {
+                                     std::fill(dst, dst + span.length, paint.color);
+                                     continue;
+                                 }
+                                 for (int i = 0; i < span.length; ++i) {
+                                     dst[i] = Color(blendChannel(paint.color.r, dst[i].r, alpha), blendChannel(paint.color.g, dst[i].g, alpha),
+                                                    blendChannel(paint.color.b, dst[i].b, alpha));
+                                 }
+                             }
+                         });
+}
+
+// Elements whose content never paints directly.
+bool isNonRenderingContainer(const std::string& name) {
+    static const char* const kNames[] = {"defs", "clipPath", "mask", "pattern", "marker", "symbol", "linearGradient",
+                                         "radialGradient", "filter", "style", "script", "title", "desc", "metadata"};
+    return std::any_of(std::begin(kNames), std::end(kNames), [&name](const char* skip) { return name == skip; });
+}
+
+// Parses the document tag by tag, flattening each shape into device edges
+// as it is read, then rasterizes horizontal bands of kBandRows rows on the
+// worker pool. Each band paints, in document order, only the shapes that
+// reach it.
+SVGImage loadSVGImpl(const std::string& filename, int forcedWidth, int forcedHeight, bool useForcedSize, int threads) {
+    std::ifstream in(filename, std::ios::binary);
+    if (!in) {
+        throw std::runtime_error("Cannot open SVG file: " + filename);
+    }
+
+    XmlTagReader reader(in);
+    XmlTag tag;
+    int width = 0;
+    int height = 0;
+    std::vector<SVGStyle> styles;
+    std::vector<std::string> open;
+    std::vector<SVGPaint> paints;
+    std::vector<RasterEdge> edges;
+    int skipDepth = 0;
+    bool sawRoot = false;
+
+    while (reader.next(tag)) {
+        if (tag.closing) {
+            if (open.empty() || open.back() != tag.name) {
+                throw std::runtime_error(open.empty() ? "Unexpected closing tag" : "Mismatched XML closing tag");
+            }
+            open.pop_back();
+            if (skipDepth > 0) {
+                --skipDepth;
+            } else {
+                styles.pop_back();
+            }
+            continue;
+        }
+
+        if (!sawRoot) {
+            if (tag.name != "svg") {
+                throw std::runtime_error("Root element is not svg");
+            }
+            sawRoot = true;
+            double viewMinX = 0.0;
+            double viewMinY = 0.0;
+            double viewW = 0.0;
+            double viewH = 0.0;
+            const bool hasViewBox = parseViewBox(tag.attrs, viewMinX, viewMinY, viewW, viewH);
+            if (useForcedSize) {
+                if (forcedWidth <= 0 || forcedHeight <= 0) {
+                    throw std::runtime_error("Invalid forced raster size");
+                }
+                width = forcedWidth;
+                height = forcedHeight;
+            } else {
+                const bool hasWidth = parseIntAttr(tag.attrs, "width", width);
+                const bool hasHeight = parseIntAttr(tag.attrs, "height", height);
+                if (hasViewBox && !hasWidth) {
+                    width = static_cast<int>(std::lround(viewW));
+                }
+                if (hasViewBox && !hasHeight) {
+                    height = static_cast<int>(std::lround(viewH));
+                }
+                if (width <= 0 || height <= 0) {
+                    throw std::runtime_error("Invalid SVG dimensions (missing width/height or viewBox)");
                 }
             }
+
+            PreserveAspectRatio par = parsePreserveAspectRatio(tag.attrs);
+            if (hasViewBox && !par.valid) {
+                throw std::runtime_error("Invalid preserveAspectRatio");
+            }
+            SVGStyle root;
+            if (hasViewBox) {
+                double scaleX = static_cast<double>(width) / viewW;
+                double scaleY = static_cast<double>(height) / viewH;
+                double alignOffsetX = 0.0;
+                double alignOffsetY = 0.0;
+                if (!par.none) {
+                    const double scale = par.slice ? std::max(scaleX, scaleY) : std::min(scaleX, scaleY);
+                    scaleX = scale;
+                    scaleY = scale;
+                    alignOffsetX = (static_cast<double>(width) - viewW * scale) * par.alignX;
+                    alignOffsetY = (static_cast<double>(height) - viewH * scale) * par.alignY;
+                }
+                root.transform = Transform2D::fromMatrix(scaleX, 0.0, 0.0, scaleY, alignOffsetX, alignOffsetY) *
+                                 Transform2D::translation(-viewMinX, -viewMinY);
+            }
+            styles.push_back(childStyle(root, tag.attrs));
+            if (!tag.selfClosing) {
+                open.push_back(tag.name);
+            }
+            continue;
+        }
+        if (open.empty()) {
+            throw std::runtime_error("Unexpected element after the svg root");
         }
 
-        for (const XmlNode& child : node.children) {
-            visit(child, combinedTransform);
+        if (skipDepth > 0 || isNonRenderingContainer(tag.name)) {
+            if (!tag.selfClosing) {
+                open.push_back(tag.name);
+                ++skipDepth;
+            }
+            continue;
         }
-    };
 
-    visit(root, Transform2D::identity());
+        const SVGStyle style = childStyle(styles.back(), tag.attrs);
+        SVGPaint paint;
+        if (tag.name == "image") {
+            if (makeBitmapPaint(tag.attrs, style, width, height, paint)) {
+                paints.push_back(std::move(paint));
+            }
+        } else if (!style.fillNone) {
+            paint.firstEdge = edges.size();
+            PathFlattener path(style.transform, edges);
+            const bool outlined = appendShapeOutline(tag.name, tag.attrs, path);
+            paint.edgeCount = edges.size() - paint.firstEdge;
+            bool kept = false;
+            if (outlined && paint.edgeCount > 0) {
+                double minX = std::numeric_limits<double>::max();
+                double minY = std::numeric_limits<double>::max();
+                double maxX = std::numeric_limits<double>::lowest();
+                double maxY = std::numeric_limits<double>::lowest();
+                for (auto edge = edges.begin() + static_cast<std::ptrdiff_t>(paint.firstEdge); edge != edges.end(); ++edge) {
+                    minX = std::min(minX, std::min(edge->x0, edge->x1));
+                    maxX = std::max(maxX, std::max(edge->x0, edge->x1));
+                    minY = std::min(minY, edge->y0);
+                    maxY = std::max(maxY, edge->y1);
+                }
+                setPaintBounds(paint, minX, minY, maxX, maxY, width, height);
+                paint.color = style.fill;
+                paint.alpha = style.fillOpacity * style.opacity;
+                paint.rule = style.rule;
+                kept = paint.left < paint.right && paint.top < paint.bottom && paint.alpha > 0.0;
+            }
+            if (kept) {
+                ScanlineRasterizer::sortEdges(edges.data() + paint.firstEdge, paint.edgeCount);
+                paints.push_back(std::move(paint));
+            } else {
+                edges.resize(paint.firstEdge);
+            }
+        }
+        if (!tag.selfClosing) {
+            open.push_back(tag.name);
+            styles.push_back(style);
+        }
+    }
+    if (!sawRoot) {
+        throw std::runtime_error("Root element is not svg");
+    }
+    if (!open.empty()) {
+        throw std::runtime_error("Unexpected end of XML");
+    }
 
+    SVGImage image(width, height, Color(255, 255, 255));
+    const int bandCount = (height + kBandRows - 1) / kBandRows;
+    std::vector<std::vector<std::size_t>> bands(static_cast<std::size_t>(bandCount));
+    for (std::size_t i = 0; i < paints.size(); ++i) {
+        for (int band = paints[i].top / kBandRows; band * kBandRows < paints[i].bottom; ++band) {
+            bands[static_cast<std::size_t>(band)].push_back(i);
+        }
+    }
+    std::vector<ScanlineRasterizer> rasterizers(static_cast<std::size_t>(parallelWorkerCount(bandCount, threads)));
+    parallelForWorkers(bandCount, threads, [&](int band, int worker) {
+        const int top = band * kBandRows;
+        const int bottom = std::min(height, top + kBandRows);
+        for (std::size_t index : bands[static_cast<std::size_t>(band)]) {
+            const SVGPaint& paint = paints[index];
+            if (paint.bitmap) {
+                drawBitmapRows(paint, top, bottom, image);
+            } else {
+                fillShapeRows(paint, edges.data(), top, bottom, width, image, rasterizers[static_cast<std::size_t>(worker)]);
+            }
+        }
+    });
     return image;
 }
 } // namespace
 
 SVGImage SVGImage::load(const std::string& filename) {
-    return loadSVGImpl(filename, 0, 0, false);
+    return loadSVGImpl(filename, 0, 0, false, 0);
 }
 
-SVGImage SVGImage::load(const std::string& filename, int rasterWidth, int rasterHeight) {
-    return loadSVGImpl(filename, rasterWidth, rasterHeight, true);
+SVGImage SVGImage::load(const std::string& filename, int rasterWidth, int rasterHeight, int threads) {
+    return loadSVGImpl(filename, rasterWidth, rasterHeight, true, threads);
 }
 
 void copyToRasterImage(const SVGImage& source, RasterImage& destination) {
@@ -672,12 +1792,12 @@ void copyToLayer(const SVGImage& source, Layer& destination, std::uint8_t alpha)
     }
 }
 
-void rasterizeSVGFileToRaster(const std::string& filename, RasterImage& destination) {
-    const SVGImage source = SVGImage::load(filename, destination.width(), destination.height());
+void rasterizeSVGFileToRaster(const std::string& filename, RasterImage& destination, int threads) {
+    const SVGImage source = SVGImage::load(filename, destination.width(), destination.height(), threads);
     copyToRasterImage(source, destination);
 }
 
-void rasterizeSVGFileToLayer(const std::string& filename, Layer& destination, std::uint8_t alpha) {
-    const SVGImage source = SVGImage::load(filename, destination.image().width(), destination.image().height());
+void rasterizeSVGFileToLayer(const std::string& filename, Layer& destination, std::uint8_t alpha, int threads) {
+    const SVGImage source = SVGImage::load(filename, destination.image().width(), destination.image().height(), threads);
     copyToLayer(source, destination, alpha);
 }
@@ -2,6 +2,7 @@
 #define SVG_H
 
 #include "image.h"
+#include "png.h"
 
 #include <cstdint>
 #include <string>
@@ -9,6 +10,17 @@
 
 class Layer;
 
+// Rects merges equal-color pixels into as few rectangles as possible
+// (exact, but large for photographic content); EmbedPNG stores the raster
+// as one base64 PNG <image>. Auto picks EmbedPNG once rectangles would
+// average fewer than 16 pixels each. png applies to the embedded image.
+enum class SVGExportMode { Auto, Rects, EmbedPNG };
+
+struct SVGSaveOptions {
+    SVGExportMode mode = SVGExportMode::Auto;
+    PNGSaveOptions png;
+};
+
 class SVGImage : public VectorImage {
 public:
     SVGImage();
@@ -19,10 +31,18 @@ public:
     bool inBounds(int x, int y) const override;
     const Color& getPixel(int x, int y) const override;
     void setPixel(int x, int y, const Color& color) override;
-
-    bool save(const std::string& filename) const;
+    // Tightly packed rows, top to bottom.
+    Color* data();
+    const Color* data() const;
+
+    bool save(const std::string& filename, const SVGSaveOptions& options = SVGSaveOptions()) const;
+    // RGBA rows keep their alpha: translucent rects get fill-opacity and
+    // fully transparent pixels get none, and an embedded PNG stores it.
+    static bool saveRows(const std::string& filename, const PixelRows& pixels, const SVGSaveOptions& options = SVGSaveOptions());
     static SVGImage load(const std::string& filename);
-    static SVGImage load(const std::string& filename, int rasterWidth, int rasterHeight);
+    // Shapes are anti-aliased and rasterized in row bands across threads
+    // (0 uses all cores).
+    static SVGImage load(const std::string& filename, int rasterWidth, int rasterHeight, int threads = 0);
 
 private:
     int m_width;
@@ -32,7 +52,7 @@ private:
 
 void copyToRasterImage(const SVGImage& source, RasterImage& destination);
 void copyToLayer(const SVGImage& source, Layer& destination, std::uint8_t alpha = 255);
-void rasterizeSVGFileToRaster(const std::string& filename, RasterImage& destination);
-void rasterizeSVGFileToLayer(const std::string& filename, Layer& destination, std::uint8_t alpha = 255);
+void rasterizeSVGFileToRaster(const std::string& filename, RasterImage& destination, int threads = 0);
+void rasterizeSVGFileToLayer(const std::string& filename, Layer& destination, std::uint8_t alpha = 255, int threads = 0);
 
 #endif
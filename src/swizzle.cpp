@@ -0,0 +1,103 @@
+#include "swizzle.h"
+
+#include <cstring>
+#include <stdexcept>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define SWIZZLE_HAS_SSSE3 1
+#include <tmmintrin.h>
+#endif
+
+namespace {
+int sourceChannel(int channel, bool swapRedBlue) {
+    return swapRedBlue && channel < 3 ? 2 - channel : channel;
+}
+
+void convertScalar(const std::uint8_t* src, int srcChannels, std::uint8_t* dst, int dstChannels, std::size_t count,
+                   bool swapRedBlue) {
+    if (srcChannels == 4 && dstChannels == 4 && swapRedBlue) {
+        // Whole-word form the compiler can vectorize on any target.
+        for (std::size_t i = 0; i < count; ++i) {
+            std::uint32_t value;
+            std::memcpy(&value, src + i * 4, 4);
+            value = (value & 0xFF00FF00u) | ((value >> 16) & 0xFFu) | ((value & 0xFFu) << 16);
+            std::memcpy(dst + i * 4, &value, 4);
+        }
+        return;
+    }
+    const int red = sourceChannel(0, swapRedBlue);
+    const int blue = sourceChannel(2, swapRedBlue);
+    for (std::size_t i = 0; i < count; ++i, src += srcChannels, dst += dstChannels) {
+        dst[0] = src[red];
+        dst[1] = src[1];
+        dst[2] = src[blue];
+        if (dstChannels == 4) {
+            dst[3] = srcChannels == 4 ? src[3] : 255;
+        }
+    }
+}
+
+#ifdef SWIZZLE_HAS_SSSE3
+#ifndef __SSSE3__
+bool hasSSSE3() {
+    static const bool supported = __builtin_cpu_supports("ssse3");
+    return supported;
+}
+#else
+bool hasSSSE3() {
+    return true;
+}
+#endif
+
+// Four pixels per shuffle. Loads and stores are 16 bytes even when a
+// 3-channel side only uses 12, so the loop stops while two more pixels
+// remain and leaves them to the scalar tail. Returns the pixels converted.
+__attribute__((target("ssse3"))) std::size_t convertSSSE3(const std::uint8_t* src, int srcChannels, std::uint8_t* dst,
+                                                         int dstChannels, std::size_t count, bool swapRedBlue) {
+    alignas(16) std::uint8_t shuffle[16];
+    alignas(16) std::uint8_t fill[16] = {};
+    std::memset(shuffle, 0x80, sizeof(shuffle));
+    for (int pixel = 0; pixel < 4; ++pixel) {
+        for (int channel = 0; channel < dstChannels; ++channel) {
+            const int out = pixel * dstChannels + channel;
+            if (channel == 3 && srcChannels == 3) {
+                fill[out] = 0xFF;
+                continue;
+            }
+            shuffle[out] = static_cast<std::uint8_t>(pixel * srcChannels + sourceChannel(channel, swapRedBlue));
+        }
+    }
+    const __m128i shuffleMask = _mm_load_si128(reinterpret_cast<const __m128i*>(shuffle));
+    const __m128i fillMask = _mm_load_si128(reinterpret_cast<const __m128i*>(fill));
+    const std::size_t srcStep = static_cast<std::size_t>(srcChannels) * 4;
+    const std::size_t dstStep = static_cast<std::size_t>(dstChannels) * 4;
+    std::size_t done = 0;
+    for (; done + 6 <= count; done += 4, src += srcStep, dst += dstStep) {
+        const __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+        const __m128i converted = _mm_or_si128(_mm_shuffle_epi8(pixels, shuffleMask), fillMask);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), converted);
+    }
+    return done;
+}
+#endif
+} // namespace
+
+void convertPixels(const std::uint8_t* src, int srcChannels, std::uint8_t* dst, int dstChannels, std::size_t count,
+                   bool swapRedBlue) {
+    if ((srcChannels != 3 && srcChannels != 4) || (dstChannels != 3 && dstChannels != 4)) {
+        throw std::invalid_argument("Pixel conversion needs 3 or 4 channels");
+    }
+    if (srcChannels == dstChannels && !swapRedBlue) {
+        std::memcpy(dst, src, count * static_cast<std::size_t>(srcChannels));
+        return;
+    }
+#ifdef SWIZZLE_HAS_SSSE3
+    if (hasSSSE3()) {
+        const std::size_t done = convertSSSE3(src, srcChannels, dst, dstChannels, count, swapRedBlue);
+        src += done * static_cast<std::size_t>(srcChannels);
+        dst += done * static_cast<std::size_t>(dstChannels);
+        count -= done;
+    }
+#endif
+    convertScalar(src, srcChannels, dst, dstChannels, count, swapRedBlue);
+}
@@ -0,0 +1,14 @@
+#ifndef SWIZZLE_H
+#define SWIZZLE_H
+
+#include <cstddef>
+#include <cstdint>
+
+// Converts count packed 8-bit pixels of 3 or 4 channels. swapRedBlue
+// exchanges the first and third channels (RGB <-> BGR). A fourth channel is
+// copied when both layouts have one, written as 255 when only dst has one
+// and dropped otherwise. src and dst must not overlap.
+void convertPixels(const std::uint8_t* src, int srcChannels, std::uint8_t* dst, int dstChannels, std::size_t count,
+                   bool swapRedBlue);
+
+#endif
@@ -1,27 +1,51 @@
 #include "example_api.h"
 #include "bmp.h"
 #include "cli.h"
+#include "cli_ops_core.h"
+#include "cli_shared.h"
+#include "codec.h"
+#include "color_lut.h"
+#include "compress.h"
+#include "display_list.h"
+#include "draw_target.h"
 #include "drawable.h"
 #include "effects.h"
+#include "flood_fill.h"
+#include "generator.h"
 #include "gif.h"
 #include "jpg.h"
 #include "layer.h"
+#include "parallel.h"
 #include "png.h"
+#include "profile.h"
+#include "raster.h"
+#include "resample.h"
 #include "resize.h"
 #include "svg.h"
+#include "swizzle.h"
 #include "webp.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cmath>
 #include <chrono>
 #include <cstdint>
+#include <cstring>
 #include <exception>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <iterator>
+#include <sstream>
 #include <stdexcept>
 #include <string>
+#include <thread>
 #include <vector>
 
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
 namespace {
 struct DiffStats {
     double meanAbs = 0.0;
@@ -137,14 +161,12 @@ void testCodecRoundtripAgainstReference() {
         require(s.maxAbs <= 180, "JPG max absolute channel error is too high vs reference");
     }
 
-    if (WEBPImage::isToolingAvailable()) {
+    {
         WEBPImage webp = example_api::createSmiley256WEBP();
         require(webp.save(testOutDir + "/test_ref.webp"), "Failed saving WEBP in test");
         WEBPImage webpDecoded = WEBPImage::load(testOutDir + "/test_ref.webp");
         const DiffStats s = compareImages(reference, webpDecoded);
         require(s.maxAbs == 0, "WEBP lossless roundtrip must be pixel identical to reference");
-    } else {
-        std::cout << "Skipping WEBP roundtrip test (install cwebp and dwebp to enable)\n";
     }
 
     SVGImage svg = example_api::createSmiley256SVG();
@@ -631,49 +653,3504 @@ void testGroupedLayerOpacityAffectsComposite() {
     require(p.r == 188 && p.g == 188 && p.b == 188, "Group opacity should apply to the flattened group result");
 }
 
-void testIFLOWSerializationRoundtripPreservesStack() {
-    const std::string testOutDir = "build/output/test-images";
-    std::filesystem::create_directories(testOutDir);
-    const std::string iflowPath = testOutDir + "/roundtrip.iflow";
+Document buildCompositeStressDocument() {
+    Document doc(37, 23);
+    Layer background("Background", 37, 23, PixelRGBA8(0, 0, 0, 255));
+    for (int y = 0; y < 23; ++y) {
+        for (int x = 0; x < 37; ++x) {
+            background.image().setPixel(x, y, PixelRGBA8(static_cast<std::uint8_t>(x * 7), static_cast<std::uint8_t>(y * 11), 90, 255));
+        }
+    }
+    doc.addLayer(background);
 
-    Document original(4, 2);
-    original.addLayer(Layer("Background", 4, 2, PixelRGBA8(12, 24, 36, 255)));
+    Layer rotated("Rotated", 12, 9, PixelRGBA8(240, 120, 30, 200));
+    rotated.transform().setRotationDegrees(33.0, 6.0, 4.5);
+    rotated.setOffset(10, 5);
+    rotated.ensureMask(PixelRGBA8(255, 255, 255, 255)).setPixel(2, 2, PixelRGBA8(40, 40, 40, 255));
+    rotated.setBlendMode(BlendMode::Screen);
+    doc.addLayer(rotated);
 
-    LayerGroup faceGroup("Face Group");
-    faceGroup.setOffset(1, 0);
-    faceGroup.setOpacity(0.8f);
-    faceGroup.transform().setTranslation(0.0, 1.0);
+    LayerGroup group("Group");
+    group.setOpacity(0.7f);
+    group.setBlendMode(BlendMode::Multiply);
+    group.transform().setTranslation(3.0, -2.0);
+    Layer scaled("Scaled", 8, 8, PixelRGBA8(30, 200, 180, 160));
+    scaled.transform().setScale(2.5, 1.5);
+    group.addLayer(scaled);
+    LayerGroup nested("Nested");
+    nested.setOffset(20, 9);
+    nested.addLayer(Layer("Dot", 5, 5, PixelRGBA8(255, 255, 255, 128)));
+    group.addGroup(nested);
+    doc.addGroup(group);
+    return doc;
+}
 
-    Layer fill("Fill", 2, 2, PixelRGBA8(220, 180, 80, 255));
-    fill.transform().setTranslation(1.0, 0.0);
-    fill.ensureMask(PixelRGBA8(255, 255, 255, 255)).setPixel(1, 1, PixelRGBA8(0, 0, 0, 255));
-    faceGroup.addLayer(fill);
+void testTiledCompositeMatchesSerial() {
+    const Document doc = buildCompositeStressDocument();
 
-    Layer shade("Shade", 2, 2, PixelRGBA8(20, 40, 100, 180));
-    shade.setBlendMode(BlendMode::Multiply);
-    faceGroup.addLayer(shade);
+    CompositeOptions serial;
+    serial.threads = 1;
+    serial.tileSize = 4096;
+    const ImageBuffer expected = doc.composite(serial);
 
-    original.addGroup(faceGroup);
+    CompositeOptions tiled;
+    tiled.threads = 4;
+    tiled.tileSize = 5;
+    const ImageBuffer actual = doc.composite(tiled);
 
-    require(saveDocumentIFLOW(original, iflowPath), "Saving IFLOW document should succeed");
-    Document loaded = loadDocumentIFLOW(iflowPath);
+    require(actual.width() == expected.width() && actual.height() == expected.height(), "Tiled composite should preserve dimensions");
+    for (int y = 0; y < expected.height(); ++y) {
+        for (int x = 0; x < expected.width(); ++x) {
+            const PixelRGBA8 pa = expected.getPixel(x, y);
+            const PixelRGBA8 pb = actual.getPixel(x, y);
+            require(pa.r == pb.r && pa.g == pb.g && pa.b == pb.b && pa.a == pb.a, "Tiled threaded composite should match serial output");
+        }
+    }
+}
 
-    require(loaded.width() == original.width() && loaded.height() == original.height(), "IFLOW should preserve dimensions");
-    require(loaded.nodeCount() == 2, "IFLOW should preserve root node count");
-    require(loaded.node(1).isGroup(), "IFLOW should preserve group nodes");
-    const LayerGroup& loadedGroup = loaded.node(1).asGroup();
-    require(loadedGroup.nodeCount() == 2, "IFLOW should preserve group children");
-    require(loadedGroup.node(0).asLayer().hasMask(), "IFLOW should preserve per-layer masks");
+float referenceSrgbToLinear(float c) {
+    if (c <= 0.04045f) {
+        return c / 12.92f;
+    }
+    return std::pow((c + 0.055f) / 1.055f, 2.4f);
+}
 
-    const ImageBuffer a = original.composite();
-    const ImageBuffer b = loaded.composite();
+std::uint8_t referenceEncode(float linear) {
+    const float clamped = std::min(1.0f, std::max(0.0f, linear));
+    const float srgb = clamped <= 0.0031308f ? clamped * 12.92f : 1.055f * std::pow(clamped, 1.0f / 2.4f) - 0.055f;
+    return static_cast<std::uint8_t>(std::lround(std::min(1.0f, std::max(0.0f, srgb)) * 255.0f));
+}
+
+float referenceBlend(BlendMode mode, float d, float s) {
+    switch (mode) {
+        case BlendMode::Multiply:
+            return d * s;
+        case BlendMode::Screen:
+            return 1.0f - (1.0f - d) * (1.0f - s);
+        case BlendMode::Overlay:
+            return d < 0.5f ? (2.0f * d * s) : (1.0f - 2.0f * (1.0f - d) * (1.0f - s));
+        case BlendMode::Darken:
+            return std::min(d, s);
+        case BlendMode::Lighten:
+            return std::max(d, s);
+        case BlendMode::Add:
+            return std::min(1.0f, d + s);
+        case BlendMode::Subtract:
+            return std::max(0.0f, d - s);
+        case BlendMode::Difference:
+            return std::abs(d - s);
+        case BlendMode::ColorDodge:
+            return s >= 1.0f ? 1.0f : std::min(1.0f, d / std::max(1e-6f, 1.0f - s));
+        default:
+            return s;
+    }
+}
+
+PixelRGBA8 referenceComposite(const PixelRGBA8& dst, const PixelRGBA8& src, BlendMode mode, float opacity) {
+    const float sa = (static_cast<float>(src.a) / 255.0f) * std::min(1.0f, std::max(0.0f, opacity));
+    if (sa <= 0.0f) {
+        return dst;
+    }
+    const float da = static_cast<float>(dst.a) / 255.0f;
+    const float s[3] = {referenceSrgbToLinear(src.r / 255.0f), referenceSrgbToLinear(src.g / 255.0f), referenceSrgbToLinear(src.b / 255.0f)};
+    const float d[3] = {referenceSrgbToLinear(dst.r / 255.0f), referenceSrgbToLinear(dst.g / 255.0f), referenceSrgbToLinear(dst.b / 255.0f)};
+    const float outA = sa + da * (1.0f - sa);
+    std::uint8_t out[3] = {0, 0, 0};
+    for (int c = 0; c < 3; ++c) {
+        const float prem = d[c] * da * (1.0f - sa) + s[c] * sa * (1.0f - da) + referenceBlend(mode, d[c], s[c]) * sa * da;
+        out[c] = referenceEncode(outA > 0.0f ? prem / outA : 0.0f);
+    }
+    return PixelRGBA8(out[0], out[1], out[2], static_cast<std::uint8_t>(std::lround(std::min(1.0f, outA) * 255.0f)));
+}
+
+void testSpanCompositorMatchesPixelReference() {
+    const BlendMode modes[] = {BlendMode::Normal, BlendMode::Multiply, BlendMode::Screen, BlendMode::Overlay, BlendMode::Darken,
+                               BlendMode::Lighten, BlendMode::Add, BlendMode::Subtract, BlendMode::Difference, BlendMode::ColorDodge};
+    const int size = 64;
+    std::uint32_t seed = 12345u;
+    const auto nextByte = [&seed]() {
+        seed = seed * 1664525u + 1013904223u;
+        return static_cast<std::uint8_t>(seed >> 24);
+    };
+
+    Layer bottom("Bottom", size, size, PixelRGBA8(0, 0, 0, 0));
+    Layer top("Top", size, size, PixelRGBA8(0, 0, 0, 0));
+    for (int y = 0; y < size; ++y) {
+        for (int x = 0; x < size; ++x) {
+            bottom.image().setPixel(x, y, PixelRGBA8(nextByte(), nextByte(), nextByte(), (x % 4 == 0) ? 255 : nextByte()));
+            top.image().setPixel(x, y, PixelRGBA8(nextByte(), nextByte(), nextByte(), (y % 5 == 0) ? 255 : nextByte()));
+        }
+    }
+
+    for (BlendMode mode : modes) {
+        Document doc(size, size);
+        doc.addLayer(bottom);
+        Layer& layer = doc.addLayer(top);
+        layer.setBlendMode(mode);
+        layer.setOpacity(0.83f);
+
+        const ImageBuffer out = doc.composite();
+        for (int y = 0; y < size; ++y) {
+            for (int x = 0; x < size; ++x) {
+                const PixelRGBA8 base = referenceComposite(PixelRGBA8(0, 0, 0, 0), bottom.image().getPixel(x, y), BlendMode::Normal, 1.0f);
+                const PixelRGBA8 expected = referenceComposite(base, top.image().getPixel(x, y), mode, 0.83f);
+                const PixelRGBA8 actual = out.getPixel(x, y);
+                require(expected.r == actual.r && expected.g == actual.g && expected.b == actual.b && expected.a == actual.a,
+                        "Span compositor should match the per-pixel reference for every blend mode");
+            }
+        }
+    }
+}
+
+void testAffineFastPathsMatchInverseSampling() {
+    const int srcW = 11;
+    const int srcH = 7;
+    Layer source("Source", srcW, srcH, PixelRGBA8(0, 0, 0, 255));
+    for (int y = 0; y < srcH; ++y) {
+        for (int x = 0; x < srcW; ++x) {
+            source.image().setPixel(x, y, PixelRGBA8(static_cast<std::uint8_t>(20 + x * 20), static_cast<std::uint8_t>(30 + y * 30), 77, 255));
+        }
+    }
+
+    std::vector<Transform2D> transforms = {
+        Transform2D::identity(),
+        Transform2D::translation(3.0, -2.0),
+        Transform2D::translation(2.5, 1.25),
+        Transform2D::scaling(1.75, 1.2, 2.0, 1.0),
+        Transform2D::scaling(-1.0, 1.0, 5.5, 0.0),
+        Transform2D::rotationRadians(0.7, 5.0, 3.0),
+        Transform2D::shearing(0.4, -0.2),
+        Transform2D::fromMatrix(0.0, 1.0, -1.0, 0.0, 12.0, 1.0)};
+
+    for (const Transform2D& t : transforms) {
+        Document doc(19, 15);
+        Layer& layer = doc.addLayer(source);
+        layer.setOffset(2, 3);
+        layer.transform() = t;
+        const ImageBuffer out = doc.composite();
+
+        Transform2D combined = Transform2D::translation(2.0, 3.0);
+        combined *= t;
+        for (int y = 0; y < out.height(); ++y) {
+            for (int x = 0; x < out.width(); ++x) {
+                const auto pos = combined.applyInverse(x + 0.5, y + 0.5);
+                const int sx = static_cast<int>(std::floor(pos.first));
+                const int sy = static_cast<int>(std::floor(pos.second));
+                const PixelRGBA8 expected = source.image().inBounds(sx, sy) ? source.image().getPixel(sx, sy) : PixelRGBA8(0, 0, 0, 0);
+                const PixelRGBA8 actual = out.getPixel(x, y);
+                require(expected.r == actual.r && expected.g == actual.g && expected.b == actual.b && expected.a == actual.a,
+                        "Layer mapping fast paths should sample the same source pixels as applyInverse");
+            }
+        }
+    }
+}
+
+void testNestedGroupSurfacesMatchFlattenedLayer() {
+    Layer base("Background", 40, 30, PixelRGBA8(0, 0, 0, 255));
+    for (int y = 0; y < 30; ++y) {
+        for (int x = 0; x < 40; ++x) {
+            base.image().setPixel(x, y, PixelRGBA8(static_cast<std::uint8_t>(x * 6), 90, static_cast<std::uint8_t>(y * 8), 255));
+        }
+    }
+
+    Layer dot("Dot", 8, 8, PixelRGBA8(200, 60, 240, 190));
+    dot.transform().setRotationDegrees(20.0, 4.0, 4.0);
+
+    Document grouped(40, 30);
+    grouped.addLayer(base);
+    LayerGroup outer("Outer");
+    outer.setOffset(30, 20);
+    outer.setBlendMode(BlendMode::Screen);
+    LayerGroup inner("Inner");
+    inner.setOffset(3, 1);
+    inner.addLayer(dot);
+    outer.addGroup(inner);
+    grouped.addGroup(outer);
+
+    Document flat(40, 30);
+    flat.addLayer(base);
+    Layer& flatDot = flat.addLayer(dot);
+    flatDot.setOffset(33, 21);
+    flatDot.setBlendMode(BlendMode::Screen);
+
+    const ImageBuffer a = grouped.composite();
+    const ImageBuffer b = flat.composite();
     for (int y = 0; y < a.height(); ++y) {
         for (int x = 0; x < a.width(); ++x) {
             const PixelRGBA8 pa = a.getPixel(x, y);
             const PixelRGBA8 pb = b.getPixel(x, y);
-            require(pa.r == pb.r && pa.g == pb.g && pa.b == pb.b && pa.a == pb.a, "IFLOW roundtrip should preserve composite output");
+            require(pa.r == pb.r && pa.g == pb.g && pa.b == pb.b && pa.a == pb.a,
+                    "Bounded group surfaces should match compositing the child directly");
+        }
+    }
+}
+
+void testDeepStackAccumulatesInLinearPrecision() {
+    Document doc(2, 1);
+    doc.addLayer(Layer("Background", 2, 1, PixelRGBA8(0, 0, 0, 255)));
+    const int depth = 20;
+    for (int i = 0; i < depth; ++i) {
+        LayerGroup group("Wash " + std::to_string(i));
+        Layer wash("Wash", 2, 1, PixelRGBA8(255, 255, 255, 255));
+        wash.setOpacity(0.02f);
+        group.addLayer(wash);
+        doc.addGroup(group);
+    }
+
+    const std::uint8_t expected = referenceEncode(1.0f - std::pow(0.98f, static_cast<float>(depth)));
+    const PixelRGBA8 p = doc.composite().getPixel(1, 0);
+    require(p.r == expected && p.g == expected && p.b == expected && p.a == 255,
+            "Deep stacks should accumulate in linear precision and encode to sRGB once");
+}
+
+bool buffersEqual(const ImageBuffer& a, const ImageBuffer& b) {
+    if (a.width() != b.width() || a.height() != b.height()) {
+        return false;
+    }
+    for (int y = 0; y < a.height(); ++y) {
+        for (int x = 0; x < a.width(); ++x) {
+            const PixelRGBA8 pa = a.getPixel(x, y);
+            const PixelRGBA8 pb = b.getPixel(x, y);
+            if (pa.r != pb.r || pa.g != pb.g || pa.b != pb.b || pa.a != pb.a) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+void testIncrementalCompositeRedoesOnlyDirtyTiles() {
+    Document doc = buildCompositeStressDocument();
+    Layer& marker = doc.addLayer(Layer("Marker", 3, 3, PixelRGBA8(10, 250, 10, 255)));
+    marker.setOffset(1, 1);
+
+    CompositeOptions options;
+    options.threads = 2;
+    options.tileSize = 8;
+    CompositeCache cache;
+
+    require(buffersEqual(doc.composite(options, cache), doc.composite(options)), "Cached composite should match a full composite");
+    require(cache.lastTilesComposited() == 15, "First cached composite should render every tile");
+
+    require(buffersEqual(doc.composite(options, cache), doc.composite(options)), "Unchanged document should reuse cached output");
+    require(cache.lastTilesComposited() == 0, "Unchanged document should not recomposite any tile");
+
+    doc.layer(2).image().setPixel(1, 1, PixelRGBA8(250, 0, 0, 255));
+    require(buffersEqual(doc.composite(options, cache), doc.composite(options)), "Pixel edit should be reflected in cached composite");
+    require(cache.lastTilesComposited() == 1, "Pixel edit inside one tile should only recomposite that tile");
+
+    doc.node(2).asGroup().transform().setTranslation(-4.0, 6.0);
+    require(buffersEqual(doc.composite(options, cache), doc.composite(options)), "Moving a group should update old and new regions");
+
+    doc.addLayer(Layer("Late", 4, 4, PixelRGBA8(0, 0, 255, 128)));
+    require(buffersEqual(doc.composite(options, cache), doc.composite(options)), "Adding a node should fall back to a full composite");
+    require(cache.lastTilesComposited() == 15, "Structure changes should recomposite every tile");
+}
+
+void testLayerMasksStoreEightBitCoverage() {
+    require(MaskBuffer::coverageFromPixel(PixelRGBA8(128, 128, 128, 255)) == 128, "Gray mask pixels should map to their luma");
+    require(MaskBuffer::coverageFromPixel(PixelRGBA8(255, 255, 255, 128)) == 128, "Mask coverage should scale by alpha");
+    require(MaskBuffer::coverageFromPixel(PixelRGBA8(255, 0, 0, 255)) == 85, "Mask coverage should average the color channels");
+
+    Layer layer("Masked", 3, 1, PixelRGBA8(255, 255, 255, 255));
+    MaskBuffer& mask = layer.ensureMask(PixelRGBA8(255, 255, 255, 255));
+    mask.setCoverage(1, 0, 0);
+    mask.setPixel(2, 0, PixelRGBA8(255, 255, 255, 128));
+    require(mask.view().stride() == 3 && mask.coverage(2, 0) == 128, "Masks should hold one coverage byte per pixel");
+    const PixelRGBA8 expanded = mask.getPixel(2, 0);
+    require(expanded.r == 128 && expanded.g == 128 && expanded.b == 128 && expanded.a == 255, "Mask reads should expand to opaque gray");
+
+    Document doc(3, 1);
+    doc.addLayer(Layer("Background", 3, 1, PixelRGBA8(0, 0, 0, 255)));
+    doc.addLayer(layer);
+    const ImageBuffer out = doc.composite();
+    require(out.getPixel(0, 0).r == 255 && out.getPixel(1, 0).r == 0, "Full and empty coverage should show and hide the layer");
+    const PixelRGBA8 half = referenceComposite(PixelRGBA8(0, 0, 0, 255), PixelRGBA8(255, 255, 255, 255), BlendMode::Normal, 128.0f / 255.0f);
+    require(std::abs(static_cast<int>(out.getPixel(2, 0).r) - static_cast<int>(half.r)) <= 1, "Partial coverage should scale layer alpha");
+
+    const std::string testOutDir = "build/output/test-images";
+    std::filesystem::create_directories(testOutDir);
+    const std::string iflowPath = testOutDir + "/coverage-mask.iflow";
+    require(saveDocumentIFLOW(doc, iflowPath), "Saving a masked document should succeed");
+    const Document loaded = loadDocumentIFLOW(iflowPath);
+    const MaskBuffer& loadedMask = loaded.node(1).asLayer().mask();
+    require(loadedMask.coverage(0, 0) == 255 && loadedMask.coverage(1, 0) == 0 && loadedMask.coverage(2, 0) == 128,
+            "IFLOW should preserve mask coverage");
+}
+
+void testChunkCodecsRoundtrip() {
+    std::uint32_t seed = 99u;
+    const auto nextByte = [&seed]() {
+        seed = seed * 1664525u + 1013904223u;
+        return static_cast<std::uint8_t>(seed >> 24);
+    };
+    std::vector<std::vector<std::uint8_t>> inputs;
+    inputs.push_back({});
+    inputs.push_back(std::vector<std::uint8_t>(70000, 42));
+    std::vector<std::uint8_t> noisy(5000);
+    for (std::uint8_t& v : noisy) {
+        v = nextByte();
+    }
+    inputs.push_back(noisy);
+    std::vector<std::uint8_t> repeating(90000);
+    for (std::size_t i = 0; i < repeating.size(); ++i) {
+        repeating[i] = (i % 977 < 600) ? static_cast<std::uint8_t>(i % 13) : nextByte();
+    }
+    inputs.push_back(repeating);
+
+    for (const std::vector<std::uint8_t>& input : inputs) {
+        for (ChunkCodec codec : {ChunkCodec::None, ChunkCodec::RLE, ChunkCodec::LZ4, ChunkCodec::Deflate}) {
+            const std::vector<std::uint8_t> encoded = encodeChunk(codec, input.data(), input.size());
+            require(decodeChunk(codec, encoded.data(), encoded.size(), input.size()) == input, "Chunk codecs should roundtrip exactly");
+        }
+    }
+    require(deflateCompress(repeating.data(), repeating.size()).size() < repeating.size() / 2, "Deflate should compress repetitive data");
+
+    // Stored block ("abc") followed by a fixed-Huffman block from zlib.
+    const std::vector<std::uint8_t> stored = {0x00, 0x03, 0x00, 0xFC, 0xFF, 'a', 'b', 'c', 0x4B, 0x4C, 0x4A, 0x06, 0x00};
+    const std::vector<std::uint8_t> inflated = inflateRaw(stored.data(), stored.size());
+    require(std::string(inflated.begin(), inflated.end()) == "abcabc", "Inflate should handle stored and fixed blocks");
+
+    bool threw = false;
+    try {
+        (void)decodeChunk(ChunkCodec::LZ4, repeating.data(), 64, 1000);
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    require(threw, "Corrupt chunks should be rejected");
+}
+
+void testPNGDeflateLevelsAndParallelSegments() {
+    const std::string testOutDir = "build/output/test-images";
+    std::filesystem::create_directories(testOutDir);
+
+    std::vector<std::uint8_t> text;
+    for (int i = 0; text.size() < 700000; ++i) {
+        const std::string word = "segment " + std::to_string(i % 300) + (i % 7 == 0 ? "\n" : " ");
+        text.insert(text.end(), word.begin(), word.end());
+    }
+    std::vector<std::uint8_t> segmented;
+    const std::size_t half = text.size() / 2;
+    for (int part = 0; part < 2; ++part) {
+        const std::vector<std::uint8_t> encoded =
+            deflateSegment(text.data() + part * half, part == 0 ? half : text.size() - half, part * half, 6, part == 1);
+        segmented.insert(segmented.end(), encoded.begin(), encoded.end());
+    }
+    require(inflateRaw(segmented.data(), segmented.size()) == text, "Deflate segments should concatenate into one stream");
+    const std::size_t fast = deflateCompress(text.data(), text.size(), 1).size();
+    const std::size_t best = deflateCompress(text.data(), text.size(), 9).size();
+    require(best < fast && fast < text.size() / 3, "Higher deflate levels should compress harder");
+    const std::vector<std::uint8_t> storedText = deflateCompress(text.data(), text.size(), 0);
+    require(inflateRaw(storedText.data(), storedText.size()) == text, "Level 0 should store data uncompressed");
+
+    PNGImage image(300, 200, Color(0, 0, 0));
+    for (int y = 0; y < 200; ++y) {
+        for (int x = 0; x < 300; ++x) {
+            image.setPixel(x, y, Color(static_cast<std::uint8_t>(x), static_cast<std::uint8_t>(y + x / 3),
+                                       static_cast<std::uint8_t>((x * y) % 251)));
+        }
+    }
+    PNGSaveOptions stored;
+    stored.level = 0;
+    PNGSaveOptions serial;
+    serial.threads = 1;
+    PNGSaveOptions parallel;
+    parallel.threads = 4;
+    const std::string storedPath = testOutDir + "/deflate_stored.png";
+    const std::string serialPath = testOutDir + "/deflate_serial.png";
+    const std::string parallelPath = testOutDir + "/deflate_parallel.png";
+    require(image.save(storedPath, stored) && image.save(serialPath, serial) && image.save(parallelPath, parallel),
+            "Saving PNGs at each level should succeed");
+    require(std::filesystem::file_size(serialPath) * 4 < std::filesystem::file_size(storedPath),
+            "Deflated PNGs should be much smaller than stored ones");
+    std::ifstream serialFile(serialPath, std::ios::binary);
+    std::ifstream parallelFile(parallelPath, std::ios::binary);
+    const std::string serialBytes((std::istreambuf_iterator<char>(serialFile)), std::istreambuf_iterator<char>());
+    const std::string parallelBytes((std::istreambuf_iterator<char>(parallelFile)), std::istreambuf_iterator<char>());
+    require(serialBytes == parallelBytes, "PNG output should not depend on the thread count");
+    for (const std::string& path : {storedPath, serialPath}) {
+        const PNGImage loaded = PNGImage::load(path);
+        require(loaded.getPixel(299, 199).g == image.getPixel(299, 199).g &&
+                    loaded.getPixel(17, 123).b == image.getPixel(17, 123).b,
+                "Deflated PNGs should load back exactly");
+    }
+}
+
+// Writes a PNG from already filtered scanlines so decoder paths this
+// library never encodes (other color types, depths, Adam7) can be tested.
+void writeTestPNG(const std::string& path,
+                  int width,
+                  int height,
+                  std::uint8_t depth,
+                  std::uint8_t colorType,
+                  std::uint8_t interlace,
+                  const std::vector<std::uint8_t>& palette,
+                  const std::vector<std::uint8_t>& scanlines) {
+    std::ofstream out(path, std::ios::binary);
+    const std::uint8_t signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+    out.write(reinterpret_cast<const char*>(signature), 8);
+    const auto writeChunk = [&out](const char* type, const std::vector<std::uint8_t>& data) {
+        std::vector<std::uint8_t> body(type, type + 4);
+        body.insert(body.end(), data.begin(), data.end());
+        const std::uint32_t crc = crc32(body.data(), body.size());
+        const std::uint32_t size = static_cast<std::uint32_t>(data.size());
+        const std::uint8_t length[4] = {static_cast<std::uint8_t>(size >> 24), static_cast<std::uint8_t>(size >> 16),
+                                        static_cast<std::uint8_t>(size >> 8), static_cast<std::uint8_t>(size)};
+        const std::uint8_t check[4] = {static_cast<std::uint8_t>(crc >> 24), static_cast<std::uint8_t>(crc >> 16),
+                                       static_cast<std::uint8_t>(crc >> 8), static_cast<std::uint8_t>(crc)};
+        out.write(reinterpret_cast<const char*>(length), 4);
+        out.write(reinterpret_cast<const char*>(body.data()), static_cast<std::streamsize>(body.size()));
+        out.write(reinterpret_cast<const char*>(check), 4);
+    };
+    writeChunk("IHDR", {0, 0, 0, static_cast<std::uint8_t>(width), 0, 0, 0, static_cast<std::uint8_t>(height), depth,
+                        colorType, 0, 0, interlace});
+    if (!palette.empty()) {
+        writeChunk("PLTE", palette);
+    }
+    std::uint32_t a = 1;
+    std::uint32_t b = 0;
+    for (std::uint8_t v : scanlines) {
+        a = (a + v) % 65521;
+        b = (b + a) % 65521;
+    }
+    std::vector<std::uint8_t> zlib = {0x78, 0xDA};
+    const std::vector<std::uint8_t> deflated = deflateCompress(scanlines.data(), scanlines.size(), 9);
+    zlib.insert(zlib.end(), deflated.begin(), deflated.end());
+    const std::uint32_t adler = (b << 16) | a;
+    for (int shift = 24; shift >= 0; shift -= 8) {
+        zlib.push_back(static_cast<std::uint8_t>(adler >> shift));
+    }
+    // Split so the zlib header and the Adler-32 trailer straddle IDAT chunks.
+    writeChunk("IDAT", std::vector<std::uint8_t>(zlib.begin(), zlib.begin() + 1));
+    writeChunk("IDAT", std::vector<std::uint8_t>(zlib.begin() + 1, zlib.end() - 2));
+    writeChunk("IDAT", std::vector<std::uint8_t>(zlib.end() - 2, zlib.end()));
+    writeChunk("IEND", {});
+}
+
+void testPNGLoadsInterlacedPalettedAndSixteenBitImages() {
+    const std::string testOutDir = "build/output/test-images";
+    std::filesystem::create_directories(testOutDir);
+
+    // 16-bit gray+alpha, Adam7: each pass stores its own filtered rows.
+    const int width = 5;
+    const int height = 6;
+    const auto gray16 = [](int x, int y) { return static_cast<std::uint16_t>(x * 13000 + y * 1500); };
+    const int passes[7][4] = {{0, 0, 8, 8}, {4, 0, 8, 8}, {0, 4, 4, 8}, {2, 0, 4, 4}, {0, 2, 2, 4}, {1, 0, 2, 2}, {0, 1, 1, 2}};
+    std::vector<std::uint8_t> interlaced;
+    for (const auto& pass : passes) {
+        if (pass[0] >= width || pass[1] >= height) {
+            continue;
+        }
+        std::vector<std::uint8_t> previous;
+        for (int y = pass[1]; y < height; y += pass[3]) {
+            std::vector<std::uint8_t> row;
+            for (int x = pass[0]; x < width; x += pass[2]) {
+                const std::uint16_t v = gray16(x, y);
+                row.insert(row.end(), {static_cast<std::uint8_t>(v >> 8), static_cast<std::uint8_t>(v), 0xFF, 0xFF});
+            }
+            // Up filter on every row after the first exercises unfiltering per pass.
+            interlaced.push_back(previous.empty() ? 0 : 2);
+            for (std::size_t i = 0; i < row.size(); ++i) {
+                interlaced.push_back(static_cast<std::uint8_t>(row[i] - (previous.empty() ? 0 : previous[i])));
+            }
+            previous = row;
+        }
+    }
+    const std::string grayPath = testOutDir + "/gray16_adam7.png";
+    writeTestPNG(grayPath, width, height, 16, 4, 1, {}, interlaced);
+    const PNGImage gray = PNGImage::load(grayPath);
+    bool grayMatches = gray.width() == width && gray.height() == height;
+    for (int y = 0; y < height && grayMatches; ++y) {
+        for (int x = 0; x < width; ++x) {
+            const int expected = (gray16(x, y) * 255 + 32767) / 65535;
+            grayMatches = grayMatches && gray.getPixel(x, y).r == expected && gray.getPixel(x, y).b == expected;
+        }
+    }
+    require(grayMatches, "16-bit interlaced gray PNGs should decode to rounded 8-bit samples");
+
+    // 2-bit palette rows pack four pixels per byte.
+    const std::vector<std::uint8_t> palette = {255, 0, 0, 0, 255, 0, 0, 0, 255, 9, 9, 9};
+    const std::vector<std::uint8_t> packed = {0, 0x1B, 0x40, 1, 0xE4, 0x00};
+    const std::string palettePath = testOutDir + "/palette2.png";
+    writeTestPNG(palettePath, 5, 2, 2, 3, 0, palette, packed);
+    const PNGImage indexed = PNGImage::load(palettePath);
+    require(indexed.getPixel(0, 0).r == 255 && indexed.getPixel(1, 0).g == 255 && indexed.getPixel(3, 0).r == 9 &&
+                indexed.getPixel(4, 0).g == 255,
+            "Paletted PNGs should map packed indices through PLTE");
+    // Filter 1 (sub) on the second row adds the previous byte.
+    require(indexed.getPixel(0, 1).r == 9 && indexed.getPixel(3, 1).r == 255 && indexed.getPixel(4, 1).b == 9,
+            "Sub-filtered packed rows should be reconstructed bytewise");
+}
+
+void testCompositeSavesEncodeRowsAndKeepPNGAlpha() {
+    const std::string testOutDir = "build/output/test-images";
+    std::filesystem::create_directories(testOutDir);
+
+    ImageBuffer composite(40, 30, PixelRGBA8(0, 0, 0, 0));
+    for (int y = 0; y < 30; ++y) {
+        for (int x = 0; x < 20; ++x) {
+            composite.setPixel(x, y, PixelRGBA8(static_cast<std::uint8_t>(x * 6), static_cast<std::uint8_t>(y / 5 * 40), 77, 255));
+        }
+    }
+    composite.setPixel(30, 12, PixelRGBA8(10, 200, 30, 90));
+
+    ImageSaveOptions stored;
+    stored.png.level = 0;
+    const std::string pngPath = testOutDir + "/composite_alpha.png";
+    require(saveCompositeByExtension(composite, pngPath, stored), "Saving a transparent composite as PNG should succeed");
+    std::ifstream pngFile(pngPath, std::ios::binary);
+    const std::vector<std::uint8_t> bytes((std::istreambuf_iterator<char>(pngFile)), std::istreambuf_iterator<char>());
+    require(bytes.size() > 33 && bytes[25] == 6, "Composite PNGs should be written as RGBA");
+
+    // Level 0 leaves rows unfiltered, so the inflated IDAT stream holds the RGBA bytes.
+    std::vector<std::uint8_t> zlib;
+    for (std::size_t pos = 8; pos + 12 <= bytes.size();) {
+        const std::size_t length = (static_cast<std::size_t>(bytes[pos]) << 24) | (static_cast<std::size_t>(bytes[pos + 1]) << 16) |
+                                   (static_cast<std::size_t>(bytes[pos + 2]) << 8) | bytes[pos + 3];
+        if (std::string(bytes.begin() + static_cast<std::ptrdiff_t>(pos + 4), bytes.begin() + static_cast<std::ptrdiff_t>(pos + 8)) == "IDAT") {
+            zlib.insert(zlib.end(), bytes.begin() + static_cast<std::ptrdiff_t>(pos + 8),
+                        bytes.begin() + static_cast<std::ptrdiff_t>(pos + 8 + length));
+        }
+        pos += length + 12;
+    }
+    const std::vector<std::uint8_t> scanlines = inflateRaw(zlib.data() + 2, zlib.size() - 6);
+    const std::size_t rowBytes = 1 + 40 * 4;
+    require(scanlines.size() == 30 * rowBytes && scanlines[12 * rowBytes + 1 + 30 * 4 + 3] == 90 &&
+                scanlines[12 * rowBytes + 1 + 35 * 4 + 3] == 0 && scanlines[5 * rowBytes + 1 + 10 * 4 + 3] == 255,
+            "PNG alpha should survive the composite save");
+    const PNGImage png = PNGImage::load(pngPath);
+    require(png.getPixel(30, 12).g == 200 && png.getPixel(7, 9).r == 42, "RGBA PNGs should decode their colors");
+
+    PNGSaveOptions opaque;
+    opaque.alpha = false;
+    const std::string rgbPath = testOutDir + "/composite_rgb.png";
+    require(PNGImage::saveRows(rgbPath, pixelRows(composite), opaque), "Saving rows without alpha should succeed");
+    std::ifstream rgbFile(rgbPath, std::ios::binary);
+    const std::vector<std::uint8_t> rgbBytes((std::istreambuf_iterator<char>(rgbFile)), std::istreambuf_iterator<char>());
+    require(rgbBytes.size() > 33 && rgbBytes[25] == 2 && PNGImage::load(rgbPath).getPixel(7, 9).g == 40,
+            "Disabling alpha should write RGB PNGs");
+
+    const std::string bmpPath = testOutDir + "/composite_rows.bmp";
+    const std::string gifPath = testOutDir + "/composite_rows.gif";
+    require(saveCompositeByExtension(composite, bmpPath) && saveCompositeByExtension(composite, gifPath),
+            "Saving composites as BMP and GIF should succeed");
+    const BMPImage bmp = BMPImage::load(bmpPath);
+    const GIFImage gif = GIFImage::load(gifPath);
+    require(bmp.getPixel(7, 9).r == 42 && bmp.getPixel(7, 9).g == 40 && bmp.getPixel(30, 12).g == 200 &&
+                gif.getPixel(7, 9).b == 77 && gif.getPixel(30, 12).r == 10,
+            "Row encoders should read the composite directly");
+}
+
+void testJPGEncodesRestartIntervalsOnWorkerThreads() {
+    const std::string testOutDir = "build/output/test-images";
+    std::filesystem::create_directories(testOutDir);
+
+    JPGImage image(203, 70, Color(0, 0, 0));
+    for (int y = 0; y < 70; ++y) {
+        for (int x = 0; x < 203; ++x) {
+            image.setPixel(x, y, Color(static_cast<std::uint8_t>(x), static_cast<std::uint8_t>(y * 3),
+                                       static_cast<std::uint8_t>(128 + (x + y) / 4)));
+        }
+    }
+    JPGSaveOptions serial;
+    serial.threads = 1;
+    JPGSaveOptions parallel;
+    parallel.threads = 3;
+    const std::string serialPath = testOutDir + "/restart_serial.jpg";
+    const std::string parallelPath = testOutDir + "/restart_parallel.jpg";
+    require(image.save(serialPath, serial) && image.save(parallelPath, parallel), "Saving JPEGs should succeed");
+    std::ifstream serialFile(serialPath, std::ios::binary);
+    std::ifstream parallelFile(parallelPath, std::ios::binary);
+    const std::string serialBytes((std::istreambuf_iterator<char>(serialFile)), std::istreambuf_iterator<char>());
+    const std::string parallelBytes((std::istreambuf_iterator<char>(parallelFile)), std::istreambuf_iterator<char>());
+    require(serialBytes == parallelBytes, "JPEG output should not depend on the thread count");
+
+    // One restart interval per MCU row: 70 rows make 5 rows of 16x16 MCUs.
+    int restarts = 0;
+    bool hasDRI = false;
+    for (std::size_t i = 0; i + 1 < serialBytes.size(); ++i) {
+        const std::uint8_t marker = static_cast<std::uint8_t>(serialBytes[i + 1]);
+        if (static_cast<std::uint8_t>(serialBytes[i]) == 0xFF) {
+            hasDRI = hasDRI || marker == 0xDD;
+            restarts += marker >= 0xD0 && marker <= 0xD7 ? 1 : 0;
+        }
+    }
+    require(hasDRI && restarts == 4, "JPEG scans should carry a restart marker between MCU rows");
+
+    const JPGImage decoded = JPGImage::load(serialPath);
+    double error = 0.0;
+    for (int y = 0; y < 70; ++y) {
+        for (int x = 0; x < 203; ++x) {
+            error += std::abs(decoded.getPixel(x, y).r - image.getPixel(x, y).r) +
+                     std::abs(decoded.getPixel(x, y).g - image.getPixel(x, y).g) +
+                     std::abs(decoded.getPixel(x, y).b - image.getPixel(x, y).b);
+        }
+    }
+    require(error / (3.0 * 203 * 70) < 4.0, "Restart-interval JPEGs should decode close to the source");
+}
+
+void testJPGSubsamplingQualityAndProgressiveDecode() {
+    const std::string testOutDir = "build/output/test-images";
+    std::filesystem::create_directories(testOutDir);
+
+    JPGImage image(61, 45, Color(0, 0, 0));
+    for (int y = 0; y < 45; ++y) {
+        for (int x = 0; x < 61; ++x) {
+            image.setPixel(x, y, Color(static_cast<std::uint8_t>(x * 4), static_cast<std::uint8_t>(y * 5),
+                                       static_cast<std::uint8_t>((x / 4 + y / 4) % 2 == 0 ? 40 : 200)));
+        }
+    }
+    const auto saveAndMeasure = [&](const std::string& name, JPGSubsampling subsampling, int quality) {
+        JPGSaveOptions options;
+        options.subsampling = subsampling;
+        options.quality = quality;
+        const std::string path = testOutDir + "/" + name;
+        require(image.save(path, options), "Saving a JPEG should succeed");
+        const JPGImage decoded = JPGImage::load(path);
+        require(decoded.width() == 61 && decoded.height() == 45, "JPEG dimensions should roundtrip");
+        double error = 0.0;
+        for (int y = 0; y < 45; ++y) {
+            for (int x = 0; x < 61; ++x) {
+                error += std::abs(decoded.getPixel(x, y).r - image.getPixel(x, y).r) +
+                         std::abs(decoded.getPixel(x, y).g - image.getPixel(x, y).g) +
+                         std::abs(decoded.getPixel(x, y).b - image.getPixel(x, y).b);
+            }
+        }
+        return std::make_pair(std::filesystem::file_size(path), error / (3.0 * 61 * 45));
+    };
+    const auto full = saveAndMeasure("sampling_444.jpg", JPGSubsampling::Yuv444, 90);
+    const auto half = saveAndMeasure("sampling_422.jpg", JPGSubsampling::Yuv422, 90);
+    const auto quarter = saveAndMeasure("sampling_420.jpg", JPGSubsampling::Yuv420, 90);
+    const auto rough = saveAndMeasure("quality_20.jpg", JPGSubsampling::Yuv420, 20);
+    require(full.first > half.first && half.first > quarter.first && quarter.first > rough.first,
+            "Chroma resolution and quality should both cost bytes");
+    require(full.second < half.second && full.second < quarter.second && quarter.second < rough.second &&
+                full.second < 4.0,
+            "Dropping chroma resolution or quality should both add error");
+
+    JPGSaveOptions invalid;
+    invalid.quality = 0;
+    bool rejected = false;
+    try {
+        image.save(testOutDir + "/quality_0.jpg", invalid);
+    } catch (const std::invalid_argument&) {
+        rejected = true;
+    }
+    require(rejected, "JPEG quality outside 1..100 should be rejected");
+
+    // A hand-built progressive frame: a DC scan at half precision, an empty
+    // AC scan and a DC refinement bit, using one-code Huffman tables.
+    std::vector<std::uint8_t> progressive = {0xFF, 0xD8, 0xFF, 0xDB, 0x00, 0x43, 0x00};
+    progressive.insert(progressive.end(), 64, 1);
+    progressive.insert(progressive.end(), {
+        0xFF, 0xC2, 0x00, 0x0B, 0x08, 0x00, 0x08, 0x00, 0x08, 0x01, 0x01, 0x11, 0x00,
+        0xFF, 0xC4, 0x00, 0x14, 0x00, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x07,
+        0xFF, 0xC4, 0x00, 0x14, 0x10, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x00,
+        // DC of 200 sent as 100 (category 7, bits 1100100) with Al = 1.
+        0xFF, 0xDA, 0x00, 0x08, 0x01, 0x01, 0x00, 0x00, 0x00, 0x01, 0x64,
+        0xFF, 0xDA, 0x00, 0x08, 0x01, 0x01, 0x00, 0x01, 0x3F, 0x00, 0x7F,
+        0xFF, 0xDA, 0x00, 0x08, 0x01, 0x01, 0x00, 0x00, 0x00, 0x10, 0x7F,
+        0xFF, 0xD9});
+    const std::string progressivePath = testOutDir + "/progressive_dc.jpg";
+    {
+        std::ofstream out(progressivePath, std::ios::binary);
+        out.write(reinterpret_cast<const char*>(progressive.data()), static_cast<std::streamsize>(progressive.size()));
+    }
+    const JPGImage flat = JPGImage::load(progressivePath);
+    require(flat.width() == 8 && flat.height() == 8 && flat.getPixel(0, 0).r == 153 && flat.getPixel(7, 7).b == 153,
+            "Progressive JPEG scans should combine into the full coefficients");
+}
+
+void testJPGDecodesAtReducedScaleForTargetSize() {
+    const std::string testOutDir = "build/output/test-images";
+    std::filesystem::create_directories(testOutDir);
+
+    JPGImage image(203, 150, Color(0, 0, 0));
+    for (int y = 0; y < 150; ++y) {
+        for (int x = 0; x < 203; ++x) {
+            image.setPixel(x, y, Color(static_cast<std::uint8_t>(x), static_cast<std::uint8_t>(y + 50),
+                                       static_cast<std::uint8_t>((x / 8 + y / 8) % 2 == 0 ? 60 : 180)));
+        }
+    }
+    const std::string path = testOutDir + "/scaled_source.jpg";
+    JPGSaveOptions saveOptions;
+    saveOptions.quality = 90;
+    require(image.save(path, saveOptions), "Saving the scaled-decode source should succeed");
+    const JPGImage full = JPGImage::load(path);
+
+    // 60x40 rules out 1/4 (51x38), so the decode stops at 1/2.
+    JPGLoadOptions options;
+    options.targetWidth = 60;
+    options.targetHeight = 40;
+    require(JPGImage::load(path, options).width() == 102, "A target size should pick the smallest covering scale");
+    options.targetWidth = 2000;
+    require(JPGImage::load(path, options).width() == 203, "Targets beyond the source should decode at full size");
+
+    for (int scale = 2; scale <= 8; scale *= 2) {
+        options.targetWidth = (203 + scale - 1) / scale;
+        options.targetHeight = (150 + scale - 1) / scale;
+        const JPGImage reduced = JPGImage::load(path, options);
+        require(reduced.width() == options.targetWidth && reduced.height() == options.targetHeight,
+                "Reduced JPEG decodes should round their size up");
+        double error = 0.0;
+        const int cols = 203 / scale;
+        const int rows = 150 / scale;
+        for (int y = 0; y < rows; ++y) {
+            for (int x = 0; x < cols; ++x) {
+                int sum[3] = {0, 0, 0};
+                for (int j = 0; j < scale; ++j) {
+                    for (int i = 0; i < scale; ++i) {
+                        const Color& c = full.getPixel(x * scale + i, y * scale + j);
+                        sum[0] += c.r;
+                        sum[1] += c.g;
+                        sum[2] += c.b;
+                    }
+                }
+                const Color& c = reduced.getPixel(x, y);
+                error += std::abs(c.r - sum[0] / (scale * scale)) + std::abs(c.g - sum[1] / (scale * scale)) +
+                         std::abs(c.b - sum[2] / (scale * scale));
+            }
+        }
+        require(error / (3.0 * cols * rows) < 2.0, "Reduced JPEG decodes should match box-filtered full decodes");
+    }
+
+    const std::string fitPath = testOutDir + "/scaled_fit.iflow";
+    require(runCLIArgs({"image_flow", "new", "--from-image", path, "--fit", "40x30", "--out", fitPath}) == 0,
+            "new --from-image --fit should accept JPEG sources");
+    const Document fitted = loadDocumentIFLOW(fitPath);
+    require(fitted.width() == 40 && fitted.height() == 30 && fitted.node(0).asLayer().image().width() == 40,
+            "--fit should still produce the requested size");
+
+    const std::string importPath = testOutDir + "/scaled_import.iflow";
+    require(runCLIArgs({"image_flow", "ops", "--width", "64", "--height", "64", "--out", importPath,
+                        "--op", "add-layer name=Photo width=8 height=8 fill=0,0,0,0",
+                        "--op", "import-image path=/0 file=" + path + " width=50 height=37"}) == 0,
+            "import-image should accept width= and height= for JPEG files");
+    const Document imported = loadDocumentIFLOW(importPath);
+    require(imported.node(0).asLayer().image().width() == 50 && imported.node(0).asLayer().image().height() == 37,
+            "import-image width=/height= should size the layer");
+    require(runCLIArgs({"image_flow", "ops", "--width", "64", "--height", "64", "--out", importPath,
+                        "--op", "add-layer name=Photo width=8 height=8 fill=0,0,0,0",
+                        "--op", "import-image path=/0 file=" + path + " width=50"}) == 1,
+            "import-image should reject a lone width= for raster files");
+}
+
+void testGIFCompressesAndQuantizesLargePalettes() {
+    const std::string testOutDir = "build/output/test-images";
+    std::filesystem::create_directories(testOutDir);
+
+    // 48 flat tiles: an exact palette whose long runs LZW should collapse.
+    GIFImage tiles(320, 240, Color(0, 0, 0));
+    for (int y = 0; y < 240; ++y) {
+        for (int x = 0; x < 320; ++x) {
+            tiles.setPixel(x, y, Color(static_cast<std::uint8_t>(x / 40 * 30), static_cast<std::uint8_t>(y / 40 * 40), 90));
+        }
+    }
+    const std::string tilesPath = testOutDir + "/lzw_tiles.gif";
+    require(tiles.save(tilesPath), "Saving a palette GIF should succeed");
+    require(std::filesystem::file_size(tilesPath) < 320 * 240 / 10, "LZW should compress flat regions well below one byte per pixel");
+    const GIFImage tilesBack = GIFImage::load(tilesPath);
+    require(compareImages(tiles, tilesBack).maxAbs == 0, "GIFs with at most 256 colors should stay exact");
+
+    GIFImage gradient(256, 192, Color(0, 0, 0));
+    for (int y = 0; y < 192; ++y) {
+        for (int x = 0; x < 256; ++x) {
+            gradient.setPixel(x, y, Color(static_cast<std::uint8_t>(x), static_cast<std::uint8_t>(y), static_cast<std::uint8_t>((x + y) / 2)));
+        }
+    }
+    const GIFDither modes[3] = {GIFDither::None, GIFDither::Ordered, GIFDither::FloydSteinberg};
+    double blockError[3] = {0.0, 0.0, 0.0};
+    for (int m = 0; m < 3; ++m) {
+        GIFSaveOptions options;
+        options.dither = modes[m];
+        const std::string path = testOutDir + "/quantized_" + std::to_string(m) + ".gif";
+        require(gradient.save(path, options), "GIFs with more than 256 colors should be quantized");
+        const GIFImage back = GIFImage::load(path);
+        require(compareImages(gradient, back).meanAbs < 12.0, "Quantized GIFs should stay close to the source");
+        // Dithering trades per-pixel error for accuracy over small areas.
+        for (int y = 0; y < 192; y += 4) {
+            for (int x = 0; x < 256; x += 4) {
+                int sums[6] = {0, 0, 0, 0, 0, 0};
+                for (int j = 0; j < 4; ++j) {
+                    for (int i = 0; i < 4; ++i) {
+                        const Color& a = gradient.getPixel(x + i, y + j);
+                        const Color& b = back.getPixel(x + i, y + j);
+                        sums[0] += a.r;
+                        sums[1] += a.g;
+                        sums[2] += a.b;
+                        sums[3] += b.r;
+                        sums[4] += b.g;
+                        sums[5] += b.b;
+                    }
+                }
+                blockError[m] += std::abs(sums[0] - sums[3]) + std::abs(sums[1] - sums[4]) + std::abs(sums[2] - sums[5]);
+            }
+        }
+    }
+    require(blockError[2] < blockError[0] && blockError[1] < blockError[0],
+            "Dithered GIFs should track the source better over 4x4 areas");
+}
+
+void testGIFAnimationWritesDeltaFrames() {
+    const std::string testOutDir = "build/output/test-images";
+    std::filesystem::create_directories(testOutDir);
+
+    // A small square moves over a tiled background; frame 3 repeats frame 2.
+    const int width = 96;
+    const int height = 64;
+    const int squareX[5] = {4, 20, 20, 36, 52};
+    std::vector<GIFImage> frames;
+    for (int f = 0; f < 5; ++f) {
+        GIFImage frame(width, height, Color(0, 0, 0));
+        for (int y = 0; y < height; ++y) {
+            for (int x = 0; x < width; ++x) {
+                const bool square = x >= squareX[f] && x < squareX[f] + 8 && y >= 24 && y < 32;
+                frame.setPixel(x, y, square ? Color(250, 20, 20) : Color(static_cast<std::uint8_t>(x / 8 * 20), static_cast<std::uint8_t>(y / 8 * 30), 100));
+            }
+        }
+        frames.push_back(frame);
+    }
+
+    const std::string path = testOutDir + "/animation.gif";
+    std::vector<std::uint8_t> rgb(static_cast<std::size_t>(width) * height * 3);
+    {
+        GIFAnimationWriter writer(path, width, height);
+        for (int f = 0; f < 5; ++f) {
+            for (int y = 0; y < height; ++y) {
+                for (int x = 0; x < width; ++x) {
+                    const Color& c = frames[f].getPixel(x, y);
+                    std::uint8_t* out = rgb.data() + (static_cast<std::size_t>(y) * width + x) * 3;
+                    out[0] = c.r;
+                    out[1] = c.g;
+                    out[2] = c.b;
+                }
+            }
+            writer.addFrame(PixelRows{rgb.data(), width, height, 3, static_cast<std::size_t>(width) * 3}, 4);
         }
+        require(writer.frameCount() == 5, "GIF animation writer should count its frames");
+        writer.finish();
     }
+
+    const std::vector<GIFImage> loaded = GIFImage::loadFrames(path);
+    require(loaded.size() == 5, "Animated GIF should load every frame");
+    for (int f = 0; f < 5; ++f) {
+        require(compareImages(frames[f], loaded[f]).maxAbs == 0, "Delta frames should composite back to the source frames");
+    }
+    require(compareImages(frames[0], GIFImage::load(path)).maxAbs == 0, "Loading an animated GIF should return its first frame");
+
+    const std::string stillPath = testOutDir + "/animation-still.gif";
+    require(frames[0].save(stillPath), "Saving a still GIF should succeed");
+    require(std::filesystem::file_size(path) < std::filesystem::file_size(stillPath) * 2,
+            "Frames after the first should only store their changed rectangles");
+
+    const std::string opsOut = testOutDir + "/animation-ops.iflow";
+    const std::string opsGif = testOutDir + "/animation-ops.gif";
+    require(runCLIArgs({"image_flow", "ops",
+                        "--width", "16",
+                        "--height", "8",
+                        "--out", opsOut,
+                        "--animate", opsGif,
+                        "--frame-delay", "7",
+                        "--op", "add-layer parent=/ name=Base width=16 height=8 fill=0,0,255,255",
+                        "--op", "emit-frame",
+                        "--op", "draw-fill-rect path=/0 x=2 y=2 width=4 height=4 rgba=255,255,0,255",
+                        "--op", "emit-frame delay=20"}) == 0,
+            "ops --animate should write one frame per emit-frame op");
+    const std::vector<GIFImage> opsFrames = GIFImage::loadFrames(opsGif);
+    require(opsFrames.size() == 2, "ops --animate should write two frames");
+    const auto isColor = [](const Color& c, int r, int g, int b) { return c.r == r && c.g == g && c.b == b; };
+    require(isColor(opsFrames[0].getPixel(3, 3), 0, 0, 255) && isColor(opsFrames[1].getPixel(3, 3), 255, 255, 0) &&
+                isColor(opsFrames[1].getPixel(10, 3), 0, 0, 255),
+            "ops --animate frames should follow the document between emit-frame ops");
+    require(runCLIArgs({"image_flow", "ops",
+                        "--width", "4",
+                        "--height", "4",
+                        "--out", opsOut,
+                        "--op", "emit-frame"}) != 0,
+            "emit-frame without --animate should fail");
+}
+
+void testWEBPEncodesLosslessAndNearLossless() {
+    const std::string testOutDir = "build/output/test-images";
+    std::filesystem::create_directories(testOutDir);
+
+    // A noisy gradient has far more than 256 colors, so it takes the
+    // predictor path rather than the palette one.
+    const int width = 83;
+    const int height = 61;
+    std::vector<std::uint8_t> rgba(static_cast<std::size_t>(width) * height * 4);
+    std::uint32_t seed = 12345;
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            seed = seed * 1103515245u + 12345u;
+            std::uint8_t* p = rgba.data() + (static_cast<std::size_t>(y) * width + x) * 4;
+            p[0] = static_cast<std::uint8_t>(x * 3 + ((seed >> 16) & 7));
+            p[1] = static_cast<std::uint8_t>(y * 4 + ((seed >> 20) & 3));
+            p[2] = static_cast<std::uint8_t>((x < width / 2) ? 200 : (x ^ y) * 5);
+            p[3] = static_cast<std::uint8_t>(x < 10 ? 0 : 255);
+        }
+    }
+    const PixelRows rows{rgba.data(), width, height, 4, static_cast<std::size_t>(width) * 4};
+    const auto maxError = [&](const WEBPImage& image) {
+        int worst = 0;
+        for (int y = 0; y < height; ++y) {
+            for (int x = 0; x < width; ++x) {
+                const std::uint8_t* p = rgba.data() + (static_cast<std::size_t>(y) * width + x) * 4;
+                const Color& c = image.getPixel(x, y);
+                worst = std::max({worst, std::abs(c.r - p[0]), std::abs(c.g - p[1]), std::abs(c.b - p[2])});
+            }
+        }
+        return worst;
+    };
+
+    const std::string losslessPath = testOutDir + "/lossless.webp";
+    require(WEBPImage::saveRows(losslessPath, rows), "Saving lossless WebP should succeed");
+    require(maxError(WEBPImage::load(losslessPath)) == 0, "Lossless WebP should roundtrip exactly");
+    std::ifstream in(losslessPath, std::ios::binary);
+    std::vector<std::uint8_t> header(26);
+    in.read(reinterpret_cast<char*>(header.data()), static_cast<std::streamsize>(header.size()));
+    require(std::string(header.begin() + 8, header.begin() + 16) == "WEBPVP8L", "WebP output should be a VP8L file");
+    require((header[24] & 0x10) != 0, "Transparent input should set the VP8L alpha bit");
+
+    const std::string nearPath = testOutDir + "/near-lossless.webp";
+    WEBPSaveOptions nearOptions;
+    nearOptions.quality = 60;
+    require(WEBPImage::saveRows(nearPath, rows, nearOptions), "Saving near-lossless WebP should succeed");
+    require(maxError(WEBPImage::load(nearPath)) < 4, "Near-lossless error should stay below the quantization step");
+    require(std::filesystem::file_size(nearPath) <= std::filesystem::file_size(losslessPath),
+            "Near-lossless WebP should never be larger than lossless");
+
+    // Few colors go through the color-indexing transform with packed indices.
+    WEBPImage palette(37, 19, Color(10, 20, 30));
+    for (int y = 0; y < palette.height(); ++y) {
+        for (int x = 0; x < palette.width(); ++x) {
+            if ((x + y) % 5 == 0) {
+                palette.setPixel(x, y, Color(250, 128, 0));
+            } else if (y > 12) {
+                palette.setPixel(x, y, Color(0, 0, 255));
+            }
+        }
+    }
+    const std::string palettePath = testOutDir + "/palette.webp";
+    require(palette.save(palettePath), "Saving palette WebP should succeed");
+    require(compareImages(palette, WEBPImage::load(palettePath)).maxAbs == 0, "Palette WebP should roundtrip exactly");
+
+    // Fibonacci frequencies force code lengths past the limit; the limited
+    // code must still be complete.
+    std::vector<std::uint32_t> freqs(30);
+    freqs[0] = 1;
+    freqs[1] = 1;
+    for (std::size_t i = 2; i < freqs.size(); ++i) {
+        freqs[i] = freqs[i - 1] + freqs[i - 2];
+    }
+    const std::vector<std::uint8_t> lengths = huffmanLengths(freqs, 15);
+    std::uint64_t kraft = 0;
+    for (const std::uint8_t length : lengths) {
+        require(length >= 1 && length <= 15, "Limited Huffman lengths should stay within the limit");
+        kraft += std::uint64_t{1} << (15 - length);
+    }
+    require(kraft == (std::uint64_t{1} << 15), "Limited Huffman code should be complete");
+}
+
+void testCodecRegistryDecodesByMagicWithAlpha() {
+    const std::string testOutDir = "build/output/test-images";
+    std::filesystem::create_directories(testOutDir);
+
+    // An RGBA PNG under a misleading extension: the magic bytes pick the codec.
+    const int width = 20;
+    const int height = 10;
+    std::vector<std::uint8_t> rgba(static_cast<std::size_t>(width) * height * 4);
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            std::uint8_t* p = rgba.data() + (static_cast<std::size_t>(y) * width + x) * 4;
+            p[0] = static_cast<std::uint8_t>(x * 12);
+            p[1] = static_cast<std::uint8_t>(y * 25);
+            p[2] = 90;
+            p[3] = static_cast<std::uint8_t>(x < 10 ? 0 : 200);
+        }
+    }
+    const std::string path = testOutDir + "/registry_rgba.jpg";
+    require(PNGImage::saveRows(path, PixelRows{rgba.data(), width, height, 4, static_cast<std::size_t>(width) * 4}),
+            "Saving RGBA PNG should succeed");
+    const ImageBuffer decoded = decodeImageFile(path);
+    require(decoded.width() == width && decoded.height() == height, "Registry decode should keep the image size");
+    require(decoded.getPixel(3, 4).a == 0 && decoded.getPixel(15, 4).a == 200 && decoded.getPixel(15, 4).r == 180,
+            "Registry decode should keep PNG alpha");
+
+    DecodeOptions options;
+    options.regionX = 10;
+    options.regionY = 2;
+    options.regionWidth = 6;
+    options.regionHeight = 4;
+    const ImageBuffer region = decodeImageFile(path, options);
+    require(region.width() == 6 && region.height() == 4 && region.getPixel(0, 0).r == 120 && region.getPixel(0, 0).g == 50,
+            "A decode region should crop in source pixels");
+    options.targetWidth = 3;
+    options.targetHeight = 2;
+    const ImageBuffer scaled = decodeImageFileAsync(path, options).get();
+    require(scaled.width() == 3 && scaled.height() == 2 && scaled.getPixel(1, 1).a == 200,
+            "Async decodes should crop, then scale to the target size");
+
+    // A registered codec is found by its magic bytes.
+    registerImageCodec({"Test", {"tst"},
+                        [](const std::uint8_t* data, std::size_t size) { return size >= 4 && std::equal(data, data + 4, "TST1"); },
+                        [](const std::uint8_t* data, std::size_t size, const PixelTarget& target, const DecodeOptions&) {
+                            std::uint8_t* out = target.allocate(static_cast<int>(size - 4), 1);
+                            for (std::size_t i = 4; i < size; ++i, out += target.channels) {
+                                out[0] = out[1] = out[2] = data[i];
+                                out[3] = 255;
+                            }
+                        }});
+    const std::uint8_t custom[] = {'T', 'S', 'T', '1', 7, 9};
+    const ImageBuffer customImage = decodeImage(custom, sizeof(custom), "custom.bin");
+    require(customImage.width() == 2 && customImage.getPixel(1, 0).g == 9, "Registered codecs should decode by magic");
+
+    bool rejected = false;
+    try {
+        const std::uint8_t junk[] = {1, 2, 3, 4};
+        decodeImage(junk, sizeof(junk), "junk.bin");
+    } catch (const std::runtime_error&) {
+        rejected = true;
+    }
+    require(rejected, "Unknown formats should be rejected");
+
+    // Imports keep alpha, scaled by alpha=, and take crop=; both imports are
+    // prefetched before the first one runs.
+    const std::string opsOut = testOutDir + "/registry-import.iflow";
+    require(runCLIArgs({"image_flow", "ops", "--width", "32", "--height", "32", "--out", opsOut,
+                        "--op", "add-layer name=A width=4 height=4",
+                        "--op", "add-layer name=B width=4 height=4",
+                        "--op", "import-image path=/0 file=" + path + " alpha=128",
+                        "--op", "import-image path=/1 file=" + path + " crop=10,2,6,4"}) == 0,
+            "import-image should accept crop=");
+    const Document imported = loadDocumentIFLOW(opsOut);
+    const ImageBuffer& first = imported.node(0).asLayer().image();
+    const ImageBuffer& second = imported.node(1).asLayer().image();
+    require(first.getPixel(3, 4).a == 0 && first.getPixel(15, 4).a == 100, "import-image alpha= should scale the file's alpha");
+    require(second.width() == 6 && second.height() == 4 && second.getPixel(0, 0).r == 120,
+            "import-image crop= should take a source rectangle");
+}
+
+void testSVGExportMergesRectsAndEmbedsPNG() {
+    const std::string testOutDir = "build/output/test-images";
+    std::filesystem::create_directories(testOutDir);
+    const auto countOf = [](const std::string& path, const std::string& token) {
+        std::ifstream in(path, std::ios::binary);
+        const std::string text((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        std::size_t count = 0;
+        for (std::size_t pos = text.find(token); pos != std::string::npos; pos = text.find(token, pos + 1)) {
+            ++count;
+        }
+        return count;
+    };
+
+    // Two blocks on a background need one rectangle each plus the background.
+    SVGImage blocks(40, 30, Color(250, 250, 250));
+    for (int y = 5; y < 20; ++y) {
+        for (int x = 3; x < 12; ++x) {
+            blocks.setPixel(x, y, Color(200, 10, 10));
+            blocks.setPixel(x + 20, y + 4, Color(10, 10, 200));
+        }
+    }
+    const std::string blocksPath = testOutDir + "/svg_blocks.svg";
+    require(blocks.save(blocksPath), "Saving merged SVG should succeed");
+    require(countOf(blocksPath, "<rect") == 3 && countOf(blocksPath, "<image") == 0, "Equal-color blocks should merge into single rects");
+    require(compareImages(blocks, SVGImage::load(blocksPath)).maxAbs == 0, "Merged rects should reproduce the pixels");
+
+    // Few colors in a noisy layout stress run and stacking boundaries.
+    std::uint32_t seed = 7u;
+    SVGImage patchy(37, 23, Color(0, 0, 0));
+    const Color palette[3] = {Color(0, 0, 0), Color(255, 128, 0), Color(30, 60, 90)};
+    for (int y = 0; y < patchy.height(); ++y) {
+        for (int x = 0; x < patchy.width(); ++x) {
+            seed = seed * 1664525u + 1013904223u;
+            if ((seed >> 28) < 4) {
+                continue;
+            }
+            patchy.setPixel(x, y, (seed >> 24) & 1 ? palette[1] : palette[2]);
+        }
+    }
+    SVGSaveOptions rectOptions;
+    rectOptions.mode = SVGExportMode::Rects;
+    const std::string patchyPath = testOutDir + "/svg_patchy.svg";
+    require(patchy.save(patchyPath, rectOptions), "Saving rects SVG should succeed");
+    require(countOf(patchyPath, "<image") == 0, "Rects mode should never embed");
+    require(compareImages(patchy, SVGImage::load(patchyPath)).maxAbs == 0, "Rects mode should reproduce noisy pixels");
+
+    // Rects keep alpha: transparent pixels get no rect and translucent runs
+    // a fill-opacity, so import (onto white) blends them.
+    std::vector<std::uint8_t> clear(static_cast<std::size_t>(40) * 30 * 4, 0);
+    for (int y = 5; y < 20; ++y) {
+        for (int x = 3; x < 12; ++x) {
+            std::uint8_t* red = clear.data() + (static_cast<std::size_t>(y) * 40 + x) * 4;
+            red[0] = 255;
+            red[3] = 128;
+            std::uint8_t* blue = clear.data() + (static_cast<std::size_t>(y) * 40 + x + 20) * 4;
+            blue[2] = 255;
+            blue[3] = 255;
+        }
+    }
+    const PixelRows clearRows{clear.data(), 40, 30, 4, static_cast<std::size_t>(40) * 4};
+    const std::string clearPath = testOutDir + "/svg_transparent.svg";
+    require(SVGImage::saveRows(clearPath, clearRows), "Saving a transparent SVG should succeed");
+    require(countOf(clearPath, "<rect") == 2 && countOf(clearPath, "<image") == 0 && countOf(clearPath, "fill-opacity=\"0.502\"") == 1,
+            "Transparent pixels should get no rect and translucent ones a fill-opacity");
+    const SVGImage clearLoaded = SVGImage::load(clearPath);
+    const Color& background = clearLoaded.getPixel(0, 0);
+    const Color& tinted = clearLoaded.getPixel(5, 10);
+    require(background.r == 255 && background.g == 255 && background.b == 255 && tinted.r == 255 && tinted.g >= 126 && tinted.g <= 128 &&
+                clearLoaded.getPixel(25, 10).b == 255 && clearLoaded.getPixel(25, 10).r == 0,
+            "Translucent rects should blend and opaque ones cover");
+
+    // Photographic content switches to an embedded PNG that loads back exactly.
+    const int width = 64;
+    const int height = 48;
+    std::vector<std::uint8_t> rgba(static_cast<std::size_t>(width) * height * 4);
+    for (std::uint8_t& value : rgba) {
+        seed = seed * 1664525u + 1013904223u;
+        value = static_cast<std::uint8_t>(seed >> 24);
+    }
+    for (std::size_t i = 3; i < rgba.size(); i += 4) {
+        rgba[i] = 255;
+    }
+    const PixelRows rows{rgba.data(), width, height, 4, static_cast<std::size_t>(width) * 4};
+    const std::string photoPath = testOutDir + "/svg_photo.svg";
+    require(SVGImage::saveRows(photoPath, rows), "Saving noisy SVG should succeed");
+    require(countOf(photoPath, "<image") == 1 && countOf(photoPath, "<rect") == 0, "Auto mode should embed photographic content");
+    const SVGImage photo = SVGImage::load(photoPath);
+    bool exact = photo.width() == width && photo.height() == height;
+    for (int y = 0; exact && y < height; ++y) {
+        for (int x = 0; exact && x < width; ++x) {
+            const std::uint8_t* p = rgba.data() + (static_cast<std::size_t>(y) * width + x) * 4;
+            const Color& c = photo.getPixel(x, y);
+            exact = c.r == p[0] && c.g == p[1] && c.b == p[2];
+        }
+    }
+    require(exact, "An embedded PNG should load back pixel for pixel");
+
+    const std::string projectPath = testOutDir + "/svg_export.iflow";
+    const std::string renderPath = testOutDir + "/svg_export.svg";
+    require(runCLIArgs({"image_flow", "new", "--width", "24", "--height", "16", "--out", projectPath}) == 0,
+            "Creating the SVG export project should succeed");
+    require(runCLIArgs({"image_flow", "render", "--in", projectPath, "--out", renderPath, "--svg-mode", "png"}) == 0,
+            "render should accept --svg-mode");
+    require(countOf(renderPath, "data:image/png;base64,") == 1, "--svg-mode png should embed the composite");
+    require(runCLIArgs({"image_flow", "render", "--in", projectPath, "--out", renderPath, "--svg-mode", "paths"}) != 0,
+            "Unknown --svg-mode values should be rejected");
+}
+
+void testSVGStreamingRasterizerAntialiasesShapes() {
+    const std::string testOutDir = "build/output/test-images";
+    std::filesystem::create_directories(testOutDir);
+    const auto writeText = [](const std::string& path, const std::string& text) {
+        std::ofstream out(path, std::ios::binary);
+        out << text;
+    };
+
+    const std::string shapesPath = testOutDir + "/svg_shapes.svg";
+    writeText(shapesPath,
+              "<?xml version=\"1.0\"?>\n<!-- comment <rect/> -->\n"
+              "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"64\" height=\"64\">\n"
+              "  <defs><rect x=\"0\" y=\"0\" width=\"64\" height=\"64\" fill=\"#000000\"/></defs>\n"
+              "  <circle cx=\"16\" cy=\"16\" r=\"10\" fill=\"#ff0000\"/>\n"
+              "  <path d=\"M36 4h24v24h-24z M40 8h16v16h-16z\" fill=\"#0000ff\" fill-rule=\"evenodd\"/>\n"
+              "  <path d=\"M4 36h24v24h-24z M8 40h16v16h-16z\" fill=\"#0000ff\"/>\n"
+              "  <g transform=\"translate(36,36) scale(2)\" style=\"fill: #00ff00\">\n"
+              "    <rect x=\"0\" y=\"0\" width=\"4\" height=\"4\"/>\n"
+              "    <path d=\"M6 6 A3 3 0 0 1 12 6 Q12 12 6 12 Z\"/>\n"
+              "  </g>\n"
+              "</svg>\n");
+    const SVGImage shapes = SVGImage::load(shapesPath, 64, 64, 1);
+    const Color& center = shapes.getPixel(16, 16);
+    require(center.r == 255 && center.g == 0 && center.b == 0, "Circle center should be solid");
+    const Color& edge = shapes.getPixel(16, 6);
+    require(edge.r == 255 && edge.g > 0 && edge.g < 255, "Circle edge should be anti-aliased");
+    const Color& corner = shapes.getPixel(1, 1);
+    require(corner.r == 255 && corner.g == 255 && corner.b == 255, "Defs content should not render");
+    const Color& evenOddHole = shapes.getPixel(48, 16);
+    const Color& nonZeroHole = shapes.getPixel(16, 48);
+    require(evenOddHole.b == 255 && evenOddHole.r == 255, "Evenodd should leave the inner square empty");
+    require(nonZeroHole.b == 255 && nonZeroHole.r == 0, "Nonzero should fill same-direction inner squares");
+    const Color& scaledRect = shapes.getPixel(43, 43);
+    require(scaledRect.r == 0 && scaledRect.g == 255 && scaledRect.b == 0, "Group transform and style should apply");
+    const Color& outsideScaled = shapes.getPixel(45, 40);
+    require(outsideScaled.g == 255 && outsideScaled.r == 255, "Scaled rect should end at its transformed edge");
+    const Color& curve = shapes.getPixel(54, 50);
+    require(curve.g == 255 && curve.r == 0, "Arc and quadratic path segments should fill");
+
+    // Integer-aligned rectangles stay exact, and threading does not change output.
+    std::string sheet = "<svg width=\"256\" height=\"256\">";
+    std::uint32_t seed = 5u;
+    for (int i = 0; i < 2000; ++i) {
+        seed = seed * 1664525u + 1013904223u;
+        const int x = static_cast<int>((seed >> 8) % 240);
+        const int y = static_cast<int>((seed >> 16) % 240);
+        sheet += i % 2 == 0 ? "<rect x=\"" + std::to_string(x) + "\" y=\"" + std::to_string(y) +
+                                  "\" width=\"9\" height=\"7\" fill=\"rgb(" + std::to_string(i % 256) + ",40,90)\"/>"
+                            : "<circle cx=\"" + std::to_string(x + 8) + "\" cy=\"" + std::to_string(y + 8) +
+                                  "\" r=\"5.5\" fill=\"#3080c0\" fill-opacity=\"0.5\"/>";
+    }
+    sheet += "<rect x=\"250\" y=\"250\" width=\"6\" height=\"6\" fill=\"#123456\"/></svg>";
+    const std::string sheetPath = testOutDir + "/svg_sheet.svg";
+    writeText(sheetPath, sheet);
+    const SVGImage serial = SVGImage::load(sheetPath, 256, 256, 1);
+    const SVGImage threaded = SVGImage::load(sheetPath, 256, 256, 0);
+    require(compareImages(serial, threaded).maxAbs == 0, "Banded rasterization should not depend on thread count");
+    const Color& aligned = serial.getPixel(252, 252);
+    require(aligned.r == 0x12 && aligned.g == 0x34 && aligned.b == 0x56, "Aligned rects should cover whole pixels exactly");
+}
+
+void testBMPMappedRowsKeepAlphaAndSwizzleExactly() {
+    const std::string testOutDir = "build/output/test-images";
+    std::filesystem::create_directories(testOutDir);
+
+    // Every layout pair and tail length against a per-pixel reference.
+    std::uint32_t seed = 11u;
+    std::vector<std::uint8_t> source(64 * 4);
+    for (std::uint8_t& value : source) {
+        seed = seed * 1664525u + 1013904223u;
+        value = static_cast<std::uint8_t>(seed >> 24);
+    }
+    for (int srcChannels = 3; srcChannels <= 4; ++srcChannels) {
+        for (int dstChannels = 3; dstChannels <= 4; ++dstChannels) {
+            for (int swap = 0; swap < 2; ++swap) {
+                for (std::size_t count = 0; count <= 64; ++count) {
+                    std::vector<std::uint8_t> converted(count * static_cast<std::size_t>(dstChannels) + 1, 0xA5);
+                    convertPixels(source.data(), srcChannels, converted.data(), dstChannels, count, swap != 0);
+                    bool exact = converted.back() == 0xA5;
+                    for (std::size_t i = 0; i < count && exact; ++i) {
+                        const std::uint8_t* in = source.data() + i * static_cast<std::size_t>(srcChannels);
+                        const std::uint8_t* out = converted.data() + i * static_cast<std::size_t>(dstChannels);
+                        exact = out[0] == in[swap ? 2 : 0] && out[1] == in[1] && out[2] == in[swap ? 0 : 2] &&
+                                (dstChannels == 3 || out[3] == (srcChannels == 4 ? in[3] : 255));
+                    }
+                    require(exact, "convertPixels should match the per-pixel layout change");
+                }
+            }
+        }
+    }
+
+    // RGBA rows round-trip through 32-bit BGRA with alpha intact.
+    ImageBuffer composite(37, 19);
+    for (int y = 0; y < composite.height(); ++y) {
+        for (int x = 0; x < composite.width(); ++x) {
+            composite.setPixel(x, y, PixelRGBA8(static_cast<std::uint8_t>(x * 7), static_cast<std::uint8_t>(y * 13),
+                                                static_cast<std::uint8_t>(x + y), static_cast<std::uint8_t>(x * y)));
+        }
+    }
+    const std::string alphaPath = testOutDir + "/rows_bgra.bmp";
+    require(BMPImage::saveRows(alphaPath, pixelRows(composite)), "Saving RGBA rows as BMP should succeed");
+    require(std::filesystem::file_size(alphaPath) == 14 + 108 + 37 * 19 * 4, "RGBA rows should be stored as 32-bit BGRA");
+    const ImageBuffer decoded = decodeImageFile(alphaPath);
+    bool same = decoded.width() == composite.width() && decoded.height() == composite.height();
+    for (int y = 0; y < composite.height() && same; ++y) {
+        for (int x = 0; x < composite.width() && same; ++x) {
+            const PixelRGBA8& a = composite.getPixel(x, y);
+            const PixelRGBA8& b = decoded.getPixel(x, y);
+            same = a.r == b.r && a.g == b.g && a.b == b.b && a.a == b.a;
+        }
+    }
+    require(same, "32-bit BMP should keep colors and alpha exactly");
+    const BMPImage rgb = BMPImage::load(alphaPath);
+    require(rgb.getPixel(5, 3).r == 35 && rgb.getPixel(5, 3).g == 39 && rgb.getPixel(5, 3).b == 8,
+            "32-bit BMP should load into RGB images");
+
+    // A top-down 32-bit BI_RGB file with its fourth byte left zero is opaque.
+    std::vector<std::uint8_t> file(14 + 40 + 2 * 2 * 4, 0);
+    const auto put32 = [&file](std::size_t offset, std::uint32_t value) {
+        for (int i = 0; i < 4; ++i) {
+            file[offset + static_cast<std::size_t>(i)] = static_cast<std::uint8_t>(value >> (8 * i));
+        }
+    };
+    file[0] = 'B';
+    file[1] = 'M';
+    put32(2, static_cast<std::uint32_t>(file.size()));
+    put32(10, 54);
+    put32(14, 40);
+    put32(18, 2);
+    put32(22, static_cast<std::uint32_t>(-2));
+    file[26] = 1;
+    file[28] = 32;
+    file[54] = 10;
+    file[55] = 20;
+    file[56] = 30;
+    const ImageBuffer plain = decodeImage(file.data(), file.size(), "plain.bmp");
+    require(plain.getPixel(0, 0).r == 30 && plain.getPixel(0, 0).b == 10 && plain.getPixel(0, 0).a == 255 &&
+                plain.getPixel(1, 1).a == 255,
+            "Zero fourth bytes in 32-bit BI_RGB files should read as opaque");
+}
+
+void testRenderWritesEveryTargetFromOneComposite() {
+    const std::string testOutDir = "build/output/test-images/render-targets";
+    std::filesystem::create_directories(testOutDir);
+    const std::string projectPath = testOutDir + "/project.iflow";
+    require(runCLIArgs({"image_flow", "ops", "--width", "64", "--height", "32", "--out", projectPath,
+                        "--op", "add-layer name=Base width=64 height=32 fill=200,40,10,255",
+                        "--op", "add-layer name=Half width=32 height=32 fill=0,0,255,128"}) == 0,
+            "Creating the render-target project should succeed");
+
+    const std::string pngPath = testOutDir + "/full.png";
+    const std::string jpgPath = testOutDir + "/thumb.jpg";
+    const std::string webpPath = testOutDir + "/half.webp";
+    require(runCLIArgs({"image_flow", "render", "--in", projectPath, "--out", pngPath + ",level=1",
+                        "--out", jpgPath + ",scale=0.25,quality=90", "--out", webpPath + ",scale=0.5"}) == 0,
+            "render should write several targets");
+    const ImageBuffer full = decodeImageFile(pngPath);
+    const ImageBuffer thumb = decodeImageFile(jpgPath);
+    const ImageBuffer half = decodeImageFile(webpPath);
+    require(full.width() == 64 && full.height() == 32, "Unscaled targets keep the document size");
+    require(thumb.width() == 16 && thumb.height() == 8 && half.width() == 32 && half.height() == 16,
+            "scale= should resize each target");
+    const PixelRGBA8& left = half.getPixel(4, 8);
+    const PixelRGBA8& right = half.getPixel(28, 8);
+    const PixelRGBA8& fullLeft = full.getPixel(8, 16);
+    require(left.r == fullLeft.r && left.g == fullLeft.g && left.b == fullLeft.b && right.r == 200 && right.b == 10,
+            "Scaled targets should average the composite");
+    require(std::abs(thumb.getPixel(12, 4).r - 200) < 8, "JPEG targets should encode the scaled composite");
+
+    require(runCLIArgs({"image_flow", "render", "--in", projectPath, "--out", pngPath, "--out", testOutDir + "/x.tiff"}) != 0,
+            "Unsupported target extensions should be rejected before rendering");
+    require(runCLIArgs({"image_flow", "render", "--in", projectPath, "--out", pngPath + ",dpi=72"}) != 0,
+            "Unknown target options should be rejected");
+
+    // Commas before the trailing options stay in the file name.
+    const std::string commaPath = testOutDir + "/we,ird.png";
+    const std::string commaScaledPath = testOutDir + "/we,ird,scaled.png";
+    std::filesystem::remove(commaPath);
+    require(runCLIArgs({"image_flow", "render", "--in", projectPath, "--out", commaPath, "--out", commaScaledPath + ",scale=0.5,level=1"}) == 0,
+            "render should accept commas in file names");
+    require(decodeImageFile(commaPath).width() == 64 && decodeImageFile(commaScaledPath).width() == 32,
+            "Comma file names should keep their trailing options");
+}
+
+void testOpsEmitWritesSnapshotsInBackground() {
+    const std::string testOutDir = "build/output/test-images/emit-queue";
+    std::filesystem::remove_all(testOutDir);
+    std::filesystem::create_directories(testOutDir);
+    const std::string projectPath = testOutDir + "/frames.iflow";
+    const std::string framePath = testOutDir + "/frame";
+    // Later fills must not reach earlier snapshots, and an import of an
+    // emitted file waits for it to be written.
+    require(runCLIArgs({"image_flow", "ops", "--width", "48", "--height", "32", "--out", projectPath,
+                        "--op", "add-layer name=A width=48 height=32 fill=255,0,0,255",
+                        "--op", "emit file=" + framePath + "0.png",
+                        "--op", "fill-layer path=/0 rgba=0,0,255,255",
+                        "--op", "emit file=" + framePath + "1.png",
+                        "--op", "fill-layer path=/0 rgba=0,255,0,255",
+                        "--op", "emit file=" + framePath + "2.bmp",
+                        "--op", "emit file=" + framePath + "3.webp",
+                        "--op", "import-image path=/0 file=" + framePath + "0.png",
+                        "--op", "emit file=" + framePath + "4.png"}) == 0,
+            "Scripts with several emits should succeed");
+    const auto colorOf = [](const std::string& path) { return decodeImageFile(path).getPixel(10, 10); };
+    require(colorOf(framePath + "0.png").r == 255 && colorOf(framePath + "1.png").b == 255 &&
+                colorOf(framePath + "2.bmp").g == 255 && colorOf(framePath + "3.webp").g == 255,
+            "Each emit should keep the composite of its own op");
+    require(colorOf(framePath + "4.png").r == 255 && colorOf(framePath + "4.png").g == 0,
+            "Importing an emitted file should see the finished write");
+
+    // A failed write is reported with its op index once the script has run,
+    // and the document is not saved.
+    const std::string failedPath = testOutDir + "/failed.iflow";
+    std::ostringstream errors;
+    std::streambuf* original = std::cerr.rdbuf(errors.rdbuf());
+    const int status = runCLIArgs({"image_flow", "ops", "--width", "8", "--height", "8", "--out", failedPath,
+                                   "--op", "add-layer name=A width=8 height=8 fill=1,2,3,255",
+                                   "--op", "emit file=" + testOutDir + "/bad.tiff",
+                                   "--op", "emit file=" + framePath + "5.png"});
+    std::cerr.rdbuf(original);
+    require(status != 0 && !std::filesystem::exists(failedPath), "A failed emit should fail the script");
+    require(errors.str().find("op[1]") != std::string::npos && std::filesystem::exists(framePath + "5.png"),
+            "Emit failures should name their op after later ops ran");
+}
+
+void testGaussianBlurMatchesReferenceAtEveryRadius() {
+    const std::string testOutDir = "build/output/test-images";
+    std::filesystem::create_directories(testOutDir);
+    const std::string projectPath = testOutDir + "/gaussian-blur.iflow";
+    // A vertical edge blurs into a profile that only depends on x.
+    require(runCLIArgs({"image_flow", "ops", "--width", "160", "--height", "40", "--out", projectPath,
+                        "--op", "add-layer name=Small width=160 height=40 fill=0,0,0,255",
+                        "--op", "draw-fill-rect path=/0 x=0 y=0 width=80 height=40 rgba=255,255,255,255",
+                        "--op", "gaussian-blur path=/0 radius=3 sigma=1.5",
+                        "--op", "add-layer name=Large width=160 height=40 fill=0,0,0,255",
+                        "--op", "draw-fill-rect path=/1 x=0 y=0 width=80 height=40 rgba=255,255,255,255",
+                        "--op", "gaussian-blur path=/1 radius=40"}) == 0,
+            "Gaussian blur scripts should succeed");
+    const Document blurred = loadDocumentIFLOW(projectPath);
+    const ImageBuffer& small = blurred.layer(0).image();
+    const ImageBuffer& large = blurred.layer(1).image();
+
+    // Short kernels are convolved directly; fixed-point weights stay within
+    // a level of the exact result.
+    double weights[7];
+    double total = 0.0;
+    for (int k = -3; k <= 3; ++k) {
+        weights[k + 3] = std::exp(-(k * k) / (2.0 * 1.5 * 1.5));
+        total += weights[k + 3];
+    }
+    bool directMatches = true;
+    for (int x = 0; x < 160; ++x) {
+        double expected = 0.0;
+        for (int k = -3; k <= 3; ++k) {
+            expected += (std::clamp(x + k, 0, 159) < 80 ? 255.0 : 0.0) * weights[k + 3] / total;
+        }
+        for (int y : {0, 20, 39}) {
+            const PixelRGBA8 pixel = small.getPixel(x, y);
+            directMatches = directMatches && std::abs(pixel.r - expected) <= 1.0 && pixel.r == pixel.b && pixel.a == 255;
+        }
+    }
+    require(directMatches, "Direct gaussian blur should match a double-precision reference");
+
+    // Long kernels run as a box cascade, which tracks the gaussian closely
+    // and leaves flat areas exact.
+    const double sigma = 0.3 * 40 + 0.8;
+    bool cascadeMatches = true;
+    for (int x = 0; x < 160; ++x) {
+        const double expected = 255.0 * 0.5 * std::erfc((x + 0.5 - 80.0) / (sigma * std::sqrt(2.0)));
+        for (int y : {0, 20, 39}) {
+            const PixelRGBA8 pixel = large.getPixel(x, y);
+            cascadeMatches = cascadeMatches && std::abs(pixel.g - expected) <= 6.0 && pixel.a == 255;
+        }
+    }
+    require(cascadeMatches, "Box cascade blur should approximate the gaussian");
+    require(large.getPixel(0, 0).r == 255 && large.getPixel(159, 39).r == 0,
+            "Box cascade blur should keep flat regions unchanged");
+}
+
+void testBoxCascadeBlurClampsEdgesLikeTheDirectKernel() {
+    // Thin lines along the borders depend most on how edges are clamped;
+    // the cascade has to agree with the direct kernel there, not just inside.
+    const std::string testOutDir = "build/output/test-images";
+    std::filesystem::create_directories(testOutDir);
+    const std::string projectPath = testOutDir + "/box-blur-edges.iflow";
+    require(runCLIArgs({"image_flow", "ops", "--width", "200", "--height", "150", "--out", projectPath,
+                        "--op", "add-layer name=A width=200 height=150 fill=0,0,0,255",
+                        "--op", "draw-fill-rect path=/0 x=0 y=0 width=3 height=150 rgba=255,255,255,255",
+                        "--op", "draw-fill-rect path=/0 x=0 y=0 width=200 height=3 rgba=255,255,255,255",
+                        "--op", "draw-fill-rect path=/0 x=194 y=144 width=6 height=6 rgba=255,255,255,255",
+                        "--op", "gaussian-blur path=/0 radius=20"}) == 0,
+            "Large-radius blur script should succeed");
+    const Document document = loadDocumentIFLOW(projectPath);
+    const ImageBuffer& blurred = document.layer(0).image();
+
+    const int radius = 20;
+    const double sigma = 0.3 * radius + 0.8;
+    std::vector<double> weights(radius * 2 + 1);
+    double total = 0.0;
+    for (int k = -radius; k <= radius; ++k) {
+        weights[k + radius] = std::exp(-(k * k) / (2.0 * sigma * sigma));
+        total += weights[k + radius];
+    }
+    // The reference is separable: rows first, then columns, both clamped.
+    std::vector<double> rows(200 * 150);
+    for (int y = 0; y < 150; ++y) {
+        for (int x = 0; x < 200; ++x) {
+            for (int k = -radius; k <= radius; ++k) {
+                const int sx = std::clamp(x + k, 0, 199);
+                const bool lit = sx < 3 || y < 3 || (sx >= 194 && y >= 144);
+                rows[y * 200 + x] += (lit ? 255.0 : 0.0) * weights[k + radius] / total;
+            }
+        }
+    }
+    double worst = 0.0;
+    for (int y = 0; y < 150; ++y) {
+        for (int x = 0; x < 200; ++x) {
+            double expected = 0.0;
+            for (int k = -radius; k <= radius; ++k) {
+                expected += rows[std::clamp(y + k, 0, 149) * 200 + x] * weights[k + radius] / total;
+            }
+            worst = std::max(worst, std::abs(blurred.getPixel(x, y).r - expected));
+        }
+    }
+    // The cascade's shape error is a few levels; re-padding each pass from
+    // blurred edges used to put the border rows 40 levels off.
+    require(worst <= 6.0, "Box cascade blur should clamp edges like the direct gaussian");
+}
+
+void testEffectsFollowTheCommandThreadCount() {
+    // Effects take --threads like the compositor; the pixels do not depend
+    // on it.
+    const std::string testOutDir = "build/output/test-images";
+    std::filesystem::create_directories(testOutDir);
+    const auto runEffects = [&testOutDir](const std::string& threads) {
+        const std::string projectPath = testOutDir + "/effects-threads-" + threads + ".iflow";
+        require(runCLIArgs({"image_flow", "ops", "--width", "120", "--height", "90", "--out", projectPath, "--threads", threads,
+                            "--op", "add-layer name=A fill=40,90,160,255",
+                            "--op", "fractal-noise path=/0 amount=0.5",
+                            "--op", "draw-fill-polygon path=/0 points=10,10;100,20;60,80 rgba=250,240,30,255",
+                            "--op", "draw-fill-ellipse path=/0 cx=80 cy=60 rx=20 ry=12 rgba=10,10,10,255",
+                            "--op", "gaussian-blur path=/0 radius=2",
+                            "--op", "morphology path=/0 op=dilate radius=2",
+                            "--op", "hatch path=/0 spacing=6",
+                            "--op", "gaussian-blur path=/0 radius=20",
+                            "--op", "gamma path=/0 gamma=1.4",
+                            "--op", "levels path=/0 in_black=10 in_white=240",
+                            "--op", "edge-detect path=/0 method=canny"}) == 0,
+                "Threaded effect scripts should succeed");
+        return loadDocumentIFLOW(projectPath).layer(0).image();
+    };
+    const ImageBuffer serial = runEffects("1");
+    const ImageBuffer threaded = runEffects("3");
+    require(std::memcmp(serial.data(), threaded.data(), static_cast<std::size_t>(120) * 90 * sizeof(PixelRGBA8)) == 0,
+            "Effects should give the same pixels for every --threads");
+}
+
+void testMorphologyMatchesBruteForceAndFoldsIterations() {
+    const std::string testOutDir = "build/output/test-images";
+    std::filesystem::create_directories(testOutDir);
+    const std::string projectPath = testOutDir + "/morphology.iflow";
+    std::vector<std::string> args = {"image_flow", "ops", "--width", "37", "--height", "23", "--out", projectPath};
+    const auto addOp = [&args](const std::string& op) {
+        args.push_back("--op");
+        args.push_back(op);
+    };
+    for (int i = 0; i < 4; ++i) {
+        addOp("add-layer name=L" + std::to_string(i) + " width=37 height=23 fill=128,128,128,255");
+        addOp("noise-layer path=/" + std::to_string(i) + " seed=7 amount=1 affect_alpha=true");
+    }
+    addOp("morphology path=/1 op=dilate shape=square radius=2 iterations=2");
+    addOp("morphology path=/2 op=erode shape=line angle=45 radius=3");
+    addOp("morphology path=/3 op=erode shape=line angle=135 radius=2 iterations=3");
+    addOp("add-layer name=Dot width=41 height=41 fill=0,0,0,255");
+    addOp("set-pixel path=/4 x=20 y=20 rgba=255,255,255,255");
+    addOp("morphology path=/4 op=dilate radius=6");
+    require(runCLIArgs(args) == 0, "Morphology scripts should succeed");
+    const Document result = loadDocumentIFLOW(projectPath);
+    const ImageBuffer& source = result.layer(0).image();
+
+    // Windows are clipped to the image, and iterations act like one pass
+    // with a longer element.
+    const auto matches = [&source](const ImageBuffer& image, int dx, int dy, int radius, bool dilate) {
+        for (int y = 0; y < 23; ++y) {
+            for (int x = 0; x < 37; ++x) {
+                std::array<int, 4> best = {dilate ? 0 : 255, dilate ? 0 : 255, dilate ? 0 : 255, dilate ? 0 : 255};
+                for (int j = -radius; j <= radius; ++j) {
+                    for (int i = -radius; i <= radius; ++i) {
+                        // A zero direction means a square window.
+                        const bool square = dx == 0 && dy == 0;
+                        const int sx = x + (square ? i : dx * i);
+                        const int sy = y + (square ? j : dy * i);
+                        if ((!square && j != 0) || sx < 0 || sy < 0 || sx >= 37 || sy >= 23) {
+                            continue;
+                        }
+                        const PixelRGBA8 p = source.getPixel(sx, sy);
+                        const std::array<int, 4> channels = {p.r, p.g, p.b, p.a};
+                        for (std::size_t c = 0; c < 4; ++c) {
+                            best[c] = dilate ? std::max(best[c], channels[c]) : std::min(best[c], channels[c]);
+                        }
+                    }
+                }
+                const PixelRGBA8 p = image.getPixel(x, y);
+                if (p.r != best[0] || p.g != best[1] || p.b != best[2] || p.a != best[3]) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    };
+    require(matches(result.layer(1).image(), 0, 0, 4, true), "Square dilation should match a brute-force window");
+    require(matches(result.layer(2).image(), 1, 1, 3, false), "Diagonal line erosion should match a brute-force window");
+    require(matches(result.layer(3).image(), -1, 1, 6, false), "Folded iterations should match one longer line");
+
+    // Discs are octagons: symmetric, reaching the radius along the axes
+    // and inside it along the diagonals.
+    const ImageBuffer& dot = result.layer(4).image();
+    bool symmetric = true;
+    for (int y = 0; y < 41; ++y) {
+        for (int x = 0; x < 41; ++x) {
+            symmetric = symmetric && dot.getPixel(x, y).r == dot.getPixel(40 - y, x).r;
+        }
+    }
+    require(symmetric, "Disc dilation should be symmetric under rotation");
+    require(dot.getPixel(26, 20).r == 255 && dot.getPixel(27, 20).r == 0 && dot.getPixel(24, 24).r == 255 &&
+                dot.getPixel(25, 24).r == 0 && dot.getPixel(26, 26).r == 0,
+            "Disc dilation should cover an octagon of the given radius");
+}
+
+void testEdgeDetectTilesMatchReferenceAcrossBands() {
+    const std::string testOutDir = "build/output/test-images";
+    std::filesystem::create_directories(testOutDir);
+    const std::string projectPath = testOutDir + "/edge-detect.iflow";
+    // Strips and a circle cross several 32-row tiles. The left strip is
+    // strong at the top and weak below; the right strip is weak throughout.
+    std::vector<std::string> args = {"image_flow", "ops", "--width", "90", "--height", "100", "--out", projectPath};
+    for (int i = 0; i < 3; ++i) {
+        const std::string path = "path=/" + std::to_string(i);
+        for (const std::string& op : {"add-layer name=L" + std::to_string(i) + " width=90 height=100 fill=0,0,0,255",
+                                      "draw-fill-rect " + path + " x=20 y=5 width=10 height=15 rgba=255,255,255,255",
+                                      "draw-fill-rect " + path + " x=20 y=20 width=10 height=70 rgba=40,40,40,255",
+                                      "draw-fill-rect " + path + " x=60 y=20 width=10 height=70 rgba=40,40,40,255",
+                                      "draw-fill-circle " + path + " cx=45 cy=60 radius=9 rgba=200,120,30,255"}) {
+            args.push_back("--op");
+            args.push_back(op);
+        }
+    }
+    for (const char* op : {"edge-detect path=/0 method=sobel", "edge-detect path=/1 method=canny low=100 high=200"}) {
+        args.push_back("--op");
+        args.push_back(op);
+    }
+    require(runCLIArgs(args) == 0, "Edge-detect scripts should succeed");
+    const Document result = loadDocumentIFLOW(projectPath);
+    const ImageBuffer& source = result.layer(2).image();
+
+    bool sobelMatches = true;
+    for (int y = 0; y < 100; ++y) {
+        for (int x = 0; x < 90; ++x) {
+            double gx = 0.0;
+            double gy = 0.0;
+            for (int j = -1; j <= 1; ++j) {
+                for (int i = -1; i <= 1; ++i) {
+                    const PixelRGBA8 p = source.getPixel(std::clamp(x + i, 0, 89), std::clamp(y + j, 0, 99));
+                    const double l = (0.299 * p.r + 0.587 * p.g + 0.114 * p.b) / 255.0;
+                    gx += i * (j == 0 ? 2 : 1) * l;
+                    gy += j * (i == 0 ? 2 : 1) * l;
+                }
+            }
+            const double expected = 255.0 * std::min(1.0, std::sqrt(gx * gx + gy * gy) / 4.0);
+            sobelMatches = sobelMatches && std::abs(result.layer(0).image().getPixel(x, y).r - expected) <= 1.0;
+        }
+    }
+    require(sobelMatches, "Sobel tiles should match a double-precision reference");
+
+    // Hysteresis keeps weak edges joined to a strong one, even tiles away,
+    // and drops weak edges with no strong neighbor.
+    const ImageBuffer& canny = result.layer(1).image();
+    const auto edgeInRow = [&canny](int y, int x0, int x1) {
+        for (int x = x0; x <= x1; ++x) {
+            if (canny.getPixel(x, y).r == 255) {
+                return true;
+            }
+        }
+        return false;
+    };
+    require(edgeInRow(10, 15, 25) && edgeInRow(40, 15, 25) && edgeInRow(80, 15, 25),
+            "Weak edges connected to a strong edge should survive across tiles");
+    require(!edgeInRow(40, 55, 75) && !edgeInRow(80, 55, 75), "Isolated weak edges should be suppressed");
+    require(edgeInRow(60, 30, 40) && canny.getPixel(45, 60).r == 0 && canny.getPixel(45, 60).a == 255,
+            "Canny should trace the circle's outline");
+}
+
+void testFusedPointOpsMatchOpsRunOneByOne() {
+    const std::string testOutDir = "build/output/test-images";
+    std::filesystem::create_directories(testOutDir);
+    const std::vector<std::string> chain = {
+        "levels path=/0 in_black=12 in_white=240 gamma=1.2 out_black=4 out_white=250",
+        "gamma path=/0 value=0.8",
+        "curves path=/0 rgb=0,0;128,150;255,255 r=0,10;255,240",
+        "channel-mix path=/0 rr=0.9 rg=0.2 gb=0.1 gg=0.85 bb=1.1 max=250",
+        "apply-effect path=/0 effect=invert preserve_alpha=false",
+        "apply-effect path=/0 effect=sepia strength=0.6",
+        "gamma path=/0 value=1.4 target=mask",
+        "curves path=/0 rgb=0,20;255,230",
+        "apply-effect path=/0 effect=grayscale",
+        "apply-effect path=/0 effect=threshold threshold=100 lo=10,20,30,200",
+        "levels path=/0 out_black=30"};
+    // Set-layer between ops keeps them from fusing.
+    const auto runChain = [&chain](const std::string& path, bool separate) {
+        std::vector<std::string> args = {"image_flow", "ops", "--width", "61", "--height", "37", "--out", path,
+                                         "--op", "add-layer name=A width=61 height=37 fill=128,128,128,255",
+                                         "--op", "noise-layer path=/0 seed=3 amount=1 affect_alpha=true",
+                                         "--op", "mask-enable path=/0 fill=200,200,200,255"};
+        for (const std::string& op : chain) {
+            args.push_back("--op");
+            args.push_back(op);
+            if (separate) {
+                args.push_back("--op");
+                args.push_back("set-layer path=/0 opacity=1");
+            }
+        }
+        require(runCLIArgs(args) == 0, "Point op chains should succeed");
+        return loadDocumentIFLOW(path);
+    };
+    const Document fused = runChain(testOutDir + "/point-ops-fused.iflow", false);
+    const Document separate = runChain(testOutDir + "/point-ops-separate.iflow", true);
+    const ImageBuffer& a = fused.layer(0).image();
+    const ImageBuffer& b = separate.layer(0).image();
+    bool same = true;
+    bool varied = false;
+    for (int y = 0; y < 37; ++y) {
+        for (int x = 0; x < 61; ++x) {
+            const PixelRGBA8 p = a.getPixel(x, y);
+            const PixelRGBA8 q = b.getPixel(x, y);
+            same = same && p.r == q.r && p.g == q.g && p.b == q.b && p.a == q.a;
+            varied = varied || p.r != a.getPixel(0, 0).r;
+        }
+        for (int x = 0; x < 61; ++x) {
+            same = same && fused.layer(0).mask().coverage(x, y) == separate.layer(0).mask().coverage(x, y);
+        }
+    }
+    require(varied, "Point op chains should keep some variation");
+    require(same, "Fused point ops should match the ops run one by one");
+}
+
+void testProceduralNoiseIsHashedPerPixel() {
+    const std::string testOutDir = "build/output/test-images";
+    std::filesystem::create_directories(testOutDir);
+    const std::string path = testOutDir + "/procedural-noise.iflow";
+    require(runCLIArgs({"image_flow", "ops", "--width", "45", "--height", "70", "--out", path,
+                        "--op", "add-layer name=A width=45 height=70 fill=100,120,140,160",
+                        "--op", "noise-layer path=/0 seed=9 amount=0.5 affect_alpha=true",
+                        "--op", "add-layer name=B width=45 height=70 fill=90,90,90,255",
+                        "--op", "pencil-strokes path=/1 spacing=3 length=20 thickness=3 angle=80 seed=4"}) == 0,
+            "Procedural noise ops should succeed");
+    const Document doc = loadDocumentIFLOW(path);
+
+    // Each value is hashed from its pixel and channel, independent of row order.
+    const auto noise = [](int x, int y, std::uint32_t channel) {
+        std::uint32_t n = static_cast<std::uint32_t>(x) * 374761393u;
+        n ^= static_cast<std::uint32_t>(y) * 668265263u;
+        n ^= (9u + channel * 0x9E3779B9u) * 2246822519u;
+        n = (n ^ (n >> 13)) * 1274126177u;
+        n ^= (n >> 16);
+        return static_cast<int>((static_cast<std::uint64_t>(n) * 257u) >> 32) - 128;
+    };
+    const auto expected = [&noise](int base, int x, int y, std::uint32_t channel) {
+        return std::clamp(static_cast<int>(std::lround(static_cast<float>(base) + 0.5f * static_cast<float>(noise(x, y, channel)))), 0, 255);
+    };
+    bool matches = true;
+    for (int y = 0; y < 70; ++y) {
+        for (int x = 0; x < 45; ++x) {
+            const PixelRGBA8 p = doc.layer(0).image().getPixel(x, y);
+            matches = matches && p.r == expected(100, x, y, 0) && p.g == expected(120, x, y, 1) &&
+                      p.b == expected(140, x, y, 2) && p.a == expected(160, x, y, 3);
+        }
+    }
+    require(matches, "noise-layer should hash each pixel and channel from the seed");
+
+    // Near-vertical strokes cross the 32-row bands the strokes are drawn in.
+    const ImageBuffer& strokes = doc.layer(1).image();
+    int crossings = 0;
+    for (int x = 0; x < 45; ++x) {
+        const bool above = strokes.getPixel(x, 31).r < 90;
+        const bool below = strokes.getPixel(x, 32).r < 90;
+        crossings += above && below ? 1 : 0;
+    }
+    require(crossings > 0, "pencil-strokes should draw across band boundaries");
+}
+
+void testRegionOpsMatchWholeLayerInsideTheRect() {
+    const std::string testOutDir = "build/output/test-images";
+    std::filesystem::create_directories(testOutDir);
+    const std::string basePath = testOutDir + "/region-base.iflow";
+    require(runCLIArgs({"image_flow", "ops", "--width", "70", "--height", "90", "--out", basePath,
+                        "--op", "add-layer name=A width=70 height=90 fill=90,110,130,255",
+                        "--op", "noise-layer path=/0 seed=5 amount=0.6",
+                        "--op", "gaussian-blur path=/0 radius=2",
+                        "--op", "mask-enable path=/0 fill=255,255,255,255"}) == 0,
+            "Building the region base document should succeed");
+    const Document base = loadDocumentIFLOW(basePath);
+
+    const std::vector<std::string> ops = {
+        "gaussian-blur path=/0 radius=4",
+        "gaussian-blur path=/0 radius=30 sigma=6",
+        "morphology path=/0 op=erode radius=2 iterations=2",
+        "morphology path=/0 op=dilate shape=line angle=45 radius=3",
+        "edge-detect path=/0 method=sobel",
+        "levels path=/0 in_black=20 gamma=1.3",
+        "apply-effect path=/0 effect=sepia",
+        "replace-color path=/0 from=90,110,130 to=200,40,40",
+        "fractal-noise path=/0 scale=9 monochrome=false",
+        "hatch path=/0 spacing=5",
+        "pencil-strokes path=/0 spacing=3 length=16 thickness=3",
+        "noise-layer path=/0 seed=2 amount=0.4",
+        "checker-layer path=/0 cell=7 offset_x=3",
+        "gradient-layer path=/0 type=radial center=20,30 radius=40",
+        "fill-layer path=/0 rgba=1,2,3,4",
+        "gaussian-blur path=/0 radius=3 target=mask"};
+    const int rx = 11;
+    const int ry = 37;
+    const int rw = 29;
+    const int rh = 40;
+    for (const std::string& op : ops) {
+        const std::string wholePath = testOutDir + "/region-whole.iflow";
+        const std::string regionPath = testOutDir + "/region-rect.iflow";
+        require(runCLIArgs({"image_flow", "ops", "--in", basePath, "--out", wholePath, "--op", op}) == 0,
+                op + " should succeed on the whole layer");
+        require(runCLIArgs({"image_flow", "ops", "--in", basePath, "--out", regionPath, "--op",
+                            op + " region=" + std::to_string(rx) + "," + std::to_string(ry) + "," + std::to_string(rw) + "," +
+                                std::to_string(rh)}) == 0,
+                op + " should succeed in a region");
+        const Document whole = loadDocumentIFLOW(wholePath);
+        const Document region = loadDocumentIFLOW(regionPath);
+        bool matches = true;
+        for (int y = 0; y < 90; ++y) {
+            for (int x = 0; x < 70; ++x) {
+                const bool inside = x >= rx && x < rx + rw && y >= ry && y < ry + rh;
+                const Layer& expected = inside ? whole.layer(0) : base.layer(0);
+                const PixelRGBA8 p = region.layer(0).image().getPixel(x, y);
+                const PixelRGBA8 q = expected.image().getPixel(x, y);
+                matches = matches && p.r == q.r && p.g == q.g && p.b == q.b && p.a == q.a &&
+                          region.layer(0).mask().coverage(x, y) == expected.mask().coverage(x, y);
+            }
+        }
+        require(matches, op + " with region= should match the whole-layer op inside the rect and nothing else");
+    }
+
+    // region=mask fades the result in by coverage.
+    const std::string maskedPath = testOutDir + "/region-mask.iflow";
+    require(runCLIArgs({"image_flow", "ops", "--width", "20", "--height", "10", "--out", maskedPath,
+                        "--op", "add-layer name=A width=20 height=10 fill=0,0,0,255",
+                        "--op", "mask-enable path=/0 fill=0,0,0,255",
+                        "--op", "mask-set-pixel path=/0 x=4 y=3 rgba=255,255,255,255",
+                        "--op", "mask-set-pixel path=/0 x=9 y=6 rgba=128,128,128,255",
+                        "--op", "fill-layer path=/0 rgba=255,255,255,255 region=mask"}) == 0,
+            "region=mask should succeed");
+    const Document masked = loadDocumentIFLOW(maskedPath);
+    require(masked.layer(0).image().getPixel(4, 3).r == 255 && masked.layer(0).image().getPixel(9, 6).r == 128 &&
+                masked.layer(0).image().getPixel(5, 3).r == 0,
+            "region=mask should fade results in by mask coverage");
+
+    // Rect edits only recomposite the tiles under the rect.
+    Document doc(64, 64);
+    doc.addLayer(Layer("Base", 64, 64, PixelRGBA8(20, 40, 60, 255)));
+    CompositeOptions options;
+    options.tileSize = 16;
+    CompositeCache cache;
+    doc.composite(options, cache);
+    doc.layer(0).imageInRect(20, 20, 4, 4).setPixel(21, 21, PixelRGBA8(255, 0, 0, 255));
+    doc.layer(0).imageInRect(40, 20, 2, 2).setPixel(40, 20, PixelRGBA8(0, 255, 0, 255));
+    require(buffersEqual(doc.composite(options, cache), doc.composite(options)), "Rect edits should show in the cached composite");
+    require(cache.lastTilesComposited() == 2, "Rect edits should only recomposite the tiles they touch");
+    doc.layer(0).image().setPixel(0, 0, PixelRGBA8(0, 0, 255, 255));
+    doc.layer(0).imageInRect(40, 40, 2, 2);
+    doc.composite(options, cache);
+    require(cache.lastTilesComposited() == 16, "A whole-layer edit should still recomposite the layer");
+}
+
+void testResampleFiltersMatchReferenceAndKeepAlpha() {
+    ImageBuffer source(37, 23);
+    for (int y = 0; y < 23; ++y) {
+        for (int x = 0; x < 37; ++x) {
+            source.setPixel(x, y, PixelRGBA8(static_cast<std::uint8_t>((x * 53 + y * 17) % 256), static_cast<std::uint8_t>((x * y * 7) % 256),
+                                             static_cast<std::uint8_t>(200 - x * 3), static_cast<std::uint8_t>(x < 9 ? 0 : 60 + y * 8)));
+        }
+    }
+
+    // Direct evaluation of the separable Lanczos3 filter, weighted by alpha,
+    // with taps past the edges folded onto the edge pixels.
+    const auto taps = [](int src, int dst, int i) {
+        const double scale = static_cast<double>(src) / dst;
+        const double stretch = std::max(1.0, scale);
+        const double center = (i + 0.5) * scale;
+        std::vector<double> weights(static_cast<std::size_t>(src), 0.0);
+        double total = 0.0;
+        for (int j = static_cast<int>(std::floor(center - 3.0 * stretch)) - 1; j <= static_cast<int>(std::ceil(center + 3.0 * stretch)); ++j) {
+            const double t = std::abs((j + 0.5 - center) / stretch);
+            const double pt = 3.14159265358979323846 * t;
+            const double w = t < 1.0e-9 ? 1.0 : (t >= 3.0 ? 0.0 : 3.0 * std::sin(pt) * std::sin(pt / 3.0) / (pt * pt));
+            weights[static_cast<std::size_t>(std::clamp(j, 0, src - 1))] += w;
+            total += w;
+        }
+        for (double& w : weights) {
+            w /= total;
+        }
+        return weights;
+    };
+    for (const auto& size : {std::pair<int, int>(14, 9), std::pair<int, int>(90, 41)}) {
+        const ImageBuffer out = resampleBuffer(source, size.first, size.second, 3, ResampleFilter::Lanczos3);
+        int worst = 0;
+        for (int y = 0; y < size.second; ++y) {
+            const std::vector<double> wy = taps(23, size.second, y);
+            for (int x = 0; x < size.first; ++x) {
+                const std::vector<double> wx = taps(37, size.first, x);
+                double sum[4] = {0.0, 0.0, 0.0, 0.0};
+                for (int sy = 0; sy < 23; ++sy) {
+                    for (int sx = 0; sx < 37; ++sx) {
+                        const PixelRGBA8 p = source.getPixel(sx, sy);
+                        const double a = p.a * wx[static_cast<std::size_t>(sx)] * wy[static_cast<std::size_t>(sy)];
+                        sum[0] += p.r * a;
+                        sum[1] += p.g * a;
+                        sum[2] += p.b * a;
+                        sum[3] += a;
+                    }
+                }
+                const PixelRGBA8 got = out.getPixel(x, y);
+                const auto channel = [](double v) { return static_cast<int>(std::lround(std::clamp(v, 0.0, 255.0))); };
+                worst = std::max(worst, std::abs(got.a - channel(sum[3])));
+                if (sum[3] >= 8.0 && got.a > 0) {
+                    for (int c = 0; c < 3; ++c) {
+                        const int value = c == 0 ? got.r : (c == 1 ? got.g : got.b);
+                        worst = std::max(worst, std::abs(value - channel(sum[c] / sum[3])));
+                    }
+                }
+            }
+        }
+        require(worst <= 1, "Lanczos3 resampling should match a direct evaluation of the filter");
+    }
+
+    // Every filter keeps a flat color flat.
+    const ImageBuffer flat(31, 17, PixelRGBA8(90, 140, 210, 255));
+    for (ResampleFilter filter : {ResampleFilter::Area, ResampleFilter::Nearest, ResampleFilter::Bilinear, ResampleFilter::Lanczos3,
+                                  ResampleFilter::Mitchell, ResampleFilter::CatmullRom}) {
+        for (const auto& size : {std::pair<int, int>(7, 5), std::pair<int, int>(64, 40)}) {
+            const ImageBuffer out = resampleBuffer(flat, size.first, size.second, 0, filter);
+            bool same = true;
+            for (int y = 0; y < size.second; ++y) {
+                for (int x = 0; x < size.first; ++x) {
+                    const PixelRGBA8 p = out.getPixel(x, y);
+                    same = same && p.r == 90 && p.g == 140 && p.b == 210 && p.a == 255;
+                }
+            }
+            require(same, "Resample filters should keep flat colors flat");
+        }
+    }
+    require(parseResampleFilter("catmull-rom") == ResampleFilter::CatmullRom && parseResampleFilter("box") == ResampleFilter::Area,
+            "Resample filter names should parse");
+
+    // resize-layer keeps alpha and resamples the mask with the pixels.
+    const std::string testOutDir = "build/output/test-images";
+    std::filesystem::create_directories(testOutDir);
+    const std::string path = testOutDir + "/resample-layer.iflow";
+    require(runCLIArgs({"image_flow", "ops", "--width", "40", "--height", "40", "--out", path,
+                        "--op", "add-layer name=A width=40 height=40 fill=10,20,30,100",
+                        "--op", "mask-enable path=/0 fill=255,255,255,255",
+                        "--op", "resize-layer path=/0 width=20 height=10 filter=mitchell"}) == 0,
+            "resize-layer with a kernel filter should succeed");
+    const Document resized = loadDocumentIFLOW(path);
+    const Layer& layer = resized.layer(0);
+    require(layer.image().width() == 20 && layer.image().getPixel(5, 5).a == 100 && layer.image().getPixel(5, 5).b == 30 &&
+                layer.hasMask() && layer.mask().coverage(19, 9) == 255,
+            "resize-layer should keep alpha and the mask");
+}
+
+void testDownscaledLayersSampleMipLevels() {
+    // A one-pixel checker shrunk to a quarter averages to grey instead of
+    // aliasing to whichever squares the pixel centers hit.
+    Layer checker("Checker", 64, 64, PixelRGBA8(0, 0, 0, 255));
+    for (int y = 0; y < 64; ++y) {
+        for (int x = 0; x < 64; ++x) {
+            if ((x + y) % 2 == 0) {
+                checker.image().setPixel(x, y, PixelRGBA8(255, 255, 255, 255));
+            }
+        }
+    }
+    Document doc(40, 40);
+    Layer& layer = doc.addLayer(checker);
+    layer.transform() = Transform2D::scaling(0.25, 0.25);
+    const auto greyInside = [](const ImageBuffer& out, int lo, int hi) {
+        bool grey = true;
+        for (int y = 0; y < 16; ++y) {
+            for (int x = 0; x < 16; ++x) {
+                const PixelRGBA8 p = out.getPixel(x, y);
+                grey = grey && p.r >= lo && p.r <= hi && p.a == 255;
+            }
+        }
+        return grey && out.getPixel(16, 16).a == 0;
+    };
+    require(greyInside(doc.composite(), 120, 136), "Downscaled layers should be filtered through mip levels");
+    layer.transform() = Transform2D::rotationRadians(0.3, 8.0, 8.0) * Transform2D::scaling(0.3, 0.3);
+    const ImageBuffer rotated = doc.composite();
+    require(rotated.getPixel(8, 8).r >= 120 && rotated.getPixel(8, 8).r <= 136, "Rotated downscales should be filtered too");
+
+    // Levels follow pixel edits but survive transform changes.
+    layer.transform() = Transform2D::scaling(0.25, 0.25);
+    const MipCache::Level* before = &layer.mipLevel(2);
+    layer.transform() = Transform2D::scaling(0.3, 0.3);
+    require(&layer.mipLevel(2) == before, "Transform changes should keep mip levels");
+    layer.image().fill(PixelRGBA8(255, 255, 255, 255));
+    require(layer.mipLevel(2).image.getPixel(3, 3).r == 255 && layer.mipLevel(2).image.width() == 16,
+            "Pixel edits should rebuild mip levels");
+
+    // Transparent pixels do not bleed their color into the average, and the
+    // mask is filtered alongside.
+    Layer halves("Halves", 32, 32, PixelRGBA8(255, 0, 0, 0));
+    for (int y = 0; y < 32; ++y) {
+        for (int x = 0; x < 32; x += 2) {
+            halves.image().setPixel(x, y, PixelRGBA8(0, 0, 255, 255));
+        }
+    }
+    halves.enableMask(PixelRGBA8(255, 255, 255, 255));
+    for (int x = 0; x < 32; ++x) {
+        halves.mask().setCoverage(x, 0, 0);
+    }
+    halves.transform() = Transform2D::scaling(0.125, 0.125);
+    Document alpha(4, 4);
+    alpha.addLayer(halves);
+    const PixelRGBA8 blue = alpha.composite().getPixel(1, 1);
+    require(blue.r == 0 && blue.b == 255 && blue.a >= 120 && blue.a <= 136, "Mip levels should weight colors by alpha");
+
+    // Cached composites still redo everything a rect edit reaches through
+    // the coarser level.
+    Layer base("Base", 256, 256, PixelRGBA8(20, 40, 60, 255));
+    base.transform() = Transform2D::scaling(0.2, 0.2);
+    Document cached(64, 64);
+    cached.addLayer(base);
+    CompositeOptions options;
+    options.tileSize = 8;
+    CompositeCache cache;
+    cached.composite(options, cache);
+    ImageBuffer& edited = cached.layer(0).imageInRect(112, 112, 6, 6);
+    for (int y = 112; y < 118; ++y) {
+        for (int x = 112; x < 118; ++x) {
+            edited.setPixel(x, y, PixelRGBA8(255, 255, 255, 255));
+        }
+    }
+    require(buffersEqual(cached.composite(options, cache), cached.composite(options)), "Rect edits should reach mip-sampled pixels");
+}
+
+void testColorLUTsLoadCubesAndBakeGrades() {
+    const std::string testOutDir = "build/output/test-images";
+    std::filesystem::create_directories(testOutDir);
+
+    // A two-point cube that inverts colors, with the usual header lines.
+    const std::string invertPath = testOutDir + "/invert.cube";
+    {
+        std::ofstream cube(invertPath);
+        cube << "# inverted\nTITLE \"Invert\"\nLUT_3D_SIZE 2\nDOMAIN_MIN 0 0 0\nDOMAIN_MAX 1 1 1\n\n";
+        for (int b = 1; b >= 0; --b) {
+            for (int g = 1; g >= 0; --g) {
+                for (int r = 1; r >= 0; --r) {
+                    cube << r << ".0 " << g << ".0 " << b << ".0\n";
+                }
+            }
+        }
+    }
+    const ColorLUT invert = loadCubeLUT(invertPath);
+    std::vector<PixelRGBA8> colors;
+    for (int i = 0; i < 4096; ++i) {
+        colors.emplace_back(static_cast<std::uint8_t>(i * 7), static_cast<std::uint8_t>(i * 13 + 5), static_cast<std::uint8_t>(i / 16), static_cast<std::uint8_t>(i));
+    }
+    std::vector<PixelRGBA8> inverted = colors;
+    invert.apply(inverted.data(), inverted.size());
+    bool exact = invert.size() == 2;
+    for (std::size_t i = 0; i < colors.size(); ++i) {
+        exact = exact && inverted[i].r == 255 - colors[i].r && inverted[i].g == 255 - colors[i].g && inverted[i].b == 255 - colors[i].b &&
+                inverted[i].a == colors[i].a;
+    }
+    require(exact, "Tetrahedral interpolation should reproduce a linear cube exactly and keep alpha");
+
+    // A saved cube reads back, and apply-lut matches it.
+    const std::string savedPath = testOutDir + "/invert-copy.cube";
+    require(saveCubeLUT(savedPath, invert, "copy") && loadCubeLUT(savedPath).values() == invert.values(), "Saved cubes should read back");
+    const std::string docPath = testOutDir + "/lut.iflow";
+    require(runCLIArgs({"image_flow", "ops", "--width", "16", "--height", "16", "--out", docPath,
+                        "--op", "add-layer name=A width=16 height=16 fill=10,200,90,128",
+                        "--op", "apply-lut path=/0 file=" + savedPath}) == 0,
+            "apply-lut should succeed");
+    const PixelRGBA8 applied = loadDocumentIFLOW(docPath).layer(0).image().getPixel(3, 3);
+    require(applied.r == 245 && applied.g == 55 && applied.b == 165 && applied.a == 128, "apply-lut should map the layer colors");
+
+    // Baked grades stay within a few levels of running the ops.
+    const std::vector<std::string> grade = {"levels in_black=12 in_white=235 gamma=1.2", "channel-mix rr=0.8 rg=0.2 bb=1.1",
+                                            "curves rgb=0,0;96,80;255,255"};
+    const std::string gradePath = testOutDir + "/grade.cube";
+    require(runCLIArgs({"image_flow", "bake-lut", "--out", gradePath, "--size", "33", "--op", grade[0], "--op", grade[1], "--op",
+                        grade[2]}) == 0,
+            "bake-lut should succeed");
+    Document direct(64, 64);
+    Layer& ramp = direct.addLayer(Layer("Ramp", 64, 64));
+    for (int y = 0; y < 64; ++y) {
+        for (int x = 0; x < 64; ++x) {
+            ramp.image().setPixel(x, y, PixelRGBA8(static_cast<std::uint8_t>(x * 4), static_cast<std::uint8_t>(y * 4), static_cast<std::uint8_t>((x * y) % 256), 255));
+        }
+    }
+    Document baked = direct;
+    for (const std::string& op : grade) {
+        applyDocumentOperation(direct, op + " path=/0", [](const std::string&, double) {});
+    }
+    applyDocumentOperation(baked, "apply-lut path=/0 file=" + gradePath, [](const std::string&, double) {});
+    int worst = 0;
+    for (int y = 0; y < 64; ++y) {
+        for (int x = 0; x < 64; ++x) {
+            const PixelRGBA8 a = direct.layer(0).image().getPixel(x, y);
+            const PixelRGBA8 b = baked.layer(0).image().getPixel(x, y);
+            worst = std::max({worst, std::abs(a.r - b.r), std::abs(a.g - b.g), std::abs(a.b - b.b)});
+        }
+    }
+    require(worst <= 4, "A baked 33^3 grade should track the ops it was baked from");
+
+    require(runCLIArgs({"image_flow", "bake-lut", "--out", gradePath, "--op", "gaussian-blur radius=2"}) != 0,
+            "bake-lut should reject ops that are not color ops");
+    const std::string flatPath = testOutDir + "/flat.cube";
+    {
+        std::ofstream cube(flatPath);
+        cube << "LUT_1D_SIZE 2\n0 0 0\n1 1 1\n";
+    }
+    bool rejected = false;
+    try {
+        loadCubeLUT(flatPath);
+    } catch (const std::runtime_error&) {
+        rejected = true;
+    }
+    require(rejected, "1D cubes should be rejected");
+
+    // replace-color looks its blend up by squared distance: colors within
+    // the tolerance take the target, colors past the soft band are kept.
+    Document replaced(64, 64);
+    replaced.addLayer(ramp);
+    applyDocumentOperation(replaced, "replace-color path=/0 from=120,128,0 to=20,60,200 tolerance=30 softness=50 preserve_luma=false",
+                           [](const std::string&, double) {});
+    bool banded = true;
+    for (int y = 0; y < 64; ++y) {
+        for (int x = 0; x < 64; ++x) {
+            const PixelRGBA8 src = ramp.image().getPixel(x, y);
+            const PixelRGBA8 got = replaced.layer(0).image().getPixel(x, y);
+            const int dist2 = (src.r - 120) * (src.r - 120) + (src.g - 128) * (src.g - 128) + src.b * src.b;
+            if (dist2 <= 30 * 30) {
+                banded = banded && got.r == 20 && got.g == 60 && got.b == 200;
+            } else if (dist2 >= 80 * 80) {
+                banded = banded && got.r == src.r && got.g == src.g && got.b == src.b;
+            }
+        }
+    }
+    require(banded, "replace-color should replace inside the tolerance and keep colors past the soft band");
+}
+
+void testSpanFloodFillMatchesPixelFloodFill() {
+    // A comb of walls with gaps gives runs that split and rejoin; each cell
+    // also gets a small color jitter so tolerance decides the region.
+    const int w = 97;
+    const int h = 61;
+    ImageBuffer image(w, h);
+    for (int y = 0; y < h; ++y) {
+        for (int x = 0; x < w; ++x) {
+            const bool wall = (x % 8 == 3 && (y + x) % 23 > 2) || (y % 9 == 4 && (x * 5 + y) % 17 > 3);
+            const std::uint8_t jitter = static_cast<std::uint8_t>((x * 7 + y * 13) % 5);
+            image.setPixel(x, y, wall ? PixelRGBA8(240, 240, 240, 255)
+                                      : PixelRGBA8(static_cast<std::uint8_t>(40 + jitter), 60, 80, static_cast<std::uint8_t>(200 + jitter * 10)));
+        }
+    }
+
+    // Reference: per-pixel breadth-first fill.
+    const auto reference = [w, h](const ImageBuffer& source, int sx, int sy, int tolerance, bool matchAlpha) {
+        const PixelRGBA8 seed = source.getPixel(sx, sy);
+        std::vector<std::uint8_t> inside(static_cast<std::size_t>(w * h), 0);
+        std::vector<std::pair<int, int>> queue = {{sx, sy}};
+        inside[static_cast<std::size_t>(sy * w + sx)] = 1;
+        for (std::size_t i = 0; i < queue.size(); ++i) {
+            const int offsets[4][2] = {{1, 0}, {-1, 0}, {0, 1}, {0, -1}};
+            for (const auto& offset : offsets) {
+                const int nx = queue[i].first + offset[0];
+                const int ny = queue[i].second + offset[1];
+                if (nx < 0 || ny < 0 || nx >= w || ny >= h || inside[static_cast<std::size_t>(ny * w + nx)] != 0) {
+                    continue;
+                }
+                const PixelRGBA8 p = source.getPixel(nx, ny);
+                const int diff = std::max({std::abs(p.r - seed.r), std::abs(p.g - seed.g), std::abs(p.b - seed.b),
+                                           matchAlpha ? std::abs(p.a - seed.a) : 0});
+                if (diff <= tolerance) {
+                    inside[static_cast<std::size_t>(ny * w + nx)] = 1;
+                    queue.push_back({nx, ny});
+                }
+            }
+        }
+        return inside;
+    };
+
+    const PixelRGBA8 fill(250, 10, 10, 255);
+    struct Case {
+        int tolerance;
+        bool matchAlpha;
+    };
+    for (const Case& c : {Case{0, false}, Case{4, false}, Case{4, true}, Case{4 * 10, true}}) {
+        ImageBuffer filled = image;
+        const std::size_t count = floodFill(filled, 10, 10, fill, c.tolerance, c.matchAlpha);
+        const std::vector<std::uint8_t> expected = reference(image, 10, 10, c.tolerance, c.matchAlpha);
+        bool same = count == static_cast<std::size_t>(std::count(expected.begin(), expected.end(), 1));
+        for (int y = 0; y < h; ++y) {
+            for (int x = 0; x < w; ++x) {
+                const PixelRGBA8 p = filled.getPixel(x, y);
+                const PixelRGBA8 q = expected[static_cast<std::size_t>(y * w + x)] != 0 ? fill : image.getPixel(x, y);
+                same = same && p.r == q.r && p.g == q.g && p.b == q.b && p.a == q.a;
+            }
+        }
+        require(same, "Span flood fill should fill the same region as a per-pixel fill");
+    }
+
+    // Drawable goes through the Image interface with the same spans.
+    PNGImage png(w, h, Color(0, 0, 0));
+    for (int y = 0; y < h; ++y) {
+        for (int x = 0; x < w; ++x) {
+            const PixelRGBA8 p = image.getPixel(x, y);
+            png.setPixel(x, y, Color(p.r, p.g, p.b));
+        }
+    }
+    Drawable drawable(png);
+    drawable.floodFill(10, 10, Color(250, 10, 10), 4);
+    const std::vector<std::uint8_t> expected = reference(image, 10, 10, 4, false);
+    bool drawn = true;
+    for (int y = 0; y < h; ++y) {
+        for (int x = 0; x < w; ++x) {
+            drawn = drawn && (png.getPixel(x, y).r == 250) == (expected[static_cast<std::size_t>(y * w + x)] != 0);
+        }
+    }
+    require(drawn, "Drawable::floodFill should fill the connected region");
+
+    MaskBuffer mask(32, 32, 0);
+    for (int y = 0; y < 32; ++y) {
+        mask.setCoverage(16, y, 255);
+    }
+    require(floodFill(mask, 3, 3, 128) == 16 * 32 && mask.coverage(15, 31) == 128 && mask.coverage(16, 5) == 255 &&
+                mask.coverage(17, 5) == 0,
+            "Mask flood fill should stop at coverage edges");
+    require(floodFill(mask, 3, 3, 128) == 0, "Flooding with the seed's own value should change nothing");
+
+    // The op fills mask coverage directly.
+    const std::string testOutDir = "build/output/test-images";
+    std::filesystem::create_directories(testOutDir);
+    const std::string docPath = testOutDir + "/flood-mask.iflow";
+    require(runCLIArgs({"image_flow", "ops", "--width", "16", "--height", "16", "--out", docPath,
+                        "--op", "add-layer name=A width=16 height=16 fill=0,0,0,255",
+                        "--op", "mask-enable path=/0 fill=0,0,0,255",
+                        "--op", "draw-line path=/0 target=mask x0=8 y0=0 x1=8 y1=15 rgba=255,255,255,255",
+                        "--op", "draw-flood-fill path=/0 target=mask x=2 y=2 rgba=255,255,255,128"}) == 0,
+            "draw-flood-fill target=mask should succeed");
+    const Document flooded = loadDocumentIFLOW(docPath);
+    const MaskBuffer& floodedMask = flooded.layer(0).maskOrThrow();
+    require(floodedMask.coverage(2, 2) == MaskBuffer::coverageFromPixel(PixelRGBA8(255, 255, 255, 128)) && floodedMask.coverage(12, 2) == 0,
+            "draw-flood-fill target=mask should fill coverage up to the line");
+}
+
+void testWideStrokesFillOutlinePolygons() {
+    const auto lit = [](const PNGImage& image, int x, int y) { return image.getPixel(x, y).r == 255; };
+
+    // A diagonal wide line covers exactly the pixels near its centerline,
+    // with no gaps between rows.
+    PNGImage diagonal(64, 64, Color(0, 0, 0));
+    Drawable d(diagonal);
+    d.setLineWidth(7);
+    d.beginPath();
+    d.moveTo(8.0f, 10.0f);
+    d.lineTo(55.0f, 50.0f);
+    d.stroke(Color(255, 255, 255));
+    const float dx = 47.0f;
+    const float dy = 40.0f;
+    const float length = std::hypot(dx, dy);
+    bool banded = true;
+    for (int y = 0; y < 64; ++y) {
+        for (int x = 0; x < 64; ++x) {
+            const float along = ((x - 8.0f) * dx + (y - 10.0f) * dy) / length;
+            const float across = std::fabs((x - 8.0f) * dy - (y - 10.0f) * dx) / length;
+            if (along < 0.5f || along > length - 0.5f) {
+                continue;
+            }
+            if (across < 3.0f) {
+                banded = banded && lit(diagonal, x, y);
+            } else if (across > 4.0f) {
+                banded = banded && !lit(diagonal, x, y);
+            }
+        }
+    }
+    require(banded, "Wide diagonal strokes should fill their band without gaps or spill");
+    require(!lit(diagonal, 4, 7), "Butt caps should end at the endpoints");
+
+    // A right-angle turn: miters fill the outer corner, bevels cut it.
+    const auto corner = [](Drawable::LineJoin join, float miterLimit) {
+        PNGImage image(40, 40, Color(0, 0, 0));
+        Drawable stroke(image);
+        stroke.setLineWidth(10);
+        stroke.setLineJoin(join);
+        stroke.setMiterLimit(miterLimit);
+        stroke.beginPath();
+        stroke.moveTo(5.0f, 20.0f);
+        stroke.lineTo(20.0f, 20.0f);
+        stroke.lineTo(20.0f, 35.0f);
+        stroke.stroke(Color(255, 255, 255));
+        return image;
+    };
+    const PNGImage miter = corner(Drawable::LineJoin::Miter, 10.0f);
+    const PNGImage bevel = corner(Drawable::LineJoin::Bevel, 10.0f);
+    const PNGImage limited = corner(Drawable::LineJoin::Miter, 1.2f);
+    const PNGImage round = corner(Drawable::LineJoin::Round, 10.0f);
+    require(lit(miter, 24, 16) && !lit(miter, 26, 14), "Miter joins should square off the outer corner");
+    require(!lit(bevel, 24, 16) && lit(bevel, 22, 18), "Bevel joins should cut the outer corner");
+    require(!lit(limited, 24, 16), "Miters past the limit should fall back to bevels");
+    require(lit(round, 23, 17) && !lit(round, 24, 16), "Round joins should round the outer corner");
+    require(!lit(miter, 14, 26), "Joins should leave the inside of the turn alone");
+
+    // Caps on an open horizontal stroke.
+    const auto capped = [](Drawable::LineCap cap) {
+        PNGImage image(40, 20, Color(0, 0, 0));
+        Drawable stroke(image);
+        stroke.setLineWidth(8);
+        stroke.setLineCap(cap);
+        stroke.beginPath();
+        stroke.moveTo(10.0f, 10.0f);
+        stroke.lineTo(30.0f, 10.0f);
+        stroke.stroke(Color(255, 255, 255));
+        return image;
+    };
+    const PNGImage butt = capped(Drawable::LineCap::Butt);
+    const PNGImage square = capped(Drawable::LineCap::Square);
+    const PNGImage roundCap = capped(Drawable::LineCap::Round);
+    require(lit(butt, 10, 7) && !lit(butt, 9, 10), "Butt caps should stop at the endpoint");
+    require(lit(square, 6, 6) && !lit(square, 5, 10), "Square caps should extend by half the width");
+    require(lit(roundCap, 7, 10) && !lit(roundCap, 7, 7), "Round caps should be half discs");
+}
+
+void testScanlineRasterizerCoverageAndFillRules() {
+    ScanlineRasterizer rasterizer;
+    const auto coverageOf = [&rasterizer](std::vector<RasterEdge> edges, FillRule rule, bool antialias) {
+        std::vector<float> coverage(64 * 64, 0.0f);
+        ScanlineRasterizer::sortEdges(edges.data(), edges.size());
+        rasterizer.rasterize(edges.data(), edges.size(), rule, antialias ? RasterSampling::Coverage : RasterSampling::Centers, 0, 64, 0, 64, [&coverage](int y, const std::vector<CoverageSpan>& spans) {
+            for (const CoverageSpan& span : spans) {
+                for (int x = span.x; x < span.x + span.length; ++x) {
+                    coverage[static_cast<std::size_t>(y * 64 + x)] += span.coverage;
+                }
+            }
+        });
+        return coverage;
+    };
+    const auto at = [](const std::vector<float>& coverage, int x, int y) { return coverage[static_cast<std::size_t>(y * 64 + x)]; };
+
+    std::vector<RasterEdge> square;
+    addPolygonEdges(square, std::vector<std::pair<double, double>>{{10.25, 10.0}, {20.75, 10.0}, {20.75, 20.0}, {10.25, 20.0}});
+    const std::vector<float> smooth = coverageOf(square, FillRule::NonZero, true);
+    require(std::fabs(at(smooth, 10, 15) - 0.75f) < 1e-4f && std::fabs(at(smooth, 20, 15) - 0.75f) < 1e-4f && at(smooth, 15, 15) == 1.0f &&
+                at(smooth, 9, 15) == 0.0f && at(smooth, 15, 20) == 0.0f,
+            "Antialiased edges should cover the exact fraction of their pixels");
+    const std::vector<float> sharp = coverageOf(square, FillRule::NonZero, false);
+    require(at(sharp, 10, 10) == 1.0f && at(sharp, 20, 19) == 1.0f && at(sharp, 21, 15) == 0.0f && at(sharp, 15, 20) == 0.0f,
+            "Aliased fills should take the pixels whose centers are inside");
+
+    // Total coverage of a many-sided disc tracks its area.
+    std::vector<std::pair<double, double>> disc;
+    for (int i = 0; i < 200; ++i) {
+        const double angle = 6.283185307179586 * i / 200.0;
+        disc.push_back({32.3 + 20.0 * std::cos(angle), 31.7 + 20.0 * std::sin(angle)});
+    }
+    std::vector<RasterEdge> discEdges;
+    addPolygonEdges(discEdges, disc);
+    const std::vector<float> discCoverage = coverageOf(discEdges, FillRule::NonZero, true);
+    double area = 0.0;
+    for (float c : discCoverage) {
+        area += c;
+    }
+    require(std::fabs(area - 3.14159265 * 400.0) < 4.0, "Antialiased coverage should add up to the shape's area");
+
+    // Two squares wound the same way overlap: nonzero fills the overlap,
+    // even-odd leaves it empty.
+    std::vector<RasterEdge> pair;
+    addPolygonEdges(pair, std::vector<std::pair<int, int>>{{4, 4}, {24, 4}, {24, 24}, {4, 24}});
+    addPolygonEdges(pair, std::vector<std::pair<int, int>>{{14, 14}, {34, 14}, {34, 34}, {14, 34}});
+    require(at(coverageOf(pair, FillRule::NonZero, false), 18, 18) == 1.0f && at(coverageOf(pair, FillRule::EvenOdd, false), 18, 18) == 0.0f &&
+                at(coverageOf(pair, FillRule::EvenOdd, false), 8, 8) == 1.0f,
+            "Fill rules should decide overlapping contours");
+
+    // Drawable fills blend edge pixels when antialiased.
+    PNGImage image(40, 40, Color(0, 0, 0));
+    Drawable drawable(image);
+    drawable.setAntialias(true);
+    drawable.fillCircle(20, 20, 12, Color(255, 255, 255));
+    int blended = 0;
+    for (int y = 0; y < 40; ++y) {
+        for (int x = 0; x < 40; ++x) {
+            const int value = image.getPixel(x, y).r;
+            blended += value > 0 && value < 255 ? 1 : 0;
+        }
+    }
+    require(image.getPixel(20, 20).r == 255 && image.getPixel(1, 1).r == 0 && blended > 40, "Antialiased circles should blend their rims");
+
+    PNGImage holes(30, 30, Color(0, 0, 0));
+    Drawable path(holes);
+    path.setFillRule(FillRule::EvenOdd);
+    path.beginPath();
+    path.moveTo(2.0f, 2.0f);
+    path.lineTo(27.0f, 2.0f);
+    path.lineTo(27.0f, 27.0f);
+    path.lineTo(2.0f, 27.0f);
+    path.closePath();
+    path.moveTo(10.0f, 10.0f);
+    path.lineTo(19.0f, 10.0f);
+    path.lineTo(19.0f, 19.0f);
+    path.lineTo(10.0f, 19.0f);
+    path.closePath();
+    path.fillPath(Color(255, 0, 0));
+    require(holes.getPixel(5, 5).r == 255 && holes.getPixel(14, 14).r == 0, "fillPath should fill subpaths together by the fill rule");
+}
+
+void testNativeDrawTargetsBlendSourceOver() {
+    // Translucent paint blends source-over onto opaque and clear pixels.
+    ImageBuffer image(8, 8, PixelRGBA8(0, 0, 255, 255));
+    image.setPixel(7, 7, PixelRGBA8(0, 0, 0, 0));
+    image.setPixel(6, 7, PixelRGBA8(0, 0, 255, 128));
+    BufferDrawable over(BufferTarget(image, 128));
+    over.fillRect(0, 0, 8, 8, Color(255, 0, 0));
+    const PixelRGBA8 tinted = image.getPixel(2, 2);
+    const PixelRGBA8 clear = image.getPixel(7, 7);
+    require(tinted.r == 128 && tinted.g == 0 && tinted.b == 127 && tinted.a == 255, "Over should tint opaque pixels by the paint alpha");
+    require(clear.r == 255 && clear.g == 0 && clear.b == 0 && clear.a == 128, "Over onto a clear pixel should take the paint as is");
+    require(image.getPixel(6, 7).a == 192, "Over should combine translucent alphas");
+
+    BufferDrawable copy(BufferTarget(image, 128, BufferTarget::Blend::Copy));
+    copy.fillCircle(4, 4, 2, Color(0, 255, 0));
+    const PixelRGBA8 copied = image.getPixel(4, 4);
+    require(copied.r == 0 && copied.g == 255 && copied.b == 0 && copied.a == 128, "Copy should replace pixels with the paint");
+
+    // Outlines blend each pixel once, including shared vertices and mirrored
+    // circle points.
+    ImageBuffer outlines(32, 32, PixelRGBA8(0, 0, 0, 255));
+    BufferDrawable pen(BufferTarget(outlines, 128));
+    pen.polyline({{1, 1}, {12, 1}, {12, 12}}, Color(255, 255, 255));
+    pen.polygon({{1, 20}, {10, 20}, {5, 28}}, Color(255, 255, 255));
+    pen.rect(16, 2, 10, 8, Color(255, 255, 255));
+    pen.circle(22, 22, 6, Color(255, 255, 255));
+    pen.ellipse(22, 22, 8, 5, Color(255, 255, 255));
+    bool once = true;
+    for (int y = 0; y < 32; ++y) {
+        for (int x = 0; x < 32; ++x) {
+            const int r = outlines.getPixel(x, y).r;
+            // The circle and ellipse cross, so those pixels may take two coats.
+            once = once && (r == 0 || r == 128 || (x >= 14 && y >= 14));
+        }
+    }
+    require(once && outlines.getPixel(12, 1).r == 128 && outlines.getPixel(16, 2).r == 128 && outlines.getPixel(1, 20).r == 128,
+            "Connected outlines should paint each pixel once");
+
+    // Mask targets store luma times alpha and mix antialiased edges.
+    MaskBuffer mask(16, 16, 0);
+    MaskDrawable maskPen(MaskTarget(mask, 128));
+    maskPen.fillRect(0, 0, 8, 16, Color(255, 255, 255));
+    maskPen.setAntialias(true);
+    maskPen.fillPolygon({{8, 0}, {16, 0}, {8, 16}}, Color(255, 255, 255));
+    const int painted = MaskBuffer::coverageFromPixel(PixelRGBA8(255, 255, 255, 128));
+    require(mask.coverage(3, 3) == painted && mask.coverage(15, 15) == 0, "Mask targets should paint coverage");
+    bool edged = false;
+    for (int x = 8; x < 16; ++x) {
+        edged = edged || (mask.coverage(x, 8) > 0 && mask.coverage(x, 8) < painted);
+    }
+    require(edged, "Antialiased mask edges should mix toward the painted coverage");
+
+    // Draw ops go through the layer targets; blend=copy keeps replacing.
+    const std::string testOutDir = "build/output/test-images";
+    std::filesystem::create_directories(testOutDir);
+    const std::string docPath = testOutDir + "/draw-blend.iflow";
+    require(runCLIArgs({"image_flow", "ops", "--width", "8", "--height", "8", "--out", docPath,
+                        "--op", "add-layer name=A width=8 height=8 fill=0,0,255,255",
+                        "--op", "draw-fill-rect path=/0 x=0 y=0 width=4 height=8 rgba=255,0,0,128",
+                        "--op", "draw-fill-rect path=/0 x=4 y=0 width=4 height=8 rgba=255,0,0,128 blend=copy"}) == 0,
+            "Translucent draw ops should succeed");
+    const Document drawn = loadDocumentIFLOW(docPath);
+    const PixelRGBA8 blended = drawn.layer(0).image().getPixel(1, 1);
+    const PixelRGBA8 replaced = drawn.layer(0).image().getPixel(6, 1);
+    require(blended.r == 128 && blended.b == 127 && blended.a == 255, "draw ops should blend translucent rgba source-over");
+    require(replaced.r == 255 && replaced.b == 0 && replaced.a == 128, "blend=copy should replace the pixels");
+}
+
+void testDisplayListTilesMatchOneByOne() {
+    // Large enough to replay by tiles; translucent overlaps and blend=copy
+    // show any change in order.
+    ImageBuffer direct(1100, 700, PixelRGBA8(10, 20, 30, 255));
+    BufferDrawable pen(BufferTarget(direct, 160));
+    DisplayList list;
+    list.setAlpha(160);
+    pen.fillRect(-20, 40, 900, 300, Color(200, 40, 40));
+    list.fillRect(-20, 40, 900, 300, Color(200, 40, 40));
+    pen.setAntialias(true);
+    list.setAntialias(true);
+    pen.fillPolygon({{100, 600}, {1050, 20}, {700, 690}}, Color(40, 200, 90));
+    list.fillPolygon({{100, 600}, {1050, 20}, {700, 690}}, Color(40, 200, 90));
+    pen.setLineWidth(9);
+    list.setLineWidth(9);
+    pen.setLineJoin(LineJoin::Round);
+    list.setLineJoin(LineJoin::Round);
+    const auto strokePath = [](auto& target) {
+        target.beginPath();
+        target.moveTo(30.0f, 30.0f);
+        target.bezierCurveTo(600.0f, -100.0f, 400.0f, 800.0f, 1080.0f, 650.0f);
+        target.lineTo(200.0f, 500.0f);
+        target.stroke(Color(250, 250, 20));
+    };
+    strokePath(pen);
+    strokePath(list);
+    pen.target().setBlend(BufferTarget::Blend::Copy);
+    list.setBlend(BufferTarget::Blend::Copy);
+    pen.fillCircle(520, 360, 140, Color(0, 0, 255));
+    list.fillCircle(520, 360, 140, Color(0, 0, 255));
+    pen.ellipse(300, 300, 250, 120, Color(255, 255, 255));
+    list.ellipse(300, 300, 250, 120, Color(255, 255, 255));
+    ImageBuffer tiled(1100, 700, PixelRGBA8(10, 20, 30, 255));
+    list.replay(tiled, 4);
+    ImageBuffer single(1100, 700, PixelRGBA8(10, 20, 30, 255));
+    list.replay(single, 1);
+    require(list.size() == 5, "Display lists should record one command per primitive");
+    require(buffersEqual(direct, tiled) && buffersEqual(direct, single), "Display list replays should match drawing one by one");
+
+    MaskBuffer directMask(1100, 700, 40);
+    MaskDrawable maskPen(MaskTarget(directMask, 200));
+    maskPen.setAntialias(true);
+    maskPen.fillEllipse(550, 350, 500, 300, Color(255, 255, 255));
+    maskPen.fillRect(0, 0, 1100, 100, Color(0, 0, 0));
+    DisplayList maskList;
+    maskList.setAlpha(200);
+    maskList.setAntialias(true);
+    maskList.fillEllipse(550, 350, 500, 300, Color(255, 255, 255));
+    maskList.fillRect(0, 0, 1100, 100, Color(0, 0, 0));
+    MaskBuffer tiledMask(1100, 700, 40);
+    maskList.replay(tiledMask, 4);
+    bool sameMask = true;
+    for (int y = 0; y < 700; ++y) {
+        for (int x = 0; x < 1100; ++x) {
+            sameMask = sameMask && tiledMask.coverage(x, y) == directMask.coverage(x, y);
+        }
+    }
+    require(sameMask, "Mask display list replays should match drawing one by one");
+
+    // Consecutive draw ops batch up, and draw-batch reads them from a file;
+    // both match the same draws made one by one.
+    const std::string testOutDir = "build/output/test-images";
+    std::filesystem::create_directories(testOutDir);
+    const std::vector<std::string> draws = {
+        "draw-fill-rect x=-5 y=10 width=600 height=200 rgba=200,40,40,160",
+        "draw-line x0=0 y0=0 x1=599 y1=399 rgba=255,255,255,200 line_width=7 cap=round",
+        "draw-fill-circle cx=300 cy=200 radius=150 rgba=0,0,255,128 antialias=true",
+        "draw-rect x=20 y=20 width=500 height=300 rgba=0,255,0,255 blend=copy",
+    };
+    const std::string batchPath = testOutDir + "/draw-batch.txt";
+    {
+        std::ofstream batch(batchPath);
+        batch << "# one list, one replay\n";
+        for (const std::string& draw : draws) {
+            batch << draw << "\n";
+        }
+    }
+    std::vector<std::string> inlineArgs = {"image_flow", "ops", "--width", "600", "--height", "400", "--out", testOutDir + "/draw-inline.iflow",
+                                           "--op", "add-layer name=A width=600 height=400 fill=10,20,30,255"};
+    for (const std::string& draw : draws) {
+        inlineArgs.push_back("--op");
+        inlineArgs.push_back(draw.substr(0, draw.find(' ')) + " path=/0" + draw.substr(draw.find(' ')));
+    }
+    require(runCLIArgs(inlineArgs) == 0, "Consecutive draw ops should succeed");
+    require(runCLIArgs({"image_flow", "ops", "--width", "600", "--height", "400", "--out", testOutDir + "/draw-batch.iflow",
+                        "--op", "add-layer name=A width=600 height=400 fill=10,20,30,255",
+                        "--op", "draw-batch path=/0 file=" + batchPath}) == 0,
+            "draw-batch should succeed");
+    ImageBuffer expected(600, 400, PixelRGBA8(10, 20, 30, 255));
+    BufferDrawable expectedPen(BufferTarget(expected, 160));
+    expectedPen.fillRect(-5, 10, 600, 200, Color(200, 40, 40));
+    BufferDrawable lineWidePen(BufferTarget(expected, 200));
+    lineWidePen.setLineWidth(7);
+    lineWidePen.setLineCap(LineCap::Round);
+    lineWidePen.beginPath();
+    lineWidePen.moveTo(0.0f, 0.0f);
+    lineWidePen.lineTo(599.0f, 399.0f);
+    lineWidePen.stroke(Color(255, 255, 255));
+    BufferDrawable circlePen(BufferTarget(expected, 128));
+    circlePen.setAntialias(true);
+    circlePen.fillCircle(300, 200, 150, Color(0, 0, 255));
+    BufferDrawable rectPen(BufferTarget(expected, 255, BufferTarget::Blend::Copy));
+    rectPen.rect(20, 20, 500, 300, Color(0, 255, 0));
+    require(buffersEqual(loadDocumentIFLOW(testOutDir + "/draw-inline.iflow").layer(0).image(), expected),
+            "Batched draw ops should match drawing them one by one");
+    require(buffersEqual(loadDocumentIFLOW(testOutDir + "/draw-batch.iflow").layer(0).image(), expected),
+            "draw-batch should match drawing its ops one by one");
+
+    {
+        std::ofstream batch(batchPath);
+        batch << "draw-fill path=/0 rgba=0,0,0,255\n";
+    }
+    require(runCLIArgs({"image_flow", "ops", "--width", "8", "--height", "8", "--out", testOutDir + "/draw-batch-bad.iflow",
+                        "--op", "add-layer name=A width=8 height=8",
+                        "--op", "draw-batch path=/0 file=" + batchPath}) != 0,
+            "draw-batch lines should not name their own layer");
+}
+
+void testGeneratorLayersStayParametric() {
+    // Whole-layer generator ops keep parameters; region= renders them now.
+    // Both must composite and reload to the same pixels.
+    const std::string testOutDir = "build/output/test-images";
+    std::filesystem::create_directories(testOutDir);
+    const auto run = [&](const std::string& name, const std::string& region) {
+        const std::string path = testOutDir + "/" + name + ".iflow";
+        require(runCLIArgs({"image_flow", "ops", "--width", "160", "--height", "120", "--out", path,
+                            "--op", "add-layer name=Bg width=160 height=120 fill=40,50,60,255",
+                            "--op", "gradient-layer path=/0 type=radial center=70,50 radius=90 from=250,240,10,255 to=10,20,200,255" + region,
+                            "--op", "noise-layer path=/0 seed=5 amount=0.4" + region,
+                            "--op", "add-layer name=Grid width=90 height=70 fill=0,0,0,0",
+                            "--op", "checker-layer path=/1 cell=7 offset_x=3 a=255,0,0,180 b=0,255,0,60" + region,
+                            "--op", "mask-enable path=/1 fill=0,0,0,255",
+                            "--op", "draw-fill-circle path=/1 cx=45 cy=35 radius=30 rgba=255,255,255,255 target=mask",
+                            "--op", "set-transform path=/1 rotate=20 translate=40,10"}) == 0,
+                "Generator ops should succeed");
+        return path;
+    };
+    const std::string lazyPath = run("generated-lazy", "");
+    const std::string bakedPath = run("generated-baked", " region=0,0,160,120");
+    Document lazy = loadDocumentIFLOW(lazyPath);
+    const Document baked = loadDocumentIFLOW(bakedPath);
+    require(imageGenerator(lazy.layer(0).image()) && imageGenerator(lazy.layer(1).image()) && !imageGenerator(baked.layer(0).image()),
+            "Whole-layer generator ops should reload as generators");
+    require(std::filesystem::file_size(lazyPath) < std::filesystem::file_size(bakedPath) / 4,
+            "Generated layers should be stored as their parameters");
+    require(buffersEqual(lazy.composite(), baked.composite()), "Generated layers should composite like rendered pixels");
+    const Document& lazyView = lazy;
+    require(!lazyView.layer(0).image().resident(), "Compositing should not render whole generated layers");
+    require(buffersEqual(lazyView.layer(0).image(), baked.layer(0).image()), "Reading generated rows should render every pixel");
+
+    // The first write bakes the pixels and keeps the rest.
+    ImageBuffer& pixels = lazy.layer(0).image();
+    pixels.setPixel(3, 4, PixelRGBA8(1, 2, 3, 4));
+    require(!imageGenerator(pixels) && pixels.getPixel(5, 5).r == baked.layer(0).image().getPixel(5, 5).r,
+            "Writing generated pixels should bake them");
+}
+
+void testOpProgramParsesBeforeRunning() {
+    const std::string testOutDir = "build/output/test-images";
+    std::filesystem::create_directories(testOutDir);
+    // A bad op late in the script fails it before earlier ops run.
+    const std::string earlyPath = testOutDir + "/program-early.png";
+    const std::string failedPath = testOutDir + "/program-failed.iflow";
+    std::filesystem::remove(earlyPath);
+    std::ostringstream errors;
+    std::streambuf* original = std::cerr.rdbuf(errors.rdbuf());
+    const int status = runCLIArgs({"image_flow", "ops", "--width", "8", "--height", "8", "--out", failedPath,
+                                   "--op", "add-layer name=A fill=1,2,3,255",
+                                   "--op", "emit file=" + earlyPath,
+                                   "--op", "set-pixel path=/0 x=1 y=1 rgba=9,9,9,255",
+                                   "--op", "set-pixel path=/0 x=2 rgba=9,9,9,255"});
+    std::cerr.rdbuf(original);
+    require(status != 0 && errors.str().find("op[3]") != std::string::npos, "Parse errors should name their op");
+    require(!std::filesystem::exists(earlyPath) && !std::filesystem::exists(failedPath), "Parse errors should stop the script before any op runs");
+
+    // Runs of pixel writes match writing them one by one, and one out of
+    // bounds still fails as its own op.
+    Document direct(16, 12);
+    direct.addLayer(Layer("A", 16, 12, PixelRGBA8(10, 20, 30, 255)));
+    Document batched = direct;
+    std::vector<CompiledOp> program;
+    for (int i = 0; i < 40; ++i) {
+        const std::string coords = " x=" + std::to_string((i * 7) % 16) + " y=" + std::to_string((i * 5) % 12);
+        program.push_back(compileOp("set-pixel path=/0" + coords + " rgba=" + std::to_string(i * 6) + ",1,2,255"));
+    }
+    for (int i = 0; i < 20; ++i) {
+        program.push_back(compileOp("mask-set-pixel path=/0 x=" + std::to_string(i % 16) + " y=3 rgba=0,0,0," + std::to_string(i * 12)));
+    }
+    program.push_back(compileOp("mask-set-pixel path=/0 x=99 y=3 rgba=0,0,0,0"));
+    for (const CompiledOp& op : program) {
+        if (op.x < 16) {
+            applyDocumentOperation(direct, op, [](const std::string&, double) {});
+        }
+    }
+    require(applyPixelOps(batched, program, 0) == 40 && applyPixelOps(batched, program, 40) == 60,
+            "Pixel runs should end where the op or an out of bounds write changes");
+    require(applyPixelOps(batched, program, 60) == 60, "A lone pixel write should run by itself");
+    bool masksMatch = true;
+    for (int x = 0; x < 16; ++x) {
+        masksMatch = masksMatch && direct.layer(0).mask().coverage(x, 3) == batched.layer(0).mask().coverage(x, 3);
+    }
+    require(buffersEqual(direct.layer(0).image(), batched.layer(0).image()) && masksMatch,
+            "Batched pixel writes should match writing them one by one");
+}
+
+void testServeKeepsDocumentsResident() {
+    const std::string testOutDir = "build/output/test-images";
+    std::filesystem::create_directories(testOutDir);
+    const std::string socketPath = testOutDir + "/serve.sock";
+    const std::string projectPath = testOutDir + "/serve.iflow";
+    std::filesystem::remove(projectPath);
+    int status = -1;
+    std::thread server([&]() { status = runCLIArgs({"image_flow", "serve", "--socket", socketPath}); });
+
+    const auto connectClient = [&]() {
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        std::memcpy(address.sun_path, socketPath.data(), socketPath.size());
+        for (int attempt = 0; attempt < 500; ++attempt) {
+            const int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+            if (::connect(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) == 0) {
+                return fd;
+            }
+            ::close(fd);
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        throw std::runtime_error("serve did not start listening");
+    };
+    // Returns the payload; ok tells whether the reply was "ok".
+    const auto request = [](int fd, const std::string& payload, bool& ok) {
+        const std::string frame = std::to_string(payload.size()) + "\n" + payload;
+        require(::write(fd, frame.data(), frame.size()) == static_cast<ssize_t>(frame.size()), "Requests should be written");
+        std::string header;
+        char c = 0;
+        while (::read(fd, &c, 1) == 1 && c != '\n') {
+            header.push_back(c);
+        }
+        const std::size_t space = header.find(' ');
+        require(space != std::string::npos, "Replies should start with a status and a count");
+        ok = header.substr(0, space) == "ok";
+        std::string reply(std::stoul(header.substr(space + 1)), '\0');
+        std::size_t at = 0;
+        while (at < reply.size()) {
+            const ssize_t count = ::read(fd, &reply[at], reply.size() - at);
+            require(count > 0, "Replies should arrive in full");
+            at += static_cast<std::size_t>(count);
+        }
+        return reply;
+    };
+
+    bool ok = false;
+    int client = connectClient();
+    request(client, "new name=doc width=24 height=16 file=" + projectPath, ok);
+    require(ok, "serve should create documents");
+    request(client, "ops name=doc\nadd-layer name=Bg fill=10,20,30,255\nset-pixel path=/0 x=3 y=2 rgba=250,0,0,255", ok);
+    require(ok, "serve should run op batches");
+    const std::string failure = request(client, "ops name=doc\nset-pixel path=/0 x=4 y=2 rgba=0,250,0,255\nbogus-op", ok);
+    require(!ok && failure.find("op[1]") != std::string::npos, "Bad ops should be reported with their index");
+    ::close(client);
+
+    // Documents stay open across connections, and renders reply with the
+    // encoded image.
+    client = connectClient();
+    const std::string png = request(client, "render name=doc format=png", ok);
+    const std::string renderPath = testOutDir + "/serve-render.png";
+    std::ofstream(renderPath, std::ios::binary) << png;
+    const ImageBuffer rendered = decodeImageFile(renderPath);
+    require(ok && rendered.width() == 24 && rendered.getPixel(3, 2).r == 250 && rendered.getPixel(4, 2).g == 20,
+            "Renders should stream the resident document, without the rejected batch");
+    request(client, "nonsense", ok);
+    require(!ok, "Unknown requests should fail without stopping the server");
+    request(client, "quit", ok);
+    ::close(client);
+    server.join();
+
+    require(ok && status == 0 && !std::filesystem::exists(socketPath), "quit should stop the server and remove its socket");
+    const Document saved = loadDocumentIFLOW(projectPath);
+    require(saved.layer(0).image().getPixel(3, 2).r == 250, "quit should save changed documents");
+}
+
+void testIndependentOpsMatchSerialOrder() {
+    // Ops on different layers run concurrently; ops on one layer keep
+    // their order, structure ops end the run.
+    Document serial(96, 64);
+    for (int i = 0; i < 3; ++i) {
+        serial.addLayer(Layer("L" + std::to_string(i), 96, 64, PixelRGBA8(static_cast<std::uint8_t>(60 * i), 90, 200, 255)));
+    }
+    Document scheduled = serial;
+    const std::vector<std::string> specs = {
+        "gaussian-blur path=/0 radius=2",
+        "noise-layer path=/1 seed=9 amount=0.5",
+        "draw-fill-circle path=/2 cx=40 cy=30 radius=20 rgba=255,0,0,255",
+        "levels path=/1 in_black=20 in_white=230",
+        "gamma path=/1 value=1.3",
+        "draw-fill-rect path=/0 x=4 y=4 width=30 height=20 rgba=0,255,0,200",
+        "mask-enable path=/2 fill=255,255,255,255",
+        "draw-fill-rect path=/2 x=0 y=0 width=20 height=64 rgba=0,0,0,255 target=mask",
+        "set-pixel path=/0 x=1 y=1 rgba=1,2,3,255",
+        "edge-detect path=/0 method=sobel",
+        "add-layer name=Barrier",
+        "gaussian-blur path=/1 radius=1",
+    };
+    std::vector<CompiledOp> program;
+    for (const std::string& spec : specs) {
+        program.push_back(compileOp(spec));
+    }
+    for (std::size_t i = 0; i < 10; ++i) {
+        applyDocumentOperation(serial, program[i], [](const std::string&, double) {});
+    }
+    require(applyIndependentOps(scheduled, program, 0, 4) == 10, "Independent ops should run up to the structure op");
+    require(applyIndependentOps(scheduled, program, 10, 4) == 10 && applyIndependentOps(scheduled, program, 11, 4) == 11,
+            "Structure ops and ops on one layer should run by themselves");
+    for (std::size_t i = 0; i < 3; ++i) {
+        require(buffersEqual(serial.layer(i).image(), scheduled.layer(i).image()), "Scheduled ops should match serial order");
+    }
+    require(scheduled.layer(2).hasMask() && scheduled.layer(2).mask().coverage(5, 5) == serial.layer(2).mask().coverage(5, 5),
+            "Scheduled mask ops should match serial order");
+
+    // The lowest failing op is reported, wherever its layer ran.
+    std::vector<CompiledOp> failing;
+    for (const char* spec : {"gaussian-blur path=/0 radius=1", "set-pixel path=/1 x=1 y=1 rgba=1,1,1,255",
+                             "draw-fill-rect path=/1 x=0 y=0 width=4 height=4 rgba=1,2,3,255 blend=bogus",
+                             "set-pixel path=/0 x=500 y=1 rgba=1,1,1,255"}) {
+        failing.push_back(compileOp(spec));
+    }
+    bool reported = false;
+    try {
+        applyIndependentOps(scheduled, failing, 0, 4);
+    } catch (const OpRunError& ex) {
+        reported = ex.index() == 2;
+    }
+    require(reported, "The first failing op should be reported");
+
+    // With rollback a failure leaves the document as the serial run does:
+    // ops before it applied, ops after it on other layers not.
+    // The blur keeps the failing lane busy while the other one runs ahead.
+    Document partial(512, 512);
+    partial.addLayer(Layer("A", 512, 512, PixelRGBA8(0, 0, 0, 255)));
+    partial.addLayer(Layer("B", 512, 512, PixelRGBA8(0, 0, 0, 255)));
+    std::vector<CompiledOp> stopping;
+    for (const char* spec : {"fill-layer path=/0 rgba=0,200,0,255", "gaussian-blur path=/0 radius=24",
+                             "set-pixel path=/0 x=9999 y=0 rgba=1,1,1,255", "fill-layer path=/1 rgba=200,0,0,255"}) {
+        stopping.push_back(compileOp(spec));
+    }
+    std::size_t failedIndex = 0;
+    try {
+        applyIndependentOps(partial, stopping, 0, 4, true);
+    } catch (const OpRunError& ex) {
+        failedIndex = ex.index();
+    }
+    const Document& partialView = partial;
+    require(failedIndex == 2 && partialView.layer(0).image().getPixel(3, 3).g == 200,
+            "Ops before the failing one should stay applied");
+    require(partialView.layer(1).image().getPixel(3, 3).r == 0, "Ops after the failing one should be rolled back");
+}
+
+void testProfileRecordsOpSpans() {
+    const std::string testOutDir = "build/output/test-images";
+    std::filesystem::create_directories(testOutDir);
+    const std::string tracePath = testOutDir + "/profile-trace.json";
+    const std::string renderPath = testOutDir + "/profile-render.png";
+    std::filesystem::remove(tracePath);
+    std::ostringstream summary;
+    std::streambuf* original = std::cerr.rdbuf(summary.rdbuf());
+    const int status = runCLIArgs({"image_flow", "ops", "--width", "64", "--height", "48", "--out",
+                                   testOutDir + "/profile.iflow", "--render", renderPath, "--profile", tracePath,
+                                   "--op", "add-layer name=A fill=10,20,30,255",
+                                   "--op", "add-layer name=B fill=200,10,10,128",
+                                   "--op", "gaussian-blur path=/1 radius=2",
+                                   "--op", "gamma path=/0 value=1.2 region=2,3,10,5"});
+    std::cerr.rdbuf(original);
+    require(status == 0, "Profiled ops should succeed");
+    require(!profilingEnabled(), "Profiling should end with the command");
+    require(summary.str().find("op[2] gaussian-blur") != std::string::npos, "Profile summary should list ops by index");
+
+    std::ifstream in(tracePath);
+    const std::string trace((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    require(trace.find("\"traceEvents\"") != std::string::npos && trace.find("\"ph\": \"X\"") != std::string::npos,
+            "Profile trace should hold complete trace events");
+    require(trace.find("\"name\": \"op[3] gamma\", \"cat\": \"op\", \"ph\": \"X\"") != std::string::npos,
+            "Profile trace should hold op spans");
+    require(trace.find("\"name\": \"/1 B\"") != std::string::npos, "Profile trace should hold composite node spans");
+    require(trace.find("\"cat\": \"encode\"") != std::string::npos, "Profile trace should hold encode spans");
+    // The region op touches only its 10x5 rect of the layer.
+    const std::size_t regionSpan = trace.find("op[3] gamma");
+    require(trace.find("\"pixels\": 50,", regionSpan) < trace.find('\n', regionSpan), "Op spans should count the pixels they edit");
+
+    // Rows are worker slots, not threads, so they stay below --threads
+    // however many parallel loops start workers.
+    const std::string threadedTracePath = testOutDir + "/profile-threaded.json";
+    std::streambuf* quiet = std::cerr.rdbuf(summary.rdbuf());
+    const int threadedStatus = runCLIArgs({"image_flow", "ops", "--width", "96", "--height", "64", "--out", testOutDir + "/profile-threaded.iflow",
+                                           "--profile", threadedTracePath, "--threads", "4",
+                                           "--op", "add-layer name=A fill=10,20,30,255",
+                                           "--op", "add-layer name=B fill=200,10,10,128",
+                                           "--op", "gaussian-blur path=/0 radius=3",
+                                           "--op", "gaussian-blur path=/1 radius=3",
+                                           "--op", "emit file=" + testOutDir + "/profile-threaded.png"});
+    std::cerr.rdbuf(quiet);
+    require(threadedStatus == 0, "Threaded profiled ops should succeed");
+    std::ifstream threadedIn(threadedTracePath);
+    const std::string threadedTrace((std::istreambuf_iterator<char>(threadedIn)), std::istreambuf_iterator<char>());
+    bool slotRows = true;
+    for (std::size_t at = threadedTrace.find("\"tid\": "); at != std::string::npos; at = threadedTrace.find("\"tid\": ", at + 1)) {
+        const int row = std::stoi(threadedTrace.substr(at + 7));
+        slotRows = slotRows && row % 1000 < 4;
+    }
+    require(slotRows, "Profile trace rows should follow worker slots");
+
+    // Spans are not recorded without --profile.
+    takeProfileEvents();
+    {
+        ProfileScope scope("op", "ignored");
+        require(!scope.active(), "Spans should be inactive without profiling");
+    }
+    require(takeProfileEvents().empty(), "Inactive spans should record nothing");
+}
+
+void testMemoryBudgetSpillsColdLayers() {
+    Document doc(32, 16);
+    for (int i = 0; i < 4; ++i) {
+        Layer& layer = doc.addLayer(Layer("L" + std::to_string(i), 32, 16, PixelRGBA8(0, 0, 0, 255)));
+        for (int y = 0; y < 16; ++y) {
+            for (int x = 0; x < 32; ++x) {
+                layer.image().setPixel(x, y, PixelRGBA8(static_cast<std::uint8_t>(x * 8 + i), static_cast<std::uint8_t>(y * 16), 7, 255));
+            }
+        }
+    }
+    const Document& view = doc;
+    const std::size_t layerBytes = 32 * 16 * sizeof(PixelRGBA8);
+    const ImageBuffer before = doc.composite();
+    const ImageBuffer firstPixels = view.layer(0).image();
+    MemoryUsage usage = documentMemoryUsage(doc);
+    require(usage.full == 4 * layerBytes && usage.pixels == 4 * layerBytes, "Edited layers should be fully resident");
+
+    // A copied layer shares its pixels and is counted once.
+    doc.addLayer(view.layer(3));
+    require(documentMemoryUsage(doc).pixels == 4 * layerBytes, "Shared planes should be counted once");
+
+    SpillFile spill;
+    const Layer* newest = &view.layer(4);
+    const std::size_t freed = enforceMemoryBudget(doc, 2 * layerBytes, spill, {newest});
+    usage = documentMemoryUsage(doc);
+    require(freed > 0 && usage.resident() <= 2 * layerBytes, "Budget should free cold layers");
+    require(spill.bytesWritten() > 0, "Edited layers without a source should spill");
+    require(layerMemoryUsage(*newest).pixels == layerBytes, "Kept layers should stay resident");
+    require(layerMemoryUsage(view.layer(0)).pixels == 0, "The least recently edited layer should go first");
+    require(usage.full == 4 * layerBytes, "Spilled layers should still count their full size");
+
+    require(std::memcmp(view.layer(0).image().data(), firstPixels.data(), layerBytes) == 0, "Spilled pixels should read back unchanged");
+    const ImageBuffer after = doc.composite();
+    require(std::memcmp(after.data(), before.data(), layerBytes) == 0, "Spilling should not change the composite");
+
+    // --max-memory is an alias; bad values name the flag that was typed.
+    require(parseCompositeOptions({"--max-memory", "3"}).memoryBudget == (std::size_t{3} << 20), "--max-memory should set the budget");
+    std::string aliasError;
+    try {
+        parseCompositeOptions({"--max-memory", "3x"});
+    } catch (const std::runtime_error& error) {
+        aliasError = error.what();
+    }
+    require(aliasError.find("max-memory") != std::string::npos, "Budget errors should name the flag that was typed");
+}
+
+void testProxyCompositeRendersAtScale() {
+    // A quarter-size proxy matches compositing each layer shrunk by a
+    // quarter onto a quarter-size document.
+    LayerGenerator ramp;
+    ramp.kind = LayerGenerator::Kind::LinearGradient;
+    ramp.from = PixelRGBA8(250, 10, 10, 255);
+    ramp.to = PixelRGBA8(10, 10, 250, 255);
+    ramp.x1 = 256.0;
+    Layer background("Ramp", 256, 192);
+    background.image() = generatedImage(256, 192, ramp);
+    Layer checker("Checker", 128, 96, PixelRGBA8(0, 0, 0, 255));
+    for (int y = 0; y < 96; ++y) {
+        for (int x = 0; x < 128; x += 2) {
+            checker.image().setPixel(x + y % 2, y, PixelRGBA8(255, 255, 255, 255));
+        }
+    }
+    checker.setOffset(40, 30);
+    checker.transform() = Transform2D::rotationRadians(0.2, 64.0, 48.0);
+    Document doc(256, 192);
+    doc.addLayer(background);
+    doc.addLayer(checker);
+    Document shrunk(64, 48);
+    for (std::size_t i = 0; i < 2; ++i) {
+        Layer& layer = shrunk.addLayer(static_cast<const Document&>(doc).layer(i));
+        layer.setOffset(0, 0);
+        layer.transform() = Transform2D::scaling(0.25, 0.25) * Transform2D::translation(doc.layer(i).offsetX(), doc.layer(i).offsetY()) *
+                            doc.layer(i).transform();
+    }
+    CompositeOptions options;
+    options.scale = 0.25;
+    const ImageBuffer proxy = doc.composite(options);
+    require(proxy.width() == 64 && proxy.height() == 48, "Proxy composites should be output sized");
+    require(buffersEqual(proxy, shrunk.composite()), "Proxy composites should shrink every layer through the root transform");
+    const PixelRGBA8 grey = proxy.getPixel(30, 25);
+    require(grey.r >= 110 && grey.r <= 146 && grey.r == grey.b, "Proxy composites should sample mip levels");
+    require(!static_cast<const Document&>(doc).layer(0).image().resident(), "Proxy composites should sample gradients without rendering them");
+
+    // Streaming and cached composites follow the scale, and a cache redoes
+    // everything when the scale changes.
+    ImageBuffer streamed(64, 48);
+    doc.compositeRows(options, [&](int y, const ConstImageView& rows) {
+        for (int r = 0; r < rows.height(); ++r) {
+            std::memcpy(streamed.data() + static_cast<std::size_t>(y + r) * 64, rows.row(r), 64 * sizeof(PixelRGBA8));
+        }
+    });
+    require(buffersEqual(streamed, proxy), "Streamed proxies should match");
+    CompositeCache cache;
+    options.tileSize = 32;
+    require(buffersEqual(doc.composite(options, cache), proxy), "Cached proxies should match");
+    doc.composite(options, cache);
+    require(cache.lastTilesComposited() == 0, "Unchanged proxies should reuse the cache");
+    options.scale = 0.5;
+    require(doc.composite(options, cache).width() == 128 && cache.lastTilesComposited() == 12, "Scale changes should recomposite fully");
+
+    // render --scale/--max-size and emit scale= write proxy sized files.
+    const std::string testOutDir = "build/output/test-images";
+    std::filesystem::create_directories(testOutDir);
+    const std::string projectPath = testOutDir + "/proxy.iflow";
+    require(runCLIArgs({"image_flow", "ops", "--width", "200", "--height", "100", "--out", projectPath,
+                        "--op", "add-layer name=A fill=10,20,30,255",
+                        "--op", "emit file=" + testOutDir + "/proxy-emit.png scale=0.5"}) == 0,
+            "Proxy emits should succeed");
+    require(decodeImageFile(testOutDir + "/proxy-emit.png").width() == 100, "emit scale= should shrink the output");
+    require(runCLIArgs({"image_flow", "render", "--in", projectPath, "--out", testOutDir + "/proxy-fit.png", "--max-size", "50x50"}) == 0,
+            "Bounded renders should succeed");
+    const ImageBuffer fitted = decodeImageFile(testOutDir + "/proxy-fit.png");
+    require(fitted.width() == 50 && fitted.height() == 25, "--max-size should fit the document inside the box");
+    require(runCLIArgs({"image_flow", "render", "--in", projectPath, "--out", testOutDir + "/proxy-scaled.jpg", "--scale", "0.1"}) == 0 &&
+                decodeImageFile(testOutDir + "/proxy-scaled.jpg").width() == 20,
+            "--scale should shrink every target");
+}
+
+void testNestedParallelLoopsShareThreads() {
+    // Loops inside a worker get its share of the threads, so a tree of
+    // nested loops never runs more threads than the outermost one asked for.
+    std::vector<int> shares(2, 0);
+    std::vector<int> slots(2, -1);
+    parallelForWorkers(2, 4, [&](int index, int worker) {
+        int origin = 0;
+        parallelThreadPosition(origin, slots[static_cast<std::size_t>(worker)]);
+        shares[static_cast<std::size_t>(index)] = resolveThreadCount(16) + 10 * parallelWorkerCount(8, 16);
+    });
+    require(shares[0] == 22 && shares[1] == 22, "Two workers of four threads should each get two");
+    require(slots[0] == 0 && (slots[1] == -1 || slots[1] == 2), "Workers should get disjoint thread slots");
+
+    std::atomic<int> running(0);
+    std::atomic<int> peak(0);
+    parallelFor(4, 4, [&](int) {
+        parallelFor(8, 8, [&](int) {
+            const int now = running.fetch_add(1) + 1;
+            int seen = peak.load();
+            while (now > seen && !peak.compare_exchange_weak(seen, now)) {
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+            running.fetch_sub(1);
+        });
+    });
+    require(peak.load() <= 4, "Nested loops should stay within the outer thread count");
+    require(resolveThreadCount(3) == 3, "Counts outside loops should be unchanged");
+}
+
+void testAliasedPolygonFillsKeepEdgeColumns() {
+    // Aliased integer polygons fill ceil(x0)..floor(x1) inclusive, so a quad
+    // or round rect over the same box spans the same columns as a rect.
+    const std::string testOutDir = "build/output/test-images";
+    std::filesystem::create_directories(testOutDir);
+    const auto columns = [&testOutDir](const std::string& op, int row) {
+        const std::string path = testOutDir + "/aliased-columns.png";
+        require(runCLIArgs({"image_flow", "ops", "--width", "96", "--height", "64", "--out", testOutDir + "/aliased-columns.iflow",
+                            "--op", "add-layer name=A fill=0,0,0,255", "--op", op, "--op", "emit file=" + path}) == 0,
+                "Aliased fill ops should succeed");
+        const ImageBuffer image = decodeImageFile(path);
+        int first = -1;
+        int last = -1;
+        for (int x = 0; x < image.width(); ++x) {
+            if (image.getPixel(x, row).r == 255) {
+                first = first < 0 ? x : first;
+                last = x;
+            }
+        }
+        return std::make_pair(first, last);
+    };
+    const auto rect = columns("draw-fill-rect path=/0 x=10 y=5 width=60 height=40 rgba=255,255,255,255", 20);
+    require(rect == std::make_pair(10, 69), "draw-fill-rect should cover x..x+width-1");
+    require(columns("draw-fill-polygon path=/0 points=10,5;69,5;69,44;10,44 rgba=255,255,255,255", 20) == rect,
+            "draw-fill-polygon should keep its rightmost column");
+    require(columns("draw-fill-round-rect path=/0 x=10 y=5 width=60 height=40 radius=8 rgba=255,255,255,255", 20) == rect,
+            "draw-fill-round-rect should span the same columns as draw-fill-rect");
+    require(columns("draw-fill-polygon path=/0 points=10,5;60,40;10,40 rgba=255,255,255,255", 39) == std::make_pair(10, 59),
+            "Slanted edges should keep the last column they reach");
+}
+
+void testCannyKeepsTiedMaximaSymmetric() {
+    // The small ellipse has neighbors with exactly equal gradients. Integer
+    // magnitudes keep both sides of such a tie, so the edges mirror the
+    // shape; the old float Canny dropped these three pixels.
+    const std::string testOutDir = "build/output/test-images";
+    std::filesystem::create_directories(testOutDir);
+    const std::string projectPath = testOutDir + "/canny-ties.iflow";
+    require(runCLIArgs({"image_flow", "ops", "--width", "26", "--height", "40", "--out", projectPath,
+                        "--op", "add-layer name=A width=26 height=40 fill=0,0,0,255",
+                        "--op", "draw-fill-ellipse path=/0 cx=12 cy=23 rx=3 ry=3 rgba=0,40,64,255",
+                        "--op", "edge-detect path=/0 method=canny"}) == 0,
+            "Canny tie script should succeed");
+    const Document document = loadDocumentIFLOW(projectPath);
+    const ImageBuffer& canny = document.layer(0).image();
+    require(canny.getPixel(9, 24).r == 255 && canny.getPixel(14, 21).r == 255 && canny.getPixel(15, 24).r == 255,
+            "Canny should keep both pixels of an exact gradient tie");
+    bool mirrored = true;
+    for (int y = 0; y < 40; ++y) {
+        for (int x = 0; x <= 24; ++x) {
+            mirrored = mirrored && canny.getPixel(x, y).r == canny.getPixel(24 - x, y).r;
+        }
+    }
+    require(mirrored, "Canny edges of a mirrored shape should be mirrored");
+}
+
+void testIFLOWLoadsLayersLazily() {
+    const std::string testOutDir = "build/output/test-images";
+    std::filesystem::create_directories(testOutDir);
+
+    Document doc(64, 48);
+    doc.addLayer(Layer("Base", 64, 48, PixelRGBA8(20, 40, 60, 255)));
+    doc.addLayer(Layer("Top", 32, 16, PixelRGBA8(200, 10, 10, 180)));
+    doc.layer(0).image().setPixel(60, 40, PixelRGBA8(9, 9, 9, 255));
+    doc.layer(1).setOffset(8, 4);
+    doc.layer(1).image().setPixel(3, 2, PixelRGBA8(1, 2, 3, 4));
+    doc.layer(1).ensureMask().setCoverage(5, 5, 77);
+    const std::string path = testOutDir + "/lazy.iflow";
+    require(saveDocumentIFLOW(doc, path), "Saving a lazily loadable IFLOW document should succeed");
+
+    Document loaded = loadDocumentIFLOW(path);
+    require(loaded.layerCount() == 2 && loaded.layer(1).offsetX() == 8, "Lazy IFLOW load should restore the layer tree");
+    require(!loaded.layer(0).image().resident() && !loaded.layer(1).image().resident() &&
+                !loaded.layer(1).mask().resident(),
+            "Lazy IFLOW load should not decode pixels up front");
+
+    // Untouched planes are copied through without being decoded.
+    const std::string copyPath = testOutDir + "/lazy-copy.iflow";
+    require(saveDocumentIFLOW(loaded, copyPath), "Resaving a lazily loaded IFLOW document should succeed");
+    require(!loaded.layer(0).image().resident() && !loaded.layer(1).mask().resident(),
+            "Resaving should copy untouched planes without decoding them");
+
+    const Document copy = loadDocumentIFLOW(copyPath);
+    require(copy.layer(1).image().getPixel(3, 2).a == 4 && copy.layer(1).image().resident(),
+            "Reading a lazy image pixel should fault the plane in");
+    require(!copy.layer(0).image().resident(), "Faulting one plane in should leave the others mapped");
+    require(copy.layer(1).mask().coverage(5, 5) == 77, "Copied-through mask chunks should decode");
+    require(buffersEqual(copy.composite(), doc.composite()), "Lazy layers should composite like the originals");
+    require(copy.layer(0).image().resident(), "Compositing should fault visible layers in");
+
+    loaded.layer(0).image().setPixel(0, 0, PixelRGBA8(9, 9, 9, 255));
+    require(loaded.layer(0).image().pixelSource() == nullptr && loaded.layer(0).image().getPixel(1, 0).r == 20,
+            "Writing a lazy plane should load it and drop its source");
+    require(saveDocumentIFLOW(loaded, path), "Saving over the mapped source file should succeed");
+    const Document edited = loadDocumentIFLOW(path);
+    require(edited.layer(0).image().getPixel(0, 0).r == 9 && edited.layer(1).mask().coverage(5, 5) == 77,
+            "Saving over the mapped file should keep both edited and copied planes");
+}
+
+void testIFLOWIncrementalSaveAppendsChanges() {
+    const std::string testOutDir = "build/output/test-images";
+    std::filesystem::create_directories(testOutDir);
+
+    Document doc(200, 120);
+    doc.addLayer(Layer("Base", 200, 120, PixelRGBA8(20, 40, 60, 255)));
+    doc.addLayer(Layer("Top", 200, 120, PixelRGBA8(200, 10, 10, 180)));
+    for (int x = 0; x < 200; ++x) {
+        doc.layer(0).image().setPixel(x, x % 120, PixelRGBA8(static_cast<std::uint8_t>(x), 7, 9, 255));
+    }
+    const std::string path = testOutDir + "/incremental.iflow";
+    require(saveDocumentIFLOW(doc, path), "Saving an IFLOW document for incremental updates should succeed");
+    const std::uintmax_t fullSize = std::filesystem::file_size(path);
+
+    {
+        Document loaded = loadDocumentIFLOW(path);
+        loaded.layer(1).setOpacity(0.25f);
+        require(saveDocumentIFLOW(loaded, path), "Incremental metadata save should succeed");
+        require(!loaded.layer(0).image().resident(), "Incremental metadata save should not decode pixels");
+    }
+    const std::uintmax_t appendedSize = std::filesystem::file_size(path);
+    require(appendedSize > fullSize && appendedSize - fullSize < 1024,
+            "Metadata-only incremental save should append only a new tree block");
+    {
+        Document loaded = loadDocumentIFLOW(path);
+        require(loaded.layer(1).opacity() == 0.25f && buffersEqual(loaded.layer(0).image(), doc.layer(0).image()),
+                "Incremental save should publish the new tree over unchanged chunks");
+        loaded.layer(1).image().setPixel(4, 4, PixelRGBA8(1, 2, 3, 4));
+        require(saveDocumentIFLOW(loaded, path), "Incremental pixel save should succeed");
+    }
+    {
+        const Document loaded = loadDocumentIFLOW(path);
+        require(loaded.layer(1).image().getPixel(4, 4).a == 4 && loaded.layer(1).opacity() == 0.25f,
+                "Incremental save should append rewritten planes");
+    }
+
+    // Tear the slot the last save published: the previous tree must win.
+    {
+        std::fstream file(path, std::ios::binary | std::ios::in | std::ios::out);
+        file.seekp(16 + 5);
+        file.put(static_cast<char>(0x5A));
+    }
+    {
+        Document loaded = loadDocumentIFLOW(path);
+        require(loaded.layer(1).image().getPixel(4, 4).a == 180 && loaded.layer(1).opacity() == 0.25f,
+                "A torn superblock should fall back to the previous save");
+        IFLOWSaveOptions options;
+        options.incremental = false;
+        require(saveDocumentIFLOW(loaded, path, options), "Compacting an IFLOW document should succeed");
+    }
+    require(std::filesystem::file_size(path) < appendedSize, "Compaction should drop chunks no tree references");
+    require(loadDocumentIFLOW(path).layer(1).opacity() == 0.25f, "Compaction should keep the current tree");
+}
+
+void testIFLOWDeduplicatesPlanesAndKeepsSolidFills() {
+    const std::string testOutDir = "build/output/test-images";
+    std::filesystem::create_directories(testOutDir);
+
+    Document doc(400, 300);
+    doc.addLayer(Layer("Solid", 400, 300, PixelRGBA8(10, 20, 30, 255)));
+    PixelRGBA8 color;
+    require(doc.layer(0).image().trySolidColor(color) && color.g == 20, "Filled layers should stay solid");
+    doc.composite();
+    require(doc.layer(0).image().trySolidColor(color) && !doc.layer(0).image().resident(),
+            "Compositing a solid layer should not expand its pixels");
+
+    Layer pattern("Pattern", 400, 300, PixelRGBA8(0, 0, 0, 0));
+    for (int y = 0; y < 300; ++y) {
+        for (int x = 0; x < 400; ++x) {
+            pattern.image().setPixel(x, y, PixelRGBA8(static_cast<std::uint8_t>(x * 7 + y), static_cast<std::uint8_t>(y * 3),
+                                                      static_cast<std::uint8_t>(x ^ y), 255));
+        }
+    }
+    pattern.enableMask(PixelRGBA8(255, 255, 255, 128));
+    for (int i = 0; i < 4; ++i) {
+        Layer copy = pattern;
+        if (i % 2 == 1) {
+            // Equal content in separate storage must be found by hashing.
+            copy.image().setPixel(0, 0, PixelRGBA8(0, 0, 0, 255));
+            copy.image().setPixel(0, 0, pattern.image().getPixel(0, 0));
+        }
+        doc.addLayer(std::move(copy));
+    }
+    const std::string path = testOutDir + "/deduplicated.iflow";
+    require(saveDocumentIFLOW(doc, path), "Saving duplicated layers should succeed");
+
+    const std::string singlePath = testOutDir + "/deduplicated-single.iflow";
+    Document single(400, 300);
+    single.addLayer(pattern);
+    require(saveDocumentIFLOW(single, singlePath), "Saving one patterned layer should succeed");
+    require(std::filesystem::file_size(path) < std::filesystem::file_size(singlePath) + 1024,
+            "Identical layers and solid planes should not add pixel chunks");
+
+    const Document loaded = loadDocumentIFLOW(path);
+    require(loaded.layer(0).image().trySolidColor(color) && color.b == 30, "Solid planes should load as solid");
+    std::uint8_t coverage = 0;
+    require(loaded.layer(1).mask().trySolidCoverage(coverage) && coverage == 128,
+            "Solid masks should load as solid");
+    for (int i = 2; i <= 4; ++i) {
+        require(loaded.layer(i).image().sharesPixelsWith(loaded.layer(1).image()),
+                "Identical planes should load into one shared buffer");
+    }
+    require(buffersEqual(loaded.layer(3).image(), pattern.image()), "Deduplicated planes should keep their pixels");
+    require(buffersEqual(loaded.composite(), doc.composite()), "Deduplicated documents should composite identically");
+}
+
+void testCompositeRowsStreamsWithinMemoryBudget() {
+    const std::string testOutDir = "build/output/test-images";
+    std::filesystem::create_directories(testOutDir);
+
+    Document doc(300, 260);
+    const PixelRGBA8 fills[4] = {PixelRGBA8(200, 0, 0, 255), PixelRGBA8(0, 200, 0, 255), PixelRGBA8(0, 0, 200, 160),
+                                 PixelRGBA8(90, 90, 90, 255)};
+    for (int i = 0; i < 4; ++i) {
+        Layer tile("Tile", 150, 130, fills[i]);
+        tile.setOffset((i % 2) * 150, (i / 2) * 130);
+        tile.image().setPixel(i, 7, PixelRGBA8(1, 2, 3, 255));
+        doc.addLayer(std::move(tile));
+    }
+    const std::string path = testOutDir + "/streamed.iflow";
+    require(saveDocumentIFLOW(doc, path), "Saving a tiled IFLOW document should succeed");
+    const Document loaded = loadDocumentIFLOW(path);
+
+    CompositeOptions options;
+    options.tileSize = 64;
+    options.threads = 2;
+    options.memoryBudget = 1;
+    ImageBuffer stitched(300, 260);
+    int nextRow = 0;
+    loaded.compositeRows(options, [&](int y, const ConstImageView& rows) {
+        require(y == nextRow && rows.width() == 300 && rows.height() == std::min(64, 260 - y),
+                "compositeRows should deliver bands top to bottom");
+        for (int r = 0; r < rows.height(); ++r) {
+            for (int x = 0; x < rows.width(); ++x) {
+                stitched.setPixel(x, y + r, rows.at(x, r));
+            }
+        }
+        nextRow += rows.height();
+    });
+    require(nextRow == 260 && buffersEqual(stitched, doc.composite()), "Streamed bands should match the full composite");
+    require(!loaded.layer(0).image().resident() && !loaded.layer(1).image().resident() &&
+                loaded.layer(3).image().resident(),
+            "A memory budget should release layers earlier bands used");
+
+    const std::string pngPath = testOutDir + "/streamed.png";
+    {
+        PNGStreamWriter writer(pngPath, 300, 260);
+        loaded.compositeRows(options, [&writer](int, const ConstImageView& rows) {
+            writer.writeRows(pixelRows(rows));
+        });
+        writer.finish();
+    }
+    const PNGImage png = PNGImage::load(pngPath);
+    const PixelRGBA8 expected = stitched.getPixel(201, 140);
+    require(png.width() == 300 && png.height() == 260 && png.getPixel(0, 7).r == 1 &&
+                png.getPixel(201, 140).r == expected.r && png.getPixel(201, 140).b == expected.b,
+            "Streamed PNG should decode to the composite");
+}
+
+void testIFLOWCompressedChunksRoundtripAndLegacyLoad() {
+    const std::string testOutDir = "build/output/test-images";
+    std::filesystem::create_directories(testOutDir);
+
+    const int width = 300;
+    const int height = 700;
+    Document doc(width, height);
+    doc.addLayer(Layer("Gradient", width, height));
+    doc.addLayer(Layer("Noise", width, height));
+    Layer& gradient = doc.layer(0);
+    Layer& noise = doc.layer(1);
+    std::uint32_t seed = 5u;
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            seed = seed * 1664525u + 1013904223u;
+            gradient.image().setPixel(x, y, PixelRGBA8(static_cast<std::uint8_t>(x), static_cast<std::uint8_t>(y), 90, 255));
+            noise.image().setPixel(x, y, PixelRGBA8(static_cast<std::uint8_t>(seed >> 24), static_cast<std::uint8_t>(seed >> 16),
+                                                    static_cast<std::uint8_t>(seed >> 8), 200));
+        }
+    }
+    noise.ensureMask(PixelRGBA8(255, 255, 255, 255)).setCoverage(7, 650, 33);
+
+    const IFLOWCompression modes[] = {IFLOWCompression::Auto, IFLOWCompression::None, IFLOWCompression::RLE,
+                                      IFLOWCompression::LZ4, IFLOWCompression::Deflate};
+    for (IFLOWCompression mode : modes) {
+        IFLOWSaveOptions options;
+        options.compression = mode;
+        options.threads = 3;
+        const std::string path = testOutDir + "/chunked.iflow";
+        require(saveDocumentIFLOW(doc, path, options), "Saving a chunked IFLOW document should succeed");
+        const Document loaded = loadDocumentIFLOW(path, 2);
+        require(buffersEqual(loaded.layer(0).image(), gradient.image()) && buffersEqual(loaded.layer(1).image(), noise.image()),
+                "Chunked IFLOW should roundtrip layer pixels for every codec");
+        require(loaded.layer(1).mask().coverage(7, 650) == 33 && loaded.layer(1).mask().coverage(8, 650) == 255,
+                "Chunked IFLOW should roundtrip mask coverage");
+        if (mode == IFLOWCompression::Auto) {
+            require(std::filesystem::file_size(path) < static_cast<std::uintmax_t>(width) * height * 6,
+                    "Auto compression should shrink smooth layers");
+        }
+    }
+
+    // Hand-written version 2 file: one 2x1 layer with an RGBA mask.
+    const std::string legacyPath = testOutDir + "/legacy-v2.iflow";
+    {
+        std::ofstream out(legacyPath, std::ios::binary | std::ios::trunc);
+        const auto put32 = [&out](std::uint32_t v) { out.write(reinterpret_cast<const char*>(&v), 4); };
+        const auto putFloat = [&out](float v) { out.write(reinterpret_cast<const char*>(&v), 4); };
+        const auto putNodeHeader = [&](const std::string& name) {
+            put32(static_cast<std::uint32_t>(name.size()));
+            out.write(name.data(), static_cast<std::streamsize>(name.size()));
+            out.put(1);
+            putFloat(1.0f);
+            put32(0);
+            put32(0);
+            put32(0);
+            for (float v : {1.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f}) {
+                putFloat(v);
+            }
+        };
+        out.write("IFLOW01", 8);
+        put32(2);
+        put32(2);
+        put32(1);
+        putNodeHeader("Root");
+        put32(1);
+        out.put(0);
+        putNodeHeader("Old");
+        put32(2);
+        put32(1);
+        for (unsigned char c : {10, 20, 30, 255, 40, 50, 60, 255}) {
+            out.put(static_cast<char>(c));
+        }
+        out.put(1);
+        put32(2);
+        put32(1);
+        for (unsigned char c : {255, 255, 255, 255, 255, 255, 255, 128}) {
+            out.put(static_cast<char>(c));
+        }
+    }
+    const Document legacy = loadDocumentIFLOW(legacyPath);
+    const Layer& old = legacy.layer(0);
+    require(old.name() == "Old" && old.image().getPixel(1, 0).g == 50, "Version 2 IFLOW files should still load");
+    require(old.mask().coverage(0, 0) == 255 && old.mask().coverage(1, 0) == 128, "Version 2 RGBA masks should convert to coverage");
+}
+
+void testIFLOWSerializationRoundtripPreservesStack() {
+    const std::string testOutDir = "build/output/test-images";
+    std::filesystem::create_directories(testOutDir);
+    const std::string iflowPath = testOutDir + "/roundtrip.iflow";
+
+    Document original(4, 2);
+    original.addLayer(Layer("Background", 4, 2, PixelRGBA8(12, 24, 36, 255)));
+
+    LayerGroup faceGroup("Face Group");
+    faceGroup.setOffset(1, 0);
+    faceGroup.setOpacity(0.8f);
+    faceGroup.transform().setTranslation(0.0, 1.0);
+
+    Layer fill("Fill", 2, 2, PixelRGBA8(220, 180, 80, 255));
+    fill.transform().setTranslation(1.0, 0.0);
+    fill.ensureMask(PixelRGBA8(255, 255, 255, 255)).setPixel(1, 1, PixelRGBA8(0, 0, 0, 255));
+    faceGroup.addLayer(fill);
+
+    Layer shade("Shade", 2, 2, PixelRGBA8(20, 40, 100, 180));
+    shade.setBlendMode(BlendMode::Multiply);
+    faceGroup.addLayer(shade);
+
+    original.addGroup(faceGroup);
+
+    require(saveDocumentIFLOW(original, iflowPath), "Saving IFLOW document should succeed");
+    Document loaded = loadDocumentIFLOW(iflowPath);
+
+    require(loaded.width() == original.width() && loaded.height() == original.height(), "IFLOW should preserve dimensions");
+    require(loaded.nodeCount() == 2, "IFLOW should preserve root node count");
+    require(loaded.node(1).isGroup(), "IFLOW should preserve group nodes");
+    const LayerGroup& loadedGroup = loaded.node(1).asGroup();
+    require(loadedGroup.nodeCount() == 2, "IFLOW should preserve group children");
+    require(loadedGroup.node(0).asLayer().hasMask(), "IFLOW should preserve per-layer masks");
+
+    const ImageBuffer a = original.composite();
+    const ImageBuffer b = loaded.composite();
+    for (int y = 0; y < a.height(); ++y) {
+        for (int x = 0; x < a.width(); ++x) {
+            const PixelRGBA8 pa = a.getPixel(x, y);
+            const PixelRGBA8 pb = b.getPixel(x, y);
+            require(pa.r == pb.r && pa.g == pb.g && pa.b == pb.b && pa.a == pb.a, "IFLOW roundtrip should preserve composite output");
+        }
+    }
+}
+
+void testImageBufferCopiesShareUntilWritten() {
+    Layer original("Original", 4, 4, PixelRGBA8(10, 20, 30, 255));
+    LayerGroup group("Group");
+    group.addLayer(original);
+    const LayerGroup duplicate = group;
+
+    const ImageBuffer& source = original.image();
+    require(group.layer(0).image().sharesPixelsWith(source), "Adding a layer should share its pixel storage");
+    require(duplicate.layer(0).image().sharesPixelsWith(source), "Copying a group should share layer pixel storage");
+
+    group.layer(0).image().setPixel(1, 1, PixelRGBA8(255, 0, 0, 255));
+    require(!group.layer(0).image().sharesPixelsWith(source), "Writing a copy should detach its pixel storage");
+    require(source.getPixel(1, 1).r == 10, "Writing a copy should not change the original");
+    require(duplicate.layer(0).image().getPixel(1, 1).r == 10, "Writing a copy should not change other copies");
+    require(group.layer(0).image().getPixel(1, 1).r == 255, "Written copy should hold the new pixel");
+}
+
+void testImageBufferViewsExposeStridedRows() {
+    ImageBuffer image(5, 4, PixelRGBA8(0, 0, 0, 255));
+    image.setPixel(3, 2, PixelRGBA8(7, 8, 9, 255));
+    const ImageBuffer shared = image;
+
+    const ConstImageView full = shared.view();
+    require(full.width() == 5 && full.height() == 4 && full.stride() == 5, "Full view should match buffer dimensions");
+    require(full.row(2) == shared.row(2) && full.row(2)[3].r == 7, "View rows should alias buffer rows");
+
+    ImageView sub = image.view(1, 1, 3, 2);
+    require(sub.stride() == 5 && sub.at(2, 1).g == 8, "Subview should keep the parent stride and offset");
+    sub.row(0)[0] = PixelRGBA8(200, 0, 0, 255);
+    require(image.getPixel(1, 1).r == 200, "Writes through a subview should reach the buffer");
+    require(shared.getPixel(1, 1).r == 0, "Taking a mutable view should detach shared storage");
+
+    const ConstImageView inner = ConstImageView(sub).subview(1, 1, 2, 1);
+    require(&inner.at(0, 0) == &image.getPixel(2, 2), "Nested subviews should compose offsets");
+
+    bool threw = false;
+    try {
+        (void)image.view(3, 0, 3, 1);
+    } catch (const std::out_of_range&) {
+        threw = true;
+    }
+    require(threw, "Subview past the buffer edge should throw");
+
+    threw = false;
+    try {
+        (void)shared.row(4);
+    } catch (const std::out_of_range&) {
+        threw = true;
+    }
+    require(threw, "Row index past the buffer height should throw");
+}
+
+void testLayerTreeMovesAndEmplacesNodes() {
+    Layer layer("Moved", 3, 3, PixelRGBA8(1, 2, 3, 255));
+    const PixelRGBA8* storage = layer.image().data();
+
+    Document doc(3, 3);
+    Layer& moved = doc.addLayer(std::move(layer));
+    require(moved.image().data() == storage, "Moving a layer into a document should keep its pixel storage");
+
+    LayerGroup& group = doc.emplaceGroup("Emplaced Group");
+    Layer& emplaced = group.emplaceLayer("Emplaced", 2, 2, PixelRGBA8(9, 9, 9, 255));
+    require(doc.node(1).isGroup() && doc.node(1).asGroup().name() == "Emplaced Group", "emplaceGroup should construct a group node");
+    require(emplaced.name() == "Emplaced" && emplaced.image().width() == 2, "emplaceLayer should forward constructor arguments");
+
+    const Document copy = doc;
+    require(copy.node(1).asGroup().layer(0).image().sharesPixelsWith(doc.node(1).asGroup().layer(0).image()),
+            "Copying the tree should share pixel storage");
+    require(&copy.node(1).asGroup() != &doc.node(1).asGroup(), "Copying the tree should deep-copy group nodes");
 }
 
 void testImageBufferRejectsExcessiveDimensions() {
@@ -798,7 +4275,64 @@ int main() {
         testEffectsOnLayerImageBuffer();
         testGroupedLayerOffsetAndVisibility();
         testGroupedLayerOpacityAffectsComposite();
+        testTiledCompositeMatchesSerial();
+        testSpanCompositorMatchesPixelReference();
+        testAffineFastPathsMatchInverseSampling();
+        testNestedGroupSurfacesMatchFlattenedLayer();
+        testDeepStackAccumulatesInLinearPrecision();
+        testIncrementalCompositeRedoesOnlyDirtyTiles();
+        testLayerMasksStoreEightBitCoverage();
         testIFLOWSerializationRoundtripPreservesStack();
+        testChunkCodecsRoundtrip();
+        testPNGDeflateLevelsAndParallelSegments();
+        testPNGLoadsInterlacedPalettedAndSixteenBitImages();
+        testCompositeSavesEncodeRowsAndKeepPNGAlpha();
+        testJPGEncodesRestartIntervalsOnWorkerThreads();
+        testJPGSubsamplingQualityAndProgressiveDecode();
+        testJPGDecodesAtReducedScaleForTargetSize();
+        testGIFCompressesAndQuantizesLargePalettes();
+        testGIFAnimationWritesDeltaFrames();
+        testWEBPEncodesLosslessAndNearLossless();
+        testCodecRegistryDecodesByMagicWithAlpha();
+        testSVGExportMergesRectsAndEmbedsPNG();
+        testSVGStreamingRasterizerAntialiasesShapes();
+        testBMPMappedRowsKeepAlphaAndSwizzleExactly();
+        testRenderWritesEveryTargetFromOneComposite();
+        testOpsEmitWritesSnapshotsInBackground();
+        testGaussianBlurMatchesReferenceAtEveryRadius();
+        testBoxCascadeBlurClampsEdgesLikeTheDirectKernel();
+        testEffectsFollowTheCommandThreadCount();
+        testMorphologyMatchesBruteForceAndFoldsIterations();
+        testEdgeDetectTilesMatchReferenceAcrossBands();
+        testCannyKeepsTiedMaximaSymmetric();
+        testFusedPointOpsMatchOpsRunOneByOne();
+        testProceduralNoiseIsHashedPerPixel();
+        testRegionOpsMatchWholeLayerInsideTheRect();
+        testResampleFiltersMatchReferenceAndKeepAlpha();
+        testDownscaledLayersSampleMipLevels();
+        testColorLUTsLoadCubesAndBakeGrades();
+        testSpanFloodFillMatchesPixelFloodFill();
+        testWideStrokesFillOutlinePolygons();
+        testScanlineRasterizerCoverageAndFillRules();
+        testNativeDrawTargetsBlendSourceOver();
+        testDisplayListTilesMatchOneByOne();
+        testGeneratorLayersStayParametric();
+        testOpProgramParsesBeforeRunning();
+        testServeKeepsDocumentsResident();
+        testIndependentOpsMatchSerialOrder();
+        testProfileRecordsOpSpans();
+        testMemoryBudgetSpillsColdLayers();
+        testProxyCompositeRendersAtScale();
+        testNestedParallelLoopsShareThreads();
+        testAliasedPolygonFillsKeepEdgeColumns();
+        testIFLOWCompressedChunksRoundtripAndLegacyLoad();
+        testIFLOWLoadsLayersLazily();
+        testIFLOWIncrementalSaveAppendsChanges();
+        testIFLOWDeduplicatesPlanesAndKeepsSolidFills();
+        testCompositeRowsStreamsWithinMemoryBudget();
+        testImageBufferCopiesShareUntilWritten();
+        testImageBufferViewsExposeStridedRows();
+        testLayerTreeMovesAndEmplacesNodes();
         testImageBufferRejectsExcessiveDimensions();
         testCLIRejectsInvalidNumericInput();
         testCLIOpSupportsQuotedValues();
@@ -164,10 +164,10 @@ public:
         return {m_a * x + m_c * y + m_tx, m_b * x + m_d * y + m_ty};
     }
 
-    std::pair<double, double> applyInverse(double x, double y) const {
+    Transform2D inverse() const {
         const double det = m_a * m_d - m_b * m_c;
         if (std::abs(det) <= 1e-12) {
-            return {x, y};
+            return Transform2D();
         }
         const double invA = m_d / det;
         const double invB = -m_b / det;
@@ -175,7 +175,11 @@ public:
         const double invD = m_a / det;
         const double invTx = -(invA * m_tx + invC * m_ty);
         const double invTy = -(invB * m_tx + invD * m_ty);
-        return {invA * x + invC * y + invTx, invB * x + invD * y + invTy};
+        return fromMatrix(invA, invB, invC, invD, invTx, invTy);
+    }
+
+    std::pair<double, double> applyInverse(double x, double y) const {
+        return inverse().apply(x, y);
     }
 
 private:
@@ -193,9 +197,17 @@ private:
 
 class Transformable {
 public:
-    Transform2D& transform() { return m_transform; }
+    virtual ~Transformable() = default;
+
+    Transform2D& transform() {
+        transformWillChange();
+        return m_transform;
+    }
     const Transform2D& transform() const { return m_transform; }
 
+protected:
+    virtual void transformWillChange() {}
+
 private:
     Transform2D m_transform;
 };
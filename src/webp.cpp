@@ -1,10 +1,20 @@
 #include "webp.h"
 
+#include "compress.h"
+#include "mapped_file.h"
+#include "swizzle.h"
+
+#include <algorithm>
+#include <array>
 #include <cctype>
-#include <cstdlib>
 #include <cerrno>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
 #include <filesystem>
 #include <fstream>
+#include <iterator>
+#include <limits>
 #include <stdexcept>
 #include <string>
 #include <sys/wait.h>
@@ -113,90 +123,1356 @@ std::string findInPath(const std::string& program) {
     return "";
 }
 
-bool writePPM(const std::string& filename, int width, int height, const std::vector<Color>& pixels) {
-    std::ofstream out(filename, std::ios::binary);
-    if (!out) {
-        return false;
+// Reads one whitespace-separated PPM header token, skipping comments.
+std::string readHeaderToken(const std::uint8_t* data, std::size_t size, std::size_t& pos) {
+    while (pos < size) {
+        if (data[pos] == '#') {
+            while (pos < size && data[pos] != '\n') {
+                ++pos;
+            }
+        } else if (std::isspace(data[pos])) {
+            ++pos;
+        } else {
+            break;
+        }
+    }
+    const std::size_t start = pos;
+    while (pos < size && !std::isspace(data[pos]) && data[pos] != '#') {
+        ++pos;
+    }
+    return std::string(reinterpret_cast<const char*>(data) + start, pos - start);
+}
+
+// Binary PPM rows are already in the layout of Color, so the mapped pixel
+// data is copied (or widened to RGBA) straight into the target.
+void readPPM(const std::string& filename, const PixelTarget& target) {
+    const MappedFile file(filename);
+    const std::uint8_t* data = file.data();
+    const std::size_t size = file.size();
+    std::size_t pos = 0;
+
+    const std::string magic = readHeaderToken(data, size, pos);
+    if (magic != "P6") {
+        throw std::runtime_error("Unsupported converted PPM magic");
     }
 
-    out << "P6\n" << width << " " << height << "\n255\n";
-    for (const Color& p : pixels) {
-        const std::uint8_t rgb[3] = {p.r, p.g, p.b};
-        out.write(reinterpret_cast<const char*>(rgb), 3);
+    const std::string widthToken = readHeaderToken(data, size, pos);
+    const std::string heightToken = readHeaderToken(data, size, pos);
+    const std::string maxValueToken = readHeaderToken(data, size, pos);
+
+    if (widthToken.empty() || heightToken.empty() || maxValueToken.empty() || pos >= size) {
+        throw std::runtime_error("Invalid converted PPM header");
     }
-    return static_cast<bool>(out);
+    ++pos;
+
+    const int width = std::stoi(widthToken);
+    const int height = std::stoi(heightToken);
+    const int maxValue = std::stoi(maxValueToken);
+
+    if (width <= 0 || height <= 0 || maxValue != 255) {
+        throw std::runtime_error("Unsupported converted PPM dimensions or max value");
+    }
+
+    const std::size_t pixelCount = static_cast<std::size_t>(width) * static_cast<std::size_t>(height);
+    if ((size - pos) / 3 < pixelCount) {
+        throw std::runtime_error("Truncated converted PPM data");
+    }
+
+    std::uint8_t* out = target.allocate(width, height);
+    convertPixels(data + pos, 3, out, target.channels, pixelCount, false);
 }
 
-std::string readTokenSkippingComments(std::istream& in) {
-    std::string token;
-    char ch = '\0';
+// VP8L (lossless WebP) bitstream constants.
+constexpr std::uint8_t kVP8LSignature = 0x2F;
+constexpr int kMaxVP8LDimension = 16384;
+constexpr std::size_t kMaxImagePixels = 100000000;
+constexpr int kNumLengthCodes = 24;
+constexpr int kNumDistanceCodes = 40;
+constexpr int kMaxCacheBits = 11;
+constexpr int kPredictorBits = 4;
+constexpr std::size_t kMinCopyLength = 3;
+constexpr std::size_t kMaxCopyLength = 4096;
+constexpr std::size_t kCopyWindow = std::size_t(1) << 20;
+constexpr std::size_t kMaxCopyDistance = kCopyWindow - 120;
+constexpr int kCopyHashBits = 16;
+constexpr int kMaxCopyChain = 16;
+constexpr std::uint32_t kColorCacheMultiplier = 0x1E35A7BDu;
 
-    while (in.get(ch)) {
-        if (std::isspace(static_cast<unsigned char>(ch))) {
-            continue;
+enum VP8LTransformType {
+    kPredictorTransform = 0,
+    kColorTransform = 1,
+    kSubtractGreenTransform = 2,
+    kColorIndexingTransform = 3,
+};
+
+constexpr std::array<std::uint8_t, 19> kCodeLengthCodeOrder = {17, 18, 0, 1, 2, 3, 4, 5, 16, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15};
+
+// (dx, dy) of the 120 short distance codes, nearest first; a code stands for
+// the pixel dy rows up and dx columns to the left.
+constexpr std::int8_t kDistanceMap[120][2] = {
+    {0, 1},  {1, 0},  {1, 1},  {-1, 1}, {0, 2},  {2, 0},  {1, 2},  {-1, 2}, {2, 1},  {-2, 1}, {2, 2},  {-2, 2},
+    {0, 3},  {3, 0},  {1, 3},  {-1, 3}, {3, 1},  {-3, 1}, {2, 3},  {-2, 3}, {3, 2},  {-3, 2}, {0, 4},  {4, 0},
+    {1, 4},  {-1, 4}, {4, 1},  {-4, 1}, {3, 3},  {-3, 3}, {2, 4},  {-2, 4}, {4, 2},  {-4, 2}, {0, 5},  {3, 4},
+    {-3, 4}, {4, 3},  {-4, 3}, {5, 0},  {1, 5},  {-1, 5}, {5, 1},  {-5, 1}, {2, 5},  {-2, 5}, {5, 2},  {-5, 2},
+    {4, 4},  {-4, 4}, {3, 5},  {-3, 5}, {5, 3},  {-5, 3}, {0, 6},  {6, 0},  {1, 6},  {-1, 6}, {6, 1},  {-6, 1},
+    {2, 6},  {-2, 6}, {6, 2},  {-6, 2}, {4, 5},  {-4, 5}, {5, 4},  {-5, 4}, {3, 6},  {-3, 6}, {6, 3},  {-6, 3},
+    {0, 7},  {7, 0},  {1, 7},  {-1, 7}, {5, 5},  {-5, 5}, {7, 1},  {-7, 1}, {4, 6},  {-4, 6}, {6, 4},  {-6, 4},
+    {2, 7},  {-2, 7}, {7, 2},  {-7, 2}, {3, 7},  {-3, 7}, {7, 3},  {-7, 3}, {5, 6},  {-5, 6}, {6, 5},  {-6, 5},
+    {8, 0},  {4, 7},  {-4, 7}, {7, 4},  {-7, 4}, {8, 1},  {8, 2},  {6, 6},  {-6, 6}, {8, 3},  {5, 7},  {-5, 7},
+    {7, 5},  {-7, 5}, {8, 4},  {6, 7},  {-6, 7}, {7, 6},  {-7, 6}, {8, 5},  {7, 7},  {-7, 7}, {8, 6},  {8, 7}};
+
+std::uint32_t readU32LE(const std::uint8_t* p) {
+    return static_cast<std::uint32_t>(p[0]) | (static_cast<std::uint32_t>(p[1]) << 8) |
+           (static_cast<std::uint32_t>(p[2]) << 16) | (static_cast<std::uint32_t>(p[3]) << 24);
+}
+
+void writeU32LE(std::vector<std::uint8_t>& out, std::uint32_t value) {
+    for (int i = 0; i < 4; ++i) {
+        out.push_back(static_cast<std::uint8_t>(value >> (8 * i)));
+    }
+}
+
+int subSampleSize(int size, int bits) {
+    return (size + (1 << bits) - 1) >> bits;
+}
+
+// Per-channel arithmetic on packed ARGB pixels.
+std::uint32_t addPixels(std::uint32_t a, std::uint32_t b) {
+    const std::uint32_t ag = (a & 0xFF00FF00u) + (b & 0xFF00FF00u);
+    const std::uint32_t rb = (a & 0x00FF00FFu) + (b & 0x00FF00FFu);
+    return (ag & 0xFF00FF00u) | (rb & 0x00FF00FFu);
+}
+
+std::uint32_t subPixels(std::uint32_t a, std::uint32_t b) {
+    const std::uint32_t ag = 0x00FF00FFu + (a & 0xFF00FF00u) - (b & 0xFF00FF00u);
+    const std::uint32_t rb = 0xFF00FF00u + (a & 0x00FF00FFu) - (b & 0x00FF00FFu);
+    return (ag & 0xFF00FF00u) | (rb & 0x00FF00FFu);
+}
+
+std::uint32_t average2(std::uint32_t a, std::uint32_t b) {
+    return (((a ^ b) & 0xFEFEFEFEu) >> 1) + (a & b);
+}
+
+int channel(std::uint32_t pixel, int shift) {
+    return static_cast<int>((pixel >> shift) & 0xFF);
+}
+
+std::uint32_t clampAddSubtractFull(std::uint32_t a, std::uint32_t b, std::uint32_t c) {
+    std::uint32_t out = 0;
+    for (int shift = 0; shift < 32; shift += 8) {
+        const int value = std::clamp(channel(a, shift) + channel(b, shift) - channel(c, shift), 0, 255);
+        out |= static_cast<std::uint32_t>(value) << shift;
+    }
+    return out;
+}
+
+std::uint32_t clampAddSubtractHalf(std::uint32_t a, std::uint32_t b) {
+    std::uint32_t out = 0;
+    for (int shift = 0; shift < 32; shift += 8) {
+        const int value = std::clamp(channel(a, shift) + (channel(a, shift) - channel(b, shift)) / 2, 0, 255);
+        out |= static_cast<std::uint32_t>(value) << shift;
+    }
+    return out;
+}
+
+std::uint32_t selectPredictor(std::uint32_t left, std::uint32_t top, std::uint32_t topLeft) {
+    int toLeft = 0;
+    int toTop = 0;
+    for (int shift = 0; shift < 32; shift += 8) {
+        toLeft += std::abs(channel(top, shift) - channel(topLeft, shift));
+        toTop += std::abs(channel(left, shift) - channel(topLeft, shift));
+    }
+    return toLeft < toTop ? left : top;
+}
+
+// The 14 spatial predictors; top points at the pixel above the current one,
+// so top[1] wraps to the start of the current row on the last column.
+std::uint32_t predictPixel(int mode, std::uint32_t left, const std::uint32_t* top) {
+    switch (mode) {
+        case 1:
+            return left;
+        case 2:
+            return top[0];
+        case 3:
+            return top[1];
+        case 4:
+            return top[-1];
+        case 5:
+            return average2(average2(left, top[1]), top[0]);
+        case 6:
+            return average2(left, top[-1]);
+        case 7:
+            return average2(left, top[0]);
+        case 8:
+            return average2(top[-1], top[0]);
+        case 9:
+            return average2(top[0], top[1]);
+        case 10:
+            return average2(average2(left, top[-1]), average2(top[0], top[1]));
+        case 11:
+            return selectPredictor(left, top[0], top[-1]);
+        case 12:
+            return clampAddSubtractFull(left, top[0], top[-1]);
+        case 13:
+            return clampAddSubtractHalf(average2(left, top[0]), top[-1]);
+        default:
+            return 0xFF000000u;
+    }
+}
+
+// The first row predicts from the left and the first column from above,
+// whatever the block's mode.
+std::uint32_t predictAt(const std::uint32_t* pixels, int width, int x, int y, int mode) {
+    const std::uint32_t* current = pixels + static_cast<std::size_t>(y) * static_cast<std::size_t>(width) + static_cast<std::size_t>(x);
+    if (y == 0) {
+        return x == 0 ? 0xFF000000u : current[-1];
+    }
+    if (x == 0) {
+        return current[-width];
+    }
+    return predictPixel(mode, current[-1], current - width);
+}
+
+int colorTransformDelta(std::int8_t multiplier, std::int8_t color) {
+    return (static_cast<int>(multiplier) * static_cast<int>(color)) >> 5;
+}
+
+std::uint32_t colorCacheKey(std::uint32_t argb, int bits) {
+    return (argb * kColorCacheMultiplier) >> (32 - bits);
+}
+
+// Lengths and distances are coded as a prefix symbol plus extra bits.
+void prefixEncode(std::uint32_t value, int& symbol, int& extraBits, std::uint32_t& extraValue) {
+    const std::uint32_t d = value - 1;
+    if (d < 4) {
+        symbol = static_cast<int>(d);
+        extraBits = 0;
+        extraValue = 0;
+        return;
+    }
+    int highest = 2;
+    while ((d >> (highest + 1)) != 0) {
+        ++highest;
+    }
+    extraBits = highest - 1;
+    symbol = 2 * highest + static_cast<int>((d >> extraBits) & 1u);
+    extraValue = d & ((1u << extraBits) - 1);
+}
+
+class VP8LBitReader {
+public:
+    VP8LBitReader(const std::uint8_t* data, std::size_t size) : m_data(data), m_size(size), m_pos(0), m_bits(0), m_count(0) {}
+
+    // At least 32 bits while input remains; zeros past the end.
+    std::uint32_t peek() {
+        if (m_count < 32) {
+            while (m_count <= 56 && m_pos < m_size) {
+                m_bits |= static_cast<std::uint64_t>(m_data[m_pos++]) << m_count;
+                m_count += 8;
+            }
         }
-        if (ch == '#') {
-            std::string discard;
-            std::getline(in, discard);
-            continue;
+        return static_cast<std::uint32_t>(m_bits);
+    }
+
+    void consume(int count) {
+        if (count > m_count) {
+            throw std::runtime_error("Truncated WebP lossless data");
         }
-        token.push_back(ch);
-        break;
+        m_bits >>= count;
+        m_count -= count;
     }
 
-    while (in.get(ch)) {
-        if (std::isspace(static_cast<unsigned char>(ch))) {
-            break;
+    std::uint32_t bits(int count) {
+        const std::uint32_t value = peek() & ((1u << count) - 1);
+        consume(count);
+        return value;
+    }
+
+private:
+    const std::uint8_t* m_data;
+    std::size_t m_size;
+    std::size_t m_pos;
+    std::uint64_t m_bits;
+    int m_count;
+};
+
+// Canonical prefix code decoder with a direct lookup for short codes and a
+// per-length walk for the rest. A code with one symbol reads no bits.
+class PrefixCode {
+public:
+    static constexpr int kFastBits = 8;
+
+    void build(const std::uint8_t* lengths, int count) {
+        m_counts.fill(0);
+        int used = 0;
+        int last = 0;
+        for (int i = 0; i < count; ++i) {
+            if (lengths[i] != 0) {
+                ++m_counts[lengths[i]];
+                ++used;
+                last = i;
+            }
+        }
+        if (used == 0) {
+            throw std::runtime_error("Empty WebP prefix code");
+        }
+        m_single = used == 1 ? last : -1;
+        if (m_single >= 0) {
+            return;
+        }
+        int left = 1;
+        for (int len = 1; len <= 15; ++len) {
+            left = (left << 1) - m_counts[static_cast<std::size_t>(len)];
+            if (left < 0) {
+                throw std::runtime_error("Over-subscribed WebP prefix code");
+            }
+        }
+
+        std::array<std::uint16_t, 16> offsets{};
+        for (int len = 1; len < 15; ++len) {
+            offsets[static_cast<std::size_t>(len + 1)] =
+                static_cast<std::uint16_t>(offsets[static_cast<std::size_t>(len)] + m_counts[static_cast<std::size_t>(len)]);
+        }
+        m_symbols.assign(static_cast<std::size_t>(used), 0);
+        for (int i = 0; i < count; ++i) {
+            if (lengths[i] != 0) {
+                m_symbols[offsets[lengths[i]]++] = static_cast<std::uint16_t>(i);
+            }
+        }
+
+        m_fast.fill(0);
+        int code = 0;
+        int index = 0;
+        for (int len = 1; len <= kFastBits; ++len) {
+            for (int i = 0; i < m_counts[static_cast<std::size_t>(len)]; ++i, ++index, ++code) {
+                int reversed = 0;
+                for (int b = 0; b < len; ++b) {
+                    reversed = (reversed << 1) | ((code >> b) & 1);
+                }
+                const std::uint16_t entry = static_cast<std::uint16_t>((m_symbols[static_cast<std::size_t>(index)] << 4) | len);
+                for (int fill = reversed; fill < (1 << kFastBits); fill += (1 << len)) {
+                    m_fast[static_cast<std::size_t>(fill)] = entry;
+                }
+            }
+            code <<= 1;
         }
-        token.push_back(ch);
     }
-    return token;
+
+    int read(VP8LBitReader& reader) const {
+        if (m_single >= 0) {
+            return m_single;
+        }
+        const std::uint32_t bits = reader.peek();
+        const std::uint16_t entry = m_fast[bits & ((1u << kFastBits) - 1)];
+        if ((entry & 0xF) != 0) {
+            reader.consume(entry & 0xF);
+            return entry >> 4;
+        }
+        int code = 0;
+        int first = 0;
+        int index = 0;
+        for (int len = 1; len <= 15; ++len) {
+            code |= static_cast<int>((bits >> (len - 1)) & 1u);
+            const int count = m_counts[static_cast<std::size_t>(len)];
+            if (code - count < first) {
+                reader.consume(len);
+                return m_symbols[static_cast<std::size_t>(index + (code - first))];
+            }
+            index += count;
+            first += count;
+            first <<= 1;
+            code <<= 1;
+        }
+        throw std::runtime_error("Invalid WebP prefix code");
+    }
+
+private:
+    std::array<std::uint16_t, 16> m_counts{};
+    std::vector<std::uint16_t> m_symbols;
+    std::array<std::uint16_t, 1 << kFastBits> m_fast{};
+    int m_single = -1;
+};
+
+void readPrefixCode(VP8LBitReader& reader, int alphabetSize, PrefixCode& code) {
+    std::vector<std::uint8_t> lengths(static_cast<std::size_t>(alphabetSize), 0);
+    if (reader.bits(1) != 0) {
+        // Simple code: one or two symbols.
+        const int symbols = static_cast<int>(reader.bits(1)) + 1;
+        const int first = static_cast<int>(reader.bits(reader.bits(1) == 0 ? 1 : 8));
+        const int second = symbols == 2 ? static_cast<int>(reader.bits(8)) : first;
+        if (first >= alphabetSize || second >= alphabetSize) {
+            throw std::runtime_error("WebP prefix code symbol out of range");
+        }
+        lengths[static_cast<std::size_t>(first)] = 1;
+        lengths[static_cast<std::size_t>(second)] = 1;
+    } else {
+        std::array<std::uint8_t, 19> codeLengthLengths{};
+        const int count = static_cast<int>(reader.bits(4)) + 4;
+        for (int i = 0; i < count; ++i) {
+            codeLengthLengths[kCodeLengthCodeOrder[static_cast<std::size_t>(i)]] = static_cast<std::uint8_t>(reader.bits(3));
+        }
+        PrefixCode lengthCode;
+        lengthCode.build(codeLengthLengths.data(), 19);
+
+        int maxTokens = alphabetSize;
+        if (reader.bits(1) != 0) {
+            const int lengthBits = 2 + 2 * static_cast<int>(reader.bits(3));
+            maxTokens = 2 + static_cast<int>(reader.bits(lengthBits));
+            if (maxTokens > alphabetSize) {
+                throw std::runtime_error("Invalid WebP code length count");
+            }
+        }
+        int symbol = 0;
+        std::uint8_t previous = 8;
+        while (symbol < alphabetSize && maxTokens-- > 0) {
+            const int token = lengthCode.read(reader);
+            if (token < 16) {
+                lengths[static_cast<std::size_t>(symbol++)] = static_cast<std::uint8_t>(token);
+                if (token != 0) {
+                    previous = static_cast<std::uint8_t>(token);
+                }
+                continue;
+            }
+            const int repeat = token == 16 ? 3 + static_cast<int>(reader.bits(2))
+                                           : (token == 17 ? 3 + static_cast<int>(reader.bits(3)) : 11 + static_cast<int>(reader.bits(7)));
+            if (symbol + repeat > alphabetSize) {
+                throw std::runtime_error("WebP code lengths overflow the alphabet");
+            }
+            std::fill_n(lengths.begin() + symbol, repeat, token == 16 ? previous : std::uint8_t(0));
+            symbol += repeat;
+        }
+    }
+    code.build(lengths.data(), alphabetSize);
 }
 
-WEBPImage readPPM(const std::string& filename) {
-    std::ifstream in(filename, std::ios::binary);
-    if (!in) {
-        throw std::runtime_error("Cannot open converted PPM file: " + filename);
+std::uint32_t readPrefixValue(VP8LBitReader& reader, int symbol) {
+    if (symbol < 4) {
+        return static_cast<std::uint32_t>(symbol) + 1;
     }
+    const int extraBits = (symbol - 2) >> 1;
+    const std::uint32_t offset = static_cast<std::uint32_t>(2 + (symbol & 1)) << extraBits;
+    return offset + reader.bits(extraBits) + 1;
+}
 
-    const std::string magic = readTokenSkippingComments(in);
-    if (magic != "P6") {
-        throw std::runtime_error("Unsupported converted PPM magic");
+std::size_t planeCodeToDistance(int width, std::uint32_t code) {
+    if (code > 120) {
+        return code - 120;
     }
+    const int distance = kDistanceMap[code - 1][1] * width + kDistanceMap[code - 1][0];
+    return static_cast<std::size_t>(std::max(1, distance));
+}
 
-    const std::string widthToken = readTokenSkippingComments(in);
-    const std::string heightToken = readTokenSkippingComments(in);
-    const std::string maxValueToken = readTokenSkippingComments(in);
+// Green, red, blue and alpha literals (green shares its alphabet with copy
+// lengths and color cache indices), then copy distances.
+struct PrefixGroup {
+    std::array<PrefixCode, 5> codes;
+};
 
-    if (widthToken.empty() || heightToken.empty() || maxValueToken.empty()) {
-        throw std::runtime_error("Invalid converted PPM header");
+struct VP8LTransform {
+    int type = 0;
+    int bits = 0;
+    int width = 0;
+    std::vector<std::uint32_t> data;
+};
+
+std::vector<std::uint32_t> decodeImageStream(VP8LBitReader& reader, int width, int height, bool topLevel);
+
+void applyInverseTransform(const VP8LTransform& transform, std::vector<std::uint32_t>& pixels, int height) {
+    const int width = transform.width;
+    switch (transform.type) {
+        case kPredictorTransform: {
+            const int blocksPerRow = subSampleSize(width, transform.bits);
+            for (int y = 0; y < height; ++y) {
+                std::uint32_t* row = pixels.data() + static_cast<std::size_t>(y) * static_cast<std::size_t>(width);
+                const std::uint32_t* modes = transform.data.data() + static_cast<std::size_t>(y >> transform.bits) * static_cast<std::size_t>(blocksPerRow);
+                for (int x = 0; x < width; ++x) {
+                    const int mode = static_cast<int>((modes[x >> transform.bits] >> 8) & 0xF);
+                    row[x] = addPixels(row[x], predictAt(pixels.data(), width, x, y, mode));
+                }
+            }
+            return;
+        }
+        case kColorTransform: {
+            const int blocksPerRow = subSampleSize(width, transform.bits);
+            for (int y = 0; y < height; ++y) {
+                std::uint32_t* row = pixels.data() + static_cast<std::size_t>(y) * static_cast<std::size_t>(width);
+                const std::uint32_t* elements = transform.data.data() + static_cast<std::size_t>(y >> transform.bits) * static_cast<std::size_t>(blocksPerRow);
+                for (int x = 0; x < width; ++x) {
+                    const std::uint32_t element = elements[x >> transform.bits];
+                    const std::uint32_t argb = row[x];
+                    const std::int8_t green = static_cast<std::int8_t>(channel(argb, 8));
+                    const int red = (channel(argb, 16) + colorTransformDelta(static_cast<std::int8_t>(element & 0xFF), green)) & 0xFF;
+                    int blue = channel(argb, 0) + colorTransformDelta(static_cast<std::int8_t>((element >> 8) & 0xFF), green);
+                    blue = (blue + colorTransformDelta(static_cast<std::int8_t>((element >> 16) & 0xFF), static_cast<std::int8_t>(red))) & 0xFF;
+                    row[x] = (argb & 0xFF00FF00u) | (static_cast<std::uint32_t>(red) << 16) | static_cast<std::uint32_t>(blue);
+                }
+            }
+            return;
+        }
+        case kSubtractGreenTransform:
+            for (std::uint32_t& argb : pixels) {
+                const std::uint32_t green = (argb >> 8) & 0xFF;
+                argb = addPixels(argb, (green << 16) | green);
+            }
+            return;
+        default: {
+            // Color indexing: several small indices may share one pixel's green.
+            const int packedWidth = subSampleSize(width, transform.bits);
+            const int bitsPerIndex = 8 >> transform.bits;
+            const std::uint32_t indexMask = (1u << bitsPerIndex) - 1;
+            const int perPixelMask = (1 << transform.bits) - 1;
+            std::vector<std::uint32_t> expanded(static_cast<std::size_t>(width) * static_cast<std::size_t>(height));
+            for (int y = 0; y < height; ++y) {
+                const std::uint32_t* packed = pixels.data() + static_cast<std::size_t>(y) * static_cast<std::size_t>(packedWidth);
+                std::uint32_t* out = expanded.data() + static_cast<std::size_t>(y) * static_cast<std::size_t>(width);
+                for (int x = 0; x < width; ++x) {
+                    const std::uint32_t green = (packed[x >> transform.bits] >> 8) & 0xFF;
+                    out[x] = transform.data[(green >> (bitsPerIndex * (x & perPixelMask))) & indexMask];
+                }
+            }
+            pixels.swap(expanded);
+            return;
+        }
     }
+}
 
-    const int width = std::stoi(widthToken);
-    const int height = std::stoi(heightToken);
-    const int maxValue = std::stoi(maxValueToken);
+VP8LTransform readTransform(VP8LBitReader& reader, int type, int& width, int height) {
+    VP8LTransform transform;
+    transform.type = type;
+    transform.width = width;
+    if (type == kPredictorTransform || type == kColorTransform) {
+        transform.bits = static_cast<int>(reader.bits(3)) + 2;
+        transform.data = decodeImageStream(reader, subSampleSize(width, transform.bits), subSampleSize(height, transform.bits), false);
+    } else if (type == kColorIndexingTransform) {
+        const int colors = static_cast<int>(reader.bits(8)) + 1;
+        transform.bits = colors > 16 ? 0 : (colors > 4 ? 1 : (colors > 2 ? 2 : 3));
+        transform.data = decodeImageStream(reader, colors, 1, false);
+        for (int i = 1; i < colors; ++i) {
+            transform.data[static_cast<std::size_t>(i)] = addPixels(transform.data[static_cast<std::size_t>(i)], transform.data[static_cast<std::size_t>(i - 1)]);
+        }
+        // Indices past the table decode as transparent black.
+        transform.data.resize(256, 0);
+        width = subSampleSize(width, transform.bits);
+    }
+    return transform;
+}
 
-    if (width <= 0 || height <= 0 || maxValue != 255) {
-        throw std::runtime_error("Unsupported converted PPM dimensions or max value");
+// Decodes one entropy-coded image. Only the top-level ARGB image carries
+// transforms and may switch prefix codes per block through a meta image.
+std::vector<std::uint32_t> decodeImageStream(VP8LBitReader& reader, int width, int height, bool topLevel) {
+    std::vector<VP8LTransform> transforms;
+    int codedWidth = width;
+    if (topLevel) {
+        unsigned seen = 0;
+        while (reader.bits(1) != 0) {
+            const int type = static_cast<int>(reader.bits(2));
+            if ((seen & (1u << type)) != 0) {
+                throw std::runtime_error("Repeated WebP transform");
+            }
+            seen |= 1u << type;
+            transforms.push_back(readTransform(reader, type, codedWidth, height));
+        }
     }
 
-    WEBPImage image(width, height, Color(0, 0, 0));
+    int cacheBits = 0;
+    if (reader.bits(1) != 0) {
+        cacheBits = static_cast<int>(reader.bits(4));
+        if (cacheBits < 1 || cacheBits > kMaxCacheBits) {
+            throw std::runtime_error("Invalid WebP color cache size");
+        }
+    }
+    const int cacheSize = cacheBits > 0 ? 1 << cacheBits : 0;
 
-    std::vector<std::uint8_t> bytes(static_cast<std::size_t>(width) * static_cast<std::size_t>(height) * 3);
-    in.read(reinterpret_cast<char*>(bytes.data()), static_cast<std::streamsize>(bytes.size()));
-    if (!in) {
-        throw std::runtime_error("Truncated converted PPM data");
+    int metaBits = 0;
+    int metaWidth = 0;
+    std::vector<std::uint32_t> meta;
+    std::size_t groupCount = 1;
+    if (topLevel && reader.bits(1) != 0) {
+        metaBits = static_cast<int>(reader.bits(3)) + 2;
+        metaWidth = subSampleSize(codedWidth, metaBits);
+        meta = decodeImageStream(reader, metaWidth, subSampleSize(height, metaBits), false);
+        for (std::uint32_t& entry : meta) {
+            entry = (entry >> 8) & 0xFFFF;
+            groupCount = std::max<std::size_t>(groupCount, entry + 1);
+        }
+    }
+    std::vector<PrefixGroup> groups(groupCount);
+    for (PrefixGroup& group : groups) {
+        readPrefixCode(reader, 256 + kNumLengthCodes + cacheSize, group.codes[0]);
+        readPrefixCode(reader, 256, group.codes[1]);
+        readPrefixCode(reader, 256, group.codes[2]);
+        readPrefixCode(reader, 256, group.codes[3]);
+        readPrefixCode(reader, kNumDistanceCodes, group.codes[4]);
     }
 
-    std::size_t byteIndex = 0;
+    const std::size_t total = static_cast<std::size_t>(codedWidth) * static_cast<std::size_t>(height);
+    std::vector<std::uint32_t> pixels(total);
+    std::vector<std::uint32_t> cache(static_cast<std::size_t>(cacheSize), 0);
+    std::size_t cached = 0;
+    const int metaMask = metaBits > 0 ? (1 << metaBits) - 1 : -1;
+    const auto groupAt = [&](int x, int y) -> const PrefixGroup& {
+        if (metaBits == 0) {
+            return groups[0];
+        }
+        return groups[meta[static_cast<std::size_t>(y >> metaBits) * static_cast<std::size_t>(metaWidth) + static_cast<std::size_t>(x >> metaBits)]];
+    };
+    const PrefixGroup* group = &groups[0];
+    std::size_t pos = 0;
+    int x = 0;
+    int y = 0;
+    while (pos < total) {
+        if ((x & metaMask) == 0) {
+            group = &groupAt(x, y);
+        }
+        const int symbol = group->codes[0].read(reader);
+        if (symbol < 256) {
+            const std::uint32_t red = static_cast<std::uint32_t>(group->codes[1].read(reader));
+            const std::uint32_t blue = static_cast<std::uint32_t>(group->codes[2].read(reader));
+            const std::uint32_t alpha = static_cast<std::uint32_t>(group->codes[3].read(reader));
+            pixels[pos++] = (alpha << 24) | (red << 16) | (static_cast<std::uint32_t>(symbol) << 8) | blue;
+            if (++x == codedWidth) {
+                x = 0;
+                ++y;
+            }
+        } else if (symbol < 256 + kNumLengthCodes) {
+            const std::size_t length = readPrefixValue(reader, symbol - 256);
+            const std::size_t distance = planeCodeToDistance(codedWidth, readPrefixValue(reader, group->codes[4].read(reader)));
+            if (distance > pos || length > total - pos) {
+                throw std::runtime_error("Invalid WebP backward reference");
+            }
+            for (std::size_t i = 0; i < length; ++i, ++pos) {
+                pixels[pos] = pixels[pos - distance];
+            }
+            x += static_cast<int>(length % static_cast<std::size_t>(codedWidth));
+            y += static_cast<int>(length / static_cast<std::size_t>(codedWidth));
+            if (x >= codedWidth) {
+                x -= codedWidth;
+                ++y;
+            }
+            if ((x & metaMask) != 0 && pos < total) {
+                group = &groupAt(x, y);
+            }
+        } else {
+            const int key = symbol - 256 - kNumLengthCodes;
+            if (key >= cacheSize) {
+                throw std::runtime_error("Invalid WebP color cache index");
+            }
+            for (; cached < pos; ++cached) {
+                cache[colorCacheKey(pixels[cached], cacheBits)] = pixels[cached];
+            }
+            pixels[pos++] = cache[static_cast<std::size_t>(key)];
+            if (++x == codedWidth) {
+                x = 0;
+                ++y;
+            }
+        }
+    }
+
+    for (std::size_t i = transforms.size(); i-- > 0;) {
+        applyInverseTransform(transforms[i], pixels, height);
+    }
+    return pixels;
+}
+
+// Finds the VP8L payload in a RIFF WebP file; returns false for lossy (VP8)
+// images.
+bool findLosslessPayload(const std::uint8_t* bytes, std::size_t size, const std::uint8_t*& payload, std::size_t& payloadSize) {
+    if (size < 12 || std::memcmp(bytes, "RIFF", 4) != 0 || std::memcmp(bytes + 8, "WEBP", 4) != 0) {
+        throw std::runtime_error("Not a WebP file");
+    }
+    const std::size_t end = std::min<std::size_t>(size, 8 + static_cast<std::size_t>(readU32LE(bytes + 4)));
+    std::size_t pos = 12;
+    while (pos + 8 <= end) {
+        const std::uint8_t* chunk = bytes + pos;
+        const std::size_t chunkSize = readU32LE(chunk + 4);
+        if (chunkSize > size - pos - 8) {
+            throw std::runtime_error("Truncated WebP chunk");
+        }
+        if (std::memcmp(chunk, "VP8L", 4) == 0) {
+            payload = chunk + 8;
+            payloadSize = chunkSize;
+            return true;
+        }
+        if (std::memcmp(chunk, "VP8 ", 4) == 0) {
+            return false;
+        }
+        pos += 8 + chunkSize + (chunkSize & 1);
+    }
+    throw std::runtime_error("WebP file has no image data");
+}
+
+std::vector<std::uint32_t> decodeVP8L(const std::uint8_t* data, std::size_t size, int& width, int& height) {
+    if (size < 5 || data[0] != kVP8LSignature) {
+        throw std::runtime_error("Invalid WebP lossless header");
+    }
+    VP8LBitReader reader(data + 1, size - 1);
+    width = static_cast<int>(reader.bits(14)) + 1;
+    height = static_cast<int>(reader.bits(14)) + 1;
+    reader.bits(1);
+    if (reader.bits(3) != 0) {
+        throw std::runtime_error("Unsupported WebP lossless version");
+    }
+    if (static_cast<std::size_t>(width) * static_cast<std::size_t>(height) > kMaxImagePixels) {
+        throw std::runtime_error("Unsupported WebP dimensions");
+    }
+    return decodeImageStream(reader, width, height, true);
+}
+
+class VP8LBitWriter {
+public:
+    void put(std::uint32_t value, int count) {
+        m_bits |= static_cast<std::uint64_t>(value) << m_count;
+        m_count += count;
+        while (m_count >= 8) {
+            m_out.push_back(static_cast<std::uint8_t>(m_bits & 0xFF));
+            m_bits >>= 8;
+            m_count -= 8;
+        }
+    }
+
+    std::vector<std::uint8_t> finish() {
+        if (m_count > 0) {
+            m_out.push_back(static_cast<std::uint8_t>(m_bits & 0xFF));
+        }
+        m_bits = 0;
+        m_count = 0;
+        return std::move(m_out);
+    }
+
+private:
+    std::vector<std::uint8_t> m_out;
+    std::uint64_t m_bits = 0;
+    int m_count = 0;
+};
+
+struct PrefixEncoder {
+    std::vector<std::uint8_t> lengths;
+    std::vector<std::uint16_t> codes;
+
+    void put(VP8LBitWriter& writer, int symbol) const {
+        writer.put(codes[static_cast<std::size_t>(symbol)], lengths[static_cast<std::size_t>(symbol)]);
+    }
+};
+
+// Writes code lengths as a normal code: run-length tokens 16 (repeat the
+// previous length), 17 and 18 (runs of zeros), themselves prefix coded.
+void writeCodeLengths(VP8LBitWriter& writer, const std::vector<std::uint8_t>& lengths) {
+    struct Token {
+        std::uint8_t symbol;
+        std::uint8_t extra;
+    };
+    std::vector<Token> tokens;
+    std::size_t i = 0;
+    while (i < lengths.size()) {
+        const std::uint8_t value = lengths[i];
+        std::size_t run = 1;
+        while (i + run < lengths.size() && lengths[i + run] == value) {
+            ++run;
+        }
+        i += run;
+        if (value == 0) {
+            while (run >= 11) {
+                const std::size_t n = std::min<std::size_t>(run, 138);
+                tokens.push_back(Token{18, static_cast<std::uint8_t>(n - 11)});
+                run -= n;
+            }
+            if (run >= 3) {
+                tokens.push_back(Token{17, static_cast<std::uint8_t>(run - 3)});
+                run = 0;
+            }
+        } else {
+            tokens.push_back(Token{value, 0});
+            --run;
+            while (run >= 3) {
+                const std::size_t n = std::min<std::size_t>(run, 6);
+                tokens.push_back(Token{16, static_cast<std::uint8_t>(n - 3)});
+                run -= n;
+            }
+        }
+        while (run-- > 0) {
+            tokens.push_back(Token{value, 0});
+        }
+    }
+
+    std::vector<std::uint32_t> freqs(19, 0);
+    for (const Token& token : tokens) {
+        ++freqs[token.symbol];
+    }
+    const std::vector<std::uint8_t> tokenLengths = huffmanLengths(freqs, 7);
+    const std::vector<std::uint16_t> tokenCodes = canonicalCodes(tokenLengths);
+    int count = 19;
+    while (count > 4 && tokenLengths[kCodeLengthCodeOrder[static_cast<std::size_t>(count - 1)]] == 0) {
+        --count;
+    }
+    writer.put(0, 1);
+    writer.put(static_cast<std::uint32_t>(count - 4), 4);
+    for (int k = 0; k < count; ++k) {
+        writer.put(tokenLengths[kCodeLengthCodeOrder[static_cast<std::size_t>(k)]], 3);
+    }
+    writer.put(0, 1);
+    for (const Token& token : tokens) {
+        writer.put(tokenCodes[token.symbol], tokenLengths[token.symbol]);
+        if (token.symbol >= 16) {
+            writer.put(token.extra, token.symbol == 16 ? 2 : (token.symbol == 17 ? 3 : 7));
+        }
+    }
+}
+
+PrefixEncoder writePrefixCode(VP8LBitWriter& writer, const std::vector<std::uint32_t>& freqs) {
+    PrefixEncoder code;
+    code.lengths.assign(freqs.size(), 0);
+    code.codes.assign(freqs.size(), 0);
+    std::vector<int> used;
+    for (std::size_t i = 0; i < freqs.size() && used.size() < 3; ++i) {
+        if (freqs[i] > 0) {
+            used.push_back(static_cast<int>(i));
+        }
+    }
+    if (used.size() <= 2 && (used.empty() || used.back() < 256)) {
+        // Simple code; a lone symbol takes no bits.
+        const int first = used.empty() ? 0 : used[0];
+        writer.put(1, 1);
+        writer.put(used.size() == 2 ? 1 : 0, 1);
+        if (first < 2) {
+            writer.put(0, 1);
+            writer.put(static_cast<std::uint32_t>(first), 1);
+        } else {
+            writer.put(1, 1);
+            writer.put(static_cast<std::uint32_t>(first), 8);
+        }
+        if (used.size() == 2) {
+            writer.put(static_cast<std::uint32_t>(used[1]), 8);
+            code.lengths[static_cast<std::size_t>(used[0])] = 1;
+            code.lengths[static_cast<std::size_t>(used[1])] = 1;
+            code.codes[static_cast<std::size_t>(used[1])] = 1;
+        }
+        return code;
+    }
+    if (used.size() == 1) {
+        std::vector<std::uint8_t> lengths(freqs.size(), 0);
+        lengths[static_cast<std::size_t>(used[0])] = 1;
+        writeCodeLengths(writer, lengths);
+        return code;
+    }
+    code.lengths = huffmanLengths(freqs, 15);
+    code.codes = canonicalCodes(code.lengths);
+    writeCodeLengths(writer, code.lengths);
+    return code;
+}
+
+// A run of literal pixels (distance 0) or a copy of length pixels from the
+// given distance code.
+struct PixelToken {
+    std::uint32_t length;
+    std::uint32_t distanceCode;
+};
+
+// Distance codes up to 120 stand for nearby pixels in the previous rows.
+std::uint32_t distanceToPlaneCode(std::size_t distance, int width) {
+    static const std::array<std::uint8_t, 128> planeCodes = [] {
+        std::array<std::uint8_t, 128> codes{};
+        for (int i = 0; i < 120; ++i) {
+            codes[static_cast<std::size_t>(kDistanceMap[i][1] * 16 + 8 - kDistanceMap[i][0])] = static_cast<std::uint8_t>(i + 1);
+        }
+        return codes;
+    }();
+    const std::size_t w = static_cast<std::size_t>(width);
+    const std::size_t dy = distance / w;
+    const std::size_t dx = distance - dy * w;
+    if (dx <= 8 && dy < 8) {
+        return planeCodes[dy * 16 + 8 - dx];
+    }
+    if (dx > w - 8 && dy < 7) {
+        return planeCodes[(dy + 1) * 16 + 8 + (w - dx)];
+    }
+    return static_cast<std::uint32_t>(distance + 120);
+}
+
+// Greedy LZ77 over pixels. The pixel to the left and the one above are
+// tried first, then a hash chain over pixel pairs.
+std::vector<PixelToken> parsePixelCopies(const std::vector<std::uint32_t>& pixels, int width) {
+    const std::size_t count = pixels.size();
+    std::vector<PixelToken> tokens;
+    std::vector<std::int32_t> head(std::size_t(1) << kCopyHashBits, -1);
+    std::vector<std::int32_t> chain(std::min(count, kCopyWindow), -1);
+    const std::size_t chainMask = kCopyWindow - 1;
+    const auto hashAt = [&pixels](std::size_t p) {
+        return ((pixels[p] * kColorCacheMultiplier) ^ (pixels[p + 1] * 0x9E3779B1u)) >> (32 - kCopyHashBits);
+    };
+    const auto insert = [&](std::size_t p) {
+        if (p + 1 < count) {
+            const std::uint32_t h = hashAt(p);
+            chain[p & chainMask] = head[h];
+            head[h] = static_cast<std::int32_t>(p);
+        }
+    };
+    const auto matchLength = [&pixels](std::size_t a, std::size_t b, std::size_t limit) {
+        std::size_t n = 0;
+        while (n < limit && pixels[a + n] == pixels[b + n]) {
+            ++n;
+        }
+        return n;
+    };
+
+    std::uint32_t literals = 0;
+    std::size_t pos = 0;
+    while (pos < count) {
+        const std::size_t limit = std::min(kMaxCopyLength, count - pos);
+        std::size_t bestLength = 0;
+        std::size_t bestDistance = 0;
+        if (limit >= kMinCopyLength) {
+            const std::size_t nearby[2] = {1, static_cast<std::size_t>(width)};
+            for (std::size_t distance : nearby) {
+                if (distance <= pos) {
+                    const std::size_t length = matchLength(pos - distance, pos, limit);
+                    if (length > bestLength) {
+                        bestLength = length;
+                        bestDistance = distance;
+                    }
+                }
+            }
+            std::int32_t candidate = head[hashAt(pos)];
+            for (int steps = 0; candidate >= 0 && steps < kMaxCopyChain && bestLength < limit; ++steps) {
+                const std::size_t c = static_cast<std::size_t>(candidate);
+                if (pos - c > kMaxCopyDistance) {
+                    break;
+                }
+                if (pixels[c + bestLength] == pixels[pos + bestLength]) {
+                    const std::size_t length = matchLength(c, pos, limit);
+                    if (length > bestLength) {
+                        bestLength = length;
+                        bestDistance = pos - c;
+                    }
+                }
+                candidate = chain[c & chainMask];
+            }
+        }
+        if (bestLength >= kMinCopyLength) {
+            if (literals > 0) {
+                tokens.push_back(PixelToken{literals, 0});
+                literals = 0;
+            }
+            tokens.push_back(PixelToken{static_cast<std::uint32_t>(bestLength), distanceToPlaneCode(bestDistance, width)});
+            for (std::size_t end = pos + bestLength; pos < end; ++pos) {
+                insert(pos);
+            }
+        } else {
+            insert(pos);
+            ++literals;
+            ++pos;
+        }
+    }
+    if (literals > 0) {
+        tokens.push_back(PixelToken{literals, 0});
+    }
+    return tokens;
+}
+
+// Replays the parse against a color cache of cacheBits (0 for none),
+// calling literal(pixel, cacheKey) with cacheKey -1 on a miss and
+// copy(token) for every copy.
+template <typename Literal, typename Copy>
+void replayTokens(const std::vector<std::uint32_t>& pixels, const std::vector<PixelToken>& tokens, int cacheBits, Literal literal, Copy copy) {
+    std::vector<std::uint32_t> cache(cacheBits > 0 ? std::size_t(1) << cacheBits : 0, 0);
+    std::vector<std::uint8_t> filled(cache.size(), 0);
+    std::size_t pos = 0;
+    const auto remember = [&](std::uint32_t argb) {
+        const std::uint32_t key = colorCacheKey(argb, cacheBits);
+        cache[key] = argb;
+        filled[key] = 1;
+    };
+    for (const PixelToken& token : tokens) {
+        if (token.distanceCode == 0) {
+            for (std::uint32_t i = 0; i < token.length; ++i) {
+                const std::uint32_t argb = pixels[pos++];
+                int key = -1;
+                if (cacheBits > 0) {
+                    const std::uint32_t k = colorCacheKey(argb, cacheBits);
+                    if (filled[k] != 0 && cache[k] == argb) {
+                        key = static_cast<int>(k);
+                    }
+                    remember(argb);
+                }
+                literal(argb, key);
+            }
+        } else {
+            copy(token);
+            if (cacheBits > 0) {
+                for (std::uint32_t i = 0; i < token.length; ++i) {
+                    remember(pixels[pos + i]);
+                }
+            }
+            pos += token.length;
+        }
+    }
+}
+
+struct PixelHistogram {
+    std::array<std::vector<std::uint32_t>, 5> freqs;
+
+    explicit PixelHistogram(int cacheBits) {
+        freqs[0].assign(static_cast<std::size_t>(256 + kNumLengthCodes + (cacheBits > 0 ? 1 << cacheBits : 0)), 0);
+        freqs[1].assign(256, 0);
+        freqs[2].assign(256, 0);
+        freqs[3].assign(256, 0);
+        freqs[4].assign(kNumDistanceCodes, 0);
+    }
+
+    // Entropy of the symbols plus a rough allowance for the code lengths.
+    double cost() const {
+        double bits = 0.0;
+        for (const std::vector<std::uint32_t>& histogram : freqs) {
+            std::uint64_t total = 0;
+            for (std::uint32_t f : histogram) {
+                total += f;
+            }
+            for (std::uint32_t f : histogram) {
+                if (f > 0) {
+                    bits += static_cast<double>(f) * std::log2(static_cast<double>(total) / static_cast<double>(f)) + 5.0;
+                }
+            }
+        }
+        return bits;
+    }
+};
+
+PixelHistogram buildHistogram(const std::vector<std::uint32_t>& pixels, const std::vector<PixelToken>& tokens, int cacheBits) {
+    PixelHistogram histogram(cacheBits);
+    replayTokens(
+        pixels, tokens, cacheBits,
+        [&](std::uint32_t argb, int key) {
+            if (key >= 0) {
+                ++histogram.freqs[0][static_cast<std::size_t>(256 + kNumLengthCodes + key)];
+                return;
+            }
+            ++histogram.freqs[0][static_cast<std::size_t>(channel(argb, 8))];
+            ++histogram.freqs[1][static_cast<std::size_t>(channel(argb, 16))];
+            ++histogram.freqs[2][static_cast<std::size_t>(channel(argb, 0))];
+            ++histogram.freqs[3][static_cast<std::size_t>(channel(argb, 24))];
+        },
+        [&](const PixelToken& token) {
+            int symbol = 0;
+            int extraBits = 0;
+            std::uint32_t extraValue = 0;
+            prefixEncode(token.length, symbol, extraBits, extraValue);
+            ++histogram.freqs[0][static_cast<std::size_t>(256 + symbol)];
+            prefixEncode(token.distanceCode, symbol, extraBits, extraValue);
+            ++histogram.freqs[4][static_cast<std::size_t>(symbol)];
+        });
+    return histogram;
+}
+
+// Entropy-codes an image with one group of prefix codes. The top-level
+// image signals that it has no meta prefix image; sub-images skip the cache.
+void writeImageData(VP8LBitWriter& writer, const std::vector<std::uint32_t>& pixels, int width, bool topLevel) {
+    const std::vector<PixelToken> tokens = parsePixelCopies(pixels, width);
+    int cacheBits = 0;
+    PixelHistogram histogram = buildHistogram(pixels, tokens, 0);
+    if (topLevel) {
+        double bestCost = histogram.cost();
+        for (int bits : {4, 7, 10}) {
+            PixelHistogram candidate = buildHistogram(pixels, tokens, bits);
+            const double cost = candidate.cost();
+            if (cost < bestCost) {
+                bestCost = cost;
+                cacheBits = bits;
+                histogram = std::move(candidate);
+            }
+        }
+    }
+
+    if (cacheBits > 0) {
+        writer.put(1, 1);
+        writer.put(static_cast<std::uint32_t>(cacheBits), 4);
+    } else {
+        writer.put(0, 1);
+    }
+    if (topLevel) {
+        writer.put(0, 1);
+    }
+    std::array<PrefixEncoder, 5> codes;
+    for (std::size_t i = 0; i < codes.size(); ++i) {
+        codes[i] = writePrefixCode(writer, histogram.freqs[i]);
+    }
+
+    replayTokens(
+        pixels, tokens, cacheBits,
+        [&](std::uint32_t argb, int key) {
+            if (key >= 0) {
+                codes[0].put(writer, 256 + kNumLengthCodes + key);
+                return;
+            }
+            codes[0].put(writer, channel(argb, 8));
+            codes[1].put(writer, channel(argb, 16));
+            codes[2].put(writer, channel(argb, 0));
+            codes[3].put(writer, channel(argb, 24));
+        },
+        [&](const PixelToken& token) {
+            int symbol = 0;
+            int extraBits = 0;
+            std::uint32_t extraValue = 0;
+            prefixEncode(token.length, symbol, extraBits, extraValue);
+            codes[0].put(writer, 256 + symbol);
+            writer.put(extraValue, extraBits);
+            prefixEncode(token.distanceCode, symbol, extraBits, extraValue);
+            codes[4].put(writer, symbol);
+            writer.put(extraValue, extraBits);
+        });
+}
+
+// Collects up to 256 distinct colors in ascending order; false if there
+// are more.
+bool collectPalette(const std::vector<std::uint32_t>& argb, std::vector<std::uint32_t>& palette) {
+    constexpr std::size_t kSlots = 1024;
+    std::array<std::uint32_t, kSlots> slots{};
+    std::array<std::uint8_t, kSlots> used{};
+    palette.clear();
+    std::uint32_t last = 0;
+    bool haveLast = false;
+    for (std::uint32_t color : argb) {
+        if (haveLast && color == last) {
+            continue;
+        }
+        last = color;
+        haveLast = true;
+        std::size_t slot = colorCacheKey(color, 10);
+        while (used[slot] != 0 && slots[slot] != color) {
+            slot = (slot + 1) & (kSlots - 1);
+        }
+        if (used[slot] == 0) {
+            if (palette.size() == 256) {
+                return false;
+            }
+            used[slot] = 1;
+            slots[slot] = color;
+            palette.push_back(color);
+        }
+    }
+    std::sort(palette.begin(), palette.end());
+    return true;
+}
+
+// Step 1 << bits has to divide 256 so quantized residuals stay multiples of
+// it after wrapping.
+int nearLosslessBits(int quality) {
+    return (100 - std::clamp(quality, 0, 100) + 19) / 20;
+}
+
+// The value closest to target that differs from base by a multiple of step
+// and stays within 0..255.
+int quantizeTowards(int base, int target, int step) {
+    const int difference = target - base;
+    int q = (std::abs(difference) + step / 2) / step * step;
+    if (difference < 0) {
+        q = -q;
+    }
+    int value = base + q;
+    if (value > 255) {
+        value -= step;
+    } else if (value < 0) {
+        value += step;
+    }
+    return value;
+}
+
+// Picks each block's predictor by the smallest sum of residual magnitudes.
+std::vector<std::uint32_t> choosePredictors(const std::vector<std::uint32_t>& pixels, int width, int height) {
+    const int blocksX = subSampleSize(width, kPredictorBits);
+    const int blocksY = subSampleSize(height, kPredictorBits);
+    std::vector<std::uint32_t> modes(static_cast<std::size_t>(blocksX) * static_cast<std::size_t>(blocksY));
+    const int blockSize = 1 << kPredictorBits;
+    for (int by = 0; by < blocksY; ++by) {
+        for (int bx = 0; bx < blocksX; ++bx) {
+            const int x0 = bx * blockSize;
+            const int y0 = by * blockSize;
+            const int x1 = std::min(width, x0 + blockSize);
+            const int y1 = std::min(height, y0 + blockSize);
+            int bestMode = 1;
+            std::uint64_t bestCost = std::numeric_limits<std::uint64_t>::max();
+            for (int mode = 1; mode <= 13; ++mode) {
+                std::uint64_t cost = 0;
+                for (int y = std::max(1, y0); y < y1 && cost < bestCost; ++y) {
+                    const std::uint32_t* row = pixels.data() + static_cast<std::size_t>(y) * static_cast<std::size_t>(width);
+                    for (int x = std::max(1, x0); x < x1; ++x) {
+                        const std::uint32_t residual = subPixels(row[x], predictPixel(mode, row[x - 1], row + x - width));
+                        for (int shift = 0; shift < 32; shift += 8) {
+                            cost += static_cast<std::uint64_t>(std::abs(static_cast<int>(static_cast<std::int8_t>(residual >> shift))));
+                        }
+                    }
+                }
+                if (cost < bestCost) {
+                    bestCost = cost;
+                    bestMode = mode;
+                }
+            }
+            modes[static_cast<std::size_t>(by) * static_cast<std::size_t>(blocksX) + static_cast<std::size_t>(bx)] =
+                0xFF000000u | (static_cast<std::uint32_t>(bestMode) << 8);
+        }
+    }
+    return modes;
+}
+
+// Whether the pixel repeats one of its four neighbours; such flat areas
+// are kept exact so runs and copies survive near-lossless coding.
+bool isFlatPixel(const std::vector<std::uint32_t>& pixels, int width, int height, int x, int y) {
+    const std::size_t i = static_cast<std::size_t>(y) * static_cast<std::size_t>(width) + static_cast<std::size_t>(x);
+    const std::uint32_t value = pixels[i];
+    return (x > 0 && pixels[i - 1] == value) || (x + 1 < width && pixels[i + 1] == value) ||
+           (y > 0 && pixels[i - static_cast<std::size_t>(width)] == value) ||
+           (y + 1 < height && pixels[i + static_cast<std::size_t>(width)] == value);
+}
+
+// Predictor residuals of the green-subtracted image. With quantBits set,
+// each pixel outside flat areas is first moved to the nearest value whose
+// residual is a multiple of the step; alpha stays exact. Later predictions
+// then use the moved pixels, as the decoder will.
+std::vector<std::uint32_t> predictorResiduals(std::vector<std::uint32_t>& pixels,
+                                              const std::vector<std::uint32_t>& modes,
+                                              int width,
+                                              int height,
+                                              int quantBits) {
+    const int blocksX = subSampleSize(width, kPredictorBits);
+    const int step = 1 << quantBits;
+    const std::vector<std::uint32_t> source = quantBits > 0 ? pixels : std::vector<std::uint32_t>();
+    std::vector<std::uint32_t> residuals(pixels.size());
     for (int y = 0; y < height; ++y) {
+        std::uint32_t* row = pixels.data() + static_cast<std::size_t>(y) * static_cast<std::size_t>(width);
+        std::uint32_t* out = residuals.data() + static_cast<std::size_t>(y) * static_cast<std::size_t>(width);
+        const std::uint32_t* blockModes = modes.data() + static_cast<std::size_t>(y >> kPredictorBits) * static_cast<std::size_t>(blocksX);
         for (int x = 0; x < width; ++x) {
-            image.setPixel(x, y, Color(bytes[byteIndex], bytes[byteIndex + 1], bytes[byteIndex + 2]));
-            byteIndex += 3;
+            const int mode = static_cast<int>((blockModes[x >> kPredictorBits] >> 8) & 0xF);
+            const std::uint32_t prediction = predictAt(pixels.data(), width, x, y, mode);
+            if (quantBits > 0 && !isFlatPixel(source, width, height, x, y)) {
+                const std::uint32_t s = row[x];
+                const int green = quantizeTowards(channel(prediction, 8), channel(s, 8), step);
+                const int red = quantizeTowards((channel(prediction, 16) + green) & 0xFF, (channel(s, 16) + channel(s, 8)) & 0xFF, step);
+                const int blue = quantizeTowards((channel(prediction, 0) + green) & 0xFF, (channel(s, 0) + channel(s, 8)) & 0xFF, step);
+                row[x] = (s & 0xFF000000u) | (static_cast<std::uint32_t>((red - green) & 0xFF) << 16) |
+                         (static_cast<std::uint32_t>(green) << 8) | static_cast<std::uint32_t>((blue - green) & 0xFF);
+            }
+            out[x] = subPixels(row[x], prediction);
+        }
+    }
+    return residuals;
+}
+
+// Images with up to 256 colors are stored as palette indices, packed
+// several to a pixel when the palette is small; others are green-subtracted
+// and predicted per 16x16 block.
+std::vector<std::uint8_t> encodeVP8L(const PixelRows& pixels, const WEBPSaveOptions& options) {
+    const int width = pixels.width;
+    const int height = pixels.height;
+    std::vector<std::uint32_t> argb(static_cast<std::size_t>(width) * static_cast<std::size_t>(height));
+    bool hasAlpha = false;
+    for (int y = 0; y < height; ++y) {
+        const std::uint8_t* src = pixels.row(y);
+        std::uint32_t* dst = argb.data() + static_cast<std::size_t>(y) * static_cast<std::size_t>(width);
+        for (int x = 0; x < width; ++x, src += pixels.channels) {
+            const std::uint32_t alpha = pixels.channels == 4 ? src[3] : 255u;
+            hasAlpha = hasAlpha || alpha != 255;
+            dst[x] = (alpha << 24) | (static_cast<std::uint32_t>(src[0]) << 16) | (static_cast<std::uint32_t>(src[1]) << 8) | src[2];
         }
     }
 
-    return image;
+    VP8LBitWriter writer;
+    writer.put(kVP8LSignature, 8);
+    writer.put(static_cast<std::uint32_t>(width - 1), 14);
+    writer.put(static_cast<std::uint32_t>(height - 1), 14);
+    writer.put(hasAlpha ? 1 : 0, 1);
+    writer.put(0, 3);
+
+    std::vector<std::uint32_t> palette;
+    if (collectPalette(argb, palette)) {
+        writer.put(1, 1);
+        writer.put(kColorIndexingTransform, 2);
+        writer.put(static_cast<std::uint32_t>(palette.size() - 1), 8);
+        std::vector<std::uint32_t> deltas(palette.size());
+        for (std::size_t i = 0; i < palette.size(); ++i) {
+            deltas[i] = i == 0 ? palette[0] : subPixels(palette[i], palette[i - 1]);
+        }
+        writeImageData(writer, deltas, static_cast<int>(deltas.size()), false);
+
+        const int bits = palette.size() > 16 ? 0 : (palette.size() > 4 ? 1 : (palette.size() > 2 ? 2 : 3));
+        const int packedWidth = subSampleSize(width, bits);
+        const int bitsPerIndex = 8 >> bits;
+        std::vector<std::uint32_t> packed(static_cast<std::size_t>(packedWidth) * static_cast<std::size_t>(height), 0xFF000000u);
+        std::uint32_t lastColor = palette[0];
+        std::uint32_t lastIndex = 0;
+        for (int y = 0; y < height; ++y) {
+            for (int x = 0; x < width; ++x) {
+                const std::uint32_t color = argb[static_cast<std::size_t>(y) * static_cast<std::size_t>(width) + static_cast<std::size_t>(x)];
+                if (color != lastColor) {
+                    lastColor = color;
+                    lastIndex = static_cast<std::uint32_t>(std::lower_bound(palette.begin(), palette.end(), color) - palette.begin());
+                }
+                packed[static_cast<std::size_t>(y) * static_cast<std::size_t>(packedWidth) + static_cast<std::size_t>(x >> bits)] |=
+                    lastIndex << (8 + bitsPerIndex * (x & ((1 << bits) - 1)));
+            }
+        }
+        writer.put(0, 1);
+        writeImageData(writer, packed, packedWidth, true);
+        return writer.finish();
+    }
+
+    writer.put(1, 1);
+    writer.put(kSubtractGreenTransform, 2);
+    for (std::uint32_t& value : argb) {
+        const std::uint32_t green = (value >> 8) & 0xFF;
+        value = subPixels(value, (green << 16) | green);
+    }
+    const std::vector<std::uint32_t> modes = choosePredictors(argb, width, height);
+    writer.put(1, 1);
+    writer.put(kPredictorTransform, 2);
+    writer.put(kPredictorBits - 2, 3);
+    writeImageData(writer, modes, subSampleSize(width, kPredictorBits), false);
+    writer.put(0, 1);
+    const int quantBits = nearLosslessBits(options.quality);
+    if (quantBits == 0) {
+        writeImageData(writer, predictorResiduals(argb, modes, width, height, 0), width, true);
+        return writer.finish();
+    }
+
+    // Rounding can cost more than it saves on synthetic art, so the exact
+    // coding is kept whenever it comes out smaller.
+    VP8LBitWriter exactWriter = writer;
+    std::vector<std::uint32_t> exact = argb;
+    writeImageData(writer, predictorResiduals(argb, modes, width, height, quantBits), width, true);
+    writeImageData(exactWriter, predictorResiduals(exact, modes, width, height, 0), width, true);
+    std::vector<std::uint8_t> nearLossless = writer.finish();
+    std::vector<std::uint8_t> lossless = exactWriter.finish();
+    return lossless.size() <= nearLossless.size() ? lossless : nearLossless;
+}
+
+void decodeLossless(const std::uint8_t* payload, std::size_t size, const PixelTarget& target) {
+    int width = 0;
+    int height = 0;
+    const std::vector<std::uint32_t> argb = decodeVP8L(payload, size, width, height);
+    std::uint8_t* out = target.allocate(width, height);
+    const int channels = target.channels;
+    for (const std::uint32_t pixel : argb) {
+        out[0] = static_cast<std::uint8_t>(pixel >> 16);
+        out[1] = static_cast<std::uint8_t>(pixel >> 8);
+        out[2] = static_cast<std::uint8_t>(pixel);
+        if (channels == 4) {
+            out[3] = static_cast<std::uint8_t>(pixel >> 24);
+        }
+        out += channels;
+    }
+}
+
+// Lossy (VP8) images still go through dwebp.
+void decodeLossy(const std::string& filename, const PixelTarget& target) {
+    const std::string dwebpPath = findInPath("dwebp");
+    if (dwebpPath.empty()) {
+        throw std::runtime_error("Decoding lossy WebP requires dwebp in PATH: " + filename);
+    }
+
+    TempPathGuard tempPPM(createSecureTempFilename(".ppm"));
+    const int rc = runProcess(dwebpPath, {"-quiet", "-ppm", filename, "-o", tempPPM.path()});
+    if (rc != 0) {
+        throw std::runtime_error("Failed to decode WebP file: " + filename);
+    }
+    readPPM(tempPPM.path(), target);
 }
 
 } // namespace
@@ -237,44 +1513,76 @@ void WEBPImage::setPixel(int x, int y, const Color& color) {
 }
 
 bool WEBPImage::isToolingAvailable() {
-    return !findInPath("cwebp").empty() && !findInPath("dwebp").empty();
+    return !findInPath("dwebp").empty();
 }
 
-bool WEBPImage::save(const std::string& filename) const {
-    if (m_width <= 0 || m_height <= 0 || !isToolingAvailable()) {
+bool WEBPImage::save(const std::string& filename, const WEBPSaveOptions& options) const {
+    if (m_width <= 0 || m_height <= 0) {
         return false;
     }
+    return saveRows(filename, colorRows(m_pixels.data(), m_width, m_height), options);
+}
 
-    const std::string cwebpPath = findInPath("cwebp");
-    if (cwebpPath.empty()) {
+bool WEBPImage::saveRows(const std::string& filename, const PixelRows& pixels, const WEBPSaveOptions& options) {
+    if (pixels.width <= 0 || pixels.height <= 0 || pixels.width > kMaxVP8LDimension || pixels.height > kMaxVP8LDimension) {
         return false;
     }
 
-    TempPathGuard tempPPM(createSecureTempFilename(".ppm"));
-    if (!writePPM(tempPPM.path(), m_width, m_height, m_pixels)) {
+    const std::vector<std::uint8_t> payload = encodeVP8L(pixels, options);
+    std::vector<std::uint8_t> header = {'R', 'I', 'F', 'F'};
+    const std::size_t padded = payload.size() + (payload.size() & 1);
+    writeU32LE(header, static_cast<std::uint32_t>(4 + 8 + padded));
+    header.insert(header.end(), {'W', 'E', 'B', 'P', 'V', 'P', '8', 'L'});
+    writeU32LE(header, static_cast<std::uint32_t>(payload.size()));
+
+    std::ofstream out(filename, std::ios::binary);
+    if (!out) {
         return false;
     }
-
-    const int rc = runProcess(cwebpPath, {"-quiet", "-lossless", tempPPM.path(), "-o", filename});
-    return rc == 0;
+    out.write(reinterpret_cast<const char*>(header.data()), static_cast<std::streamsize>(header.size()));
+    out.write(reinterpret_cast<const char*>(payload.data()), static_cast<std::streamsize>(payload.size()));
+    if ((payload.size() & 1) != 0) {
+        out.put('\0');
+    }
+    return static_cast<bool>(out);
 }
 
 WEBPImage WEBPImage::load(const std::string& filename) {
-    if (!isToolingAvailable()) {
-        throw std::runtime_error("WebP support requires cwebp and dwebp tools installed");
+    std::ifstream in(filename, std::ios::binary);
+    if (!in) {
+        throw std::runtime_error("Cannot open WebP file: " + filename);
     }
-
-    const std::string dwebpPath = findInPath("dwebp");
-    if (dwebpPath.empty()) {
-        throw std::runtime_error("Cannot find dwebp in PATH");
+    const std::vector<std::uint8_t> bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    WEBPImage image;
+    const PixelTarget target{3, [&image](int width, int height) {
+                                 image = WEBPImage(width, height);
+                                 return reinterpret_cast<std::uint8_t*>(image.m_pixels.data());
+                             }};
+    const std::uint8_t* payload = nullptr;
+    std::size_t payloadSize = 0;
+    if (findLosslessPayload(bytes.data(), bytes.size(), payload, payloadSize)) {
+        decodeLossless(payload, payloadSize, target);
+    } else {
+        decodeLossy(filename, target);
     }
+    return image;
+}
 
-    TempPathGuard tempPPM(createSecureTempFilename(".ppm"));
-    const int rc = runProcess(dwebpPath, {"-quiet", "-ppm", filename, "-o", tempPPM.path()});
-    if (rc != 0) {
-        throw std::runtime_error("Failed to decode WebP file: " + filename);
+void WEBPImage::decode(const std::uint8_t* data, std::size_t size, const PixelTarget& target) {
+    const std::uint8_t* payload = nullptr;
+    std::size_t payloadSize = 0;
+    if (findLosslessPayload(data, size, payload, payloadSize)) {
+        decodeLossless(payload, payloadSize, target);
+        return;
     }
-
-    WEBPImage decoded = readPPM(tempPPM.path());
-    return decoded;
+    // dwebp only reads files, so lossy data is spooled to one first.
+    TempPathGuard tempWebP(createSecureTempFilename(".webp"));
+    {
+        std::ofstream out(tempWebP.path(), std::ios::binary);
+        out.write(reinterpret_cast<const char*>(data), static_cast<std::streamsize>(size));
+        if (!out) {
+            throw std::runtime_error("Failed to write temporary WebP file");
+        }
+    }
+    decodeLossy(tempWebP.path(), target);
 }
@@ -3,9 +3,18 @@
 
 #include "image.h"
 
+#include <cstddef>
+#include <cstdint>
 #include <string>
 #include <vector>
 
+// Files are written as lossless WebP (VP8L) with alpha. Quality below 100
+// turns on near-lossless coding: predictor residuals are rounded to a
+// coarser step (up to 32 at quality 0) before entropy coding.
+struct WEBPSaveOptions {
+    int quality = 100;
+};
+
 class WEBPImage : public RasterImage {
 public:
     WEBPImage();
@@ -18,8 +27,12 @@ public:
     const Color& getPixel(int x, int y) const override;
     void setPixel(int x, int y, const Color& color) override;
 
-    bool save(const std::string& filename) const;
+    bool save(const std::string& filename, const WEBPSaveOptions& options = WEBPSaveOptions()) const;
+    static bool saveRows(const std::string& filename, const PixelRows& pixels, const WEBPSaveOptions& options = WEBPSaveOptions());
+    // Lossless files decode in process; lossy (VP8) files need dwebp.
     static WEBPImage load(const std::string& filename);
+    // RGBA targets keep lossless alpha; lossy images decode opaque.
+    static void decode(const std::uint8_t* data, std::size_t size, const PixelTarget& target);
     static bool isToolingAvailable();
 
 private: